@@ -282,10 +282,16 @@ static void map_table(struct sdt_header const * const table) {
     // The goal here is to id map the table, however to this end we need to know
     // its length first. Therefore with first map the header bytes, read the
     // length, and then map the rest.
-    if (!paging_map(table, table, sizeof(*table), 0) || 
-        !paging_map(table, table, table->length, 0)) {
+    // Both mappings are done in the same batch so that the TLB is only
+    // invalidated once. The header page was not mapped before the first call,
+    // hence it can be read before committing the batch.
+    struct paging_batch batch;
+    paging_batch_begin(&batch, get_curr_addr_space());
+    if (!paging_batch_map(&batch, table, table, sizeof(*table), 0) ||
+        !paging_batch_map(&batch, table, table, table->length, 0)) {
         PANIC("Cannot map table in ACPI parser\n");
     }
+    paging_batch_commit(&batch);
 }
 
 static void unmap_table(struct sdt_header const * const table) {
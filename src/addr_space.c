@@ -1,23 +1,39 @@
 #include <addr_space.h>
 #include <debug.h>
+#include <memstat.h>
 #include <kmalloc.h>
 #include <frame_alloc.h>
 #include <paging.h>
 #include <acpi.h>
 #include <error.h>
 #include <sched.h>
+#include <memory.h>
+#include <vfs.h>
+#include <page_cache.h>
+#include <ipm.h>
 
 // The kernel's address space needs to be statically allocated since it will be
 // used even before dynamic allocation is setup.
 struct addr_space KERNEL_ADDR_SPACE = {
     .lock = INIT_SPINLOCK(),
     .page_dir_phy_addr = NULL,
+    .segments = {&KERNEL_ADDR_SPACE.segments, &KERNEL_ADDR_SPACE.segments},
 };
 
 // Each cpu has the curr_addr_space variable which contains a pointer to the
 // struct addr_space associated with the address space that it is currently
 // using.
 DECLARE_PER_CPU(struct addr_space *, curr_addr_space);
+// Indicate if the curr_addr_space of a cpu is borrowed by the kernel process it
+// is running. See "Lazy address space switching" in addr_space.h.
+DECLARE_PER_CPU(bool, addr_space_borrowed);
+
+// The list of all address spaces created with create_new_addr_space().
+static struct list_node ADDR_SPACES = {&ADDR_SPACES, &ADDR_SPACES};
+// Lock protecting the ADDR_SPACES list. Held while the page directory of a new
+// address space is initialized, so that addr_space_for_each() either sees the
+// new address space or runs entirely before its page directory is initialized.
+static DECLARE_SPINLOCK(ADDR_SPACES_LOCK);
 
 struct addr_space *get_curr_addr_space(void) {
     preempt_disable();
@@ -35,11 +51,71 @@ void switch_to_addr_space(struct addr_space * const addr_space) {
     cpu_set_interrupt_flag(false);
 
     this_cpu_var(curr_addr_space) = addr_space;
+    this_cpu_var(addr_space_borrowed) = false;
     cpu_set_cr3(addr_space->page_dir_phy_addr);
 
     cpu_set_interrupt_flag(irqs);
 }
 
+void switch_to_proc_addr_space(struct addr_space * const addr_space,
+                               bool const borrow) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+
+    struct addr_space * const curr = this_cpu_var(curr_addr_space);
+    if (borrow) {
+        // Borrowing the kernel address space is the same as using it.
+        this_cpu_var(addr_space_borrowed) = curr != &KERNEL_ADDR_SPACE;
+    } else if (curr == addr_space) {
+        // The TLB of this cpu is kept coherent for the address space it uses,
+        // borrowed or not, no need to reload CR3.
+        this_cpu_var(addr_space_borrowed) = false;
+    } else {
+        switch_to_addr_space(addr_space);
+    }
+
+    cpu_set_interrupt_flag(irqs);
+}
+
+struct addr_space *enter_kernel_addr_space(void) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+
+    struct addr_space * const curr = this_cpu_var(curr_addr_space);
+    bool const borrowed = this_cpu_var(addr_space_borrowed);
+    if (curr != &KERNEL_ADDR_SPACE) {
+        // This also drops the borrowed address space, if any. It is not needed
+        // by the kernel process and might get deleted before switching back.
+        switch_to_addr_space(&KERNEL_ADDR_SPACE);
+    }
+
+    cpu_set_interrupt_flag(irqs);
+    return (curr == &KERNEL_ADDR_SPACE || borrowed) ? NULL : curr;
+}
+
+void exit_kernel_addr_space(struct addr_space * const prev) {
+    if (prev) {
+        switch_to_addr_space(prev);
+    }
+}
+
+// Stop borrowing an address space on the current cpu, if it is borrowed.
+// @param addr_space: The address space to stop borrowing.
+static void drop_borrowed_addr_space(void * const addr_space) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    if (this_cpu_var(addr_space_borrowed) &&
+        this_cpu_var(curr_addr_space) == addr_space) {
+        switch_to_addr_space(&KERNEL_ADDR_SPACE);
+    }
+    cpu_set_interrupt_flag(irqs);
+}
+
+bool cpu_uses_addr_space(uint8_t const cpu,
+                         struct addr_space const * const addr_space) {
+    return cpu_var(curr_addr_space, cpu) == addr_space;
+}
+
 struct addr_space *get_kernel_addr_space(void) {
     return &KERNEL_ADDR_SPACE;
 }
@@ -77,11 +153,17 @@ struct addr_space *create_new_addr_space(void) {
         kfree(clone);
         return NULL;
     }
+    memstat_add(MEMSTAT_PAGE_TABLES, PAGE_SIZE);
 
     spinlock_init(&clone->lock);
     clone->page_dir_phy_addr = page_dir;
+    memzero(clone->pde_num_mapped, sizeof(clone->pde_num_mapped));
+    list_init(&clone->segments);
 
+    spinlock_lock(&ADDR_SPACES_LOCK);
     paging_setup_new_page_dir(clone->page_dir_phy_addr);
+    list_add_tail(&ADDR_SPACES, &clone->addr_space_list);
+    spinlock_unlock(&ADDR_SPACES_LOCK);
 
     return clone;
 }
@@ -95,20 +177,172 @@ void delete_addr_space(struct addr_space * const addr_space) {
     // Make sure that no cpu is currently using the address space. Note: For now
     // there is no guarantee that remote cpus are not trying to switch to this
     // address space. Care should be taken here FIXME.
+    // Cpus running a kernel process might still borrow the address space, make
+    // them switch to the kernel address space. An address space cannot be
+    // borrowed again once none of its processes is running.
+    preempt_disable();
+    drop_borrowed_addr_space(addr_space);
     uint32_t const ncpus = acpi_get_number_cpus();
     for (uint32_t cpu = 0; cpu < ncpus; ++cpu) {
-        struct addr_space const * const cpu_as = cpu_var(curr_addr_space, cpu);
-        if (cpu_as == addr_space) {
+        if (cpu != cpu_id() && cpu_uses_addr_space(cpu, addr_space) &&
+            cpu_var(addr_space_borrowed, cpu)) {
+            exec_remote_call(cpu, drop_borrowed_addr_space, addr_space, true);
+        }
+        if (cpu_uses_addr_space(cpu, addr_space)) {
             PANIC("Tried to delete an address space used by cpu %d\n", cpu);
         }
     }
+    preempt_enable();
+
+    spinlock_lock(&ADDR_SPACES_LOCK);
+    list_del(&addr_space->addr_space_list);
+    spinlock_unlock(&ADDR_SPACES_LOCK);
 
     paging_free_addr_space(addr_space);
 
+    while (!list_empty(&addr_space->segments)) {
+        struct vm_segment * const segment = list_first_entry(
+            &addr_space->segments, struct vm_segment, segment_list);
+        list_del(&segment->segment_list);
+        if (segment->image) {
+            segment_image_put(segment->image);
+        }
+        if (segment->file) {
+            vfs_close(segment->file);
+        }
+        kfree(segment);
+    }
+
     // Address space must _always_ be created using the create_new_addr_space()
     // which dynamically allocate the struct addr_space. The only exception is
     // KERNEL_ADDR_SPACE but this one should _never_ be deleted.
     kfree(addr_space);
 }
 
+// Insert a segment in the list of segments of an address space.
+// @param addr_space: The address space.
+// @param segment: The segment to insert, must be fully initialized.
+// @return: true on success, false if the segment overlaps an existing segment.
+static bool insert_segment(struct addr_space * const addr_space,
+                           struct vm_segment * const segment) {
+    lock_addr_space(addr_space);
+    bool const overlap = addr_space_find_segment(addr_space, segment->start,
+        segment->end);
+    if (!overlap) {
+        list_add_tail(&addr_space->segments, &segment->segment_list);
+    }
+    unlock_addr_space(addr_space);
+    return !overlap;
+}
+
+bool addr_space_add_segment(struct addr_space * const addr_space,
+                            void * const vaddr,
+                            size_t const memsz,
+                            struct file * const file,
+                            off_t const offset,
+                            size_t const filesz,
+                            uint32_t const flags) {
+    ASSERT(addr_space != &KERNEL_ADDR_SPACE);
+    ASSERT(memsz && filesz <= memsz);
+    ASSERT(flags || !filesz);
+    ASSERT(is_user_addr(vaddr) && is_user_addr(vaddr + memsz - 1));
+
+    struct vm_segment * const segment = kmalloc(sizeof(*segment));
+    if (!segment) {
+        SET_ERROR("Cannot allocate struct vm_segment", ENONE);
+        return false;
+    }
+    segment->start = get_page_addr(vaddr);
+    segment->end = get_page_addr(vaddr + memsz - 1) + PAGE_SIZE;
+    segment->data_start = vaddr;
+    segment->data_len = filesz;
+    segment->file = filesz ? file : NULL;
+    segment->offset = offset;
+    segment->flags = flags;
+    // Sharing is an optimization, the segment works without an image.
+    segment->image = segment->file && !(flags & VM_WRITE) ?
+        page_cache_get_segment_image(file, vaddr, filesz, offset) : NULL;
+
+    if (!insert_segment(addr_space, segment)) {
+        SET_ERROR("Segment overlaps another segment", ENONE);
+        if (segment->image) {
+            segment_image_put(segment->image);
+        }
+        kfree(segment);
+        return false;
+    }
+    if (segment->file) {
+        vfs_file_get(segment->file);
+    }
+    return true;
+}
+
+struct vm_segment *addr_space_find_segment(struct addr_space * const addr_space,
+                                           void const * const start,
+                                           void const * const end) {
+    ASSERT(spinlock_is_held(&addr_space->lock));
+    struct vm_segment * segment;
+    list_for_each_entry(segment, &addr_space->segments, segment_list) {
+        if (start < segment->end && segment->start < end) {
+            return segment;
+        }
+    }
+    return NULL;
+}
+
+// Copy the lazy segments of an address space into another.
+// @param src: The address space to copy the segments from.
+// @param dst: The address space to copy the segments to. Must not have any
+// segment.
+// @return: true on success, false otherwise. In case of failure, only part of
+// the segments are copied.
+static bool clone_segments(struct addr_space * const src,
+                           struct addr_space * const dst) {
+    // Segments are only added by the owner of the address space, which is busy
+    // cloning it, hence the list can be walked without the lock. This is
+    // required since kmalloc() might modify the page tables.
+    struct vm_segment * segment;
+    list_for_each_entry(segment, &src->segments, segment_list) {
+        struct vm_segment * const copy = kmalloc(sizeof(*copy));
+        if (!copy) {
+            SET_ERROR("Cannot allocate struct vm_segment", ENONE);
+            return false;
+        }
+        *copy = *segment;
+        if (copy->image) {
+            segment_image_get(copy->image);
+        }
+        if (copy->file) {
+            vfs_file_get(copy->file);
+        }
+        list_add_tail(&dst->segments, &copy->segment_list);
+    }
+    return true;
+}
+
+struct addr_space *clone_addr_space(struct addr_space * const addr_space) {
+    struct addr_space * const clone = create_new_addr_space();
+    if (!clone) {
+        return NULL;
+    }
+
+    if (!clone_segments(addr_space, clone) ||
+        !paging_clone_user_mappings(addr_space, clone)) {
+        SET_ERROR("Cannot copy user mappings to cloned address space", ENONE);
+        delete_addr_space(clone);
+        return NULL;
+    }
+    return clone;
+}
+
+void addr_space_for_each(void (*func)(struct addr_space * const, void * const),
+                         void * const arg) {
+    spinlock_lock(&ADDR_SPACES_LOCK);
+    struct addr_space * addr_space;
+    list_for_each_entry(addr_space, &ADDR_SPACES, addr_space_list) {
+        func(addr_space, arg);
+    }
+    spinlock_unlock(&ADDR_SPACES_LOCK);
+}
+
 #include <addr_space.test>
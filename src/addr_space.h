@@ -2,6 +2,12 @@
 
 #include <types.h>
 #include <spinlock.h>
+#include <list.h>
+
+struct file;
+
+// The number of PDEs in a page directory.
+#define ADDR_SPACE_NUM_PDES 1024
 
 // This struct represent the address space of a process or kernel.
 struct addr_space {
@@ -12,6 +18,54 @@ struct addr_space {
 
     // The physical address of the page directory describing this address space.
     void * page_dir_phy_addr;
+
+    // Element of the list of all the address spaces created with
+    // create_new_addr_space(). Unused for the kernel address space.
+    struct list_node addr_space_list;
+
+    // The number of pages mapped under each PDE of the page directory, a large
+    // page counts as PTES_PER_PAGE pages. This is used by the paging code to
+    // skip empty and full PDEs when looking for free virtual memory. The
+    // entries for kernel PDEs are only maintained in the kernel address space.
+    uint16_t pde_num_mapped[ADDR_SPACE_NUM_PDES];
+
+    // The list of lazy segments of this address space, see struct vm_segment.
+    // Protected by the lock of the address space.
+    struct list_node segments;
+};
+
+// Lazy segments
+// =============
+//     A lazy segment is a range of user virtual memory whose pages are only
+// allocated and mapped upon their first access, by the page fault handler. The
+// content of such a page is read from the file backing the segment, if any, the
+// remaining bytes are zeroed. This is used to load ELF binaries on demand.
+struct vm_segment {
+    // Element of the `segments` list of the address space.
+    struct list_node segment_list;
+    // The address of the first page of the segment.
+    void * start;
+    // The address of the first page after the segment.
+    void * end;
+    // The virtual address of the first byte read from the file.
+    void * data_start;
+    // The number of bytes read from the file, bytes of the segment outside of
+    // [data_start; data_start + data_len[ are zeroed.
+    size_t data_len;
+    // The file backing the segment. NULL if data_len is 0. The segment holds a
+    // reference on the file.
+    struct file * file;
+    // The offset in `file` corresponding to `data_start`.
+    off_t offset;
+    // The frames shared with the other read-only segments mapping the same
+    // data of `file`, see page_cache.h. NULL for writable segments, segments
+    // without data, or if the image could not be allocated. The segment holds
+    // a reference on the image.
+    struct segment_image * image;
+    // The flags to use when mapping the pages of the segment, see VM_* flags in
+    // paging.h. If 0, the segment is a guard area: its pages are reserved but
+    // never mapped, any access to them is a fault.
+    uint32_t flags;
 };
 
 // Get a pointer on the address space currently used by the cpu.
@@ -23,6 +77,46 @@ struct addr_space *get_curr_addr_space(void);
 // @param addr_space: The address space to switch to.
 void switch_to_addr_space(struct addr_space * const addr_space);
 
+// Lazy address space switching
+// ============================
+//     Kernel processes only access kernel mappings, which are shared by all
+// address spaces. Hence, when switching to a kernel process, the cpu keeps
+// using the address space of the previous process instead of reloading CR3 and
+// flushing the non-global TLB entries. The address space is then said to be
+// borrowed. A borrowed address space is still reported as used by the cpu (see
+// cpu_uses_addr_space()), so the cpu keeps being targeted by the TLB shootdowns
+// for that address space. Deleting an address space makes all the cpus
+// borrowing it switch to the kernel address space.
+
+// Switch to the address space of a process on the current cpu. CR3 is only
+// reloaded if the target differs from the address space currently in use.
+// @param addr_space: The address space of the process.
+// @param borrow: If true, the process only accesses kernel mappings and the
+// current address space is kept, whatever it is.
+void switch_to_proc_addr_space(struct addr_space * const addr_space,
+                               bool const borrow);
+
+// Switch to the kernel address space on the current cpu, in order to modify
+// kernel mappings.
+// @return: The address space to switch back to using
+// exit_kernel_addr_space(), NULL if there is no need to switch back.
+// Note: If the current address space is borrowed, no switch back is necessary:
+// the cpu keeps using the kernel address space.
+struct addr_space *enter_kernel_addr_space(void);
+
+// Switch back to the address space used before enter_kernel_addr_space().
+// @param prev: The value returned by enter_kernel_addr_space().
+void exit_kernel_addr_space(struct addr_space * const prev);
+
+// Check if a cpu is currently using a given address space.
+// @param cpu: The cpu to check.
+// @param addr_space: The address space.
+// @return: true if `cpu` is currently using `addr_space`, false otherwise.
+// Note: The result is only a snapshot, the remote cpu might switch address
+// space right after this function returns.
+bool cpu_uses_addr_space(uint8_t const cpu,
+                         struct addr_space const * const addr_space);
+
 // Get the struct addr_space associated with the kernel address space.
 // @return: A pointer on the struct addr_space of the kernel's address space.
 struct addr_space *get_kernel_addr_space(void);
@@ -51,10 +145,63 @@ void unlock_addr_space(struct addr_space * const addr_space);
 // space, otherwise NULL is returned.
 struct addr_space *create_new_addr_space(void);
 
+// Create a copy of an address space. The user frames are not copied, they are
+// shared copy-on-write by both address spaces, see
+// paging_clone_user_mappings().
+// @param addr_space: The address space to clone. Cannot be the kernel address
+// space.
+// @return: On success, the struct addr_space of the copy, otherwise NULL is
+// returned.
+struct addr_space *clone_addr_space(struct addr_space * const addr_space);
+
 // Delete an address space and de-allocate the physical frames it uses for its
 // page directory and page tables.
 // @param addr_space: The address space to be deleted.
 void delete_addr_space(struct addr_space * const addr_space);
 
+// Add a lazy segment to an address space.
+// @param addr_space: The address space to add the segment to. Cannot be the
+// kernel address space.
+// @param vaddr: The start address of the segment.
+// @param memsz: The size of the segment in bytes.
+// @param file: The file from which the content of the segment is read. A
+// reference is taken on the file until the address space is deleted.
+// @param offset: The offset in `file` of the content of the segment.
+// @param filesz: The number of bytes to read from `file`, the last memsz -
+// filesz bytes of the segment are zeroed. Must be <= memsz.
+// @param flags: The flags to use when mapping the pages of the segment.
+// @return: true on success, false otherwise. A segment overlapping another
+// segment of the address space cannot be added.
+// Note: The pages of the segments are reserved, they are never returned by
+// paging_find_contiguous_non_mapped_pages_in() and its callers.
+bool addr_space_add_segment(struct addr_space * const addr_space,
+                            void * const vaddr,
+                            size_t const memsz,
+                            struct file * const file,
+                            off_t const offset,
+                            size_t const filesz,
+                            uint32_t const flags);
+
+// Find a lazy segment overlapping a memory range.
+// @param addr_space: The address space to search.
+// @param start: The start address of the range.
+// @param end: The end address of the range, exclusive.
+// @return: A segment overlapping [start; end[, NULL if there is none.
+// Note: The caller must hold the lock of the address space.
+struct vm_segment *addr_space_find_segment(struct addr_space * const addr_space,
+                                           void const * const start,
+                                           void const * const end);
+
+// Call a function on each address space created with create_new_addr_space()
+// and not yet deleted. This does not include the kernel address space. New
+// address spaces cannot be created or deleted while the function is running,
+// this is used by the paging code to propagate modifications of kernel PDEs to
+// the page directory of all address spaces.
+// @param func: The function to call on each address space.
+// @param arg: The argument to pass to `func`.
+// Note: `func` is called with interrupts disabled.
+void addr_space_for_each(void (*func)(struct addr_space * const, void * const),
+                         void * const arg);
+
 // Execute tests related to address space.
 void addr_space_test(void);
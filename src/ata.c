@@ -0,0 +1,689 @@
+#include <ata.h>
+#include <disk.h>
+#include <pci.h>
+#include <cpu.h>
+#include <ioapic.h>
+#include <interrupt.h>
+#include <frame_alloc.h>
+#include <paging.h>
+#include <mutex.h>
+#include <wait_queue.h>
+#include <spinlock.h>
+#include <memory.h>
+#include <math.h>
+#include <debug.h>
+
+#define ATA_SECTOR_SIZE 512
+
+// The interrupt vectors of the channels.
+#define ATA_PRIMARY_VECTOR      37
+#define ATA_SECONDARY_VECTOR    38
+
+// The number of status reads after which a polled wait gives up.
+#define ATA_POLL_TIMEOUT    (1 << 24)
+
+// Registers of the command block, relative to the channel's I/O base.
+#define REG_DATA        0
+#define REG_SECCOUNT    2
+#define REG_LBA_LOW     3
+#define REG_LBA_MID     4
+#define REG_LBA_HIGH    5
+#define REG_DRIVE       6
+#define REG_STATUS      7
+#define REG_COMMAND     7
+
+// Bits of the device control register, in the control block.
+#define DEV_CTRL_NIEN   (1 << 1)
+
+// Bits of the status register.
+#define STATUS_ERR  (1 << 0)
+#define STATUS_DRQ  (1 << 3)
+#define STATUS_DF   (1 << 5)
+#define STATUS_BSY  (1 << 7)
+
+// ATA commands.
+#define CMD_READ_PIO            0x20
+#define CMD_READ_PIO_EXT        0x24
+#define CMD_READ_DMA            0xC8
+#define CMD_READ_DMA_EXT        0x25
+#define CMD_WRITE_PIO           0x30
+#define CMD_WRITE_PIO_EXT       0x34
+#define CMD_WRITE_DMA           0xCA
+#define CMD_WRITE_DMA_EXT       0x35
+#define CMD_CACHE_FLUSH         0xE7
+#define CMD_CACHE_FLUSH_EXT     0xEA
+#define CMD_IDENTIFY            0xEC
+
+// Registers of the bus master, relative to the channel's bus master base.
+#define BM_COMMAND  0
+#define BM_STATUS   2
+#define BM_PRDT     4
+
+// Bits of the bus master command register.
+#define BM_CMD_START    (1 << 0)
+#define BM_CMD_READ     (1 << 3)
+
+// Bits of the bus master status register. ERROR and IRQ are cleared by writing
+// 1 to them.
+#define BM_STATUS_ERROR (1 << 1)
+#define BM_STATUS_IRQ   (1 << 2)
+
+// An entry of a Physical Region Descriptor Table. A region must be word aligned
+// and must not cross a 64KiB boundary.
+struct prd {
+    // The physical address of the region.
+    uint32_t addr;
+    // The size of the region in bytes, 0 meaning 64KiB.
+    uint16_t len;
+    // PRD_EOT on the last entry of the table, 0 otherwise.
+    uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT (1 << 15)
+
+// The PRDT of a channel fills a single page, which never crosses a 64KiB
+// boundary as required by the controller.
+#define PRDT_MAX_ENTRIES    (PAGE_SIZE / sizeof(struct prd))
+
+// An IDE channel.
+struct ata_channel {
+    // The base of the command block registers.
+    uint16_t io_base;
+    // The base of the control block registers.
+    uint16_t ctrl_base;
+    // The base of the bus master registers, 0 if the channel cannot do DMA.
+    uint16_t bm_base;
+    // The ISA IRQ of the channel and the vector it is redirected to.
+    uint8_t irq;
+    uint8_t vector;
+    // Serializes the commands sent to the channel.
+    struct mutex lock;
+    // The PRDT of the channel, and its physical address.
+    struct prd * prdt;
+    void * prdt_phys;
+    // Protects the fields below, which are shared with the interrupt handler.
+    spinlock_t irq_lock;
+    // Is a DMA command in flight.
+    bool busy;
+    // Set by the interrupt handler once the DMA command is complete.
+    bool volatile done;
+    // The bus master status at the completion of the last command.
+    uint8_t bm_status;
+    // The process waiting for the completion of the command.
+    struct wait_queue wq;
+};
+
+// An ATA disk.
+struct ata_disk {
+    // The channel the disk is attached to.
+    struct ata_channel * channel;
+    // Is the disk the slave of its channel.
+    bool slave;
+    // Does the disk support 48-bit LBAs.
+    bool lba48;
+    // Can the disk be accessed with DMA.
+    bool dma;
+    // The number of sectors of the disk.
+    uint64_t num_sectors;
+};
+
+static struct ata_channel CHANNELS[2] = {
+    {
+        .io_base = 0x1F0,
+        .ctrl_base = 0x3F6,
+        .irq = 14,
+        .vector = ATA_PRIMARY_VECTOR,
+    },
+    {
+        .io_base = 0x170,
+        .ctrl_base = 0x376,
+        .irq = 15,
+        .vector = ATA_SECONDARY_VECTOR,
+    },
+};
+
+static struct ata_disk ATA_DISKS[ATA_MAX_DISKS];
+static struct disk DISKS[ATA_MAX_DISKS];
+static uint8_t NUM_DISKS = 0;
+
+// Read a command block register of a channel.
+// @param chan: The channel.
+// @param reg: The register.
+// @return: The value of the register.
+static uint8_t read_reg(struct ata_channel const * const chan,
+                        uint8_t const reg) {
+    return cpu_inb(chan->io_base + reg);
+}
+
+// Write a command block register of a channel.
+// @param chan: The channel.
+// @param reg: The register.
+// @param val: The value to write.
+static void write_reg(struct ata_channel const * const chan,
+                      uint8_t const reg,
+                      uint8_t const val) {
+    cpu_outb(chan->io_base + reg, val);
+}
+
+// Enable or disable the interrupts of the disks of a channel. Disabled when
+// polling, in which case the drive does not raise its IRQ.
+// @param chan: The channel.
+// @param enabled: Whether the interrupts should be enabled.
+static void set_drive_interrupts(struct ata_channel const * const chan,
+                                 bool const enabled) {
+    cpu_outb(chan->ctrl_base, enabled ? 0 : DEV_CTRL_NIEN);
+}
+
+// Wait for the 400ns the drive needs to update its status after a drive
+// selection, reading the alternate status register which takes ~100ns.
+// @param chan: The channel.
+static void delay_400ns(struct ata_channel const * const chan) {
+    for (uint8_t i = 0; i < 4; ++i) {
+        cpu_inb(chan->ctrl_base);
+    }
+}
+
+// Poll the status of a channel until the drive is not busy.
+// @param chan: The channel.
+// @return: The last status read, with STATUS_BSY set on timeout.
+static uint8_t wait_not_busy(struct ata_channel const * const chan) {
+    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; ++i) {
+        uint8_t const status = read_reg(chan, REG_STATUS);
+        if (!(status & STATUS_BSY)) {
+            return status;
+        }
+        cpu_pause();
+    }
+    return STATUS_BSY;
+}
+
+// Poll the status of a channel until the drive is ready to transfer data.
+// @param chan: The channel.
+// @return: true if the drive is ready, false in case of error or timeout.
+static bool wait_drq(struct ata_channel const * const chan) {
+    for (uint32_t i = 0; i < ATA_POLL_TIMEOUT; ++i) {
+        uint8_t const status = read_reg(chan, REG_STATUS);
+        if (status & (STATUS_ERR | STATUS_DF)) {
+            return false;
+        } else if (!(status & STATUS_BSY) && (status & STATUS_DRQ)) {
+            return true;
+        }
+        cpu_pause();
+    }
+    return false;
+}
+
+// Select a disk on its channel and send a command to it.
+// @param disk: The disk.
+// @param lba: The first sector of the command.
+// @param count: The number of sectors of the command, at most
+// ATA_MAX_SECTORS_PER_CMD.
+// @param cmd: The command, used with 28-bit LBAs.
+// @param cmd_ext: The equivalent command with 48-bit LBAs.
+// @return: true if the command was sent, false if the drive is stuck busy.
+static bool issue_command(struct ata_disk const * const disk,
+                          sector_t const lba,
+                          uint32_t const count,
+                          uint8_t const cmd,
+                          uint8_t const cmd_ext) {
+    ASSERT(count && count <= ATA_MAX_SECTORS_PER_CMD);
+    struct ata_channel const * const chan = disk->channel;
+    uint8_t const slave = disk->slave ? (1 << 4) : 0;
+    if (disk->lba48) {
+        write_reg(chan, REG_DRIVE, 0x40 | slave);
+    } else {
+        write_reg(chan, REG_DRIVE, 0xE0 | slave | ((lba >> 24) & 0xF));
+    }
+    delay_400ns(chan);
+    if (wait_not_busy(chan) & STATUS_BSY) {
+        return false;
+    }
+
+    if (disk->lba48) {
+        // The high bytes are written first, each register is a 2-entry FIFO.
+        write_reg(chan, REG_SECCOUNT, count >> 8);
+        write_reg(chan, REG_LBA_LOW, lba >> 24);
+        write_reg(chan, REG_LBA_MID, lba >> 32);
+        write_reg(chan, REG_LBA_HIGH, lba >> 40);
+    }
+    write_reg(chan, REG_SECCOUNT, count);
+    write_reg(chan, REG_LBA_LOW, lba);
+    write_reg(chan, REG_LBA_MID, lba >> 8);
+    write_reg(chan, REG_LBA_HIGH, lba >> 16);
+    write_reg(chan, REG_COMMAND, disk->lba48 ? cmd_ext : cmd);
+    return true;
+}
+
+// Flush the write cache of a disk. The disk's channel must be locked and its
+// interrupts disabled.
+// @param disk: The disk.
+// @return: true on success, false otherwise.
+static bool flush_cache(struct ata_disk const * const disk) {
+    struct ata_channel const * const chan = disk->channel;
+    uint8_t const slave = disk->slave ? (1 << 4) : 0;
+    write_reg(chan, REG_DRIVE, (disk->lba48 ? 0x40 : 0xE0) | slave);
+    delay_400ns(chan);
+    if (wait_not_busy(chan) & STATUS_BSY) {
+        return false;
+    }
+    write_reg(chan, REG_COMMAND,
+              disk->lba48 ? CMD_CACHE_FLUSH_EXT : CMD_CACHE_FLUSH);
+    delay_400ns(chan);
+    uint8_t const status = wait_not_busy(chan);
+    return !(status & (STATUS_BSY | STATUS_ERR | STATUS_DF));
+}
+
+// Transfer sectors with PIO. The disk's channel must be locked.
+// @param disk: The disk.
+// @param is_write: If true, write to the disk, otherwise read from it.
+// @param lba: The first sector.
+// @param count: The number of sectors, at most ATA_MAX_SECTORS_PER_CMD.
+// @param buf: The buffer to read into or the data to write.
+// @return: The number of bytes transferred.
+static size_t pio_transfer(struct ata_disk const * const disk,
+                           bool const is_write,
+                           sector_t const lba,
+                           uint32_t const count,
+                           uint8_t * const buf) {
+    struct ata_channel const * const chan = disk->channel;
+    // PIO completion is polled, the drive raises an interrupt per sector
+    // otherwise.
+    set_drive_interrupts(chan, false);
+    size_t done = 0;
+    if (issue_command(disk, lba, count,
+                      is_write ? CMD_WRITE_PIO : CMD_READ_PIO,
+                      is_write ? CMD_WRITE_PIO_EXT : CMD_READ_PIO_EXT)) {
+        for (uint32_t i = 0; i < count && wait_drq(chan); ++i) {
+            for (uint32_t j = 0; j < ATA_SECTOR_SIZE; j += 2) {
+                // The buffer might not be word aligned.
+                uint16_t word;
+                if (is_write) {
+                    memcpy(&word, buf + done + j, sizeof(word));
+                    cpu_outw(chan->io_base + REG_DATA, word);
+                } else {
+                    word = cpu_inw(chan->io_base + REG_DATA);
+                    memcpy(buf + done + j, &word, sizeof(word));
+                }
+            }
+            done += ATA_SECTOR_SIZE;
+        }
+        uint8_t const status = wait_not_busy(chan);
+        if (status & (STATUS_BSY | STATUS_ERR | STATUS_DF)) {
+            done = 0;
+        } else if (is_write && !flush_cache(disk)) {
+            done = 0;
+        }
+    }
+    set_drive_interrupts(chan, chan->bm_base);
+    return done;
+}
+
+// Describe a buffer in a PRDT.
+// @param prdt: The table to fill.
+// @param max_entries: The capacity of the table.
+// @param buf: The buffer, must be mapped in the current address space.
+// @param len: The length of the buffer in bytes.
+// @return: The number of entries used, 0 if the buffer cannot be described: its
+// address is odd, or it needs more than `max_entries` regions.
+static uint32_t build_prdt(struct prd * const prdt,
+                           uint32_t const max_entries,
+                           uint8_t const * const buf,
+                           size_t const len) {
+    if ((uint32_t)buf & 1 || !len) {
+        return 0;
+    }
+    uint32_t n = 0;
+    size_t done = 0;
+    while (done < len) {
+        uint8_t const * const vaddr = buf + done;
+        void * const paddr = paging_virt_to_phys(vaddr);
+        if (paddr == NO_FRAME) {
+            return 0;
+        }
+        // The next page is not necessarily physically contiguous.
+        uint32_t const chunk =
+            min_u32(PAGE_SIZE - ((uint32_t)vaddr % PAGE_SIZE), len - done);
+        uint32_t const addr = (uint32_t)paddr;
+        struct prd * const last = n ? prdt + n - 1 : NULL;
+        uint32_t const last_len = last ? (last->len ? last->len : 0x10000) : 0;
+        // A page never crosses a 64KiB boundary, only the extension of the
+        // previous region can.
+        if (last && last->addr + last_len == addr &&
+            (last->addr >> 16) == ((addr + chunk - 1) >> 16)) {
+            last->len = last_len + chunk;
+        } else if (n == max_entries) {
+            return 0;
+        } else {
+            prdt[n].addr = addr;
+            prdt[n].len = chunk;
+            prdt[n].flags = 0;
+            n++;
+        }
+        done += chunk;
+    }
+    prdt[n - 1].flags = PRD_EOT;
+    return n;
+}
+
+// Handle the completion of a DMA command on a channel.
+// @param chan: The channel.
+static void handle_channel_interrupt(struct ata_channel * const chan) {
+    spinlock_lock(&chan->irq_lock);
+    uint8_t const bm_status = cpu_inb(chan->bm_base + BM_STATUS);
+    if (bm_status & BM_STATUS_IRQ) {
+        // Reading the status acknowledges the interrupt of the drive, writing
+        // back the bus master status clears its IRQ and ERROR bits.
+        read_reg(chan, REG_STATUS);
+        cpu_outb(chan->bm_base + BM_STATUS, bm_status);
+        if (chan->busy) {
+            chan->busy = false;
+            chan->bm_status = bm_status;
+            chan->done = true;
+            wake_up(&chan->wq);
+        }
+    }
+    spinlock_unlock(&chan->irq_lock);
+}
+
+// Interrupt handler of the IDE channels.
+// @param frame: The interrupt frame.
+static void ata_interrupt_handler(struct interrupt_frame const * const frame) {
+    struct ata_channel * const chan =
+        frame->vector == ATA_PRIMARY_VECTOR ? CHANNELS : CHANNELS + 1;
+    handle_channel_interrupt(chan);
+}
+
+// Check if the DMA command in flight on a channel is complete.
+// @param chan: The channel.
+// @return: true if the command is complete, false otherwise.
+static bool dma_done(struct ata_channel * const chan) {
+    if (!chan->done && !interrupts_enabled()) {
+        // The interrupt cannot be delivered to this cpu, poll instead.
+        handle_channel_interrupt(chan);
+    }
+    return chan->done;
+}
+
+// Transfer sectors with DMA. The disk's channel must be locked.
+// @param disk: The disk.
+// @param is_write: If true, write to the disk, otherwise read from it.
+// @param lba: The first sector.
+// @param count: The number of sectors, at most ATA_MAX_SECTORS_PER_CMD.
+// @return: The number of bytes transferred.
+// Note: The PRDT of the channel must describe the buffer of the transfer.
+static size_t dma_transfer(struct ata_disk const * const disk,
+                           bool const is_write,
+                           sector_t const lba,
+                           uint32_t const count) {
+    struct ata_channel * const chan = disk->channel;
+    uint16_t const bm = chan->bm_base;
+    uint8_t const direction = is_write ? 0 : BM_CMD_READ;
+
+    cpu_outl(bm + BM_PRDT, (uint32_t)chan->prdt_phys);
+    cpu_outb(bm + BM_STATUS, cpu_inb(bm + BM_STATUS) |
+             BM_STATUS_ERROR | BM_STATUS_IRQ);
+    cpu_outb(bm + BM_COMMAND, direction);
+
+    spinlock_lock(&chan->irq_lock);
+    chan->done = false;
+    chan->busy = true;
+    spinlock_unlock(&chan->irq_lock);
+
+    if (!issue_command(disk, lba, count,
+                       is_write ? CMD_WRITE_DMA : CMD_READ_DMA,
+                       is_write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT)) {
+        spinlock_lock(&chan->irq_lock);
+        chan->busy = false;
+        spinlock_unlock(&chan->irq_lock);
+        return 0;
+    }
+    cpu_outb(bm + BM_COMMAND, direction | BM_CMD_START);
+    wait_event(&chan->wq, dma_done(chan));
+    cpu_outb(bm + BM_COMMAND, 0);
+
+    uint8_t const status = read_reg(chan, REG_STATUS);
+    if (chan->bm_status & BM_STATUS_ERROR ||
+        status & (STATUS_ERR | STATUS_DF)) {
+        return 0;
+    }
+    if (is_write) {
+        set_drive_interrupts(chan, false);
+        bool const flushed = flush_cache(disk);
+        set_drive_interrupts(chan, true);
+        if (!flushed) {
+            return 0;
+        }
+    }
+    return count * ATA_SECTOR_SIZE;
+}
+
+// Transfer consecutive sectors of an ATA disk.
+// @param disk: The disk.
+// @param is_write: If true, write to the disk, otherwise read from it.
+// @param start: The first sector.
+// @param count: The number of sectors.
+// @param buf: The buffer to read into or the data to write.
+// @return: The number of bytes transferred.
+static uint32_t ata_transfer(struct disk * const disk,
+                             bool const is_write,
+                             sector_t const start,
+                             uint32_t const count,
+                             uint8_t * const buf) {
+    struct ata_disk * const ata = disk->driver_private;
+    struct ata_channel * const chan = ata->channel;
+    if (start >= ata->num_sectors) {
+        return 0;
+    }
+    uint32_t const total = ata->num_sectors - start < count ?
+        ata->num_sectors - start : count;
+
+    uint32_t done = 0;
+    while (done < total) {
+        uint32_t const n = min_u32(total - done, ATA_MAX_SECTORS_PER_CMD);
+        uint8_t * const cmd_buf = buf + done * ATA_SECTOR_SIZE;
+        uint32_t const len = n * ATA_SECTOR_SIZE;
+
+        mutex_lock(&chan->lock);
+        size_t res;
+        if (ata->dma && build_prdt(chan->prdt, PRDT_MAX_ENTRIES, cmd_buf, len)) {
+            res = dma_transfer(ata, is_write, start + done, n);
+        } else {
+            res = pio_transfer(ata, is_write, start + done, n, cmd_buf);
+        }
+        mutex_unlock(&chan->lock);
+
+        if (res != len) {
+            break;
+        }
+        done += n;
+    }
+    return done * ATA_SECTOR_SIZE;
+}
+
+static uint32_t ata_sector_size(struct disk * const disk) {
+    return ATA_SECTOR_SIZE;
+}
+
+static uint32_t ata_read_sector(struct disk * const disk,
+                                sector_t const sector_index,
+                                uint8_t * const buf) {
+    return ata_transfer(disk, false, sector_index, 1, buf);
+}
+
+static uint32_t ata_write_sector(struct disk * const disk,
+                                 sector_t const sector_index,
+                                 uint8_t const * const buf) {
+    return ata_transfer(disk, true, sector_index, 1, (uint8_t*)buf);
+}
+
+static uint32_t ata_read_sectors(struct disk * const disk,
+                                 sector_t const start,
+                                 uint32_t const count,
+                                 uint8_t * const buf) {
+    return ata_transfer(disk, false, start, count, buf);
+}
+
+static uint32_t ata_write_sectors(struct disk * const disk,
+                                  sector_t const start,
+                                  uint32_t const count,
+                                  uint8_t const * const buf) {
+    return ata_transfer(disk, true, start, count, (uint8_t*)buf);
+}
+
+static struct disk_ops const ata_disk_ops = {
+    .sector_size = ata_sector_size,
+    .read_sector = ata_read_sector,
+    .write_sector = ata_write_sector,
+    .read_sectors = ata_read_sectors,
+    .write_sectors = ata_write_sectors,
+};
+
+// Detect a disk with IDENTIFY DEVICE. The interrupts of the channel must be
+// disabled.
+// @param chan: The channel.
+// @param slave: Whether to detect the master or the slave of the channel.
+// @param disk: Output parameter describing the disk, if found.
+// @return: true if an ATA disk was found, false otherwise.
+static bool identify(struct ata_channel * const chan,
+                     bool const slave,
+                     struct ata_disk * const disk) {
+    write_reg(chan, REG_DRIVE, 0xA0 | (slave ? (1 << 4) : 0));
+    delay_400ns(chan);
+    write_reg(chan, REG_SECCOUNT, 0);
+    write_reg(chan, REG_LBA_LOW, 0);
+    write_reg(chan, REG_LBA_MID, 0);
+    write_reg(chan, REG_LBA_HIGH, 0);
+    write_reg(chan, REG_COMMAND, CMD_IDENTIFY);
+    delay_400ns(chan);
+
+    uint8_t const status = read_reg(chan, REG_STATUS);
+    if (!status || status == 0xFF || wait_not_busy(chan) & STATUS_BSY) {
+        // No drive.
+        return false;
+    } else if (read_reg(chan, REG_LBA_MID) || read_reg(chan, REG_LBA_HIGH)) {
+        // Not an ATA drive, e.g. ATAPI.
+        return false;
+    } else if (!wait_drq(chan)) {
+        return false;
+    }
+
+    uint16_t id[256];
+    for (uint32_t i = 0; i < 256; ++i) {
+        id[i] = cpu_inw(chan->io_base + REG_DATA);
+    }
+    if (!(id[49] & (1 << 9))) {
+        // CHS-only drives are not supported.
+        return false;
+    }
+    disk->channel = chan;
+    disk->slave = slave;
+    disk->lba48 = id[83] & (1 << 10);
+    disk->dma = chan->bm_base && (id[49] & (1 << 8));
+    if (disk->lba48) {
+        disk->num_sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+            ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        disk->num_sectors = (uint32_t)id[60] | ((uint32_t)id[61] << 16);
+    }
+    return disk->num_sectors;
+}
+
+// Find the bus master registers of the IDE controller.
+// @return: The base of the bus master registers of the primary channel, the
+// ones of the secondary channel follow. 0 if the controller cannot do DMA.
+static uint16_t find_bus_master(void) {
+    struct pci_addr pci;
+    if (!pci_find_class(0x01, 0x01, &pci)) {
+        return 0;
+    }
+    uint8_t const prog_if = pci_read32(pci, PCI_CLASS_REVISION) >> 8;
+    // Bit 7: bus master capable. Bits 0 and 2: channels in native mode, using
+    // the ports of BARs 0-3 instead of the legacy ones, which is not supported.
+    if (!(prog_if & 0x80) || prog_if & 0x5) {
+        return 0;
+    }
+    uint32_t const bar4 = pci_read32(pci, PCI_BAR0 + 4 * 4);
+    if (!(bar4 & 1)) {
+        // Not an I/O space BAR.
+        return 0;
+    }
+    uint16_t const command = pci_read16(pci, PCI_COMMAND);
+    pci_write16(pci, PCI_COMMAND,
+                command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    return bar4 & 0xFFFC;
+}
+
+// Allocate the PRDT of a channel.
+// @param chan: The channel.
+// @return: true on success, false otherwise.
+static bool alloc_prdt(struct ata_channel * const chan) {
+    void * frame = alloc_frame();
+    if (frame == NO_FRAME) {
+        return false;
+    }
+    void * const vaddr = paging_map_frames_above(0x0, &frame, 1, VM_WRITE);
+    if (vaddr == NO_REGION) {
+        free_frame(frame);
+        return false;
+    }
+    chan->prdt = vaddr;
+    chan->prdt_phys = frame;
+    return true;
+}
+
+void init_ata(void) {
+    uint16_t const bm_base = find_bus_master();
+    for (uint8_t c = 0; c < 2; ++c) {
+        struct ata_channel * const chan = CHANNELS + c;
+        mutex_init(&chan->lock);
+        wait_queue_init(&chan->wq);
+        spinlock_init(&chan->irq_lock);
+        chan->bm_base = bm_base ? bm_base + 8 * c : 0;
+
+        set_drive_interrupts(chan, false);
+        if (read_reg(chan, REG_STATUS) == 0xFF) {
+            // Floating bus, no drive on this channel.
+            continue;
+        }
+        if (chan->bm_base && !alloc_prdt(chan)) {
+            chan->bm_base = 0;
+        }
+
+        uint8_t found = 0;
+        for (uint8_t slave = 0; slave < 2; ++slave) {
+            struct ata_disk * const ata = ATA_DISKS + NUM_DISKS;
+            if (!identify(chan, slave, ata)) {
+                continue;
+            }
+            struct disk * const disk = DISKS + NUM_DISKS;
+            disk->ops = &ata_disk_ops;
+            disk->driver_private = ata;
+            disk->cache_enabled = false;
+            disk->fs_private = NULL;
+            blk_queue_init(&disk->queue);
+            LOG("ATA disk %u: channel %u %s, %U sectors, %s\n", NUM_DISKS, c,
+                slave ? "slave" : "master", ata->num_sectors,
+                ata->dma ? "DMA" : "PIO");
+            NUM_DISKS++;
+            found++;
+        }
+
+        if (found && chan->bm_base) {
+            interrupt_register_global_callback(chan->vector,
+                                               ata_interrupt_handler);
+            redirect_isa_interrupt(chan->irq, chan->vector);
+            set_drive_interrupts(chan, true);
+        }
+    }
+}
+
+uint8_t ata_num_disks(void) {
+    return NUM_DISKS;
+}
+
+struct disk *ata_get_disk(uint8_t const idx) {
+    ASSERT(idx < NUM_DISKS);
+    return DISKS + idx;
+}
+
+#include <ata.test>
@@ -0,0 +1,47 @@
+#pragma once
+#include <types.h>
+
+// ATA disk driver
+// ===============
+//    Driver for the ATA disks attached to the two legacy IDE channels: primary
+// (ports 0x1F0, ISA IRQ 14) and secondary (ports 0x170, ISA IRQ 15). Each
+// channel has up to two disks, master and slave, which are detected with
+// IDENTIFY DEVICE by init_ata(). Every disk found gets a struct disk.
+//    If the IDE controller is a PCI bus-master controller (class 0x01,
+// sub-class 0x01, e.g. PIIX), sectors are transferred with DMA: the physical
+// pages of the caller's buffer are described in a Physical Region Descriptor
+// Table (PRDT), and the controller moves the data to/from them without the cpu
+// touching a single byte. The completion of a command is signaled by the
+// channel's interrupt, routed through the IOAPIC, the process waiting for it
+// blocks in the meantime. With interrupts disabled, the completion is polled
+// instead. Buffers that cannot be described by a PRDT, e.g. with an odd
+// address, and controllers without bus-master support fall back to PIO.
+//    The disks are accessed through their request queue (see blk_queue.h)
+// which merges adjacent bios into a single command of up to
+// ATA_MAX_SECTORS_PER_CMD sectors. A channel executes one command at a time.
+
+// The maximum number of ATA disks: master and slave on two channels.
+#define ATA_MAX_DISKS   4
+
+// The maximum number of sectors transferred by a single command. Bigger
+// transfers are split.
+#define ATA_MAX_SECTORS_PER_CMD 128
+
+// Forward declaration, see disk.h.
+struct disk;
+
+// Detect the ATA disks and set up their channels. Must be called once the
+// IOAPIC is initialized.
+void init_ata(void);
+
+// Get the number of ATA disks found by init_ata().
+// @return: The number of disks.
+uint8_t ata_num_disks(void);
+
+// Get an ATA disk.
+// @param idx: The index of the disk, must be < ata_num_disks().
+// @return: The disk.
+struct disk *ata_get_disk(uint8_t const idx);
+
+// Execute the tests of the ATA driver.
+void ata_test(void);
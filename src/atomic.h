@@ -2,6 +2,20 @@
 #include <types.h>
 
 // This file provides functions for atomic primitives.
+//    All the primitives are inlined, they are used on hot paths (reference
+// counts, IPM completion counters, TLB shootdown waits, ...) for which the cost
+// of a call would dominate the cost of the locked instruction itself.
+//
+// Memory ordering: On x86 every locked instruction (and XCHG) is a full memory
+// barrier, hence all read-modify-write primitives below are sequentially
+// consistent. Plain reads and writes are only ordered by the x86 memory model
+// (TSO): a read can be reordered with an older write to a different location.
+// The _acquire and _release variants additionally prevent the _compiler_ from
+// moving memory accesses across the read or the write, which is all that is
+// needed on x86 to implement acquire/release semantics.
+
+// Prevent the compiler from reordering memory accesses across this point.
+#define atomic_compiler_barrier()   asm volatile("" : : : "memory")
 
 // An atomic_t is a structure containing a simple int32. This underlying value
 // should _never_ be accessed directly.
@@ -12,52 +26,301 @@ typedef struct {
 // Initialize an atomic_t to a specific value.
 // @param atomic: Pointer to the atomic_t to initialize.
 // @param value: Value to initialize the atomic_t to.
-void atomic_init(atomic_t * const atomic, int32_t const value);
+static inline void atomic_init(atomic_t * const atomic, int32_t const value) {
+    atomic->value = value;
+}
 
 // Read the value of an atomic_t.
 // @param atomic: Pointer to the atomic_t to read from.
 // @return: The current value of `atomic`.
-int32_t atomic_read(atomic_t * const atomic);
+static inline int32_t atomic_read(atomic_t * const atomic) {
+    // In x86, a read from an aligned word is atomic. The volatile access
+    // prevents the compiler from caching the value in a register across
+    // iterations of a polling loop.
+    return *(int32_t volatile *)&atomic->value;
+}
 
 // Set the value of an atomic_t.
 // @param atomic: A pointer to the target atomic_t.
 // @param value: The value to write into the atomic_t.
-void atomic_write(atomic_t * const atomic, int32_t const value);
+static inline void atomic_write(atomic_t * const atomic, int32_t const value) {
+    // In x86, a write to an aligned word is atomic.
+    *(int32_t volatile *)&atomic->value = value;
+}
 
-// Increment an atomic_t.
-// @param atomic: The atomic_t to increment.
-void atomic_inc(atomic_t * const atomic);
+// Read the value of an atomic_t with acquire semantics: no memory access
+// following the read in program order can be performed before it.
+// @param atomic: Pointer to the atomic_t to read from.
+// @return: The current value of `atomic`.
+static inline int32_t atomic_read_acquire(atomic_t * const atomic) {
+    int32_t const value = atomic_read(atomic);
+    atomic_compiler_barrier();
+    return value;
+}
 
-// Decrement an atomic_t.
-// @param atomic: The atomic_t to decrement.
-void atomic_dec(atomic_t * const atomic);
+// Set the value of an atomic_t with release semantics: all memory accesses
+// preceding the write in program order are visible before the write.
+// @param atomic: A pointer to the target atomic_t.
+// @param value: The value to write into the atomic_t.
+static inline void atomic_write_release(atomic_t * const atomic,
+                                        int32_t const value) {
+    atomic_compiler_barrier();
+    atomic_write(atomic, value);
+}
 
 // Add a value to the current value of an atomic_t.
 // @param atomic: The atomic_t to update.
 // @param value: The value to add to the atomic_t.
-void atomic_add(atomic_t * const atomic, int32_t const value);
+static inline void atomic_add(atomic_t * const atomic, int32_t const value) {
+    asm volatile("lock addl %1, %0"
+        : "+m"(atomic->value) : "ir"(value) : "memory", "cc");
+}
 
 // Subtract a value from the current value of an atomic_t.
 // @param atomic: The atomic_t to update.
 // @param value: The value to add to the atomic_t.
-void atomic_sub(atomic_t * const atomic, int32_t const value);
+static inline void atomic_sub(atomic_t * const atomic, int32_t const value) {
+    asm volatile("lock subl %1, %0"
+        : "+m"(atomic->value) : "ir"(value) : "memory", "cc");
+}
+
+// Increment an atomic_t.
+// @param atomic: The atomic_t to increment.
+static inline void atomic_inc(atomic_t * const atomic) {
+    asm volatile("lock incl %0" : "+m"(atomic->value) : : "memory", "cc");
+}
+
+// Decrement an atomic_t.
+// @param atomic: The atomic_t to decrement.
+static inline void atomic_dec(atomic_t * const atomic) {
+    asm volatile("lock decl %0" : "+m"(atomic->value) : : "memory", "cc");
+}
 
 // Atomically read the value of an atomic_t and add a value to it.
 // @param atomic: The target atomic_t.
 // @param value: The value to add to the atomic_t after reading from it.
 // @return: The value of the atomic_t _before_ adding to it.
-int32_t atomic_fetch_and_add(atomic_t * const atomic, int32_t const value);
+static inline int32_t atomic_fetch_and_add(atomic_t * const atomic,
+                                           int32_t const value) {
+    int32_t old = value;
+    asm volatile("lock xaddl %0, %1"
+        : "+r"(old), "+m"(atomic->value) : : "memory", "cc");
+    return old;
+}
 
 // Atomically read the value of an atomic_t and subtract a value from it.
 // @param atomic: The target atomic_t.
 // @param value: The value to add to the atomic_t after reading from it.
 // @return: The value of the atomic_t _before_ subtracting from it.
-int32_t atomic_fetch_and_sub(atomic_t * const atomic, int32_t const value);
+static inline int32_t atomic_fetch_and_sub(atomic_t * const atomic,
+                                           int32_t const value) {
+    return atomic_fetch_and_add(atomic, -value);
+}
 
 // Atomically decrement an atomic_t and test it.
 // @param atomic: The targeted atomic_t.
 // @return: true if atomic became 0 after the decrement, false otherwise.
-bool atomic_dec_and_test(atomic_t * const atomic);
+static inline bool atomic_dec_and_test(atomic_t * const atomic) {
+    uint8_t zero;
+    asm volatile("lock decl %0\n"
+                 "setz %1"
+        : "+m"(atomic->value), "=q"(zero) : : "memory", "cc");
+    return zero;
+}
+
+// Atomically replace the value of an atomic_t.
+// @param atomic: The target atomic_t.
+// @param value: The new value of the atomic_t.
+// @return: The value of the atomic_t _before_ the exchange.
+static inline int32_t atomic_exchange(atomic_t * const atomic,
+                                      int32_t const value) {
+    int32_t old = value;
+    // XCHG with a memory operand is implicitly locked.
+    asm volatile("xchgl %0, %1"
+        : "+r"(old), "+m"(atomic->value) : : "memory");
+    return old;
+}
+
+// Short-hand for atomic_exchange.
+#define atomic_xchg(atomic, value)  atomic_exchange((atomic), (value))
+
+// Atomically compare the value of an atomic_t to an expected value and, if they
+// are equal, replace it with a new value.
+// @param atomic: The target atomic_t.
+// @param expected: The value the atomic_t is expected to have.
+// @param desired: The value to write into the atomic_t if its current value is
+// `expected`.
+// @return: The value of the atomic_t _before_ the operation. The exchange
+// happened iff this value is equal to `expected`.
+static inline int32_t atomic_compare_and_exchange(atomic_t * const atomic,
+                                                  int32_t const expected,
+                                                  int32_t const desired) {
+    int32_t old = expected;
+    // Whether or not the exchange happened, EAX contains the old value.
+    asm volatile("lock cmpxchgl %2, %1"
+        : "+a"(old), "+m"(atomic->value) : "r"(desired) : "memory", "cc");
+    return old;
+}
+
+// Compare-and-swap flavour of atomic_compare_and_exchange, better suited to
+// retry loops:
+//      int32_t old = atomic_read(a);
+//      while (!atomic_cmpxchg(a, &old, f(old)));
+// @param atomic: The target atomic_t.
+// @param expected: In: The value the atomic_t is expected to have. Out: If the
+// exchange did not happen, the value of the atomic_t observed by the operation.
+// @param desired: The value to write into the atomic_t if its current value is
+// `*expected`.
+// @return: true if the exchange happened, false otherwise.
+static inline bool atomic_cmpxchg(atomic_t * const atomic,
+                                  int32_t * const expected,
+                                  int32_t const desired) {
+    int32_t const exp = *expected;
+    int32_t const old = atomic_compare_and_exchange(atomic, exp, desired);
+    *expected = old;
+    return old == exp;
+}
+
+// Atomically increment an atomic_t unless its value is 0. This is used to take
+// a reference on an object found without holding a lock, a reference count of 0
+// meaning that the object is being freed.
+// @param atomic: The target atomic_t.
+// @return: true if the atomic_t was incremented, false if its value was 0.
+static inline bool atomic_inc_not_zero(atomic_t * const atomic) {
+    int32_t old = atomic_read(atomic);
+    while (old && !atomic_cmpxchg(atomic, &old, old + 1));
+    return old;
+}
+
+// An atomic64_t is a structure containing an int64. As for atomic_t the
+// underlying value should _never_ be accessed directly. Since a 64-bit access is
+// not atomic on i386 all the operations, including reads, are implemented with
+// a locked CMPXCHG8B, they are therefore more expensive than their 32-bit
+// counterparts. The value must be 8-byte aligned so that it never crosses a
+// cache line, which would turn the locked instruction into a bus lock.
+typedef struct {
+    int64_t value;
+} __attribute__((aligned(8))) atomic64_t;
+
+// Atomically compare the value of an atomic64_t to an expected value and, if
+// they are equal, replace it with a new value.
+// @param atomic: The target atomic64_t.
+// @param expected: The value the atomic64_t is expected to have.
+// @param desired: The value to write into the atomic64_t if its current value
+// is `expected`.
+// @return: The value of the atomic64_t _before_ the operation. The exchange
+// happened iff this value is equal to `expected`.
+static inline int64_t atomic64_compare_and_exchange(atomic64_t * const atomic,
+                                                    int64_t const expected,
+                                                    int64_t const desired) {
+    int64_t old = expected;
+    // CMPXCHG8B compares EDX:EAX with the memory operand. If equal, ECX:EBX is
+    // written, otherwise the memory operand is loaded into EDX:EAX.
+    asm volatile("lock cmpxchg8b %1"
+        : "+A"(old), "+m"(atomic->value)
+        : "b"((uint32_t)desired), "c"((uint32_t)((uint64_t)desired >> 32))
+        : "memory", "cc");
+    return old;
+}
+
+// Compare-and-swap flavour of atomic64_compare_and_exchange, see
+// atomic_cmpxchg.
+// @param atomic: The target atomic64_t.
+// @param expected: In: The value the atomic64_t is expected to have. Out: If
+// the exchange did not happen, the value of the atomic64_t observed by the
+// operation.
+// @param desired: The value to write into the atomic64_t if its current value
+// is `*expected`.
+// @return: true if the exchange happened, false otherwise.
+static inline bool atomic64_cmpxchg(atomic64_t * const atomic,
+                                    int64_t * const expected,
+                                    int64_t const desired) {
+    int64_t const exp = *expected;
+    int64_t const old = atomic64_compare_and_exchange(atomic, exp, desired);
+    *expected = old;
+    return old == exp;
+}
+
+// Initialize an atomic64_t to a specific value. This is not atomic and must
+// only be used before the atomic64_t is shared.
+// @param atomic: Pointer to the atomic64_t to initialize.
+// @param value: Value to initialize the atomic64_t to.
+static inline void atomic64_init(atomic64_t * const atomic,
+                                 int64_t const value) {
+    atomic->value = value;
+}
+
+// Read the value of an atomic64_t.
+// @param atomic: Pointer to the atomic64_t to read from.
+// @return: The current value of `atomic`.
+static inline int64_t atomic64_read(atomic64_t * const atomic) {
+    // A CMPXCHG8B that replaces x by x whenever the value is x: the value is
+    // never modified but the read is atomic. The expected value is arbitrary.
+    return atomic64_compare_and_exchange(atomic, 0, 0);
+}
+
+// Atomically replace the value of an atomic64_t.
+// @param atomic: The target atomic64_t.
+// @param value: The new value of the atomic64_t.
+// @return: The value of the atomic64_t _before_ the exchange.
+static inline int64_t atomic64_exchange(atomic64_t * const atomic,
+                                        int64_t const value) {
+    int64_t old = atomic->value;
+    while (!atomic64_cmpxchg(atomic, &old, value));
+    return old;
+}
+
+// Short-hand for atomic64_exchange.
+#define atomic64_xchg(atomic, value)    atomic64_exchange((atomic), (value))
+
+// Set the value of an atomic64_t.
+// @param atomic: A pointer to the target atomic64_t.
+// @param value: The value to write into the atomic64_t.
+static inline void atomic64_write(atomic64_t * const atomic,
+                                  int64_t const value) {
+    atomic64_exchange(atomic, value);
+}
+
+// Atomically read the value of an atomic64_t and add a value to it.
+// @param atomic: The target atomic64_t.
+// @param value: The value to add to the atomic64_t after reading from it.
+// @return: The value of the atomic64_t _before_ adding to it.
+static inline int64_t atomic64_fetch_and_add(atomic64_t * const atomic,
+                                             int64_t const value) {
+    // A torn read of the initial guess is harmless, the CMPXCHG8B will fail
+    // and return the actual value.
+    int64_t old = atomic->value;
+    while (!atomic64_cmpxchg(atomic, &old, old + value));
+    return old;
+}
+
+// Add a value to the current value of an atomic64_t.
+// @param atomic: The atomic64_t to update.
+// @param value: The value to add to the atomic64_t.
+static inline void atomic64_add(atomic64_t * const atomic,
+                                int64_t const value) {
+    atomic64_fetch_and_add(atomic, value);
+}
+
+// Subtract a value from the current value of an atomic64_t.
+// @param atomic: The atomic64_t to update.
+// @param value: The value to subtract from the atomic64_t.
+static inline void atomic64_sub(atomic64_t * const atomic,
+                                int64_t const value) {
+    atomic64_fetch_and_add(atomic, -value);
+}
+
+// Increment an atomic64_t.
+// @param atomic: The atomic64_t to increment.
+static inline void atomic64_inc(atomic64_t * const atomic) {
+    atomic64_fetch_and_add(atomic, 1);
+}
+
+// Decrement an atomic64_t.
+// @param atomic: The atomic64_t to decrement.
+static inline void atomic64_dec(atomic64_t * const atomic) {
+    atomic64_fetch_and_add(atomic, -1);
+}
 
 // Execute tests related to atomic_ts.
 void atomic_test(void);
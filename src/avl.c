@@ -0,0 +1,166 @@
+#include <avl.h>
+#include <debug.h>
+
+void avl_init(struct avl_tree * const tree, avl_cmp_t const cmp) {
+    tree->root = NULL;
+    tree->cmp = cmp;
+    tree->size = 0;
+}
+
+// Get the height of a subtree.
+// @param node: The root of the subtree, can be NULL.
+// @return: The height of the subtree, 0 for an empty subtree.
+static uint32_t height(struct avl_node const * const node) {
+    return node ? node->height : 0;
+}
+
+// Recompute the height of a node from the heights of its children.
+// @param node: The node to update.
+static void update_height(struct avl_node * const node) {
+    uint32_t const l = height(node->left);
+    uint32_t const r = height(node->right);
+    node->height = (l > r ? l : r) + 1;
+}
+
+// Rotate a subtree to the right, the left child becoming the new root.
+// @param node: The root of the subtree.
+// @return: The new root of the subtree.
+static struct avl_node *rotate_right(struct avl_node * const node) {
+    struct avl_node * const left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update_height(node);
+    update_height(left);
+    return left;
+}
+
+// Rotate a subtree to the left, the right child becoming the new root.
+// @param node: The root of the subtree.
+// @return: The new root of the subtree.
+static struct avl_node *rotate_left(struct avl_node * const node) {
+    struct avl_node * const right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update_height(node);
+    update_height(right);
+    return right;
+}
+
+// Restore the AVL property of a subtree after an insertion or removal in one of
+// its children.
+// @param node: The root of the subtree. Both its children must be balanced.
+// @return: The new root of the subtree.
+static struct avl_node *rebalance(struct avl_node * const node) {
+    update_height(node);
+    int32_t const balance = (int32_t)height(node->left) -
+        (int32_t)height(node->right);
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    } else if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+// Insert a node in a subtree.
+// @param tree: The tree the subtree belongs to.
+// @param root: The root of the subtree.
+// @param node: The node to insert.
+// @return: The new root of the subtree.
+static struct avl_node *insert(struct avl_tree const * const tree,
+                               struct avl_node * const root,
+                               struct avl_node * const node) {
+    if (!root) {
+        return node;
+    }
+    int const cmp = tree->cmp(node, root);
+    ASSERT(cmp);
+    if (cmp < 0) {
+        root->left = insert(tree, root->left, node);
+    } else {
+        root->right = insert(tree, root->right, node);
+    }
+    return rebalance(root);
+}
+
+void avl_insert(struct avl_tree * const tree, struct avl_node * const node) {
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    tree->root = insert(tree, tree->root, node);
+    tree->size ++;
+}
+
+// Remove the lowest node of a subtree.
+// @param root: The root of the subtree. Cannot be NULL.
+// @param min: Output parameter, set to the node removed.
+// @return: The new root of the subtree.
+static struct avl_node *remove_min(struct avl_node * const root,
+                                   struct avl_node ** const min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = remove_min(root->left, min);
+    return rebalance(root);
+}
+
+// Remove a node from a subtree.
+// @param tree: The tree the subtree belongs to.
+// @param root: The root of the subtree.
+// @param node: The node to remove. Must be part of the subtree.
+// @return: The new root of the subtree.
+static struct avl_node *remove(struct avl_tree const * const tree,
+                               struct avl_node * const root,
+                               struct avl_node * const node) {
+    ASSERT(root);
+    int const cmp = tree->cmp(node, root);
+    if (cmp < 0) {
+        root->left = remove(tree, root->left, node);
+    } else if (cmp > 0) {
+        root->right = remove(tree, root->right, node);
+    } else {
+        ASSERT(root == node);
+        if (!node->left) {
+            return node->right;
+        } else if (!node->right) {
+            return node->left;
+        }
+        // Replace the node with its successor.
+        struct avl_node * succ;
+        struct avl_node * const right = remove_min(node->right, &succ);
+        succ->left = node->left;
+        succ->right = right;
+        return rebalance(succ);
+    }
+    return rebalance(root);
+}
+
+void avl_remove(struct avl_tree * const tree, struct avl_node * const node) {
+    ASSERT(tree->size);
+    tree->root = remove(tree, tree->root, node);
+    tree->size --;
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 0;
+}
+
+struct avl_node *avl_min(struct avl_tree const * const tree) {
+    struct avl_node * node = tree->root;
+    while (node && node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+bool avl_empty(struct avl_tree const * const tree) {
+    return !tree->root;
+}
+
+#include <avl.test>
@@ -0,0 +1,72 @@
+#pragma once
+#include <types.h>
+
+// This file defines an intrusive self-balancing binary search tree (AVL tree).
+// As with struct list_node, a type/struct can be part of a tree by embedding a
+// struct avl_node. The order of the elements is defined by a comparison
+// function provided when initializing the tree.
+
+// This struct allows a type/struct to be part of an AVL tree.
+struct avl_node {
+    // The left child of this node, all its elements compare lower than this
+    // node.
+    struct avl_node * left;
+    // The right child of this node, all its elements compare greater than this
+    // node.
+    struct avl_node * right;
+    // The height of the subtree rooted at this node. A leaf has height 1.
+    uint32_t height;
+};
+
+// Compare two nodes of a tree.
+// @param a: The first node.
+// @param b: The second node.
+// @return: A negative value if a < b, a positive value if a > b, 0 if a == b.
+// Note: Two different nodes of a tree must never compare equal, comparison
+// functions should break ties, for instance using the address of the nodes.
+typedef int (*avl_cmp_t)(struct avl_node const * a, struct avl_node const * b);
+
+// An AVL tree.
+struct avl_tree {
+    // The root of the tree, NULL if the tree is empty.
+    struct avl_node * root;
+    // The comparison function defining the order of the nodes.
+    avl_cmp_t cmp;
+    // The number of nodes in the tree.
+    uint32_t size;
+};
+
+// Get a pointer to the structure containing an avl_node.
+// @param node: The address of the avl_node to get the struct address from.
+// @param type: The expected type of the container.
+// @param member: The name of the avl_node in the container.
+#define avl_entry(node, type, member) \
+    ((type*)((void*)node - offsetof(type, member)))
+
+// Initialize an empty tree.
+// @param tree: The tree to initialize.
+// @param cmp: The comparison function to use to order the nodes.
+void avl_init(struct avl_tree * const tree, avl_cmp_t const cmp);
+
+// Insert a node in a tree. O(log n).
+// @param tree: The tree to insert into.
+// @param node: The node to insert. Must not be part of any tree.
+void avl_insert(struct avl_tree * const tree, struct avl_node * const node);
+
+// Remove a node from a tree. O(log n).
+// @param tree: The tree to remove from.
+// @param node: The node to remove. Must be part of `tree`.
+void avl_remove(struct avl_tree * const tree, struct avl_node * const node);
+
+// Get the lowest node of a tree. O(log n).
+// @param tree: The tree.
+// @return: The lowest node of the tree, NULL if the tree is empty.
+struct avl_node *avl_min(struct avl_tree const * const tree);
+
+// Test if a tree is empty.
+// @param tree: The tree to test.
+// @return: true if the tree is empty, false otherwise.
+bool avl_empty(struct avl_tree const * const tree);
+
+// Execute tests on the AVL tree implementation.
+void avl_test(void);
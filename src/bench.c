@@ -0,0 +1,94 @@
+#include <bench.h>
+#include <kmalloc.h>
+#include <clock.h>
+#include <debug.h>
+#include <tty.h>
+#include <serial.h>
+#include <cpu.h>
+
+// The I/O port of qemu's isa-debug-exit device, see `make bench_sweep`.
+#define DEBUG_EXIT_PORT 0xF4
+
+// The statistics reported for a benchmark, in TSC cycles.
+struct bench_stats {
+    uint64_t min;
+    uint64_t median;
+    uint64_t p99;
+};
+
+// Sort an array of durations in increasing order. This is a shell sort, the
+// arrays are small and sorting is not part of any measurement.
+// @param durations: The array to sort.
+// @param n: The number of elements in the array.
+static void sort_durations(uint64_t * const durations, uint32_t const n) {
+    for (uint32_t gap = n / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < n; ++i) {
+            uint64_t const tmp = durations[i];
+            uint32_t j = i;
+            for (; j >= gap && tmp < durations[j - gap]; j -= gap) {
+                durations[j] = durations[j - gap];
+            }
+            durations[j] = tmp;
+        }
+    }
+}
+
+// Compute the statistics of a set of durations.
+// @param durations: The durations, sorted by this function.
+// @param n: The number of durations, must be non-zero.
+// @param stats: Output parameter receiving the statistics.
+static void compute_stats(uint64_t * const durations,
+                          uint32_t const n,
+                          struct bench_stats * const stats) {
+    ASSERT(n);
+    sort_durations(durations, n);
+    stats->min = durations[0];
+    stats->median = durations[n / 2];
+    uint32_t const p99_idx = (n * 99) / 100;
+    stats->p99 = durations[p99_idx < n ? p99_idx : n - 1];
+}
+
+void bench_report(char const * const name,
+                  uint64_t * const durations,
+                  uint32_t const n) {
+    if (!n) {
+        LOG("[bench] %s: no iterations\n", name);
+        return;
+    }
+    struct bench_stats stats;
+    compute_stats(durations, n, &stats);
+    LOG("[bench] %s: n=%u min=%U med=%U p99=%U cycles, min=%U med=%U p99=%U "
+        "ns\n", name, n, stats.min, stats.median, stats.p99,
+        clock_cycles_to_ns(stats.min), clock_cycles_to_ns(stats.median),
+        clock_cycles_to_ns(stats.p99));
+}
+
+void __run_single_bench(bench_function const func,
+                        void * const arg,
+                        char const * const name) {
+    uint64_t * const durations = kmalloc(BENCH_ITERATIONS * sizeof(*durations));
+    if (!durations) {
+        WARN("[bench] %s: cannot allocate durations\n", name);
+        return;
+    }
+
+    for (uint32_t i = 0; i < BENCH_WARMUP_ITERATIONS; ++i) {
+        func(arg);
+    }
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; ++i) {
+        durations[i] = func(arg);
+    }
+
+    bench_report(name, durations, BENCH_ITERATIONS);
+    kfree(durations);
+}
+
+void bench_exit(void) {
+    tty_flush();
+#ifdef SERIAL
+    serial_flush();
+#endif
+    cpu_outb(DEBUG_EXIT_PORT, 0);
+}
+
+#include <bench.test>
@@ -0,0 +1,63 @@
+#pragma once
+#include <types.h>
+
+// Microbenchmarks.
+//    A benchmark measures the duration of an operation over a number of
+// iterations, after a few warm-up iterations whose durations are discarded. It
+// reports the min, median and 99th percentile of the durations, in TSC cycles
+// and in nanoseconds:
+//      [bench] <name>: n=<n> min=<c> med=<c> p99=<c> cycles, min=<t> med=<t>
+//      p99=<t> ns
+// The kernel runs the benchmarks instead of the tests when built with BENCH=1,
+// see `make bench` and bench_kernel(). Scalability benchmarks additionally run
+// an operation on 1, 2, 4, ... cpus and report the throughput for each number
+// of cpus, `make bench_sweep` repeats the benchmarks for different numbers of
+// cpus in the VM.
+
+// The number of measured iterations of a benchmark.
+#define BENCH_ITERATIONS        1000
+// The number of iterations run before measuring, so that the caches, TLBs and
+// allocators' per-cpu caches are warm.
+#define BENCH_WARMUP_ITERATIONS 100
+
+// A benchmark function runs a single iteration of the benchmarked operation and
+// returns its duration in TSC cycles. Timing is left to the function so that
+// the setup and teardown of an iteration (e.g. freeing what was just allocated)
+// can be excluded from the measurement.
+typedef uint64_t (*bench_function)(void * const arg);
+
+// Run a single benchmark. This function is not meant to be used directly, one
+// should use the BENCH_RUN macro instead.
+// @param func: The benchmark function.
+// @param arg: The argument passed to each call to `func`.
+// @param name: The name of the benchmark, used in the report.
+void __run_single_bench(bench_function const func,
+                        void * const arg,
+                        char const * const name);
+
+// Short-hand for __run_single_bench. The name is given explicitly so that
+// variants of the same benchmark (e.g. different sizes) can be told apart.
+#define BENCH_RUN(func, arg, name) \
+    __run_single_bench(func, arg, name)
+
+// Report the durations of a benchmark that was not run through BENCH_RUN, e.g.
+// because its iterations run on a remote cpu. The warm-up iterations must
+// already be excluded.
+// @param name: The name of the benchmark.
+// @param durations: The duration of each iteration, in TSC cycles. This array
+// is sorted by this function.
+// @param n: The number of iterations.
+void bench_report(char const * const name,
+                  uint64_t * const durations,
+                  uint32_t const n);
+
+// Run all the benchmarks.
+void bench_kernel(void);
+
+// Flush the output and exit qemu through its isa-debug-exit device. Does
+// nothing if the device is not present, which is the case unless the kernel is
+// started by `make bench_sweep`.
+void bench_exit(void);
+
+// Run the tests of the benchmark framework.
+void bench_test(void);
@@ -0,0 +1,615 @@
+#include <bench.h>
+#include <kmalloc.h>
+#include <frame_alloc.h>
+#include <paging.h>
+#include <memory.h>
+#include <ipm.h>
+#include <acpi.h>
+#include <smp.h>
+#include <sched.h>
+#include <proc.h>
+#include <proc_test_helpers.h>
+#include <vfs.h>
+#include <memdisk.h>
+#include <cpu.h>
+#include <clock.h>
+#include <atomic.h>
+#include <debug.h>
+#include <parallel.h>
+
+// The benchmarks run by bench_kernel(). Most of them run on the BSP, the ones
+// that need processes (context switch and syscalls) run on a remote cpu which
+// is reset with init_aps() afterwards, as done by the tests.
+
+// Dynamic memory allocation.
+
+// @param arg: The size of the allocation.
+static uint64_t kmalloc_bench(void * const arg) {
+    size_t const size = (size_t)arg;
+    uint64_t const start = read_tsc();
+    void * const ptr = kmalloc(size);
+    uint64_t const end = read_tsc();
+    kfree(ptr);
+    return end - start;
+}
+
+// @param arg: The size of the allocation.
+static uint64_t kfree_bench(void * const arg) {
+    size_t const size = (size_t)arg;
+    void * const ptr = kmalloc(size);
+    uint64_t const start = read_tsc();
+    kfree(ptr);
+    return read_tsc() - start;
+}
+
+// Physical frame allocation.
+
+static uint64_t alloc_frame_bench(void * const unused) {
+    uint64_t const start = read_tsc();
+    void * const frame = alloc_frame();
+    uint64_t const end = read_tsc();
+    free_frame(frame);
+    return end - start;
+}
+
+static uint64_t free_frame_bench(void * const unused) {
+    void * const frame = alloc_frame();
+    uint64_t const start = read_tsc();
+    free_frame(frame);
+    return read_tsc() - start;
+}
+
+// Paging.
+
+// @param arg: Pointer on the physical frame to map.
+static uint64_t paging_map_bench(void * const arg) {
+    uint64_t const start = read_tsc();
+    void * const vaddr = paging_map_frames_above(0x0, arg, 1, VM_WRITE);
+    uint64_t const end = read_tsc();
+    paging_unmap(vaddr, PAGE_SIZE);
+    return end - start;
+}
+
+// @param arg: Pointer on the physical frame to map.
+static uint64_t paging_unmap_bench(void * const arg) {
+    void * const vaddr = paging_map_frames_above(0x0, arg, 1, VM_WRITE);
+    uint64_t const start = read_tsc();
+    paging_unmap(vaddr, PAGE_SIZE);
+    return read_tsc() - start;
+}
+
+// Remote calls and TLB shootdowns.
+
+// The function executed by the remote calls.
+static void nop_remote_call(void * const unused) {
+}
+
+// @param arg: The cpu to execute the remote call on.
+static uint64_t exec_remote_call_bench(void * const arg) {
+    uint8_t const cpu = (uint8_t)(uint32_t)arg;
+    uint64_t const start = read_tsc();
+    exec_remote_call(cpu, nop_remote_call, NULL, true);
+    return read_tsc() - start;
+}
+
+static uint64_t broadcast_remote_call_bench(void * const unused) {
+    uint64_t const start = read_tsc();
+    broadcast_remote_call(nop_remote_call, NULL, true);
+    return read_tsc() - start;
+}
+
+// A page used as the target of the TLB shootdowns.
+static uint8_t TLB_SHOOTDOWN_PAGE[PAGE_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+static uint64_t tlb_shootdown_bench(void * const unused) {
+    uint64_t const start = read_tsc();
+    exec_tlb_shootdown(get_kernel_addr_space(), TLB_SHOOTDOWN_PAGE, 1);
+    return read_tsc() - start;
+}
+
+// Memory copies.
+
+// The buffers used by the memcpy benchmark.
+static uint8_t * MEMCPY_SRC = NULL;
+static uint8_t * MEMCPY_DST = NULL;
+
+// Receives the results of the memeq benchmarks so that the comparisons are not
+// optimized out.
+static bool volatile MEMEQ_RESULT;
+
+// Byte-by-byte reference implementations, the optimized functions are compared
+// against those. The attribute prevents the compiler from turning the loops into
+// calls to memcpy()/memset().
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void bytewise_memcpy(void * const to,
+                            void const * const from,
+                            size_t const len) {
+    uint8_t * const __to = (uint8_t*)to;
+    uint8_t const * const __from = (uint8_t*)from;
+    for (size_t i = 0; i < len; ++i) {
+        __to[i] = __from[i];
+    }
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void bytewise_memset(void * const to,
+                            uint8_t const byte,
+                            size_t const len) {
+    uint8_t * const __to = (uint8_t*)to;
+    for (size_t i = 0; i < len; ++i) {
+        __to[i] = byte;
+    }
+}
+
+static bool bytewise_memeq(void const * const s1,
+                           void const * const s2,
+                           size_t const size) {
+    uint8_t const * const __s1 = (uint8_t const *)s1;
+    uint8_t const * const __s2 = (uint8_t const *)s2;
+    for (size_t i = 0; i < size; ++i) {
+        if (__s1[i] != __s2[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// @param arg: The number of bytes to copy.
+static uint64_t memcpy_bench(void * const arg) {
+    size_t const len = (size_t)arg;
+    uint64_t const start = read_tsc();
+    memcpy(MEMCPY_DST, MEMCPY_SRC, len);
+    return read_tsc() - start;
+}
+
+// @param arg: The number of bytes to copy.
+static uint64_t bytewise_memcpy_bench(void * const arg) {
+    size_t const len = (size_t)arg;
+    uint64_t const start = read_tsc();
+    bytewise_memcpy(MEMCPY_DST, MEMCPY_SRC, len);
+    return read_tsc() - start;
+}
+
+// @param arg: The number of bytes to set.
+static uint64_t memset_bench(void * const arg) {
+    size_t const len = (size_t)arg;
+    uint64_t const start = read_tsc();
+    memset(MEMCPY_DST, 0xAB, len);
+    return read_tsc() - start;
+}
+
+// @param arg: The number of bytes to set.
+static uint64_t bytewise_memset_bench(void * const arg) {
+    size_t const len = (size_t)arg;
+    uint64_t const start = read_tsc();
+    bytewise_memset(MEMCPY_DST, 0xAB, len);
+    return read_tsc() - start;
+}
+
+// @param arg: The number of bytes to compare. The buffers are equal, hence
+// compared entirely.
+static uint64_t memeq_bench(void * const arg) {
+    size_t const len = (size_t)arg;
+    uint64_t const start = read_tsc();
+    MEMEQ_RESULT = memeq(MEMCPY_DST, MEMCPY_SRC, len);
+    return read_tsc() - start;
+}
+
+// @param arg: The number of bytes to compare.
+static uint64_t bytewise_memeq_bench(void * const arg) {
+    size_t const len = (size_t)arg;
+    uint64_t const start = read_tsc();
+    MEMEQ_RESULT = bytewise_memeq(MEMCPY_DST, MEMCPY_SRC, len);
+    return read_tsc() - start;
+}
+
+// Zero a chunk of MEMCPY_DST, executed by parallel_for().
+// @param unused: Unused.
+// @param start: The index of the first page of the chunk.
+// @param end: The index following the last page of the chunk.
+static void memzero_chunk(void * const unused,
+                          uint32_t const start,
+                          uint32_t const end) {
+    memzero(MEMCPY_DST + start * PAGE_SIZE, (end - start) * PAGE_SIZE);
+}
+
+// @param arg: The number of pages to zero.
+static uint64_t memzero_bench(void * const arg) {
+    uint32_t const npages = (uint32_t)arg;
+    uint64_t const start = read_tsc();
+    memzero(MEMCPY_DST, npages * PAGE_SIZE);
+    return read_tsc() - start;
+}
+
+// @param arg: The number of pages to zero.
+static uint64_t parallel_memzero_bench(void * const arg) {
+    uint32_t const npages = (uint32_t)arg;
+    uint64_t const start = read_tsc();
+    parallel_for(0, npages, 4, memzero_chunk, NULL);
+    return read_tsc() - start;
+}
+
+// VFS.
+
+// Re-use the TAR archive of the tests, mounted on a memdisk. The size of file0
+// is 1078 bytes.
+extern uint8_t ARCHIVE[];
+extern size_t const ARCHIVE_SIZE;
+#define VFS_BENCH_MOUNT_POINT   "/bench/"
+#define VFS_BENCH_FILE          "/bench/root/file0"
+#define VFS_BENCH_FILE_LEN      1078
+
+static uint64_t vfs_open_bench(void * const unused) {
+    uint64_t const start = read_tsc();
+    struct file * const file = vfs_open(VFS_BENCH_FILE);
+    uint64_t const end = read_tsc();
+    ASSERT(file);
+    vfs_close(file);
+    return end - start;
+}
+
+// @param arg: The file to read.
+static uint64_t vfs_read_bench(void * const arg) {
+    uint8_t buf[VFS_BENCH_FILE_LEN];
+    uint64_t const start = read_tsc();
+    size_t const len = vfs_read(arg, 0, buf, sizeof(buf));
+    uint64_t const end = read_tsc();
+    ASSERT(len == sizeof(buf));
+    return end - start;
+}
+
+// Process creation and deletion.
+
+// @param arg: If non-NULL, the pool of dead processes is emptied before each
+// iteration, so that the process is created from scratch.
+static uint64_t spawn_exit_bench(void * const arg) {
+    if (arg) {
+        proc_pool_shrink();
+    }
+    uint64_t const start = read_tsc();
+    struct proc * const proc = create_proc();
+    ASSERT(proc);
+    delete_proc(proc);
+    return read_tsc() - start;
+}
+
+// Context switch and syscalls. Those run in kernel processes on a remote cpu
+// and record their own durations.
+
+// The processes of the current remote benchmark. The scheduler alternates
+// between the two, both entries point to the same process if there is only
+// one.
+static struct proc * REMOTE_PROCS[2];
+// The durations recorded by the processes, warm-up iterations excluded.
+static uint64_t * REMOTE_DURATIONS = NULL;
+// Set by the processes once all iterations are done.
+static bool volatile REMOTE_DONE = false;
+
+// The TSC value right before the last call to schedule() in the context switch
+// benchmark.
+static uint64_t volatile SWITCH_START = 0;
+
+// pick_next_proc callback of the scheduler used by the remote benchmarks.
+// @return: The process that is not currently running.
+static struct proc *remote_pick_next_proc(void) {
+    struct proc * const curr = get_curr_proc();
+    return curr == REMOTE_PROCS[0] ? REMOTE_PROCS[1] : REMOTE_PROCS[0];
+}
+
+// put_prev_proc callback of the scheduler used by the remote benchmarks.
+// @param proc: Unused, the processes are not kept in a runqueue.
+static void remote_put_prev_proc(struct proc * const proc) {
+}
+
+// The scheduler used by the remote benchmarks. Only schedule() is used.
+static struct sched remote_sched = {
+    .sched_init       = NULL,
+    .enqueue_proc     = NULL,
+    .dequeue_proc     = NULL,
+    .update_curr      = NULL,
+    .tick             = NULL,
+    .pick_next_proc   = remote_pick_next_proc,
+    .put_prev_proc    = remote_put_prev_proc,
+};
+
+// The code of the two processes of the context switch benchmark. Each
+// iteration measures the time from a call to schedule() in one process to the
+// other process resuming.
+static void context_switch_proc_code(void * const unused) {
+    static uint32_t iter = 0;
+    while (true) {
+        uint64_t const now = read_tsc();
+        if (SWITCH_START) {
+            uint32_t const i = iter++;
+            if (i >= BENCH_WARMUP_ITERATIONS) {
+                REMOTE_DURATIONS[i - BENCH_WARMUP_ITERATIONS] =
+                    now - SWITCH_START;
+            }
+            if (i + 1 == BENCH_WARMUP_ITERATIONS + BENCH_ITERATIONS) {
+                iter = 0;
+                REMOTE_DONE = true;
+                lock_up();
+            }
+        }
+        sched_resched();
+        SWITCH_START = read_tsc();
+        schedule();
+    }
+}
+
+// Perform a getpid() syscall through int 0x80, see bench_asm.S.
+// @return: The pid of the current process.
+extern pid_t bench_getpid_syscall(void);
+
+// The code of the process of the syscall benchmark.
+static void syscall_proc_code(void * const unused) {
+    for (uint32_t i = 0; i < BENCH_WARMUP_ITERATIONS + BENCH_ITERATIONS; ++i) {
+        uint64_t const start = read_tsc();
+        bench_getpid_syscall();
+        uint64_t const end = read_tsc();
+        if (i >= BENCH_WARMUP_ITERATIONS) {
+            REMOTE_DURATIONS[i - BENCH_WARMUP_ITERATIONS] = end - start;
+        }
+    }
+    REMOTE_DONE = true;
+    lock_up();
+}
+
+// Run a remote benchmark and report its durations.
+// @param name: The name of the benchmark.
+// @param code: The code of the processes.
+// @param num_procs: The number of processes, 1 or 2.
+static void run_remote_bench(char const * const name,
+                             void (*code)(void*),
+                             uint8_t const num_procs) {
+    ASSERT(num_procs == 1 || num_procs == 2);
+    REMOTE_DURATIONS = kmalloc(BENCH_ITERATIONS * sizeof(*REMOTE_DURATIONS));
+    ASSERT(REMOTE_DURATIONS);
+    REMOTE_PROCS[0] = create_kproc(code, NULL);
+    REMOTE_PROCS[1] = num_procs == 2 ? create_kproc(code, NULL) :
+        REMOTE_PROCS[0];
+    REMOTE_DONE = false;
+    SWITCH_START = 0;
+
+    // No scheduler is selected outside of the tests.
+    sched_select(&remote_sched);
+    uint8_t const cpu = (cpu_id() + 1) % acpi_get_number_cpus();
+    exec_remote_call(cpu, exec_proc, REMOTE_PROCS[0], false);
+    while (!REMOTE_DONE) {
+        cpu_pause();
+    }
+
+    // Reset the remote cpu, it is locked up in the process.
+    init_aps();
+    cpu_var(curr_proc, cpu) = NULL;
+    sched_select(NULL);
+
+    bench_report(name, REMOTE_DURATIONS, BENCH_ITERATIONS);
+    delete_proc(REMOTE_PROCS[0]);
+    if (num_procs == 2) {
+        delete_proc(REMOTE_PROCS[1]);
+    }
+    kfree(REMOTE_DURATIONS);
+}
+
+// Scalability benchmarks. The same operation is run in a loop concurrently on
+// 1, 2, 4, ... cpus for a fixed duration and the total throughput is reported
+// for each number of cpus, in operations per second:
+//      [scal] <name>: cpus=<n> ops/s=<total> ops/s/cpu=<per cpu>
+// The loops on remote cpus run in remote calls, see exec_remote_call().
+
+// The duration of the measurement for each number of cpus.
+#define SCAL_DURATION_MS    100
+
+// A run of a scalability benchmark.
+struct scal_run {
+    // The operation to run in a loop.
+    void (*op)(void);
+    // Set once all cpus of the run are ready to start.
+    bool volatile go;
+    // The TSC value at which the cpus stop running the operation.
+    uint64_t volatile deadline;
+    // The number of cpus that are ready, resp. done.
+    atomic_t ready;
+    atomic_t done;
+    // The total number of operations run by the cpus.
+    atomic_t num_ops;
+};
+
+// Run the operation of a scalability run until its deadline.
+// @param arg: The struct scal_run.
+static void scal_worker(void * const arg) {
+    struct scal_run * const run = arg;
+    atomic_inc(&run->ready);
+    while (!run->go) {
+        cpu_pause();
+    }
+    int32_t n = 0;
+    while (read_tsc() < run->deadline) {
+        run->op();
+        n++;
+    }
+    atomic_add(&run->num_ops, n);
+    atomic_inc(&run->done);
+}
+
+// Run a scalability benchmark on a given number of cpus and report its
+// throughput.
+// @param name: The name of the benchmark.
+// @param op: The operation to run.
+// @param n: The number of cpus to use, including the current cpu.
+static void run_scalability_step(char const * const name,
+                                 void (*op)(void),
+                                 uint8_t const n) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    struct scal_run run = {
+        .op = op,
+        .go = false,
+        .deadline = 0,
+    };
+    atomic_init(&run.ready, 0);
+    atomic_init(&run.done, 0);
+    atomic_init(&run.num_ops, 0);
+
+    for (uint8_t i = 1; i < n; ++i) {
+        uint8_t const cpu = (cpu_id() + i) % ncpus;
+        exec_remote_call(cpu, scal_worker, &run, false);
+    }
+    while (atomic_read(&run.ready) != n - 1) {
+        cpu_pause();
+    }
+    run.deadline = read_tsc() + clock_tsc_freq() * SCAL_DURATION_MS / 1000;
+    cpu_mfence();
+    run.go = true;
+    scal_worker(&run);
+    while (atomic_read(&run.done) != n) {
+        cpu_pause();
+    }
+
+    uint64_t const ops_per_sec =
+        (uint64_t)atomic_read(&run.num_ops) * 1000 / SCAL_DURATION_MS;
+    LOG("[scal] %s: cpus=%u ops/s=%U ops/s/cpu=%U\n", name, n, ops_per_sec,
+        ops_per_sec / n);
+}
+
+// Run a scalability benchmark on 1, 2, 4, ... cpus and on all the cpus.
+// @param name: The name of the benchmark.
+// @param op: The operation to run.
+static void run_scalability_bench(char const * const name, void (*op)(void)) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    uint8_t n = 1;
+    while (true) {
+        run_scalability_step(name, op, n);
+        if (n == ncpus) {
+            break;
+        }
+        n = 2 * n < ncpus ? 2 * n : ncpus;
+    }
+}
+
+// Allocate and free 64 bytes, contends on kmalloc's locks.
+static void kmalloc_scal_op(void) {
+    kfree(kmalloc(64));
+}
+
+// Allocate and free a physical frame, contends on the frame allocator.
+static void alloc_frame_scal_op(void) {
+    free_frame(alloc_frame());
+}
+
+// Map and unmap a frame in the kernel address space, contends on the page
+// tables and shoots down the TLB of all cpus.
+static void paging_scal_op(void) {
+    void * frame = alloc_frame();
+    void * const vaddr = paging_map_frames_above(0x0, &frame, 1, VM_WRITE);
+    paging_unmap(vaddr, PAGE_SIZE);
+    free_frame(frame);
+}
+
+// Shoot down a page from the TLB of all cpus.
+static void tlb_shootdown_scal_op(void) {
+    exec_tlb_shootdown(get_kernel_addr_space(), TLB_SHOOTDOWN_PAGE, 1);
+}
+
+void bench_kernel(void) {
+    LOG("=== Benchmarks ===\n");
+
+    BENCH_RUN(kmalloc_bench, (void*)16, "kmalloc 16");
+    BENCH_RUN(kmalloc_bench, (void*)256, "kmalloc 256");
+    BENCH_RUN(kmalloc_bench, (void*)2048, "kmalloc 2048");
+    BENCH_RUN(kmalloc_bench, (void*)16384, "kmalloc 16384");
+    BENCH_RUN(kfree_bench, (void*)16, "kfree 16");
+    BENCH_RUN(kfree_bench, (void*)256, "kfree 256");
+    BENCH_RUN(kfree_bench, (void*)2048, "kfree 2048");
+    BENCH_RUN(kfree_bench, (void*)16384, "kfree 16384");
+
+    BENCH_RUN(alloc_frame_bench, NULL, "alloc_frame");
+    BENCH_RUN(free_frame_bench, NULL, "free_frame");
+
+    void * frame = alloc_frame();
+    ASSERT(frame);
+    BENCH_RUN(paging_map_bench, &frame, "paging_map");
+    BENCH_RUN(paging_unmap_bench, &frame, "paging_unmap");
+    free_frame(frame);
+
+    BENCH_RUN(spawn_exit_bench, NULL, "spawn/exit");
+    BENCH_RUN(spawn_exit_bench, (void*)1, "spawn/exit no pool");
+
+    if (acpi_get_number_cpus() > 1) {
+        uint8_t const cpu = (cpu_id() + 1) % acpi_get_number_cpus();
+        BENCH_RUN(exec_remote_call_bench, (void*)(uint32_t)cpu,
+                  "exec_remote_call");
+        BENCH_RUN(broadcast_remote_call_bench, NULL, "broadcast_remote_call");
+        BENCH_RUN(tlb_shootdown_bench, NULL, "tlb_shootdown");
+        run_remote_bench("context_switch", context_switch_proc_code, 2);
+        run_remote_bench("syscall getpid", syscall_proc_code, 1);
+    }
+
+    size_t const memcpy_max = 64 * 1024;
+    MEMCPY_SRC = kmalloc(memcpy_max);
+    MEMCPY_DST = kmalloc(memcpy_max);
+    ASSERT(MEMCPY_SRC && MEMCPY_DST);
+    BENCH_RUN(memcpy_bench, (void*)16, "memcpy 16");
+    BENCH_RUN(memcpy_bench, (void*)64, "memcpy 64");
+    BENCH_RUN(memcpy_bench, (void*)256, "memcpy 256");
+    BENCH_RUN(memcpy_bench, (void*)4096, "memcpy 4096");
+    BENCH_RUN(memcpy_bench, (void*)memcpy_max, "memcpy 65536");
+    BENCH_RUN(bytewise_memcpy_bench, (void*)16, "bytewise memcpy 16");
+    BENCH_RUN(bytewise_memcpy_bench, (void*)256, "bytewise memcpy 256");
+    BENCH_RUN(bytewise_memcpy_bench, (void*)4096, "bytewise memcpy 4096");
+    BENCH_RUN(bytewise_memcpy_bench, (void*)memcpy_max,
+              "bytewise memcpy 65536");
+    BENCH_RUN(memset_bench, (void*)16, "memset 16");
+    BENCH_RUN(memset_bench, (void*)256, "memset 256");
+    BENCH_RUN(memset_bench, (void*)4096, "memset 4096");
+    BENCH_RUN(memset_bench, (void*)memcpy_max, "memset 65536");
+    BENCH_RUN(bytewise_memset_bench, (void*)16, "bytewise memset 16");
+    BENCH_RUN(bytewise_memset_bench, (void*)256, "bytewise memset 256");
+    BENCH_RUN(bytewise_memset_bench, (void*)4096, "bytewise memset 4096");
+    BENCH_RUN(bytewise_memset_bench, (void*)memcpy_max,
+              "bytewise memset 65536");
+    // The memeq benchmarks compare equal buffers, i.e. the worst case.
+    memcpy(MEMCPY_DST, MEMCPY_SRC, memcpy_max);
+    BENCH_RUN(memeq_bench, (void*)16, "memeq 16");
+    BENCH_RUN(memeq_bench, (void*)256, "memeq 256");
+    BENCH_RUN(memeq_bench, (void*)4096, "memeq 4096");
+    BENCH_RUN(memeq_bench, (void*)memcpy_max, "memeq 65536");
+    BENCH_RUN(bytewise_memeq_bench, (void*)16, "bytewise memeq 16");
+    BENCH_RUN(bytewise_memeq_bench, (void*)256, "bytewise memeq 256");
+    BENCH_RUN(bytewise_memeq_bench, (void*)4096, "bytewise memeq 4096");
+    BENCH_RUN(bytewise_memeq_bench, (void*)memcpy_max,
+              "bytewise memeq 65536");
+    kfree(MEMCPY_SRC);
+    kfree(MEMCPY_DST);
+
+    // Zeroing 1MiB on the current cpu vs all the cpus.
+    uint32_t const memzero_pages = 256;
+    MEMCPY_DST = kmalloc(memzero_pages * PAGE_SIZE);
+    ASSERT(MEMCPY_DST);
+    BENCH_RUN(memzero_bench, (void*)memzero_pages, "memzero 1MiB");
+    BENCH_RUN(parallel_memzero_bench, (void*)memzero_pages,
+              "parallel_for memzero 1MiB");
+    kfree(MEMCPY_DST);
+
+    struct disk * const disk = create_memdisk(ARCHIVE, ARCHIVE_SIZE, false);
+    ASSERT(disk);
+    bool const mounted = vfs_mount(disk, VFS_BENCH_MOUNT_POINT);
+    ASSERT(mounted);
+    BENCH_RUN(vfs_open_bench, NULL, "vfs_open");
+    struct file * const file = vfs_open(VFS_BENCH_FILE);
+    ASSERT(file);
+    BENCH_RUN(vfs_read_bench, file, "vfs_read 1078");
+    vfs_close(file);
+    vfs_unmount(VFS_BENCH_MOUNT_POINT);
+    delete_memdisk(disk);
+
+    run_scalability_bench("kmalloc/kfree 64", kmalloc_scal_op);
+    run_scalability_bench("alloc_frame/free_frame", alloc_frame_scal_op);
+    run_scalability_bench("paging map/unmap", paging_scal_op);
+    if (acpi_get_number_cpus() > 1) {
+        run_scalability_bench("tlb_shootdown", tlb_shootdown_scal_op);
+    }
+
+    LOG("==================\n");
+}
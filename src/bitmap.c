@@ -1,6 +1,7 @@
 #include <bitmap.h>
 #include <math.h>
 #include <memory.h>
+#include <debug.h>
 
 // Most of the bitmap implementation is done in assembly in bitmap_asm.S. This
 // file contains functions that we not deemed necessary to be written in
@@ -16,12 +17,19 @@
 // definition) bit can be optimized to use the BSF instruction (as it is
 // equivalent to find the first bit set in a word).
 
+//   On top of the data, the summary level contains one bit per word of data.
+// Following the same inverted convention, a 1 in the summary indicates that the
+// corresponding word contains at least one non-set bit, that is the word is not
+// 0. This invariant is maintained by bitmap_set and bitmap_unset.
+
 void bitmap_init(struct bitmap * const bitmap,
                  uint32_t const size,
                  uint32_t * const data,
+                 uint32_t * const summary,
                  bool const default_val) {
     bitmap->size = size;
     bitmap->data = data;
+    bitmap->summary = summary;
     if (default_val) {
         bitmap_set_all(bitmap);
     } else {
@@ -31,12 +39,78 @@ void bitmap_init(struct bitmap * const bitmap,
 
 void bitmap_reset(struct bitmap * const bitmap) {
     bitmap->free = bitmap->size;
-    memset(bitmap->data, ~((uint8_t)0), BITMAP_WORD_COUNT(bitmap->size) * 4);
+    uint32_t const num_words = BITMAP_WORD_COUNT(bitmap->size);
+    memset(bitmap->data, ~((uint8_t)0), num_words * 4);
+
+    // All words contain available bits.
+    memset(bitmap->summary, ~((uint8_t)0), BITMAP_WORD_COUNT(num_words) * 4);
+    if (num_words % 32) {
+        // Do not advertise words past the end of the data array.
+        bitmap->summary[num_words / 32] = (1U << (num_words % 32)) - 1;
+    }
 }
 
 void bitmap_set_all(struct bitmap * const bitmap) {
     bitmap->free = 0;
-    memzero(bitmap->data, BITMAP_WORD_COUNT(bitmap->size) * 4);
+    uint32_t const num_words = BITMAP_WORD_COUNT(bitmap->size);
+    memzero(bitmap->data, num_words * 4);
+    memzero(bitmap->summary, BITMAP_WORD_COUNT(num_words) * 4);
+}
+
+// Check if the `n` bits starting at `index` are all available.
+// @param bitmap: The target bitmap.
+// @param index: The index of the first bit of the range.
+// @param n: The number of bits in the range. This is a power of two and index
+// must be a multiple of n.
+// @return: true if all the bits in the range are available, false otherwise.
+static bool range_is_available(struct bitmap const * const bitmap,
+                               uint32_t const index,
+                               uint32_t const n) {
+    uint32_t const * const word = bitmap->data + index / 32;
+    if (n < 32) {
+        // The range is within a single word. Recall that available bits are 1s
+        // in the actual data.
+        uint32_t const mask = ((1U << n) - 1) << (index % 32);
+        return (*word & mask) == mask;
+    } else {
+        // The range covers whole words.
+        for (uint32_t i = 0; i < n / 32; ++i) {
+            if (word[i] != ~0U) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+uint32_t bitmap_set_next_aligned_range(struct bitmap * const bitmap,
+                                       uint32_t const start,
+                                       uint32_t const order) {
+    ASSERT(order < 32);
+    uint32_t const n = 1U << order;
+    if (bitmap->free < n) {
+        return BM_NPOS;
+    }
+
+    // Start on the first index >= start that is a multiple of n.
+    uint32_t index = round_up_u32(start, n);
+    while (index < bitmap->size && n <= bitmap->size - index) {
+        if (!bitmap->data[index / 32]) {
+            // The word containing index does not contain a single available
+            // bit, skip to the next word. Since n is a power of two, the next
+            // word's first index is either a multiple of n or is within a range
+            // that also covers the current word.
+            index = round_up_u32(index + 1, max_u32(n, 32));
+            continue;
+        } else if (range_is_available(bitmap, index, n)) {
+            for (uint32_t i = index; i < index + n; ++i) {
+                bitmap_set(bitmap, i);
+            }
+            return index;
+        }
+        index += n;
+    }
+    return BM_NPOS;
 }
 
 #include <bitmap.test>
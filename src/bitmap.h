@@ -4,6 +4,10 @@
 // Implementation of a bitmap.
 
 // This structure holds all of the state for a bitmap.
+// In addition to the bits themselves, a bitmap maintains a summary level
+// containing one bit per uint32_t word of data indicating if the word contains
+// at least one available bit. This allows bitmap_set_next_bit() to skip over
+// 32 full words at once instead of scanning them one by one.
 struct bitmap {
     // The size (in number of bits) that the bitmap can hold.
     uint32_t size;
@@ -11,6 +15,8 @@ struct bitmap {
     uint32_t free;
     // The uint32_t array storing the actual bitmap.
     uint32_t * data;
+    // The uint32_t array storing the summary level of the bitmap.
+    uint32_t * summary;
 };
 
 // Computes the number of uint32_t words necessary to hold a bitmap.
@@ -18,21 +24,32 @@ struct bitmap {
 // Note: The size does not necessarily need to be a multiple of 32 bits.
 #define BITMAP_WORD_COUNT(size) (((size) / (32)) + (((size) % (32)) != 0))
 
+// Computes the number of uint32_t words necessary to hold the summary level of
+// a bitmap.
+// @param size: The size (in bits) of the bitmap.
+#define BITMAP_SUMMARY_WORD_COUNT(size) \
+    BITMAP_WORD_COUNT(BITMAP_WORD_COUNT(size))
+
 // Declare a static bitmap.
 // @param _name: The _name of the bitmap variable to declare.
 // @param _size: The size (in bits) of the bitmap to declare.
 #define DECLARE_BITMAP(_name,_size)                                 \
     uint32_t _bitmap_ ## _name ## _data[BITMAP_WORD_COUNT(_size)];  \
+    uint32_t _bitmap_ ## _name ## _summary[                         \
+        BITMAP_SUMMARY_WORD_COUNT(_size)];                          \
     struct bitmap _name = {                                       \
         .size = _size,                                              \
         .free = _size,                                              \
         .data = _bitmap_ ## _name ## _data,                         \
+        .summary = _bitmap_ ## _name ## _summary,                   \
     };
 
 // Initialize a bitmap with a given size and data array.
 // @param bitmap: The bitmap to initialize.
 // @param size: The size of the bitmap in bits.
 // @param data: A pointer to the array to use as the bitmap's data.
+// @param summary: A pointer to the array to use as the bitmap's summary level.
+// This array must be BITMAP_SUMMARY_WORD_COUNT(size) words long.
 // @param default_val: The default value to reset _all_ the bits of the bitmap
 // to.
 // Note: There is no way to check that the data array is big enough to hold size
@@ -40,6 +57,7 @@ struct bitmap {
 void bitmap_init(struct bitmap * const bitmap,
                  uint32_t const size,
                  uint32_t * const data,
+                 uint32_t * const summary,
                  bool const default_val);
 
 // Reset a bitmap. That is unset all the bits, making the bitmap empty.
@@ -73,6 +91,18 @@ void bitmap_unset(struct bitmap * const bitmap, uint32_t const index);
 uint32_t bitmap_set_next_bit(struct bitmap * const bitmap,
                              uint32_t const start);
 
+// Find 2^order contiguous available bits in a bitmap, starting at an index that
+// is a multiple of 2^order, and set all of them.
+// @param bitmap: The target bitmap.
+// @param start: The index to start the search from.
+// @param order: The log2 of the number of contiguous bits to set.
+// @return: If such a range was available, returns the index of its first bit,
+// otherwise returns BM_NPOS. The returned index is guaranteed to be >= start
+// index or BM_NPOS.
+uint32_t bitmap_set_next_aligned_range(struct bitmap * const bitmap,
+                                       uint32_t const start,
+                                       uint32_t const order);
+
 // Check if a bitmap is full.
 // @param bitmap: The target bitmap.
 // @return: true if the bitmap is full, that is all the bits are set, false
@@ -0,0 +1,228 @@
+#include <blk_queue.h>
+#include <disk.h>
+#include <kmalloc.h>
+#include <memory.h>
+#include <math.h>
+#include <cpu.h>
+#include <debug.h>
+
+void blk_queue_init(struct blk_queue * const queue) {
+    spinlock_init(&queue->lock);
+    queue->pending = NULL;
+    queue->head_pos = 0;
+    queue->num_requests = 0;
+    queue->num_merged = 0;
+}
+
+void bio_init(struct bio * const bio,
+              struct disk * const disk,
+              bool const is_write,
+              sector_t const sector,
+              uint32_t const count,
+              uint8_t * const buf,
+              bio_end_io_t const end_io,
+              void * const private) {
+    ASSERT(count);
+    bio->next = NULL;
+    bio->disk = disk;
+    bio->is_write = is_write;
+    bio->sector = sector;
+    bio->count = count;
+    bio->buf = buf;
+    bio->end_io = end_io;
+    bio->private = private;
+    bio->done = 0;
+}
+
+void submit_bio(struct bio * const bio) {
+    struct blk_queue * const queue = &bio->disk->queue;
+    spinlock_lock(&queue->lock);
+    // Insert after the bios starting at the same sector, so that those are
+    // dispatched in submission order.
+    struct bio ** pos = &queue->pending;
+    while (*pos && (*pos)->sector <= bio->sector) {
+        pos = &(*pos)->next;
+    }
+    bio->next = *pos;
+    *pos = bio;
+    spinlock_unlock(&queue->lock);
+}
+
+// Transfer consecutive sectors with the driver of a disk.
+// @param disk: The disk.
+// @param is_write: If true, write to the disk, otherwise read from it.
+// @param sector: The index of the first sector.
+// @param count: The number of sectors.
+// @param buf: The buffer to read into or the data to write.
+// @return: The number of bytes transferred, a multiple of the sector size.
+static size_t transfer(struct disk * const disk,
+                       bool const is_write,
+                       sector_t const sector,
+                       uint32_t const count,
+                       uint8_t * const buf) {
+    struct disk_ops const * const ops = disk->ops;
+    if (is_write && ops->write_sectors) {
+        return ops->write_sectors(disk, sector, count, buf);
+    } else if (!is_write && ops->read_sectors) {
+        return ops->read_sectors(disk, sector, count, buf);
+    }
+    uint32_t const sector_size = ops->sector_size(disk);
+    size_t done = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t const res = is_write ?
+            ops->write_sector(disk, sector + i, buf + done) :
+            ops->read_sector(disk, sector + i, buf + done);
+        if (res != sector_size) {
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+// Dispatch a request made of merged bios to the driver and complete its bios.
+// @param disk: The disk.
+// @param first: The first bio of the request. The bios of the request are
+// linked through their `next` field, the last one has a NULL `next`.
+// @param count: The total number of sectors of the request.
+static void dispatch_request(struct disk * const disk,
+                             struct bio * const first,
+                             uint32_t const count) {
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+    bool const is_write = first->is_write;
+    sector_t const sector = first->sector;
+
+    bool contiguous = true;
+    for (struct bio * bio = first; bio->next; bio = bio->next) {
+        contiguous &= bio->buf + bio->count * sector_size == bio->next->buf;
+    }
+    uint8_t * const buf = contiguous ? first->buf :
+        kmalloc(count * sector_size);
+
+    if (!buf) {
+        // Cannot bounce, transfer the bios one by one instead.
+        struct bio * bio = first;
+        while (bio) {
+            struct bio * const next = bio->next;
+            bio->done = transfer(disk, is_write, bio->sector, bio->count,
+                                 bio->buf);
+            bio->end_io(bio);
+            bio = next;
+        }
+    } else {
+        if (!contiguous && is_write) {
+            uint32_t off = 0;
+            for (struct bio * bio = first; bio; bio = bio->next) {
+                memcpy(buf + off, bio->buf, bio->count * sector_size);
+                off += bio->count * sector_size;
+            }
+        }
+        size_t const done = transfer(disk, is_write, sector, count, buf);
+
+        uint32_t off = 0;
+        struct bio * bio = first;
+        while (bio) {
+            struct bio * const next = bio->next;
+            uint32_t const len = bio->count * sector_size;
+            uint32_t const bio_done =
+                done >= off + len ? len : (done > off ? done - off : 0);
+            if (!contiguous && !is_write) {
+                memcpy(bio->buf, buf + off, bio_done);
+            }
+            off += len;
+            bio->done = bio_done;
+            bio->end_io(bio);
+            bio = next;
+        }
+        if (!contiguous) {
+            kfree(buf);
+        }
+    }
+
+    struct blk_queue * const queue = &disk->queue;
+    spinlock_lock(&queue->lock);
+    queue->head_pos = sector + count;
+    queue->num_requests++;
+    spinlock_unlock(&queue->lock);
+}
+
+// Dispatch a list of bios sorted by sector, merging adjacent bios.
+// @param disk: The disk.
+// @param bio: The first bio of the list.
+static void dispatch_list(struct disk * const disk, struct bio * bio) {
+    while (bio) {
+        struct bio * const first = bio;
+        struct bio * last = bio;
+        uint32_t count = bio->count;
+        uint32_t merged = 0;
+        while (last->next && last->next->is_write == first->is_write &&
+               last->next->sector == first->sector + count &&
+               count + last->next->count <= BLK_MAX_MERGE_SECTORS) {
+            last = last->next;
+            count += last->count;
+            merged++;
+        }
+        if (merged) {
+            struct blk_queue * const queue = &disk->queue;
+            spinlock_lock(&queue->lock);
+            queue->num_merged += merged;
+            spinlock_unlock(&queue->lock);
+        }
+        bio = last->next;
+        last->next = NULL;
+        dispatch_request(disk, first, count);
+    }
+}
+
+void blk_run_queue(struct disk * const disk) {
+    struct blk_queue * const queue = &disk->queue;
+    spinlock_lock(&queue->lock);
+    struct bio * high = queue->pending;
+    sector_t const head_pos = queue->head_pos;
+    queue->pending = NULL;
+    spinlock_unlock(&queue->lock);
+
+    // Serve the bios after the head's position first, then wrap around to the
+    // ones before it.
+    struct bio * low = NULL;
+    struct bio ** low_tail = &low;
+    while (high && high->sector < head_pos) {
+        *low_tail = high;
+        low_tail = &high->next;
+        high = high->next;
+    }
+    *low_tail = NULL;
+    dispatch_list(disk, high);
+    dispatch_list(disk, low);
+}
+
+// Completion callback of the bios of blk_rw_sync().
+// @param bio: The completed bio, its private data points to the completion
+// flag of the waiter.
+static void sync_end_io(struct bio * const bio) {
+    *(bool volatile*)bio->private = true;
+}
+
+size_t blk_rw_sync(struct disk * const disk,
+                   bool const is_write,
+                   sector_t const sector,
+                   uint32_t const count,
+                   uint8_t * const buf) {
+    if (!count) {
+        return 0;
+    }
+    bool volatile completed = false;
+    struct bio bio;
+    bio_init(&bio, disk, is_write, sector, count, buf, sync_end_io,
+             (void*)&completed);
+    submit_bio(&bio);
+    blk_run_queue(disk);
+    // Another process running the queue concurrently might have dispatched
+    // the bio, wait for it to complete it.
+    while (!completed) {
+        cpu_pause();
+    }
+    return bio.done;
+}
+
+#include <blk_queue.test>
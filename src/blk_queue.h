@@ -0,0 +1,122 @@
+#pragma once
+#include <types.h>
+#include <spinlock.h>
+
+// Block I/O request queue
+// =======================
+//    A disk access is described by a struct bio: a direction, a range of
+// consecutive sectors and a buffer. submit_bio() inserts a bio in the request
+// queue of its disk and returns right away, the bio's end_io() callback is
+// called once the transfer is done.
+//    The queue is an elevator: the pending bios are kept sorted by sector and
+// blk_run_queue() dispatches them in ascending order, starting from the sector
+// following the last dispatched request and wrapping around once (C-SCAN).
+// Consecutive bios in the same direction on adjacent sectors are merged into a
+// single request to the driver, going through a bounce buffer if their buffers
+// are not contiguous. Bios with overlapping ranges that are pending at the same
+// time are not ordered with respect to each other.
+//    The disk drivers are synchronous for now, hence the queue is run by the
+// submitter: submitting multiple bios before running the queue is what allows
+// them to be merged. A driver with interrupt-driven transfers would instead
+// start the requests from the queue and complete them from its interrupt
+// handler, overlapping the I/O with computation.
+
+// Forward declaration, see disk.h.
+struct disk;
+
+// The maximum number of sectors of a request made of merged bios.
+#define BLK_MAX_MERGE_SECTORS   256
+
+struct bio;
+
+// Completion callback of a bio. Called once the transfer is done, possibly from
+// another process than the submitter. The bio is not accessed by the queue
+// after the callback is called, hence the callback can free it.
+// @param bio: The completed bio.
+typedef void (*bio_end_io_t)(struct bio * const bio);
+
+// A block I/O.
+struct bio {
+    // Next bio in the queue of the disk.
+    struct bio * next;
+    // The disk to read from/write to.
+    struct disk * disk;
+    // If true, the bio writes to the disk, otherwise it reads from it.
+    bool is_write;
+    // The index of the first sector of the transfer.
+    sector_t sector;
+    // The number of sectors to transfer.
+    uint32_t count;
+    // The buffer to read into or the data to write, of size >= count * sector
+    // size.
+    uint8_t * buf;
+    // Called upon completion.
+    bio_end_io_t end_io;
+    // Data available for the submitter.
+    void * private;
+    // Set upon completion to the number of bytes transferred, a multiple of the
+    // sector size. Less than `count` sectors are transferred if the end of the
+    // disk is reached or in case of error.
+    uint32_t done;
+};
+
+// The request queue of a disk.
+struct blk_queue {
+    // Protects the fields below.
+    spinlock_t lock;
+    // The pending bios, sorted by sector.
+    struct bio * pending;
+    // The sector following the last dispatched request.
+    sector_t head_pos;
+    // The number of requests sent to the driver.
+    uint32_t num_requests;
+    // The number of bios merged into the request of a preceding bio.
+    uint32_t num_merged;
+};
+
+// Initialize an empty request queue.
+// @param queue: The queue to initialize.
+void blk_queue_init(struct blk_queue * const queue);
+
+// Initialize a bio.
+// @param bio: The bio to initialize.
+// @param disk: The disk to read from/write to.
+// @param is_write: If true, write to the disk, otherwise read from it.
+// @param sector: The index of the first sector of the transfer.
+// @param count: The number of sectors to transfer, must not be 0.
+// @param buf: The buffer to read into or the data to write.
+// @param end_io: The completion callback.
+// @param private: Data available for the submitter.
+void bio_init(struct bio * const bio,
+              struct disk * const disk,
+              bool const is_write,
+              sector_t const sector,
+              uint32_t const count,
+              uint8_t * const buf,
+              bio_end_io_t const end_io,
+              void * const private);
+
+// Queue a bio to its disk. The bio is only transferred once the queue is run.
+// @param bio: The bio, must stay valid until its completion.
+void submit_bio(struct bio * const bio);
+
+// Dispatch all the pending bios of a disk to its driver.
+// @param disk: The disk.
+void blk_run_queue(struct disk * const disk);
+
+// Transfer consecutive sectors through the request queue of a disk and wait
+// for the transfer to complete.
+// @param disk: The disk.
+// @param is_write: If true, write to the disk, otherwise read from it.
+// @param sector: The index of the first sector.
+// @param count: The number of sectors.
+// @param buf: The buffer to read into or the data to write.
+// @return: The number of bytes transferred, a multiple of the sector size.
+size_t blk_rw_sync(struct disk * const disk,
+                   bool const is_write,
+                   sector_t const sector,
+                   uint32_t const count,
+                   uint8_t * const buf);
+
+// Execute the tests of the request queue.
+void blk_queue_test(void);
@@ -0,0 +1,278 @@
+#include <block_cache.h>
+#include <list.h>
+#include <spinlock.h>
+#include <kmalloc.h>
+#include <memory.h>
+#include <debug.h>
+#include <memstat.h>
+#include <cpu.h>
+
+// A sector cached in the block cache.
+struct cached_block {
+    // Node in the LRU list of the bucket.
+    struct list_node lru_ll;
+    // The disk this sector belongs to.
+    struct disk * disk;
+    // The index of the sector on the disk.
+    sector_t sector;
+    // If true, the data has been modified and must be written back to the
+    // disk before the block is evicted.
+    bool dirty;
+    // The size of `data` in bytes, at least the sector size of `disk`.
+    uint32_t capacity;
+    // The content of the sector, of size the disk's sector size.
+    uint8_t data[];
+};
+
+// A bucket of the block cache.
+struct block_cache_bucket {
+    // Protects all the fields of the bucket and the blocks in it.
+    spinlock_t lock;
+    // The cached blocks of this bucket, the most recently used first.
+    struct list_node lru;
+    // The number of blocks in `lru`.
+    uint32_t num_blocks;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The buckets of the block cache.
+static struct block_cache_bucket BUCKETS[BLOCK_CACHE_BUCKETS];
+
+void init_block_cache(void) {
+    for (uint32_t i = 0; i < BLOCK_CACHE_BUCKETS; ++i) {
+        spinlock_init(&BUCKETS[i].lock);
+        list_init(&BUCKETS[i].lru);
+        BUCKETS[i].num_blocks = 0;
+    }
+}
+
+// Allocate a block, accounted in MEMSTAT_BLOCK_CACHE.
+// @param capacity: The size of the sectors the block can hold.
+// @return: The block, not part of any LRU list. NULL if the allocation failed.
+static struct cached_block *alloc_block(uint32_t const capacity) {
+    struct cached_block * const block = kmalloc(sizeof(*block) + capacity);
+    if (block) {
+        list_init(&block->lru_ll);
+        block->capacity = capacity;
+        memstat_add(MEMSTAT_BLOCK_CACHE, sizeof(*block) + capacity);
+    }
+    return block;
+}
+
+// Free a block allocated with alloc_block().
+// @param block: The block to free.
+static void free_block(struct cached_block * const block) {
+    memstat_add(MEMSTAT_BLOCK_CACHE,
+                -(int32_t)(sizeof(*block) + block->capacity));
+    kfree(block);
+}
+
+// Get the bucket of a sector.
+// @param disk: The disk.
+// @param sector: The index of the sector.
+// @return: The bucket in which the sector is cached, if cached.
+static struct block_cache_bucket *get_bucket(struct disk const * const disk,
+                                             sector_t const sector) {
+    // Consecutive sectors of a disk land in consecutive buckets, the disk only
+    // offsets the first bucket so that the first sectors of all disks do not
+    // compete for the same bucket.
+    uint32_t const hash = (uint32_t)disk / sizeof(*disk) + sector;
+    return BUCKETS + (hash & (BLOCK_CACHE_BUCKETS - 1));
+}
+
+// Find a sector in its bucket. The bucket's lock must be held.
+// @param bucket: The bucket of the sector.
+// @param disk: The disk.
+// @param sector: The index of the sector.
+// @return: The cached block or NULL if the sector is not in the cache.
+static struct cached_block *find_block(struct block_cache_bucket * const bucket,
+                                       struct disk const * const disk,
+                                       sector_t const sector) {
+    ASSERT(spinlock_is_held(&bucket->lock));
+    struct cached_block * it;
+    list_for_each_entry(it, &bucket->lru, lru_ll) {
+        if (it->disk == disk && it->sector == sector) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+// Write a dirty block back to its disk.
+// @param block: The block.
+// @return: true on success, false otherwise in which case the block remains
+// dirty.
+static bool write_back(struct cached_block * const block) {
+    ASSERT(block->dirty);
+    struct disk * const disk = block->disk;
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+    uint32_t const res = disk->ops->write_sector(disk, block->sector,
+                                                 block->data);
+    if (res != sector_size) {
+        return false;
+    }
+    block->dirty = false;
+    return true;
+}
+
+// Get a block to cache a new sector in a bucket, either by allocating one or
+// by evicting the least recently used block of the bucket. The bucket's lock
+// must be held.
+// @param bucket: The bucket.
+// @param disk: The disk the new sector belongs to.
+// @return: The block, not part of the LRU list. NULL if no block could be
+// allocated or the evicted block could not be written back.
+static struct cached_block *get_free_block(
+    struct block_cache_bucket * const bucket,
+    struct disk * const disk) {
+    ASSERT(spinlock_is_held(&bucket->lock));
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+
+    if (bucket->num_blocks < BLOCK_CACHE_WAYS) {
+        struct cached_block * const block = alloc_block(sector_size);
+        if (block) {
+            bucket->num_blocks++;
+            return block;
+        } else if (!bucket->num_blocks) {
+            return NULL;
+        }
+        // Could not allocate, evict instead.
+    }
+
+    struct cached_block * victim =
+        list_last_entry(&bucket->lru, struct cached_block, lru_ll);
+    if (victim->dirty && !write_back(victim)) {
+        return NULL;
+    }
+    list_del(&victim->lru_ll);
+
+    if (victim->capacity < sector_size) {
+        // The block is too small for the new sector.
+        free_block(victim);
+        victim = alloc_block(sector_size);
+        if (!victim) {
+            bucket->num_blocks--;
+            return NULL;
+        }
+    }
+    return victim;
+}
+
+// Get the cached block of a sector, reading it from disk if necessary. The
+// bucket's lock must be held.
+// @param bucket: The bucket of the sector.
+// @param disk: The disk.
+// @param sector: The index of the sector.
+// @return: The cached block, now the most recently used of its bucket. NULL if
+// the sector could not be read.
+static struct cached_block *get_block(struct block_cache_bucket * const bucket,
+                                      struct disk * const disk,
+                                      sector_t const sector) {
+    ASSERT(spinlock_is_held(&bucket->lock));
+
+    struct cached_block * block = find_block(bucket, disk, sector);
+    if (block) {
+        list_del(&block->lru_ll);
+        list_add(&bucket->lru, &block->lru_ll);
+        return block;
+    }
+
+    block = get_free_block(bucket, disk);
+    if (!block) {
+        return NULL;
+    }
+
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+    if (disk->ops->read_sector(disk, sector, block->data) != sector_size) {
+        // Most likely past the end of the disk.
+        free_block(block);
+        bucket->num_blocks--;
+        return NULL;
+    }
+    block->disk = disk;
+    block->sector = sector;
+    block->dirty = false;
+    list_add(&bucket->lru, &block->lru_ll);
+    return block;
+}
+
+uint32_t block_cache_read(struct disk * const disk,
+                          sector_t const sector,
+                          uint8_t * const buf) {
+    ASSERT(disk->cache_enabled);
+
+    struct block_cache_bucket * const bucket = get_bucket(disk, sector);
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+
+    spinlock_lock(&bucket->lock);
+    struct cached_block const * const block = get_block(bucket, disk, sector);
+    if (block) {
+        memcpy(buf, block->data, sector_size);
+    }
+    spinlock_unlock(&bucket->lock);
+    return block ? sector_size : 0;
+}
+
+uint32_t block_cache_write(struct disk * const disk,
+                           sector_t const sector,
+                           uint8_t const * const buf) {
+    ASSERT(disk->cache_enabled);
+
+    struct block_cache_bucket * const bucket = get_bucket(disk, sector);
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+
+    spinlock_lock(&bucket->lock);
+    // Reading the sector on a miss, even though it is about to be overwritten,
+    // makes sure that only sectors that exist on the disk get cached.
+    struct cached_block * const block = get_block(bucket, disk, sector);
+    if (block) {
+        memcpy(block->data, buf, sector_size);
+        block->dirty = true;
+    }
+    spinlock_unlock(&bucket->lock);
+    return block ? sector_size : 0;
+}
+
+// Go through all the blocks of a disk in the cache, optionally removing them.
+// @param disk: The disk.
+// @param drop: If true, the blocks are removed from the cache after being
+// written back.
+// @return: true if all dirty blocks were written back, false otherwise.
+static bool for_each_disk_block(struct disk * const disk, bool const drop) {
+    bool success = true;
+    for (uint32_t i = 0; i < BLOCK_CACHE_BUCKETS; ++i) {
+        struct block_cache_bucket * const bucket = BUCKETS + i;
+        spinlock_lock(&bucket->lock);
+        struct cached_block * block =
+            list_first_entry(&bucket->lru, struct cached_block, lru_ll);
+        while (&block->lru_ll != &bucket->lru) {
+            // The block might be freed below, get the next one first.
+            struct cached_block * const next =
+                list_entry(block->lru_ll.next, struct cached_block, lru_ll);
+            if (block->disk == disk) {
+                if (block->dirty && !write_back(block)) {
+                    success = false;
+                }
+                if (drop) {
+                    list_del(&block->lru_ll);
+                    free_block(block);
+                    bucket->num_blocks--;
+                }
+            }
+            block = next;
+        }
+        spinlock_unlock(&bucket->lock);
+    }
+    return success;
+}
+
+bool block_cache_flush(struct disk * const disk) {
+    return for_each_disk_block(disk, false);
+}
+
+void block_cache_drop(struct disk * const disk) {
+    if (!for_each_disk_block(disk, true)) {
+        WARN("Dirty sectors of disk %p lost from block cache\n", disk);
+    }
+}
+
+#include <block_cache.test>
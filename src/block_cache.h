@@ -0,0 +1,60 @@
+#pragma once
+#include <types.h>
+#include <disk.h>
+
+// Block cache
+// ===========
+//    The block cache keeps copies of recently accessed disk sectors in memory.
+// It sits between disk_read()/disk_write() and the disk_ops of drivers and is
+// enabled per disk with disk_enable_cache(). The cache is shared by all disks
+// and keyed by (disk, sector).
+// The cache is a set-associative hash table: a (disk, sector) pair hashes to a
+// single bucket and each bucket holds up to BLOCK_CACHE_WAYS sectors in LRU
+// order. Each bucket has its own lock hence accesses to sectors in different
+// buckets never contend. When a bucket is full, its least recently used sector
+// is evicted to make room for a new one.
+// Writes are write-back: a write only updates the cached copy and marks it
+// dirty. A dirty sector reaches the disk when it is evicted or when the disk is
+// flushed with disk_flush().
+
+// The number of buckets in the block cache. Must be a power of two.
+#define BLOCK_CACHE_BUCKETS 64
+// The maximum number of sectors cached in a single bucket.
+#define BLOCK_CACHE_WAYS    8
+
+// Initialize the block cache.
+void init_block_cache(void);
+
+// Read a sector through the block cache.
+// @param disk: The disk to read from. The cache must be enabled on this disk.
+// @param sector: The index of the sector to read.
+// @param buf: The buffer to read into, of size >= the disk's sector size.
+// @return: Same as disk_ops::read_sector: the sector size on success, 0
+// otherwise.
+uint32_t block_cache_read(struct disk * const disk,
+                          sector_t const sector,
+                          uint8_t * const buf);
+
+// Write a sector through the block cache. The data is only written to disk
+// upon eviction or flush.
+// @param disk: The disk to write to. The cache must be enabled on this disk.
+// @param sector: The index of the sector to write.
+// @param buf: The data to write, of size >= the disk's sector size.
+// @return: Same as disk_ops::write_sector: the sector size on success, 0
+// otherwise.
+uint32_t block_cache_write(struct disk * const disk,
+                           sector_t const sector,
+                           uint8_t const * const buf);
+
+// Write all the dirty sectors of a disk back to the disk.
+// @param disk: The disk to flush.
+// @return: true if all dirty sectors were written successfully, false
+// otherwise. Sectors that could not be written back remain dirty.
+bool block_cache_flush(struct disk * const disk);
+
+// Flush and remove all the sectors of a disk from the cache.
+// @param disk: The disk.
+void block_cache_drop(struct disk * const disk);
+
+// Run the block cache tests.
+void block_cache_test(void);
@@ -0,0 +1,65 @@
+#include <clock.h>
+#include <cpu.h>
+#include <sched.h>
+#include <debug.h>
+
+// The frequency of the TSC in Hz. 0 until calibrate_timer() is called.
+static uint64_t TSC_FREQ = 0;
+
+// The conversion factor from TSC cycles to nanoseconds as a 32.32 fixed point
+// number: ns = (cycles * NS_PER_CYCLE) >> 32.
+static uint64_t NS_PER_CYCLE = 0;
+
+void clock_set_tsc_freq(uint64_t const freq) {
+    ASSERT(freq);
+    // (10^9 << 32) fits in 63 bits.
+    NS_PER_CYCLE = (1000000000ULL << 32) / freq;
+    TSC_FREQ = freq;
+
+    // CPUID.80000007H:EDX[8] indicates an invariant TSC.
+    uint32_t max_ext_leaf;
+    cpuid(0x80000000, &max_ext_leaf, NULL, NULL, NULL);
+    uint32_t edx = 0;
+    if (max_ext_leaf >= 0x80000007) {
+        cpuid(0x80000007, NULL, NULL, NULL, &edx);
+    }
+    if (!(edx & (1 << 8))) {
+        WARN("TSC is not invariant (CPUID.80000007H:EDX = %x), clock might "
+             "drift\n", edx);
+    }
+}
+
+uint64_t clock_tsc_freq(void) {
+    return TSC_FREQ;
+}
+
+uint64_t clock_cycles_to_ns(uint64_t const cycles) {
+    // Compute (cycles * NS_PER_CYCLE) >> 32 using 32x32 -> 64 bit
+    // multiplications only:
+    //  (c * m) >> 32 = (ch * mh) << 32 + ch * ml + cl * mh + (cl * ml) >> 32
+    // The result overflows after 2^64 nanoseconds, which is not a concern.
+    uint64_t const ch = cycles >> 32;
+    uint64_t const cl = cycles & 0xFFFFFFFF;
+    uint64_t const mh = NS_PER_CYCLE >> 32;
+    uint64_t const ml = NS_PER_CYCLE & 0xFFFFFFFF;
+    return ((ch * mh) << 32) + ch * ml + cl * mh + ((cl * ml) >> 32);
+}
+
+uint64_t clock_now_ns(void) {
+    return clock_cycles_to_ns(read_tsc());
+}
+
+void clock_delay_us(uint32_t const usec) {
+    ASSERT(TSC_FREQ);
+    uint64_t const end = clock_now_ns() + (uint64_t)usec * 1000;
+    while (clock_now_ns() < end) {
+        cpu_pause();
+    }
+}
+
+void clock_get_cpu_time(uint8_t const cpu, struct cpu_time * const time) {
+    *time = cpu_var(cpu_time, cpu);
+    time->idle_ns = sched_cpu_idle_ns(cpu);
+}
+
+#include <clock.test>
@@ -0,0 +1,58 @@
+#pragma once
+#include <types.h>
+#include <percpu.h>
+
+// The TSC clocksource.
+// The TSC is assumed to be invariant, that is to tick at a constant rate
+// regardless of the power state of the cpu, and synchronized between all cpus.
+// Its frequency is measured once, against the PIT, by calibrate_timer(). TSC
+// values are then converted to nanoseconds with a multiplication and a shift,
+// without any division.
+
+// Set the frequency of the TSC. Called by calibrate_timer().
+// @param freq: The frequency of the TSC in Hz.
+void clock_set_tsc_freq(uint64_t const freq);
+
+// Get the frequency of the TSC.
+// @return: The frequency of the TSC in Hz, 0 if it has not been calibrated yet.
+uint64_t clock_tsc_freq(void);
+
+// Convert a number of TSC cycles to nanoseconds.
+// @param cycles: The number of cycles.
+// @return: The duration of `cycles` in nanoseconds, 0 if the TSC has not been
+// calibrated yet.
+uint64_t clock_cycles_to_ns(uint64_t const cycles);
+
+// Read the monotonic clock. The clock counts the nanoseconds since the TSC was
+// reset, ie. since the machine was powered on, and gives the same time on all
+// cpus.
+// @return: The current time in nanoseconds, 0 if the TSC has not been
+// calibrated yet.
+uint64_t clock_now_ns(void);
+
+// Busy wait for a given amount of time. Unlike lapic_sleep(), this has a
+// microsecond granularity and does not use the LAPIC timer.
+// @param usec: The number of microseconds to wait. The TSC must be calibrated.
+void clock_delay_us(uint32_t const usec);
+
+// Time accounting of a cpu, in nanoseconds.
+struct cpu_time {
+    // The time spent running the idle process of the cpu.
+    uint64_t idle_ns;
+    // The time spent in interrupt handlers, syscalls excluded.
+    uint64_t irq_ns;
+    // The time spent executing syscalls.
+    uint64_t system_ns;
+};
+
+// The irq and system time of each cpu. The idle time is accounted as the
+// runtime of the cpu's idle process, see clock_get_cpu_time().
+DECLARE_PER_CPU(struct cpu_time, cpu_time);
+
+// Get the time accounting of a cpu.
+// @param cpu: The cpu.
+// @param time: Output parameter receiving the time accounting of the cpu.
+void clock_get_cpu_time(uint8_t const cpu, struct cpu_time * const time);
+
+// Execute clock tests.
+void clock_test(void);
@@ -3,6 +3,9 @@
 
 // CPU related operations.
 
+// The size of a cache line in bytes.
+#define CACHE_LINE_SIZE 64
+
 // Read a Model-Specific-Register into dest.
 // @param msr_num: The MSR number, as found in Intel's documentation.
 // @return: The value read from the MSR.
@@ -68,10 +71,23 @@ void cpu_outb(uint16_t const port, uint8_t const byte);
 // @param byte: The value of the word to write to the port.
 void cpu_outw(uint16_t const port, uint16_t const word);
 
+// Write a double word to an I/O port.
+// @param port: The port to write the double word to.
+// @param dword: The value of the double word to write to the port.
+void cpu_outl(uint16_t const port, uint32_t const dword);
+
 // Read a byte from an I/O port.
 // @param port: The port to read a byte from.
 uint8_t cpu_inb(uint16_t const port);
 
+// Read a word from an I/O port.
+// @param port: The port to read a word from.
+uint16_t cpu_inw(uint16_t const port);
+
+// Read a double word from an I/O port.
+// @param port: The port to read a double word from.
+uint32_t cpu_inl(uint16_t const port);
+
 // Desciptor for a GDT containing the size and base address of the GDT.
 struct gdt_desc {
     // Limit is such that base+limit points to the latest valid byte of the GDT.
@@ -199,6 +215,11 @@ void cpu_enable_paging(void);
 // Flush/invalidate the TLB on the current core.
 void cpu_invalidate_tlb(void);
 
+// Invalidate the TLB entry of a single page on the current core using the
+// INVLPG instruction.
+// @param addr: An address within the page to invalidate.
+void cpu_invlpg(void const * const addr);
+
 // Read the address reported into the CR2 register.
 // @return: The current value of the CR2 register.
 void *cpu_read_cr2(void);
@@ -211,6 +232,29 @@ uint32_t cpu_read_cr0(void);
 // @return: Value of CR4 for the current core.
 uint32_t cpu_read_cr4(void);
 
+// Enable the FPU and SSE instructions on the current cpu. The FPU is
+// re-initialized to its default state.
+// Note: The cpu must support the FXSAVE/FXRSTOR instructions.
+void cpu_enable_fpu(void);
+
+// Set the TS (Task Switched) bit of CR0, the next FPU/SSE instruction raises a
+// Device Not Available exception (#NM).
+void cpu_set_ts(void);
+
+// Clear the TS (Task Switched) bit of CR0 using the CLTS instruction.
+void cpu_clear_ts(void);
+
+// Save the FPU and SSE state of the current cpu using the FXSAVE instruction.
+// @param area: The 512 bytes area to save the state into. Must be 16 bytes
+// aligned.
+void cpu_fxsave(void * const area);
+
+// Restore the FPU and SSE state of the current cpu using the FXRSTOR
+// instruction.
+// @param area: The 512 bytes area to restore the state from, as written by
+// cpu_fxsave(). Must be 16 bytes aligned.
+void cpu_fxrstor(void const * const area);
+
 // Halt the cpu. This function does not enable interrupts!
 void cpu_halt(void);
 
@@ -220,6 +264,18 @@ void cpu_halt(void);
 // cpu enters a halt state.
 void cpu_set_interrupt_flag_and_halt(void);
 
+// Arm the address monitoring hardware on a given address, using the MONITOR
+// instruction. A subsequent MWAIT returns when the cache line containing the
+// address is written.
+// @param addr: The address to monitor.
+void cpu_monitor(void const volatile * const addr);
+
+// Execute the MWAIT instruction. This function does not enable interrupts!
+// @param hints: The hints passed in EAX, i.e. the target C-state.
+// @param ext: The extensions passed in ECX. If bit 0 is set, interrupts wake
+// up the cpu even when they are masked.
+void cpu_mwait(uint32_t const hints, uint32_t const ext);
+
 // Enable the cache on the CPU.
 void cpu_enable_cache(void);
 
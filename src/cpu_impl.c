@@ -58,11 +58,9 @@ union segment_selector_t cpu_read_ss(void) {
 uint8_t cpu_id(void) {
     if (cpu_read_gs().value) {
         // If the GS register is non null then we assume that it points to the
-        // percpu segment of this cpu.
-        preempt_disable();
-        uint8_t const cpu =  this_cpu_var(cpu_id);
-        preempt_enable();
-        return cpu;
+        // percpu segment of this cpu. A single read does not require disabling
+        // preemption.
+        return this_cpu_read(cpu_id);
     } else {
         // We are most likely early at boot and percpu segments were not
         // initialized yet. Use the CPUID instruction to get the ID.
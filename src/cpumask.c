@@ -0,0 +1,54 @@
+#include <cpumask.h>
+#include <memory.h>
+#include <acpi.h>
+
+void cpumask_clear(struct cpumask * const mask) {
+    memzero(mask, sizeof(*mask));
+}
+
+void cpumask_fill(struct cpumask * const mask) {
+    cpumask_clear(mask);
+    uint16_t const ncpus = acpi_get_number_cpus();
+    for (uint16_t cpu = 0; cpu < ncpus; ++cpu) {
+        cpumask_set(mask, cpu);
+    }
+}
+
+void cpumask_set(struct cpumask * const mask, uint8_t const cpu) {
+    mask->bits[cpu / 32] |= 1U << (cpu % 32);
+}
+
+void cpumask_unset(struct cpumask * const mask, uint8_t const cpu) {
+    mask->bits[cpu / 32] &= ~(1U << (cpu % 32));
+}
+
+bool cpumask_has(struct cpumask const * const mask, uint8_t const cpu) {
+    return mask->bits[cpu / 32] & (1U << (cpu % 32));
+}
+
+uint32_t cpumask_weight(struct cpumask const * const mask) {
+    uint32_t weight = 0;
+    for (uint32_t i = 0; i < CPUMASK_MAX_CPUS / 32; ++i) {
+        // Clear the lowest set bit until the word becomes 0.
+        for (uint32_t word = mask->bits[i]; word; word &= word - 1) {
+            weight++;
+        }
+    }
+    return weight;
+}
+
+uint32_t cpumask_next(struct cpumask const * const mask, uint32_t const start) {
+    for (uint32_t i = start / 32; i < CPUMASK_MAX_CPUS / 32; ++i) {
+        uint32_t word = mask->bits[i];
+        if (i == start / 32) {
+            // Ignore the cpus before start in the first word.
+            word &= ~0U << (start % 32);
+        }
+        if (word) {
+            return i * 32 + __builtin_ctz(word);
+        }
+    }
+    return CPUMASK_MAX_CPUS;
+}
+
+#include <cpumask.test>
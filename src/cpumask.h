@@ -0,0 +1,59 @@
+#pragma once
+#include <types.h>
+
+// A cpumask is a set of cpus, represented as a bitmap indexed by cpu id.
+
+// Cpu ids are 8-bit APIC IDs, hence a cpumask needs to be able to represent up
+// to 256 cpus.
+#define CPUMASK_MAX_CPUS    256
+
+struct cpumask {
+    uint32_t bits[CPUMASK_MAX_CPUS / 32];
+};
+
+// Remove all cpus from a cpumask.
+// @param mask: The cpumask to clear.
+void cpumask_clear(struct cpumask * const mask);
+
+// Set a cpumask to contain all the cpus on the system.
+// @param mask: The cpumask to fill.
+void cpumask_fill(struct cpumask * const mask);
+
+// Add a cpu to a cpumask.
+// @param mask: The cpumask to modify.
+// @param cpu: The cpu to add.
+void cpumask_set(struct cpumask * const mask, uint8_t const cpu);
+
+// Remove a cpu from a cpumask.
+// @param mask: The cpumask to modify.
+// @param cpu: The cpu to remove.
+void cpumask_unset(struct cpumask * const mask, uint8_t const cpu);
+
+// Check if a cpumask contains a cpu.
+// @param mask: The cpumask to test.
+// @param cpu: The cpu to look for.
+// @return: true if `cpu` is in `mask`, false otherwise.
+bool cpumask_has(struct cpumask const * const mask, uint8_t const cpu);
+
+// Compute the number of cpus in a cpumask.
+// @param mask: The cpumask.
+// @return: The number of cpus contained in `mask`.
+uint32_t cpumask_weight(struct cpumask const * const mask);
+
+// Find the next cpu contained in a cpumask.
+// @param mask: The cpumask.
+// @param start: The cpu to start the search from (included).
+// @return: The smallest cpu >= start contained in `mask`, CPUMASK_MAX_CPUS if
+// there is none.
+uint32_t cpumask_next(struct cpumask const * const mask, uint32_t const start);
+
+// Iterate over all the cpus contained in a cpumask, in increasing order.
+// @param cpu: A uint32_t that is set to the current cpu in each iteration.
+// @param mask: A pointer to the cpumask to iterate over.
+#define cpumask_for_each(cpu, mask)                                     \
+    for ((cpu) = cpumask_next((mask), 0);                               \
+         (cpu) < CPUMASK_MAX_CPUS;                                      \
+         (cpu) = cpumask_next((mask), (cpu) + 1))
+
+// Execute cpumask tests.
+void cpumask_test(void);
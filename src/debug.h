@@ -18,6 +18,7 @@
 // Panic the kernel, output the error message an dump some states into the tty.
 #define PANIC(...) \
     do { \
+        tty_enter_sync_mode(); \
         LOG("----[ CPU %u PANIC! ]----\n", cpu_apic_id()); \
         LOG("Kernel panic at %s:%d\n", __FILE__, __LINE__); \
         LOG(__VA_ARGS__); \
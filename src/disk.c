@@ -3,6 +3,7 @@
 #include <memory.h>
 #include <debug.h>
 #include <kmalloc.h>
+#include <block_cache.h>
 
 // Get the index of the sector containing a particular offset on disk.
 // @param offset: The offset to convert to sector index.
@@ -20,142 +21,247 @@ static off_t sector_to_offset(sector_t const sec, size_t const sec_size) {
     return (off_t)(sec * sec_size);
 }
 
-size_t disk_read(struct disk * const disk,
-                 off_t const offset,
-                 uint8_t * const buf,
-                 size_t const len) {
-    if (!len) {
-        // Empty read optmization.
-        return 0;
+// Read a sector from a disk, through the block cache if enabled or the request
+// queue otherwise.
+// @param disk: The disk.
+// @param sector: The index of the sector to read.
+// @param buf: The buffer to read into.
+// @return: The number of bytes read, either the sector size or 0.
+static uint32_t read_sector(struct disk * const disk,
+                            sector_t const sector,
+                            uint8_t * const buf) {
+    if (disk->cache_enabled) {
+        return block_cache_read(disk, sector, buf);
+    } else {
+        return blk_rw_sync(disk, false, sector, 1, buf);
+    }
+}
+
+// Write a sector to a disk, through the block cache if enabled or the request
+// queue otherwise.
+// @param disk: The disk.
+// @param sector: The index of the sector to write.
+// @param buf: The data to write.
+// @return: The number of bytes written, either the sector size or 0.
+static uint32_t write_sector(struct disk * const disk,
+                             sector_t const sector,
+                             uint8_t const * const buf) {
+    if (disk->cache_enabled) {
+        return block_cache_write(disk, sector, buf);
+    } else {
+        return blk_rw_sync(disk, true, sector, 1, (uint8_t*)buf);
+    }
+}
+
+void const *disk_get_ptr(struct disk * const disk,
+                         off_t const offset,
+                         size_t const len) {
+    if (!disk->ops->get_sector_ptr || disk->cache_enabled || !len) {
+        return NULL;
     }
 
     uint32_t const sector_size = disk->ops->sector_size(disk);
     sector_t const start_sector = offset_to_sector(offset, sector_size);
     sector_t const end_sector = offset_to_sector(offset + len - 1, sector_size);
 
-    // The number of bytes written to the buffer `buf` so far.
-    uint32_t written = 0;
+    void * const start = disk->ops->get_sector_ptr(disk, start_sector);
+    void * const end = disk->ops->get_sector_ptr(disk, end_sector);
+    if (!start || !end) {
+        return NULL;
+    }
+    // The driver is not required to store consecutive sectors contiguously.
+    // The sectors in between are assumed to be contiguous if the first and
+    // last sectors are.
+    uint32_t const dist = end - start;
+    if (dist != (end_sector - start_sector) * sector_size) {
+        return NULL;
+    }
+    return start + (offset - sector_to_offset(start_sector, sector_size));
+}
 
-    // All sectors will be read into the `sector_data` buffer. FIXME: This could
-    // be optimized to read into the buffer `buf` instead.
-    uint8_t * const sector_data = kmalloc(sector_size);
+void disk_enable_cache(struct disk * const disk) {
+    disk->cache_enabled = true;
+}
 
-    // FIXME: Not sure if we should return 0 here or an error code (-1 ?).
-    // Probably better to get rid of the dynamic allocation and use the buffer
-    // directly.
-    TODO_PROPAGATE_ERROR(!sector_data);
+void disk_disable_cache(struct disk * const disk) {
+    if (disk->cache_enabled) {
+        block_cache_drop(disk);
+        disk->cache_enabled = false;
+    }
+}
 
-    for (sector_t sector = start_sector; sector <= end_sector; ++sector) {
-        memzero(sector_data, sector_size);
+bool disk_flush(struct disk * const disk) {
+    return !disk->cache_enabled || block_cache_flush(disk);
+}
 
-        uint32_t const read = disk->ops->read_sector(disk, sector, sector_data);
-        if (read == 0) {
-            // We reached the end of the disk, no more to read.
+// Read consecutive whole sectors from a disk directly into a buffer, through
+// the request queue of the disk unless the block cache is enabled.
+// @param disk: The disk.
+// @param start: The index of the first sector to read.
+// @param count: The number of sectors to read.
+// @param buf: The buffer to read into, of size >= count * sector size.
+// @return: The number of bytes read, a multiple of the sector size.
+static size_t read_sectors(struct disk * const disk,
+                           sector_t const start,
+                           uint32_t const count,
+                           uint8_t * const buf) {
+    if (!disk->cache_enabled) {
+        return blk_rw_sync(disk, false, start, count, buf);
+    }
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+    size_t done = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t const res = read_sector(disk, start + i, buf + done);
+        if (res != sector_size) {
             break;
         }
+        done += res;
+    }
+    return done;
+}
 
-        // The read_sector() function should return a complete sector or
-        // nothing.
-        ASSERT(read == sector_size);
-
-        uint32_t start_offset = 0;
-        if (sector == start_sector) {
-            // This is the first sector, the offset to read from might point
-            // to the middle of this sector.
-            ASSERT(sector_to_offset(sector, sector_size) <= offset);
-            start_offset = offset - sector_to_offset(sector, sector_size);
-        } else {
-            // For all sectors after the fist one copy from the start of the
-            // sector.
-            start_offset = 0;
+// Write consecutive whole sectors to a disk directly from a buffer, through
+// the request queue of the disk unless the block cache is enabled.
+// @param disk: The disk.
+// @param start: The index of the first sector to write.
+// @param count: The number of sectors to write.
+// @param buf: The data to write, of size >= count * sector size.
+// @return: The number of bytes written, a multiple of the sector size.
+static size_t write_sectors(struct disk * const disk,
+                            sector_t const start,
+                            uint32_t const count,
+                            uint8_t const * const buf) {
+    if (!disk->cache_enabled) {
+        return blk_rw_sync(disk, true, start, count, (uint8_t*)buf);
+    }
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+    size_t done = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t const res = write_sector(disk, start + i, buf + done);
+        if (res != sector_size) {
+            break;
         }
+        done += res;
+    }
+    return done;
+}
+
+// Read or write part of a single sector through a bounce buffer.
+// @param disk: The disk.
+// @param sector: The index of the sector.
+// @param sec_off: The offset of the access within the sector.
+// @param buf: The buffer to read into or the data to write.
+// @param len: The length of the access, sec_off + len must not exceed the
+// sector size.
+// @param is_read: If true, read from the sector, otherwise update the sector
+// with the content of `buf`.
+// @return: `len` on success, 0 otherwise.
+static size_t partial_sector_update(struct disk * const disk,
+                                    sector_t const sector,
+                                    uint32_t const sec_off,
+                                    uint8_t * const buf,
+                                    size_t const len,
+                                    bool const is_read) {
+    uint32_t const sector_size = disk->ops->sector_size(disk);
+    ASSERT(sec_off + len <= sector_size);
 
-        ASSERT(start_offset < sector_size);
-        ASSERT(written <= len);
+    uint8_t * const sector_data = kmalloc(sector_size);
+    // FIXME: Not sure if we should return 0 here or an error code (-1 ?).
+    TODO_PROPAGATE_ERROR(!sector_data);
 
-        uint32_t const remaining = len - written;
-        size_t const copy_len = min_u32(remaining, sector_size - start_offset);
-        memcpy(buf + written, sector_data + start_offset, copy_len);
-        written += copy_len;
+    size_t res = 0;
+    // Even a write needs to read the sector first since it is only partially
+    // updated.
+    if (read_sector(disk, sector, sector_data) == sector_size) {
+        if (is_read) {
+            memcpy(buf, sector_data + sec_off, len);
+            res = len;
+        } else {
+            memcpy(sector_data + sec_off, buf, len);
+            bool const ok = write_sector(disk, sector, sector_data)
+                == sector_size;
+            res = ok ? len : 0;
+        }
     }
     kfree(sector_data);
-    return written;
+    return res;
 }
 
-size_t disk_write(struct disk * const disk,
-                  off_t const offset,
-                  uint8_t const * const buf,
-                  size_t const len) {
+// Read or write a range of bytes on a disk. Only the unaligned head and tail
+// of the range go through a bounce buffer, the sectors in between are
+// transferred directly from/to the buffer.
+// @param disk: The disk.
+// @param offset: The offset of the range on the disk.
+// @param buf: The buffer to read into or the data to write.
+// @param len: The length of the range.
+// @param is_read: If true, read the range, otherwise write it.
+// @return: The number of bytes read or written.
+static size_t disk_update(struct disk * const disk,
+                          off_t const offset,
+                          uint8_t * const buf,
+                          size_t const len,
+                          bool const is_read) {
     if (!len) {
-        // Empty write optimization.
+        // Empty access optimization.
         return 0;
     }
 
     uint32_t const sector_size = disk->ops->sector_size(disk);
-    sector_t const start_sector = offset_to_sector(offset, sector_size);
-    sector_t const end_sector = offset_to_sector(offset + len - 1, sector_size);
+    sector_t sector = offset_to_sector(offset, sector_size);
+    size_t done = 0;
+
+    // Unaligned head, or an access smaller than a sector.
+    uint32_t const head_off = offset - sector_to_offset(sector, sector_size);
+    if (head_off || len < sector_size) {
+        size_t const head_len = min_u32(len, sector_size - head_off);
+        size_t const res = partial_sector_update(disk, sector, head_off, buf,
+                                                 head_len, is_read);
+        if (res != head_len) {
+            return 0;
+        }
+        done += res;
+        sector++;
+    }
 
-    // The number of bytes written onto disk.
-    uint32_t written = 0;
-
-    for (sector_t sector = start_sector; sector <= end_sector; ++sector) {
-        if ((sector == start_sector && offset % sector_size != 0) ||
-            (sector == end_sector && (offset + len) % sector_size != 0)) {
-            // The first and last sectors might need a partial update, which is
-            // only possible by reading the sector and writting it back again.
-
-            // Read the current data on the sector.
-            uint8_t * const curr = kmalloc(sector_size);
-            TODO_PROPAGATE_ERROR(!curr);
-            uint32_t const read = disk->ops->read_sector(disk, sector, curr);
-            if (read != sector_size) {
-                // We failed to read the sector to update it, this could happen
-                // if the write tries to write outside the boundaries of the
-                // disk. Just abort now.
-                kfree(curr);
-                break;
-            }
-
-            // Compute the offset and length to use when moving data from the
-            // buffer to `curr`.
-            off_t const sec_start_off = sector_to_offset(sector, sector_size);
-            off_t const next_start_off = sector_to_offset(sector + 1,
-                                                          sector_size);
-            uint32_t const c_off = offset + written - sec_start_off;
-            uint32_t const cpy_len =
-                min_u32(next_start_off - (sec_start_off+c_off), len - written);
-
-            // Update the `curr`.
-            memcpy(curr + c_off, buf + written, cpy_len);
-
-            // Write back the updated sector onto the disk.
-            uint32_t const res = disk->ops->write_sector(disk, sector, curr);
-            kfree(curr);
-            if (res != sector_size) {
-                // Having an error in the middle of the write should abort.
-                break;
-            }
-
-            // The "effective" amount of written bytes is the number of bytes
-            // that were overwritten in the current sector NOT the returned
-            // value from write_sector since we may have updated the sector
-            // partially.
-            written += cpy_len;
+    // Aligned middle.
+    uint32_t const num_full = (len - done) / sector_size;
+    if (num_full) {
+        size_t res;
+        if (is_read) {
+            res = read_sectors(disk, sector, num_full, buf + done);
         } else {
-            // All sectors between the first and last will receive a full
-            // update.
-            uint8_t const * const data = buf + written;
-            ASSERT(data < buf + len);
-            ASSERT(data + sector_size <= buf + len);
-            uint32_t const res = disk->ops->write_sector(disk, sector, data);
-            written += res;
-            if (res != sector_size) {
-                // Having an error in the middle of the write should abort.
-                break;
-            }
+            res = write_sectors(disk, sector, num_full, buf + done);
+        }
+        done += res;
+        if (res != num_full * sector_size) {
+            // Reached the end of the disk or an error.
+            return done;
         }
+        sector += num_full;
+    }
+
+    // Unaligned tail.
+    if (done < len) {
+        size_t const tail_len = len - done;
+        ASSERT(tail_len < sector_size);
+        done += partial_sector_update(disk, sector, 0, buf + done, tail_len,
+                                      is_read);
     }
-    return written;
+    return done;
+}
+
+size_t disk_read(struct disk * const disk,
+                 off_t const offset,
+                 uint8_t * const buf,
+                 size_t const len) {
+    return disk_update(disk, offset, buf, len, true);
+}
+
+size_t disk_write(struct disk * const disk,
+                  off_t const offset,
+                  uint8_t const * const buf,
+                  size_t const len) {
+    return disk_update(disk, offset, (uint8_t*)buf, len, false);
 }
 
 #include <disk.test>
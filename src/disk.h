@@ -1,5 +1,6 @@
 #pragma once
 #include <types.h>
+#include <blk_queue.h>
 
 // This file defines generic functions for disk devices.
 // Two structures are at play when reading from a disk device:
@@ -44,6 +45,44 @@ struct disk_ops {
     uint32_t (*write_sector)(struct disk * const disk,
                              sector_t const sector_index,
                              uint8_t const * const buf);
+
+    // Read consecutive sectors from the disk in a single operation. This
+    // operation is optional and may be NULL, in which case read_sector() is
+    // called for each sector.
+    // @param disk: The disk.
+    // @param start: The index of the first sector to read.
+    // @param count: The number of sectors to read.
+    // @param buf: The buffer to read into, of size >= count * sector size.
+    // @return: The number of bytes successfully read, a multiple of the sector
+    // size. Less than count sectors are read if the end of the disk is reached.
+    uint32_t (*read_sectors)(struct disk * const disk,
+                             sector_t const start,
+                             uint32_t const count,
+                             uint8_t * const buf);
+
+    // Write consecutive sectors to the disk in a single operation. This
+    // operation is optional and may be NULL, in which case write_sector() is
+    // called for each sector.
+    // @param disk: The disk.
+    // @param start: The index of the first sector to write.
+    // @param count: The number of sectors to write.
+    // @param buf: The data to write, of size >= count * sector size.
+    // @return: The number of bytes successfully written, a multiple of the
+    // sector size.
+    uint32_t (*write_sectors)(struct disk * const disk,
+                              sector_t const start,
+                              uint32_t const count,
+                              uint8_t const * const buf);
+
+    // Get the address at which the content of a sector can be accessed
+    // directly in memory. This operation is optional and may be NULL, it only
+    // makes sense for disks backed by memory.
+    // @param disk: The disk.
+    // @param sector_index: The index of the sector.
+    // @return: The address of the sector's data, valid as long as the disk
+    // exists. NULL if the sector is out of the bounds of the disk.
+    void *(*get_sector_ptr)(struct disk * const disk,
+                            sector_t const sector_index);
 };
 
 // Struct representing a disk on the system. Unlike disk_ops, there is one
@@ -54,6 +93,19 @@ struct disk {
 
     // Additional data available for the driver.
     void * driver_private;
+
+    // If true, sectors of this disk are accessed through the block cache. See
+    // block_cache.h.
+    bool cache_enabled;
+
+    // Additional data available for the filesystem mounted on this disk. NULL
+    // if the disk is not mounted or if the filesystem does not use it.
+    void * fs_private;
+
+    // The request queue of the disk. Accesses to the disk that do not go
+    // through the block cache are sent to the driver through this queue. See
+    // blk_queue.h.
+    struct blk_queue queue;
 };
 
 // Read data from a disk.
@@ -78,5 +130,35 @@ size_t disk_write(struct disk * const disk,
                   uint8_t const * const buf,
                   size_t const len);
 
+// Get a pointer to a range of bytes of a disk that is directly accessible in
+// memory, avoiding a copy. This requires the disk to support get_sector_ptr(),
+// the range to be contiguous in memory and the block cache to be disabled on
+// the disk (otherwise the memory might not contain the latest data).
+// @param disk: The disk.
+// @param offset: The offset of the range on the disk.
+// @param len: The length of the range in bytes.
+// @return: The address of the first byte of the range, NULL if the range cannot
+// be accessed directly.
+void const *disk_get_ptr(struct disk * const disk,
+                         off_t const offset,
+                         size_t const len);
+
+// Start caching the sectors of a disk in the block cache. All subsequent
+// disk_read() and disk_write() on this disk go through the cache.
+// @param disk: The disk.
+void disk_enable_cache(struct disk * const disk);
+
+// Stop caching the sectors of a disk. Dirty sectors are written back and all
+// the sectors of the disk are removed from the block cache. Must be called
+// before deleting a disk that has its cache enabled.
+// @param disk: The disk.
+void disk_disable_cache(struct disk * const disk);
+
+// Write all the modified sectors of a disk that are in the block cache back to
+// the disk. This is a no-op if the cache is not enabled on the disk.
+// @param disk: The disk to flush.
+// @return: true on success, false if some sectors could not be written.
+bool disk_flush(struct disk * const disk);
+
 // Execute disk related tests.
 void disk_test(void);
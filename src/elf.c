@@ -1,11 +1,9 @@
 #include <elf.h>
 #include <debug.h>
 #include <vfs.h>
-#include <kmalloc.h>
 #include <memory.h>
 #include <paging.h>
-#include <math.h>
-#include <frame_alloc.h>
+#include <addr_space.h>
 #include <error.h>
 
 // Typedef all the types per the ELF specification.
@@ -216,36 +214,51 @@ static uint32_t segment_flags_to_paging_flags(elf32_word_t const flags) {
     return paging_flags;
 }
 
-// Read the ELF header from a file.
-// @param file: The file to read from.
-// @param dst: The destination to read the header into.
-static void read_elf_header(struct file * const file, struct elf32_ehdr * dst) {
-    size_t const read = vfs_read(file, 0x0, (uint8_t*)dst, sizeof(*dst));
-    ASSERT(read == sizeof(*dst));
-    ASSERT(check_elf_header(dst));
+// Access a range of bytes of a file. When the file's content is directly
+// accessible in memory (e.g. initrd files) the range is accessed in place,
+// otherwise it is read into a buffer.
+// @param file: The file to access.
+// @param offset: The offset of the range in the file.
+// @param buf: The buffer to read the range into if it cannot be accessed in
+// place.
+// @param len: The length of the range.
+// @return: The address of the range's data, either in the file's memory or
+// `buf`.
+static void const *access_file(struct file * const file,
+                               off_t const offset,
+                               void * const buf,
+                               size_t const len) {
+    void const * const ptr = vfs_mmap_readonly(file, offset, len);
+    if (ptr) {
+        return ptr;
+    }
+    size_t const read = vfs_read(file, offset, buf, len);
+    ASSERT(read == len);
+    return buf;
 }
 
-// Compute the number of frames/pages needed to hold a memory range.
-// @param start: Pointer on the first byte of the memory range.
-// @param end: Pointer on the last byte of the memory range.
-// @return: The number of frames/pages required to hold that range.
-static size_t get_required_num_frames(void const * const start,
-                                      void const * const end) {
-    ASSERT(start < end);
-    void const * const start_page = get_page_addr(start);
-    void const * const end_page = get_page_addr(end);
-    size_t const diff = (uint32_t)(end_page - start_page);
-    ASSERT(!(diff % PAGE_SIZE));
-    return (diff / PAGE_SIZE) + 1;
+// Get the ELF header of a file.
+// @param file: The file to read from.
+// @param buf: The buffer to read the header into, if it cannot be accessed in
+// place.
+// @return: The address of the header.
+static struct elf32_ehdr const *get_elf_header(struct file * const file,
+                                               struct elf32_ehdr * const buf) {
+    struct elf32_ehdr const * const hdr =
+        access_file(file, 0x0, buf, sizeof(*buf));
+    ASSERT(check_elf_header(hdr));
+    return hdr;
 }
 
-// Process a program header from an ELF. This function will copy the content of
-// the segment described by the program header into the proc's address space.
+// Process a program header from an ELF. The segment described by the program
+// header is added as a lazy segment of the proc's address space: its pages are
+// allocated and read from the file upon their first access, see
+// addr_space_add_segment().
 // @param file: The ELF file.
 // @param proc: The process to load the ELF into.
 // @param elf_hdr: The ELF header of the file.
 // @param prog_hdr: The program header to be processed.
-// @return: true if the program header has been successfully loaded to the
+// @return: true if the program header has been successfully added to the
 // process' address space, false otherwise.
 static bool process_program_header(struct file * const file,
                                    struct proc * const proc,
@@ -258,145 +271,71 @@ static bool process_program_header(struct file * const file,
     // This should always be the case since ELFs are targeting i386.
     ASSERT(prog_hdr->align == PAGE_SIZE);
 
-    // This function is supposed to be called while being in the address space
-    // of the process.
-    ASSERT(get_curr_addr_space() == proc->addr_space);
-
-    // Start and end addresses of the segment in virtual memory.
-    void const * const segment_start = prog_hdr->vaddr;
-    void const * const segment_end = segment_start + prog_hdr->memsz - 1;
-
-    // Allocate physical frames for this segment.
-    size_t const nframes = get_required_num_frames(segment_start, segment_end);
-    void **frames = kmalloc(nframes * sizeof(*frames));
-    if (!frames) {
-        SET_ERROR("Cannot alloc dyn memory to load ELF program header", ENONE);
-        return false;
-    }
-
-    for (uint32_t i = 0; i < nframes; ++i) {
-        frames[i] = alloc_frame();
-        if (frames[i] == NO_FRAME) {
-            for (uint32_t j = 0; j < i; ++j) {
-                free_frame(frames[j]);
-            }
-            SET_ERROR("Cannot alloc physical frame to load ELF prog hdr", ENONE);
-            kfree(frames);
-            return false;
-        }
-    }
-
-    // ELF and paging do not share the same flags for access permissions. We
-    // need to translate them.
-    uint32_t const map_flags = segment_flags_to_paging_flags(prog_hdr->flags);
-
-    // Map the frames to where the segment should reside in memory.
-    void * const first_page = get_page_addr(segment_start);
-    void * const mapped = paging_map_frames_above(first_page,
-                                                  frames,
-                                                  nframes,
-                                                  map_flags);
-    if (mapped == NO_REGION) {
-        SET_ERROR("Failed to map ELF prog header to proc address space", ENONE);
-        goto fail_first_map_above;
-    }
-    // FIXME: We could map the frames one by one to make sure that they are
-    // mapped at the right virt address. Using paging_map_frames_above_in() is
-    // shorter be we could end up in a situation where the mapped address is not
-    // the one requested, hence the ASSERT() below.
-    ASSERT(mapped == first_page);
-
-    // Copy the data to the process' virtual memory. FIXME: Since there is no
-    // easy way to change the access permissions of a mapped virtual memory
-    // range, we need to re-map the frames with VM_WRITE permissions in order to
-    // do the copy.
-    void * const write_map = paging_map_frames_above(0x0,
-                                                     frames,
-                                                     nframes,
-                                                     VM_NON_GLOBAL | VM_WRITE);
-    if (write_map == NO_REGION) {
-        SET_ERROR("Failed to map ELF prog header to proc address space", ENONE);
-        goto fail_second_map_above;
-    }
-
-    // Copy the initialized segment data from the file.
-    off_t const offset = prog_hdr->offset;
-    size_t const len = prog_hdr->filesz;
-    void * const dest = write_map + (segment_start - first_page);
-    size_t const written = vfs_read(file, offset, dest, len);
-    ASSERT(written == prog_hdr->filesz);
-
     // In some cases the size of the segment as it appear in the file is
     // different than what its size should be in memory. This is the case for
     // uninitialized memory for instance. In this case, the ELF specification
-    // requires the memory after the initialized segment data to be zeroed.
+    // requires the memory after the initialized segment data to be zeroed,
+    // which is taken care of by the page fault handler.
     ASSERT(prog_hdr->memsz >= prog_hdr->filesz);
-    if (prog_hdr->filesz != prog_hdr->memsz) {
-        memzero(dest + written, prog_hdr->memsz - len);
+    if (!prog_hdr->memsz) {
+        return true;
     }
 
-    // Clean up the mapping used for copying.
-    paging_unmap(write_map, nframes * PAGE_SIZE);
-    kfree(frames);
-    return true;
+    // ELF and paging do not share the same flags for access permissions. We
+    // need to translate them.
+    uint32_t const map_flags = segment_flags_to_paging_flags(prog_hdr->flags);
 
-fail_second_map_above:
-    paging_unmap(mapped, nframes * PAGE_SIZE);
-fail_first_map_above:
-    for (uint32_t i = 0; i < nframes; ++i) {
-        free_frame(frames[i]);
+    if (!addr_space_add_segment(proc->addr_space, prog_hdr->vaddr,
+        prog_hdr->memsz, file, prog_hdr->offset, prog_hdr->filesz,
+        map_flags)) {
+        SET_ERROR("Failed to add ELF prog header to proc address space", ENONE);
+        return false;
     }
-    kfree(frames);
-    return false;
+    return true;
 }
 
-// Read a program header from a ELF file.
+// Get a program header from a ELF file.
 // @param file: The ELF file to read from.
 // @param elf_hdr: The ELF header of the file.
 // @param index: The index of the program header to be read.
-// @param dst: The destination to read the program header into.
-static void read_program_header(struct file * const file,
-                                struct elf32_ehdr const * const elf_hdr,
-                                uint32_t const index,
-                                struct elf32_phdr * const dst) {
+// @param buf: The buffer to read the program header into, if it cannot be
+// accessed in place.
+// @return: The address of the program header.
+static struct elf32_phdr const *get_program_header(
+    struct file * const file,
+    struct elf32_ehdr const * const elf_hdr,
+    uint32_t const index,
+    struct elf32_phdr * const buf) {
     ASSERT(index < elf_hdr->phnum);
     off_t const offset = elf_hdr->phoff + index * elf_hdr->phentsize;
-    size_t const r = vfs_read(file, offset, (uint8_t*)dst, sizeof(*dst));
-    ASSERT(r == sizeof(*dst));
+    return access_file(file, offset, buf, sizeof(*buf));
 }
 
 bool load_elf_binary(struct file * const file, struct proc * const proc) {
     ASSERT(file);
 
-    // Read ELF header from the file.
-    struct elf32_ehdr header;
-    read_elf_header(file, &header);
-
-    // To make copying the segments easier, temporarily switch to the process'
-    // address space.
-    switch_to_addr_space(proc->addr_space);
+    // Get the ELF header from the file.
+    struct elf32_ehdr header_buf;
+    struct elf32_ehdr const * const header = get_elf_header(file, &header_buf);
 
     // Process each program header.
-    for (elf32_half_t i = 0; i < header.phnum; ++i) {
-        struct elf32_phdr phdr;
-
-        read_program_header(file, &header, i, &phdr);
-        if (!process_program_header(file, proc, &header, &phdr)) {
+    for (elf32_half_t i = 0; i < header->phnum; ++i) {
+        struct elf32_phdr phdr_buf;
+        struct elf32_phdr const * const phdr =
+            get_program_header(file, header, i, &phdr_buf);
+        if (!process_program_header(file, proc, header, phdr)) {
             // Ideally, we should undo the mapping of the other headers until
             // now. However this would require re-parsing the whole thing. There
             // is not much to benefit from doing that, this process is likely to
             // be thrown away if we can't load the whole ELF anyway, this will
             // take care of the section that got loaded.
-            switch_to_addr_space(get_kernel_addr_space());
             SET_ERROR("Could not map ELF prog header into process", ENONE);
             return false;
         }
     }
 
-    switch_to_addr_space(get_kernel_addr_space());
-
     // Set the EIP to the entry point of the program.
-    proc->registers.eip = (reg_t)header.entry;
+    proc->registers.eip = (reg_t)header->entry;
 
     proc->state_flags &= ~PROC_WAITING_EIP;
     return true;
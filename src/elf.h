@@ -6,7 +6,10 @@
 // linking is not yet supported.
 
 // Load an ELF binary into a process' address space and update the EIP of the
-// process to point to the entry point specified by the ELF.
+// process to point to the entry point specified by the ELF. The segments are
+// loaded on demand: a page is only allocated and read from the file upon its
+// first access. A reference on the file is kept until the address space of the
+// process is deleted.
 // @param path: File path to the ELF to be loaded.
 // @param proc: The proc in which the ELF should be loaded.
 // @return: true if the ELF binary has successfully been loaded into the
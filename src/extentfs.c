@@ -0,0 +1,963 @@
+#include <extentfs.h>
+#include <debug.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <math.h>
+#include <memory.h>
+#include <fs.h>
+#include <disk.h>
+#include <mutex.h>
+#include <spinlock.h>
+
+// Spells "EXTF" on disk.
+#define EXTENTFS_MAGIC  0x46545845
+
+// The superblock, stored at the beginning of block 0.
+struct extentfs_super {
+    // Must be EXTENTFS_MAGIC.
+    uint32_t magic;
+    // The size of the filesystem in blocks.
+    uint32_t num_blocks;
+    // The first block of the block bitmap and its length in blocks.
+    uint32_t bitmap_start;
+    uint32_t bitmap_blocks;
+    // The first block of the inode table and the number of inodes it holds.
+    uint32_t inodes_start;
+    uint32_t num_inodes;
+    // The first block of the directory and the number of entries it holds,
+    // always a power of two.
+    uint32_t dir_start;
+    uint32_t dir_slots;
+    // The first data block.
+    uint32_t data_start;
+} __attribute__((packed));
+
+// A run of contiguous blocks.
+struct extent {
+    uint32_t start;
+    uint32_t len;
+} __attribute__((packed));
+
+// An inode, describing a file. Inode 0 is never used so that a NUL inode
+// number can mark a free directory entry.
+struct extentfs_inode {
+    // The size of the file in bytes.
+    uint64_t size;
+    // Non-zero if this inode is in use.
+    uint32_t used;
+    // The number of valid entries in `extents`.
+    uint32_t num_extents;
+    // The blocks of the file, in file order.
+    struct extent extents[EXTENTFS_INODE_EXTENTS];
+} __attribute__((packed));
+STATIC_ASSERT(sizeof(struct extentfs_inode) == 128, "");
+
+// The number of inodes per block of the inode table.
+#define INODES_PER_BLOCK    (EXTENTFS_BLOCK_SIZE / sizeof(struct extentfs_inode))
+
+// The inode number of a directory entry that was deleted. Lookups must probe
+// past such entries while insertions can reuse them.
+#define DIR_TOMBSTONE   0xFFFFFFFF
+
+// An entry of the directory.
+struct extentfs_dirent {
+    // The inode of the file, 0 if the entry was never used.
+    uint32_t ino;
+    // The path of the file, NUL terminated.
+    char path[EXTENTFS_MAX_PATH_LEN + 1];
+} __attribute__((packed));
+STATIC_ASSERT(sizeof(struct extentfs_dirent) == 64, "");
+
+// The in-memory state of a mounted extent filesystem, pointed to by the
+// fs_private field of the disk.
+struct extentfs {
+    // The number of times the disk has been mounted. The state is freed when
+    // the last mount is removed.
+    uint32_t mount_count;
+    // Protects the bitmaps, the inode table and the directory. This is a mutex
+    // as disk accesses are made while holding it.
+    struct mutex lock;
+    // A copy of the superblock.
+    struct extentfs_super super;
+    // A copy of the on-disk block bitmap, written back on every change.
+    uint32_t * block_bitmap;
+    // The number of free blocks.
+    uint32_t free_blocks;
+    // The block from which to look for free blocks when the goal of an
+    // allocation is not available.
+    uint32_t alloc_hint;
+    // One bit per inode, set if the inode is in use. This is built from the
+    // inode table when mounting.
+    uint32_t * inode_bitmap;
+};
+
+// Each opened file uses the fs_private field to point to the following struct.
+// The inode is only written by extentfs_write(), which is called with the
+// file's write lock held.
+struct extentfs_file {
+    // The inode number of the file.
+    uint32_t ino;
+    // A copy of the inode of the file.
+    struct extentfs_inode inode;
+};
+
+// Get the offset of a block on disk.
+// @param block: The index of the block.
+// @return: The offset of the first byte of the block.
+static off_t block_offset(uint32_t const block) {
+    return (off_t)block * EXTENTFS_BLOCK_SIZE;
+}
+
+// Get the value of a bit in an array of words.
+// @param words: The array.
+// @param idx: The index of the bit.
+// @return: true if the bit is set.
+static bool bit_get(uint32_t const * const words, uint32_t const idx) {
+    return words[idx / 32] & (1U << (idx % 32));
+}
+
+// Set or clear a bit in an array of words.
+// @param words: The array.
+// @param idx: The index of the bit.
+// @param val: The new value of the bit.
+static void bit_assign(uint32_t * const words,
+                       uint32_t const idx,
+                       bool const val) {
+    if (val) {
+        words[idx / 32] |= (1U << (idx % 32));
+    } else {
+        words[idx / 32] &= ~(1U << (idx % 32));
+    }
+}
+
+// Read an inode from the inode table.
+// @param disk: The disk.
+// @param super: The superblock of the disk.
+// @param ino: The inode number.
+// @param inode: The struct extentfs_inode to read into.
+// @return: true on success, false otherwise.
+static bool read_inode(struct disk * const disk,
+                       struct extentfs_super const * const super,
+                       uint32_t const ino,
+                       struct extentfs_inode * const inode) {
+    ASSERT(ino && ino < super->num_inodes);
+    off_t const off = block_offset(super->inodes_start) + ino * sizeof(*inode);
+    return disk_read(disk, off, (uint8_t*)inode, sizeof(*inode)) ==
+        sizeof(*inode);
+}
+
+// Write an inode to the inode table. The caller must hold the lock of the
+// filesystem, since neighbouring inodes share the same sectors.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param ino: The inode number.
+// @param inode: The content of the inode.
+// @return: true on success, false otherwise.
+static bool write_inode(struct disk * const disk,
+                        struct extentfs * const fs,
+                        uint32_t const ino,
+                        struct extentfs_inode const * const inode) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    ASSERT(ino && ino < fs->super.num_inodes);
+    off_t const off =
+        block_offset(fs->super.inodes_start) + ino * sizeof(*inode);
+    return disk_write(disk, off, (uint8_t const*)inode, sizeof(*inode)) ==
+        sizeof(*inode);
+}
+
+// Write the words of the in-memory block bitmap covering a range of blocks
+// back to the disk. The caller must hold the lock of the filesystem.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param start: The first block of the range.
+// @param len: The number of blocks in the range.
+static void flush_block_bitmap(struct disk * const disk,
+                               struct extentfs * const fs,
+                               uint32_t const start,
+                               uint32_t const len) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    uint32_t const first_word = start / 32;
+    uint32_t const last_word = (start + len - 1) / 32;
+    size_t const size = (last_word - first_word + 1) * sizeof(uint32_t);
+    off_t const off = block_offset(fs->super.bitmap_start) +
+        first_word * sizeof(uint32_t);
+    uint8_t const * const data = (uint8_t*)(fs->block_bitmap + first_word);
+    if (disk_write(disk, off, data, size) != size) {
+        WARN("Cannot write block bitmap of extent filesystem at %U\n", off);
+    }
+}
+
+// Find a free block, starting the search at the allocation hint.
+// @param fs: The filesystem.
+// @return: The index of a free block, 0 if the filesystem is full.
+static uint32_t find_free_block(struct extentfs const * const fs) {
+    uint32_t const num_blocks = fs->super.num_blocks;
+    uint32_t const data_start = fs->super.data_start;
+    for (uint32_t pass = 0; pass < 2; ++pass) {
+        uint32_t block = pass ? data_start : fs->alloc_hint;
+        uint32_t const end = pass ? fs->alloc_hint : num_blocks;
+        while (block < end) {
+            if (!(block % 32) && fs->block_bitmap[block / 32] == 0xFFFFFFFF) {
+                // Skip full words.
+                block += 32;
+            } else if (!bit_get(fs->block_bitmap, block)) {
+                return block;
+            } else {
+                block++;
+            }
+        }
+    }
+    return 0;
+}
+
+// Allocate a run of contiguous blocks. The caller must hold the lock of the
+// filesystem.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param goal: The preferred first block of the run, used if it is free.
+// @param max: The maximum length of the run.
+// @param len[out]: The length of the allocated run, between 1 and max.
+// @return: The first block of the run, 0 if the filesystem is full.
+static uint32_t alloc_run(struct disk * const disk,
+                          struct extentfs * const fs,
+                          uint32_t const goal,
+                          uint32_t const max,
+                          uint32_t * const len) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    ASSERT(max);
+    uint32_t const num_blocks = fs->super.num_blocks;
+    uint32_t start = 0;
+    if (fs->super.data_start <= goal && goal < num_blocks &&
+        !bit_get(fs->block_bitmap, goal)) {
+        start = goal;
+    } else {
+        start = find_free_block(fs);
+        if (!start) {
+            return 0;
+        }
+    }
+
+    uint32_t n = 0;
+    while (n < max && start + n < num_blocks &&
+           !bit_get(fs->block_bitmap, start + n)) {
+        bit_assign(fs->block_bitmap, start + n, true);
+        n++;
+    }
+    fs->free_blocks -= n;
+    fs->alloc_hint = start + n < num_blocks ? start + n : fs->super.data_start;
+    flush_block_bitmap(disk, fs, start, n);
+    *len = n;
+    return start;
+}
+
+// Free a run of contiguous blocks. The caller must hold the lock of the
+// filesystem.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param start: The first block of the run.
+// @param len: The length of the run.
+static void free_run(struct disk * const disk,
+                     struct extentfs * const fs,
+                     uint32_t const start,
+                     uint32_t const len) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    for (uint32_t i = 0; i < len; ++i) {
+        ASSERT(bit_get(fs->block_bitmap, start + i));
+        bit_assign(fs->block_bitmap, start + i, false);
+    }
+    fs->free_blocks += len;
+    flush_block_bitmap(disk, fs, start, len);
+}
+
+// Get the number of blocks allocated to an inode.
+// @param inode: The inode.
+// @return: The sum of the length of its extents.
+static uint32_t inode_num_blocks(struct extentfs_inode const * const inode) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < inode->num_extents; ++i) {
+        n += inode->extents[i].len;
+    }
+    return n;
+}
+
+// Allocate blocks at the end of a file. The caller must hold the lock of the
+// filesystem.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param inode: The inode of the file. The inode is only updated in memory.
+// @param count: The number of blocks to add.
+// @return: The number of blocks added, less than count if the filesystem is
+// full or the inode ran out of extents.
+static uint32_t grow_inode(struct disk * const disk,
+                           struct extentfs * const fs,
+                           struct extentfs_inode * const inode,
+                           uint32_t const count) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    uint32_t added = 0;
+    while (added < count) {
+        struct extent * const last = inode->num_extents ?
+            inode->extents + inode->num_extents - 1 : NULL;
+        // Try to extend the last extent first.
+        uint32_t const goal = last ? last->start + last->len : fs->alloc_hint;
+        uint32_t len = 0;
+        uint32_t const start = alloc_run(disk, fs, goal, count - added, &len);
+        if (!start) {
+            break;
+        }
+        if (last && start == goal) {
+            last->len += len;
+        } else if (inode->num_extents < EXTENTFS_INODE_EXTENTS) {
+            struct extent * const new = inode->extents + inode->num_extents;
+            new->start = start;
+            new->len = len;
+            inode->num_extents++;
+        } else {
+            free_run(disk, fs, start, len);
+            break;
+        }
+        added += len;
+    }
+    return added;
+}
+
+// Find the location on disk of a byte of a file.
+// @param inode: The inode of the file.
+// @param pos: The offset of the byte within the file.
+// @param contig[out]: The number of bytes of the file starting at `pos` that
+// are contiguous on disk.
+// @return: The offset of the byte on disk, 0 if `pos` is beyond the blocks of
+// the file.
+static off_t map_pos(struct extentfs_inode const * const inode,
+                     off_t const pos,
+                     size_t * const contig) {
+    off_t ext_pos = 0;
+    for (uint32_t i = 0; i < inode->num_extents; ++i) {
+        struct extent const * const ext = inode->extents + i;
+        off_t const ext_len = block_offset(ext->len);
+        if (pos < ext_pos + ext_len) {
+            off_t const in_ext = pos - ext_pos;
+            *contig = min_u64(ext_len - in_ext, (size_t)-1);
+            return block_offset(ext->start) + in_ext;
+        }
+        ext_pos += ext_len;
+    }
+    return 0;
+}
+
+// Read or write a range of the blocks of a file, with one disk access per
+// extent covered by the range.
+// @param disk: The disk.
+// @param inode: The inode of the file.
+// @param offset: The offset of the range within the file.
+// @param buf: The buffer to read into or to write from.
+// @param len: The length of the range.
+// @param is_read: If true, read the range, otherwise write it.
+// @return: The number of bytes read or written.
+static size_t transfer(struct disk * const disk,
+                       struct extentfs_inode const * const inode,
+                       off_t const offset,
+                       uint8_t * const buf,
+                       size_t const len,
+                       bool const is_read) {
+    size_t done = 0;
+    while (done < len) {
+        size_t contig = 0;
+        off_t const disk_off = map_pos(inode, offset + done, &contig);
+        if (!disk_off) {
+            break;
+        }
+        size_t const n = min_u32(contig, len - done);
+        size_t const res = is_read ?
+            disk_read(disk, disk_off, buf + done, n) :
+            disk_write(disk, disk_off, buf + done, n);
+        done += res;
+        if (res != n) {
+            break;
+        }
+    }
+    return done;
+}
+
+// Write zeros to a range of the blocks of a file, used to fill the hole
+// created by a write past the end of the file.
+// @param disk: The disk.
+// @param inode: The inode of the file.
+// @param offset: The offset of the range within the file.
+// @param len: The length of the range.
+// @return: true on success, false otherwise.
+static bool zero_range(struct disk * const disk,
+                       struct extentfs_inode const * const inode,
+                       off_t const offset,
+                       off_t const len) {
+    uint8_t * const zeros = kmalloc(EXTENTFS_BLOCK_SIZE);
+    if (!zeros) {
+        return false;
+    }
+    memzero(zeros, EXTENTFS_BLOCK_SIZE);
+    off_t done = 0;
+    while (done < len) {
+        size_t const n = min_u64(len - done, EXTENTFS_BLOCK_SIZE);
+        if (transfer(disk, inode, offset + done, zeros, n, false) != n) {
+            break;
+        }
+        done += n;
+    }
+    kfree(zeros);
+    return done == len;
+}
+
+// Get the offset of a directory entry on disk.
+// @param super: The superblock.
+// @param slot: The index of the entry.
+// @return: The offset of the entry.
+static off_t dirent_offset(struct extentfs_super const * const super,
+                           uint32_t const slot) {
+    return block_offset(super->dir_start) +
+        slot * sizeof(struct extentfs_dirent);
+}
+
+// Look up a path in the directory. The caller must hold the lock of the
+// filesystem.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param path: The path to look up.
+// @param slot[out]: If the path is found, the index of its entry. Otherwise
+// the index of the first entry that can receive the path, or
+// fs->super.dir_slots if the directory is full.
+// @return: The inode of the file, 0 if the path is not in the directory.
+static uint32_t dir_lookup(struct disk * const disk,
+                           struct extentfs * const fs,
+                           char const * const path,
+                           uint32_t * const slot) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    uint32_t const num_slots = fs->super.dir_slots;
+    uint32_t const first = str_hash(path) & (num_slots - 1);
+    uint32_t free_slot = num_slots;
+    struct extentfs_dirent dirent;
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        uint32_t const s = (first + i) & (num_slots - 1);
+        off_t const off = dirent_offset(&fs->super, s);
+        if (disk_read(disk, off, (uint8_t*)&dirent, sizeof(dirent)) !=
+            sizeof(dirent)) {
+            break;
+        }
+        if (!dirent.ino) {
+            // The probe sequence of the path ends here.
+            if (free_slot == num_slots) {
+                free_slot = s;
+            }
+            break;
+        } else if (dirent.ino == DIR_TOMBSTONE) {
+            if (free_slot == num_slots) {
+                free_slot = s;
+            }
+        } else if (strneq(dirent.path, path, sizeof(dirent.path))) {
+            *slot = s;
+            return dirent.ino;
+        }
+    }
+    *slot = free_slot;
+    return 0;
+}
+
+// Write a directory entry. The caller must hold the lock of the filesystem.
+// @param disk: The disk.
+// @param fs: The filesystem.
+// @param slot: The index of the entry.
+// @param ino: The inode of the entry.
+// @param path: The path of the entry.
+// @return: true on success, false otherwise.
+static bool dir_write(struct disk * const disk,
+                      struct extentfs * const fs,
+                      uint32_t const slot,
+                      uint32_t const ino,
+                      char const * const path) {
+    ASSERT(mutex_is_locked(&fs->lock));
+    struct extentfs_dirent dirent;
+    memzero(&dirent, sizeof(dirent));
+    dirent.ino = ino;
+    memcpy(dirent.path, path, strlen(path));
+    off_t const off = dirent_offset(&fs->super, slot);
+    return disk_write(disk, off, (uint8_t*)&dirent, sizeof(dirent)) ==
+        sizeof(dirent);
+}
+
+// Read a file stored on an extent filesystem.
+// @param file: The file to read from.
+// @param offset: The offset to read from in the file.
+// @param buf: The buffer to read into.
+// @param len: The length of the buffer to read.
+// @return: The number of bytes read.
+static size_t extentfs_read(struct file * const file,
+                            off_t const offset,
+                            uint8_t * const buf,
+                            size_t const len) {
+    struct extentfs_file const * const data = file->fs_private;
+    uint64_t const size = data->inode.size;
+    if (offset >= size) {
+        return 0;
+    }
+    size_t const read_len = min_u64(size - offset, len);
+    return transfer(file->disk, &data->inode, offset, buf, read_len, true);
+}
+
+// Write a file stored on an extent filesystem, growing it if needed.
+// @param file: The file to write to.
+// @param offset: The offset to write to in the file.
+// @param buf: The buffer containing the data to be written.
+// @param len: The length of the buffer to write.
+// @return: The number of bytes written. This is less than len if the
+// filesystem is full.
+static size_t extentfs_write(struct file * const file,
+                             off_t const offset,
+                             uint8_t const * const buf,
+                             size_t const len) {
+    struct disk * const disk = file->disk;
+    struct extentfs * const fs = disk->fs_private;
+    struct extentfs_file * const data = file->fs_private;
+    struct extentfs_inode * const inode = &data->inode;
+    if (!fs || !len) {
+        return 0;
+    }
+
+    // Only the allocation needs the lock of the filesystem, the blocks of the
+    // file belong to it alone.
+    off_t const end = offset + len;
+    off_t capacity = block_offset(inode_num_blocks(inode));
+    if (end > capacity) {
+        uint32_t const missing =
+            (end - capacity + EXTENTFS_BLOCK_SIZE - 1) / EXTENTFS_BLOCK_SIZE;
+        mutex_lock(&fs->lock);
+        grow_inode(disk, fs, inode, missing);
+        mutex_unlock(&fs->lock);
+        capacity = block_offset(inode_num_blocks(inode));
+    }
+
+    size_t res = 0;
+    if (offset < capacity) {
+        uint64_t const old_size = inode->size;
+        if (offset <= old_size || zero_range(disk, inode, old_size,
+                                             offset - old_size)) {
+            size_t const write_len = min_u64(len, capacity - offset);
+            res = transfer(disk, inode, offset, (uint8_t*)buf, write_len,
+                           false);
+            inode->size = max_u64(old_size, offset + res);
+        }
+    }
+    if (res != len) {
+        WARN("Short write on extent filesystem: %u/%u bytes to %s\n", res,
+             len, file->abs_path);
+    }
+
+    // The blocks allocated above are recorded in the inode even if the write
+    // failed, so that they are not leaked.
+    mutex_lock(&fs->lock);
+    if (!write_inode(disk, fs, data->ino, inode)) {
+        WARN("Cannot write inode %u of %s\n", data->ino, file->abs_path);
+    }
+    mutex_unlock(&fs->lock);
+    return res;
+}
+
+// Get a pointer to the content of a file stored on an extent filesystem, if
+// the disk is directly accessible in memory and the range is contiguous on
+// disk.
+// @param file: The file.
+// @param offset: The offset of the first byte to access within the file.
+// @param len: The number of bytes to access.
+// @return: The address of the data or NULL.
+static void const *extentfs_map_readonly(struct file * const file,
+                                         off_t const offset,
+                                         size_t const len) {
+    struct extentfs_file const * const data = file->fs_private;
+    uint64_t const size = data->inode.size;
+    if (!len || offset >= size || len > size - offset) {
+        return NULL;
+    }
+    size_t contig = 0;
+    off_t const disk_off = map_pos(&data->inode, offset, &contig);
+    if (!disk_off || contig < len) {
+        return NULL;
+    }
+    return disk_get_ptr(file->disk, disk_off, len);
+}
+
+// The file operations on an extent filesystem.
+static struct file_ops extentfs_file_ops = {
+    .read = extentfs_read,
+    .write = extentfs_write,
+    .map_readonly = extentfs_map_readonly,
+};
+
+// Read the superblock of a disk.
+// @param disk: The disk.
+// @param super: The struct extentfs_super to read into.
+// @return: true if the disk contains a valid superblock, false otherwise.
+static bool read_super(struct disk * const disk,
+                       struct extentfs_super * const super) {
+    if (disk_read(disk, 0, (uint8_t*)super, sizeof(*super)) !=
+        sizeof(*super)) {
+        return false;
+    }
+    return super->magic == EXTENTFS_MAGIC &&
+        super->num_inodes && super->dir_slots &&
+        !(super->dir_slots & (super->dir_slots - 1)) &&
+        super->data_start <= super->num_blocks;
+}
+
+// Detect if a disk uses an extent filesystem.
+// @param disk: The disk to test.
+// @return: true if `disk` is using an extent filesystem, false otherwise.
+static bool extentfs_detect_fs(struct disk * const disk) {
+    struct extentfs_super super;
+    return read_super(disk, &super);
+}
+
+// Load the state of a filesystem from its disk.
+// @param disk: The disk.
+// @return: The state, NULL if the disk could not be read or memory could not be
+// allocated.
+static struct extentfs *extentfs_load(struct disk * const disk) {
+    struct extentfs * const fs = kmalloc(sizeof(*fs));
+    if (!fs) {
+        return NULL;
+    }
+    if (!read_super(disk, &fs->super)) {
+        kfree(fs);
+        return NULL;
+    }
+    struct extentfs_super const * const super = &fs->super;
+    size_t const bitmap_size =
+        ceil_x_over_y_u32(super->num_blocks, 32) * sizeof(uint32_t);
+    size_t const inode_bitmap_size =
+        ceil_x_over_y_u32(super->num_inodes, 32) * sizeof(uint32_t);
+    fs->block_bitmap = kmalloc(bitmap_size);
+    fs->inode_bitmap = kmalloc(inode_bitmap_size);
+    struct extentfs_inode * const inodes = kmalloc(EXTENTFS_BLOCK_SIZE);
+    bool ok = fs->block_bitmap && fs->inode_bitmap && inodes;
+
+    ok = ok && disk_read(disk, block_offset(super->bitmap_start),
+                         (uint8_t*)fs->block_bitmap, bitmap_size) ==
+        bitmap_size;
+    if (ok) {
+        fs->free_blocks = 0;
+        for (uint32_t i = 0; i < super->num_blocks; ++i) {
+            fs->free_blocks += !bit_get(fs->block_bitmap, i);
+        }
+        memzero(fs->inode_bitmap, inode_bitmap_size);
+        // Inode 0 is reserved.
+        bit_assign(fs->inode_bitmap, 0, true);
+    }
+
+    for (uint32_t ino = 0; ok && ino < super->num_inodes; ++ino) {
+        uint32_t const idx = ino % INODES_PER_BLOCK;
+        if (!idx) {
+            off_t const off = block_offset(super->inodes_start) +
+                ino * sizeof(*inodes);
+            ok = disk_read(disk, off, (uint8_t*)inodes, EXTENTFS_BLOCK_SIZE) ==
+                EXTENTFS_BLOCK_SIZE;
+        }
+        if (ok && inodes[idx].used) {
+            bit_assign(fs->inode_bitmap, ino, true);
+        }
+    }
+    kfree(inodes);
+
+    if (!ok) {
+        kfree(fs->block_bitmap);
+        kfree(fs->inode_bitmap);
+        kfree(fs);
+        return NULL;
+    }
+    fs->mount_count = 0;
+    fs->alloc_hint = super->data_start;
+    mutex_init(&fs->lock);
+    return fs;
+}
+
+// Serializes extentfs_mount() and extentfs_unmount(), which may be called
+// concurrently on the same disk.
+static DECLARE_SPINLOCK(EXTENTFS_MOUNT_LOCK);
+
+// Load the state of an extent filesystem when its disk is mounted.
+// @param disk: The disk being mounted.
+// @return: true on success, false otherwise.
+static bool extentfs_mount(struct disk * const disk) {
+    // Loading reads the disk, which may block, hence it is done outside of the
+    // lock and the result discarded if another mount won the race.
+    spinlock_lock(&EXTENTFS_MOUNT_LOCK);
+    struct extentfs * fs = disk->fs_private;
+    if (fs) {
+        fs->mount_count++;
+        spinlock_unlock(&EXTENTFS_MOUNT_LOCK);
+        return true;
+    }
+    spinlock_unlock(&EXTENTFS_MOUNT_LOCK);
+
+    struct extentfs * const new = extentfs_load(disk);
+    if (!new) {
+        return false;
+    }
+
+    spinlock_lock(&EXTENTFS_MOUNT_LOCK);
+    fs = disk->fs_private;
+    if (!fs) {
+        fs = new;
+        disk->fs_private = fs;
+    }
+    fs->mount_count++;
+    spinlock_unlock(&EXTENTFS_MOUNT_LOCK);
+
+    if (fs != new) {
+        kfree(new->block_bitmap);
+        kfree(new->inode_bitmap);
+        kfree(new);
+    }
+    return true;
+}
+
+// Free the state of an extent filesystem once it is not mounted anymore.
+// @param disk: The disk being unmounted.
+static void extentfs_unmount(struct disk * const disk) {
+    spinlock_lock(&EXTENTFS_MOUNT_LOCK);
+    struct extentfs * const fs = disk->fs_private;
+    ASSERT(fs && fs->mount_count);
+    bool const last = !--fs->mount_count;
+    if (last) {
+        disk->fs_private = NULL;
+    }
+    spinlock_unlock(&EXTENTFS_MOUNT_LOCK);
+
+    if (last) {
+        kfree(fs->block_bitmap);
+        kfree(fs->inode_bitmap);
+        kfree(fs);
+    }
+}
+
+// Initialize the FS specific fields of a file on an extent filesystem.
+// @param disk: The disk the file is stored on.
+// @param file: The struct file to initialize.
+// @param ino: The inode of the file.
+// @return: FS_SUCCESS if the inode was read and is in use, FS_NOT_FOUND
+// otherwise.
+static enum fs_op_res extentfs_init_opened_file(struct disk * const disk,
+                                                struct file * const file,
+                                                uint32_t const ino) {
+    struct extentfs const * const fs = disk->fs_private;
+    if (!ino || ino >= fs->super.num_inodes) {
+        return FS_NOT_FOUND;
+    }
+    struct extentfs_file * const data = kmalloc(sizeof(*data));
+    if (!data) {
+        return FS_NOT_FOUND;
+    }
+    data->ino = ino;
+    if (!read_inode(disk, &fs->super, ino, &data->inode) ||
+        !data->inode.used) {
+        kfree(data);
+        return FS_NOT_FOUND;
+    }
+    file->ops = &extentfs_file_ops;
+    file->fs_private = data;
+    file->fs_handle = ino;
+    return FS_SUCCESS;
+}
+
+// Open a file on an extent filesystem.
+// @param disk: The disk to open the file from.
+// @param file: The struct file to initialize.
+// @param path: The path of the file relative to the mount point.
+// @return: FS_SUCCESS if the file was opened, FS_NOT_FOUND otherwise.
+static enum fs_op_res extentfs_open_file(struct disk * const disk,
+                                         struct file * const file,
+                                         char const * const path) {
+    struct extentfs * const fs = disk->fs_private;
+    if (!fs) {
+        return FS_NOT_FOUND;
+    }
+    uint32_t slot = 0;
+    mutex_lock(&fs->lock);
+    uint32_t const ino = dir_lookup(disk, fs, path, &slot);
+    mutex_unlock(&fs->lock);
+    return ino ? extentfs_init_opened_file(disk, file, ino) : FS_NOT_FOUND;
+}
+
+// Open a file on an extent filesystem from its inode number, as found by a
+// previous extentfs_open_file(). This skips the directory lookup.
+// @param disk: The disk to open the file from.
+// @param file: The struct file to initialize.
+// @param path: The path of the file relative to the mount point.
+// @param handle: The inode of the file.
+// @return: FS_SUCCESS if the file was opened, FS_NOT_FOUND otherwise.
+static enum fs_op_res extentfs_open_file_by_handle(struct disk * const disk,
+                                                   struct file * const file,
+                                                   char const * const path,
+                                                   uint64_t const handle) {
+    if (!disk->fs_private) {
+        return FS_NOT_FOUND;
+    }
+    enum fs_op_res const res = extentfs_init_opened_file(disk, file, handle);
+    if (res != FS_SUCCESS) {
+        // The inode is not in use anymore, fall back to a full lookup.
+        return extentfs_open_file(disk, file, path);
+    }
+    return res;
+}
+
+// Create a file on an extent filesystem. If the file already exists, it is
+// opened instead.
+// @param disk: The disk to create the file on.
+// @param file: The struct file to initialize.
+// @param path: The path of the file relative to the mount point.
+// @return: FS_SUCCESS if the file was created, FS_NO_SPACE if there is no free
+// inode or directory entry, FS_NOT_FOUND if the path is too long or the disk
+// is not mounted.
+static enum fs_op_res extentfs_create_file(struct disk * const disk,
+                                           struct file * const file,
+                                           char const * const path) {
+    struct extentfs * const fs = disk->fs_private;
+    if (!fs || !*path || strlen(path) > EXTENTFS_MAX_PATH_LEN) {
+        return FS_NOT_FOUND;
+    }
+
+    mutex_lock(&fs->lock);
+    uint32_t slot = 0;
+    uint32_t ino = dir_lookup(disk, fs, path, &slot);
+    if (ino) {
+        mutex_unlock(&fs->lock);
+        return extentfs_init_opened_file(disk, file, ino);
+    } else if (slot == fs->super.dir_slots) {
+        mutex_unlock(&fs->lock);
+        return FS_NO_SPACE;
+    }
+
+    for (ino = 1; ino < fs->super.num_inodes; ++ino) {
+        if (!bit_get(fs->inode_bitmap, ino)) {
+            break;
+        }
+    }
+    if (ino == fs->super.num_inodes) {
+        mutex_unlock(&fs->lock);
+        return FS_NO_SPACE;
+    }
+
+    struct extentfs_inode inode;
+    memzero(&inode, sizeof(inode));
+    inode.used = 1;
+    if (!write_inode(disk, fs, ino, &inode) ||
+        !dir_write(disk, fs, slot, ino, path)) {
+        mutex_unlock(&fs->lock);
+        return FS_NO_SPACE;
+    }
+    bit_assign(fs->inode_bitmap, ino, true);
+    mutex_unlock(&fs->lock);
+    return extentfs_init_opened_file(disk, file, ino);
+}
+
+// Delete a file from an extent filesystem, freeing its blocks and inode.
+// @param disk: The disk to delete the file from.
+// @param path: The path of the file relative to the mount point.
+// Note: The file must not be opened.
+static void extentfs_delete_file(struct disk * const disk,
+                                 char const * const path) {
+    struct extentfs * const fs = disk->fs_private;
+    if (!fs) {
+        return;
+    }
+    mutex_lock(&fs->lock);
+    uint32_t slot = 0;
+    uint32_t const ino = dir_lookup(disk, fs, path, &slot);
+    struct extentfs_inode inode;
+    if (ino && read_inode(disk, &fs->super, ino, &inode)) {
+        for (uint32_t i = 0; i < inode.num_extents; ++i) {
+            free_run(disk, fs, inode.extents[i].start, inode.extents[i].len);
+        }
+        memzero(&inode, sizeof(inode));
+        write_inode(disk, fs, ino, &inode);
+        dir_write(disk, fs, slot, DIR_TOMBSTONE, "");
+        bit_assign(fs->inode_bitmap, ino, false);
+    }
+    mutex_unlock(&fs->lock);
+}
+
+// Close an opened file on an extent filesystem.
+// @param file: The file to be closed.
+static void extentfs_close_file(struct file * const file) {
+    kfree(file->fs_private);
+}
+
+// The filesystem operations for an extent filesystem.
+struct fs_ops const extentfs_fs_ops = {
+    .detect_fs = extentfs_detect_fs,
+    .mount = extentfs_mount,
+    .unmount = extentfs_unmount,
+    .create_file = extentfs_create_file,
+    .open_file = extentfs_open_file,
+    .open_file_by_handle = extentfs_open_file_by_handle,
+    .close_file = extentfs_close_file,
+    .delete_file = extentfs_delete_file,
+};
+
+// The extent filesystem implementation.
+struct fs const extentfs_fs = {
+    .name = "EXTENTFS",
+    .ops = &extentfs_fs_ops,
+};
+
+bool extentfs_format(struct disk * const disk, uint32_t const num_blocks) {
+    struct extentfs_super super;
+    super.magic = EXTENTFS_MAGIC;
+    super.num_blocks = num_blocks;
+    super.bitmap_start = 1;
+    super.bitmap_blocks =
+        ceil_x_over_y_u32(num_blocks, EXTENTFS_BLOCK_SIZE * 8);
+    // One inode for every 4 blocks, rounded up to a full block of inodes.
+    super.inodes_start = super.bitmap_start + super.bitmap_blocks;
+    super.num_inodes =
+        round_up_u32(max_u32(num_blocks / 4, 1), INODES_PER_BLOCK);
+    // Keep the load factor of the directory under 1/2.
+    uint32_t const entries_per_block =
+        EXTENTFS_BLOCK_SIZE / sizeof(struct extentfs_dirent);
+    super.dir_start =
+        super.inodes_start + super.num_inodes / INODES_PER_BLOCK;
+    super.dir_slots = entries_per_block;
+    while (super.dir_slots < 2 * super.num_inodes) {
+        super.dir_slots *= 2;
+    }
+    super.data_start = super.dir_start + super.dir_slots / entries_per_block;
+    if (super.data_start >= num_blocks) {
+        return false;
+    }
+
+    uint8_t * const block = kmalloc(EXTENTFS_BLOCK_SIZE);
+    if (!block) {
+        return false;
+    }
+    // Zero the bitmap, inode table and directory.
+    memzero(block, EXTENTFS_BLOCK_SIZE);
+    bool ok = true;
+    for (uint32_t i = 1; ok && i < super.data_start; ++i) {
+        ok = disk_write(disk, block_offset(i), block, EXTENTFS_BLOCK_SIZE) ==
+            EXTENTFS_BLOCK_SIZE;
+    }
+
+    // Mark the metadata blocks as used. They all fit in the first block of the
+    // bitmap since the bitmap is much smaller than the disk.
+    ASSERT(super.data_start < EXTENTFS_BLOCK_SIZE * 8);
+    for (uint32_t i = 0; i < super.data_start; ++i) {
+        bit_assign((uint32_t*)block, i, true);
+    }
+    ok = ok && disk_write(disk, block_offset(super.bitmap_start), block,
+                          EXTENTFS_BLOCK_SIZE) == EXTENTFS_BLOCK_SIZE;
+
+    // Write the superblock last so that a failed format is not detected.
+    memzero(block, EXTENTFS_BLOCK_SIZE);
+    memcpy(block, &super, sizeof(super));
+    ok = ok && disk_write(disk, 0, block, EXTENTFS_BLOCK_SIZE) ==
+        EXTENTFS_BLOCK_SIZE;
+    kfree(block);
+    return ok;
+}
+
+#include <extentfs.test>
@@ -0,0 +1,45 @@
+#pragma once
+#include <types.h>
+
+// Extent filesystem
+// =================
+//    A simple writable filesystem, meant for disks that need files to grow,
+// which USTAR cannot do. The disk is divided in blocks of EXTENTFS_BLOCK_SIZE
+// bytes laid out as follows:
+//      SUPERBLOCK | BLOCK BITMAP | INODE TABLE | DIRECTORY | DATA ...
+//    The block bitmap has one bit per block of the disk, set if the block is in
+// use. Each file is described by an inode in the inode table, which maps the
+// content of the file with up to EXTENTFS_INODE_EXTENTS extents, that is runs
+// of contiguous blocks. Appending to a file first tries to extend its last
+// extent with the blocks following it, hence files written sequentially are
+// usually made of a single extent and are read and written with a single disk
+// access per extent.
+//    The namespace is flat: the directory is an on-disk open addressing hash
+// table mapping the path of a file (relative to the mount point) to its inode,
+// hence opening, creating or deleting a file reads a handful of directory
+// entries no matter how many files the disk contains.
+//    The block bitmap is loaded in memory when the disk is mounted, files can
+// only be accessed on mounted disks.
+
+// The size of a block in bytes.
+#define EXTENTFS_BLOCK_SIZE     4096
+
+// The maximum number of extents of a file. Writes that would need more extents
+// are truncated.
+#define EXTENTFS_INODE_EXTENTS  14
+
+// The maximum length of the path of a file, excluding the NUL char.
+#define EXTENTFS_MAX_PATH_LEN   59
+
+// Forward declaration, see disk.h.
+struct disk;
+
+// Create an empty extent filesystem on a disk.
+// @param disk: The disk to format. Must not be mounted.
+// @param num_blocks: The size of the disk in blocks.
+// @return: true on success, false if the disk is too small or could not be
+// written.
+bool extentfs_format(struct disk * const disk, uint32_t const num_blocks);
+
+// Execute the tests of the extent filesystem.
+void extentfs_test(void);
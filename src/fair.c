@@ -0,0 +1,227 @@
+#include <sched.h>
+#include <debug.h>
+#include <cpu.h>
+#include <avl.h>
+#include <math.h>
+#include <clock.h>
+
+// The "Fair" scheduler.
+// The fair scheduler distributes the cpu time between processes proportionally
+// to their weight, which is derived from their nice value:
+//  - Each process has a virtual runtime (vruntime), which is its execution time
+//  in nanoseconds scaled by NICE_0_WEIGHT / weight. Higher priority processes
+//  have a higher weight and therefore their vruntime grows slower.
+//  - The runnable processes are kept in a tree ordered by vruntime. The next
+//  process to run is always the one with the lowest vruntime.
+//  - On each tick, the vruntime of the current process is updated and the
+//  process is preempted if it got more than FAIR_GRANULARITY ahead of the
+//  lowest vruntime in the tree.
+// As with the TS scheduler, all cpus share a single runqueue.
+
+// The weight of a process with a nice value of 0.
+#define NICE_0_WEIGHT   1024
+
+// Map a nice value to a weight. Each nice level is ~1.25 times the weight of
+// the next, meaning that a process gets ~10% more cpu time than a process with
+// the next nice value. This is the same table as the Linux kernel.
+static uint32_t const NICE_TO_WEIGHT[PROC_NICE_MAX - PROC_NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+// The amount of virtual runtime, in nanoseconds, a process can get ahead of the
+// process with the lowest vruntime before being preempted. This avoids context
+// switching on every tick between processes with similar vruntimes.
+#define FAIR_GRANULARITY    (500 * 1000ULL)
+
+// The runqueue, containing all the runnable processes that are not currently
+// running on a cpu, ordered by vruntime.
+static struct avl_tree RUNQUEUE;
+
+// The lowest vruntime seen in the runqueue so far. This value is monotonic and
+// used as the vruntime of processes that are newly enqueued, so that a process
+// that was sleeping a long time does not monopolize the cpu.
+static uint64_t MIN_VRUNTIME;
+
+// A lock protecting the runqueue and MIN_VRUNTIME against concurrent access.
+static DECLARE_SPINLOCK(RUNQUEUE_LOCK);
+
+// Compare two processes by their vruntime.
+// @param a: The fair_node of the first process.
+// @param b: The fair_node of the second process.
+// @return: A negative value if a has a lower vruntime than b, a positive value
+// otherwise. Ties are broken using the addresses of the processes.
+static int vruntime_cmp(struct avl_node const * const a,
+                        struct avl_node const * const b) {
+    struct proc const * const pa = avl_entry(a, struct proc, fair_node);
+    struct proc const * const pb = avl_entry(b, struct proc, fair_node);
+    if (pa->vruntime != pb->vruntime) {
+        return pa->vruntime < pb->vruntime ? -1 : 1;
+    }
+    return pa == pb ? 0 : (pa < pb ? -1 : 1);
+}
+
+// Initialize the runqueue and lock.
+static void fair_sched_init(void) {
+    avl_init(&RUNQUEUE, vruntime_cmp);
+    MIN_VRUNTIME = 0;
+    spinlock_init(&RUNQUEUE_LOCK);
+}
+
+// Get the weight of a process.
+// @param proc: The process.
+// @return: The weight of the process, derived from its nice value.
+static uint32_t proc_weight(struct proc const * const proc) {
+    ASSERT(PROC_NICE_MIN <= proc->nice && proc->nice <= PROC_NICE_MAX);
+    return NICE_TO_WEIGHT[proc->nice - PROC_NICE_MIN];
+}
+
+// Compute the virtual runtime corresponding to an execution time.
+// @param proc: The process that executed.
+// @param delta: The execution time in nanoseconds.
+// @return: The virtual runtime to add to the process' vruntime.
+static uint64_t calc_delta_vruntime(struct proc const * const proc,
+                                    uint64_t const delta) {
+    uint32_t const weight = proc_weight(proc);
+    if (weight == NICE_0_WEIGHT) {
+        return delta;
+    }
+    return delta * NICE_0_WEIGHT / weight;
+}
+
+// Account the time a process has been running since its exec_start.
+// @param proc: The process. Must be the current process of this cpu or the
+// process that was running on this cpu right before the current one.
+static void account_runtime(struct proc * const proc) {
+    if (!proc->exec_start) {
+        // The process has not been picked by this scheduler, this is the case
+        // of the idle procs.
+        return;
+    }
+    uint64_t const now = clock_now_ns();
+    if (now > proc->exec_start) {
+        proc->vruntime += calc_delta_vruntime(proc, now - proc->exec_start);
+    }
+    proc->exec_start = now;
+}
+
+// Insert a process in the runqueue.
+// @param proc: The process.
+// Note: This function assumes the RUNQUEUE_LOCK is held.
+static void insert_in_runqueue(struct proc * const proc) {
+    ASSERT(spinlock_is_held(&RUNQUEUE_LOCK));
+    ASSERT(!proc->on_rq);
+    avl_insert(&RUNQUEUE, &proc->fair_node);
+    proc->on_rq = true;
+}
+
+// Remove a process from the runqueue.
+// @param proc: The process. Must be in the runqueue.
+// Note: This function assumes the RUNQUEUE_LOCK is held.
+static void remove_from_runqueue(struct proc * const proc) {
+    ASSERT(spinlock_is_held(&RUNQUEUE_LOCK));
+    ASSERT(proc->on_rq);
+    avl_remove(&RUNQUEUE, &proc->fair_node);
+    proc->on_rq = false;
+}
+
+// Enqueue a process.
+// @param proc: The process to enqueue.
+static void fair_enqueue_proc(struct proc * const proc) {
+    spinlock_lock(&RUNQUEUE_LOCK);
+    proc->vruntime = max_u64(proc->vruntime, MIN_VRUNTIME);
+    insert_in_runqueue(proc);
+    spinlock_unlock(&RUNQUEUE_LOCK);
+}
+
+// Dequeue a process.
+// @param proc: The process to dequeue.
+static void fair_dequeue_proc(struct proc * const proc) {
+    spinlock_lock(&RUNQUEUE_LOCK);
+    remove_from_runqueue(proc);
+    spinlock_unlock(&RUNQUEUE_LOCK);
+}
+
+// Update the vruntime of the current process.
+static void fair_update_curr(void) {
+    struct proc * const curr = get_curr_proc();
+    if (curr) {
+        account_runtime(curr);
+    }
+}
+
+// React to a scheduler tick.
+static void fair_tick(void) {
+    fair_update_curr();
+
+    struct proc * const curr = get_curr_proc();
+    bool resched = false;
+
+    spinlock_lock(&RUNQUEUE_LOCK);
+    struct avl_node * const min = avl_min(&RUNQUEUE);
+    if (min) {
+        struct proc const * const first =
+            avl_entry(min, struct proc, fair_node);
+        // If the current process is not managed by this scheduler (e.g. this
+        // is the idle proc) always give the cpu to the waiting process.
+        resched = !curr || !curr->exec_start ||
+            curr->vruntime > first->vruntime + FAIR_GRANULARITY;
+    }
+    spinlock_unlock(&RUNQUEUE_LOCK);
+
+    if (resched) {
+        sched_resched();
+    }
+}
+
+// Select the next process to be run on a cpu.
+// If no process is available, this function will return NO_PROC.
+// @return: The next process to run.
+static struct proc *fair_pick_next_proc(void) {
+    struct proc * next = NO_PROC;
+
+    spinlock_lock(&RUNQUEUE_LOCK);
+    struct avl_node * const min = avl_min(&RUNQUEUE);
+    if (min) {
+        next = avl_entry(min, struct proc, fair_node);
+        remove_from_runqueue(next);
+        MIN_VRUNTIME = max_u64(MIN_VRUNTIME, next->vruntime);
+    }
+    spinlock_unlock(&RUNQUEUE_LOCK);
+
+    if (next != NO_PROC) {
+        next->exec_start = clock_now_ns();
+    }
+    return next;
+}
+
+// Put back a process after it ran on the current cpu.
+// @param proc: The process.
+static void fair_put_prev_proc(struct proc * const proc) {
+    // Account the time spent running since the last tick. The process keeps its
+    // vruntime as is, it is not clamped to MIN_VRUNTIME as for enqueue.
+    account_runtime(proc);
+    proc->exec_start = 0;
+
+    spinlock_lock(&RUNQUEUE_LOCK);
+    insert_in_runqueue(proc);
+    spinlock_unlock(&RUNQUEUE_LOCK);
+}
+
+struct sched fair_sched = {
+    .sched_init          = fair_sched_init,
+    .enqueue_proc        = fair_enqueue_proc,
+    .dequeue_proc        = fair_dequeue_proc,
+    .update_curr         = fair_update_curr,
+    .tick                = fair_tick,
+    .pick_next_proc      = fair_pick_next_proc,
+    .put_prev_proc       = fair_put_prev_proc,
+};
+
+#include <fair.test>
@@ -0,0 +1,180 @@
+#include <fpu.h>
+#include <cpu.h>
+#include <proc.h>
+#include <sched.h>
+#include <interrupt.h>
+#include <percpu.h>
+#include <memory.h>
+#include <debug.h>
+
+// The vector of the Device Not Available exception.
+#define NM_VECTOR   7
+
+// The process whose FPU state was last loaded in the FPU registers of this cpu,
+// NULL if none. This process might be dead, this pointer is only dereferenced
+// if fpu_live is true.
+DECLARE_PER_CPU(struct proc *, fpu_owner) = NULL;
+
+// Indicate if the FPU is usable on this cpu without raising #NM, that is if TS
+// is cleared. If so the registers of the FPU contain the state of fpu_owner,
+// which is the current process.
+DECLARE_PER_CPU(bool, fpu_live) = false;
+
+// Indicate if a section of kernel code using the SSE registers is in progress on
+// this cpu, see fpu_kernel_begin().
+DECLARE_PER_CPU(bool, fpu_kernel_in_use) = false;
+
+// The value of the interrupt flag before the start of the current kernel
+// section, restored by fpu_kernel_end().
+DECLARE_PER_CPU(bool, fpu_kernel_irqs) = false;
+
+// Indicate if the cpus support SSE2, set by init_fpu().
+static bool FPU_HAS_SSE2 = false;
+
+// Bit of CR4 indicating that the operating system supports FXSAVE/FXRSTOR and
+// that SSE instructions are enabled.
+#define CR4_OSFXSR  (1 << 9)
+
+// Check if the cpu supports the FXSAVE and FXRSTOR instructions.
+// @return: true if FXSR is supported, false otherwise.
+static bool cpu_has_fxsr(void) {
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    return edx & (1 << 24);
+}
+
+// Enable the FPU on the current cpu in lazy mode.
+static void do_init_fpu(void) {
+    if (!cpu_has_fxsr()) {
+        PANIC("FXSAVE/FXRSTOR not supported by the cpu");
+    }
+    cpu_enable_fpu();
+    cpu_set_ts();
+    this_cpu_var(fpu_owner) = NULL;
+    this_cpu_var(fpu_live) = false;
+    this_cpu_var(fpu_kernel_in_use) = false;
+}
+
+// Load the FPU state of a process in the registers of the current cpu and give
+// it the ownership of the FPU.
+// @param curr: The process currently running on this cpu, NULL if none.
+static void fpu_take(struct proc * const curr) {
+    ASSERT(!interrupts_enabled());
+    ASSERT(!this_cpu_var(fpu_live));
+    cpu_clear_ts();
+    if (curr) {
+        // The state saved in memory is always up to date, see fpu_switch().
+        cpu_fxrstor(&curr->fpu_state);
+        curr->fpu_cpu = cpu_id();
+        this_cpu_var(fpu_owner) = curr;
+    } else {
+        // There is no process to own the registers, they will be reset upon
+        // the next use.
+        this_cpu_var(fpu_owner) = NULL;
+    }
+    this_cpu_var(fpu_live) = true;
+}
+
+// Handler of the Device Not Available exception.
+// @param frame: Unused.
+static void nm_handler(struct interrupt_frame const * const frame) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    fpu_take(get_curr_proc());
+    cpu_set_interrupt_flag(irqs);
+}
+
+void init_fpu(void) {
+    do_init_fpu();
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    FPU_HAS_SSE2 = edx & (1 << 26);
+    interrupt_register_global_callback(NM_VECTOR, nm_handler);
+}
+
+void ap_init_fpu(void) {
+    do_init_fpu();
+}
+
+void fpu_init_proc(struct proc * const proc) {
+    struct fpu_state * const state = &proc->fpu_state;
+    memzero(state, sizeof(*state));
+    // FCW (bytes 0-1): All x87 exceptions masked, 64-bit precision, round to
+    // nearest.
+    state->data[0] = 0x7F;
+    state->data[1] = 0x03;
+    // MXCSR (bytes 24-27): All SIMD exceptions masked, round to nearest.
+    state->data[24] = 0x80;
+    state->data[25] = 0x1F;
+    // A struct proc can be allocated at the address of a dead process which is
+    // still the fpu_owner of some cpu, make sure the state of this new process
+    // is loaded before its first use.
+    proc->fpu_cpu = FPU_NO_CPU;
+}
+
+void fpu_switch(struct proc * const prev, struct proc * const next) {
+    ASSERT(!interrupts_enabled());
+    struct proc * const owner = this_cpu_var(fpu_owner);
+    if (this_cpu_var(fpu_live) && owner && owner == prev) {
+        // The process being switched out used the FPU, save its state. The
+        // registers are kept as is, the restore can still be skipped if this
+        // process is the next one to use the FPU on this cpu.
+        // Note: The owner is not the previous process if the current process
+        // has been forcefully reset (e.g. to start a new process from scratch),
+        // its state is then discarded.
+        cpu_fxsave(&owner->fpu_state);
+    }
+
+    if (next && owner == next && next->fpu_cpu == cpu_id()) {
+        // The registers still contain the state of the next process.
+        if (!this_cpu_var(fpu_live)) {
+            cpu_clear_ts();
+            this_cpu_var(fpu_live) = true;
+        }
+    } else if (this_cpu_var(fpu_live)) {
+        cpu_set_ts();
+        this_cpu_var(fpu_live) = false;
+    }
+}
+
+bool fpu_kernel_begin(void) {
+    // The FPU is enabled on APs after they start executing kernel code, CR4 is
+    // checked to know if this cpu is ready.
+    if (!FPU_HAS_SSE2 || !(cpu_read_cr4() & CR4_OSFXSR)) {
+        return false;
+    }
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    if (this_cpu_var(fpu_kernel_in_use)) {
+        cpu_set_interrupt_flag(irqs);
+        return false;
+    }
+    this_cpu_var(fpu_kernel_in_use) = true;
+    this_cpu_var(fpu_kernel_irqs) = irqs;
+
+    if (this_cpu_var(fpu_live)) {
+        // The registers contain the state of the current process, which is
+        // only saved upon switching out otherwise.
+        struct proc * const owner = this_cpu_var(fpu_owner);
+        if (owner) {
+            cpu_fxsave(&owner->fpu_state);
+        }
+    } else {
+        cpu_clear_ts();
+    }
+    return true;
+}
+
+void fpu_kernel_end(void) {
+    ASSERT(!interrupts_enabled());
+    ASSERT(this_cpu_var(fpu_kernel_in_use));
+    // The registers do not contain the state of any process anymore. Setting TS
+    // makes the next process using the FPU reload its state.
+    cpu_set_ts();
+    this_cpu_var(fpu_live) = false;
+    this_cpu_var(fpu_owner) = NULL;
+    this_cpu_var(fpu_kernel_in_use) = false;
+    cpu_set_interrupt_flag(this_cpu_var(fpu_kernel_irqs));
+}
+
+#include <fpu.test>
@@ -0,0 +1,73 @@
+#pragma once
+#include <types.h>
+
+// Lazy FPU/SSE context switching
+// ==============================
+//   The FPU and SSE registers are not saved nor restored when switching
+// processes. Instead, the TS bit of CR0 is set upon a context switch so that the
+// first FPU/SSE instruction executed by the next process raises a Device Not
+// Available exception (#NM). The #NM handler then loads the FPU state of the
+// current process and clears TS, the process then owns the FPU of the cpu until
+// the next context switch. Processes that never use the FPU therefore never pay
+// for saving/restoring its state.
+//   Upon switching out a process that used the FPU, its state is saved in its
+// struct proc. This makes the saved state always up to date, hence a process
+// can migrate to another cpu at any time. Each cpu remembers the last process
+// whose state was loaded in its registers: if this process is the next to run
+// on that cpu, and its state was not loaded anywhere else in the meantime, TS
+// is left cleared and the #NM exception is avoided altogether.
+//   The kernel itself only uses the SSE registers in short sections delimited
+// by fpu_kernel_begin() and fpu_kernel_end(), e.g. to copy large buffers. Such a
+// section runs with interrupts disabled and saves the state of the owner of the
+// FPU first, the next use of the FPU by a process then reloads its state.
+
+// The FPU and SSE state of a process, in the format used by the FXSAVE and
+// FXRSTOR instructions.
+struct fpu_state {
+    uint8_t data[512];
+} __attribute__((aligned(16)));
+
+// Value of the fpu_cpu field of a struct proc whose FPU state has never been
+// loaded.
+#define FPU_NO_CPU  0xFFFF
+
+struct proc;
+
+// Enable the FPU on the BSP and register the #NM handler. The FPU is enabled in
+// lazy mode: the TS bit of CR0 is set.
+void init_fpu(void);
+
+// Enable the FPU on an AP. init_fpu() must have been called before.
+void ap_init_fpu(void);
+
+// Initialize the FPU state of a new process to the default state of the FPU,
+// that is the state in which the FPU is after an FNINIT with all SIMD floating
+// point exceptions masked.
+// @param proc: The process to initialize.
+void fpu_init_proc(struct proc * const proc);
+
+// Update the FPU state of the current cpu upon a context switch. The FPU state
+// of `prev` is saved if it was using the FPU and TS is set, unless the state of
+// `next` is still loaded in the FPU of the current cpu.
+// @param prev: The process being switched out. Can be NULL.
+// @param next: The process being switched in.
+// Note: This function must be called with interrupts disabled.
+void fpu_switch(struct proc * const prev, struct proc * const next);
+
+// Start a section of kernel code using the SSE registers. Interrupts are
+// disabled until the matching fpu_kernel_end(). Sections cannot be nested, in
+// particular a section cannot be started from an exception handler running
+// while another section is in progress.
+// @return: true if the section was started and SSE2 instructions can be used
+// until fpu_kernel_end(). false if SSE2 is not supported or not enabled yet on
+// this cpu, or if a section is already in progress, fpu_kernel_end() must not
+// be called in this case.
+bool fpu_kernel_begin(void);
+
+// End a section started with fpu_kernel_begin(). The SSE registers must not be
+// used after this call. Interrupts are restored to their state before the call
+// to fpu_kernel_begin().
+void fpu_kernel_end(void);
+
+// Execute FPU related tests.
+void fpu_test(void);
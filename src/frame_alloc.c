@@ -10,6 +10,10 @@
 #include <spinlock.h>
 #include <error.h>
 #include <memory.h>
+#include <percpu.h>
+#include <acpi.h>
+#include <kmalloc.h>
+#include <parallel.h>
 
 // There is a single frame allocator for the whole system. Hence we need a lock
 // to avoid race conditions.
@@ -23,9 +27,81 @@ struct bitmap FRAME_BITMAP;
 // The number of physical frames used for the bitmap.
 static uint32_t NUM_FRAMES_FOR_BITMAP = 0;
 
+// The descriptors of the frames, indexed by frame index, with FRAME_BITMAP.size
+// entries. NULL until init_mem_map() is called.
+// An owner of a frame can safely read the reference count of the frame without
+// the lock to test if it is the only owner: no other cpu can add a reference to
+// a frame it does not own.
+static struct page * MEM_MAP = NULL;
+
 // Out-Of-Memory simulation flag.
 static bool OOM_SIMULATION = false;
 
+// Per-cpu frame caches (magazines):
+// Each cpu keeps a small stack of free frames taken from the bitmap. Allocating
+// or freeing a frame from/to the current cpu's magazine only requires disabling
+// interrupts, FRAME_ALLOC_LOCK is only acquired to refill an empty magazine or
+// drain a full one, FRAME_MAGAZINE_BATCH frames at a time.
+// A magazine is only ever modified by its cpu, with interrupts disabled, and is
+// never protected by FRAME_ALLOC_LOCK. Frames in a magazine are still marked as
+// allocated in the bitmap, frames_allocated() subtracts the count of each
+// magazine without synchronizing with their cpus, hence its result is only a
+// snapshot that can be off by the frames being allocated or freed concurrently.
+// Since the bitmap cannot tell a frame sitting in a magazine from an allocated
+// one, a double free of such a frame goes unnoticed by the bitmap check. Debug
+// builds (KMALLOC_DEBUG) scan the current cpu's magazine to catch those.
+
+// Zeroed-frame pool:
+// A global stack of free frames that have already been zeroed, used by
+// alloc_zeroed_frame() so that callers needing a zeroed frame (e.g. page tables,
+// bss and stack pages) do not pay for the zeroing. The pool is refilled in the
+// background by idle cpus, see frame_alloc_refill_zeroed_pool(). As for the
+// magazines, frames in the pool are marked as allocated in the bitmap, the pool
+// is only modified while holding FRAME_ALLOC_LOCK.
+
+// The maximum number of frames in the zeroed-frame pool.
+#define ZEROED_POOL_SIZE    64
+
+static struct {
+    // The number of frames currently in the pool.
+    uint32_t count;
+    // The frames in the pool, the next frame to be allocated is
+    // frames[count - 1].
+    void * frames[ZEROED_POOL_SIZE];
+} ZEROED_POOL;
+
+// The maximum number of frames in a cpu's magazine.
+#define FRAME_MAGAZINE_SIZE     32
+// The number of frames moved at once between a magazine and the bitmap.
+#define FRAME_MAGAZINE_BATCH    (FRAME_MAGAZINE_SIZE / 2)
+
+struct frame_magazine {
+    // The number of frames currently in the magazine.
+    uint32_t count;
+    // The physical addresses of the frames. The next frame to be allocated is
+    // frames[count - 1].
+    void * frames[FRAME_MAGAZINE_SIZE];
+};
+
+// The magazine of each cpu. Those are zeroed at startup, e.g. empty.
+DECLARE_PER_CPU(struct frame_magazine, frame_magazine);
+
+// Indicate if the magazines can be used. This is false during early boot, until
+// the percpu areas of all cpus have been allocated.
+static bool MAGAZINES_ENABLED = false;
+
+// The balance of each cpu, see frame_alloc_cpu_balance().
+DECLARE_PER_CPU(int32_t, frame_balance);
+
+// Account frames allocated or freed on the current cpu in its balance.
+// @param n: The number of frames allocated, negative for frees.
+static void account_frames(int32_t const n) {
+    // Percpu variables are only usable once GS has been loaded.
+    if (cpu_read_gs().value) {
+        this_cpu_add(frame_balance, n);
+    }
+}
+
 // Acquire the frame allocator lock and return a pointer on the frame
 // allocator's bitmap.
 // @return: The virtual address of the frame allocator's bitmap.
@@ -156,7 +232,10 @@ void init_frame_alloc(void) {
     // need to find a continuous memory range big enough to fit all the bits.
     // Because we will need to access this bitmap from the virtual address space
     // we use a page size granularity.
-    uint32_t const num_frames = ceil_x_over_y_u32(bitmap_size, (8 * 0x1000));
+    // The summary level of the bitmap is stored right after the bitmap's data.
+    uint32_t const num_words = BITMAP_WORD_COUNT(bitmap_size) +
+        BITMAP_SUMMARY_WORD_COUNT(bitmap_size);
+    uint32_t const num_frames = ceil_x_over_y_u32(num_words * 4, 0x1000);
     LOG("PFA's bitmap will be stored on %u physical frames.\n", num_frames);
 
     // Save the number of frames allocated for the bitmap, this will be useful
@@ -174,7 +253,9 @@ void init_frame_alloc(void) {
     void * const start_frame = to_virt(start_frame_phy);
 
     // Initialize the bitmap. Mark _all_ the frames as allocated.
-    bitmap_init(bitmap, bitmap_size, (uint32_t*)start_frame, true);
+    uint32_t * const data = start_frame;
+    uint32_t * const summary = data + BITMAP_WORD_COUNT(bitmap_size);
+    bitmap_init(bitmap, bitmap_size, data, summary, true);
 
     // Now go over the memory map and mark all the frames that are available to
     // us as free.
@@ -208,6 +289,7 @@ void init_frame_alloc(void) {
     LOG("  .size = %u\n", FRAME_BITMAP.size);
     LOG("  .free = %u\n", FRAME_BITMAP.free);
     LOG("  .data = %p\n", FRAME_BITMAP.data);
+    LOG("  .summary = %p\n", FRAME_BITMAP.summary);
 
     // If the data of the frame allocator is above kernel addresses, then once
     // we enable paging we will need to manually map those frames to virtual
@@ -219,19 +301,17 @@ void init_frame_alloc(void) {
 // The maximum index for memory under 1MiB.
 #define LOW_MEM_MAX_IDX   (((1 << 20) / PAGE_SIZE) - 1)
 
-// Perform the actual frame allocation.
+// Allocate a single frame from the bitmap.
+// @param bitmap: The bitmap of the frame allocator.
 // @param low_mem: If true, this function will try to allocate a frame under the
-// 1MiB limit. Otherwise it will try anywhere in physical memory.
-static void *do_allocation(bool const low_mem) {
-    struct bitmap * const bitmap = get_bitmap_and_lock();
-
-    if (OOM_SIMULATION) {
-        spinlock_unlock(&FRAME_ALLOC_LOCK);
-        SET_ERROR("OOM Simulation active", ENOMEM);
-        return NO_FRAME;
-    }
-
-    void * frame_addr;
+// 1MiB limit. Otherwise it will try anywhere in physical memory, low memory
+// being used as a last resort.
+// @return: The index of the allocated frame in the bitmap, BM_NPOS if no frame
+// is available.
+// Note: This function assumes that FRAME_ALLOC_LOCK is held.
+static uint32_t alloc_frame_idx(struct bitmap * const bitmap,
+                                bool const low_mem) {
+    ASSERT(spinlock_is_held(&FRAME_ALLOC_LOCK));
 
     uint32_t const start_idx = low_mem ? 0 : LOW_MEM_MAX_IDX; 
     uint32_t frame_idx = bitmap_set_next_bit(bitmap, start_idx);
@@ -250,55 +330,520 @@ static void *do_allocation(bool const low_mem) {
             frame_idx = BM_NPOS;
         }
     }
+    return frame_idx;
+}
+
+// Reset the descriptor of a frame being given back to the allocator.
+// @param idx: The index of the frame. The caller must own its last reference.
+static void reset_page(uint32_t const idx) {
+    if (MEM_MAP) {
+        struct page * const page = MEM_MAP + idx;
+        list_init(&page->link);
+        page->owner = NULL;
+        page->flags &= PAGE_RESERVED;
+    }
+}
+
+// Free a single frame in the bitmap.
+// @param bitmap: The bitmap of the frame allocator.
+// @param ptr: The physical address of the frame to free.
+// Note: This function assumes that FRAME_ALLOC_LOCK is held.
+static void free_frame_idx(struct bitmap * const bitmap,
+                           void const * const ptr) {
+    ASSERT(spinlock_is_held(&FRAME_ALLOC_LOCK));
+    ASSERT(ptr != NO_FRAME);
+
+    // The pointer is supposed to describe a physical frame and therefore should
+    // be 4KiB aligned.
+    ASSERT(is_4kib_aligned(ptr));
+
+    // First check that the frame is currently in use.
+    uint32_t const idx = frame_index(ptr);
+    bool const in_use = bitmap_get_bit(bitmap, idx);
+
+    if (!in_use) {
+        // Even though it wouldn't break anything we should panic on a double
+        // free as it might be helpful to find a bug in the caller.
+        PANIC("Double free");
+    }
+
+    if (MEM_MAP && MEM_MAP[idx].refs) {
+        // The frame is shared, only drop the reference of the caller.
+        MEM_MAP[idx].refs--;
+        return;
+    }
+
+    // The frame is currently in use, free the bit up.
+    reset_page(idx);
+    bitmap_unset(bitmap, idx);
+}
+
+// Perform the actual frame allocation.
+// @param low_mem: If true, this function will try to allocate a frame under the
+// 1MiB limit. Otherwise it will try anywhere in physical memory.
+static void *do_allocation(bool const low_mem) {
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+
+    if (OOM_SIMULATION) {
+        spinlock_unlock(&FRAME_ALLOC_LOCK);
+        SET_ERROR("OOM Simulation active", ENOMEM);
+        return NO_FRAME;
+    }
+
+    uint32_t const frame_idx = alloc_frame_idx(bitmap, low_mem);
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
 
     if (frame_idx == BM_NPOS) {
         SET_ERROR("No physical frame left for allocation", ENOMEM);
-        frame_addr = NO_FRAME;
+        return NO_FRAME;
     } else {
         // A frame is available, its address is the bit position * PAGE_SIZE.
-        frame_addr = (void*)(frame_idx * 0x1000);
+        return (void*)(frame_idx * PAGE_SIZE);
+    }
+}
+
+// Check if the per-cpu magazines can be used on the current cpu.
+// @return: true if the magazines can be used, false otherwise.
+static bool magazines_usable(void) {
+    // Percpu variables are only usable once GS has been loaded.
+    return MAGAZINES_ENABLED && cpu_read_gs().value;
+}
+
+// Refill the current cpu's magazine from the bitmap.
+// @param mag: The magazine of the current cpu. Must be empty.
+// Note: Interrupts must be disabled when calling this function.
+static void refill_magazine(struct frame_magazine * const mag) {
+    ASSERT(!interrupts_enabled());
+    ASSERT(!mag->count);
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+    // The frames are pushed in reverse order so that they are allocated in
+    // increasing address order, as if they came from the bitmap directly.
+    void * frames[FRAME_MAGAZINE_BATCH];
+    uint32_t n = 0;
+    while (n < FRAME_MAGAZINE_BATCH) {
+        uint32_t const idx = alloc_frame_idx(bitmap, false);
+        if (idx == BM_NPOS) {
+            break;
+        }
+        frames[n++] = (void*)(idx * PAGE_SIZE);
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        mag->frames[i] = frames[n - 1 - i];
     }
+    mag->count = n;
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+}
 
+// Give back frames from the current cpu's magazine to the bitmap.
+// @param mag: The magazine of the current cpu.
+// @param n: The number of frames to give back. The oldest frames, those at the
+// bottom of the magazine, are given back first.
+// Note: Interrupts must be disabled when calling this function.
+static void drain_magazine(struct frame_magazine * const mag, uint32_t const n) {
+    ASSERT(!interrupts_enabled());
+    ASSERT(n <= mag->count);
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+    for (uint32_t i = 0; i < n; ++i) {
+        free_frame_idx(bitmap, mag->frames[i]);
+    }
+    mag->count -= n;
+    memcpy(mag->frames, mag->frames + n, mag->count * sizeof(*mag->frames));
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+}
+
+// Allocate a frame from the current cpu's magazine, refilling it if needed.
+// @return: The physical address of the frame, NO_FRAME if the magazine is empty
+// and could not be refilled.
+static void *magazine_alloc(void) {
+    bool const irq = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+
+    struct frame_magazine * const mag = &this_cpu_var(frame_magazine);
+    if (!mag->count) {
+        refill_magazine(mag);
+    }
+    void * const frame = mag->count ? mag->frames[--mag->count] : NO_FRAME;
+
+    cpu_set_interrupt_flag(irq);
+    return frame;
+}
+
+// Free a frame into the current cpu's magazine, draining it if it is full.
+// @param ptr: The physical address of the frame to free.
+static void magazine_free(void const * const ptr) {
+    ASSERT(ptr != NO_FRAME);
+    ASSERT(is_4kib_aligned(ptr));
+    // Catch double frees of frames that have been given back to the bitmap.
+    // Reading the bit without the lock is fine since the frame is supposed to
+    // be owned by the caller.
+    uint32_t const idx = frame_index(ptr);
+    if (!bitmap_get_bit(&FRAME_BITMAP, idx)) {
+        PANIC("Double free");
+    }
+    // The frame is not shared, the caller owns its descriptor.
+    reset_page(idx);
+
+    bool const irq = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+
+    struct frame_magazine * const mag = &this_cpu_var(frame_magazine);
+#ifdef KMALLOC_DEBUG
+    for (uint32_t i = 0; i < mag->count; ++i) {
+        if (mag->frames[i] == ptr) {
+            PANIC("Double free of frame %p in magazine\n", ptr);
+        }
+    }
+#endif
+    if (mag->count == FRAME_MAGAZINE_SIZE) {
+        drain_magazine(mag, FRAME_MAGAZINE_BATCH);
+    }
+    mag->frames[mag->count++] = (void*)ptr;
+
+    cpu_set_interrupt_flag(irq);
+}
+
+void init_frame_alloc_percpu_caches(void) {
+    // This is required for frames_allocated() to access remote magazines.
+    ASSERT(PER_CPU_OFFSETS);
+    MAGAZINES_ENABLED = true;
+}
+
+void frame_alloc_drain_cpu_cache(void) {
+    if (!magazines_usable()) {
+        return;
+    }
+    bool const irq = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    struct frame_magazine * const mag = &this_cpu_var(frame_magazine);
+    drain_magazine(mag, mag->count);
+    cpu_set_interrupt_flag(irq);
+}
+
+// Take a frame out of the zeroed-frame pool.
+// @return: The physical address of the frame, NO_FRAME if the pool is empty.
+static void *zeroed_pool_pop(void) {
+    spinlock_lock(&FRAME_ALLOC_LOCK);
+    void * const frame = ZEROED_POOL.count ?
+        ZEROED_POOL.frames[--ZEROED_POOL.count] : NO_FRAME;
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+    return frame;
+}
+
+// Allocate a frame, without accounting it in the balance of the current cpu.
+// @return: The physical address of the frame, NO_FRAME if none is left.
+static void *take_frame(void) {
+    if (magazines_usable() && !OOM_SIMULATION) {
+        void * const frame = magazine_alloc();
+        if (frame != NO_FRAME) {
+            return frame;
+        }
+    }
+    // Either the magazines are not usable or there is no frame left at all, in
+    // which case do_allocation() will set the error.
+    void * const frame = do_allocation(false);
+    if (frame == NO_FRAME && !OOM_SIMULATION) {
+        // The frames of the zeroed-frame pool are the last resort.
+        return zeroed_pool_pop();
+    }
+    return frame;
+}
+
+// Free a frame, without accounting it in the balance of the current cpu.
+// @param ptr: The physical address of the frame.
+static void release_frame(void const * const ptr) {
+    // Frames under 1MiB are scarce and needed by alloc_frame_low_mem() which
+    // only looks at the bitmap. Never hold them in a magazine. Shared frames
+    // need the lock to drop the reference.
+    uint32_t const idx = frame_index(ptr);
+    bool const shared =
+        MEM_MAP && idx < FRAME_BITMAP.size && MEM_MAP[idx].refs;
+    if (magazines_usable() && idx > LOW_MEM_MAX_IDX && !shared) {
+        magazine_free(ptr);
+        return;
+    }
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+    free_frame_idx(bitmap, ptr);
     spinlock_unlock(&FRAME_ALLOC_LOCK);
-    return frame_addr;
 }
 
 void *alloc_frame(void) {
-    return do_allocation(false);
+    void * const frame = take_frame();
+    if (frame != NO_FRAME) {
+        account_frames(1);
+    }
+    return frame;
+}
+
+void *alloc_zeroed_frame(void) {
+    void * frame = OOM_SIMULATION ? NO_FRAME : zeroed_pool_pop();
+    if (frame == NO_FRAME) {
+        // The pool is empty, zero a frame synchronously.
+        frame = take_frame();
+        if (frame != NO_FRAME) {
+            paging_zero_frame(frame);
+        }
+    }
+    if (frame != NO_FRAME) {
+        account_frames(1);
+    }
+    return frame;
+}
+
+bool frame_alloc_refill_zeroed_pool(void) {
+    // Reading the count without the lock is fine, at worst a frame is zeroed
+    // for nothing.
+    if (ZEROED_POOL.count == ZEROED_POOL_SIZE || OOM_SIMULATION) {
+        return false;
+    }
+    // The frames of the pool are free, they are only accounted once allocated
+    // from the pool.
+    void * const frame = take_frame();
+    if (frame == NO_FRAME) {
+        // Running out of memory is not an error for the idle cpu.
+        CLEAR_ERROR();
+        return false;
+    }
+    paging_zero_frame(frame);
+
+    spinlock_lock(&FRAME_ALLOC_LOCK);
+    bool const added = ZEROED_POOL.count < ZEROED_POOL_SIZE;
+    if (added) {
+        ZEROED_POOL.frames[ZEROED_POOL.count++] = frame;
+    }
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+
+    if (!added) {
+        release_frame(frame);
+    }
+    return added;
+}
+
+// Zero frames for the zeroed-frame pool, executed by parallel_for().
+// @param unused: Unused.
+// @param start: The index of the first frame.
+// @param end: The index following the last frame.
+static void fill_zeroed_pool_chunk(void * const unused,
+                                   uint32_t const start,
+                                   uint32_t const end) {
+    for (uint32_t i = start; i < end; ++i) {
+        if (!frame_alloc_refill_zeroed_pool()) {
+            return;
+        }
+    }
+}
+
+void frame_alloc_fill_zeroed_pool(void) {
+    parallel_for(0, ZEROED_POOL_SIZE, 4, fill_zeroed_pool_chunk, NULL);
 }
 
 void *alloc_frame_low_mem(void) {
-    return do_allocation(true);
+    void * const frame = do_allocation(true);
+    if (frame != NO_FRAME) {
+        account_frames(1);
+    }
+    return frame;
+}
+
+bool alloc_frames(uint32_t const n, void ** const frames) {
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+
+    if (OOM_SIMULATION) {
+        spinlock_unlock(&FRAME_ALLOC_LOCK);
+        SET_ERROR("OOM Simulation active", ENOMEM);
+        return false;
+    }
+
+    if (bitmap->free < n) {
+        // Not enough frames, no need to even try.
+        spinlock_unlock(&FRAME_ALLOC_LOCK);
+        SET_ERROR("Not enough physical frames left for allocation", ENOMEM);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t const frame_idx = alloc_frame_idx(bitmap, false);
+        // Since we checked the number of free frames above and are holding the
+        // lock, this cannot fail.
+        ASSERT(frame_idx != BM_NPOS);
+        frames[i] = (void*)(frame_idx * PAGE_SIZE);
+    }
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+    account_frames(n);
+    return true;
+}
+
+void *alloc_contiguous_frames(uint32_t const order) {
+    ASSERT(order <= MAX_FRAME_ORDER);
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+
+    if (OOM_SIMULATION) {
+        spinlock_unlock(&FRAME_ALLOC_LOCK);
+        SET_ERROR("OOM Simulation active", ENOMEM);
+        return NO_FRAME;
+    }
+
+    // As with single frames, avoid low memory unless there is no other choice.
+    uint32_t idx = bitmap_set_next_aligned_range(bitmap, LOW_MEM_MAX_IDX + 1,
+        order);
+    if (idx == BM_NPOS) {
+        idx = bitmap_set_next_aligned_range(bitmap, 0, order);
+    }
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+
+    if (idx == BM_NPOS) {
+        SET_ERROR("No contiguous physical frames left for allocation", ENOMEM);
+        return NO_FRAME;
+    }
+    account_frames(1 << order);
+    return (void*)(idx * PAGE_SIZE);
 }
 
 void free_frame(void const * const ptr) {
-    ASSERT(ptr != NO_FRAME);
+    account_frames(-1);
+    release_frame(ptr);
+}
+
+void free_frames(uint32_t const n, void * const * const frames) {
+    account_frames(-(int32_t)n);
+    struct bitmap * const bitmap = get_bitmap_and_lock();
+    for (uint32_t i = 0; i < n; ++i) {
+        free_frame_idx(bitmap, frames[i]);
+    }
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+}
+
+void free_contiguous_frames(void const * const ptr, uint32_t const order) {
+    ASSERT(order <= MAX_FRAME_ORDER);
+    // The range must be naturally aligned.
+    ASSERT(!((uint32_t)ptr % ((1U << order) * PAGE_SIZE)));
+    account_frames(-(1 << order));
     struct bitmap * const bitmap = get_bitmap_and_lock();
+    for (uint32_t i = 0; i < (1U << order); ++i) {
+        free_frame_idx(bitmap, ptr + i * PAGE_SIZE);
+    }
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+}
 
-    // The pointer is supposed to describe a physical frame and therefore should
-    // be 4KiB aligned.
-    ASSERT(is_4kib_aligned(ptr));
+// Flag the frames that are not usable RAM according to the memory map.
+// @param map: The mem_map.
+// @param n: The number of entries in `map`.
+static void mark_reserved_pages(struct page * const map, uint32_t const n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        map[i].flags = PAGE_RESERVED;
+    }
 
-    // First check that the frame is currently in use.
-    uint32_t const idx = frame_index(ptr);
-    bool const in_use = bitmap_get_bit(bitmap, idx);
+    struct multiboot_mmap_entry const * const first = get_mmap_entry_ptr();
+    uint32_t const count = multiboot_mmap_entries_count();
+    struct multiboot_mmap_entry const * ptr;
+    for (ptr = first; ptr < first + count; ++ptr) {
+        struct multiboot_mmap_entry entry;
+        phy_read(ptr, &entry, sizeof(entry));
+        if (mmap_entry_is_available(&entry) && mmap_entry_within_4GiB(&entry)) {
+            uint32_t const start = frame_index((void*)(uint32_t)entry.base_addr);
+            uint32_t const end = frame_index(get_max_addr_for_entry(&entry));
+            for (uint32_t i = start; i <= end && i < n; ++i) {
+                map[i].flags = 0;
+            }
+        }
+    }
+}
 
-    if (!in_use) {
-        // Even though it wouldn't break anything we should panic on a double
-        // free as it might be helpful to find a bug in the caller.
-        PANIC("Double free");
+void init_mem_map(void) {
+    ASSERT(!MEM_MAP);
+    uint32_t const n = FRAME_BITMAP.size;
+    struct page * const map = kmalloc(n * sizeof(*map));
+    if (!map) {
+        PANIC("Cannot allocate the mem_map");
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        list_init(&map[i].link);
+        map[i].owner = NULL;
+        map[i].refs = 0;
     }
+    mark_reserved_pages(map, n);
+    LOG("mem_map of %u frames at %p (%u bytes)\n", n, map, n * sizeof(*map));
+    MEM_MAP = map;
+}
 
-    // The frame is currently in use, free the bit up.
-    bitmap_unset(bitmap, idx);
+struct page *frame_to_page(void const * const frame) {
+    uint32_t const idx = frame_index(frame);
+    return (MEM_MAP && idx < FRAME_BITMAP.size) ? MEM_MAP + idx : NULL;
+}
+
+void *page_to_frame(struct page const * const page) {
+    ASSERT(MEM_MAP <= page && page < MEM_MAP + FRAME_BITMAP.size);
+    return (void*)((page - MEM_MAP) * PAGE_SIZE);
+}
+
+void frame_set_owner(void const * const frame,
+                     void * const owner,
+                     uint16_t const flags) {
+    ASSERT(is_4kib_aligned(frame));
+    struct page * const page = frame_to_page(frame);
+    if (!page) {
+        return;
+    }
+    spinlock_lock(&FRAME_ALLOC_LOCK);
+    ASSERT(bitmap_get_bit(&FRAME_BITMAP, frame_index(frame)));
+    page->owner = owner;
+    page->flags = (page->flags & PAGE_RESERVED) | (flags & ~PAGE_RESERVED);
     spinlock_unlock(&FRAME_ALLOC_LOCK);
 }
 
+bool frame_get(void const * const frame) {
+    ASSERT(is_4kib_aligned(frame));
+    if (!MEM_MAP) {
+        SET_ERROR("mem_map not initialized", ENONE);
+        return false;
+    }
+    uint32_t const idx = frame_index(frame);
+    if (idx >= FRAME_BITMAP.size) {
+        SET_ERROR("Frame not managed by the frame allocator", ENONE);
+        return false;
+    }
+    spinlock_lock(&FRAME_ALLOC_LOCK);
+    ASSERT(bitmap_get_bit(&FRAME_BITMAP, idx));
+    bool const res = MEM_MAP[idx].refs != (uint16_t)-1;
+    if (res) {
+        MEM_MAP[idx].refs++;
+    }
+    spinlock_unlock(&FRAME_ALLOC_LOCK);
+    if (res) {
+        account_frames(1);
+    } else {
+        SET_ERROR("Too many references on frame", ENONE);
+    }
+    return res;
+}
+
+uint32_t frame_ref_count(void const * const frame) {
+    struct page const * const page = frame_to_page(frame);
+    return page ? page->refs + 1 : 1;
+}
+
 uint32_t frames_allocated(void) {
     struct bitmap * const bitmap = get_bitmap_and_lock();
-    uint32_t const n_allocs = bitmap->size - bitmap->free;
+    // Frames in the zeroed-frame pool are free as well.
+    uint32_t n_allocs = bitmap->size - bitmap->free - ZEROED_POOL.count;
+    if (MAGAZINES_ENABLED) {
+        // Frames sitting in magazines are marked as allocated in the bitmap but
+        // are actually free. The counts are read without synchronizing with
+        // the cpus owning the magazines, see the comment on the magazines.
+        for (uint16_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+            n_allocs -= cpu_var(frame_magazine, cpu).count;
+        }
+    }
     spinlock_unlock(&FRAME_ALLOC_LOCK);
-    return n_allocs;
+    // The frames of the empty groups retained by kmalloc are not in use either.
+    return n_allocs - kmalloc_retained_pages();
+}
+
+int32_t frame_alloc_cpu_balance(void) {
+    return cpu_read_gs().value ? this_cpu_read(frame_balance) : 0;
+}
+
+void frame_alloc_exclude_from_balance(int32_t const n) {
+    account_frames(-n);
 }
 
 void frame_alloc_set_oom_simulation(bool const enabled) {
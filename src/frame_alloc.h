@@ -1,6 +1,8 @@
 #pragma once
 #include <types.h>
 #include <multiboot.h>
+#include <list.h>
+#include <debug.h>
 
 // This file contains the public interface of the physical frame allocator used
 // in this kernel.
@@ -8,6 +10,84 @@
 // Initialize the frame allocator.
 void init_frame_alloc(void);
 
+// Enable the per-cpu frame caches (magazines). Before this function is called,
+// all allocations are served by the global bitmap. This must be called after
+// allocate_aps_percpu_areas().
+void init_frame_alloc_percpu_caches(void);
+
+// Frame descriptors (mem_map)
+// ===========================
+//     Besides the bitmap, which stays the index used to find free frames, each
+// frame of RAM has a struct page describing it. The descriptors form an array,
+// the mem_map, indexed by frame index and covering all the frames up to the
+// highest address of the multiboot memory map. A descriptor is 16 bytes so that
+// 4 of them fit in a cache line.
+//     A frame can have multiple owners, for instance address spaces sharing it
+// copy-on-write. The descriptor contains the reference count of the frame: a
+// freshly allocated frame has a single reference, frame_get() adds a reference
+// and free_frame() (and its variants) drops one. The frame is only given back to
+// the allocator once its last reference is dropped, at which point its owner,
+// flags and link are reset.
+//     The owner, the flags (except PAGE_RESERVED) and the link belong to whoever
+// allocated the frame: the allocator never interprets them.
+
+// The descriptor of a physical frame.
+struct page {
+    // Node in a list of frames, free for use by the frame's owner.
+    struct list_node link;
+    // The object owning the frame, e.g. the struct file of a page cache. NULL
+    // if the frame has no registered owner.
+    void * owner;
+    // The number of additional references of the frame. A value of 0 means
+    // that the frame has a single owner, which is the case for any freshly
+    // allocated frame. Modified while holding the frame allocator's lock.
+    uint16_t refs;
+    // A combination of the PAGE_* flags below.
+    uint16_t flags;
+};
+STATIC_ASSERT(sizeof(struct page) == 16, "");
+
+// The frame is not usable RAM according to the memory map, e.g. an MMIO hole.
+// Set once when the mem_map is initialized.
+#define PAGE_RESERVED   (1 << 0)
+// The frame is held by a page cache, the owner is the struct file.
+#define PAGE_CACHED     (1 << 1)
+
+// Allocate and initialize the mem_map. This must be called once kmalloc() is
+// usable. Before this call, frame_get() always fails and frame_to_page()
+// returns NULL.
+void init_mem_map(void);
+
+// Get the descriptor of a frame.
+// @param frame: The physical address of the frame.
+// @return: The struct page of the frame, NULL if the mem_map is not initialized
+// yet or if the frame is beyond the end of RAM.
+struct page *frame_to_page(void const * const frame);
+
+// Get the frame described by a descriptor.
+// @param page: The descriptor, as returned by frame_to_page().
+// @return: The physical address of the frame.
+void *page_to_frame(struct page const * const page);
+
+// Set the owner of an allocated frame.
+// @param frame: The physical address of the frame.
+// @param owner: The new owner, NULL to clear it.
+// @param flags: The new flags of the frame. PAGE_RESERVED is ignored.
+void frame_set_owner(void const * const frame,
+                     void * const owner,
+                     uint16_t const flags);
+
+// Add a reference to an allocated frame.
+// @param frame: The physical address of the frame.
+// @return: true on success, false if the mem_map is not initialized or if the
+// frame already has the maximum number of references.
+bool frame_get(void const * const frame);
+
+// Get the number of references of an allocated frame.
+// @param frame: The physical address of the frame.
+// @return: The number of references of the frame, at least 1.
+uint32_t frame_ref_count(void const * const frame);
+
 // Special value returned by alloc_frame() to indicate that no physical frame
 // could be allocated. We use this invalid value instead of NULL here so that
 // the physical frame 0 can still be allocated/used without being mistaken for
@@ -19,21 +99,100 @@ void init_frame_alloc(void);
 // frame is available for allocation, this function returns NO_FRAME.
 void *alloc_frame(void);
 
+// Allocate a new physical frame in RAM and fill it with zeros. The frame is
+// taken from a pool of pre-zeroed frames if possible, otherwise it is zeroed
+// synchronously.
+// @return: The physical address of the allocated physical frame. If no physical
+// frame is available for allocation, this function returns NO_FRAME.
+void *alloc_zeroed_frame(void);
+
+// Zero a free frame and add it to the pool used by alloc_zeroed_frame(). This is
+// meant to be called by idle cpus.
+// @return: true if a frame was added to the pool, false if the pool is full or
+// no frame could be allocated.
+bool frame_alloc_refill_zeroed_pool(void);
+
+// Fill the pool used by alloc_zeroed_frame() using all the cpus, see
+// parallel_for(). Called at boot once the APs are online so that the first
+// allocations of zeroed frames do not wait for the cpus to go idle.
+void frame_alloc_fill_zeroed_pool(void);
+
 // Allocate a new physical frame in RAM under the 1MiB limit.
 // @return: The physical address of the allocated physical frame. If no physical
 // frame under 1MiB is available for allocation, this function returns
 // NO_FRAME.
 void *alloc_frame_low_mem(void);
 
+// Allocate multiple physical frames in RAM at once. This is equivalent to
+// calling alloc_frame() n times, but the frame allocator's lock is only acquired
+// once. The frames are not necessarily contiguous.
+// @param n: The number of frames to allocate.
+// @param frames: Output array of at least n entries receiving the physical
+// addresses of the allocated frames.
+// @return: true if all the frames were allocated, false otherwise. In case of
+// failure, no frame is allocated and the content of `frames` is undefined.
+bool alloc_frames(uint32_t const n, void ** const frames);
+
+// The maximum order supported by alloc_contiguous_frames(), that is up to
+// 2^MAX_FRAME_ORDER contiguous frames (4MiB) can be allocated at once.
+#define MAX_FRAME_ORDER 10
+
+// Allocate 2^order contiguous physical frames in RAM. The physical address of
+// the first frame is aligned on 2^order * PAGE_SIZE.
+// @param order: Log2 of the number of frames to allocate. Must be <=
+// MAX_FRAME_ORDER.
+// @return: The physical address of the first frame. If no such contiguous range
+// of frames is available, NO_FRAME is returned.
+void *alloc_contiguous_frames(uint32_t const order);
+
 // Free up a physical frame.
 // @param ptr: The poitner to the frame to be freed up. Note this pointer must
 // be 4KiB aligned.
 void free_frame(void const * const ptr);
 
-// Get the number of physical frames currently allocated.
+// Free up multiple physical frames at once, acquiring the frame allocator's lock
+// only once.
+// @param n: The number of frames to free.
+// @param frames: Array of the physical addresses of the frames to free. The
+// frames do not need to be contiguous.
+void free_frames(uint32_t const n, void * const * const frames);
+
+// Free up a range of contiguous frames allocated with
+// alloc_contiguous_frames().
+// @param ptr: The physical address of the first frame of the range.
+// @param order: The order used when allocating the range.
+void free_contiguous_frames(void const * const ptr, uint32_t const order);
+
+// Give back all the frames held by the current cpu's frame cache to the global
+// bitmap.
+void frame_alloc_drain_cpu_cache(void);
+
+// Get the number of physical frames currently allocated. Frames sitting in the
+// per-cpu caches, in the zeroed-frame pool or in the empty groups retained by
+// kmalloc are not accounted as allocated.
 // @return: The number of frames currently allocated.
 uint32_t frames_allocated(void);
 
+// Per-cpu balance
+// ===============
+//     Each cpu counts the frames allocated on it minus the frames freed on it, a
+// reference added with frame_get() counts as an allocation. The test framework
+// compares the balance of a cpu before and after a test suite to attribute the
+// leaks to the suites running concurrently on different cpus, see
+// test_run_parallel(). The frames backing the heap and the object caches are
+// excluded from the balance: those are cached and shared by all cpus, they are
+// given back independently of the allocations of the cpu that created them.
+
+// Get the balance of the current cpu.
+// @return: The number of frames allocated minus the number of frames freed on
+// the current cpu so far. Only the difference between two values is relevant.
+int32_t frame_alloc_cpu_balance(void);
+
+// Exclude frames from the balance of the current cpu. This is used by the
+// allocators caching frames, for the frames they allocate and free.
+// @param n: The number of frames allocated by the caller, negative for frees.
+void frame_alloc_exclude_from_balance(int32_t const n);
+
 // Set or Unset the Out Of Memory simulation.
 // @param enabled: If true OOM simulation will be enabled and any subsequent
 // call to frame_alloc() will return NO_FRAME. If false OOM is disabled and
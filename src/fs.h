@@ -3,6 +3,8 @@
 #include <list.h>
 #include <atomic.h>
 #include <rw_lock.h>
+#include <page_cache.h>
+#include <rcu.h>
 
 // This file declares the filesystem interface. Any supported filesystem must
 // define specific functions and structs described below:
@@ -35,6 +37,16 @@ struct file_ops {
                     off_t offset,
                     uint8_t const * buf,
                     size_t len);
+
+    // Get a pointer to the content of the file in memory, without copying it.
+    // This operation is optional and may be NULL.
+    // @param file: The file.
+    // @param offset: The offset of the first byte to access within the file.
+    // @param len: The number of bytes to access.
+    // @return: The address of the byte at `offset` in the file, the following
+    // len - 1 bytes are accessible too. NULL if the range is out of the bounds
+    // of the file or cannot be accessed directly.
+    void const *(*map_readonly)(struct file * file, off_t offset, size_t len);
 };
 
 // Each file opened on the system has a corresponding struct file associated to
@@ -67,13 +79,30 @@ struct file {
     struct file_ops const * ops;
     // Available data to the filesytem implementation.
     void *fs_private;
+    // An opaque value identifying the file on its filesystem, e.g. the offset
+    // of its metadata on disk. VFS caches this value after a successful
+    // open_file() and passes it back to open_file_by_handle() when the same
+    // path is opened again, skipping the filesystem lookup.
+    uint64_t fs_handle;
     // End of FS specific fields.
 
-    // Node for the Opened Files Linked List (OFLL) in VFS.
+    // The filesystem this file has been opened from.
+    struct fs const * fs;
+    // The cached pages of this file, shared by all its openers.
+    struct page_cache page_cache;
+    // Hash of abs_path, used to index the opened file table in VFS.
+    uint32_t path_hash;
+    // The length of abs_path, VFS only compares paths of the same length.
+    size_t abs_path_len;
+    // Node for the bucket of the opened file table in VFS.
     struct list_node opened_files_ll;
     // Reference count to know how many processes are referencing this file.
-    // When this reaches 0, this struct can be removed from the OFLL and freed.
+    // When this reaches 0, this struct can be removed from the opened file
+    // table and freed.
     atomic_t open_ref_count;
+    // Lookups in the opened file table do not take the bucket's lock, hence
+    // a closed file is only freed after an RCU grace period.
+    struct rcu_head rcu;
 };
 
 // Enumeration to indicate success or failures for FS operations.
@@ -84,6 +113,8 @@ enum fs_op_res {
     FS_NOT_IMPL,
     // File was not found.
     FS_NOT_FOUND,
+    // The filesystem ran out of space, e.g. blocks or inodes.
+    FS_NO_SPACE,
 };
 
 // Each supported filesystem must define a struct fs which defines basic
@@ -96,6 +127,17 @@ struct fs_ops {
     // @return: true if the disk uses this filesystem, false otherwise. 
     bool (*detect_fs)(struct disk * disk);
 
+    // Prepare a disk to be mounted, e.g. build in-memory metadata. This
+    // operation is optional and may be NULL. Each successful call is matched
+    // by a call to unmount().
+    // @param disk: The disk being mounted.
+    // @return: true on success, false otherwise in which case the mount fails.
+    bool (*mount)(struct disk * disk);
+
+    // Release the state created by mount(). Optional, may be NULL.
+    // @param disk: The disk being unmounted.
+    void (*unmount)(struct disk * disk);
+
     // Create a new file on the filesystem.
     // @param disk: The disk on which the new file should be created.
     // @param file: A struct file to be initialized. As described in the
@@ -122,6 +164,21 @@ struct fs_ops {
                                 struct file * file,
                                 char const * path);
 
+    // Open a file using the fs_handle from a previous open_file() on the same
+    // path. This operation is optional and may be NULL, in which case VFS
+    // always uses open_file().
+    // @param disk: The disk to open the file from.
+    // @param file: A struct file to be initialized, same as open_file().
+    // @param path: The full path of the file to be opened.
+    // @param handle: The value of fs_handle after the previous open_file().
+    // @return: A fs_op_res indicating success or failure.
+    // Note: The caller of this function holds a write/exclusive lock on the
+    // file.
+    enum fs_op_res (*open_file_by_handle)(struct disk * disk,
+                                          struct file * file,
+                                          char const * path,
+                                          uint64_t handle);
+
     // Close an opened file on the filesystem.
     // @param file: The file to be closed. Only the FS-specific fields might be
     // written and/or freed. Other fields must remain untouched.
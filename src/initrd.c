@@ -7,6 +7,7 @@
 #include <memory.h>
 #include <disk.h>
 #include <memdisk.h>
+#include <lz4disk.h>
 
 // Since this kernel assumes a single initrd, we can save the memdisk of the
 // initrd in a static var. Subsequent calls to get_initrd_disk() will return
@@ -41,26 +42,26 @@ struct disk *get_initrd_disk(void) {
 
         // We expect the bootloader to map the initrd on a 4KiB aligned page.
         ASSERT(is_4kib_aligned(phy_addr));
-        size_t const num_frames = ceil_x_over_y_u32(size, PAGE_SIZE);
-        ASSERT(num_frames);
 
-        // Map the initrd into the kernel address space.
-        void * frames[num_frames];
-        for (size_t i = 0; i < num_frames; ++i) {
-            frames[i] = phy_addr + i * PAGE_SIZE;
-        }
-
-        // Map the initrd to kernel memory.
-        void * const initrd_vaddr = paging_map_frames_above(KERNEL_PHY_OFFSET, 
-                                                            frames,
-                                                            num_frames,
-                                                            0);
+        // Map the initrd to kernel memory. The physical range is contiguous,
+        // this allows the mapping to use large pages for big images.
+        void * const initrd_vaddr = paging_map_range_above(KERNEL_PHY_OFFSET,
+                                                           phy_addr,
+                                                           size,
+                                                           0);
         if (initrd_vaddr == NO_REGION) {
             spinlock_unlock(&INIT_RD_GET_DISK_LOCK);
             LOG("Cannot map initrd to virtual address space\n");
             return NULL;
         }
-        INIT_RD_MEMDISK = create_memdisk(initrd_vaddr, size, true);
+        // A compressed initrd is only decompressed as its chunks are read,
+        // otherwise the image is used as is.
+        size_t const image_size = multiboot_get_initrd_size();
+        if (lz4disk_detect(initrd_vaddr, image_size)) {
+            INIT_RD_MEMDISK = create_lz4disk(initrd_vaddr, image_size);
+        } else {
+            INIT_RD_MEMDISK = create_memdisk(initrd_vaddr, size, true);
+        }
         if (!INIT_RD_MEMDISK) {
             // Instead of reporting an error here, let this one slip. The initrd
             // is clearly there, unfortunately we cannot create a memdisk for it
@@ -3,7 +3,8 @@
 
 // This file contains definitions of functions used to interact with the initrd.
 // The assumption is that there at most initrd on the system. This module
-// provides an abstraction on the initrd (through a memdisk).
+// provides an abstraction on the initrd (through a memdisk, or an lz4disk if
+// the initrd is a compressed image, see lz4disk.h).
 
 // Get a memdisk of the initrd.
 // @return: A pointer on the struct disk capable of reading the content of the
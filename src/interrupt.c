@@ -7,6 +7,11 @@
 #include <percpu.h>
 #include <ipm.h>
 #include <sched.h>
+#include <paging.h>
+#include <cpu.h>
+#include <uaccess.h>
+#include <clock.h>
+#include <acpi.h>
 
 // Interrupt gate descriptor.
 union interrupt_descriptor_t {
@@ -90,6 +95,8 @@ int_callback_t GLOBAL_CALLBACKS[IDT_SIZE];
 DECLARE_SPINLOCK(GLOBAL_CALLBACKS_LOCK);
 // The cpu-private callbacks.
 DECLARE_PER_CPU(int_callback_t, local_callbacks[IDT_SIZE]);
+// The per-vector statistics of each cpu.
+DECLARE_PER_CPU(struct interrupt_stats, interrupt_stats[IDT_SIZE]);
 
 // Get the address/offset of the interrupt handler for a given vector.
 // @param vector: The vector of the handler to get.
@@ -129,15 +136,16 @@ static void dump_registers(struct interrupt_frame const * const frame) {
     LOG("EFER = %X\n", efer);
 }
 
-// Get the int_callback_t registered for a given vector.
+// Get the int_callback_t registered for a given vector. This must be called
+// with interrupts disabled, the local callbacks are read without disabling
+// preemption.
 // @param vector: The vector to get the callback for.
 // @return: If available, the int_callback_t registered for vector `vector`
 // otherwise NULL.
 static int_callback_t get_callback(uint8_t const vector) {
     // Check for local callback first.
-    preempt_disable();
-    int_callback_t const local_callback = this_cpu_var(local_callbacks)[vector];
-    preempt_enable();
+    int_callback_t const local_callback =
+        this_cpu_var_unsafe(local_callbacks)[vector];
 
     if (local_callback) {
         return local_callback;
@@ -155,6 +163,24 @@ bool generic_interrupt_handler(struct interrupt_frame const * const frame) {
     // gate.
     ASSERT(!interrupts_enabled());
 
+    uint8_t const vector = frame->vector;
+    uint64_t const start_cycles = read_tsc();
+
+    // The faulting address of a page fault must be read before enabling
+    // interrupts, a nested page fault would overwrite it.
+    void const * const fault_addr = vector == 14 ? cpu_read_cr2() : NULL;
+
+    // Syscalls are accounted as system time instead, see syscall_dispatch().
+    bool const account_irq = vector != SYSCALL_VECTOR;
+    uint8_t const cpu = cpu_id();
+    uint64_t const irq_start = account_irq ? clock_now_ns() : 0;
+    uint64_t const irq_ns_before = this_cpu_var(cpu_time).irq_ns;
+
+    // Interrupts are still disabled, the callback and the statistics of this
+    // cpu can be accessed without disabling preemption.
+    int_callback_t const callback = get_callback(vector);
+    this_cpu_var_unsafe(interrupt_stats)[vector].count ++;
+
     // Now that the nesting level has been taken care of we can safely enable
     // interrupts again.
     // Note: The Intel manual says:
@@ -168,10 +194,14 @@ bool generic_interrupt_handler(struct interrupt_frame const * const frame) {
     // From this point forward any interrupt can be received while processing
     // the current one.
 
-    uint8_t const vector = frame->vector;
-
-    int_callback_t const callback = get_callback(vector);
-    if (callback) {
+    if (vector == 14 &&
+        paging_handle_page_fault(fault_addr, frame->error_code)) {
+        // The page fault was a copy-on-write fault and has been resolved, the
+        // faulting instruction will be retried upon returning.
+    } else if (vector == 14 && uaccess_handle_fault(frame)) {
+        // The page fault was raised by an invalid user memory access, the
+        // access will fail upon returning.
+    } else if (callback) {
         callback(frame);
     } else {
         // No callback found.
@@ -198,6 +228,18 @@ bool generic_interrupt_handler(struct interrupt_frame const * const frame) {
     //  the registers of the first interrupt (in the scheduler) saved instead.
     cpu_set_interrupt_flag(false);
 
+    if (account_irq && cpu_id() == cpu) {
+        // The time of nested interrupts has been added to irq_ns already, and
+        // is part of the time elapsed since irq_start. Hence set the total
+        // instead of adding to it, so that nested time is counted once.
+        this_cpu_var(cpu_time).irq_ns =
+            irq_ns_before + (clock_now_ns() - irq_start);
+    }
+    if (cpu_id() == cpu) {
+        this_cpu_var_unsafe(interrupt_stats)[vector].cycles +=
+            read_tsc() - start_cycles;
+    }
+
     return false;
 }
 
@@ -340,6 +382,10 @@ void interrupt_register_local_callback(uint8_t const vector,
     register_callback(vector, callback, false);
 }
 
+bool interrupt_has_global_callback(uint8_t const vector) {
+    return GLOBAL_CALLBACKS[vector] != NULL;
+}
+
 void interrupt_delete_global_callback(uint8_t const vector) {
     delete_callback(vector, true);
 }
@@ -348,6 +394,28 @@ void interrupt_delete_local_callback(uint8_t const vector) {
     delete_callback(vector, false);
 }
 
+void interrupt_get_stats(uint8_t const cpu,
+                         uint8_t const vector,
+                         struct interrupt_stats * const stats) {
+    ASSERT(cpu < acpi_get_number_cpus());
+    *stats = cpu_var(interrupt_stats, cpu)[vector];
+}
+
+void interrupt_dump_stats(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        for (uint16_t vector = 0; vector < IDT_SIZE; ++vector) {
+            struct interrupt_stats stats;
+            interrupt_get_stats(cpu, vector, &stats);
+            if (!stats.count) {
+                continue;
+            }
+            LOG("[irq] cpu=%u vector=%u count=%U cycles=%U avg=%U\n", cpu,
+                vector, stats.count, stats.cycles, stats.cycles / stats.count);
+        }
+    }
+}
+
 bool interrupt_vector_has_error_code(uint8_t const vector) {
     return vector == 0x8 || vector == 0xA || vector == 0xB || vector == 0xC ||
         vector == 0xD || vector == 0xE || vector == 0x11;
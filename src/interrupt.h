@@ -63,6 +63,12 @@ void interrupt_register_global_callback(uint8_t const vector,
 void interrupt_register_local_callback(uint8_t const vector,
                                        int_callback_t const callback);
 
+// Check if a global callback is registered for a vector.
+// @param vector: The vector.
+// @return: true if a global callback is registered for `vector`, false
+// otherwise.
+bool interrupt_has_global_callback(uint8_t const vector);
+
 // Remove a global callback for a given vector.
 // @param vector: The interrupt vector for which the callback should be removed.
 void interrupt_delete_global_callback(uint8_t const vector);
@@ -71,6 +77,35 @@ void interrupt_delete_global_callback(uint8_t const vector);
 // @param vector: The interrupt vector for which the callback should be removed.
 void interrupt_delete_local_callback(uint8_t const vector);
 
+// Interrupt statistics
+// ====================
+//      Each cpu counts the interrupts it receives and the TSC cycles spent
+// handling them, per vector. The cycles of a handler include the cycles of the
+// interrupts nested in it. Syscalls are counted as any other vector.
+
+// The statistics of a vector on a cpu.
+struct interrupt_stats {
+    // The number of interrupts received.
+    uint64_t count;
+    // The total number of TSC cycles spent in the handler.
+    uint64_t cycles;
+};
+
+// Get the statistics of a vector on a cpu.
+// @param cpu: The cpu.
+// @param vector: The vector.
+// @param stats: Output parameter receiving the statistics. The value is a
+// snapshot and might be slightly out of date if the cpu is handling an
+// interrupt concurrently.
+void interrupt_get_stats(uint8_t const cpu,
+                         uint8_t const vector,
+                         struct interrupt_stats * const stats);
+
+// Log the statistics of all the vectors that have been received at least once,
+// for each cpu. Each line is formatted as follows:
+//      [irq] cpu=<cpu> vector=<vector> count=<n> cycles=<c> avg=<c/n>
+void interrupt_dump_stats(void);
+
 // Return whether or not a given interrupt vector has an associated error code.
 // @param vector: The vector to test.
 // @return: true if the vector has an error code, false otherwise.
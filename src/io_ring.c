@@ -0,0 +1,97 @@
+#include <io_ring.h>
+#include <syscalls.h>
+#include <sched.h>
+#include <paging.h>
+#include <frame_alloc.h>
+#include <debug.h>
+#include <error.h>
+
+STATIC_ASSERT(sizeof(struct io_ring) <= PAGE_SIZE, "");
+STATIC_ASSERT(!(IO_RING_SQ_ENTRIES & (IO_RING_SQ_ENTRIES - 1)), "");
+STATIC_ASSERT(!(IO_RING_CQ_ENTRIES & (IO_RING_CQ_ENTRIES - 1)), "");
+
+struct io_ring *do_io_ring_setup(void) {
+    struct proc * const curr = get_curr_proc();
+    ASSERT(!curr->is_kernel_proc);
+    if (curr->io_ring) {
+        return curr->io_ring;
+    }
+
+    // A zeroed frame gives empty rings.
+    void * frame = alloc_zeroed_frame();
+    if (frame == NO_FRAME) {
+        SET_ERROR("Not enough physical frames to allocate io_ring", ENONE);
+        return NULL;
+    }
+
+    // The frame is mapped in user space only. Since the rings are only used by
+    // the kernel while executing a syscall on behalf of the process, the
+    // kernel accesses them through that mapping, which is released (and the
+    // frame freed) along with the address space.
+    // Note: Start above the first page so that the address is never NULL.
+    uint32_t const flags = VM_USER | VM_WRITE | VM_NON_GLOBAL;
+    void * const ring = paging_map_frames_above((void*)PAGE_SIZE, &frame, 1,
+        flags);
+    if (ring == NO_REGION) {
+        free_frame(frame);
+        SET_ERROR("Cannot map io_ring in the process' address space", ENONE);
+        return NULL;
+    }
+    curr->io_ring = ring;
+    return ring;
+}
+
+// Execute a single request.
+// @param sqe: The request.
+// @return: The result of the request.
+static reg_t execute_sqe(struct io_ring_sqe const * const sqe) {
+    switch (sqe->opcode) {
+        case IO_RING_OP_READ:
+            return do_read(sqe->fd, sqe->buf, sqe->len);
+        case IO_RING_OP_WRITE:
+            return do_write(sqe->fd, sqe->buf, sqe->len);
+        case IO_RING_OP_KLOG:
+            do_klog(sqe->buf);
+            return 0;
+        default:
+            PANIC("Invalid io_ring opcode %u\n", sqe->opcode);
+            // Unreachable.
+            return 0;
+    }
+}
+
+uint32_t do_io_ring_enter(void) {
+    struct proc * const curr = get_curr_proc();
+    struct io_ring * const ring = curr->io_ring;
+    if (!ring) {
+        PANIC("Process %u has no io_ring\n", curr->pid);
+    }
+
+    uint32_t sq_head = ring->sq_head;
+    uint32_t cq_tail = ring->cq_tail;
+    uint32_t executed = 0;
+    while (sq_head != ring->sq_tail &&
+           cq_tail - ring->cq_head < IO_RING_CQ_ENTRIES &&
+           !proc_is_dead(curr)) {
+        // The process may modify the ring concurrently, work on a copy of the
+        // request.
+        struct io_ring_sqe volatile const * const usqe =
+            &ring->sq[sq_head & (IO_RING_SQ_ENTRIES - 1)];
+        struct io_ring_sqe const sqe = *usqe;
+        reg_t const res = execute_sqe(&sqe);
+
+        struct io_ring_cqe volatile * const cqe =
+            &ring->cq[cq_tail & (IO_RING_CQ_ENTRIES - 1)];
+        cqe->user_data = sqe.user_data;
+        cqe->res = res;
+
+        // Both counters are only published once the entries they cover are
+        // consumed/written. x86 does not re-order stores, accessing the
+        // entries through volatile pointers prevents the compiler from doing
+        // so.
+        ring->sq_head = ++sq_head;
+        ring->cq_tail = ++cq_tail;
+        executed++;
+    }
+    return executed;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <types.h>
+
+// Submission/completion rings.
+// A user process can submit I/O requests to the kernel without trapping once
+// per request. The process sets up a struct io_ring with the
+// NR_SYSCALL_IO_RING_SETUP syscall which maps it in the process' address space.
+// The struct io_ring contains two rings shared between the process and the
+// kernel:
+//  - The submission ring (SQ) in which the process pushes requests (struct
+//  io_ring_sqe). The process is the producer and updates sq_tail, the kernel is
+//  the consumer and updates sq_head.
+//  - The completion ring (CQ) in which the kernel pushes the result of each
+//  request (struct io_ring_cqe). The kernel is the producer and updates
+//  cq_tail, the process is the consumer and updates cq_head.
+// Heads and tails are free running counters, the index of an entry in its ring
+// is the counter modulo the size of the ring. A ring is empty when head ==
+// tail, and full when tail - head == size of the ring.
+// Requests are executed, in order, by the NR_SYSCALL_IO_RING_ENTER syscall
+// which drains the submission ring. A single kernel entry can therefore execute
+// as many requests as the submission ring contains.
+// Note: The kernel reads each request only once, hence modifying a request
+// after it has been submitted has no effect on its execution.
+
+// The number of entries in the submission ring. Must be a power of two.
+#define IO_RING_SQ_ENTRIES  64
+// The number of entries in the completion ring. Must be a power of two. This is
+// bigger than the submission ring so that a full submission ring can be drained
+// without waiting for the process to consume completions.
+#define IO_RING_CQ_ENTRIES  128
+
+// The operations that can be submitted:
+// Equivalent to do_read(fd, buf, len).
+#define IO_RING_OP_READ     0x0
+// Equivalent to do_write(fd, buf, len).
+#define IO_RING_OP_WRITE    0x1
+// Equivalent to do_klog(buf). fd and len are ignored.
+#define IO_RING_OP_KLOG     0x2
+
+// A request in the submission ring.
+struct io_ring_sqe {
+    // The operation to execute, one of the IO_RING_OP_* values.
+    uint32_t opcode;
+    // The file descriptor the operation applies to, if applicable.
+    fd_t fd;
+    // The buffer used by the operation.
+    void * buf;
+    // The length of the buffer in bytes, if applicable.
+    size_t len;
+    // Arbitrary value copied as is in the completion of this request.
+    uint32_t user_data;
+} __attribute__((packed));
+
+// The completion of a request.
+struct io_ring_cqe {
+    // The user_data of the completed request.
+    uint32_t user_data;
+    // The result of the operation, as it would be returned by the equivalent
+    // syscall.
+    reg_t res;
+} __attribute__((packed));
+
+// The memory shared between a process and the kernel.
+struct io_ring {
+    uint32_t volatile sq_head;
+    uint32_t volatile sq_tail;
+    uint32_t volatile cq_head;
+    uint32_t volatile cq_tail;
+    struct io_ring_sqe sq[IO_RING_SQ_ENTRIES];
+    struct io_ring_cqe cq[IO_RING_CQ_ENTRIES];
+} __attribute__((packed));
+
+// Set up the submission/completion rings of the current process. Only user
+// processes can use rings.
+// @return: The address of the struct io_ring in the process' address space. If
+// the rings are already set up, the same address is returned. NULL if the
+// rings could not be allocated.
+struct io_ring *do_io_ring_setup(void);
+
+// Execute the requests in the submission ring of the current process. The
+// execution stops when the submission ring is empty, when the completion ring
+// is full or if a request kills the process.
+// @return: The number of requests executed.
+uint32_t do_io_ring_enter(void);
@@ -6,6 +6,7 @@
 #include <paging.h>
 #include <memory.h>
 #include <spinlock.h>
+#include <interrupt.h>
 
 // The register addresses of the IO APIC.
 #define IOAPICID    0
@@ -121,12 +122,8 @@ struct redirection_entry {
             bool masked : 1;
             // Reserved.
             uint64_t : 39;
-            struct {
-                // The APIC ID of the processor to route the interrupt to.
-                uint8_t dest : 4;
-                // Reserved.
-                uint8_t : 4;
-            } __attribute__((packed));
+            // The APIC ID of the processor to route the interrupt to.
+            uint8_t dest : 8;
         } __attribute__((packed));
     } __attribute__((packed));
 } __attribute__((packed));
@@ -246,14 +243,66 @@ static void write_redirection(uint8_t const index,
     write_register(reg, curr_entry.low);
 }
 
+// The number of entries in the redirection table tracked by the kernel. Only
+// ISA interrupts are redirected, which are mapped to the first 24 entries.
+#define IOAPIC_MAX_REDIRECTIONS 24
+
+// Information about an entry of the redirection table.
+struct redirection_info {
+    // Is the entry redirecting interrupts?
+    bool used;
+    // The vector the interrupts are redirected to.
+    uint8_t vector;
+    // The APIC ID of the processor receiving the interrupts.
+    uint8_t dest;
+    // The total number of interrupts received for the vector at the time of
+    // the last call to ioapic_balance_irqs().
+    uint64_t last_count;
+};
+
+// The state of the redirection table, indexed by entry. Protected by the
+// IOAPIC_LOCK.
+static struct redirection_info REDIRECTIONS[IOAPIC_MAX_REDIRECTIONS];
+
+// The affinity requested through ioapic_set_affinity() for vectors that are
+// not redirected yet, IOAPIC_NO_AFFINITY if none. Protected by the
+// IOAPIC_LOCK.
+static uint8_t REQUESTED_AFFINITY[256];
+
 // Get the APIC ID of the processor that should receive interrupts of a given
-// vector.
+// vector. The IOAPIC_LOCK must be held.
 // @param vector: The vector.
 // @return: The APIC ID of the processor to use in the destination field.
 static uint8_t compute_destination_for_interrupt(uint8_t const vector) {
-    // TODO: Try to do some load balancing once all cores are up.
     ASSERT(vector >= 32);
-    return cpu_apic_id();
+    uint8_t const requested = REQUESTED_AFFINITY[vector];
+    return requested != IOAPIC_NO_AFFINITY ? requested : cpu_apic_id();
+}
+
+// Find the entry of the redirection table redirecting to a vector. The
+// IOAPIC_LOCK must be held.
+// @param vector: The vector.
+// @return: The index of the entry, or IOAPIC_MAX_REDIRECTIONS if the vector is
+// not redirected.
+static uint8_t find_redirection(uint8_t const vector) {
+    for (uint8_t i = 0; i < IOAPIC_MAX_REDIRECTIONS; ++i) {
+        if (REDIRECTIONS[i].used && REDIRECTIONS[i].vector == vector) {
+            return i;
+        }
+    }
+    return IOAPIC_MAX_REDIRECTIONS;
+}
+
+// Change the destination of an entry of the redirection table. The IOAPIC_LOCK
+// must be held.
+// @param index: The index of the entry.
+// @param dest: The APIC ID of the new destination.
+static void set_redirection_dest(uint8_t const index, uint8_t const dest) {
+    struct redirection_entry entry;
+    read_redirection(index, &entry);
+    entry.dest = dest;
+    write_redirection(index, &entry);
+    REDIRECTIONS[index].dest = dest;
 }
 
 void init_ioapic(void) {
@@ -275,6 +324,9 @@ void init_ioapic(void) {
     LOG("IOAPICVER  = %x\n", read_register(IOAPICVER));
     LOG("IOAPICARB  = %x\n", read_register(IOAPICARB));
     LOG("Max redirections = %u\n", get_max_redirections());
+
+    memzero(REDIRECTIONS, sizeof(REDIRECTIONS));
+    memset(REQUESTED_AFFINITY, IOAPIC_NO_AFFINITY, sizeof(REQUESTED_AFFINITY));
 }
 
 void redirect_isa_interrupt(uint8_t const isa_vector,
@@ -297,17 +349,21 @@ void redirect_isa_interrupt(uint8_t const isa_vector,
     redir.masked = 0;
     redir.waiting_for_apic = 0;
 
-    // Compute which CPU should handle this interrupt.
-    redir.dest = compute_destination_for_interrupt(new_vector);
-
     // Write the redirection entry in the IO APIC.
     redir.vector = new_vector;
 
     // The ISA vector might have been mapped to another vector on the IO APIC.
     uint8_t const mappedisa = acpi_get_isa_interrupt_vector_mapping(isa_vector);
+    ASSERT(mappedisa < IOAPIC_MAX_REDIRECTIONS);
 
     spinlock_lock(&IOAPIC_LOCK);
+    // Compute which CPU should handle this interrupt.
+    redir.dest = compute_destination_for_interrupt(new_vector);
     write_redirection(mappedisa, &redir);
+    REDIRECTIONS[mappedisa].used = true;
+    REDIRECTIONS[mappedisa].vector = new_vector;
+    REDIRECTIONS[mappedisa].dest = redir.dest;
+    REDIRECTIONS[mappedisa].last_count = 0;
     spinlock_unlock(&IOAPIC_LOCK);
 }
 
@@ -328,6 +384,96 @@ void remove_redirection_for_isa_interrupt(uint8_t const isa_vector) {
 
     // Write-back the entry.
     write_redirection(mappedisa, &curr_entry);
+    REDIRECTIONS[mappedisa].used = false;
+    spinlock_unlock(&IOAPIC_LOCK);
+}
+
+void ioapic_set_affinity(uint8_t const vector, uint8_t const cpu) {
+    ASSERT(cpu < acpi_get_number_cpus());
+    spinlock_lock(&IOAPIC_LOCK);
+    REQUESTED_AFFINITY[vector] = cpu;
+    uint8_t const index = find_redirection(vector);
+    if (index != IOAPIC_MAX_REDIRECTIONS) {
+        set_redirection_dest(index, cpu);
+    }
+    spinlock_unlock(&IOAPIC_LOCK);
+}
+
+uint8_t ioapic_get_affinity(uint8_t const vector) {
+    spinlock_lock(&IOAPIC_LOCK);
+    uint8_t const index = find_redirection(vector);
+    uint8_t const dest = index != IOAPIC_MAX_REDIRECTIONS ?
+        REDIRECTIONS[index].dest : IOAPIC_NO_AFFINITY;
+    spinlock_unlock(&IOAPIC_LOCK);
+    return dest;
+}
+
+// Get the total number of interrupts received for a vector, on all cpus.
+// @param vector: The vector.
+// @return: The number of interrupts.
+static uint64_t vector_total_count(uint8_t const vector) {
+    uint64_t total = 0;
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        struct interrupt_stats stats;
+        interrupt_get_stats(cpu, vector, &stats);
+        total += stats.count;
+    }
+    return total;
+}
+
+void ioapic_balance_irqs(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    // The load assigned to each cpu so far.
+    uint64_t cpu_load[ncpus];
+    memzero(cpu_load, sizeof(cpu_load));
+    // The load of each entry since the last balancing.
+    uint64_t load[IOAPIC_MAX_REDIRECTIONS];
+    // Whether the entry still needs to be assigned a cpu.
+    bool pending[IOAPIC_MAX_REDIRECTIONS];
+
+    spinlock_lock(&IOAPIC_LOCK);
+    for (uint8_t i = 0; i < IOAPIC_MAX_REDIRECTIONS; ++i) {
+        struct redirection_info * const info = REDIRECTIONS + i;
+        // Vectors handled by a local callback can only be handled by their
+        // current cpu.
+        pending[i] = info->used &&
+            interrupt_has_global_callback(info->vector);
+        if (!pending[i]) {
+            continue;
+        }
+        uint64_t const count = vector_total_count(info->vector);
+        load[i] = count - info->last_count;
+        info->last_count = count;
+    }
+
+    // Greedy assignment: the most loaded entry goes to the least loaded cpu.
+    while (true) {
+        uint8_t entry = IOAPIC_MAX_REDIRECTIONS;
+        for (uint8_t i = 0; i < IOAPIC_MAX_REDIRECTIONS; ++i) {
+            if (pending[i] && (entry == IOAPIC_MAX_REDIRECTIONS ||
+                               load[i] > load[entry])) {
+                entry = i;
+            }
+        }
+        if (entry == IOAPIC_MAX_REDIRECTIONS) {
+            break;
+        }
+        uint8_t cpu = 0;
+        for (uint8_t c = 1; c < ncpus; ++c) {
+            cpu = cpu_load[c] < cpu_load[cpu] ? c : cpu;
+        }
+        // Count each entry as at least one interrupt so that idle vectors are
+        // spread as well.
+        cpu_load[cpu] += load[entry] ? load[entry] : 1;
+        pending[entry] = false;
+
+        if (REDIRECTIONS[entry].dest != cpu) {
+            LOG("[irq] Moving vector %u from cpu %u to cpu %u\n",
+                REDIRECTIONS[entry].vector, REDIRECTIONS[entry].dest, cpu);
+            set_redirection_dest(entry, cpu);
+        }
+    }
     spinlock_unlock(&IOAPIC_LOCK);
 }
 
@@ -17,5 +17,32 @@ void redirect_isa_interrupt(uint8_t const isa_vector, uint8_t const new_vector);
 // @param isa_vector: The ISA vector to remove the redirection of.
 void remove_redirection_for_isa_interrupt(uint8_t const isa_vector);
 
+// Interrupt affinity
+// ------------------
+//     Each redirected interrupt is delivered to a single cpu, its affinity. By
+// default this is the cpu that created the redirection. The affinity of a
+// vector can be changed at any time, and ioapic_balance_irqs() can spread the
+// device interrupts across all the cpus. Only vectors with a global callback
+// can be moved to another cpu, see interrupt_register_global_callback().
+
+// Set the cpu receiving the interrupts of a vector. If the vector is not
+// redirected yet, the affinity is used when it gets redirected.
+// @param vector: The vector, as passed to redirect_isa_interrupt().
+// @param cpu: The cpu that should receive the interrupts.
+void ioapic_set_affinity(uint8_t const vector, uint8_t const cpu);
+
+// Get the cpu receiving the interrupts of a redirected vector.
+// @param vector: The vector, as passed to redirect_isa_interrupt().
+// @return: The cpu receiving the interrupts of `vector`, or IOAPIC_NO_AFFINITY
+// if the vector is not redirected.
+uint8_t ioapic_get_affinity(uint8_t const vector);
+#define IOAPIC_NO_AFFINITY  0xFF
+
+// Spread the redirected interrupts with a global callback across all the cpus.
+// Vectors are assigned, from the most to the least loaded, to the cpu with the
+// least load so far. The load of a vector is the number of interrupts received
+// since the previous call, as counted in the per-vector interrupt statistics.
+void ioapic_balance_irqs(void);
+
 // Execute IO APIC tests.
 void ioapic_test(void);
@@ -17,6 +17,10 @@ struct io_stream {
     // @param length: The number of bytes to write into the output stream.
     // @return: The number of bytes successfully written into the output stream.
     size_t (*write)(uint8_t const * const buf, size_t const length);
+
+    // Wait until all the bytes written into the output stream so far have
+    // actually been output. NULL if the stream does not buffer writes.
+    void (*flush)(void);
 };
 
 // Define some short-hands for input stream (not implementing write) and output
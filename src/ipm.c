@@ -3,9 +3,22 @@
 #include <interrupt.h>
 #include <acpi.h>
 #include <debug.h>
+#include <memstat.h>
 #include <kmalloc.h>
+#include <kmem_cache.h>
 #include <memory.h>
 #include <sched.h>
+#include <paging.h>
+#include <addr_space.h>
+#include <cpumask.h>
+#include <tracelog.h>
+#include <mwait.h>
+#include <rcu.h>
+
+DEFINE_TRACEPOINT(ipm_send);
+DEFINE_TRACEPOINT(ipm_recv);
+DEFINE_TRACEPOINT(tlb_shootdown);
+DEFINE_TRACEPOINT(tlb_shootdown_done);
 
 // This structure contains all the state necesasry to execute a remote function.
 // This represents the payload of an IPM message with tag REMOTE_CALL.
@@ -17,8 +30,10 @@ struct remote_call_data {
     void (*func)(void*);
     // The argument to pass to the function upon execution.
     void *arg;
-    // A ref count of this instance. If the ref_counts become 0 then it is the
-    // responsibility of the core that updated it to 0 to free this structure.
+    // A ref count of this instance, i.e. the number of targets that did not yet
+    // start executing the call, plus one for the sender of a synchronous call.
+    // An asynchronous call's slot is free again once this reaches 0, see
+    // claim_async_call().
     atomic_t ref_count;
     // This bit indicates if the sender of the remote call is waiting for the
     // call to be completed by all dest cpus.
@@ -27,16 +42,78 @@ struct remote_call_data {
     // call is synchronous. It should be incremented by each cpu once the call
     // is completed.
     atomic_t completed_count;
+    // The messages used to deliver this call, one per target cpu. All of them
+    // point to this struct. They live as long as the struct itself, hence the
+    // message of a cpu must not be accessed after this cpu released its
+    // reference.
+    struct ipm_message * slots;
 };
 
-// Lock the message queue of the current CPU.
-static void lock_message_queue(void) {
-    spinlock_lock(&this_cpu_var(message_queue_lock));
+// The number of pre-allocated struct remote_call_data per cpu for asynchronous
+// remote calls. Synchronous calls use the stack of the sender instead.
+#define ASYNC_CALL_SLOTS    8
+
+// The pool of struct remote_call_data used by the asynchronous remote calls
+// sent by a cpu. Each has ncpus messages so that it can be used for any set of
+// targets. A slot is free if its ref_count is 0.
+DECLARE_PER_CPU(struct remote_call_data *, async_calls);
+
+// The payload of TLB_SHOOTDOWN messages. A single instance, allocated on the
+// stack of the sender, is shared by all the targets of a shootdown.
+struct tlb_shootdown_data {
+    // The number of targets that did not yet invalidate their TLB. Each target
+    // decrements it once done and must not access the struct afterwards.
+    atomic_t pending;
+    // The range to invalidate. See paging_flush_tlb_range().
+    void const * vaddr;
+    uint32_t num_pages;
+};
+
+// Object cache for the struct ipm_message sent through send_ipm() and
+// broadcast_ipm().
+static DECLARE_KMEM_CACHE(MESSAGE_CACHE, struct ipm_message, CACHE_LINE_SIZE,
+    NULL);
+
+// The pre-allocated RESCHED message of each cpu, see send_resched_ipm().
+DECLARE_PER_CPU(struct ipm_message, resched_message);
+
+// Indicate that the resched_message of a cpu is in its inbox and waiting to be
+// processed. The message cannot be re-used until this flag is cleared by the
+// target.
+DECLARE_PER_CPU(atomic_t, resched_pending);
+
+// The messages taken from the inbox of a cpu but not yet processed, in the
+// order they have been sent. A message is only removed from this list right
+// before being processed. This way, a remote call that never returns (e.g.
+// lock_up()) does not drop the messages following it, they are processed by the
+// next IPM interrupt, nested in the call. Only accessed by its cpu, with
+// interrupts disabled.
+DECLARE_PER_CPU(struct ipm_message *, message_backlog);
+
+// Atomically take all the messages in the inbox of the current cpu.
+// @return: The messages in the order they have been sent, chained through their
+// next field. NULL if the inbox was empty.
+static struct ipm_message *drain_inbox(void) {
+    struct ipm_message * const lifo =
+        (void*)atomic_exchange(&this_cpu_var(message_inbox), 0);
+
+    // Reverse the list so that messages are processed in the order they have
+    // been sent.
+    struct ipm_message * fifo = NULL;
+    struct ipm_message * curr = lifo;
+    while (curr) {
+        struct ipm_message * const next = curr->next;
+        curr->next = fifo;
+        fifo = curr;
+        curr = next;
+    }
+    return fifo;
 }
 
-// Unlock the message queue of the current CPU.
-static void unlock_message_queue(void) {
-    spinlock_unlock(&this_cpu_var(message_queue_lock));
+// Check if the inbox of the current cpu contains any message.
+// @return: true if there is at least one message waiting to be processed.
+static bool inbox_is_empty(void) {
+    return !atomic_read(&this_cpu_var(message_inbox));
 }
 
 // Used for testing purposes only. This callback is called whenever a message
@@ -73,10 +150,9 @@ static void handle_remote_call(struct remote_call_data * const call) {
     if (!call->is_synchronous) {
         memcpy(&call_cpy, call, sizeof(call_cpy));
         call_data = &call_cpy;
-        if (atomic_dec_and_test(&call->ref_count)) {
-            // This is the job of this cpu to free the remote_call_data_t.
-            kfree(call);
-        }
+        // The call is from the sender's pool of asynchronous calls, the last
+        // target to release its reference makes the slot available again.
+        atomic_dec(&call->ref_count);
     } else {
         call_data = call;
     }
@@ -94,11 +170,11 @@ static void handle_remote_call(struct remote_call_data * const call) {
         // because we knew the function would return.
         ASSERT(call_data == call);
 
-        // Update ref count and potentially free the struct. This must be done
-        // BEFORE updating the completed_count. Additionaly we know for sure
-        // that the ref_count cannot reach 0 here, because in the synchronous
-        // case it is the responsibility of the sending cpu to free the struct
-        // remote_call_data.
+        // Update ref count. This must be done BEFORE updating the
+        // completed_count, as the struct lives on the stack of the sender which
+        // returns as soon as all targets completed. Additionaly we know for
+        // sure that the ref_count cannot reach 0 here, because in the
+        // synchronous case the sender holds a reference.
         ASSERT(!atomic_dec_and_test(&call->ref_count));
 
         // Notify the completion.
@@ -106,62 +182,109 @@ static void handle_remote_call(struct remote_call_data * const call) {
     }
 }
 
-// Process any message in this cpu's message queue.
-static void process_messages(void) {
-    struct list_node * const head = &this_cpu_var(message_queue);
-
-    // Atomically pick the first message in the queue and process it. Do that
-    // until all messages have been processed.
-    lock_message_queue();
-    while (list_size(head)) {
-        // Get the first message in the queue and remove it.
-        struct ipm_message * const first =
-            list_first_entry(head, struct ipm_message, msg_queue);
-        struct list_node * const node = &first->msg_queue;
-        list_del(node);
-
-        // We can now unlock the queue so that remote cpus can still send us
-        // message while we are processing this one.
-        unlock_message_queue();
-
-        // Copy the message structure onto the stack, and free the original
-        // message (if required) before processing it. This is to avoid memory
-        // leak if if this message is a remote call for a function that will
-        // never return. We could only do so if the message is a REMOTE_CALL but
-        // the complexity is not worth the savings.
-        struct ipm_message msg;
-        memcpy(&msg, first, sizeof(msg));
-        if (first->receiver_dealloc) {
-            kfree(first);
+// Process a single message.
+// @param message: The message to process. If the receiver is responsible for
+// de-allocating it, it will be freed by this function.
+static void process_message(struct ipm_message * const message) {
+    // Copy the message structure onto the stack, and free the original
+    // message (if required) before processing it. This is to avoid memory
+    // leak if if this message is a remote call for a function that will
+    // never return. We could only do so if the message is a REMOTE_CALL but
+    // the complexity is not worth the savings.
+    struct ipm_message msg;
+    memcpy(&msg, message, sizeof(msg));
+    TRACEPOINT(ipm_recv, "sender=%u tag=%u", msg.sender_id, msg.tag);
+    if (message->receiver_dealloc) {
+        kmem_cache_free(&MESSAGE_CACHE, message);
+    }
+
+    switch (msg.tag) {
+        case __TEST : {
+            if (TEST_TAG_CALLBACK) {
+                TEST_TAG_CALLBACK(&msg);
+            }
+            break;
+        }
+        case REMOTE_CALL : {
+            struct remote_call_data * const call = msg.data;
+            handle_remote_call(call);
+            break;
+        }
+        case TLB_SHOOTDOWN : {
+            // See exec_tlb_shootdown() for more information about how
+            // TLB-shootdowns are implemented in this kernel.
+            struct tlb_shootdown_data * const data = msg.data;
+            paging_flush_tlb_range(data->vaddr, data->num_pages);
+            // The sender may return as soon as pending reaches 0, data must
+            // not be accessed after this point.
+            atomic_dec(&data->pending);
+            break;
+        }
+        case RESCHED : {
+            // The message has been copied, it can be re-used by the next
+            // sender.
+            atomic_exchange(&this_cpu_var(resched_pending), 0);
+            sched_resched();
+            break;
         }
+    }
+}
+
+// Process any message in this cpu's message inbox.
+static void process_messages(void) {
+    // Drain the inbox until both the inbox and the backlog stay empty. Messages
+    // sent while processing the backlog are picked up by the next iteration.
+    while (!inbox_is_empty() || this_cpu_var(message_backlog)) {
+        struct ipm_message * batch = drain_inbox();
 
-        switch (msg.tag) {
-            case __TEST : {
-                if (TEST_TAG_CALLBACK) {
-                    TEST_TAG_CALLBACK(&msg);
+        // TLB_SHOOTDOWNs are critical and should be handled as soon as
+        // possible, since the sender is spinning. Process them before any other
+        // message of the batch. RESCHED messages only set a flag and are
+        // processed right away as well, so that the resched_pending flag is
+        // cleared even if a message before them never returns.
+        // The other messages are kept, in order, in the [others; others_tail]
+        // list.
+        struct ipm_message * others = NULL;
+        struct ipm_message * others_tail = NULL;
+        while (batch) {
+            // Read the next pointer before processing, the message might be
+            // freed.
+            struct ipm_message * const next = batch->next;
+            if (batch->tag == TLB_SHOOTDOWN || batch->tag == RESCHED) {
+                process_message(batch);
+            } else {
+                batch->next = NULL;
+                if (others_tail) {
+                    others_tail->next = batch;
+                } else {
+                    others = batch;
                 }
-                break;
-            }
-            case REMOTE_CALL : {
-                struct remote_call_data * const call = msg.data;
-                handle_remote_call(call);
-                break;
+                others_tail = batch;
             }
-            case TLB_SHOOTDOWN : {
-                // See exec_tlb_shootdown() for more information about how
-                // TLB-shootdowns are implemented in this kernel.
-                atomic_t * const wait = (atomic_t*)msg.data;
-                cpu_invalidate_tlb();
-                atomic_dec(wait);
-                break;
+            batch = next;
+        }
+
+        // Append the remaining messages to the backlog, after the messages
+        // left over by a remote call that did not return.
+        struct ipm_message * last = this_cpu_var(message_backlog);
+        if (!last) {
+            this_cpu_var(message_backlog) = others;
+        } else {
+            while (last->next) {
+                last = last->next;
             }
+            last->next = others;
         }
 
-        // Re-acquire the lock before the next iteration since the condition
-        // accesses the queue.
-        lock_message_queue();
+        // Pop each message from the backlog before processing it. The backlog
+        // must be re-read after each message, a nested call to this function
+        // might have processed some of it.
+        struct ipm_message * msg;
+        while ((msg = this_cpu_var(message_backlog))) {
+            this_cpu_var(message_backlog) = msg->next;
+            process_message(msg);
+        }
     }
-    unlock_message_queue();
 }
 
 // The IPI handler for IPMs. This handler is registered globally by the init_ipm
@@ -170,26 +293,54 @@ static void process_messages(void) {
 // handler.
 static void ipm_handler(struct interrupt_frame const * const frame) {
     ASSERT(frame);
+    // If the interrupted context was preemptible, it was not in an RCU
+    // read-side critical section. This is how cpus kicked by RCU report their
+    // quiescent state.
+    bool const quiescent = preemptible();
     // Jump to the process_messages function to processes any message(s) in the
     // message queue.
     preempt_disable();
+    if (quiescent) {
+        rcu_note_quiescent_state();
+    }
     process_messages();
     preempt_enable();
 }
 
 void init_ipm(void) {
     uint8_t const ncpus = acpi_get_number_cpus();
-    // For each cpu, initialize the lock (to set it in an unlocked state) and
-    // message queue.
+    // For each cpu, initialize the message inbox to an empty state.
     for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
-        // This is technically an abomination since we don't own the lock, but
-        // this work very will in practice.
-        spinlock_unlock(&cpu_var(message_queue_lock, cpu));
-        list_init(&cpu_var(message_queue, cpu));
+        atomic_init(&cpu_var(message_inbox, cpu), 0);
+        atomic_init(&cpu_var(resched_pending, cpu), 0);
+        cpu_var(message_backlog, cpu) = NULL;
+    }
+
+    // Pre-allocate the asynchronous remote calls of all cpus, along with their
+    // messages, in a single allocation so that remote calls never use the
+    // heap.
+    size_t const calls_size = ASYNC_CALL_SLOTS * sizeof(struct remote_call_data);
+    size_t const msgs_size = ASYNC_CALL_SLOTS * ncpus *
+        sizeof(struct ipm_message);
+    uint8_t * const pool = kmalloc(ncpus * (calls_size + msgs_size));
+    if (!pool) {
+        PANIC("Cannot allocate the asynchronous remote call slots\n");
+    }
+    memstat_add(MEMSTAT_IPM, ncpus * (calls_size + msgs_size));
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        uint8_t * const area = pool + cpu * (calls_size + msgs_size);
+        struct remote_call_data * const calls = (void*)area;
+        struct ipm_message * const msgs = (void*)(area + calls_size);
+        for (uint32_t i = 0; i < ASYNC_CALL_SLOTS; ++i) {
+            atomic_init(&calls[i].ref_count, 0);
+            calls[i].slots = msgs + i * ncpus;
+        }
+        cpu_var(async_calls, cpu) = calls;
     }
 
     // Register a global callback so that all cpus can receive IPMs.
     interrupt_register_global_callback(IPM_VECTOR, ipm_handler);
+    interrupt_register_global_callback(RESCHED_VECTOR, ipm_handler);
 }
 
 // Dynamically allocate an ipm_message_t and initialize it to the given values.
@@ -203,7 +354,7 @@ void init_ipm(void) {
 static struct ipm_message * alloc_message(enum ipm_tag_t const tag,
                                             void * const data,
                                             size_t const len) {
-    struct ipm_message * const message = kmalloc(sizeof(*message));
+    struct ipm_message * const message = kmem_cache_alloc(&MESSAGE_CACHE);
     if (!message) {
         // It is probably better to just PANIC here, this is used by the kernel
         // only, not facing user space.
@@ -218,29 +369,21 @@ static struct ipm_message * alloc_message(enum ipm_tag_t const tag,
     message->receiver_dealloc = true;
     message->data = data;
     message->len = len;
-    list_init(&message->msg_queue);
+    message->next = NULL;
     return message;
 }
 
-// Enqueue a message on a cpu's message queue.
+// Enqueue a message in a cpu's message inbox.
 // @param message: The message to enqueue.
+// @param cpu: The cpu to send the message to.
 static void enqueue_message(struct ipm_message * const message,
                             uint8_t const cpu) {
-    struct list_node * const message_queue = &cpu_var(message_queue, cpu);
-    // Atomically append the message to the remote cpu's queue.
-    spinlock_t * const lock = &cpu_var(message_queue_lock, cpu);
-    spinlock_lock(lock);
-
-    if (message->tag == TLB_SHOOTDOWN) {
-        // TLB_SHOOTDOWNs are critical and should be handled as soon as
-        // possible. Therefore enqueue them at the head of the message queue of
-        // the destination.
-        list_add(message_queue, &message->msg_queue);
-    } else {
-        list_add_tail(message_queue, &message->msg_queue);
-    }
-
-    spinlock_unlock(lock);
+    atomic_t * const inbox = &cpu_var(message_inbox, cpu);
+    int32_t head;
+    do {
+        head = atomic_read(inbox);
+        message->next = (void*)head;
+    } while (atomic_compare_and_exchange(inbox, head, (int32_t)message) != head);
 }
 
 // Send an IPM.
@@ -257,6 +400,8 @@ static void do_send_ipm(uint8_t const cpu,
     uint8_t const ncpus = acpi_get_number_cpus();
     bool const is_broadcast = cpu == IPI_BROADCAST;
 
+    TRACEPOINT(ipm_send, "dest=%u tag=%u", cpu, tag);
+
     uint8_t const start = is_broadcast ? 0 : cpu;
     uint8_t const end = is_broadcast ? ncpus : cpu + 1;
     for (uint8_t i = start; i < end; ++i) {
@@ -293,132 +438,256 @@ void broadcast_ipm(enum ipm_tag_t const tag,
     do_send_ipm(IPI_BROADCAST, tag, data, len);
 }
 
-void exec_remote_call(uint8_t const cpu,
-                      void (*func)(void*),
-                      void * const arg,
-                      bool const wait) {
-    // How to choose the reference count initial value ?
-    // ref_count == 1 => The remote core will execute the function and free the
-    // struct remote_call_data immediately after. This is good if we don't
-    // want to wait for the remote call to finish.
-    // ref_count == 2 => After executing the call, the remote core will dec the
-    // ref_count to 1, and therefore will not free the memroy. This is good if
-    // we want to wait for the call to finish, just wait for the ref_count to
-    // become one.
-    int32_t const ref_count_initial_val = wait ? 2 : 1;
-
-    struct remote_call_data *rem_data = kmalloc(sizeof(*rem_data));
-    if (!rem_data) {
-        PANIC("Cannot allocate remote_call_data for remote call\n");
+void send_resched_ipm(uint8_t const cpu) {
+    if (cpu == cpu_id()) {
+        sched_resched();
+        return;
     }
 
-    rem_data->func = func;
-    rem_data->arg = arg;
-    atomic_init(&rem_data->ref_count, ref_count_initial_val);
-    rem_data->is_synchronous = wait;
-    atomic_init(&rem_data->completed_count, 0);
+    if (atomic_exchange(&cpu_var(resched_pending, cpu), 1)) {
+        // A request is already pending, the target will reschedule anyway.
+        return;
+    }
 
-    send_ipm(cpu, REMOTE_CALL, rem_data, sizeof(rem_data));
+    struct ipm_message * const message = &cpu_var(resched_message, cpu);
+    message->tag = RESCHED;
+    message->sender_id = cpu_id();
+    message->receiver_dealloc = false;
+    message->data = NULL;
+    message->len = 0;
+    enqueue_message(message, cpu);
+    lapic_send_ipi(cpu, RESCHED_VECTOR);
+}
 
-    if (wait) {
-        while (atomic_read(&rem_data->completed_count) != 1) {
-            cpu_pause();
+// Claim a free slot in the pool of asynchronous calls of the current cpu. If
+// all slots are in use, wait for the targets of one of them to process their
+// message. Interrupts are enabled while waiting, as this cpu might be one of
+// those targets.
+// @param ntargets: The number of targets of the call. This is the initial value
+// of the ref_count of the claimed slot.
+// @return: The claimed struct remote_call_data.
+static struct remote_call_data *claim_async_call(uint32_t const ntargets) {
+    // The pool is per-cpu to avoid contention but a slot is claimed atomically,
+    // hence being migrated after reading async_calls is harmless.
+    struct remote_call_data * const calls = this_cpu_var(async_calls);
+    ASSERT(calls);
+    ASSERT(ntargets <= acpi_get_number_cpus());
+    bool const irqs = interrupts_enabled();
+    while (true) {
+        for (uint32_t i = 0; i < ASYNC_CALL_SLOTS; ++i) {
+            atomic_t * const ref = &calls[i].ref_count;
+            if (!atomic_compare_and_exchange(ref, 0, ntargets)) {
+                cpu_set_interrupt_flag(irqs);
+                return calls + i;
+            }
         }
-        ASSERT(atomic_read(&rem_data->ref_count) == 1);
-        kfree(rem_data);
+        cpu_set_interrupt_flag(true);
+        cpu_pause();
     }
 }
 
-void broadcast_remote_call(void (*func)(void*),
+// Deliver a remote call to its targets: enqueue the messages and send the IPIs.
+// @param rem_data: The initialized call. Its slots must contain at least one
+// message per target.
+// @param mask: The targets.
+// @param ntargets: The number of targets in `mask`.
+static void send_remote_call(struct remote_call_data * const rem_data,
+                             struct cpumask const * const mask,
+                             uint32_t const ntargets) {
+    struct ipm_message * const slots = rem_data->slots;
+    uint8_t const this_cpu = cpu_id();
+    uint32_t i = 0;
+    uint32_t cpu;
+    cpumask_for_each(cpu, mask) {
+        struct ipm_message * const slot = slots + i++;
+        slot->tag = REMOTE_CALL;
+        slot->sender_id = this_cpu;
+        // The slots live as long as the struct remote_call_data.
+        slot->receiver_dealloc = false;
+        slot->data = rem_data;
+        slot->len = sizeof(*rem_data);
+        slot->next = NULL;
+        enqueue_message(slot, cpu);
+    }
+    // Past this point, rem_data must not be accessed if the call is
+    // asynchronous, as its slot might have been re-used already.
+
+    // Notify the targets. If all remote cpus are targeted a single IPI with the
+    // "all excluding self" shorthand is enough, otherwise a single IPI is sent
+    // per logical cluster of targets.
+    if (!cpumask_has(mask, this_cpu) &&
+        ntargets == (uint32_t)acpi_get_number_cpus() - 1) {
+        lapic_send_ipi(IPI_BROADCAST, IPM_VECTOR);
+    } else {
+        lapic_send_ipi_mask(mask, IPM_VECTOR);
+    }
+}
+
+void multicast_remote_call(struct cpumask const * const mask,
+                           void (*func)(void*),
                            void * const arg,
                            bool const wait) {
-    // As in exec_remote_call, the initial value of the ref_count depends on
-    // whether or not we want for this cpu to wait for the remote calls to
-    // finish.
-    int32_t const ref_count_initial_val = acpi_get_number_cpus() - (wait?0:1);
-
-    struct remote_call_data *rem_data = kmalloc(sizeof(*rem_data));
-    if (!rem_data) {
-        PANIC("Cannot allocate remote_call_data for remote call\n");
+    uint32_t const ntargets = cpumask_weight(mask);
+    if (!ntargets) {
+        return;
     }
 
-    rem_data->func = func;
-    rem_data->arg = arg;
-    atomic_init(&rem_data->ref_count, ref_count_initial_val);
-    rem_data->is_synchronous = wait;
-    atomic_init(&rem_data->completed_count, 0);
-
-    broadcast_ipm(REMOTE_CALL, rem_data, sizeof(rem_data));
-
+    // Remote calls never allocate memory:
+    //  - A synchronous call keeps the struct remote_call_data and its messages
+    //  on the stack, the sender does not return before all targets are done
+    //  with them. The ref_count starts at ntargets + 1 so that it never reaches
+    //  0, only the completed_count is used to detect completion.
+    //  - An asynchronous call uses a pre-allocated slot from the pool of the
+    //  sender. The ref_count starts at ntargets, the slot is free again once
+    //  all targets copied the call, i.e. before executing it, hence a call
+    //  that never returns does not hold a slot.
     if (wait) {
-        uint8_t const ncpus = acpi_get_number_cpus();
-        while (atomic_read(&rem_data->completed_count) != ncpus - 1) {
-            cpu_pause();
-        }
-        ASSERT(atomic_read(&rem_data->ref_count) == 1);
-        kfree(rem_data);
+        struct ipm_message messages[ntargets];
+        struct remote_call_data rem_data = {
+            .func = func,
+            .arg = arg,
+            .is_synchronous = true,
+            .slots = messages,
+        };
+        atomic_init(&rem_data.ref_count, ntargets + 1);
+        atomic_init(&rem_data.completed_count, 0);
+
+        send_remote_call(&rem_data, mask, ntargets);
+
+        wait_on_address(&rem_data.completed_count,
+            (uint32_t)atomic_read(&rem_data.completed_count) == ntargets);
+        ASSERT(atomic_read(&rem_data.ref_count) == 1);
+    } else {
+        struct remote_call_data * const rem_data = claim_async_call(ntargets);
+        rem_data->func = func;
+        rem_data->arg = arg;
+        rem_data->is_synchronous = false;
+        atomic_init(&rem_data->completed_count, 0);
+        send_remote_call(rem_data, mask, ntargets);
     }
 }
 
-void exec_tlb_shootdown(void) {
+void exec_remote_call(uint8_t const cpu,
+                      void (*func)(void*),
+                      void * const arg,
+                      bool const wait) {
+    struct cpumask mask;
+    cpumask_clear(&mask);
+    cpumask_set(&mask, cpu);
+    multicast_remote_call(&mask, func, arg, wait);
+}
+
+void broadcast_remote_call(void (*func)(void*),
+                           void * const arg,
+                           bool const wait) {
+    struct cpumask mask;
+    cpumask_fill(&mask);
+    cpumask_unset(&mask, cpu_id());
+    multicast_remote_call(&mask, func, arg, wait);
+}
+
+void exec_tlb_shootdown(struct addr_space const * const addr_space,
+                        void const * const vaddr,
+                        uint32_t const num_pages) {
     // TLB-Shootdowns are implemented as follows:
-    // For each remote cpu:
-    //  1. Send an IPM message with tag = TLB_SHOOTDOWN. The data contains a
-    //  pointer to an atomic_t initialized to 1.
-    //  2. Wait for the atomic_t to become 0, this indicate that the remtoe cpu
-    //  flushed its TLB.
+    //  1. Select the target cpus, that is all the remote cpus currently using
+    //  the address space, including the cpus borrowing it for a kernel process,
+    //  or all remote cpus if addr_space is NULL.
+    //  2. Enqueue a TLB_SHOOTDOWN message in the message queue of each target.
+    //  All messages point to the same struct tlb_shootdown_data containing the
+    //  range to invalidate and a pending counter initialized to the number of
+    //  targets.
+    //  3. Send the IPIs, a single broadcast IPI if all cpus are targeted.
+    //  4. Wait for the pending counter to become 0, this indicates that all
+    //  targets invalidated the range from their TLB.
     //
-    // Upon receiving a TLB_SHOOTDOWN message, a core flushes its TLB and
-    // decreases the value of the atomic_t passed through the data of the
-    // message.
+    // A cpu switching to the address space after it has been selected (or not)
+    // as a target is not an issue: switching address space flushes the TLB and
+    // the page tables have already been modified at this point.
 
-    atomic_t wait;
+    // Stay on this cpu for the entire duration of the shootdown, otherwise we
+    // might end up being part of the targets.
+    preempt_disable();
+
+    uint8_t const ncpus = acpi_get_number_cpus();
+    uint8_t const this_cpu = cpu_id();
 
-    // We _must_ statically allocate the message here as kmalloc could
+    struct tlb_shootdown_data data = {
+        .vaddr = vaddr,
+        .num_pages = num_pages,
+    };
+
+    // We _must_ statically allocate the messages here as kmalloc could
     // potentially require a new group and therefore map a new page and execute
     // a TLB shootdown leading to an infinite loop.
-    struct ipm_message tlb_message = {
-        .tag = TLB_SHOOTDOWN,
-        .sender_id = cpu_id(),
-        .receiver_dealloc = false,
-        .data = &wait,
-        .len = sizeof(wait),
-    };
+    struct ipm_message messages[ncpus];
 
-    // For now, the TLB shootdown message is sent to each cpu sequentially. This
-    // is because of a limitation of IPM messages that can only be enqueued in a
-    // single message queue at any time. This is slow but will do for now.
-    for (uint8_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
-        if (cpu == cpu_id()) {
+    // Make sure the modifications of the page tables are visible to the other
+    // cpus before reading their current address spaces.
+    cpu_mfence();
+
+    uint8_t targets[ncpus];
+    uint8_t num_targets = 0;
+    struct cpumask target_mask;
+    cpumask_clear(&target_mask);
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        if (cpu == this_cpu) {
             continue;
+        } else if (!addr_space || cpu_uses_addr_space(cpu, addr_space)) {
+            targets[num_targets++] = cpu;
+            cpumask_set(&target_mask, cpu);
         }
+    }
 
-        atomic_init(&wait, 1);
-        list_init(&tlb_message.msg_queue);
+    if (!num_targets) {
+        preempt_enable_no_resched();
+        return;
+    }
+    TRACEPOINT(tlb_shootdown, "as=%p vaddr=%p pages=%u targets=%u", addr_space,
+               vaddr, num_pages, num_targets);
+    // The counter must be initialized before enqueuing any message, as targets
+    // might process their message before we are done sending all of them.
+    atomic_init(&data.pending, num_targets);
+
+    for (uint8_t i = 0; i < num_targets; ++i) {
+        struct ipm_message * const message = messages + i;
+        message->tag = TLB_SHOOTDOWN;
+        message->sender_id = this_cpu;
+        message->receiver_dealloc = false;
+        message->data = &data;
+        message->len = sizeof(data);
+        message->next = NULL;
 
         // We need to manually enqueue and raise the IPI here as it is normally
         // done by send_ipm() which we cannot use here (because of the dynamic
         // allocation).
-        enqueue_message(&tlb_message, cpu);
-        lapic_send_ipi(cpu, IPM_VECTOR);
-
-        // Now wait for the remote cpu to acknowlege the TLB_SHOOTDOWN message.
-        // WARNING: While waiting for the remote CPU to acknowlege, we _MUST_
-        // re-enable interrupts. This is to avoid a deadlock if the remote cpu
-        // tries to send us a TLB_SHOOTDOWN message in the meantime.
-        bool const irqs = interrupts_enabled();
-        cpu_set_interrupt_flag(true);
+        enqueue_message(message, targets[i]);
+    }
 
-        // No need for the lapic_eoi() call here. In case we are within an
-        // interrupt handler, the generic_interrupt_handler() already called
-        // lapic_eoi() for us.
+    if (num_targets == ncpus - 1) {
+        // All remote cpus are targeted, use a single IPI.
+        lapic_send_ipi(IPI_BROADCAST, IPM_VECTOR);
+    } else {
+        lapic_send_ipi_mask(&target_mask, IPM_VECTOR);
+    }
 
-        while (atomic_read(&wait)) {
-            cpu_pause();
-        }
+    // Now wait for all the targets to acknowlege the TLB_SHOOTDOWN message.
+    // WARNING: While waiting for the remote CPUs to acknowlege, we _MUST_
+    // re-enable interrupts. This is to avoid a deadlock if a remote cpu tries
+    // to send us a TLB_SHOOTDOWN message in the meantime.
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(true);
 
-        cpu_set_interrupt_flag(irqs);
-    }
+    // No need for the lapic_eoi() call here. In case we are within an
+    // interrupt handler, the generic_interrupt_handler() already called
+    // lapic_eoi() for us.
+
+    wait_on_address(&data.pending, !atomic_read(&data.pending));
+    TRACEPOINT(tlb_shootdown_done, "as=%p", addr_space);
+
+    cpu_set_interrupt_flag(irqs);
+    // Do not call schedule() here, the caller might not be expecting it.
+    preempt_enable_no_resched();
 }
 
 #include <ipm.test>
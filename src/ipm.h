@@ -5,12 +5,15 @@
 #include <percpu.h>
 #include <atomic.h>
 
+struct addr_space;
+struct cpumask;
+
 // To make communication between cores easier, the kernel provide a mechanism of
 // Inter-Processor-Messaging (IPM).
 // This mechanism allows one to send "messages" to remote cores through IPIs.
 // When a core wants to send a message to a remote core, it first enqueue the
-// message in the remote core's message queue (think of it as an inbox) and
-// sends an IPI to the remote core.
+// message in the remote core's message inbox and sends an IPI to the remote
+// core.
 // Upon receiving the IPI, the remote core will process the message and carry
 // out any operation associated with it.
 // IPIs are set to maskable, such that a core will not receive IPM message in a
@@ -20,15 +23,21 @@
 // in the queue.
 #define IPM_VECTOR  33
 
+// Vector 35 is reserved to reschedule IPIs, see send_resched_ipm(). It is
+// handled by the same handler as IPM_VECTOR.
+#define RESCHED_VECTOR  35
+
 // Each message is associated a tag indicating its nature.
 enum ipm_tag_t {
     // This tag is used for testing only!
     __TEST,
     // Execute a remote function call on a cpu.
     REMOTE_CALL,
-    // Indicate a remote cpu that it needs to flush its TLB. For now a
-    // TLB_SHOOTDOWN message will flush the entire TLB of the remote cpu.
+    // Indicate a remote cpu that it needs to invalidate a range of virtual
+    // addresses from its TLB. See exec_tlb_shootdown().
     TLB_SHOOTDOWN,
+    // Request a remote cpu to reschedule. See send_resched_ipm().
+    RESCHED,
 };
 
 // The structure of a message.
@@ -46,17 +55,19 @@ struct ipm_message {
     void * data;
     // The length of the data memory region. If Any.
     size_t len;
-    // Each message is enqueued in the remote cpu's message queue.
-    struct list_node msg_queue;
+    // Link to the next message in the inbox of the remote cpu.
+    struct ipm_message * next;
 } __attribute__((packed));
 
-// The message queue of a cpu.
-DECLARE_PER_CPU(struct list_node, message_queue);
-
-// Since multiple cpus can try to send a message to the same destination
-// concurrently, the message queue needs a lock to protect it against race
-// conditions.
-DECLARE_PER_CPU(spinlock_t, message_queue_lock);
+// The message inbox of a cpu. This is a lock-free multi-producer
+// single-consumer queue implemented as an intrusive singly-linked list of
+// struct ipm_message. The atomic_t contains the address of the last message
+// pushed to the inbox, NULL if the inbox is empty:
+//  - Senders push a message by atomically compare-and-exchanging the head of
+//  the inbox with the address of their message.
+//  - The owner of the inbox takes all the messages at once by atomically
+//  exchanging the head with NULL. The messages are then in LIFO order.
+DECLARE_PER_CPU(atomic_t, message_inbox);
 
 // Initialize IPM related data i.e. per-cpu variables related to IPM. This must
 // be done by a single cpu (not necessarily the BSP) _before_ attempting to send
@@ -83,6 +94,15 @@ void broadcast_ipm(enum ipm_tag_t const tag,
                    void * const data,
                    size_t const len);
 
+// Request a cpu to reschedule as soon as possible. This sets the resched_flag
+// of the target and kicks it out of halt if it is idle. The message used is
+// pre-allocated per target, hence this function never allocates memory, and at
+// most one request can be pending per target: sending a request to a cpu that
+// did not yet process the previous one is a no-op.
+// @param cpu: The cpu to send the request to. If this is the current cpu, its
+// resched_flag is set directly.
+void send_resched_ipm(uint8_t const cpu);
+
 // Remote calls
 // ============
 //      The IPM mechanism provides a way to execute function calls on remote cpu
@@ -92,6 +112,11 @@ void broadcast_ipm(enum ipm_tag_t const tag,
 // while still being in the interrupt context. As a result:
 //  - Interrupts are disabled while calling the function.
 //  - The function to execute must be fast.
+// Remote calls never allocate memory: a synchronous call (wait = true) keeps its
+// payload and messages on the stack of the sender, an asynchronous call uses
+// one of the slots pre-allocated for the sender by init_ipm(). If all the slots
+// of the sender are in use, an asynchronous call waits, with interrupts
+// enabled, for the targets of an earlier call to process their message.
 
 // Execute a function call on a remote processor.
 // @param cpu: The APIC ID of the cpu on which the remote call is to be
@@ -106,6 +131,20 @@ void exec_remote_call(uint8_t const cpu,
                       void * const arg,
                       bool const wait);
 
+// Execute a function on a set of cpus. A single payload is shared by all the
+// targets and the IPIs are sent to all targets before waiting for any of them.
+// @param mask: The set of cpus on which the function should be executed. Can
+// contain the current cpu.
+// @param func: A pointer to the function to be executed on the remote cores.
+// @param arg: The argument to pass to the function when executing remotely.
+// @param wait: If true, this function will only return once all the targets
+// executed the function. If false, this function will return immediately after
+// sending the REMOTE_CALL messages.
+void multicast_remote_call(struct cpumask const * const mask,
+                           void (*func)(void*),
+                           void * const arg,
+                           bool const wait);
+
 // Execute a function on all cpus on the system, except this one.
 // @param func: A pointer to the function to be executed on the remote cores.
 // @param arg: The argument to pass to the function when executing remotely.
@@ -116,10 +155,20 @@ void broadcast_remote_call(void (*func)(void*),
                            void * const arg,
                            bool const wait);
 
-// Execute a TLB Shootdown. This function will send out TLB_SHOOTDOWN message to
-// each cpu (except self) on the system and only return when all cpus have
-// acknowleged the message.
-void exec_tlb_shootdown(void);
+// Execute a TLB Shootdown. This function will send out a TLB_SHOOTDOWN message
+// to each targeted cpu (except self) and only return when all of them have
+// acknowleged the message. The messages are sent to all targets before waiting
+// for any acknowlegement so that the remote cpus process them in parallel.
+// @param addr_space: Only the cpus currently using this address space are
+// targeted. If NULL, all cpus are targeted, this is required when modifying
+// kernel mappings.
+// @param vaddr: The start address of the virtual memory range to invalidate.
+// @param num_pages: The number of pages in the range. Remote cpus use INVLPG if
+// this is at most TLB_FLUSH_MAX_INVLPG and flush their entire TLB otherwise. A
+// value of 0 requests a full TLB flush.
+void exec_tlb_shootdown(struct addr_space const * const addr_space,
+                        void const * const vaddr,
+                        uint32_t const num_pages);
 
 // Execute IPM related tests.
 void ipm_test(void);
@@ -8,6 +8,11 @@
 #include <math.h>
 #include <spinlock.h>
 #include <error.h>
+#include <percpu.h>
+#include <acpi.h>
+#include <workqueue.h>
+#include <kmalloc_stats.h>
+#include <kmalloc_sample.h>
 
 // Dynamic memory allocator for the kernel.
 // The memory allocator has the same interfaces as malloc() and free(). The goal
@@ -40,14 +45,38 @@
 //
 // Free list:
 // ==========
-// To speed up allocation a free list is constructed within groups. A free list
-// is basically a linked list of free node that can be iterated over when
-// finding a suitable node for allocation.
+// A free list is constructed within groups. A free list is basically a linked
+// list of free node, sorted by addresses. It is used to merge neighbouring free
+// nodes.
+//
+// Buckets:
+// ========
+// To speed up allocation, each free node is also part of a segregated free list
+// (bucket) of its group. Bucket i contains the free nodes of size in
+// [2^i; 2^(i+1)[, the last bucket contains all the bigger nodes. A bitmap of
+// the non-empty buckets is maintained in each group so that finding a free node
+// big enough for an allocation is a find-first-set in the bitmap followed by a
+// pop from the bucket.
 //
 // Free:
 // =====
 // Upon freeing memory, the corresponding node is marked as FREE and inserted
 // back into the free list.
+//
+// Empty groups:
+// =============
+// Unmapping a group triggers a TLB shootdown on all cpus, and an allocation
+// following the free of the last node of a group would map a new one right
+// away. Hence small groups becoming empty are not freed immediately but kept
+// in a pool, from which do_kmalloc() takes a group of the required size before
+// creating a new one. When the pool holds more than EMPTY_GROUPS_HIGH_PAGES
+// pages, it is shrunk down to EMPTY_GROUPS_LOW_PAGES pages by a work item, the
+// gap between the two avoiding to free groups on every kfree() around the
+// limit. The pool is emptied when no physical frame is left to create a group.
+
+// The number of buckets in a group. The last bucket contains all free nodes of
+// 2^(NUM_BUCKETS - 1) bytes or more.
+#define NUM_BUCKETS 16
 
 // This is the structure describing a group of virtual pages.
 struct group {
@@ -61,6 +90,11 @@ struct group {
     struct list_node group_list;
     // The free list of this group.
     struct list_node free_head;
+    // Bitmap of the non-empty buckets: bit i is set iff buckets[i] contains at
+    // least one free node.
+    uint32_t bucket_bitmap;
+    // The buckets of this group.
+    struct list_node buckets[NUM_BUCKETS];
 } __attribute__((packed));
 
 // An allocation node.
@@ -76,8 +110,14 @@ struct node {
         // This part is used for data storage. For free node, it contains state
         // for the free list element. For allocated node this is the actual
         // data.
-        // For free node this is where we store the free list element.
-        struct list_node free;
+        // For free node this is where we store the free list element and the
+        // bucket list element.
+        struct {
+            // Element of the free list sorted by addresses.
+            struct list_node free;
+            // Element of the bucket containing this node.
+            struct list_node bucket;
+        } __attribute__((packed));
         // Variable size.
         uint8_t data[0];
     };
@@ -92,11 +132,111 @@ struct node {
 // The size of a node header in bytes.
 #define HEADER_SIZE (sizeof((struct node*)NULL)->header)
 // The minimum allocation size. The reason behind this minimum is that the
-// element of the free list is included in the data section of the node struct.
-// Therefore every node need at least this amount of memory to contain this
-// struct list_node in case it becomes a free node.
+// elements of the free list and bucket are included in the data section of the
+// node struct. Therefore every node need at least this amount of memory to
+// contain those struct list_node in case it becomes a free node.
 #define MIN_SIZE    (sizeof(struct node) - HEADER_SIZE)
 
+// Compute the floor of the base 2 logarithm of a size.
+// @param size: The size, must be > 0.
+// @return: floor(log2(size)).
+static uint32_t floor_log2(uint32_t const size) {
+    ASSERT(size);
+    return 31 - __builtin_clz(size);
+}
+
+// Compute the index of the bucket that should contain a free node.
+// @param size: The size of the free node.
+// @return: The index of the bucket for free nodes of `size` bytes.
+static uint32_t bucket_index(uint32_t const size) {
+    return min_u32(floor_log2(size), NUM_BUCKETS - 1);
+}
+
+// Insert a free node in the bucket corresponding to its size.
+// @param group: The group containing the node.
+// @param node: The free node to insert.
+static void bucket_insert(struct group * const group,
+                          struct node * const node) {
+    uint32_t const idx = bucket_index(node->header.size);
+    list_add(group->buckets + idx, &node->bucket);
+    group->bucket_bitmap |= (1 << idx);
+}
+
+// Remove a free node from its bucket.
+// @param group: The group containing the node.
+// @param node: The free node to remove. Its size must not have changed since
+// its insertion.
+static void bucket_remove(struct group * const group,
+                          struct node * const node) {
+    uint32_t const idx = bucket_index(node->header.size);
+    list_del(&node->bucket);
+    if (list_empty(group->buckets + idx)) {
+        group->bucket_bitmap &= ~(1 << idx);
+    }
+}
+
+// Reverse map from kernel virtual pages to the group containing them. Entry i
+// describes the page at address KERNEL_PHY_OFFSET + i * PAGE_SIZE, it contains
+// the address of the group using this page or NULL if the page is not used by
+// any group. This map allows kfree() to find the group owning an allocation in
+// constant time, no matter how many groups exist.
+// The map covers the entire kernel address space (the last GiB), that is 1MiB
+// of memory.
+#define GROUP_MAP_SIZE  ((0xFFFFFFFF / PAGE_SIZE + 1) / 4)
+static struct group * GROUP_MAP[GROUP_MAP_SIZE];
+
+// Compute the index of a page in the GROUP_MAP.
+// @param addr: An address within the page.
+// @return: The index of the entry in the GROUP_MAP describing the page
+// containing `addr`.
+static uint32_t group_map_index(void const * const addr) {
+    ASSERT(addr >= (void*)KERNEL_PHY_OFFSET);
+    uint32_t const idx = (addr - (void*)KERNEL_PHY_OFFSET) / PAGE_SIZE;
+    ASSERT(idx < GROUP_MAP_SIZE);
+    return idx;
+}
+
+// Update the GROUP_MAP entries of all the pages of a group.
+// @param group: The group.
+// @param value: The value to write in the entries, either `group` when the
+// group is created, or NULL when it is freed.
+// Note: No lock is required here as the pages of a group are private to the cpu
+// creating/freeing it.
+static void set_group_map_entries(struct group const * const group,
+                                  struct group * const value) {
+    uint32_t const start = group_map_index(group);
+    for (uint32_t i = start; i < start + group->num_pages; ++i) {
+        GROUP_MAP[i] = value;
+    }
+}
+
+// Find the group containing an address.
+// @param addr: The address to look for.
+// @return: The group containing `addr` if any, NULL otherwise.
+static struct group * group_for_addr(void const * const addr) {
+    if (addr < (void*)KERNEL_PHY_OFFSET) {
+        // Groups are always in kernel memory.
+        return NULL;
+    }
+    return GROUP_MAP[group_map_index(addr)];
+}
+
+// Counters of the heap, see struct kmalloc_stats.
+static struct {
+    // The number of bytes in the ALLOCATED nodes of GROUP_LIST and its peak.
+    // Modified under KMALLOC_LOCK, `allocated` is read without it.
+    size_t volatile allocated;
+    size_t peak_allocated;
+    // The number of allocations and frees in GROUP_LIST. Modified under
+    // KMALLOC_LOCK.
+    uint32_t group_allocs;
+    uint32_t group_frees;
+    // The number of groups and pages currently mapped. Groups are created and
+    // freed without holding KMALLOC_LOCK.
+    atomic_t groups;
+    atomic_t pages;
+} HEAP_STATS;
+
 // Allocate a new group. The new group is initially empty.
 // @param size: The size of the group in pages.
 // @return: The virtual address of the new group. If the group cannot be created
@@ -112,44 +252,28 @@ static struct group * create_group(size_t const size) {
     // KERNEL_PHY_OFFSET. This is to avoid filling the low addresses used by the
     // SMP code.
     void *frames[size];
-    for (size_t i = 0; i < size; ++i) {
-        frames[i] = alloc_frame();
-
-        if (frames[i] == NO_FRAME) {
-            // Not enough physical memory to allocate the whole group. Free the
-            // frames allocated so far.
-            for (size_t j = 0; j < i; ++j) {
-                free_frame(frames[j]);
-            }
-            SET_ERROR("Not enough physical frames to allocate group", ENONE);
-            return NULL;
-        }
+    if (!alloc_frames(size, frames)) {
+        // Not enough physical memory to allocate the whole group.
+        SET_ERROR("Not enough physical frames to allocate group", ENONE);
+        return NULL;
     }
 
     // Modifying kernel mappings requires using the kernel address space.
     // FIXME: This can be avoided once this rule is removed.
-    struct addr_space * const curr_addr_space = get_curr_addr_space();
-    struct addr_space * const kernel_addr_space = get_kernel_addr_space();
-    bool const change_addr_space = curr_addr_space != kernel_addr_space;
-
-    if (change_addr_space) {
-        switch_to_addr_space(kernel_addr_space);
-    }
+    struct addr_space * const prev_addr_space = enter_kernel_addr_space();
     void * const pages = paging_map_frames_above(low, frames, size, VM_WRITE);
-    if (change_addr_space) {
-        switch_to_addr_space(curr_addr_space);
-    }
+    exit_kernel_addr_space(prev_addr_space);
 
     if (pages == NO_REGION) {
         // We were able to allocate the physical frames, however we cannot map
         // them to a contiguous region in the address space. The group is
         // unusable here. Free the frames and fail.
-        for (size_t i = 0; i < size; ++i) {
-            free_frame(frames[i]);
-        }
+        free_frames(size, frames);
         SET_ERROR("Cannot map group to virt addr space", ENONE);
         return NULL;
     }
+    // The frames of the groups are shared by all cpus.
+    frame_alloc_exclude_from_balance(size);
 
     // Zero the pages to avoid random garbage.
     memzero(pages, size * PAGE_SIZE);
@@ -162,6 +286,7 @@ static struct group * create_group(size_t const size) {
     free->header.tag = FREE;
     free->header.size = size * PAGE_SIZE - sizeof(*group) - HEADER_SIZE;
     list_init(&free->free);
+    list_init(&free->bucket);
 
     // Initialize the group's attributes: size, free, and the list nodes.
     group->size = free->header.size;
@@ -169,9 +294,20 @@ static struct group * create_group(size_t const size) {
     group->free = free->header.size;
     list_init(&group->group_list);
     list_init(&group->free_head);
+    group->bucket_bitmap = 0;
+    for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+        list_init(group->buckets + i);
+    }
 
-    // Add the first free entry to the free list of the group.
+    // Add the first free entry to the free list and buckets of the group.
     list_add(&group->free_head, &free->free);
+    bucket_insert(group, free);
+
+    // Register the pages in the reverse map.
+    set_group_map_entries(group, group);
+
+    atomic_inc(&HEAP_STATS.groups);
+    atomic_add(&HEAP_STATS.pages, size);
 
     return group;
 }
@@ -197,18 +333,112 @@ static void free_group(struct group * const group) {
     void * const addr = (void*)group;
     uint32_t const len = group->num_pages * PAGE_SIZE;
 
+    // The pages are about to be unmapped, remove them from the reverse map.
+    set_group_map_entries(group, NULL);
+
+    atomic_dec(&HEAP_STATS.groups);
+    atomic_sub(&HEAP_STATS.pages, group->num_pages);
+    frame_alloc_exclude_from_balance(-(int32_t)group->num_pages);
+
     // Modifying kernel mappings requires using the kernel address space.
     // FIXME: This can be avoided once this rule is removed.
-    struct addr_space * const curr_addr_space = get_curr_addr_space();
-    struct addr_space * const kernel_addr_space = get_kernel_addr_space();
-    bool const change_addr_space = curr_addr_space != kernel_addr_space;
+    struct addr_space * const prev_addr_space = enter_kernel_addr_space();
+    paging_unmap_and_free_frames(addr, len);
+    exit_kernel_addr_space(prev_addr_space);
+}
+
+// The spinlock that must be held while performing any operation in the dynamic
+// memory allocator.
+DECLARE_SPINLOCK(KMALLOC_LOCK);
 
-    if (change_addr_space) {
-        switch_to_addr_space(kernel_addr_space);
+// Groups of more than this number of pages are always freed as soon as they are
+// empty.
+#define EMPTY_GROUP_MAX_PAGES       8
+// The pool is shrunk once it holds more than this number of pages...
+#define EMPTY_GROUPS_HIGH_PAGES     64
+// ... down to this number of pages.
+#define EMPTY_GROUPS_LOW_PAGES      32
+
+// The pool of empty groups. Protected by KMALLOC_LOCK.
+static struct {
+    // The empty groups, linked through their group_list. The most recently
+    // emptied groups are at the head.
+    struct counted_list groups;
+    // The total number of pages of the groups in the pool. Read without the
+    // lock by kmalloc_retained_pages().
+    uint32_t volatile num_pages;
+    // Work item shrinking the pool down to EMPTY_GROUPS_LOW_PAGES.
+    struct work shrink_work;
+} EMPTY_GROUPS;
+
+// Put an empty group in the pool of empty groups. KMALLOC_LOCK must be held.
+// @param group: The group, not part of any group list.
+// @return: true if the group was added to the pool, false if it is too big to
+// be retained, in which case the caller must free it.
+static bool retain_group(struct group * const group) {
+    ASSERT(group_is_empty(group));
+    if (group->num_pages > EMPTY_GROUP_MAX_PAGES) {
+        return false;
     }
-    paging_unmap_and_free_frames(addr, len);
-    if (change_addr_space) {
-        switch_to_addr_space(curr_addr_space);
+    counted_list_add(&EMPTY_GROUPS.groups, &group->group_list);
+    EMPTY_GROUPS.num_pages += group->num_pages;
+    return true;
+}
+
+// Take a group out of the pool of empty groups. KMALLOC_LOCK must be held.
+// @param num_pages: The required size of the group, in pages.
+// @return: An empty group of exactly `num_pages` pages, NULL if the pool does
+// not contain any.
+static struct group *take_retained_group(uint32_t const num_pages) {
+    struct group * group;
+    list_for_each_entry(group, &EMPTY_GROUPS.groups.head, group_list) {
+        if (group->num_pages == num_pages) {
+            counted_list_del(&EMPTY_GROUPS.groups, &group->group_list);
+            EMPTY_GROUPS.num_pages -= num_pages;
+            return group;
+        }
+    }
+    return NULL;
+}
+
+// Free the groups of the pool until it holds at most a given number of pages.
+// The oldest groups are freed first.
+// @param max_pages: The maximum number of pages left in the pool.
+// Note: This function assumes that KMALLOC_LOCK is not held.
+static void shrink_empty_groups(uint32_t const max_pages) {
+    while (true) {
+        spinlock_lock(&KMALLOC_LOCK);
+        struct group * group = NULL;
+        if (EMPTY_GROUPS.num_pages > max_pages) {
+            group = list_last_entry(&EMPTY_GROUPS.groups.head, struct group,
+                                    group_list);
+            counted_list_del(&EMPTY_GROUPS.groups, &group->group_list);
+            EMPTY_GROUPS.num_pages -= group->num_pages;
+        }
+        spinlock_unlock(&KMALLOC_LOCK);
+        if (!group) {
+            return;
+        }
+        free_group(group);
+    }
+}
+
+// The function of EMPTY_GROUPS.shrink_work.
+// @param unused: Unused.
+static void shrink_work_func(void * const unused) {
+    shrink_empty_groups(EMPTY_GROUPS_LOW_PAGES);
+}
+
+// Shrink the pool of empty groups after it went above EMPTY_GROUPS_HIGH_PAGES.
+// The shrinking is deferred to the worker of the current cpu if it is running.
+// Note: This function assumes that KMALLOC_LOCK is not held.
+static void schedule_shrink(void) {
+    // Percpu variables are only usable once GS has been loaded.
+    uint8_t const cpu = cpu_id();
+    if (cpu_read_gs().value && workqueue_has_worker(cpu)) {
+        queue_work(cpu, &EMPTY_GROUPS.shrink_work);
+    } else {
+        shrink_empty_groups(EMPTY_GROUPS_LOW_PAGES);
     }
 }
 
@@ -219,15 +449,17 @@ static void * node_data_start(struct node * const node) {
     return node->data;
 }
 
-// Find a free node in a group capable of holding a certain number of bytes.
+// Find the first node of a bucket capable of holding a certain number of bytes.
 // @param group: The group to search into.
+// @param idx: The index of the bucket to search.
 // @param size: The minimum size of the free node to look for.
 // @return: If such a free node exists then this function returns the virtual
 // address of the node, otherwise it returns NULL.
-static struct node * find_node_in_group(struct group const * const group,
-                                          size_t const size) {
+static struct node * find_node_in_bucket(struct group const * const group,
+                                         uint32_t const idx,
+                                         size_t const size) {
     struct node * ite = NULL;
-    list_for_each_entry(ite, &group->free_head, free) {
+    list_for_each_entry(ite, group->buckets + idx, bucket) {
         if (ite->header.size >= size) {
             return ite;
         }
@@ -235,6 +467,37 @@ static struct node * find_node_in_group(struct group const * const group,
     return NULL;
 }
 
+// Find a free node in a group capable of holding a certain number of bytes.
+// @param group: The group to search into.
+// @param size: The minimum size of the free node to look for.
+// @return: If such a free node exists then this function returns the virtual
+// address of the node, otherwise it returns NULL.
+static struct node * find_node_in_group(struct group const * const group,
+                                          size_t const size) {
+    uint32_t const floor = floor_log2(size);
+    if (floor < NUM_BUCKETS - 1) {
+        // All the nodes in the buckets of index >= ceil(log2(size)) are big
+        // enough to contain the allocation. Pick the first one of the smallest
+        // bucket.
+        bool const is_pow2 = !(size & (size - 1));
+        uint32_t const first_fit_idx = is_pow2 ? floor : floor + 1;
+        uint32_t const mask = group->bucket_bitmap & (~0U << first_fit_idx);
+        if (mask) {
+            uint32_t const idx = __builtin_ctz(mask);
+            return list_first_entry(group->buckets + idx, struct node, bucket);
+        }
+    }
+
+    // No bucket is guaranteed to contain a big enough node, however the bucket
+    // at `floor` may contain nodes of at least `size` bytes.
+    uint32_t const idx = min_u32(floor, NUM_BUCKETS - 1);
+    if (group->bucket_bitmap & (1 << idx)) {
+        return find_node_in_bucket(group, idx, size);
+    } else {
+        return NULL;
+    }
+}
+
 // Allocate memory within a group.
 // @param group: The group to allocate into.
 // @param size: The size of the allocation.
@@ -274,6 +537,7 @@ static void * kmalloc_in_group(struct group * const group, size_t size) {
     // be useful to add it to the list.
     struct list_node * const prev = dest->free.prev;
     list_del(&dest->free);
+    bucket_remove(group, dest);
 
     // Check if there is enough space between the end of the requested data and
     // the next entry to fit a new free node.
@@ -284,11 +548,13 @@ static void * kmalloc_in_group(struct group * const group, size_t size) {
         node->header.tag = FREE;
         node->header.size = dest->header.size - size - HEADER_SIZE;
         list_init(&node->free);
+        list_init(&node->bucket);
 
         // Add the new free node to the free list at the same position as the
         // node that now contains data. To this end we use the prev pointer that
         // we saved before remove the old node.
         list_add(prev, &node->free);
+        bucket_insert(group, node);
 
         // Since we added a new free node to the group we need to update the
         // group->free accordingly.
@@ -384,9 +650,12 @@ static void merge_free_node(struct group * const group,
         if (can_merge(prev, node)) {
             // This node can be merged with the neighbour before it. Remove it
             // from the free list and update the neighbour's size to contain
-            // this node.
+            // this node. The neighbour's bucket changes with its size.
             list_del(&node->free);
+            bucket_remove(group, node);
+            bucket_remove(group, prev);
             prev->header.size += node->header.size + HEADER_SIZE;
+            bucket_insert(group, prev);
 
             // Since we end up with one less free node (merged), we gained
             // HEADER_SIZE free bytes.
@@ -430,6 +699,7 @@ static void insert_in_free_list(struct group * const group,
 
     // Now insert `node` in the free list right before `next`.
     list_add_tail(next, &node->free);
+    bucket_insert(group, node);
 
     // Try to merge this new node in the free list with its neighbours. This
     // reduces fragmentation.
@@ -478,10 +748,6 @@ static void *try_allocation(struct list_node * group_list, size_t const size) {
     return NULL;
 }
 
-// The spinlock that must be held while performing any operation in the dynamic
-// memory allocator.
-DECLARE_SPINLOCK(KMALLOC_LOCK);
-
 // Allocate memory in the first group available in `group_list`.
 // @param group_list: A linked list of groups to try to allocate into. The
 // particular group that will contain the allocation is the first group (in the
@@ -493,6 +759,18 @@ static void * do_kmalloc(struct list_node * group_list, size_t const size) {
     void * const addr = try_allocation(group_list, size);
     if (addr) {
         return addr;
+    }
+
+    struct group * group;
+    uint32_t const num_pages = ceil_x_over_y_u32(size + sizeof(*group) +
+        HEADER_SIZE, PAGE_SIZE);
+    group = take_retained_group(num_pages);
+    if (group) {
+        // Re-use an empty group, it is already mapped.
+        list_add_tail(group_list, &group->group_list);
+        void * const addr = kmalloc_in_group(group, size);
+        ASSERT(addr);
+        return addr;
     } else {
         // Either we do not have a group right now or no group is big enough to
         // contain the allocation. Try to allocate a new one.
@@ -504,10 +782,13 @@ static void * do_kmalloc(struct list_node * group_list, size_t const size) {
         // (if another message is enqueued alongside the TLB-shootdown message).
         spinlock_unlock(&KMALLOC_LOCK);
 
-        struct group * group;
-        uint32_t const num_pages = ceil_x_over_y_u32(size + sizeof(group) +
-            HEADER_SIZE, PAGE_SIZE);
         group = create_group(num_pages);
+        if (!group && EMPTY_GROUPS.num_pages) {
+            // The empty groups are holding physical frames, give them back and
+            // retry.
+            shrink_empty_groups(0);
+            group = create_group(num_pages);
+        }
 
         spinlock_lock(&KMALLOC_LOCK);
 
@@ -525,13 +806,15 @@ static void * do_kmalloc(struct list_node * group_list, size_t const size) {
         void * const addr = try_allocation(group_list, size);
         if (addr) {
             // The allocation was successful, no need to add the group.
-
-            // Note: Because free_group assumes that KMALLOC_LOCK is not held we
-            // need to release, call free_group and re-acquire KMALLOC_LOCK.
-            // This is ok here, the allocation has already been done.
-            spinlock_unlock(&KMALLOC_LOCK);
-            free_group(group);
-            spinlock_lock(&KMALLOC_LOCK);
+            if (!retain_group(group)) {
+                // Note: Because free_group assumes that KMALLOC_LOCK is not
+                // held we need to release, call free_group and re-acquire
+                // KMALLOC_LOCK. This is ok here, the allocation has already
+                // been done.
+                spinlock_unlock(&KMALLOC_LOCK);
+                free_group(group);
+                spinlock_lock(&KMALLOC_LOCK);
+            }
 
             return addr;
         } else {
@@ -553,37 +836,41 @@ static void * do_kmalloc(struct list_node * group_list, size_t const size) {
 }
 
 // Free allocated memory.
-// @param group_list: A list of group to look into to de-allocate the memory.
-// This function will look for the group containing the address to de-allocate.
 // @param addr: The address to de-allocated.
-static void do_kfree(struct list_node * group_list, void * const addr) {
-    struct group * group;
-    list_for_each_entry(group, group_list, group_list) {
-        if (addr_in_group(group, addr)) {
-            kfree_in_group(group, addr);
-
-            // If removing the allocation from the group makes it empty,
-            // deallocate the group to free physical frames.
-            if (group_is_empty(group)) {
-                // Remote the group from the group list before freeing it. Note:
-                // This is safe to do so in the loop since we will return
-                // anyway.
-                list_del(&group->group_list);
-
-                // Unlock the KMALLOC_LOCK while we are allocating a new group.
-                // The reason is that free_group will modify the page tables
-                // and therefore may execute a TLB shootdown. This could cause a
-                // deadlock if remote cpus need to acquire the kmalloc lock
-                // while processing their messages (if another message is
-                // enqueued alongside the TLB-shootdown message).
-                spinlock_unlock(&KMALLOC_LOCK);
-                free_group(group);
-                spinlock_lock(&KMALLOC_LOCK);
-            }
-            return;
-        }
+// @return: true if the pool of empty groups went above EMPTY_GROUPS_HIGH_PAGES,
+// in which case the caller should call schedule_shrink() once KMALLOC_LOCK is
+// released.
+// Note: If the group containing the allocation becomes empty, it is removed
+// from the group list it belongs to and either retained in the pool of empty
+// groups or de-allocated.
+static bool do_kfree(void * const addr) {
+    struct group * const group = group_for_addr(addr);
+    if (!group) {
+        PANIC("Unknow pointer to free.");
     }
-    PANIC("Unknow pointer to free.");
+    ASSERT(addr_in_group(group, addr));
+
+    kfree_in_group(group, addr);
+
+    if (!group_is_empty(group)) {
+        return false;
+    }
+
+    // Remove the group from the group list before retaining or freeing it.
+    list_del(&group->group_list);
+    if (retain_group(group)) {
+        return EMPTY_GROUPS.num_pages > EMPTY_GROUPS_HIGH_PAGES;
+    }
+
+    // Unlock the KMALLOC_LOCK while we are freeing the group. The reason is
+    // that free_group will modify the page tables and therefore may execute a
+    // TLB shootdown. This could cause a deadlock if remote cpus need to acquire
+    // the kmalloc lock while processing their messages (if another message is
+    // enqueued alongside the TLB-shootdown message).
+    spinlock_unlock(&KMALLOC_LOCK);
+    free_group(group);
+    spinlock_lock(&KMALLOC_LOCK);
+    return false;
 }
 
 // The global kernel list of groups.
@@ -597,56 +884,477 @@ static bool KMALLOC_INITIALIZED = false;
 // Indicate if the kmalloc OOM simulation is currently active.
 static bool KMALLOC_OOM_SIMULATION = false;
 
-// This is the public interface for the dynamic memory allocation.
+// Allocate memory from the global GROUP_LIST. This is the slow path of kmalloc,
+// it is taken for allocations that are too big to be served by the per-cpu
+// caches or when a cache needs to be refilled.
 // @param size: The requested amount of memory.
-// @return: The virtual address of the allocated memory.
-void * kmalloc(size_t const size) {
-    ASSERT(cpu_paging_enabled());
+// @param addrs: Output array receiving the addresses of the allocations.
+// @param count: The number of allocations of `size` bytes to perform.
+// @return: The number of successful allocations. Allocations are performed in
+// order, if an allocation fails the subsequent ones are not attempted.
+static uint32_t global_kmalloc(size_t const size,
+                               void ** const addrs,
+                               uint32_t const count) {
     spinlock_lock(&KMALLOC_LOCK);
-    this_cpu_var(kmalloc_nest_level) ++;
-
     if (!KMALLOC_INITIALIZED) {
         // Initialize the group list if it wasn't done already.
         list_init(&GROUP_LIST);
+        counted_list_init(&EMPTY_GROUPS.groups);
+        EMPTY_GROUPS.num_pages = 0;
+        work_init(&EMPTY_GROUPS.shrink_work, shrink_work_func, NULL);
         KMALLOC_INITIALIZED = true;
     }
 
-    void *addr;
+    uint32_t i = 0;
     if (KMALLOC_OOM_SIMULATION) {
         SET_ERROR("kmalloc's OOM Simulation active", ENOMEM);
-        addr = NULL;
-    } else  {
-        addr = do_kmalloc(&GROUP_LIST, size);
+    } else {
+        for (; i < count; ++i) {
+            addrs[i] = do_kmalloc(&GROUP_LIST, size);
+            if (!addrs[i]) {
+                break;
+            }
+            HEAP_STATS.allocated += node_for_addr(addrs[i])->header.size;
+            HEAP_STATS.group_allocs++;
+        }
+        if (HEAP_STATS.allocated > HEAP_STATS.peak_allocated) {
+            HEAP_STATS.peak_allocated = HEAP_STATS.allocated;
+        }
     }
 
-    this_cpu_var(kmalloc_nest_level) --;
     spinlock_unlock(&KMALLOC_LOCK);
+    return i;
+}
+
+// Free memory into the global GROUP_LIST.
+// @param addrs: Array containing the addresses to free.
+// @param count: The number of addresses in `addrs`.
+static void global_kfree(void ** const addrs, uint32_t const count) {
+    spinlock_lock(&KMALLOC_LOCK);
+    ASSERT(KMALLOC_INITIALIZED);
+    bool shrink = false;
+    for (uint32_t i = 0; i < count; ++i) {
+        HEAP_STATS.allocated -= node_for_addr(addrs[i])->header.size;
+        HEAP_STATS.group_frees++;
+        shrink |= do_kfree(addrs[i]);
+    }
+    spinlock_unlock(&KMALLOC_LOCK);
+    if (shrink) {
+        schedule_shrink();
+    }
+}
+
+// Per-cpu caches:
+// ===============
+//      Going through the GROUP_LIST requires the global KMALLOC_LOCK. To avoid
+// serializing all cpus on this lock, small allocations are served by per-cpu
+// caches sitting in front of the groups.
+// Each cpu has one cache per size class. The size classes are the powers of two
+// between KMALLOC_CACHE_MIN_SIZE and KMALLOC_CACHE_MAX_SIZE, an allocation is
+// served by the smallest class that can contain it. A cache is a LIFO stack of
+// objects of its class, allocated from the groups like any other allocation.
+// From the point of view of the groups, an object in a cache is still
+// ALLOCATED.
+// When a cache is empty, KMALLOC_CACHE_BATCH objects are allocated from the
+// groups at once, taking the KMALLOC_LOCK a single time. Symmetrically, when a
+// cache is full, KMALLOC_CACHE_BATCH objects are given back to the groups at
+// once.
+// Each cache is protected by its own lock. This lock is only contended when a
+// remote cpu drains the caches (see kmalloc_drain_caches()), the fast path
+// therefore never bounces cache lines between cpus.
+
+// The size of the smallest size class.
+#define KMALLOC_CACHE_MIN_SIZE      16
+// The size of the biggest size class. Any allocation bigger than this goes
+// directly to the groups.
+#define KMALLOC_CACHE_MAX_SIZE \
+    (KMALLOC_CACHE_MIN_SIZE << (KMALLOC_CACHE_NUM_CLASSES - 1))
+// The max number of objects in the cache of a size class.
+#define KMALLOC_CACHE_CAPACITY      16
+// The number of objects moved between the caches and the groups at once.
+#define KMALLOC_CACHE_BATCH         8
+// Value indicating that a size is not served by the per-cpu caches.
+#define NO_CLASS                    (-1)
+
+STATIC_ASSERT(KMALLOC_CACHE_MIN_SIZE >= MIN_SIZE, "");
+STATIC_ASSERT(KMALLOC_CACHE_BATCH <= KMALLOC_CACHE_CAPACITY, "");
+
+// The cache of a single size class.
+struct kmalloc_class_cache {
+    // The number of objects currently in the cache.
+    uint32_t count;
+    // The objects in the cache. objs[count - 1] is the most recently freed.
+    void * objs[KMALLOC_CACHE_CAPACITY];
+};
+
+// The caches of a cpu.
+struct kmalloc_cpu_cache {
+    // Indicate if the lock has been initialized. Percpu areas of APs are zeroed
+    // upon allocation, hence the cache is lazily initialized by its cpu.
+    bool initialized;
+    // Protects the caches below.
+    spinlock_t lock;
+    // One cache per size class.
+    struct kmalloc_class_cache classes[KMALLOC_CACHE_NUM_CLASSES];
+    // The counters of each size class on this cpu, see struct
+    // kmalloc_class_stats. Only modified by the cpu, under `lock`.
+    uint32_t hits[KMALLOC_CACHE_NUM_CLASSES];
+    uint32_t misses[KMALLOC_CACHE_NUM_CLASSES];
+    uint32_t frees[KMALLOC_CACHE_NUM_CLASSES];
+};
+
+// The small allocation caches of each cpu.
+DECLARE_PER_CPU(struct kmalloc_cpu_cache, kmalloc_cpu_cache);
+
+// The balance of each cpu, see kmalloc_cpu_balance().
+DECLARE_PER_CPU(int32_t, kmalloc_balance);
+
+// Account bytes allocated or freed on the current cpu in its balance.
+// @param bytes: The number of bytes allocated, negative for frees.
+static void account_bytes(int32_t const bytes) {
+    // Percpu variables are only usable once GS has been loaded.
+    if (cpu_read_gs().value) {
+        this_cpu_add(kmalloc_balance, bytes);
+    }
+}
+
+// Get the size in bytes of a size class.
+// @param class: The index of the size class.
+// @return: The size of the objects in this class.
+static size_t class_size(int8_t const class) {
+    return KMALLOC_CACHE_MIN_SIZE << class;
+}
+
+// Get the size class serving an allocation.
+// @param size: The size of the allocation.
+// @return: The index of the smallest size class that can contain `size` bytes.
+// NO_CLASS if the allocation is too big for the caches.
+static int8_t class_for_alloc(size_t const size) {
+    for (int8_t class = 0; class < KMALLOC_CACHE_NUM_CLASSES; ++class) {
+        if (size <= class_size(class)) {
+            return class;
+        }
+    }
+    return NO_CLASS;
+}
+
+// Get the size class an allocated node belongs to.
+// @param node: The allocated node.
+// @return: The index of the size class the node can be cached in, NO_CLASS if
+// the node cannot be cached.
+static int8_t class_for_node(struct node const * const node) {
+    size_t const size = node->header.size;
+    for (int8_t class = KMALLOC_CACHE_NUM_CLASSES - 1; class >= 0; --class) {
+        // A node allocated for a size class can be slightly bigger than the
+        // size of the class if its free node could not be split (see
+        // kmalloc_in_group()). The slack is always smaller than a struct node.
+        if (class_size(class) <= size) {
+            return (size - class_size(class) < sizeof(struct node)) ?
+                class : NO_CLASS;
+        }
+    }
+    return NO_CLASS;
+}
+
+// Get the kmalloc cache of the current cpu, initialize it if needed.
+// @return: The address of the current cpu's cache.
+// Note: Interrupts must be disabled while calling this function.
+static struct kmalloc_cpu_cache * get_cpu_cache(void) {
+    ASSERT(!interrupts_enabled());
+    struct kmalloc_cpu_cache * const cache = &this_cpu_var(kmalloc_cpu_cache);
+    if (!cache->initialized) {
+        spinlock_init(&cache->lock);
+        // Make sure the lock is initialized before remote cpus can see the
+        // cache as initialized.
+        cpu_mfence();
+        cache->initialized = true;
+    }
+    return cache;
+}
+
+// Pop an object from the current cpu's cache.
+// @param class: The size class of the object.
+// @return: The address of the object, NULL if the cache is empty.
+static void * cache_pop(int8_t const class) {
+    bool const irq = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+
+    struct kmalloc_cpu_cache * const cache = get_cpu_cache();
+    struct kmalloc_class_cache * const c = cache->classes + class;
+
+    spinlock_lock(&cache->lock);
+    void * const addr = c->count ? c->objs[--c->count] : NULL;
+    if (addr) {
+        cache->hits[class]++;
+    } else {
+        cache->misses[class]++;
+    }
+    spinlock_unlock(&cache->lock);
+
+    cpu_set_interrupt_flag(irq);
     return addr;
 }
 
+// Push objects in the current cpu's cache.
+// @param class: The size class of the objects.
+// @param addrs: The objects to push.
+// @param count: The number of objects in `addrs`.
+// @param overflow: Output array receiving the objects that could not fit in the
+// cache. This array must be at least KMALLOC_CACHE_CAPACITY entries long.
+// @param freed: true if the objects are pushed because they were freed, false
+// if they come from the groups.
+// @return: The number of objects written to `overflow`.
+// Note: When the cache is full, the KMALLOC_CACHE_BATCH oldest objects of the
+// cache are evicted to `overflow` to make room for the new ones.
+static uint32_t cache_push(int8_t const class,
+                           void ** const addrs,
+                           uint32_t const count,
+                           void ** const overflow,
+                           bool const freed) {
+    bool const irq = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+
+    struct kmalloc_cpu_cache * const cache = get_cpu_cache();
+    struct kmalloc_class_cache * const c = cache->classes + class;
+
+    spinlock_lock(&cache->lock);
+    uint32_t num_overflow = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (c->count == KMALLOC_CACHE_CAPACITY) {
+            // Evict the oldest objects, those are the least likely to still be
+            // in the cpu's caches.
+            for (uint32_t j = 0; j < KMALLOC_CACHE_BATCH; ++j) {
+                overflow[num_overflow++] = c->objs[j];
+            }
+            c->count -= KMALLOC_CACHE_BATCH;
+            memcpy(c->objs, c->objs + KMALLOC_CACHE_BATCH,
+                c->count * sizeof(*c->objs));
+        }
+        c->objs[c->count++] = addrs[i];
+    }
+    if (freed) {
+        cache->frees[class] += count;
+    }
+    spinlock_unlock(&cache->lock);
+
+    cpu_set_interrupt_flag(irq);
+    return num_overflow;
+}
+
+// Allocate an object from the per-cpu caches.
+// @param class: The size class to allocate from.
+// @return: The address of the object, NULL if the allocation failed.
+static void * cache_alloc(int8_t const class) {
+    void * const addr = cache_pop(class);
+    if (addr) {
+        return addr;
+    }
+
+    // The cache is empty, refill it from the groups. This is done without
+    // holding the cache's lock as allocating a new group might require a TLB
+    // shootdown. We might therefore run on another cpu when pushing the objects
+    // into a cache, this is harmless.
+    void * objs[KMALLOC_CACHE_BATCH];
+    uint32_t const num = global_kmalloc(class_size(class), objs,
+        KMALLOC_CACHE_BATCH);
+    if (!num) {
+        // Note: The error has already been set by global_kmalloc(). Calling
+        // SET_ERROR() here would recurse into kmalloc().
+        return NULL;
+    }
+
+    // Keep the first object for the current allocation, cache the rest.
+    void * overflow[KMALLOC_CACHE_CAPACITY];
+    uint32_t const num_overflow = cache_push(class, objs + 1, num - 1,
+        overflow, false);
+    if (num_overflow) {
+        global_kfree(overflow, num_overflow);
+    }
+    return objs[0];
+}
+
+// Free an object into the per-cpu caches.
+// @param class: The size class of the object.
+// @param addr: The object to free.
+static void cache_free(int8_t const class, void * const addr) {
+    void * addrs[1] = {addr};
+    void * overflow[KMALLOC_CACHE_CAPACITY];
+    uint32_t const num_overflow = cache_push(class, addrs, 1, overflow, true);
+    if (num_overflow) {
+        // The cache was full, give the evicted objects back to the groups.
+        global_kfree(overflow, num_overflow);
+    }
+}
+
+// Drain the caches of a cpu.
+// @param cache: The cache to drain. This can belong to a remote cpu.
+static void drain_cpu_cache(struct kmalloc_cpu_cache * const cache) {
+    if (!cache->initialized) {
+        // The cpu never used its cache, it is therefore empty.
+        return;
+    }
+
+    for (int8_t class = 0; class < KMALLOC_CACHE_NUM_CLASSES; ++class) {
+        struct kmalloc_class_cache * const c = cache->classes + class;
+        void * objs[KMALLOC_CACHE_CAPACITY];
+
+        spinlock_lock(&cache->lock);
+        uint32_t const count = c->count;
+        memcpy(objs, c->objs, count * sizeof(*objs));
+        c->count = 0;
+        spinlock_unlock(&cache->lock);
+
+        if (count) {
+            global_kfree(objs, count);
+        }
+    }
+}
+
+void kmalloc_drain_caches(void) {
+    if (!PER_CPU_OFFSETS) {
+        // Percpu areas of APs are not yet allocated, only the current cpu can
+        // have a cache.
+        bool const irq = interrupts_enabled();
+        cpu_set_interrupt_flag(false);
+        struct kmalloc_cpu_cache * const cache = get_cpu_cache();
+        cpu_set_interrupt_flag(irq);
+        drain_cpu_cache(cache);
+        return;
+    }
+
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        drain_cpu_cache(&cpu_var(kmalloc_cpu_cache, cpu));
+    }
+}
+
+// Allocate memory, without accounting it in the allocation sampler.
+// @param size: The requested amount of memory.
+// @return: The virtual address of the allocated memory.
+static void * heap_alloc(size_t const size) {
+    ASSERT(cpu_paging_enabled());
+
+    void * addr = NULL;
+    int8_t const class = class_for_alloc(size);
+    if (class != NO_CLASS && !KMALLOC_OOM_SIMULATION) {
+        addr = cache_alloc(class);
+        if (addr) {
+            // Objects coming from the cache contain the data of their previous
+            // owner.
+            memzero(addr, size);
+        }
+    } else if (!global_kmalloc(size, &addr, 1)) {
+        addr = NULL;
+    }
+    if (addr) {
+        account_bytes(node_for_addr(addr)->header.size);
+    }
+    return addr;
+}
+
+// This is the public interface for the dynamic memory allocation.
+// @param size: The requested amount of memory.
+// @return: The virtual address of the allocated memory.
+void * kmalloc(size_t const size) {
+    void * const addr = heap_alloc(size);
+    if (addr) {
+        kmalloc_sample_alloc(addr, size, __builtin_return_address(0));
+    }
+    return addr;
+}
+
+// Free memory, without removing it from the allocation sampler.
+// @param addr: The address of the memory to free.
+static void heap_free(void * const addr) {
+    ASSERT(KMALLOC_INITIALIZED);
+
+    struct node const * const node = node_for_addr(addr);
+    ASSERT(node->header.tag == ALLOCATED);
+    account_bytes(-(int32_t)node->header.size);
+
+    int8_t const class = class_for_node(node);
+    if (class != NO_CLASS) {
+        cache_free(class, addr);
+    } else {
+        void * addrs[1] = {addr};
+        global_kfree(addrs, 1);
+    }
+}
+
 // Public interface to free dynamically allocated memory.
 // @param addr: The address of the memory to free. This cannot point in the
 // middle of an allocated buffer. It _must_ point to the very first byte of the
 // allocated buffer.
 void kfree(void * const addr) {
-    spinlock_lock(&KMALLOC_LOCK);
-    ASSERT(KMALLOC_INITIALIZED);
-    do_kfree(&GROUP_LIST, addr);
-    spinlock_unlock(&KMALLOC_LOCK);
+    // The sample must be removed before `addr` can be allocated again.
+    kmalloc_sample_free(addr);
+    heap_free(addr);
+}
+
+int32_t kmalloc_cpu_balance(void) {
+    return cpu_read_gs().value ? this_cpu_read(kmalloc_balance) : 0;
 }
 
-// Compute the number of total bytes currently allocated through kmalloc.
 size_t kmalloc_total_allocated(void) {
+    return HEAP_STATS.allocated;
+}
+
+void kmalloc_get_stats(struct kmalloc_stats * const stats) {
+    memzero(stats, sizeof(*stats));
     spinlock_lock(&KMALLOC_LOCK);
+    stats->allocated = HEAP_STATS.allocated;
+    stats->peak_allocated = HEAP_STATS.peak_allocated;
+    stats->group_allocs = HEAP_STATS.group_allocs;
+    stats->group_frees = HEAP_STATS.group_frees;
+    stats->retained_groups =
+        KMALLOC_INITIALIZED ? counted_list_size(&EMPTY_GROUPS.groups) : 0;
+    stats->retained_pages = KMALLOC_INITIALIZED ? EMPTY_GROUPS.num_pages : 0;
+    spinlock_unlock(&KMALLOC_LOCK);
+    stats->groups = atomic_read(&HEAP_STATS.groups);
+    stats->pages = atomic_read(&HEAP_STATS.pages);
+
+    size_t const mapped = stats->pages * PAGE_SIZE;
+    if (mapped) {
+        // The groups are created before being accounted in `allocated`, the
+        // latter cannot exceed `mapped` unless racing with a free_group().
+        size_t const used = min_u32(stats->allocated, mapped);
+        stats->fragmentation = (uint64_t)(mapped - used) * 100 / mapped;
+    }
 
-    size_t tot = 0;
-    struct group *group;
-    list_for_each_entry(group, &GROUP_LIST, group_list) {
-        tot += group->size - group->free;
+    for (int8_t class = 0; class < KMALLOC_CACHE_NUM_CLASSES; ++class) {
+        stats->classes[class].size = class_size(class);
+    }
+    if (!PER_CPU_OFFSETS) {
+        // The per-cpu caches are not used yet.
+        return;
     }
+    for (uint16_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+        // Reading the counters of a remote cpu without its lock is fine, they
+        // are only used for monitoring.
+        struct kmalloc_cpu_cache const * const cache =
+            &cpu_var(kmalloc_cpu_cache, cpu);
+        for (int8_t class = 0; class < KMALLOC_CACHE_NUM_CLASSES; ++class) {
+            stats->classes[class].hits += cache->hits[class];
+            stats->classes[class].misses += cache->misses[class];
+            stats->classes[class].frees += cache->frees[class];
+        }
+    }
+}
 
-    spinlock_unlock(&KMALLOC_LOCK);
-    return tot;
+void kmalloc_log_stats(void) {
+    struct kmalloc_stats stats;
+    kmalloc_get_stats(&stats);
+    LOG("kmalloc: allocated = %u bytes (peak %u), %u groups, %u pages, "
+        "fragmentation = %u percent\n", stats.allocated, stats.peak_allocated,
+        stats.groups, stats.pages, stats.fragmentation);
+    LOG("kmalloc: %u empty groups retained (%u pages), %u group allocs, %u "
+        "group frees\n", stats.retained_groups, stats.retained_pages,
+        stats.group_allocs, stats.group_frees);
+    for (int8_t class = 0; class < KMALLOC_CACHE_NUM_CLASSES; ++class) {
+        struct kmalloc_class_stats const * const c = stats.classes + class;
+        LOG("kmalloc:   class %u bytes: hits = %u, misses = %u, frees = %u\n",
+            c->size, c->hits, c->misses, c->frees);
+    }
 }
 
 #ifdef KMALLOC_DEBUG
@@ -674,7 +1382,7 @@ void * kmalloc_debug_wrapper(char const * const func_name,
     // information.
     size_t const excess = sizeof(uint32_t) + sizeof(struct kmalloc_debug_info);
 
-    void * const addr = kmalloc(size + excess);
+    void * const addr = heap_alloc(size + excess);
     if (!addr) {
         return NULL;
     }
@@ -691,6 +1399,8 @@ void * kmalloc_debug_wrapper(char const * const func_name,
     uint8_t const cpu = cpu_id();
     info->cpu = cpu;
 
+    // Sample the address and size seen by the caller.
+    kmalloc_sample_alloc(ret_addr, size, __builtin_return_address(0));
     return ret_addr;
 }
 
@@ -699,7 +1409,8 @@ void kfree_debug_wrapper(char const * const func_name,
                          uint32_t const line_number,
                          void * const addr) {
     // For now the filename and line number are not useful when freeing memory.
-    kfree(addr - sizeof(uint32_t));
+    kmalloc_sample_free(addr);
+    heap_free(addr - sizeof(uint32_t));
 }
 
 // Log a kmalloc allocation. This version will log all debug informations.
@@ -735,6 +1446,10 @@ static void log_allocation(struct node const * const node) {
 #endif
 
 void kmalloc_list_allocations(void) {
+    // Objects in the per-cpu caches are ALLOCATED from the point of view of the
+    // groups, do not report them.
+    kmalloc_drain_caches();
+
     spinlock_lock(&KMALLOC_LOCK);
 
     struct group *group;
@@ -761,6 +1476,16 @@ void kmalloc_list_allocations(void) {
     spinlock_unlock(&KMALLOC_LOCK);
 }
 
+void kmalloc_shrink(void) {
+    if (KMALLOC_INITIALIZED) {
+        shrink_empty_groups(0);
+    }
+}
+
+uint32_t kmalloc_retained_pages(void) {
+    return KMALLOC_INITIALIZED ? EMPTY_GROUPS.num_pages : 0;
+}
+
 void kmalloc_set_oom_simulation(bool const enabled) {
     KMALLOC_OOM_SIMULATION = enabled;
 }
@@ -1,4 +1,6 @@
 #pragma once
+#include <types.h>
+#include <kmalloc_stats.h>
 
 #ifdef KMALLOC_DEBUG
 // When KMALLOC_DEBUG is enabled, each allocation records the file and line
@@ -72,9 +74,33 @@ void * kmalloc(size_t const size);
 void kfree(void * const addr);
 #endif
 
-// Compute the number of total bytes currently allocated through kmalloc.
+// Get the number of total bytes currently allocated through kmalloc. This is
+// read from a counter maintained upon each allocation and free, hence is O(1).
+// Note: Memory sitting in the per-cpu caches is accounted as allocated, call
+// kmalloc_drain_caches() before this function to get the exact number of bytes
+// in use.
 size_t kmalloc_total_allocated(void);
 
+// Get the balance of the current cpu, that is the number of bytes allocated
+// minus the number of bytes freed through kmalloc() on the current cpu so far.
+// Only the difference between two values is relevant, see
+// frame_alloc_cpu_balance().
+// @return: The balance of the current cpu.
+int32_t kmalloc_cpu_balance(void);
+
+// Give back all the memory held by the per-cpu caches of all cpus to the global
+// memory allocator.
+void kmalloc_drain_caches(void);
+
+// Free the empty groups retained by the allocator. Those groups are otherwise
+// kept around to avoid unmapping and re-mapping pages when allocations and
+// frees alternate around a group boundary.
+void kmalloc_shrink(void);
+
+// Get the number of pages held by the empty groups retained by the allocator.
+// @return: The number of pages, see kmalloc_shrink().
+uint32_t kmalloc_retained_pages(void);
+
 // Log all the currently allocated memory regions. If debug information is
 // present, log them as well.
 void kmalloc_list_allocations(void);
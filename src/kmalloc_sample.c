@@ -0,0 +1,257 @@
+#include <kmalloc_sample.h>
+#include <kmalloc.h>
+#include <memory.h>
+#include <percpu.h>
+#include <spinlock.h>
+#include <list.h>
+#include <cpu.h>
+#include <acpi.h>
+#include <debug.h>
+
+// The number of buckets of the hash table of samples. Must be a power of two.
+#define SAMPLE_BUCKETS  1024
+
+// A sampled allocation.
+struct sample {
+    // Links the sample in its hash bucket, or in the free list when unused.
+    struct list_node link;
+    // The address of the allocation.
+    void const * addr;
+    // The return address of the kmalloc() call.
+    void const * site;
+    // The number of bytes this sample stands for, see kmalloc_sample.h.
+    uint32_t weight;
+};
+
+// The hash table of live samples. The samples are pre-allocated so that
+// recording one never calls into the allocator being tracked.
+static struct {
+    struct list_node buckets[SAMPLE_BUCKETS];
+    struct sample entries[KMALLOC_SAMPLE_MAX_ENTRIES];
+    // The unused entries.
+    struct list_node free;
+    // The number of samples in the buckets. Read without the lock by
+    // kmalloc_sample_free() to skip the lookup when empty.
+    uint32_t volatile num_live;
+    // The number of samples dropped because all the entries were in use.
+    uint32_t dropped;
+} SAMPLES;
+
+// Protects SAMPLES.
+static DECLARE_SPINLOCK(SAMPLES_LOCK);
+
+// The average number of bytes between two samples, 0 if sampling is stopped or
+// kmalloc_sample_init() was not called yet.
+static uint32_t volatile SAMPLE_PERIOD = 0;
+
+// Set by kmalloc_sample_init().
+static bool SAMPLES_INITIALIZED = false;
+
+// The number of bytes this cpu can still allocate before taking a sample.
+DECLARE_PER_CPU(int32_t, kmalloc_sample_countdown);
+
+// Get the hash bucket of an address.
+// @param addr: The address.
+// @return: The head of the bucket's list.
+static struct list_node * bucket_for_addr(void const * const addr) {
+    // Knuth's multiplicative hash, the high bits are the best mixed.
+    uint32_t const hash = (uint32_t)addr * 2654435761u;
+    return SAMPLES.buckets + (hash >> 22);
+}
+STATIC_ASSERT(SAMPLE_BUCKETS == 1 << (32 - 22), "Bucket hash shift mismatch");
+
+// Compute the next value of a countdown. The value is drawn uniformly in
+// [period/2, 3*period/2) so that sampling does not lock onto a periodic
+// allocation pattern.
+// @param period: The sampling period.
+// @return: The number of bytes until the next sample.
+static int32_t next_countdown(uint32_t const period) {
+    return period / 2 + (uint32_t)read_tsc() % period;
+}
+
+// Record a sample.
+// @param addr: The address of the sampled allocation.
+// @param site: The call site of the allocation.
+// @param weight: The number of bytes the sample stands for.
+static void record_sample(void const * const addr,
+                          void const * const site,
+                          uint32_t const weight) {
+    spinlock_lock(&SAMPLES_LOCK);
+    if (list_empty(&SAMPLES.free)) {
+        SAMPLES.dropped++;
+    } else {
+        struct sample * const sample =
+            list_first_entry(&SAMPLES.free, struct sample, link);
+        list_del(&sample->link);
+        sample->addr = addr;
+        sample->site = site;
+        sample->weight = weight;
+        list_add(bucket_for_addr(addr), &sample->link);
+        SAMPLES.num_live++;
+    }
+    spinlock_unlock(&SAMPLES_LOCK);
+}
+
+// Find the sample of an address. SAMPLES_LOCK must be held.
+// @param addr: The address.
+// @return: The sample, NULL if the address was not sampled.
+static struct sample * find_sample(void const * const addr) {
+    struct sample * sample;
+    list_for_each_entry(sample, bucket_for_addr(addr), link) {
+        if (sample->addr == addr) {
+            return sample;
+        }
+    }
+    return NULL;
+}
+
+void kmalloc_sample_init(void) {
+    for (uint32_t i = 0; i < SAMPLE_BUCKETS; ++i) {
+        list_init(SAMPLES.buckets + i);
+    }
+    list_init(&SAMPLES.free);
+    for (uint32_t i = 0; i < KMALLOC_SAMPLE_MAX_ENTRIES; ++i) {
+        list_add_tail(&SAMPLES.free, &SAMPLES.entries[i].link);
+    }
+    SAMPLES_INITIALIZED = true;
+    kmalloc_sample_set_period(KMALLOC_SAMPLE_PERIOD);
+}
+
+void kmalloc_sample_set_period(uint32_t const period) {
+    ASSERT(SAMPLES_INITIALIZED);
+    // The countdowns are re-armed with the new period the next time they
+    // expire, start them over so that a shorter period applies right away.
+    for (uint16_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+        cpu_var(kmalloc_sample_countdown, cpu) = 0;
+    }
+    SAMPLE_PERIOD = period;
+}
+
+void kmalloc_sample_alloc(void * const addr,
+                          size_t const size,
+                          void const * const site) {
+    uint32_t const period = SAMPLE_PERIOD;
+    // Percpu variables are only usable once GS has been loaded.
+    if (!period || !cpu_read_gs().value) {
+        return;
+    }
+    this_cpu_add(kmalloc_sample_countdown, -(int32_t)size);
+    // Being migrated between the subtraction above and this read only changes
+    // which allocation gets sampled.
+    if (this_cpu_read(kmalloc_sample_countdown) > 0) {
+        return;
+    }
+    this_cpu_write(kmalloc_sample_countdown, next_countdown(period));
+    record_sample(addr, site, size > period ? size : period);
+}
+
+void kmalloc_sample_free(void * const addr) {
+    // A sample is recorded before kmalloc() returns, and thus before its
+    // allocation can be freed. An empty bucket therefore cannot turn out to
+    // contain the sample of `addr` after this check.
+    if (!SAMPLES.num_live || list_empty(bucket_for_addr(addr))) {
+        return;
+    }
+    spinlock_lock(&SAMPLES_LOCK);
+    struct sample * const sample = find_sample(addr);
+    if (sample) {
+        list_del(&sample->link);
+        list_add(&SAMPLES.free, &sample->link);
+        SAMPLES.num_live--;
+    }
+    spinlock_unlock(&SAMPLES_LOCK);
+}
+
+// The estimated live bytes of a call site.
+struct site_stats {
+    void const * site;
+    uint32_t bytes;
+    uint32_t samples;
+};
+
+// Sort an array of site_stats. This is a shell sort, it is only used when
+// dumping.
+// @param stats: The array to sort.
+// @param n: The number of elements in the array.
+// @param by_bytes: If true, sort by decreasing bytes, otherwise by increasing
+// site.
+static void sort_site_stats(struct site_stats * const stats,
+                            uint32_t const n,
+                            bool const by_bytes) {
+    for (uint32_t gap = n / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < n; ++i) {
+            struct site_stats const tmp = stats[i];
+            uint32_t j = i;
+            for (; j >= gap; j -= gap) {
+                struct site_stats const * const prev = stats + j - gap;
+                bool const before = by_bytes ?
+                    tmp.bytes > prev->bytes : tmp.site < prev->site;
+                if (!before) {
+                    break;
+                }
+                stats[j] = *prev;
+            }
+            stats[j] = tmp;
+        }
+    }
+}
+
+// Aggregate per-sample stats into per-site stats, sorted by decreasing bytes.
+// @param stats: One element per sample on input, with `samples` set to 1. On
+// output, contains one element per call site.
+// @param n: The number of samples.
+// @return: The number of call sites.
+static uint32_t aggregate_sites(struct site_stats * const stats,
+                                uint32_t const n) {
+    sort_site_stats(stats, n, false);
+    uint32_t num_sites = 0;
+    for (uint32_t i = 0, j; i < n; i = j) {
+        struct site_stats site = stats[i];
+        for (j = i + 1; j < n && stats[j].site == site.site; ++j) {
+            site.bytes += stats[j].bytes;
+            site.samples += stats[j].samples;
+        }
+        stats[num_sites++] = site;
+    }
+    sort_site_stats(stats, num_sites, true);
+    return num_sites;
+}
+
+void kmalloc_sample_dump(uint32_t const max_sites) {
+    // Allocate before taking the lock, the allocation may itself be sampled.
+    struct site_stats * const stats =
+        kmalloc(KMALLOC_SAMPLE_MAX_ENTRIES * sizeof(*stats));
+    if (!stats) {
+        WARN("Cannot allocate %u sampled allocation sites\n",
+             KMALLOC_SAMPLE_MAX_ENTRIES);
+        return;
+    }
+
+    spinlock_lock(&SAMPLES_LOCK);
+    uint32_t n = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < SAMPLE_BUCKETS; ++i) {
+        struct sample const * sample;
+        list_for_each_entry(sample, SAMPLES.buckets + i, link) {
+            stats[n].site = sample->site;
+            stats[n].bytes = sample->weight;
+            stats[n].samples = 1;
+            total += sample->weight;
+            n++;
+        }
+    }
+    uint32_t const dropped = SAMPLES.dropped;
+    spinlock_unlock(&SAMPLES_LOCK);
+
+    uint32_t const num_sites = aggregate_sites(stats, n);
+    LOG("Sampled allocations: %u live samples (~%U bytes) from %u sites, %u "
+        "dropped\n", n, total, num_sites, dropped);
+    // The format of those lines is parsed by `make profile_report`.
+    for (uint32_t i = 0; i < num_sites && i < max_sites; ++i) {
+        LOG("[kalloc] %x %u k %u\n", (uint32_t)stats[i].site, stats[i].bytes,
+            stats[i].samples);
+    }
+    kfree(stats);
+}
+
+#include <kmalloc_sample.test>
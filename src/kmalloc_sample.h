@@ -0,0 +1,58 @@
+#pragma once
+#include <types.h>
+
+// Sampled allocation tracking.
+//    KMALLOC_DEBUG records the origin of every allocation next to its data,
+// which is too costly to be enabled outside of debugging. Instead, the sampler
+// records the call site of about one allocation for every
+// KMALLOC_SAMPLE_PERIOD bytes allocated through kmalloc(): each cpu counts down
+// the bytes it allocates, and the allocation reaching zero is sampled and the
+// countdown re-armed with a random value averaging the period. A sample holds
+// the address, size and call site of the allocation and lives in a hash table
+// keyed by address, outside of the heap, until the allocation is freed. The
+// cost for allocations that are not sampled is a per-cpu subtraction, and for
+// frees a lookup of an usually empty hash bucket without taking any lock.
+//    Large allocations are more likely to be sampled than small ones, hence a
+// sample stands for max(size, period) bytes, which makes the sum of the samples
+// of a call site an unbiased estimate of its live bytes.
+// kmalloc_sample_dump() outputs the call sites with the most live bytes as
+// "[kalloc] <site> <bytes> k <samples>" lines, which `make profile_report
+// PROFILE_TAG=[kalloc] PROFILE_LOG=<file>` resolves against the symbols of the
+// kernel image, the same way as the profiler's samples.
+
+// The default average number of bytes allocated between two samples.
+#define KMALLOC_SAMPLE_PERIOD       (512 << 10)
+
+// The maximum number of live samples. Samples taken while the table is full
+// are dropped and counted.
+#define KMALLOC_SAMPLE_MAX_ENTRIES  1024
+
+// Start sampling allocations with the default period. Must be called once the
+// percpu areas exist.
+void kmalloc_sample_init(void);
+
+// Change the sampling period. kmalloc_sample_init() must have been called.
+// @param period: The average number of bytes allocated between two samples. 0
+// stops sampling, the live samples are still removed when their allocation is
+// freed.
+void kmalloc_sample_set_period(uint32_t const period);
+
+// Account an allocation, and record it if it is sampled. Called by kmalloc().
+// @param addr: The address returned to the caller of kmalloc().
+// @param size: The requested size.
+// @param site: The return address of the kmalloc() call.
+void kmalloc_sample_alloc(void * const addr,
+                          size_t const size,
+                          void const * const site);
+
+// Forget about an allocation if it was sampled. Called by kfree() before the
+// memory is given back to the allocator.
+// @param addr: The address being freed.
+void kmalloc_sample_free(void * const addr);
+
+// Output the call sites with the most estimated live bytes.
+// @param max_sites: The maximum number of call sites to output.
+void kmalloc_sample_dump(uint32_t const max_sites);
+
+// Run the tests of the allocation sampler.
+void kmalloc_sample_test(void);
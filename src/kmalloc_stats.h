@@ -0,0 +1,54 @@
+#pragma once
+#include <types.h>
+
+// Statistics of the dynamic memory allocator. Those are separated from
+// kmalloc.h so that kmalloc.c can use them without the KMALLOC_DEBUG wrappers.
+
+// The number of size classes of the per-cpu caches. The size classes are the
+// powers of two from 16 bytes to 1KiB.
+#define KMALLOC_CACHE_NUM_CLASSES   7
+
+// Counters of a size class of the per-cpu caches, summed over all the cpus.
+struct kmalloc_class_stats {
+    // The size of the objects of this class.
+    uint32_t size;
+    // The number of allocations served by the cache of a cpu.
+    uint32_t hits;
+    // The number of allocations for which the cache was empty and had to be
+    // refilled from the groups.
+    uint32_t misses;
+    // The number of frees into the caches.
+    uint32_t frees;
+};
+
+// Statistics of the dynamic memory allocator, see kmalloc_get_stats().
+struct kmalloc_stats {
+    // The number of bytes currently allocated in the groups, as returned by
+    // kmalloc_total_allocated().
+    size_t allocated;
+    // The highest value of `allocated` since boot.
+    size_t peak_allocated;
+    // The number of groups and pages currently mapped, including the retained
+    // empty groups.
+    uint32_t groups;
+    uint32_t pages;
+    // The number of empty groups retained and their number of pages.
+    uint32_t retained_groups;
+    uint32_t retained_pages;
+    // The number of allocations and frees that went to the groups.
+    uint32_t group_allocs;
+    uint32_t group_frees;
+    // The percentage of the mapped bytes not holding allocated data: free
+    // nodes, node headers and retained groups. 0 means a perfectly packed heap.
+    uint32_t fragmentation;
+    // The counters of each size class.
+    struct kmalloc_class_stats classes[KMALLOC_CACHE_NUM_CLASSES];
+};
+
+// Get the statistics of the dynamic memory allocator. The counters are kept up
+// to date upon each allocation and free, this function does not walk the heap.
+// @param stats: Output parameter receiving the statistics.
+void kmalloc_get_stats(struct kmalloc_stats * const stats);
+
+// Log the statistics of the dynamic memory allocator.
+void kmalloc_log_stats(void);
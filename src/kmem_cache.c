@@ -0,0 +1,363 @@
+#include <kmem_cache.h>
+#include <debug.h>
+#include <memory.h>
+#include <frame_alloc.h>
+#include <paging.h>
+#include <kernel_map.h>
+#include <kmalloc.h>
+#include <error.h>
+#include <percpu.h>
+#include <cpu.h>
+
+// The header of a slab. Located at the beginning of the slab's page, the
+// objects are located right after it (modulo alignment).
+struct slab {
+    // The cache this slab belongs to.
+    struct kmem_cache * cache;
+    // Element of either the partial_slabs or full_slabs list of the cache.
+    struct list_node slab_list;
+    // The number of allocated objects in this slab.
+    uint32_t in_use;
+    // The head of the free list of this slab. Free objects are chained through
+    // their first word.
+    void * free_head;
+} __attribute__((packed));
+STATIC_ASSERT(sizeof(struct slab) <= KMEM_CACHE_SLAB_HEADER_SIZE, "");
+
+// The list of all the caches that have allocated at least one slab. This is
+// used by kmem_cache_shrink_all() and kmem_cache_total_allocated().
+static struct list_node CACHES_LIST = {&CACHES_LIST, &CACHES_LIST};
+// Lock protecting CACHES_LIST. When both this lock and a cache's lock must be
+// held, this lock must be acquired first.
+static DECLARE_SPINLOCK(CACHES_LIST_LOCK);
+
+// The balance of each cpu, see kmem_cache_cpu_balance().
+DECLARE_PER_CPU(int32_t, kmem_cache_balance);
+
+// Account bytes allocated or freed on the current cpu in its balance.
+// @param bytes: The number of bytes allocated, negative for frees.
+static void account_bytes(int32_t const bytes) {
+    // Percpu variables are only usable once GS has been loaded.
+    if (cpu_read_gs().value) {
+        this_cpu_add(kmem_cache_balance, bytes);
+    }
+}
+
+void kmem_cache_init(struct kmem_cache * const cache,
+                     char const * const name,
+                     size_t const size,
+                     size_t const align,
+                     void (*ctor)(void *)) {
+    // The alignment must be a power of two.
+    ASSERT(align && !(align & (align - 1)));
+    size_t const stride = _KMEM_CACHE_STRIDE(size, align);
+    size_t const first_obj_off = _KMEM_CACHE_FIRST_OBJ_OFF(align);
+    // This implementation only supports objects fitting in a single page.
+    ASSERT(first_obj_off + stride <= PAGE_SIZE);
+
+    cache->name = name;
+    cache->obj_size = size;
+    cache->stride = stride;
+    cache->first_obj_offset = first_obj_off;
+    cache->objs_per_slab = (PAGE_SIZE - first_obj_off) / stride;
+    cache->ctor = ctor;
+    spinlock_init(&cache->lock);
+    list_init(&cache->partial_slabs);
+    list_init(&cache->full_slabs);
+    cache->empty_slab = NULL;
+    cache->num_allocated = 0;
+    cache->registered = false;
+    list_init(&cache->cache_list);
+}
+
+struct kmem_cache *kmem_cache_create(char const * const name,
+                                     size_t const size,
+                                     size_t const align,
+                                     void (*ctor)(void *)) {
+    struct kmem_cache * const cache = kmalloc(sizeof(*cache));
+    if (!cache) {
+        SET_ERROR("Cannot allocate struct kmem_cache", ENONE);
+        return NULL;
+    }
+    kmem_cache_init(cache, name, size, align, ctor);
+    return cache;
+}
+
+// Get the address of the i-th object of a slab.
+// @param slab: The slab.
+// @param i: The index of the object.
+// @return: The address of the object.
+static void *slab_obj(struct slab * const slab, uint32_t const i) {
+    struct kmem_cache const * const cache = slab->cache;
+    return (void*)slab + cache->first_obj_offset + i * cache->stride;
+}
+
+// Get the slab containing an object.
+// @param obj: The object.
+// @return: The struct slab of the page containing the object.
+static struct slab *obj_slab(void const * const obj) {
+    return (struct slab*)((uint32_t)obj & ~(PAGE_SIZE - 1));
+}
+
+// Allocate and initialize a new slab for a cache.
+// @param cache: The cache to allocate the slab for.
+// @return: The new slab, NULL if the allocation failed.
+// Note: This function assumes that the lock of the cache is not held. The reason
+// is that this function modifies the page tables, which might trigger a TLB
+// shootdown which in turn enables interrupts while waiting for remote cpus.
+static struct slab *create_slab(struct kmem_cache * const cache) {
+    void * const frame = alloc_frame();
+    if (frame == NO_FRAME) {
+        SET_ERROR("Not enough physical frames to allocate slab", ENONE);
+        return NULL;
+    }
+
+    // Modifying kernel mappings requires using the kernel address space.
+    // FIXME: This can be avoided once this rule is removed.
+    struct addr_space * const prev_addr_space = enter_kernel_addr_space();
+    void * frames[1] = {frame};
+    void * const page = paging_map_frames_above(KERNEL_PHY_OFFSET, frames, 1,
+        VM_WRITE);
+    exit_kernel_addr_space(prev_addr_space);
+
+    if (page == NO_REGION) {
+        free_frame(frame);
+        SET_ERROR("Cannot map slab to virt addr space", ENONE);
+        return NULL;
+    }
+    // The slabs are shared by all cpus.
+    frame_alloc_exclude_from_balance(1);
+
+    struct slab * const slab = page;
+    slab->cache = cache;
+    list_init(&slab->slab_list);
+    slab->in_use = 0;
+
+    // Chain all the objects in the free list, the first object being the head.
+    slab->free_head = slab_obj(slab, 0);
+    for (uint32_t i = 0; i < cache->objs_per_slab; ++i) {
+        void ** const obj = slab_obj(slab, i);
+        *obj = (i + 1 < cache->objs_per_slab) ? slab_obj(slab, i + 1) : NULL;
+    }
+    return slab;
+}
+
+// Free the page used by a slab.
+// @param slab: The slab to free. Must not contain any allocated object.
+// Note: This function assumes that the lock of the cache is not held, see
+// create_slab().
+static void free_slab(struct slab * const slab) {
+    ASSERT(!slab->in_use);
+
+    // Modifying kernel mappings requires using the kernel address space.
+    // FIXME: This can be avoided once this rule is removed.
+    frame_alloc_exclude_from_balance(-1);
+    struct addr_space * const prev_addr_space = enter_kernel_addr_space();
+    paging_unmap_and_free_frames(slab, PAGE_SIZE);
+    exit_kernel_addr_space(prev_addr_space);
+}
+
+// Add a cache to the global list of caches if this is not already done.
+// @param cache: The cache to register.
+static void register_cache(struct kmem_cache * const cache) {
+    spinlock_lock(&CACHES_LIST_LOCK);
+    if (!cache->registered) {
+        list_add_tail(&CACHES_LIST, &cache->cache_list);
+        cache->registered = true;
+    }
+    spinlock_unlock(&CACHES_LIST_LOCK);
+}
+
+// Take an object out of a slab.
+// @param cache: The cache of the slab.
+// @param slab: The slab to allocate from. Must contains at least one free
+// object and be on the partial_slabs list of the cache.
+// @return: The address of the object.
+// Note: This function assumes the lock of the cache is held.
+static void *slab_alloc(struct kmem_cache * const cache,
+                        struct slab * const slab) {
+    ASSERT(spinlock_is_held(&cache->lock));
+    ASSERT(slab->free_head);
+
+    void ** const obj = slab->free_head;
+    slab->free_head = *obj;
+    slab->in_use ++;
+    cache->num_allocated ++;
+
+    if (slab->in_use == cache->objs_per_slab) {
+        list_del(&slab->slab_list);
+        list_add(&cache->full_slabs, &slab->slab_list);
+    }
+    return obj;
+}
+
+void *kmem_cache_alloc(struct kmem_cache * const cache) {
+    if (!cache->registered) {
+        register_cache(cache);
+    }
+
+    void *obj = NULL;
+    spinlock_lock(&cache->lock);
+    if (list_empty(&cache->partial_slabs) && cache->empty_slab) {
+        // Re-use the empty slab.
+        list_add(&cache->partial_slabs, &cache->empty_slab->slab_list);
+        cache->empty_slab = NULL;
+    }
+
+    if (!list_empty(&cache->partial_slabs)) {
+        struct slab * const slab = list_first_entry(&cache->partial_slabs,
+            struct slab, slab_list);
+        obj = slab_alloc(cache, slab);
+    }
+    spinlock_unlock(&cache->lock);
+
+    if (!obj) {
+        // No free object left, create a new slab. This must be done without
+        // holding the lock, see create_slab().
+        struct slab * const slab = create_slab(cache);
+        if (!slab) {
+            return NULL;
+        }
+        spinlock_lock(&cache->lock);
+        list_add(&cache->partial_slabs, &slab->slab_list);
+        obj = slab_alloc(cache, slab);
+        spinlock_unlock(&cache->lock);
+    }
+
+    memzero(obj, cache->obj_size);
+    if (cache->ctor) {
+        cache->ctor(obj);
+    }
+    account_bytes(cache->obj_size);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache * const cache, void * const obj) {
+    if (!obj) {
+        return;
+    }
+
+    account_bytes(-(int32_t)cache->obj_size);
+    struct slab * const slab = obj_slab(obj);
+    ASSERT(slab->cache == cache);
+    ASSERT(!(((void*)obj - slab_obj(slab, 0)) % cache->stride));
+
+    // The slab to be freed after releasing the lock, if any.
+    struct slab * to_free = NULL;
+
+    spinlock_lock(&cache->lock);
+    ASSERT(slab->in_use);
+    bool const was_full = slab->in_use == cache->objs_per_slab;
+
+    // Push the object at the head of the free list so that it is the next one
+    // to be allocated.
+    *(void**)obj = slab->free_head;
+    slab->free_head = obj;
+    slab->in_use --;
+    cache->num_allocated --;
+
+    if (!slab->in_use) {
+        list_del(&slab->slab_list);
+        if (!cache->empty_slab) {
+            cache->empty_slab = slab;
+        } else {
+            to_free = slab;
+        }
+    } else if (was_full) {
+        list_del(&slab->slab_list);
+        list_add(&cache->partial_slabs, &slab->slab_list);
+    }
+    spinlock_unlock(&cache->lock);
+
+    if (to_free) {
+        free_slab(to_free);
+    }
+}
+
+// Release the empty slab retained by a cache, if any.
+// @param cache: The cache to shrink.
+static void shrink_cache(struct kmem_cache * const cache) {
+    spinlock_lock(&cache->lock);
+    struct slab * const empty = cache->empty_slab;
+    cache->empty_slab = NULL;
+    spinlock_unlock(&cache->lock);
+
+    if (empty) {
+        free_slab(empty);
+    }
+}
+
+void kmem_cache_destroy(struct kmem_cache * const cache) {
+    ASSERT(!cache->num_allocated);
+    ASSERT(list_empty(&cache->partial_slabs));
+    ASSERT(list_empty(&cache->full_slabs));
+
+    spinlock_lock(&CACHES_LIST_LOCK);
+    if (cache->registered) {
+        list_del(&cache->cache_list);
+        cache->registered = false;
+    }
+    spinlock_unlock(&CACHES_LIST_LOCK);
+
+    shrink_cache(cache);
+    kfree(cache);
+}
+
+void kmem_cache_shrink_all(void) {
+    // The empty slabs cannot be freed while holding CACHES_LIST_LOCK, see
+    // create_slab(). Collect them first.
+    struct slab * to_free = NULL;
+
+    spinlock_lock(&CACHES_LIST_LOCK);
+    struct kmem_cache * cache;
+    list_for_each_entry(cache, &CACHES_LIST, cache_list) {
+        spinlock_lock(&cache->lock);
+        struct slab * const empty = cache->empty_slab;
+        cache->empty_slab = NULL;
+        spinlock_unlock(&cache->lock);
+        if (empty) {
+            // Since the slab is empty, its free_head can be re-used to chain
+            // the slabs to be freed.
+            empty->free_head = to_free;
+            to_free = empty;
+        }
+    }
+    spinlock_unlock(&CACHES_LIST_LOCK);
+
+    while (to_free) {
+        struct slab * const next = to_free->free_head;
+        free_slab(to_free);
+        to_free = next;
+    }
+}
+
+int32_t kmem_cache_cpu_balance(void) {
+    return cpu_read_gs().value ? this_cpu_read(kmem_cache_balance) : 0;
+}
+
+size_t kmem_cache_total_allocated(void) {
+    size_t total = 0;
+    spinlock_lock(&CACHES_LIST_LOCK);
+    struct kmem_cache * cache;
+    list_for_each_entry(cache, &CACHES_LIST, cache_list) {
+        spinlock_lock(&cache->lock);
+        total += cache->num_allocated * cache->obj_size;
+        spinlock_unlock(&cache->lock);
+    }
+    spinlock_unlock(&CACHES_LIST_LOCK);
+    return total;
+}
+
+void kmem_cache_log_stats(void) {
+    spinlock_lock(&CACHES_LIST_LOCK);
+    struct kmem_cache * cache;
+    list_for_each_entry(cache, &CACHES_LIST, cache_list) {
+        // A snapshot is good enough, the lock of the cache is not needed.
+        uint32_t const num = cache->num_allocated;
+        LOG("kmem_cache: %s: %u objects of %u bytes (%u bytes)\n", cache->name,
+            num, cache->obj_size, num * cache->obj_size);
+    }
+    spinlock_unlock(&CACHES_LIST_LOCK);
+}
+
+#include <kmem_cache.test>
@@ -0,0 +1,154 @@
+#pragma once
+#include <types.h>
+#include <list.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <paging.h>
+
+// Object caches
+// =============
+//      An object cache (struct kmem_cache) is a dedicated allocator for objects
+// of a fixed size. This is useful for the kernel's hottest objects (struct
+// proc, struct file, IPM messages, ...) for which the general purpose kmalloc()
+// is overkill.
+// Objects are packed into slabs. A slab is a single page containing a small
+// header followed by the objects. There is no per-object header, an object is
+// found back to its slab by rounding its address down to the page boundary.
+// Objects are aligned on the alignment requested at cache creation, usually
+// CACHE_LINE_SIZE, so that two objects never share a cache line.
+// Freed objects are recycled in LIFO order: the next allocation returns the
+// most recently freed object which is likely to still be in the cpu's caches.
+// Each cache keeps at most one empty slab around, other empty slabs are
+// released immediately. The retained slabs can be released with
+// kmem_cache_shrink_all().
+
+// The header of a slab, located at the very beginning of the slab's page.
+struct slab;
+
+// The state of an object cache. Fields are private to the implementation.
+struct kmem_cache {
+    // The name of the cache, for debugging.
+    char const * name;
+    // The size of the objects as requested by the user.
+    size_t obj_size;
+    // The distance in bytes between two consecutive objects in a slab.
+    size_t stride;
+    // Offset of the first object in a slab.
+    size_t first_obj_offset;
+    // The number of objects in a single slab.
+    uint32_t objs_per_slab;
+    // Optional constructor called on each object returned by kmem_cache_alloc.
+    void (*ctor)(void *);
+    // Protects the state of the cache.
+    spinlock_t lock;
+    // The slabs containing at least one free object and one allocated object.
+    struct list_node partial_slabs;
+    // The slabs in which all objects are allocated.
+    struct list_node full_slabs;
+    // An empty slab kept around to avoid mapping and unmapping pages when the
+    // number of allocated objects oscillates around a multiple of
+    // objs_per_slab. NULL if there is no such slab.
+    struct slab * empty_slab;
+    // The number of objects currently allocated in this cache.
+    uint32_t num_allocated;
+    // Indicate if this cache is part of the global list of caches.
+    bool registered;
+    // Element of the global list of caches.
+    struct list_node cache_list;
+};
+
+// Compute a static initializer for a struct kmem_cache. The macros below use
+// the same layout computation as kmem_cache_init().
+#define _KMEM_CACHE_ROUND_UP(x, m)  ((((x) + (m) - 1) / (m)) * (m))
+// Objects must be big enough to hold a pointer, used by free lists.
+#define _KMEM_CACHE_STRIDE(size, align) \
+    _KMEM_CACHE_ROUND_UP(((size) < sizeof(void*) ? sizeof(void*) : (size)),   \
+                         (align))
+#define _KMEM_CACHE_FIRST_OBJ_OFF(align) \
+    _KMEM_CACHE_ROUND_UP(KMEM_CACHE_SLAB_HEADER_SIZE, (align))
+
+// The size reserved at the beginning of each slab for the slab's header.
+#define KMEM_CACHE_SLAB_HEADER_SIZE 32
+
+// Declare a statically allocated object cache.
+// @param var: The name of the struct kmem_cache variable.
+// @param type: The type of the objects.
+// @param align: The alignment of the objects. Must be a power of two.
+// @param constructor: Optional constructor for the objects, can be NULL.
+#define DECLARE_KMEM_CACHE(var, type, align, constructor)                   \
+    struct kmem_cache var = {                                               \
+        .name = #type,                                                      \
+        .obj_size = sizeof(type),                                           \
+        .stride = _KMEM_CACHE_STRIDE(sizeof(type), (align)),                \
+        .first_obj_offset = _KMEM_CACHE_FIRST_OBJ_OFF(align),               \
+        .objs_per_slab = (PAGE_SIZE - _KMEM_CACHE_FIRST_OBJ_OFF(align)) /   \
+            _KMEM_CACHE_STRIDE(sizeof(type), (align)),                      \
+        .ctor = (constructor),                                              \
+        .lock = INIT_SPINLOCK(),                                            \
+        .partial_slabs = {&var.partial_slabs, &var.partial_slabs},          \
+        .full_slabs = {&var.full_slabs, &var.full_slabs},                   \
+        .empty_slab = NULL,                                                 \
+        .num_allocated = 0,                                                 \
+        .registered = false,                                                \
+        .cache_list = {&var.cache_list, &var.cache_list},                   \
+    }
+
+// Initialize an object cache.
+// @param cache: The cache to initialize.
+// @param name: The name of the cache.
+// @param size: The size of the objects.
+// @param align: The alignment of each object. Must be a power of two.
+// @param ctor: Optional constructor called on each object allocated from this
+// cache, after it has been zeroed. Can be NULL.
+void kmem_cache_init(struct kmem_cache * const cache,
+                     char const * const name,
+                     size_t const size,
+                     size_t const align,
+                     void (*ctor)(void *));
+
+// Create a dynamically allocated object cache.
+// @param name: The name of the cache.
+// @param size: The size of the objects.
+// @param align: The alignment of each object. Must be a power of two.
+// @param ctor: Optional constructor called on each object allocated from this
+// cache, after it has been zeroed. Can be NULL.
+// @return: The new cache, NULL if the allocation failed.
+struct kmem_cache *kmem_cache_create(char const * const name,
+                                     size_t const size,
+                                     size_t const align,
+                                     void (*ctor)(void *));
+
+// Destroy a cache created with kmem_cache_create().
+// @param cache: The cache to destroy. All objects must have been freed.
+void kmem_cache_destroy(struct kmem_cache * const cache);
+
+// Allocate an object from a cache. The object is zeroed and the constructor of
+// the cache, if any, is called on it.
+// @param cache: The cache to allocate from.
+// @return: The address of the object, NULL if the allocation failed.
+void *kmem_cache_alloc(struct kmem_cache * const cache);
+
+// Free an object.
+// @param cache: The cache the object was allocated from.
+// @param obj: The object to free.
+void kmem_cache_free(struct kmem_cache * const cache, void * const obj);
+
+// Release the empty slabs retained by all caches.
+void kmem_cache_shrink_all(void);
+
+// Compute the number of bytes currently allocated in all the object caches.
+// @return: The sum of the size of all allocated objects.
+size_t kmem_cache_total_allocated(void);
+
+// Get the balance of the current cpu, that is the number of bytes of the objects
+// allocated minus the number of bytes of the objects freed on the current cpu so
+// far, in all caches. Only the difference between two values is relevant, see
+// frame_alloc_cpu_balance().
+// @return: The balance of the current cpu.
+int32_t kmem_cache_cpu_balance(void);
+
+// Log the number of objects allocated in each registered cache.
+void kmem_cache_log_stats(void);
+
+// Execute tests related to object caches.
+void kmem_cache_test(void);
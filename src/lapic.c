@@ -5,6 +5,7 @@
 #include <memory.h>
 #include <interrupt.h>
 #include <acpi.h>
+#include <clock.h>
 // lapic_def.c contains the definition of the struct lapic.
 #include <lapic_def.c>
 
@@ -16,10 +17,78 @@ static volatile struct lapic *LAPIC;
 // base address.
 static uint32_t const IA32_APIC_BASE_MSR = 0x1B;
 
+// x2APIC mode
+// -----------
+//     When supported, the LAPICs are used in x2APIC mode. In this mode the LAPIC
+// registers are accessed through MSRs instead of MMIO, which avoids a costly
+// exit to the hypervisor on every access in a VM. The ICR is a single 64-bit
+// MSR: sending an IPI is a single write, without waiting for the delivery
+// status.
+// The mode is enabled by the BSP in init_lapic() and by each AP in
+// ap_init_lapic(), all the LAPICs use the same mode. The LAPIC_READ and
+// LAPIC_WRITE macros access a register in the current mode.
+
+// True if the LAPICs are in x2APIC mode.
+static bool X2APIC_ENABLED = false;
+
+// The MSR of the first LAPIC register in x2APIC mode. The MSR of a register is
+// X2APIC_MSR_BASE + (MMIO offset of the register >> 4).
+#define X2APIC_MSR_BASE 0x800
+
+// Get the x2APIC MSR of a LAPIC register.
+// @param reg: The name of the register in struct lapic.
+#define X2APIC_MSR(reg) (X2APIC_MSR_BASE + (offsetof(struct lapic, reg) >> 4))
+
+// Read a 32-bit LAPIC register.
+// @param reg: The name of the register in struct lapic.
+#define LAPIC_READ(reg)                                                     \
+    (X2APIC_ENABLED ? (uint32_t)read_msr(X2APIC_MSR(reg)) : LAPIC->reg.val)
+
+// Write a 32-bit LAPIC register.
+// @param reg: The name of the register in struct lapic.
+// @param value: The value to write.
+#define LAPIC_WRITE(reg, value)                         \
+    do {                                                \
+        if (X2APIC_ENABLED) {                           \
+            write_msr(X2APIC_MSR(reg), (value));        \
+        } else {                                        \
+            LAPIC->reg.val = (value);                   \
+        }                                               \
+    } while (0)
+
+// Logical destinations
+// --------------------
+//     An IPI in logical destination mode targets a set of cpus at once. Both
+// modes use the cluster model: the logical destination of a cpu is a cluster id
+// and a bit within the cluster, an IPI targets any subset of a single cluster.
+//  - In xAPIC mode, the logical destinations are programmed by the kernel: the
+//  cluster of a cpu is cpu >> XAPIC_CLUSTER_SHIFT. Only 15 clusters exist
+//  (cluster 0xF is the broadcast), cpus beyond them are sent IPIs in physical
+//  mode.
+//  - In x2APIC mode, the logical destination is read-only and derived from the
+//  x2APIC ID: the cluster is id >> X2APIC_CLUSTER_SHIFT.
+// Since APIC IDs are allocated hierarchically (see topology.h), a cluster
+// groups SMT siblings and cores of the same package.
+
+#define XAPIC_CLUSTER_SHIFT     2
+#define X2APIC_CLUSTER_SHIFT    4
+#define XAPIC_NUM_CLUSTERS      15
+// The value of the destination format register selecting the cluster model.
+#define XAPIC_DFR_CLUSTER       0x0FFFFFFF
+
+// The x2APIC enable bit (EXTD) of the IA32_APIC_BASE_MSR.
+#define APIC_BASE_X2APIC_ENABLE (1 << 10)
+// The global enable bit of the IA32_APIC_BASE_MSR.
+#define APIC_BASE_GLOBAL_ENABLE (1 << 11)
+
 // The frequency of the LAPIC timer in Hz. We assume that the frequency is
 // constant AND the same on all cpus in the system.
 static uint64_t LAPIC_TIMER_FREQ = 0;
 
+// The value of the divide configuration register to run the timer at the
+// frequency of its clock (bits 0, 1 and 3 set).
+#define LAPIC_TIMER_DIVIDE_BY_1 0xB
+
 // Get the base address of the LAPIC.
 // @return: Base address of the LAPIC.
 static void *get_lapic_base_addr(void) {
@@ -28,13 +97,53 @@ static void *get_lapic_base_addr(void) {
 }
 
 
+// Check if the cpu supports the x2APIC mode.
+// @return: true if the x2APIC mode is supported, false otherwise.
+static bool has_x2apic(void) {
+    // CPUID.01H:ECX[21] indicates x2APIC support.
+    uint32_t ecx = 0;
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    return ecx & (1 << 21);
+}
+
+// Put the LAPIC of the current cpu in x2APIC mode. The xAPIC mode must be
+// enabled first.
+static void enable_x2apic(void) {
+    uint64_t const apic_base_msr = read_msr(IA32_APIC_BASE_MSR);
+    uint64_t const flags = APIC_BASE_GLOBAL_ENABLE | APIC_BASE_X2APIC_ENABLE;
+    write_msr(IA32_APIC_BASE_MSR, apic_base_msr | flags);
+}
+
+// Program the logical destination of the current cpu's LAPIC in xAPIC mode, see
+// "Logical destinations" above. Nothing to do in x2APIC mode.
+static void set_logical_destination(void) {
+    if (X2APIC_ENABLED) {
+        return;
+    }
+    uint8_t const cpu = cpu_id();
+    uint32_t const cluster = cpu >> XAPIC_CLUSTER_SHIFT;
+    uint32_t const member = 1 << (cpu & ((1 << XAPIC_CLUSTER_SHIFT) - 1));
+    LAPIC_WRITE(destination_format, XAPIC_DFR_CLUSTER);
+    // Cpus without a cluster are not part of any logical destination.
+    uint32_t const ldr =
+        cluster < XAPIC_NUM_CLUSTERS ? (cluster << 4) | member : 0;
+    LAPIC_WRITE(logical_destination, ldr << 24);
+}
+
 // Enable the Local APIC for the current CPU.
 static void enable_apic(void) {
+    // The destination format must be configured before enabling the LAPIC.
+    set_logical_destination();
     // Writing the enable bit in the IA32_APIC_BASE_MSR (0x1B) only works for
     // the BSP but not the APs.
     // A more reliable option is to set the bit 8 of the Spuriouse Interrupt
     // Vector register.
-    LAPIC->spurious_interrupt_vector.val |= (1 << 8);
+    uint32_t const spurious = LAPIC_READ(spurious_interrupt_vector);
+    LAPIC_WRITE(spurious_interrupt_vector, spurious | (1 << 8));
+    // Run the timer at the frequency of the bus/core crystal clock, without
+    // divider. All cpus must use the same divider since the frequency of the
+    // timer is only computed once, on the BSP.
+    LAPIC_WRITE(divide_configuration, LAPIC_TIMER_DIVIDE_BY_1);
 }
 
 // Start the LAPIC timer.
@@ -51,12 +160,12 @@ static void start_timer(uint32_t const count,
                         bool const masked) {
     uint32_t const periodic_bit = periodic ? (1 << 17) : 0;
     uint32_t const masked_bit = masked << 16;
-    LAPIC->lvt_timer.val = masked_bit | periodic_bit | vector;
+    LAPIC_WRITE(lvt_timer, masked_bit | periodic_bit | vector);
     // Note: We need to be careful here. The lvt_timer register should be
     // configured _before_ the initial_count. Enforce this order by using a
     // memory fence.
     //cpu_mfence();
-    LAPIC->initial_count.val = count;
+    LAPIC_WRITE(initial_count, count);
     // Writing in the initial_count register starts off the timer.
 }
 
@@ -68,6 +177,8 @@ static uint32_t num_underflows_remaining = 50;
 static volatile bool calibrate_done = false;
 // The value of the LAPIC timer at the time of the last PIT underflow.
 static volatile uint32_t current_at_pit_interrupt = 0;
+// The value of the TSC at the time of the last PIT underflow.
+static volatile uint64_t tsc_at_pit_interrupt = 0;
 
 // The handler to call on PIT underflow.
 static void calibrate_timer_pit_handler(
@@ -76,7 +187,8 @@ static void calibrate_timer_pit_handler(
     if (!num_underflows_remaining) {
         // This is the last underflow. Read out the LAPIC timer current value
         // and set the calibrate_done to true.
-        current_at_pit_interrupt = LAPIC->current_count.val;
+        current_at_pit_interrupt = LAPIC_READ(current_count);
+        tsc_at_pit_interrupt = read_tsc();
         calibrate_done = true;
         // Disable the redirection for the PIT irq so we don't receive anymore
         // of them.
@@ -85,8 +197,8 @@ static void calibrate_timer_pit_handler(
     }
 }
 
-// The calibration function.
-void calibrate_timer(void) {
+// Calibrate the LAPIC timer and the TSC against the PIT.
+static void calibrate_with_pit(void) {
     // To calibrate the LAPIC timer, we will use the legacy PIT through the IO
     // APIC.
     // The calibration methodology is as follow:
@@ -100,8 +212,10 @@ void calibrate_timer(void) {
     // 6. Compute the frequency of the LAPIC depending on the frequency of the
     // PIT and the delta between the count of the LAPIC timer when starting and
     // ending the PIT.
+    // The TSC is calibrated the same way, using its values when starting and
+    // ending the PIT.
 
-    LOG("Calibrating LAPIC timer frequency\n");
+    LOG("Calibrating LAPIC timer and TSC frequencies against the PIT\n");
 
     uint32_t const N = 20;
     num_underflows_remaining = N;
@@ -139,7 +253,8 @@ void calibrate_timer(void) {
     // Enable interrupts and read the start current value of the LAPIC timer
     // right before the PIT starts (aka. writting the high byte of the counter).
     cpu_set_interrupt_flag(true);
-    uint32_t const current_at_start = LAPIC->current_count.val;
+    uint32_t const current_at_start = LAPIC_READ(current_count);
+    uint64_t const tsc_at_start = read_tsc();
     // Write the high byte of the counter and start the counter.
     cpu_outb(pit_counter_port, (uint8_t)(counter >> 8));
 
@@ -165,7 +280,101 @@ void calibrate_timer(void) {
     uint64_t const pit_curr_freq = pit_base_freq / (uint64_t)counter;
     LAPIC_TIMER_FREQ = (delta * pit_curr_freq) / N;
 
-    LOG("LAPIC freq = %U Hz\n", LAPIC_TIMER_FREQ);
+    uint64_t const tsc_freq =
+        ((tsc_at_pit_interrupt - tsc_at_start) * pit_curr_freq) / N;
+    clock_set_tsc_freq(tsc_freq);
+}
+
+// Read the TSC and core crystal clock frequencies enumerated by the CPUID leaves
+// 0x15 (TSC/core crystal clock ratio) and 0x16 (processor base frequency).
+// @param tsc_freq: Output parameter receiving the frequency of the TSC in Hz, 0
+// if not enumerated.
+// @param crystal_freq: Output parameter receiving the frequency of the core
+// crystal clock in Hz, 0 if not enumerated.
+static void cpuid_clock_freqs(uint64_t * const tsc_freq,
+                              uint64_t * const crystal_freq) {
+    *tsc_freq = 0;
+    *crystal_freq = 0;
+
+    uint32_t max_leaf;
+    cpuid(0x0, &max_leaf, NULL, NULL, NULL);
+
+    // CPUID.15H: TSC freq = ECX * EBX / EAX, with ECX the frequency of the core
+    // crystal clock, which might not be enumerated (ECX = 0).
+    uint32_t denom = 0, numer = 0;
+    if (max_leaf >= 0x15) {
+        uint32_t crystal;
+        cpuid(0x15, &denom, &numer, &crystal, NULL);
+        if (denom && numer && crystal) {
+            *crystal_freq = crystal;
+            *tsc_freq = (*crystal_freq * numer) / denom;
+        }
+    }
+
+    // CPUID.16H:EAX[15:0] is the processor base frequency in MHz, which is the
+    // frequency of the TSC. It can be used to derive the crystal frequency
+    // when CPUID.15H does not enumerate it.
+    if (!*tsc_freq && max_leaf >= 0x16) {
+        uint32_t base_mhz;
+        cpuid(0x16, &base_mhz, NULL, NULL, NULL);
+        *tsc_freq = (uint64_t)(base_mhz & 0xFFFF) * 1000000ULL;
+        if (*tsc_freq && denom && numer) {
+            *crystal_freq = (*tsc_freq * denom) / numer;
+        }
+    }
+}
+
+// Calibrate the LAPIC timer against the TSC. The TSC frequency must be known.
+static void calibrate_lapic_with_tsc(void) {
+    // Let the LAPIC timer count down, masked, for a few milliseconds as
+    // measured by the TSC. The LAPIC timer and TSC values are read as close as
+    // possible from each other.
+    uint32_t const duration_us = 10000;
+    start_timer(0xFFFFFFFF, false, 0, true);
+    uint32_t const current_at_start = LAPIC_READ(current_count);
+    uint64_t const tsc_at_start = read_tsc();
+    clock_delay_us(duration_us);
+    uint32_t const current_at_end = LAPIC_READ(current_count);
+    uint64_t const tsc_at_end = read_tsc();
+    lapic_stop_timer();
+
+    ASSERT(current_at_end < current_at_start);
+    uint64_t const delta = current_at_start - current_at_end;
+    LAPIC_TIMER_FREQ = (delta * clock_tsc_freq()) / (tsc_at_end - tsc_at_start);
+}
+
+// The calibration function.
+void calibrate_timer(void) {
+    // The frequencies are the same on all cpus, calibrate only once. This
+    // avoids the noise of repeated calibrations.
+    if (LAPIC_TIMER_FREQ) {
+        return;
+    }
+
+    // Prefer the frequencies enumerated by CPUID as those are exact and do
+    // not require waiting on a timer. With a known TSC frequency, the LAPIC
+    // timer can be calibrated quickly against the TSC. The PIT is only used as
+    // a last resort, it takes about half a second.
+    uint64_t tsc_freq, crystal_freq;
+    cpuid_clock_freqs(&tsc_freq, &crystal_freq);
+    char const * method;
+    if (tsc_freq) {
+        clock_set_tsc_freq(tsc_freq);
+        if (crystal_freq) {
+            // The LAPIC timer runs at the core crystal clock frequency.
+            LAPIC_TIMER_FREQ = crystal_freq;
+            method = "CPUID";
+        } else {
+            calibrate_lapic_with_tsc();
+            method = "CPUID + TSC";
+        }
+    } else {
+        calibrate_with_pit();
+        method = "PIT";
+    }
+
+    LOG("LAPIC freq = %U Hz, TSC freq = %U Hz (%s)\n", LAPIC_TIMER_FREQ,
+        clock_tsc_freq(), method);
 }
 
 void init_lapic(void) {
@@ -175,18 +384,27 @@ void init_lapic(void) {
     if (!paging_map((void*)LAPIC, (void*)LAPIC, sizeof(*LAPIC), flags)) {
         PANIC("Cannot map LAPIC to virtual memory\n");
     }
+    X2APIC_ENABLED = has_x2apic();
+    if (X2APIC_ENABLED) {
+        enable_x2apic();
+    }
     enable_apic();
+    LOG("LAPIC in %s mode\n", X2APIC_ENABLED ? "x2APIC" : "xAPIC");
 }
 
 void ap_init_lapic(void) {
     // The LAPIC registers have already been mapped by the BSP at boot,
-    // therefore all is left to do is enabling the LAPIC on this AP.
+    // therefore all is left to do is enabling the LAPIC on this AP, in the
+    // same mode as the BSP.
+    if (X2APIC_ENABLED) {
+        enable_x2apic();
+    }
     enable_apic();
 }
 
 void lapic_eoi(void) {
     // A write of 0 in the EOI register indicates the end of interrupt.
-    LAPIC->eoi.val = 0;
+    LAPIC_WRITE(eoi, 0);
 }
 
 void lapic_start_timer(uint32_t const msec,
@@ -211,15 +429,37 @@ void lapic_start_timer(uint32_t const msec,
     start_timer(count, periodic, vector, false);
 }
 
+void lapic_arm_timer(uint64_t const nsec, uint8_t const vector) {
+    // Clamp the delay to ~4.3 seconds so that the conversion below does not
+    // overflow, the LAPIC timer frequency is well below 2^32 Hz. Longer delays
+    // simply lead to an early interrupt after which the timer is re-armed.
+    uint64_t const max_ns = 1ULL << 32;
+    uint64_t const ns = nsec < max_ns ? nsec : max_ns;
+    uint64_t count = ns * LAPIC_TIMER_FREQ / 1000000000ULL;
+    if (!count) {
+        // A count of 0 would not start the timer.
+        count = 1;
+    } else if (count > 0xFFFFFFFF) {
+        count = 0xFFFFFFFF;
+    }
+    start_timer(count, false, vector, false);
+}
+
 void lapic_stop_timer(void) {
     // Mask the interrupts from the LAPIC timer.
-    LAPIC->lvt_timer.val = LAPIC->lvt_timer.val | ((uint32_t)(1 << 16));
+    LAPIC_WRITE(lvt_timer, LAPIC_READ(lvt_timer) | ((uint32_t)(1 << 16)));
     // Writing 0 in the initial_count register stops the timer in both one-shot
     // and periodic modes.
-    LAPIC->initial_count.val = 0;
+    LAPIC_WRITE(initial_count, 0);
 }
 
 void lapic_sleep(uint32_t const msec) {
+    if (clock_tsc_freq()) {
+        // Do not use the LAPIC timer, it might be used by the timer wheel.
+        clock_delay_us(msec * 1000);
+        return;
+    }
+
     uint32_t const count = msec * LAPIC_TIMER_FREQ / 1000;
 
     // Start a one-shot timer for `msec` milliseconds. We do not want interrupts
@@ -227,7 +467,7 @@ void lapic_sleep(uint32_t const msec) {
     // to be 0.
     start_timer(count, false, 0, true);
 
-    while(LAPIC->current_count.val) {
+    while(LAPIC_READ(current_count)) {
         cpu_pause();
     }
 }
@@ -277,13 +517,27 @@ static bool icr_is_valid(struct icr const * const icr) {
 // Write a configuration into the ICR. This sends the IPI as described by the
 // value passed as parameter.
 // @param icr: The configuration to write.
+// @param destination: The destination of the IPI, ignored if the configuration
+// uses a shorthand. Its interpretation depends on the destination mode.
 // Note: This function will wait until the IPI has been sent.
-static void write_icr(struct icr const * const icr) {
+static void write_icr(struct icr const * const icr,
+                      uint32_t const destination) {
     // Make sure the ICR is valid before writing it into the LAPIC.
     ASSERT(icr_is_valid(icr));
 
+    if (X2APIC_ENABLED) {
+        // In x2APIC mode the ICR is a single 64-bit MSR with the destination
+        // in bits 32 to 63, and writing it sends the IPI. There is no delivery
+        // status to wait on.
+        uint64_t const val = ((uint64_t)destination << 32) | icr->low;
+        write_msr(X2APIC_MSR(interrupt_command), val);
+        return;
+    }
+
     // The interrupt command register must be written MSBytes first.
-    LAPIC->interrupt_command.bits_32_63.val = icr->high;
+    // The destination is in bits 56 to 63.
+    ASSERT(destination <= 0xFF);
+    LAPIC->interrupt_command.bits_32_63.val = icr->high | (destination << 24);
     LAPIC->interrupt_command.bits_0_31.val = icr->low;
 
     // Wait for the IPI to be sent by looking at the delivery status bit (bit
@@ -307,7 +561,7 @@ void lapic_send_broadcast_init(void) {
     icr.level = 1;
     icr.destination_shorthand = ALL_EXCL_SELF;
 
-    write_icr(&icr);
+    write_icr(&icr, 0);
 }
 
 void lapic_send_broadcast_sipi(void const * const trampoline) {
@@ -331,7 +585,7 @@ void lapic_send_broadcast_sipi(void const * const trampoline) {
     // destination related fields.
     icr.destination_shorthand = ALL_EXCL_SELF;
 
-    write_icr(&icr);
+    write_icr(&icr, 0);
 }
 
 void lapic_send_ipi(uint8_t const dest_cpu, uint8_t const vector) {
@@ -345,14 +599,47 @@ void lapic_send_ipi(uint8_t const dest_cpu, uint8_t const vector) {
 
     if (dest_cpu < acpi_get_number_cpus()) {
         icr.destination_shorthand = NONE;
-        icr.destination = dest_cpu;
     } else if (dest_cpu == IPI_BROADCAST) {
         icr.destination_shorthand = ALL_EXCL_SELF;
     } else {
         PANIC("Invalid cpu id %u\n", dest_cpu);
     }
 
-    write_icr(&icr);
+    write_icr(&icr, dest_cpu);
+}
+
+void lapic_send_ipi_mask(struct cpumask const * const mask,
+                         uint8_t const vector) {
+    struct icr icr;
+    memzero(&icr, sizeof(icr));
+    icr.vector = vector;
+    icr.level = 1;
+    icr.delivery_mode = NORMAL;
+    icr.destination_mode = LOGICAL;
+    icr.destination_shorthand = NONE;
+
+    uint8_t const shift = X2APIC_ENABLED ?
+        X2APIC_CLUSTER_SHIFT : XAPIC_CLUSTER_SHIFT;
+    uint32_t cpu = cpumask_next(mask, 0);
+    while (cpu < CPUMASK_MAX_CPUS) {
+        ASSERT(cpu < acpi_get_number_cpus());
+        uint32_t const cluster = cpu >> shift;
+        if (!X2APIC_ENABLED && cluster >= XAPIC_NUM_CLUSTERS) {
+            lapic_send_ipi(cpu, vector);
+            cpu = cpumask_next(mask, cpu + 1);
+            continue;
+        }
+        // Gather all the targets of this cluster, they are consecutive in the
+        // mask.
+        uint32_t members = 0;
+        for (; cpu < CPUMASK_MAX_CPUS && (cpu >> shift) == cluster;
+             cpu = cpumask_next(mask, cpu + 1)) {
+            members |= 1 << (cpu & ((1 << shift) - 1));
+        }
+        uint32_t const dest = X2APIC_ENABLED ?
+            (cluster << 16) | members : (cluster << 4) | members;
+        write_icr(&icr, dest);
+    }
 }
 
 #include <lapic.test>
@@ -1,5 +1,6 @@
 #pragma once
 #include <interrupt.h>
+#include <cpumask.h>
 
 // Initialized the Local APIC on the current CPU.
 void init_lapic(void);
@@ -23,18 +24,33 @@ void lapic_start_timer(uint32_t const msec,
                        uint8_t const vector,
                        int_callback_t const callback);
 
+// Arm the LAPIC timer of the current CPU in one-shot mode. Unlike
+// lapic_start_timer(), this does not register any callback nor touch the
+// interrupt flag, the handler of `vector` is expected to be registered already.
+// This is used by the timer wheel, see timer.h.
+// @param nsec: The number of nanoseconds before the timer fires. This is
+// rounded to the period of the LAPIC timer and clamped to the longest delay
+// supported by the LAPIC timer.
+// @param vector: The interrupt vector to use once the timer reaches 0.
+void lapic_arm_timer(uint64_t const nsec, uint8_t const vector);
+
 // Stop the current timer on the Local APIC of the current CPU.
 // Note: This stops both one-shot and periodic timers.
 void lapic_stop_timer(void);
 
-// Calibrate the frequency of the LAPIC timer. This function assumes that the IO
-// APIC is set up and initialized.
+// Calibrate the frequency of the LAPIC timer and of the TSC. The frequencies
+// are taken from CPUID when enumerated, otherwise the LAPIC timer is calibrated
+// against the TSC or, as a last resort, both are calibrated against the PIT.
+// The calibration is only done once, on the BSP, subsequent calls are no-ops and
+// the APs re-use the result. This function assumes that the IO APIC is set up
+// and initialized.
 void calibrate_timer(void);
 
-// "Sleep" for a fixed amount of time using the LAPIC timer.
+// "Sleep" for a fixed amount of time. Once the TSC frequency is known this
+// busy waits on the TSC clocksource, leaving the LAPIC timer to the timer
+// wheel, otherwise the LAPIC timer is used.
 // @param msec: The number of milliseconds before this function returns.
-// Note: During "sleep" the core is simply busy waiting for the timer to reach
-// 0.
+// Note: During "sleep" the core is simply busy waiting.
 void lapic_sleep(uint32_t const msec);
 
 // Broadcast an INIT IPI to all processors except the current one.
@@ -50,9 +66,18 @@ void lapic_send_broadcast_sipi(void const * const trampoline);
 // @param dest_cpu: The ID of the cpu to send the interrupt to.
 // @param vector: The vector to raise on the destination cpu. If this value is
 // IPI_BROADCAST, send a broadcast to all cpus except the current cpu.
-// Note: This function waits for the interrupt to be issued by the LAPIC before
-// returning.
+// Note: In xAPIC mode, this function waits for the interrupt to be issued by
+// the LAPIC before returning. In x2APIC mode, the IPI is sent with a single MSR
+// write.
 void lapic_send_ipi(uint8_t const dest_cpu, uint8_t const vector);
 
+// Send an Inter-Processor-Interrupt to a set of cpus using logical destination
+// mode. Targets are grouped by logical cluster, a single IPI is sent per
+// cluster containing at least one target.
+// @param mask: The targets. Can contain the current cpu.
+// @param vector: The vector to raise on the targets.
+void lapic_send_ipi_mask(struct cpumask const * const mask,
+                         uint8_t const vector);
+
 // Test LAPIC functionalities.
 void lapic_test(void);
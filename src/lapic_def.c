@@ -49,7 +49,8 @@ enum destination_mode_t {
     // The destination field is an APIC ID. That is only one processor will
     // receive the interrupt.
     PHYSICAL = 0,
-    // The destination field is a set of processors. Unsupported for now.
+    // The destination field is a set of processors, see "Logical destinations"
+    // in lapic.c.
     LOGICAL = 1,
 } __attribute__((packed));
 
@@ -117,11 +118,10 @@ struct icr {
             // destination field is ignored (since the IPI is either sent to
             // self or broadcasted).
             enum destination_shorthand_t destination_shorthand : 2;
-            uint64_t : 36;
-
-            // The destination of the IPI. Interpretation differs depending on
-            // delivery and destination mode and destination shorthand.
-            uint8_t destination : 8;
+            // The destination of the IPI lives in the upper bits, its
+            // position differs between xAPIC and x2APIC mode, hence it is
+            // passed separately to write_icr().
+            uint64_t : 44;
         } __attribute__((packed));
     } __attribute__((packed));
     uint8_t padding[24];
@@ -1,5 +1,7 @@
 #include <list.h>
 #include <types.h>
+#include <rcu.h>
+#include <debug.h>
 
 void list_init(struct list_node * const node) {
     node->prev = node;
@@ -29,6 +31,21 @@ void list_del(struct list_node * const node) {
     list_init(node);
 }
 
+void list_add_rcu(struct list_node * const head, struct list_node * const n) {
+    struct list_node * const next = head->next;
+    n->prev = head;
+    n->next = next;
+    // Readers only follow the next pointers, publishing the node in
+    // head->next must be the last write.
+    next->prev = n;
+    rcu_assign_pointer(head->next, n);
+}
+
+void list_del_rcu(struct list_node * const node) {
+    node->next->prev = node->prev;
+    rcu_assign_pointer(node->prev->next, node->next);
+}
+
 bool list_empty(struct list_node const * const head) {
     return head->next == head;
 }
@@ -41,4 +58,36 @@ uint32_t list_size(struct list_node const * const head) {
     }
     return size;
 }
+
+void counted_list_init(struct counted_list * const list) {
+    list_init(&list->head);
+    list->len = 0;
+}
+
+void counted_list_add(struct counted_list * const list,
+                      struct list_node * const n) {
+    list_add(&list->head, n);
+    list->len ++;
+}
+
+void counted_list_add_tail(struct counted_list * const list,
+                           struct list_node * const n) {
+    list_add_tail(&list->head, n);
+    list->len ++;
+}
+
+void counted_list_del(struct counted_list * const list,
+                      struct list_node * const node) {
+    ASSERT(list->len);
+    list_del(node);
+    list->len --;
+}
+
+bool counted_list_empty(struct counted_list const * const list) {
+    return !list->len;
+}
+
+uint32_t counted_list_size(struct counted_list const * const list) {
+    return list->len;
+}
 #include <list.test>
@@ -39,13 +39,79 @@ void list_add_tail(struct list_node * const head, struct list_node * const n);
 // Note: The node is re-initialized upon deletion.
 void list_del(struct list_node * const node);
 
+// Add an element to a list, after the head node, while readers might be
+// traversing the list concurrently with list_for_each_entry_rcu (see rcu.h).
+// The element is fully linked before being published to the readers. Writers
+// must still be serialized.
+// @param head: The node to add the element right after.
+// @param n: The element/node to add.
+void list_add_rcu(struct list_node * const head, struct list_node * const n);
+
+// Delete an element from a list while readers might be traversing the list
+// concurrently with list_for_each_entry_rcu. Unlike list_del(), the node is
+// NOT re-initialized: a reader currently on the node can still move on to the
+// rest of the list. The node can only be re-used or freed after a grace period,
+// e.g. with call_rcu().
+// @param node: The element to remove.
+void list_del_rcu(struct list_node * const node);
+
 // Test if a list is empty.
 // @param head: The list to test.
 // @return: true if the list pointed by head is empty, false otherwise.
 bool list_empty(struct list_node const * const head);
 
+// Compute the number of elements in a list.
+// @param head: The list.
+// @return: The number of elements in the list.
+// Note: This walks the entire list. Lists whose length is needed frequently
+// should use a struct counted_list instead.
 uint32_t list_size(struct list_node const * const head);
 
+// A list head maintaining the number of elements in the list, making its size
+// available in O(1). Elements are regular list_nodes, added and removed with the
+// counted_list_* functions below; the list can be traversed with the usual
+// iterators on its `head` member.
+struct counted_list {
+    // The head of the list.
+    struct list_node head;
+    // The number of elements in the list. Can be read without holding the lock
+    // of the list to get an estimate of its length.
+    uint32_t volatile len;
+};
+
+// Initialize an empty counted list.
+// @param list: The list to initialize.
+void counted_list_init(struct counted_list * const list);
+
+// Add an element at the head of a counted list.
+// @param list: The list.
+// @param n: The element/node to add.
+void counted_list_add(struct counted_list * const list,
+                      struct list_node * const n);
+
+// Add an element at the tail of a counted list.
+// @param list: The list.
+// @param n: The element/node to add.
+void counted_list_add_tail(struct counted_list * const list,
+                           struct list_node * const n);
+
+// Delete an element from a counted list.
+// @param list: The list containing the element.
+// @param node: The element to remove.
+// Note: The node is re-initialized upon deletion.
+void counted_list_del(struct counted_list * const list,
+                      struct list_node * const node);
+
+// Test if a counted list is empty.
+// @param list: The list to test.
+// @return: true if the list is empty, false otherwise.
+bool counted_list_empty(struct counted_list const * const list);
+
+// Get the number of elements in a counted list.
+// @param list: The list.
+// @return: The number of elements in the list.
+uint32_t counted_list_size(struct counted_list const * const list);
+
 // Iterate over a list.
 // @param cursor: The struct list_node * to use as an iterator.
 // @param head: The list to iterate over.
@@ -61,6 +127,19 @@ uint32_t list_size(struct list_node const * const head);
          &entry->member != (head);                                          \
          entry = list_entry(entry->member.next, typeof(*entry), member))
 
+// Iterate over the entries of a list in an RCU read-side critical section, or
+// with the lock of the list's writers held. The list can be modified
+// concurrently with list_add_rcu() and list_del_rcu().
+// @param entry: The type* to use as an iterator.
+// @param head: The list to iterate over.
+// @param member: The name of the list_node member in the entry to follow.
+#define list_for_each_entry_rcu(entry, head, member)                        \
+    for (entry = list_entry(rcu_dereference((head)->next), typeof(*entry),  \
+                            member);                                        \
+         &entry->member != (head);                                          \
+         entry = list_entry(rcu_dereference(entry->member.next),            \
+                            typeof(*entry), member))
+
 #define list_first(head) \
     ((head)->next)
 
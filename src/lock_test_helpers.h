@@ -9,6 +9,11 @@
 // actions. All actions in a step are run in parallel on different cpus (other
 // than the cpu running the test). Steps are executed one after the other, and
 // the framework makes sure that a step completed before executing the next.
+// A cpu blocked on a lock in a step might not be able to execute the actions of
+// the following steps until it acquires the lock, either because it is spinning
+// with interrupts disabled or because the actions are nested in its attempt.
+// Its pending actions are executed, late, once it acquires the lock. Hence
+// steps must not be deleted before the remote cpus are reset.
 
 // The possible actions of a cpu in a step.
 enum action {
@@ -16,6 +21,9 @@ enum action {
     NONE,
     // Acquire the lock (spinlock).
     SPINLOCK_LOCK,
+    // Acquire the lock (spinlock) with interrupts disabled. Contrary to
+    // SPINLOCK_LOCK, the cpu waits on a ticket, see spinlock.h.
+    SPINLOCK_LOCK_IRQ_DISABLED,
     // Release the lock (spinlock).
     SPINLOCK_UNLOCK,
     // Acquire the read lock on a RW lock.
@@ -35,10 +43,10 @@ struct step_action {
     void *lock;
     // The action to execute.
     enum action action;
-    // Before performing the action, the cpu will wait for this variable to
-    // become true. This is done so that all cpus in a given step starts their
-    // action relatively at the same time.
-    bool volatile *start_flag;
+    // Before performing the action, the cpu will wait for STEP_GENERATION to
+    // reach this value. This is done so that all cpus in a given step starts
+    // their action relatively at the same time.
+    uint32_t generation;
     // If the action is succesful, the cpu will write true to this field.
     bool volatile done;
 };
@@ -59,6 +67,11 @@ struct step {
     struct step_action actions[0];
 };
 
+// The generation of the last step started. This is a global rather than a flag
+// on the stack of run_step() because actions can be executed after their step
+// is over, see comment at the top of this file.
+static uint32_t volatile STEP_GENERATION = 0;
+
 // Create a step. This is not meant to be used directly, see create_step()
 // instead.
 // @param lock: The lock to use in the step.
@@ -146,7 +159,7 @@ static void delete_step(struct step * const step) {
 // Run a struct step_action. This function is meant to be used with
 // exec_remote_call to execute an action on a remote cpu.
 // @param arg: A pointer on a struct step_action.
-// The cpu will first wait on the start_flag of the step_action to become true
+// The cpu will first wait for the step of the step_action to start
 // then perform the action before writing true to the step_action's done field
 // (provided that this action should be successful).
 static void run_step_action_remote(void * const arg) {
@@ -154,9 +167,8 @@ static void run_step_action_remote(void * const arg) {
     ASSERT(!step_action->done);
 
     uint8_t const cpu = cpu_id();
-    bool volatile * const flag = step_action->start_flag;
-    LOG("[%u] Waiting on start flag %p\n", cpu, flag);
-    while (!*flag);
+    LOG("[%u] Waiting on start of step %u\n", cpu, step_action->generation);
+    while (STEP_GENERATION < step_action->generation);
 
     // Make sure that interrupts are enabled if this cpu tries to acquire the
     // lock.
@@ -169,6 +181,11 @@ static void run_step_action_remote(void * const arg) {
             spinlock_lock((spinlock_t*)step_action->lock);
             LOG("[%u] Acquired spinlock\n", cpu);
             break;
+        case SPINLOCK_LOCK_IRQ_DISABLED:
+            cpu_set_interrupt_flag(false);
+            spinlock_lock((spinlock_t*)step_action->lock);
+            LOG("[%u] Acquired spinlock with interrupts disabled\n", cpu);
+            break;
         case SPINLOCK_UNLOCK:
             spinlock_unlock((spinlock_t*)step_action->lock);
             LOG("[%u] Released spinlock\n", cpu);
@@ -201,11 +218,13 @@ static void run_step_action_remote(void * const arg) {
     cpu_set_interrupt_flag(true);
 }
 
-// Set the current cpu into an infinite loop with interrupts enabled. This is
-// meant to stop the remote cpus at the end of a step before continuing to the
-// next step.
-static void standby(void * const unused) {
-    while (true) {
+// Set the current cpu into a loop with interrupts enabled until the next step
+// starts. This is meant to stop the remote cpus at the end of a step before
+// continuing to the next step.
+// @param arg: The generation of the step that just ended.
+static void standby(void * const arg) {
+    uint32_t const generation = (uint32_t)arg;
+    while (STEP_GENERATION == generation) {
         cpu_set_interrupt_flag_and_halt();
     }
 }
@@ -216,12 +235,10 @@ static void standby(void * const unused) {
 // struct step_action.
 // @param step: The step to be executed.
 static void run_step(struct step * const step) {
-    // The flag that will be used to start all cpus "at the same time".
-    bool volatile start_flag = false;
-
-    // Set the pointer to the start flag in all actions.
+    // The generation that will be used to start all cpus "at the same time".
+    uint32_t const generation = STEP_GENERATION + 1;
     for (uint32_t i = 0; i < step->num_actions; ++i) {
-        step->actions[i].start_flag = &start_flag;
+        step->actions[i].generation = generation;
     }
 
     // Now get all cpus ready to execute their action.
@@ -234,7 +251,7 @@ static void run_step(struct step * const step) {
     lapic_sleep(100);
 
     // Give the signal to start.
-    start_flag = true;
+    STEP_GENERATION = generation;
 
     // Each cpu has 1/2 second to perform its task.
     lapic_sleep(500);
@@ -242,7 +259,7 @@ static void run_step(struct step * const step) {
     // Put the cpus in standby.
     for (uint32_t i = 0; i < step->num_actions; ++i) {
         uint8_t const cpu = TEST_TARGET_CPU(i);
-        exec_remote_call(cpu, standby, NULL, false);
+        exec_remote_call(cpu, standby, (void*)generation, false);
     }
 }
 
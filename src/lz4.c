@@ -0,0 +1,88 @@
+#include <lz4.h>
+#include <memory.h>
+
+// The minimum length of a match, matches lengths are encoded minus this value.
+#define LZ4_MIN_MATCH   4
+
+// Read an extended length: while the length so far saturates its field, the
+// following bytes are added to it, a byte < 255 ending the sequence.
+// @param ip[in/out]: The position in the input, updated past the length.
+// @param iend: The end of the input.
+// @param len[in/out]: The length so far, updated with the extension.
+// @return: true on success, false if the input ended prematurely.
+static bool read_ext_len(uint8_t const ** const ip,
+                         uint8_t const * const iend,
+                         size_t * const len) {
+    uint8_t byte;
+    do {
+        if (*ip == iend) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+size_t lz4_decompress(uint8_t const * const src,
+                      size_t const src_len,
+                      uint8_t * const dst,
+                      size_t const dst_len) {
+    uint8_t const * ip = src;
+    uint8_t const * const iend = src + src_len;
+    uint8_t * op = dst;
+    uint8_t * const oend = dst + dst_len;
+
+    while (ip < iend) {
+        uint8_t const token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_ext_len(&ip, iend, &lit_len)) {
+            return 0;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+            return 0;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend) {
+            // The last sequence has no match.
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        size_t const offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t)(op - dst)) {
+            return 0;
+        }
+
+        size_t match_len = token & 0xF;
+        if (match_len == 15 && !read_ext_len(&ip, iend, &match_len)) {
+            return 0;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) {
+            return 0;
+        }
+
+        uint8_t const * match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            // The match overlaps the output, e.g. a run of the same byte, it
+            // must be copied byte by byte.
+            for (size_t i = 0; i < match_len; ++i) {
+                *op++ = *match++;
+            }
+        }
+    }
+    return op - dst;
+}
+
+#include <lz4.test>
@@ -0,0 +1,25 @@
+#pragma once
+#include <types.h>
+
+// LZ4 block decompression.
+//    An LZ4 block is a sequence of (literals, match) pairs: each sequence
+// copies a run of literal bytes from the input followed by a copy of bytes
+// already produced, at a distance of up to 64KiB behind. The last sequence only
+// has literals. See
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md. Only the block
+// format is supported, not the frame format with its headers and checksums.
+
+// Decompress an LZ4 block.
+// @param src: The compressed block.
+// @param src_len: The length of the compressed block in bytes.
+// @param dst: The buffer receiving the decompressed data.
+// @param dst_len: The size of `dst` in bytes.
+// @return: The number of bytes written to `dst`, 0 if the block is malformed
+// or does not fit in `dst`.
+size_t lz4_decompress(uint8_t const * const src,
+                      size_t const src_len,
+                      uint8_t * const dst,
+                      size_t const dst_len);
+
+// Execute the tests of the LZ4 decompressor.
+void lz4_test(void);
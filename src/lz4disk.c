@@ -0,0 +1,154 @@
+#include <lz4disk.h>
+#include <lz4.h>
+#include <block_cache.h>
+#include <kmalloc.h>
+#include <memory.h>
+#include <math.h>
+#include <debug.h>
+#include <atomic.h>
+#include <error.h>
+
+// The private state of a compressed disk.
+struct lz4disk_data {
+    // The compressed image.
+    struct lz4disk_header const * header;
+    // The size of the image in bytes.
+    size_t image_size;
+    // The number of chunks decompressed so far.
+    atomic_t num_decompressed;
+};
+
+// Get the private data of a compressed disk.
+#define get_data(disk)  ((struct lz4disk_data*)(disk)->driver_private)
+
+// Get the sector size of a compressed disk, one sector per chunk.
+// @param disk: The disk.
+// @return: The size of a chunk.
+static uint32_t lz4disk_sector_size(struct disk * const disk) {
+    return get_data(disk)->header->chunk_size;
+}
+
+// Read a chunk of a compressed disk, decompressing it.
+// @param disk: The disk.
+// @param sector_index: The index of the chunk.
+// @param buf: The buffer to decompress into, of the size of a chunk.
+// @return: The size of a chunk on success, 0 if the chunk is out of the bounds
+// of the disk or is corrupted.
+static uint32_t lz4disk_read_sector(struct disk * const disk,
+                                    sector_t const sector_index,
+                                    uint8_t * const buf) {
+    struct lz4disk_data * const data = get_data(disk);
+    struct lz4disk_header const * const header = data->header;
+    if (sector_index >= header->num_chunks) {
+        return 0;
+    }
+    uint32_t const idx = sector_index;
+    uint32_t const chunk_size = header->chunk_size;
+    uint32_t const len = min_u32(chunk_size, header->size - idx * chunk_size);
+    uint8_t const * const src = (uint8_t const*)header + header->offsets[idx];
+    uint32_t const src_len = header->offsets[idx + 1] - header->offsets[idx];
+
+    if (src_len == len) {
+        // Stored uncompressed.
+        memcpy(buf, src, len);
+    } else if (lz4_decompress(src, src_len, buf, len) != len) {
+        WARN("Corrupted chunk %u in compressed disk\n", idx);
+        return 0;
+    }
+    if (len < chunk_size) {
+        memzero(buf + len, chunk_size - len);
+    }
+    atomic_inc(&data->num_decompressed);
+    return chunk_size;
+}
+
+// Compressed disks are read only.
+// @param disk: The disk.
+// @param sector_index: The index of the sector to write.
+// @param buf: The data to write.
+// @return: Always 0.
+static uint32_t lz4disk_write_sector(struct disk * const disk,
+                                     sector_t const sector_index,
+                                     uint8_t const * const buf) {
+    return 0;
+}
+
+// The available operations on a compressed disk.
+struct disk_ops const lz4disk_ops = {
+    .sector_size = lz4disk_sector_size,
+    .read_sector = lz4disk_read_sector,
+    .write_sector = lz4disk_write_sector,
+};
+
+bool lz4disk_detect(void const * const addr, size_t const size) {
+    struct lz4disk_header const * const header = addr;
+    return size >= sizeof(*header) && header->magic == LZ4DISK_MAGIC;
+}
+
+// Check that the header and chunk table of a compressed image are consistent,
+// so that reading chunks never accesses memory outside of the image.
+// @param header: The header of the image.
+// @param size: The size of the image in bytes.
+// @return: true if the image is valid, false otherwise.
+static bool check_image(struct lz4disk_header const * const header,
+                        size_t const size) {
+    if (!lz4disk_detect(header, size)) {
+        return false;
+    }
+    uint32_t const chunk_size = header->chunk_size;
+    if (chunk_size < 512 || chunk_size > 0x10000 ||
+        (chunk_size & (chunk_size - 1)) ||
+        header->num_chunks != ceil_x_over_y_u32(header->size, chunk_size)) {
+        return false;
+    }
+    size_t const table_end = sizeof(*header) +
+        (header->num_chunks + 1) * sizeof(header->offsets[0]);
+    if (header->num_chunks >= size / sizeof(header->offsets[0]) ||
+        table_end > size || header->offsets[0] < table_end) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->num_chunks; ++i) {
+        uint32_t const start = header->offsets[i];
+        uint32_t const end = header->offsets[i + 1];
+        if (end < start || end > size || end - start > chunk_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct disk *create_lz4disk(void const * const addr, size_t const size) {
+    if (!check_image(addr, size)) {
+        SET_ERROR("Malformed compressed disk image", ENONE);
+        return NULL;
+    }
+
+    struct disk * const disk = kmalloc(sizeof(*disk));
+    struct lz4disk_data * const data = kmalloc(sizeof(*data));
+    if (!disk || !data) {
+        SET_ERROR("Cannot allocate new compressed disk", ENONE);
+        kfree(disk);
+        kfree(data);
+        return NULL;
+    }
+    data->header = addr;
+    data->image_size = size;
+    atomic_init(&data->num_decompressed, 0);
+
+    disk->ops = &lz4disk_ops;
+    disk->driver_private = data;
+    disk->fs_private = NULL;
+    disk->cache_enabled = false;
+    blk_queue_init(&disk->queue);
+    // Keep the decompressed chunks in the block cache.
+    disk_enable_cache(disk);
+    return disk;
+}
+
+void delete_lz4disk(struct disk * const disk) {
+    disk_disable_cache(disk);
+    kfree(get_data(disk));
+    kfree(disk);
+}
+
+#include <lz4disk.test>
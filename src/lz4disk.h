@@ -0,0 +1,59 @@
+#pragma once
+#include <disk.h>
+#include <types.h>
+
+// LZ4 compressed disks
+// ====================
+//    A read-only disk backed by a compressed image in memory, used for
+// compressed initrds. The content of the disk is split in chunks of
+// `chunk_size` bytes which are compressed independently with LZ4 (see lz4.h),
+// hence any chunk can be decompressed without touching the others. The image
+// starts with a struct lz4disk_header followed by a table of num_chunks + 1
+// offsets: chunk i is stored in the image between offsets[i] and
+// offsets[i + 1]. A chunk whose stored length equals its decompressed length
+// is stored uncompressed, for data that does not compress.
+//    Each chunk is exposed as a sector of the disk and the disk uses the block
+// cache, hence a chunk is decompressed the first time it is read, straight into
+// the block cache, and stays there until it is evicted. Only the chunks that
+// are actually accessed are ever decompressed.
+
+// Spells "LZ4D" in the image.
+#define LZ4DISK_MAGIC   0x44345A4C
+
+// The header of a compressed image.
+struct lz4disk_header {
+    // Must be LZ4DISK_MAGIC.
+    uint32_t magic;
+    // The size of a decompressed chunk, a power of two between 512 and 64KiB.
+    uint32_t chunk_size;
+    // The size of the decompressed content in bytes. The last chunk is padded
+    // with zeros up to chunk_size.
+    uint32_t size;
+    // The number of chunks, ceil(size / chunk_size).
+    uint32_t num_chunks;
+    // The offsets of the chunks within the image, followed by the end offset
+    // of the last chunk.
+    uint32_t offsets[];
+} __attribute__((packed));
+
+// Check if a memory region contains a compressed image.
+// @param addr: The start of the region.
+// @param size: The size of the region in bytes.
+// @return: true if the region starts with the magic of a compressed image.
+bool lz4disk_detect(void const * const addr, size_t const size);
+
+// Create a disk from a compressed image.
+// @param addr: The address of the image. It must remain mapped as long as the
+// disk exists.
+// @param size: The size of the image in bytes.
+// @return: On success, the struct disk* associated to the new disk, otherwise
+// NULL if the image is malformed or memory could not be allocated.
+struct disk *create_lz4disk(void const * const addr, size_t const size);
+
+// Delete a disk created by create_lz4disk(), dropping its chunks from the block
+// cache.
+// @param disk: The disk. This function de-allocates the struct disk*.
+void delete_lz4disk(struct disk * const disk);
+
+// Execute the tests of LZ4 compressed disks.
+void lz4disk_test(void);
@@ -13,53 +13,109 @@
 #include <segmentation.h>
 #include <interrupt.h>
 #include <lapic.h>
+#include <timer.h>
+#include <workqueue.h>
+#include <parallel.h>
+#include <mwait.h>
+#include <topology.h>
+#include <rcu.h>
 #include <bitmap.h>
 #include <frame_alloc.h>
 #include <paging.h>
 #include <kernel_map.h>
 #include <multiboot.h>
 #include <list.h>
+#include <avl.h>
 #include <kmalloc.h>
+#include <kmalloc_sample.h>
+#include <kmem_cache.h>
+#include <memstat.h>
 #include <acpi.h>
 #include <ioapic.h>
 #include <smp.h>
 #include <percpu.h>
 #include <ipm.h>
+#include <cpumask.h>
 #include <atomic.h>
 #include <addr_space.h>
 #include <proc.h>
 #include <sched.h>
 #include <syscalls.h>
+#include <pipe.h>
 #include <disk.h>
+#include <block_cache.h>
+#include <blk_queue.h>
+#include <pci.h>
+#include <ata.h>
+#include <page_cache.h>
 #include <initrd.h>
 #include <fs.h>
 #include <memdisk.h>
+#include <lz4.h>
+#include <lz4disk.h>
 #include <ustar.h>
+#include <extentfs.h>
 #include <vfs.h>
 #include <elf.h>
 #include <rw_lock.h>
+#include <seqlock.h>
+#include <wait_queue.h>
+#include <mutex.h>
 #include <error.h>
 #include <spinlock.h>
+#include <fpu.h>
+#include <uaccess.h>
+#include <tracelog.h>
+#include <clock.h>
+#include <profiler.h>
+#include <bench.h>
+
+// The test suites that only exercise the current cpu, never block and do not
+// depend on any global state. Those can run concurrently, see
+// test_run_parallel().
+static struct parallel_suite const INDEPENDENT_SUITES[] = {
+    PARALLEL_SUITE(mem_test),
+    PARALLEL_SUITE(str_test),
+    PARALLEL_SUITE(math_test),
+    PARALLEL_SUITE(bitmap_test),
+    PARALLEL_SUITE(list_test),
+    PARALLEL_SUITE(avl_test),
+    PARALLEL_SUITE(cpumask_test),
+    PARALLEL_SUITE(lz4_test),
+    PARALLEL_SUITE(lz4disk_test),
+};
 
 // Execute all the tests in the kernel.
 void test_kernel(void) {
     LOG("Running tests:\n");
+    uint32_t const num_independent =
+        sizeof(INDEPENDENT_SUITES) / sizeof(*INDEPENDENT_SUITES);
+#ifdef PARALLEL_TESTS
+    test_run_parallel(INDEPENDENT_SUITES, num_independent);
+#else
+    for (uint32_t i = 0; i < num_independent; ++i) {
+        INDEPENDENT_SUITES[i].func();
+    }
+#endif
+    // Uses the OOM simulation of kmalloc.
+    error_test();
     vga_test();
-    mem_test();
-    str_test();
-    math_test();
     tty_test();
+    tracelog_test();
+    profiler_test();
+    bench_test();
     cpu_test();
     serial_test();
     segmentation_test();
     interrupt_test();
     lapic_test();
-    bitmap_test();
     frame_alloc_test();
     paging_test();
     multiboot_test();
-    list_test();
     kmalloc_test();
+    kmalloc_sample_test();
+    kmem_cache_test();
+    memstat_test();
     ioapic_test();
     smp_test();
     percpu_test();
@@ -67,15 +123,35 @@ void test_kernel(void) {
     atomic_test();
     addr_space_test();
     proc_test();
+    fpu_test();
     sched_test();
+    ws_test();
+    fair_test();
+    clock_test();
+    uaccess_test();
     syscall_test();
+    pipe_test();
     disk_test();
+    blk_queue_test();
+    pci_test();
+    ata_test();
+    block_cache_test();
     memdisk_test();
     ustar_test();
+    page_cache_test();
     vfs_test();
+    extentfs_test();
     elf_test();
     rwlock_test();
-    error_test();
+    seqlock_test();
+    wait_queue_test();
+    mutex_test();
+    timer_test();
+    workqueue_test();
+    parallel_test();
+    mwait_test();
+    topology_test();
+    rcu_test();
     spinlock_test();
 
     print_test_summary();
@@ -103,6 +179,32 @@ void kernel_main(void) {
     // now proceed to allocate percpu areas for the Application Processor(s).
     allocate_aps_percpu_areas();
 
+    // From now on, logging goes through the per-cpu log rings.
+    tty_init_log_rings();
+
+    // TRACELOG() records are dropped until the trace rings are allocated.
+    tracelog_init();
+#ifdef TRACING
+    tracepoint_enable_all(true);
+#endif
+
+    // The profiler cannot be started until its sample buffers are allocated.
+    profiler_init();
+#ifdef PROFILING
+    profiler_start();
+#endif
+
+    // Now that all the percpu areas exist, the frame allocator can start using
+    // per-cpu frame caches.
+    init_frame_alloc_percpu_caches();
+
+    // The allocation sampler keeps a per-cpu countdown.
+    kmalloc_sample_init();
+
+    // Dynamic memory allocation is available, allocate the descriptors of the
+    // physical frames.
+    init_mem_map();
+
     // Allocate the final GDT (containing all percpu + tss segments and user
     // segments) and switch to it.
     init_final_gdt();
@@ -110,13 +212,35 @@ void kernel_main(void) {
     // Setup the BSP's TSS.
     setup_tss();
 
+    // Enable the FPU and SSE, their state is switched lazily.
+    init_fpu();
+
+    // The SYSENTER entry point relies on the TSS, see syscalls.h.
+    init_sysenter();
+
+    // The APs assume the same MONITOR/MWAIT support as the BSP.
+    init_mwait();
+
+    // The topology of all the cpus is derived from their APIC IDs and the
+    // CPUID leaves of the BSP.
+    init_topology();
+
     // Initialize LAPIC and IOAPIC.
     init_lapic();
     init_ioapic();
 
+#ifdef SERIAL
+    // Serial output can now be drained by the UART's interrupt.
+    serial_enable_tx_interrupt();
+#endif
+
     // Calibrate the lapic timer frequency.
     calibrate_timer();
 
+    // The timer wheel programs the LAPIC timer from the calibrated frequency
+    // and reads the TSC clocksource.
+    init_timers();
+
     // Disable the BSP bit on the current cpu. The reason is that this bit
     // inhibit any INIT IPI on the BSP which makes it impossible to execute
     // init_aps test from APs.
@@ -126,13 +250,65 @@ void kernel_main(void) {
     // it ASAP.
     init_ipm();
 
+    // The pools of work items exist from now on, work queued before the
+    // workers are started is executed once they run.
+    init_workqueues();
+
+    // Grace periods are polled by a timer and lagging cpus are kicked through
+    // IPMs.
+    init_rcu();
+
     // Wake up Application Processors.
     init_aps();
 
+    // Pre-zero frames on all the cpus now that they are online.
+    frame_alloc_fill_zeroed_pool();
+
+    // Detect the ATA disks. Their DMA completions are signaled by interrupts,
+    // which are balanced below with the other device interrupts.
+    init_ata();
+
+#ifdef IRQ_BALANCE
+    // Spread the device interrupts across all the cpus now that they are
+    // online.
+    ioapic_balance_irqs();
+#endif
+
     // Initialize the Virtual File System. This must be done before running the
     // tests.
+    init_block_cache();
     init_vfs();
 
+#ifdef BENCH
+    // Run the benchmarks instead of the tests, see `make bench`.
+    bench_kernel();
+    bench_exit();
+#else
     // Run tests.
     test_kernel();
+#endif
+
+    // Report the memory still in use after the tests, e.g. to spot leaks.
+    memstat_dump();
+
+#ifdef TRACING
+    // Output the events recorded by the tracepoints over the test run.
+    tracepoint_enable_all(false);
+    tracelog_dump();
+#endif
+
+#ifdef PROFILING
+    // Output the histograms of the samples taken over the test run and the
+    // interrupt load of each cpu.
+    profiler_stop();
+    profiler_dump();
+    interrupt_dump_stats();
+    // The sampled allocations still alive after the tests.
+    kmalloc_sample_dump(20);
+#endif
+
+#ifdef LOCK_PROFILING
+    // Report the most contended locks over the test run.
+    spinlock_dump_profile(10);
+#endif
 }
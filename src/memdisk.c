@@ -31,17 +31,19 @@ static uint32_t memdisk_sector_size(struct disk * const disk) {
     return MEMDISK_SEC_SIZE;
 }
 
-// Read or write a sector from/to a memdisk.
+// Read or write consecutive sectors from/to a memdisk.
 // @param disk: The disk.
-// @param sector_index: The index of the sector to be read.
-// @param buf: The buffer to read the sector into. The buffer must be of size >=
-// the sector size used by the memdisk.
-// @param is_read: If true then this function will read the sector into buf, if
-// false, the content of buf will be written into the sector.
-// @return: The number of bytes successfully read/written, this is either 0 or
-// sector size.
+// @param start: The index of the first sector to be read/written.
+// @param count: The number of sectors.
+// @param buf: The buffer to read the sectors into or containing the data to
+// write. The buffer must be of size >= count * the sector size.
+// @param is_read: If true then this function will read the sectors into buf,
+// if false, the content of buf will be written into the sectors.
+// @return: The number of bytes successfully read/written, this is a multiple of
+// the sector size.
 static uint32_t do_update(struct disk * const disk,
-                          sector_t const sector_index,
+                          sector_t const start,
+                          uint32_t const count,
                           uint8_t * const buf,
                           bool const is_read) {
     struct memdisk_data const * const data = get_data(disk);
@@ -58,19 +60,20 @@ static uint32_t do_update(struct disk * const disk,
     // The sector after the last valid one.
     sector_t const end_sector = ceil_x_over_y_u32(size, sector_size);
 
-    if (sector_index >= end_sector) {
+    if (start >= end_sector) {
         // Reached the end of the memdisk.
         return 0;
     }
 
-    uint32_t const offset = sector_index * sector_size;
-    size_t const len = min_u32(sector_size, size - offset);
+    uint32_t const num_sectors = min_u32(count, end_sector - start);
+    uint32_t const offset = start * sector_size;
+    size_t const len = min_u32(num_sectors * sector_size, size - offset);
 
-    if (len < sector_size && is_read) {
+    if (len < num_sectors * sector_size && is_read) {
         // Since the memdisk has a size with a byte granularity, we might have
         // less than one sector of data left to read. If that is the case, pad
         // with zeros.
-        memzero(buf, sector_size);
+        memzero(buf + len, num_sectors * sector_size - len);
     }
 
     if (is_read) {
@@ -78,7 +81,7 @@ static uint32_t do_update(struct disk * const disk,
     } else {
         memcpy(data->mapped_addr + offset, buf, len);
     }
-    return sector_size;
+    return num_sectors * sector_size;
 }
 
 // Read a sector from a memdisk.
@@ -91,7 +94,7 @@ static uint32_t do_update(struct disk * const disk,
 static uint32_t memdisk_read_sector(struct disk * const disk,
                                     sector_t const sector_index,
                                     uint8_t * const buf) {
-    return do_update(disk, sector_index, buf, true);
+    return do_update(disk, sector_index, 1, buf, true);
 }
 
 // Write a sector to the memdisk.
@@ -104,7 +107,48 @@ static uint32_t memdisk_read_sector(struct disk * const disk,
 static uint32_t memdisk_write_sector(struct disk * const disk,
                                      sector_t const sector_index,
                                      uint8_t const * const buf) {
-    return do_update(disk, sector_index, (uint8_t*)buf, false);
+    return do_update(disk, sector_index, 1, (uint8_t*)buf, false);
+}
+
+// Read consecutive sectors from a memdisk.
+// @param disk: The disk.
+// @param start: The index of the first sector to be read.
+// @param count: The number of sectors to read.
+// @param buf: The buffer to read the sectors into.
+// @return: The number of bytes successfully read.
+static uint32_t memdisk_read_sectors(struct disk * const disk,
+                                     sector_t const start,
+                                     uint32_t const count,
+                                     uint8_t * const buf) {
+    return do_update(disk, start, count, buf, true);
+}
+
+// Write consecutive sectors to a memdisk.
+// @param disk: The disk.
+// @param start: The index of the first sector to be written.
+// @param count: The number of sectors to write.
+// @param buf: The data to write.
+// @return: The number of bytes successfully written.
+static uint32_t memdisk_write_sectors(struct disk * const disk,
+                                      sector_t const start,
+                                      uint32_t const count,
+                                      uint8_t const * const buf) {
+    return do_update(disk, start, count, (uint8_t*)buf, false);
+}
+
+// Get the address of a sector of a memdisk in memory.
+// @param disk: The disk.
+// @param sector_index: The index of the sector.
+// @return: The address of the sector, NULL if out of bounds.
+static void *memdisk_get_sector_ptr(struct disk * const disk,
+                                    sector_t const sector_index) {
+    struct memdisk_data const * const data = get_data(disk);
+    ASSERT(data);
+    // The size of a memdisk is a multiple of the sector size.
+    if (sector_index >= data->size / MEMDISK_SEC_SIZE) {
+        return NULL;
+    }
+    return data->mapped_addr + sector_index * MEMDISK_SEC_SIZE;
 }
 
 // The available operations on a memdisk.
@@ -112,6 +156,9 @@ struct disk_ops const memdisk_ops = {
     .sector_size = memdisk_sector_size,
     .read_sector = memdisk_read_sector,
     .write_sector = memdisk_write_sector,
+    .read_sectors = memdisk_read_sectors,
+    .write_sectors = memdisk_write_sectors,
+    .get_sector_ptr = memdisk_get_sector_ptr,
 };
 
 struct disk *create_memdisk(void * const addr,
@@ -130,6 +177,9 @@ struct disk *create_memdisk(void * const addr,
     }
 
     disk->ops = &memdisk_ops;
+    disk->cache_enabled = false;
+    disk->fs_private = NULL;
+    blk_queue_init(&disk->queue);
 
     // Allocate a memdisk_data for this new disk containing its state.
     struct memdisk_data * const data = kmalloc(sizeof(*data));
@@ -151,6 +201,8 @@ struct disk *create_memdisk(void * const addr,
 void delete_memdisk(struct disk * const disk) {
     struct memdisk_data * const data = get_data(disk);
     ASSERT(data);
+    // The block cache must not keep references to the disk.
+    ASSERT(!disk->cache_enabled);
     kfree(data);
     kfree(disk);
 }
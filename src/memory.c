@@ -2,18 +2,148 @@
 #include <kmalloc.h>
 #include <debug.h>
 #include <kernel_map.h>
+#include <paging.h>
+#include <math.h>
+#include <cpu.h>
+#include <fpu.h>
+
+// Copies and fills of at least this many bytes use REP MOVSD/STOSD. Below,
+// the cost of starting the string instruction outweighs its gains.
+#define REP_THRESHOLD   64
+// Copies and fills of at least this many bytes use the SSE registers, if
+// available. Below, disabling interrupts and saving the FPU state costs more
+// than the wider accesses save.
+#define SSE2_THRESHOLD  2048
+
+// Copy double words using REP MOVSD.
+// @param to: The destination.
+// @param from: The source.
+// @param n: The number of double words to copy.
+void memcpy_dwords(void * const to, void const * const from, size_t const n);
+
+// Fill double words using REP STOSD.
+// @param to: The destination.
+// @param val: The value to write in each double word.
+// @param n: The number of double words to write.
+void memset_dwords(void * const to, uint32_t const val, size_t const n);
+
+// Copy 64 bytes blocks using the SSE registers, which must be usable, see
+// fpu_kernel_begin().
+// @param to: The destination, 16 bytes aligned.
+// @param from: The source.
+// @param n: The number of blocks to copy.
+void memcpy_sse2_blocks(void * const to, void const * const from, size_t const n);
+
+// Fill 64 bytes blocks using the SSE registers, which must be usable, see
+// fpu_kernel_begin().
+// @param to: The destination, 16 bytes aligned.
+// @param val: The value to write in each double word.
+// @param n: The number of blocks to write.
+void memset_sse2_blocks(void * const to, uint32_t const val, size_t const n);
+
+// Copy a 4KiB page using MOVNTI non-temporal stores followed by an SFENCE.
+// @param to: The destination page.
+// @param from: The source page.
+void copy_page_nt(void * const to, void const * const from);
+
+// Zero a 4KiB page using MOVNTI non-temporal stores followed by an SFENCE.
+// @param to: The page to zero.
+void clear_page_nt(void * const to);
+
+// Compute the number of bytes between an address and the next address aligned
+// on a power of two.
+// @param addr: The address.
+// @param align: The alignment, must be a power of two.
+// @return: The number of bytes to skip from `addr` to be aligned.
+static size_t bytes_to_align(void const * const addr, uint32_t const align) {
+    return (-(uint32_t)addr) & (align - 1);
+}
 
 void memcpy(void * const to, void const * const from, size_t const len) {
-    uint8_t * const __to = (uint8_t*)to;
-    uint8_t const * const __from = (uint8_t*)from;
-    for (size_t i = 0; i < len; ++i) {
+    uint8_t * __to = (uint8_t*)to;
+    uint8_t const * __from = (uint8_t*)from;
+    size_t left = len;
+
+    if (left >= REP_THRESHOLD) {
+        // Both the SSE2 and REP MOVSD paths are the fastest with an aligned
+        // destination, unaligned loads are cheaper than unaligned stores.
+        size_t const align = (left >= SSE2_THRESHOLD) ? 16 : 4;
+        size_t const head = bytes_to_align(__to, align);
+        for (size_t i = 0; i < head; ++i) {
+            __to[i] = __from[i];
+        }
+        __to += head;
+        __from += head;
+        left -= head;
+
+        if (left >= SSE2_THRESHOLD && fpu_kernel_begin()) {
+            size_t const nblocks = left / 64;
+            memcpy_sse2_blocks(__to, __from, nblocks);
+            fpu_kernel_end();
+            __to += nblocks * 64;
+            __from += nblocks * 64;
+            left -= nblocks * 64;
+        }
+
+        size_t const ndwords = left / 4;
+        memcpy_dwords(__to, __from, ndwords);
+        __to += ndwords * 4;
+        __from += ndwords * 4;
+        left -= ndwords * 4;
+    } else if (!(((uint32_t)__to | (uint32_t)__from) & 3)) {
+        uint32_t * const to32 = (uint32_t*)__to;
+        uint32_t const * const from32 = (uint32_t const*)__from;
+        size_t const ndwords = left / 4;
+        for (size_t i = 0; i < ndwords; ++i) {
+            to32[i] = from32[i];
+        }
+        __to += ndwords * 4;
+        __from += ndwords * 4;
+        left -= ndwords * 4;
+    }
+
+    for (size_t i = 0; i < left; ++i) {
         __to[i] = __from[i];
     }
 }
 
 void memset(void * const to, uint8_t const byte, size_t const len) {
-    uint8_t * const __to = (uint8_t*)to;
-    for (size_t i = 0; i < len; ++i) {
+    uint8_t * __to = (uint8_t*)to;
+    size_t left = len;
+    uint32_t const val = byte * 0x01010101U;
+
+    if (left >= REP_THRESHOLD) {
+        size_t const align = (left >= SSE2_THRESHOLD) ? 16 : 4;
+        size_t const head = bytes_to_align(__to, align);
+        for (size_t i = 0; i < head; ++i) {
+            __to[i] = byte;
+        }
+        __to += head;
+        left -= head;
+
+        if (left >= SSE2_THRESHOLD && fpu_kernel_begin()) {
+            size_t const nblocks = left / 64;
+            memset_sse2_blocks(__to, val, nblocks);
+            fpu_kernel_end();
+            __to += nblocks * 64;
+            left -= nblocks * 64;
+        }
+
+        size_t const ndwords = left / 4;
+        memset_dwords(__to, val, ndwords);
+        __to += ndwords * 4;
+        left -= ndwords * 4;
+    } else if (!((uint32_t)__to & 3)) {
+        uint32_t * const to32 = (uint32_t*)__to;
+        size_t const ndwords = left / 4;
+        for (size_t i = 0; i < ndwords; ++i) {
+            to32[i] = val;
+        }
+        __to += ndwords * 4;
+        left -= ndwords * 4;
+    }
+
+    for (size_t i = 0; i < left; ++i) {
         __to[i] = byte;
     }
 }
@@ -25,16 +155,77 @@ void memzero(void * const to, size_t const len) {
 bool memeq(void const * const s1, void const * const s2, size_t const size) {
     uint8_t const * __s1 = (uint8_t const *)s1;
     uint8_t const * __s2 = (uint8_t const *)s2;
-    for (size_t i = 0; i < size; ++i) {
-        if (*__s1 != *__s2) {
+    size_t left = size;
+
+    // Compare double words when both areas can be aligned at the same time.
+    if (left >= 8 && !(((uint32_t)__s1 ^ (uint32_t)__s2) & 3)) {
+        size_t const head = bytes_to_align(__s1, 4);
+        for (size_t i = 0; i < head; ++i) {
+            if (__s1[i] != __s2[i]) {
+                return false;
+            }
+        }
+        __s1 += head;
+        __s2 += head;
+        left -= head;
+
+        uint32_t const * const w1 = (uint32_t const*)__s1;
+        uint32_t const * const w2 = (uint32_t const*)__s2;
+        size_t const ndwords = left / 4;
+        for (size_t i = 0; i < ndwords; ++i) {
+            if (w1[i] != w2[i]) {
+                return false;
+            }
+        }
+        __s1 += ndwords * 4;
+        __s2 += ndwords * 4;
+        left -= ndwords * 4;
+    }
+
+    for (size_t i = 0; i < left; ++i) {
+        if (__s1[i] != __s2[i]) {
             return false;
         }
-        __s1 ++;
-        __s2 ++;
     }
     return true;
 }
 
+// Check if the cpu supports the MOVNTI instruction, which is part of SSE2.
+// Since MOVNTI only uses general purpose registers, no FPU state needs to be
+// saved to use it.
+// @return: true if MOVNTI can be used, false otherwise.
+static bool cpu_has_movnti(void) {
+    // 0 = unknown, 1 = supported, -1 = not supported. Concurrent callers
+    // compute the same value.
+    static int8_t has_movnti = 0;
+    if (!has_movnti) {
+        uint32_t edx = 0;
+        if (has_cpuid()) {
+            cpuid(1, NULL, NULL, NULL, &edx);
+        }
+        has_movnti = (edx & (1 << 26)) ? 1 : -1;
+    }
+    return has_movnti > 0;
+}
+
+void copy_page(void * const to, void const * const from) {
+    ASSERT(is_4kib_aligned(to) && is_4kib_aligned(from));
+    if (cpu_has_movnti()) {
+        copy_page_nt(to, from);
+    } else {
+        memcpy(to, from, PAGE_SIZE);
+    }
+}
+
+void clear_page(void * const to) {
+    ASSERT(is_4kib_aligned(to));
+    if (cpu_has_movnti()) {
+        clear_page_nt(to);
+    } else {
+        memzero(to, PAGE_SIZE);
+    }
+}
+
 void *memdup(void const * const buf, size_t const len) {
     void * const dup_buf = kmalloc(len);
     if (dup_buf) {
@@ -45,15 +236,12 @@ void *memdup(void const * const buf, size_t const len) {
 
 // Compute the address in the current address space and mode (PM flat, PM higher
 // half, paging) resolving to a physical address.
-// @param paddr: The target physical address.
+// @param paddr: The target physical address. When paging is enabled this
+// address must be covered by the direct map.
 // @return: An address that resolve to `paddr`.
 static void *get_adjusted_addr(void * const paddr) {
     if (cpu_paging_enabled()) {
-        // TODO: For now only allow addresses under the physical address where
-        // the kernel has been mapped, this is because those addresses are
-        // mapped to higher half. For any other addresses we would need to map
-        // them first.
-        ASSERT(paddr < to_phys(KERNEL_END_ADDR));
+        ASSERT(paging_in_direct_map(paddr, 1));
         return to_virt(paddr);
     } else {
         // Check if we are using the boot GDT (that is higher half mapping) or
@@ -73,14 +261,67 @@ static void *get_adjusted_addr(void * const paddr) {
     return NULL;
 }
 
+// Check if a physical range can be accessed through get_adjusted_addr().
+// @param paddr: The start of the range.
+// @param size: The size of the range in bytes.
+// @return: true if the entire range is accessible without a kmap slot.
+static bool is_directly_accessible(void const * const paddr,
+                                   size_t const size) {
+    return !cpu_paging_enabled() || paging_in_direct_map(paddr, size);
+}
+
+// Copy between physical memory and a buffer, one page at a time, using the
+// KMAP_COPY slot of the current cpu.
+// @param paddr: The physical address to access.
+// @param buf: The buffer to copy from/to.
+// @param size: The number of bytes to copy.
+// @param write: If true copy from `buf` to `paddr`, otherwise copy from `paddr`
+// to `buf`.
+static void kmap_copy(void const * const paddr,
+                      void * const buf,
+                      size_t const size,
+                      bool const write) {
+    uint32_t addr = (uint32_t)paddr;
+    uint8_t * ptr = buf;
+    size_t left = size;
+    while (left) {
+        uint32_t const offset = addr & (PAGE_SIZE - 1);
+        size_t const len = min_u32(left, PAGE_SIZE - offset);
+
+        // The slot must not be re-used by another path on this cpu while the
+        // copy is in progress.
+        bool const irqs = interrupts_enabled();
+        cpu_set_interrupt_flag(false);
+        uint8_t * const page = paging_kmap(KMAP_COPY, (void*)(addr - offset));
+        if (write) {
+            memcpy(page + offset, ptr, len);
+        } else {
+            memcpy(ptr, page + offset, len);
+        }
+        cpu_set_interrupt_flag(irqs);
+
+        addr += len;
+        ptr += len;
+        left -= len;
+    }
+}
+
 void phy_read(void const * const addr, void * const dest, size_t const size) {
-    void const * const adj = get_adjusted_addr((void*)addr);
-    memcpy(dest, adj, size);
+    if (is_directly_accessible(addr, size)) {
+        void const * const adj = get_adjusted_addr((void*)addr);
+        memcpy(dest, adj, size);
+    } else {
+        kmap_copy(addr, dest, size, false);
+    }
 }
 
 void phy_write(void * const addr, void const * const buf, size_t const size) {
-    void * const adj = get_adjusted_addr(addr);
-    memcpy(adj, buf, size);
+    if (is_directly_accessible(addr, size)) {
+        void * const adj = get_adjusted_addr(addr);
+        memcpy(adj, buf, size);
+    } else {
+        kmap_copy(addr, (void*)buf, size, true);
+    }
 }
 
 // Testing.
@@ -6,7 +6,8 @@
 // @param to: The destination of the copy.
 // @param fomr: The source of the copy.
 // @param len: The number of bytes to copy from `from` to `to`.
-// Note: The copy is performed on a byte basis.
+// Note: Small copies use 32-bit accesses when both buffers are aligned, larger
+// ones use REP MOVSD and, for the largest ones, the SSE registers.
 void memcpy(void * const to, void const * const from, size_t const len);
 
 // Fill a memory region with a certain value.
@@ -29,6 +30,19 @@ void memzero(void * const to, size_t const len);
 // false otherwise.
 bool memeq(void const * const s1, void const * const s2, size_t const size);
 
+// Copy a 4KiB page. Unlike memcpy(), the destination is written with
+// non-temporal stores which bypass the cache, this should be preferred when
+// the content of the destination is not going to be read soon, e.g. when
+// copying a frame for a copy-on-write fault. The stores are globally visible
+// when this function returns.
+// @param to: The destination page. Must be 4KiB aligned.
+// @param from: The source page. Must be 4KiB aligned.
+void copy_page(void * const to, void const * const from);
+
+// Fill a 4KiB page with NULL bytes using non-temporal stores, see copy_page().
+// @param to: The page to zero. Must be 4KiB aligned.
+void clear_page(void * const to);
+
 // Duplicate a memory buffer into the heap.
 // @param buf: The buffer to be duplicated.
 // @param len: The length of the buffer in bytes.
@@ -0,0 +1,60 @@
+#include <memstat.h>
+#include <atomic.h>
+#include <frame_alloc.h>
+#include <kmalloc.h>
+#include <kmalloc_stats.h>
+#include <kmem_cache.h>
+#include <paging.h>
+#include <debug.h>
+
+// The number of bytes in use by each class. Those are updated from any context,
+// including with interrupts disabled, hence the atomics rather than a lock.
+static atomic_t CLASS_BYTES[MEMSTAT_NUM_CLASSES];
+
+// The names of the classes, for memstat_dump().
+static char const * const CLASS_NAMES[MEMSTAT_NUM_CLASSES] = {
+    [MEMSTAT_PAGE_TABLES]   = "page tables",
+    [MEMSTAT_KERNEL_STACKS] = "kernel stacks",
+    [MEMSTAT_PAGE_CACHE]    = "page cache",
+    [MEMSTAT_BLOCK_CACHE]   = "block cache",
+    [MEMSTAT_IPM]           = "ipm",
+};
+
+void memstat_add(enum memstat_class const class, int32_t const bytes) {
+    ASSERT(class < MEMSTAT_NUM_CLASSES);
+    atomic_add(CLASS_BYTES + class, bytes);
+}
+
+uint32_t memstat_class_bytes(enum memstat_class const class) {
+    ASSERT(class < MEMSTAT_NUM_CLASSES);
+    return (uint32_t)atomic_read(CLASS_BYTES + class);
+}
+
+void memstat_get(struct memstat * const stats) {
+    struct kmalloc_stats heap;
+    kmalloc_get_stats(&heap);
+    stats->frames_allocated = frames_allocated();
+    stats->kmalloc_pages = heap.pages;
+    stats->kmalloc_allocated = heap.allocated;
+    stats->kmem_cache_allocated = kmem_cache_total_allocated();
+    for (uint32_t i = 0; i < MEMSTAT_NUM_CLASSES; ++i) {
+        stats->classes[i] = memstat_class_bytes(i);
+    }
+}
+
+void memstat_dump(void) {
+    struct memstat stats;
+    memstat_get(&stats);
+    LOG("memstat: %u frames allocated (%u KiB)\n", stats.frames_allocated,
+        stats.frames_allocated * (PAGE_SIZE / 1024));
+    LOG("memstat: kmalloc: %u pages, %u bytes allocated\n", stats.kmalloc_pages,
+        stats.kmalloc_allocated);
+    LOG("memstat: kmem_cache: %u bytes allocated\n",
+        stats.kmem_cache_allocated);
+    for (uint32_t i = 0; i < MEMSTAT_NUM_CLASSES; ++i) {
+        LOG("memstat: %s: %u bytes\n", CLASS_NAMES[i], stats.classes[i]);
+    }
+    kmem_cache_log_stats();
+}
+
+#include <memstat.test>
@@ -0,0 +1,88 @@
+#pragma once
+#include <types.h>
+
+// Memory accounting
+// =================
+//    frames_allocated() and kmalloc_total_allocated() only tell how much memory
+// is in use, not who is using it. Each subsystem owning a significant amount of
+// memory accounts for it in one of the classes below with memstat_add() when
+// it allocates and frees, the counters are always up to date and cost a single
+// atomic add per update, hence they are available in all builds, not only with
+// KMALLOC_DEBUG.
+//    memstat_get() takes a snapshot of the classes along with the global
+// counters of the frame allocator and the heap, memstat_dump() logs it. The
+// memory used by a process is reported by proc_get_mem_stats(), the mem_stats()
+// syscall returns both to user space.
+
+// The classes of memory accounted by the subsystems.
+enum memstat_class {
+    // The page directories and page tables of all the address spaces.
+    MEMSTAT_PAGE_TABLES,
+    // The kernel stacks of the processes.
+    MEMSTAT_KERNEL_STACKS,
+    // The frames held by the page caches of the files.
+    MEMSTAT_PAGE_CACHE,
+    // The blocks of the block cache, allocated with kmalloc().
+    MEMSTAT_BLOCK_CACHE,
+    // The pre-allocated remote call slots and messages of the IPMs, allocated
+    // with kmalloc(). Dynamically allocated messages are accounted by their
+    // object cache, see kmem_cache_log_stats().
+    MEMSTAT_IPM,
+    MEMSTAT_NUM_CLASSES,
+};
+
+// A snapshot of the memory usage of the kernel, see memstat_get().
+struct memstat {
+    // The number of frames currently allocated, as returned by
+    // frames_allocated().
+    uint32_t frames_allocated;
+    // The number of pages mapped by the heap and the number of bytes allocated
+    // in it, see kmalloc_get_stats(). Classes allocating with kmalloc() are
+    // included in those.
+    uint32_t kmalloc_pages;
+    uint32_t kmalloc_allocated;
+    // The number of bytes allocated in the object caches, see
+    // kmem_cache_total_allocated().
+    uint32_t kmem_cache_allocated;
+    // The number of bytes in use by each class.
+    uint32_t classes[MEMSTAT_NUM_CLASSES];
+};
+
+// The memory used by a process, see proc_get_mem_stats(). Frames shared between
+// processes (copy-on-write pages, page cache frames) are counted in each of the
+// processes mapping them.
+struct proc_mem_stats {
+    // The number of frames of the page directory and the user page tables of
+    // the address space of the process. 0 for kernel processes.
+    uint32_t page_table_frames;
+    // The number of frames of the kernel stack.
+    uint32_t kernel_stack_frames;
+    // The number of pages of the user stack currently mapped.
+    uint32_t user_stack_pages;
+    // The number of pages of the other lazy segments currently mapped, e.g. the
+    // segments of the ELF binary.
+    uint32_t segment_pages;
+    // The number of other user pages mapped, e.g. with mmap().
+    uint32_t other_pages;
+};
+
+// Account an allocation or a free of memory of a class.
+// @param class: The class.
+// @param bytes: The number of bytes allocated, negative for a free.
+void memstat_add(enum memstat_class const class, int32_t const bytes);
+
+// Get the number of bytes currently in use by a class.
+// @param class: The class.
+// @return: The number of bytes.
+uint32_t memstat_class_bytes(enum memstat_class const class);
+
+// Take a snapshot of the memory usage of the kernel.
+// @param stats: Output parameter receiving the snapshot.
+void memstat_get(struct memstat * const stats);
+
+// Log a snapshot of the memory usage of the kernel, including the usage of each
+// object cache.
+void memstat_dump(void);
+
+// Execute the tests of the memory accounting.
+void memstat_test(void);
@@ -0,0 +1,35 @@
+#include <mutex.h>
+#include <debug.h>
+
+void mutex_init(struct mutex * const mutex) {
+    atomic_init(&mutex->locked, 0);
+    wait_queue_init(&mutex->waiters);
+}
+
+bool mutex_trylock(struct mutex * const mutex) {
+    return !atomic_compare_and_exchange(&mutex->locked, 0, 1);
+}
+
+void mutex_lock(struct mutex * const mutex) {
+    if (mutex_trylock(mutex)) {
+        return;
+    }
+    wait_event(&mutex->waiters, mutex_trylock(mutex));
+}
+
+void mutex_unlock(struct mutex * const mutex) {
+    ASSERT(mutex_is_locked(mutex));
+    // The exchange is a full barrier: a waiter adds itself to the queue
+    // (locked instruction) before trying to acquire the mutex, hence either it
+    // sees the mutex free or this cpu sees it in the queue below.
+    atomic_exchange(&mutex->locked, 0);
+    if (wait_queue_has_waiters(&mutex->waiters)) {
+        wake_up(&mutex->waiters);
+    }
+}
+
+bool mutex_is_locked(struct mutex * const mutex) {
+    return atomic_read(&mutex->locked);
+}
+
+#include <mutex.test>
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic.h>
+#include <wait_queue.h>
+
+// Sleeping mutex.
+//     Unlike spinlocks, a process waiting for a mutex blocks and gives its cpu
+// to other processes, and the holder of a mutex can block while holding it
+// (e.g. waiting for a disk I/O). Mutexes are therefore meant for long critical
+// sections in process context. They must not be acquired in interrupt handlers.
+// As with wait_event(), contexts that cannot block busy-wait for the mutex.
+// The uncontended acquisition and release are a single atomic operation each,
+// the wait queue is only used under contention.
+struct mutex {
+    // 1 if the mutex is held, 0 otherwise.
+    atomic_t locked;
+    // The processes waiting for the mutex.
+    struct wait_queue waiters;
+};
+
+#define INIT_MUTEX(name)                            \
+    {                                               \
+        .locked = { .value = 0 },                   \
+        .waiters = INIT_WAIT_QUEUE((name).waiters), \
+    }
+
+#define DECLARE_MUTEX(name) \
+    struct mutex name = INIT_MUTEX(name)
+
+// Initialize a mutex to the unlocked state.
+// @param mutex: The mutex to initialize.
+void mutex_init(struct mutex * const mutex);
+
+// Try to acquire a mutex, without waiting.
+// @param mutex: The mutex to acquire.
+// @return: true if the mutex has been acquired, false if it is held.
+bool mutex_trylock(struct mutex * const mutex);
+
+// Acquire a mutex, blocking until it is available.
+// @param mutex: The mutex to acquire.
+void mutex_lock(struct mutex * const mutex);
+
+// Release a mutex and wake up one of its waiters, if any.
+// @param mutex: The mutex to release. Must be held.
+void mutex_unlock(struct mutex * const mutex);
+
+// Check if a mutex is held.
+// @param mutex: The mutex.
+// @return: true if the mutex is held by any process, false otherwise.
+bool mutex_is_locked(struct mutex * const mutex);
+
+// Execute the tests of mutexes.
+void mutex_test(void);
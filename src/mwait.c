@@ -0,0 +1,45 @@
+#include <mwait.h>
+#include <debug.h>
+
+// CPUID.01H:ECX[3] indicates support for MONITOR/MWAIT.
+#define CPUID_ECX_MONITOR               (1 << 3)
+// CPUID.05H:ECX[0] indicates that the MWAIT extensions are enumerated.
+#define CPUID_MWAIT_ECX_EMX             (1 << 0)
+// CPUID.05H:ECX[1] indicates that interrupts can break MWAIT even when masked.
+#define CPUID_MWAIT_ECX_IRQ_BREAK       (1 << 1)
+
+// Set by init_mwait().
+static bool MWAIT_SUPPORTED = false;
+static bool MWAIT_IRQ_BREAK = false;
+
+void init_mwait(void) {
+    uint32_t max_leaf;
+    cpuid(0x0, &max_leaf, NULL, NULL, NULL);
+    uint32_t ecx;
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    // Leaf 5 is needed to know the size of the monitored line and whether or
+    // not the extensions are supported. Without it, MWAIT is not used.
+    MWAIT_SUPPORTED = (ecx & CPUID_ECX_MONITOR) && max_leaf >= 0x5;
+    MWAIT_IRQ_BREAK = false;
+    if (!MWAIT_SUPPORTED) {
+        LOG("MONITOR/MWAIT not supported, waiting with PAUSE\n");
+        return;
+    }
+
+    uint32_t min_line, max_line, mwait_ecx;
+    cpuid(0x5, &min_line, &max_line, &mwait_ecx, NULL);
+    uint32_t const emx = CPUID_MWAIT_ECX_EMX | CPUID_MWAIT_ECX_IRQ_BREAK;
+    MWAIT_IRQ_BREAK = (mwait_ecx & emx) == emx;
+    LOG("MONITOR/MWAIT supported, line = %u-%u bytes, irq break = %d\n",
+        min_line & 0xFFFF, max_line & 0xFFFF, MWAIT_IRQ_BREAK);
+}
+
+bool mwait_supported(void) {
+    return MWAIT_SUPPORTED;
+}
+
+bool mwait_irq_break_supported(void) {
+    return MWAIT_IRQ_BREAK;
+}
+
+#include <mwait.test>
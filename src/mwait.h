@@ -0,0 +1,57 @@
+#pragma once
+#include <types.h>
+#include <cpu.h>
+
+// MONITOR/MWAIT based waiting.
+//     Busy-waiting on a memory location with PAUSE keeps the cpu executing
+// instructions and hammers the cache line being polled. When the cpu supports
+// MONITOR/MWAIT, a waiter instead arms the monitor on the cache line it is
+// waiting on and executes MWAIT: the cpu stops executing instructions, in a
+// low power state, until the cache line is written by another cpu or an
+// interrupt arrives.
+//     Support is detected through CPUID by init_mwait(). All the cpus are
+// assumed to support the same features as the BSP. Without MWAIT, all the
+// helpers fall back to a PAUSE loop.
+//     The idle loop of the scheduler also uses MWAIT, see do_idle() in
+// sched_core.c.
+
+// Detect MONITOR/MWAIT support on the current cpu. Must be called on the BSP
+// before the other cpus are woken up.
+void init_mwait(void);
+
+// Check if the cpu supports MONITOR/MWAIT.
+// @return: true if MONITOR/MWAIT can be used.
+bool mwait_supported(void);
+
+// Check if the cpu supports using interrupts as break events for MWAIT even
+// when they are masked, i.e. bit 0 of ECX for MWAIT.
+// @return: true if MWAIT can be woken up by masked interrupts.
+bool mwait_irq_break_supported(void);
+
+// Wait until a condition becomes true, the condition depending on the value at
+// a given address. The cpu sleeps in MWAIT until the cache line containing the
+// address is written, hence the condition must only change through writes to
+// that cache line, otherwise the wait can last until the next interrupt. With
+// interrupts disabled, nothing but a write to the cache line ends the wait.
+// @param addr: The address the condition depends on.
+// @param cond: The condition. Evaluated any number of times, it must therefore
+// be free of side effects.
+#define wait_on_address(addr, cond)                                 \
+    do {                                                            \
+        while (!(cond)) {                                           \
+            if (!mwait_supported()) {                               \
+                cpu_pause();                                        \
+                continue;                                           \
+            }                                                       \
+            cpu_monitor(addr);                                      \
+            /* The write might have happened before the monitor */  \
+            /* was armed. */                                        \
+            if (cond) {                                             \
+                break;                                              \
+            }                                                       \
+            cpu_mwait(0, 0);                                        \
+        }                                                           \
+    } while (0)
+
+// Run the MWAIT tests.
+void mwait_test(void);
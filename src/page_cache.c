@@ -0,0 +1,560 @@
+#include <page_cache.h>
+#include <fs.h>
+#include <frame_alloc.h>
+#include <paging.h>
+#include <kernel_map.h>
+#include <kmalloc.h>
+#include <memory.h>
+#include <math.h>
+#include <debug.h>
+#include <memstat.h>
+
+void page_cache_init(struct page_cache * const cache) {
+    spinlock_init(&cache->lock);
+    cache->pages = NULL;
+    cache->num_pages = 0;
+    cache->segment_images = NULL;
+}
+
+void page_cache_destroy(struct page_cache * const cache) {
+    for (uint32_t i = 0; i < cache->num_pages; ++i) {
+        if (cache->pages[i].frame != NO_FRAME) {
+            // Frames still mapped somewhere keep the references of their
+            // mappings.
+            frame_set_owner(cache->pages[i].frame, NULL, 0);
+            free_frame(cache->pages[i].frame);
+            memstat_add(MEMSTAT_PAGE_CACHE, -PAGE_SIZE);
+        }
+    }
+    kfree(cache->pages);
+    cache->pages = NULL;
+    cache->num_pages = 0;
+    // Segments hold a reference on their file, hence the images of a file are
+    // all gone by the time it is closed.
+    ASSERT(!cache->segment_images);
+}
+
+// Grow the array of pages of a page cache. The cache's lock must be held.
+// @param cache: The cache.
+// @param min_pages: The minimum number of entries of the array after growing.
+// @return: true on success, false if the new array could not be allocated.
+static bool grow(struct page_cache * const cache, uint32_t const min_pages) {
+    ASSERT(spinlock_is_held(&cache->lock));
+    ASSERT(min_pages <= PAGE_CACHE_MAX_PAGES);
+    uint32_t num_pages = cache->num_pages ? cache->num_pages : 1;
+    while (num_pages < min_pages) {
+        num_pages *= 2;
+    }
+    struct cached_page * const pages = kmalloc(num_pages * sizeof(*pages));
+    if (!pages) {
+        return false;
+    }
+    memcpy(pages, cache->pages, cache->num_pages * sizeof(*pages));
+    for (uint32_t i = cache->num_pages; i < num_pages; ++i) {
+        pages[i].frame = NO_FRAME;
+        pages[i].len = 0;
+    }
+    kfree(cache->pages);
+    cache->pages = pages;
+    cache->num_pages = num_pages;
+    return true;
+}
+
+// Read a page of a file into a new frame.
+// @param file: The file.
+// @param page_idx: The index of the page within the file.
+// @param len: Output parameter set to the number of bytes read from the file.
+// @return: The frame, NO_FRAME if the page is past the end of the file or if
+// the frame could not be allocated.
+static void *fill_frame(struct file * const file,
+                        uint32_t const page_idx,
+                        uint32_t * const len) {
+    void * const frame = alloc_frame();
+    if (frame == NO_FRAME) {
+        return NO_FRAME;
+    }
+    off_t const offset = (off_t)page_idx * PAGE_SIZE;
+    if (paging_in_direct_map(frame, PAGE_SIZE)) {
+        uint8_t * const data = to_virt(frame);
+        *len = file->ops->read(file, offset, data, PAGE_SIZE);
+        memzero(data + *len, PAGE_SIZE - *len);
+    } else {
+        // The frame can only be accessed through a kmap slot, which cannot be
+        // held across the filesystem read. Go through a bounce buffer instead.
+        uint8_t * const buf = kmalloc(PAGE_SIZE);
+        if (!buf) {
+            free_frame(frame);
+            return NO_FRAME;
+        }
+        *len = file->ops->read(file, offset, buf, PAGE_SIZE);
+        memzero(buf + *len, PAGE_SIZE - *len);
+        phy_write(frame, buf, PAGE_SIZE);
+        kfree(buf);
+    }
+    if (!*len) {
+        free_frame(frame);
+        return NO_FRAME;
+    }
+    return frame;
+}
+
+// Get the cached page of a file, filling it if necessary.
+// @param file: The file. The caller must hold at least a read lock on the file.
+// @param page_idx: The index of the page.
+// @param len: Output parameter set to the number of bytes of the page that are
+// part of the file.
+// @param get_ref: If true, a reference is added to the frame on behalf of the
+// caller.
+// @return: The frame of the page, or NO_FRAME.
+// Note: The frame of a page is only removed from the cache under the write lock
+// of its file, hence callers holding the read lock can use the frame without
+// adding a reference.
+static void *get_page(struct file * const file,
+                      uint32_t const page_idx,
+                      uint32_t * const len,
+                      bool const get_ref) {
+    if (page_idx >= PAGE_CACHE_MAX_PAGES) {
+        return NO_FRAME;
+    }
+    struct page_cache * const cache = &file->page_cache;
+
+    spinlock_lock(&cache->lock);
+    void * frame = NO_FRAME;
+    if (page_idx < cache->num_pages) {
+        frame = cache->pages[page_idx].frame;
+        *len = cache->pages[page_idx].len;
+    }
+    if (frame != NO_FRAME && get_ref && !frame_get(frame)) {
+        frame = NO_FRAME;
+    }
+    spinlock_unlock(&cache->lock);
+    if (frame != NO_FRAME) {
+        return frame;
+    }
+
+    // Miss. The filesystem read might be slow, do not hold the cache's lock
+    // while it is in progress.
+    uint32_t fill_len = 0;
+    void * const new_frame = fill_frame(file, page_idx, &fill_len);
+    if (new_frame == NO_FRAME) {
+        return NO_FRAME;
+    }
+
+    spinlock_lock(&cache->lock);
+    if (page_idx >= cache->num_pages && !grow(cache, page_idx + 1)) {
+        // Cannot cache the page, hand the frame to the caller if it wants a
+        // reference on it, otherwise the caller falls back to the filesystem.
+        spinlock_unlock(&cache->lock);
+        if (get_ref) {
+            *len = fill_len;
+            return new_frame;
+        }
+        free_frame(new_frame);
+        return NO_FRAME;
+    }
+    struct cached_page * const page = cache->pages + page_idx;
+    bool const raced = page->frame != NO_FRAME;
+    if (!raced) {
+        // Another reader might have filled the page concurrently, in which case
+        // its frame wins.
+        page->frame = new_frame;
+        page->len = fill_len;
+        frame_set_owner(new_frame, file, PAGE_CACHED);
+        memstat_add(MEMSTAT_PAGE_CACHE, PAGE_SIZE);
+    }
+    frame = page->frame;
+    *len = page->len;
+    if (get_ref && !frame_get(frame)) {
+        frame = NO_FRAME;
+    }
+    spinlock_unlock(&cache->lock);
+
+    if (raced) {
+        free_frame(new_frame);
+    }
+    return frame;
+}
+
+void *page_cache_get(struct file * const file,
+                     uint32_t const page_idx,
+                     uint32_t * const len) {
+    return get_page(file, page_idx, len, true);
+}
+
+size_t page_cache_read(struct file * const file,
+                       off_t const offset,
+                       uint8_t * const buf,
+                       size_t const len) {
+    size_t done = 0;
+    while (done < len) {
+        off_t const pos = offset + done;
+        uint32_t const page_idx = pos / PAGE_SIZE;
+        uint32_t const in_page = pos % PAGE_SIZE;
+
+        uint32_t page_len;
+        void * const frame = get_page(file, page_idx, &page_len, false);
+        if (frame == NO_FRAME) {
+            // The page is past the end of the file or cannot be cached, let
+            // the filesystem handle the rest of the read.
+            done += file->ops->read(file, pos, buf + done, len - done);
+            break;
+        } else if (in_page >= page_len) {
+            // End of file.
+            break;
+        }
+        uint32_t const n = min_u32(page_len - in_page, len - done);
+        phy_read(frame + in_page, buf + done, n);
+        done += n;
+        if (page_len < PAGE_SIZE && in_page + n == page_len) {
+            // Reached the end of the last page of the file.
+            break;
+        }
+    }
+    return done;
+}
+
+void read_ahead_init(struct read_ahead * const ra) {
+    // The first read of a file usually starts at offset 0 and is treated as
+    // sequential.
+    ra->next_offset = 0;
+    ra->window = 0;
+    ra->ahead_end = 0;
+}
+
+// Find the first run of pages missing from a page cache.
+// @param cache: The cache.
+// @param first_idx: The index of the first page to consider.
+// @param end_idx: The index of the page following the last page to consider.
+// @param run_end: Output parameter set to the index of the page following the
+// run.
+// @return: The index of the first page of the run, `end_idx` if all the pages
+// are cached.
+static uint32_t find_missing_run(struct page_cache * const cache,
+                                 uint32_t const first_idx,
+                                 uint32_t const end_idx,
+                                 uint32_t * const run_end) {
+    spinlock_lock(&cache->lock);
+    uint32_t start = first_idx;
+    while (start < end_idx && start < cache->num_pages &&
+           cache->pages[start].frame != NO_FRAME) {
+        start++;
+    }
+    uint32_t end = start;
+    while (end < end_idx &&
+           (end >= cache->num_pages || cache->pages[end].frame == NO_FRAME)) {
+        end++;
+    }
+    spinlock_unlock(&cache->lock);
+    *run_end = end;
+    return start;
+}
+
+// Insert a frame in a page cache, unless the page was cached concurrently.
+// @param file: The file.
+// @param page_idx: The index of the page.
+// @param frame: The frame containing the page. The reference of the caller is
+// transferred to the cache, or dropped if the frame is not inserted.
+// @param len: The number of bytes of the page that are part of the file.
+static void insert_page(struct file * const file,
+                        uint32_t const page_idx,
+                        void * const frame,
+                        uint32_t const len) {
+    struct page_cache * const cache = &file->page_cache;
+    spinlock_lock(&cache->lock);
+    bool inserted = false;
+    if (page_idx < cache->num_pages || grow(cache, page_idx + 1)) {
+        struct cached_page * const page = cache->pages + page_idx;
+        inserted = page->frame == NO_FRAME;
+        if (inserted) {
+            page->frame = frame;
+            page->len = len;
+            frame_set_owner(frame, file, PAGE_CACHED);
+            memstat_add(MEMSTAT_PAGE_CACHE, PAGE_SIZE);
+        }
+    }
+    spinlock_unlock(&cache->lock);
+    if (!inserted) {
+        free_frame(frame);
+    }
+}
+
+// Fill a run of pages of a page cache with a single filesystem read.
+// @param file: The file. The caller must hold at least a read lock on the file.
+// @param first_idx: The index of the first page of the run.
+// @param n: The number of pages in the run.
+// @return: true if the whole run is part of the file, false if the end of the
+// file was reached or in case of failure.
+static bool fill_run(struct file * const file,
+                     uint32_t const first_idx,
+                     uint32_t const n) {
+    uint8_t * const buf = kmalloc(n * PAGE_SIZE);
+    if (!buf) {
+        return false;
+    }
+    off_t const offset = (off_t)first_idx * PAGE_SIZE;
+    size_t const read = file->ops->read(file, offset, buf, n * PAGE_SIZE);
+    for (uint32_t i = 0; i * PAGE_SIZE < read; ++i) {
+        uint32_t const len = min_u32(read - i * PAGE_SIZE, PAGE_SIZE);
+        void * const frame = alloc_frame();
+        if (frame == NO_FRAME) {
+            break;
+        }
+        memzero(buf + i * PAGE_SIZE + len, PAGE_SIZE - len);
+        phy_write(frame, buf + i * PAGE_SIZE, PAGE_SIZE);
+        insert_page(file, first_idx + i, frame, len);
+    }
+    kfree(buf);
+    return read == n * PAGE_SIZE;
+}
+
+void page_cache_read_ahead(struct file * const file,
+                           struct read_ahead * const ra,
+                           off_t const offset,
+                           size_t const len) {
+    bool const sequential = offset == ra->next_offset;
+    ra->next_offset = offset + len;
+    if (!sequential || !len) {
+        ra->window = 0;
+        ra->ahead_end = 0;
+        return;
+    }
+    ra->window = ra->window ?
+        min_u32(ra->window * 2, READ_AHEAD_MAX_PAGES) : READ_AHEAD_MIN_PAGES;
+
+    uint32_t const first_idx = offset / PAGE_SIZE;
+    uint32_t const end_idx = (offset + len - 1) / PAGE_SIZE + 1;
+    if (end_idx + ra->window / 2 < ra->ahead_end) {
+        // The reader has not reached the second half of the current window
+        // yet, its pages are cached already.
+        return;
+    }
+    uint32_t const start = ra->ahead_end > first_idx ? ra->ahead_end : first_idx;
+    uint32_t const stop = min_u32(end_idx + ra->window, PAGE_CACHE_MAX_PAGES);
+    ra->ahead_end = stop;
+
+    uint32_t run_end;
+    for (uint32_t idx = start; idx < stop; idx = run_end) {
+        idx = find_missing_run(&file->page_cache, idx, stop, &run_end);
+        if (idx == stop) {
+            break;
+        }
+        // Reading the pages of the read itself along with the window avoids
+        // a filesystem read per page.
+        uint32_t const n = min_u32(run_end - idx, READ_AHEAD_MAX_PAGES);
+        run_end = idx + n;
+        if (!fill_run(file, idx, n)) {
+            // Nothing to read ahead past the end of the file. Stop until the
+            // next non-sequential read, the reads themselves still go through
+            // the cache.
+            ra->ahead_end = PAGE_CACHE_MAX_PAGES;
+            break;
+        }
+    }
+}
+
+// The shared frames of a read-only segment, see page_cache.h.
+struct segment_image {
+    // The next image of the file, if the image is attached to its file.
+    struct segment_image * next;
+    // The file backing the segment. The image does not hold a reference on it,
+    // the segments using the image do.
+    struct file * file;
+    // Is the image in the `segment_images` list of the file's page cache.
+    bool attached;
+    // The number of segments using the image.
+    uint32_t refs;
+    // The layout of the segment, see struct vm_segment.
+    void const * data_start;
+    size_t data_len;
+    off_t offset;
+    // The number of entries in `frames`.
+    uint32_t num_frames;
+    // The frame of each page containing data, starting with the page of
+    // `data_start`. NO_FRAME for the pages not filled yet.
+    void * frames[];
+};
+
+// Detach the images of a page cache from its file. The cache's lock must be
+// held.
+// @param cache: The page cache.
+static void detach_segment_images(struct page_cache * const cache) {
+    ASSERT(spinlock_is_held(&cache->lock));
+    struct segment_image * image = cache->segment_images;
+    while (image) {
+        image->attached = false;
+        image = image->next;
+    }
+    cache->segment_images = NULL;
+}
+
+void page_cache_write(struct file * const file,
+                      off_t const offset,
+                      uint8_t const * const buf,
+                      size_t const len) {
+    if (!len) {
+        return;
+    }
+    struct page_cache * const cache = &file->page_cache;
+    uint32_t const first_idx = offset / PAGE_SIZE;
+
+    spinlock_lock(&cache->lock);
+    detach_segment_images(cache);
+    for (uint32_t i = 0; i < cache->num_pages && i < first_idx; ++i) {
+        struct cached_page * const page = cache->pages + i;
+        if (page->frame != NO_FRAME && page->len < PAGE_SIZE) {
+            // This was the last page of the file, the write might have
+            // extended it. Drop it, it will be re-read on the next access.
+            frame_set_owner(page->frame, NULL, 0);
+            free_frame(page->frame);
+            memstat_add(MEMSTAT_PAGE_CACHE, -PAGE_SIZE);
+            page->frame = NO_FRAME;
+        }
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        off_t const pos = offset + done;
+        uint32_t const page_idx = pos / PAGE_SIZE;
+        uint32_t const in_page = pos % PAGE_SIZE;
+        uint32_t const n = min_u32(PAGE_SIZE - in_page, len - done);
+        if (page_idx >= cache->num_pages) {
+            break;
+        }
+        struct cached_page * const page = cache->pages + page_idx;
+        if (page->frame != NO_FRAME) {
+            phy_write(page->frame + in_page, buf + done, n);
+            page->len = max_u32(page->len, in_page + n);
+        }
+        done += n;
+    }
+    spinlock_unlock(&cache->lock);
+}
+
+struct segment_image *page_cache_get_segment_image(
+    struct file * const file,
+    void const * const data_start,
+    size_t const data_len,
+    off_t const offset) {
+    ASSERT(data_len);
+    void const * const first_page = get_page_addr(data_start);
+    void const * const last_page = get_page_addr(data_start + data_len - 1);
+    uint32_t const num_frames = (last_page - first_page) / PAGE_SIZE + 1;
+
+    // Allocate before taking the lock, the allocation is dropped if the image
+    // exists already.
+    struct segment_image * const new =
+        kmalloc(sizeof(*new) + num_frames * sizeof(*new->frames));
+    if (!new) {
+        return NULL;
+    }
+
+    struct page_cache * const cache = &file->page_cache;
+    spinlock_lock(&cache->lock);
+    struct segment_image * image = cache->segment_images;
+    while (image && (image->data_start != data_start ||
+                     image->data_len != data_len || image->offset != offset)) {
+        image = image->next;
+    }
+    if (image) {
+        image->refs++;
+    } else {
+        image = new;
+        image->file = file;
+        image->attached = true;
+        image->refs = 1;
+        image->data_start = data_start;
+        image->data_len = data_len;
+        image->offset = offset;
+        image->num_frames = num_frames;
+        for (uint32_t i = 0; i < num_frames; ++i) {
+            image->frames[i] = NO_FRAME;
+        }
+        image->next = cache->segment_images;
+        cache->segment_images = image;
+    }
+    spinlock_unlock(&cache->lock);
+
+    if (image != new) {
+        kfree(new);
+    }
+    return image;
+}
+
+void segment_image_get(struct segment_image * const image) {
+    struct page_cache * const cache = &image->file->page_cache;
+    spinlock_lock(&cache->lock);
+    ASSERT(image->refs);
+    image->refs++;
+    spinlock_unlock(&cache->lock);
+}
+
+void segment_image_put(struct segment_image * const image) {
+    struct page_cache * const cache = &image->file->page_cache;
+    spinlock_lock(&cache->lock);
+    ASSERT(image->refs);
+    bool const last = !--image->refs;
+    if (last && image->attached) {
+        struct segment_image ** prev = &cache->segment_images;
+        while (*prev != image) {
+            prev = &(*prev)->next;
+        }
+        *prev = image->next;
+    }
+    spinlock_unlock(&cache->lock);
+
+    if (last) {
+        for (uint32_t i = 0; i < image->num_frames; ++i) {
+            if (image->frames[i] != NO_FRAME) {
+                free_frame(image->frames[i]);
+            }
+        }
+        kfree(image);
+    }
+}
+
+// Get the index of a page in the frames of a segment image.
+// @param image: The image.
+// @param page: The address of the page.
+// @return: The index, image->num_frames if the page does not contain data from
+// the file.
+static uint32_t image_frame_index(struct segment_image const * const image,
+                                  void const * const page) {
+    void const * const first_page = get_page_addr(image->data_start);
+    if (page < first_page) {
+        return image->num_frames;
+    }
+    return min_u32((page - first_page) / PAGE_SIZE, image->num_frames);
+}
+
+void *segment_image_get_frame(struct segment_image * const image,
+                              void const * const page) {
+    uint32_t const idx = image_frame_index(image, page);
+    if (idx == image->num_frames) {
+        return NO_FRAME;
+    }
+    struct page_cache * const cache = &image->file->page_cache;
+    spinlock_lock(&cache->lock);
+    void * frame = image->frames[idx];
+    if (frame != NO_FRAME && !frame_get(frame)) {
+        frame = NO_FRAME;
+    }
+    spinlock_unlock(&cache->lock);
+    return frame;
+}
+
+void segment_image_set_frame(struct segment_image * const image,
+                             void const * const page,
+                             void * const frame) {
+    uint32_t const idx = image_frame_index(image, page);
+    ASSERT(idx < image->num_frames);
+    struct page_cache * const cache = &image->file->page_cache;
+    spinlock_lock(&cache->lock);
+    // Two address spaces may fill the same page concurrently, the frame of the
+    // first one is shared and the other one stays private.
+    if (image->frames[idx] == NO_FRAME && frame_get(frame)) {
+        image->frames[idx] = frame;
+    }
+    spinlock_unlock(&cache->lock);
+}
+
+#include <page_cache.test>
@@ -0,0 +1,208 @@
+#pragma once
+#include <types.h>
+#include <spinlock.h>
+
+// Page cache
+// ==========
+//    Each struct file has a page cache holding the content of the file in
+// physical frames, one frame per page of the file. Since the opened file table
+// of VFS guarantees that all openers of a path share the same struct file, the
+// cached frames are shared by all of them, and can be mapped as is into
+// multiple address spaces (see do_mmap()).
+// A page is cached the first time it is accessed and stays cached until the
+// file is closed by its last opener. Writes to the file update the cached
+// frames in place, hence they are visible through existing mappings.
+// The frames are reference counted: the cache holds one reference on each of
+// them, and each mapping of a frame holds its own reference. A frame
+// therefore outlives the cache if it is still mapped when the file is closed.
+// The cache is a dynamic array indexed by page index. Only the first
+// PAGE_CACHE_MAX_PAGES pages of a file are cached, accesses beyond go straight
+// to the filesystem.
+
+// Forward declaration, see fs.h.
+struct file;
+// Forward declaration, see page_cache.c.
+struct segment_image;
+
+// The maximum number of pages cached for a single file.
+#define PAGE_CACHE_MAX_PAGES    (1 << 16)
+
+// A cached page of a file.
+struct cached_page {
+    // The physical frame containing the data, NO_FRAME if the page is not
+    // cached.
+    void * frame;
+    // The number of bytes of the page that are part of the file. Bytes of the
+    // frame after those are zero.
+    uint32_t len;
+};
+
+struct page_cache {
+    // Protects `pages` and `num_pages`. The content of the frames is protected
+    // by the lock of the file instead.
+    spinlock_t lock;
+    // The cached pages, indexed by page index within the file.
+    struct cached_page * pages;
+    // The number of entries in `pages`.
+    uint32_t num_pages;
+    // The segment images of the file, see page_cache_get_segment_image().
+    // Protected by `lock`.
+    struct segment_image * segment_images;
+};
+
+// Static initializer for an empty page cache.
+#define INIT_PAGE_CACHE()           \
+    {                               \
+        .lock = INIT_SPINLOCK(),    \
+        .pages = NULL,              \
+        .num_pages = 0,             \
+        .segment_images = NULL,     \
+    }
+
+// Initialize an empty page cache.
+// @param cache: The cache to initialize.
+void page_cache_init(struct page_cache * const cache);
+
+// Drop all the pages of a page cache.
+// @param cache: The cache to destroy.
+void page_cache_destroy(struct page_cache * const cache);
+
+// Get the frame containing a page of a file, reading it from the filesystem if
+// it is not cached yet.
+// @param file: The file. The caller must hold at least a read lock on the file.
+// @param page_idx: The index of the page within the file.
+// @param len: Output parameter set to the number of bytes of the page that are
+// part of the file.
+// @return: The physical address of the frame, with a reference added on behalf
+// of the caller, which must drop it with free_frame(). NO_FRAME if the page is
+// past the end of the file, cannot be cached or if the frame cannot be
+// allocated.
+void *page_cache_get(struct file * const file,
+                     uint32_t const page_idx,
+                     uint32_t * const len);
+
+// Read from a file through its page cache.
+// @param file: The file. The caller must hold at least a read lock on the file.
+// @param offset: The offset to read from.
+// @param buf: The buffer to read into.
+// @param len: The number of bytes to read.
+// @return: The number of bytes read.
+size_t page_cache_read(struct file * const file,
+                       off_t const offset,
+                       uint8_t * const buf,
+                       size_t const len);
+
+// Update the cached pages of a file after a write to the filesystem.
+// @param file: The file. The caller must hold the write lock of the file.
+// @param offset: The offset of the write.
+// @param buf: The data that was written.
+// @param len: The number of bytes that were successfully written.
+void page_cache_write(struct file * const file,
+                      off_t const offset,
+                      uint8_t const * const buf,
+                      size_t const len);
+
+// Read-ahead
+// ----------
+//    Each opened file descriptor tracks the offset following its last read.
+// A read starting at that offset is sequential, and makes the page cache
+// prefetch a window of pages past the end of the read, fetching all the missing
+// pages of the window with a single filesystem read instead of one read per
+// page. The window starts at READ_AHEAD_MIN_PAGES and doubles with each
+// sequential read up to READ_AHEAD_MAX_PAGES, a non-sequential read stops the
+// read-ahead. The next window is fetched once the reader reaches the second
+// half of the current one. The prefetch is synchronous for now: with a disk
+// supporting asynchronous I/O, it could instead be submitted while the process
+// consumes the data already cached.
+
+// The size of the first read-ahead window, in pages.
+#define READ_AHEAD_MIN_PAGES    4
+// The maximum size of a read-ahead window, in pages.
+#define READ_AHEAD_MAX_PAGES    32
+
+// The read-ahead state of an opened file descriptor.
+struct read_ahead {
+    // The offset following the last read.
+    off_t next_offset;
+    // The size of the current read-ahead window in pages, 0 if the accesses
+    // are not sequential.
+    uint32_t window;
+    // The index of the page following the last page read ahead.
+    uint32_t ahead_end;
+};
+
+// Initialize the read-ahead state of a newly opened file descriptor.
+// @param ra: The state to initialize.
+void read_ahead_init(struct read_ahead * const ra);
+
+// Update the read-ahead state with a read, and prefetch the pages following
+// the read into the page cache if it is sequential. Must be called before the
+// read itself, which also benefits from the prefetch.
+// @param file: The file. The caller must hold at least a read lock on the file.
+// @param ra: The read-ahead state of the file descriptor being read.
+// @param offset: The offset of the read.
+// @param len: The number of bytes to read.
+void page_cache_read_ahead(struct file * const file,
+                           struct read_ahead * const ra,
+                           off_t const offset,
+                           size_t const len);
+
+// Segment images
+// --------------
+//    The pages of a read-only lazy segment lining up with a page of the file
+// are mapped with the frames of the page cache. The other pages of the segment,
+// e.g. its first and last pages when its data does not start or end on a page
+// boundary of the file, need a frame filled specifically for the segment. A
+// segment image keeps those frames for a given segment layout, so that all the
+// address spaces mapping the same segment of a file, e.g. the processes running
+// the same binary, share them instead of each filling a private copy.
+//    Images are reference counted by the segments using them and hold a
+// reference on each of their frames. Unlike the page cache, the frames of an
+// image are not updated by writes to the file. A write instead detaches the
+// images from the file: the segments created afterwards get a new image, while
+// the existing ones keep the content they already mapped.
+
+// Get the segment image of a read-only segment of a file, creating it if it
+// does not exist.
+// @param file: The file backing the segment.
+// @param data_start: The virtual address of the first byte read from the file.
+// @param data_len: The number of bytes read from the file, must not be 0.
+// @param offset: The offset in the file corresponding to `data_start`.
+// @return: The image, with a reference added on behalf of the caller which must
+// drop it with segment_image_put(). NULL if the image cannot be allocated.
+struct segment_image *page_cache_get_segment_image(
+    struct file * const file,
+    void const * const data_start,
+    size_t const data_len,
+    off_t const offset);
+
+// Add a reference to a segment image.
+// @param image: The image.
+void segment_image_get(struct segment_image * const image);
+
+// Drop a reference to a segment image, freeing it and dropping the references
+// on its frames if this was the last one.
+// @param image: The image.
+void segment_image_put(struct segment_image * const image);
+
+// Get the frame of a segment image for a page.
+// @param image: The image.
+// @param page: The address of the page in the segment.
+// @return: The frame, with a reference added on behalf of the caller which must
+// drop it with free_frame(). NO_FRAME if the page was not filled yet or does
+// not contain data from the file.
+void *segment_image_get_frame(struct segment_image * const image,
+                              void const * const page);
+
+// Share the frame filled for a page of a segment with the other users of the
+// segment's image. Does nothing if the image already has a frame for this page.
+// @param image: The image.
+// @param page: The address of the page in the segment. Must contain data from
+// the file.
+// @param frame: The frame containing the content of the page.
+void segment_image_set_frame(struct segment_image * const image,
+                             void const * const page,
+                             void * const frame);
+
+// Run the page cache tests.
+void page_cache_test(void);
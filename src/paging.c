@@ -1,5 +1,6 @@
 #include <paging.h>
 #include <debug.h>
+#include <memstat.h>
 #include <frame_alloc.h>
 #include <memory.h>
 #include <math.h>
@@ -11,6 +12,14 @@
 #include <error.h>
 #include <segmentation.h>
 #include <interrupt.h>
+#include <vfs.h>
+#include <page_cache.h>
+#include <multiboot.h>
+#include <tracelog.h>
+#include <sched.h>
+
+DEFINE_TRACEPOINT(paging_map);
+DEFINE_TRACEPOINT(paging_unmap);
 
 // Some helper constants to interact with page tables/dirs.
 #define PDES_PER_PAGE       1024
@@ -25,6 +34,14 @@
 // limit the memory overhead of storing page tables for the kernel.
 #define KERNEL_MAX_PDE_IDX  (RECURSIVE_PDE_IDX - 1)
 
+#ifndef DIRECT_MAP_MAX_MIB
+// The maximum amount of physical memory, in MiB, covered by the direct map. The
+// remaining kernel virtual addresses are used for dynamic mappings (kmalloc,
+// stacks, MMIO, ...). Setting this to 0 limits the direct map to the kernel
+// image.
+#define DIRECT_MAP_MAX_MIB  512
+#endif
+
 // Virtual address space organization
 // ==================================
 //   A virtual address space is divided in user and kernel addresses. The
@@ -45,9 +62,9 @@
 // mappings exclusively (eg. when mapping a page dir of another address space to
 // modify it). This page table (as any kernel page table) is shared between all
 // cpus on the system, however each cpu has a private entry in the page table.
-// In this page table, entry i is reserved for cpu i, only cpu i might modify or
-// access this entry. (For now only 1 entry per cpu, in the future this could be
-// extended to 4 entries per cpu).
+// In this page table, entries i * KMAP_NUM_SLOTS to (i + 1) * KMAP_NUM_SLOTS - 1
+// are reserved for cpu i, only cpu i might modify or access those entries (see
+// the kmap slots in paging.h).
 // Because each entry is cpu private, there is no need to hold the lock on the
 // address space when modifying an entry and a TLB shootdown is not needed. This
 // is particularly useful when a cpu wants to modify a foreign address space and
@@ -56,6 +73,16 @@
 // Temporary mappings are ONLY used in this file while modifying paging
 // structures.
 //
+// Direct map
+// ==========
+//   The physical range [0x0; DIRECT_MAP_END[ is permanently mapped at
+// KERNEL_PHY_OFFSET in all address spaces, that is to_virt() is valid for any
+// physical address in this range. This range starts with the kernel image and
+// covers RAM up to DIRECT_MAP_MAX_MIB, using large pages when possible. Accesses
+// to frames in this range (page tables of other address spaces, physical
+// copies, ...) do not need any temporary mapping. Physical ranges that are not
+// usable RAM are mapped with cache disabled.
+//
 // Page Directory summary
 // ======================
 //
@@ -74,7 +101,7 @@
 //  +-------------+
 //        ...
 //  +-------------+
-//  |     XYZ     | <- Last PDE kernel addrs, mapped to last kernel phy frame.
+//  |     XYZ     | <- Last PDE kernel addrs, mapped to DIRECT_MAP_END.
 //  +-------------+
 //        ...
 //  +-------------+
@@ -82,6 +109,19 @@
 //  +-------------+
 //  |    1023     | <- Recursive PDE entry pointing to this page directory.
 //  +-------------+
+//
+// Large pages
+// ===========
+//   A PDE can directly map a 4MiB physical range (PSE) instead of pointing to a
+// page table. Such PDEs are only installed for ranges for which both the
+// virtual and physical addresses are 4MiB aligned and are split back into a
+// page table when only part of the range is unmapped.
+//   Kernel PDEs are shared by all the address spaces. Installing or removing a
+// large page in the kernel address space therefore modifies the PDE in all the
+// page directories (see set_pde()). The page table that was pre-allocated for a
+// kernel PDE is kept aside while a large page is installed in its place, and
+// re-used when the large page is removed or split. As a result kernel PDEs are
+// always present and never need a page table allocation.
 
 // This is the definition of an entry of a page directory.
 union pde_t {
@@ -99,13 +139,20 @@ union pde_t {
         uint8_t cache_disable : 1;
         // [CONST] Indicates if this entry has been accessed by the CPU.
         uint8_t accessed : 1;
-        // [CONST] Ignored field. Also contains the PS bit which is only used
-        // with 4MB pages. This is not supported in this kernel.
-        // Note: Using a uint16_t here to avoid a warning "offset of packed
-        // bit-field 'ignored' has changed in GCC 4.4".
-        uint16_t ignored : 6;
+        // [CONST] Indicates if the large page pointed by this entry is dirty.
+        // Only used if page_size is set.
+        uint8_t dirty : 1;
+        // If set, this entry maps a 4MiB page instead of pointing to a page
+        // table.
+        uint8_t page_size : 1;
+        // Same as the global bit of a PTE. Only used if page_size is set.
+        uint8_t global : 1;
+        // [CONST] Ignored field.
+        uint8_t ignored : 3;
         // Physical address (top 20 bits) of the page table pointed by this
-        // entry.
+        // entry. If page_size is set, this is the physical address of the 4MiB
+        // page instead, since the address is 4MiB aligned the lower 10 bits are
+        // always 0 in this case.
         uint32_t page_table_addr : 20;
     } __attribute__((packed));
 } __attribute__((packed));
@@ -134,13 +181,17 @@ union pte_t {
         // If set, prevents the TLB from updating the address in its cache if
         // CR3 is reset.
         uint8_t global : 1;
+        // Ignored by the cpu. If set, the page is shared copy-on-write with
+        // other address spaces, the entry is then read-only.
+        uint8_t cow : 1;
         // [CONST] Ignored field.
-        uint8_t ignored : 3;
+        uint8_t ignored : 2;
         // Physical address (top 20 bits) of the page pointed by this entry.
         uint32_t frame_addr : 20;
     } __attribute__((packed));
 } __attribute__((packed));
 STATIC_ASSERT(sizeof(union pte_t) == 4, "");
+STATIC_ASSERT(ADDR_SPACE_NUM_PDES == PDES_PER_PAGE, "");
 
 // A page directory structure.
 struct page_dir {
@@ -169,6 +220,104 @@ static bool compare_ptes(union pte_t const a, union pte_t const b) {
     a.frame_addr == b.frame_addr;
 }
 
+// Create a PTE.
+// @param paddr: The physical address of the frame the PTE points to.
+// @param flags: The attributes of the mapping. See macros VM_* in paging.h.
+// @return: The PTE.
+static union pte_t make_pte(void const * const paddr, uint32_t const flags) {
+    union pte_t pte;
+    // Need to be extremely careful with the bitwise op here. The value stored
+    // in the attributes of the PTE need to be 0 or 1, anything higher might not
+    // map to what it seems (eg. pte.write_through = 2 will write 0 instead).
+    // This is because of the bitfields with size 1 bit.
+    pte.writable = (bool)(flags & VM_WRITE);
+    pte.write_through = (bool)(flags & VM_WRITE_THROUGH);
+    pte.cache_disable = (bool)(flags & VM_CACHE_DISABLE);
+    pte.global = (bool)!(flags & VM_NON_GLOBAL);
+    pte.user_accessible = (bool)(flags & VM_USER);
+    // Reset accessed and dirty bits.
+    pte.accessed = 0;
+    pte.dirty = 0;
+    pte.zero = 0;
+    pte.cow = 0;
+    pte.ignored = 0;
+    pte.present = 1;
+    pte.frame_addr = ((uint32_t)paddr) >> 12;
+    return pte;
+}
+
+// Create a PDE pointing to a page table.
+// @param page_table: The _physical_ address of the page table.
+// @param user: If true the PDE is user accessible.
+// @return: The PDE.
+static union pde_t make_table_pde(void const * const page_table,
+                                  bool const user) {
+    union pde_t pde;
+    pde.val = 0;
+    // Try to be as inclusive as possible for the PDE. The PTEs will
+    // enforced the actual attributes.
+    pde.writable = 1;
+    pde.write_through = 0;
+    pde.cache_disable = 0;
+    // Reset accessed bit.
+    pde.accessed = 0;
+    pde.user_accessible = user;
+    pde.page_table_addr = ((uint32_t)page_table) >> 12;
+    pde.present = 1;
+    return pde;
+}
+
+// Create a PDE mapping a large page.
+// @param paddr: The physical address of the large page. Must be 4MiB aligned.
+// @param flags: The attributes of the mapping. See macros VM_* in paging.h.
+// @return: The PDE.
+static union pde_t make_large_pde(void const * const paddr,
+                                  uint32_t const flags) {
+    ASSERT(!((uint32_t)paddr & (LARGE_PAGE_SIZE - 1)));
+    union pde_t pde;
+    pde.val = 0;
+    pde.writable = (bool)(flags & VM_WRITE);
+    pde.write_through = (bool)(flags & VM_WRITE_THROUGH);
+    pde.cache_disable = (bool)(flags & VM_CACHE_DISABLE);
+    pde.global = (bool)!(flags & VM_NON_GLOBAL);
+    pde.user_accessible = (bool)(flags & VM_USER);
+    pde.page_size = 1;
+    pde.page_table_addr = ((uint32_t)paddr) >> 12;
+    pde.present = 1;
+    return pde;
+}
+
+// Compute the PTE that would map a 4KiB page within a large page with the same
+// attributes.
+// @param pde: The PDE of the large page.
+// @param pte_idx: The index of the 4KiB page within the large page.
+// @return: The equivalent PTE.
+static union pte_t large_pde_pte(union pde_t const pde, uint16_t const pte_idx) {
+    ASSERT(pde.present && pde.page_size);
+    union pte_t pte;
+    pte.val = 0;
+    pte.writable = pde.writable;
+    pte.write_through = pde.write_through;
+    pte.cache_disable = pde.cache_disable;
+    pte.global = pde.global;
+    pte.user_accessible = pde.user_accessible;
+    pte.frame_addr = pde.page_table_addr + pte_idx;
+    pte.present = 1;
+    return pte;
+}
+
+// Check if an address is aligned on a large page boundary.
+// @param addr: The address to test.
+// @return: true if addr is 4MiB aligned, false otherwise.
+static inline bool is_large_page_aligned(void const * const addr) {
+    return !((uint32_t)addr & (LARGE_PAGE_SIZE - 1));
+}
+
+// The physical addresses of the page tables pre-allocated for the kernel PDEs,
+// indexed by PDE index. Those are the tables to be used by the PDEs when they do
+// not map a large page.
+static void * KERNEL_PAGE_TABLES[PDES_PER_PAGE];
+
 // Allocate a new page directory.
 // @return: The _physical_ address of the freshly allocated page directory.
 static struct page_dir * alloc_page_dir(void) {
@@ -176,9 +325,14 @@ static struct page_dir * alloc_page_dir(void) {
 }
 
 // Allocate a new page table.
-// @return: The _physical_ address of the freshly allocated page table.
+// @return: The _physical_ address of the freshly allocated page table. The page
+// table is zeroed.
 static struct page_table * alloc_page_table(void) {
-    return (struct page_table*) alloc_frame();
+    struct page_table * const table = alloc_zeroed_frame();
+    if (table != NO_FRAME) {
+        memstat_add(MEMSTAT_PAGE_TABLES, PAGE_SIZE);
+    }
+    return table;
 }
 
 // Create the recursive entry on the last entry of a page directory.
@@ -213,18 +367,14 @@ static void create_temp_mapping_entry(struct page_dir * const page_dir) {
         PANIC("Cannot allocated temp mapping page table\n");
     }
 
-    // Zero out the page. This is important especially in baremetal since the
-    // page_table might contain garbage leading to PANIC when mapping into it.
-    memzero(to_virt(page_table), PAGE_SIZE);
-
     LOG("Temporary mapping page table at physical address %p\n", page_table);
 
     ASSERT(!page_dir->entry[TEMP_MAP_PDE_IDX].present);
 
     union pde_t temp_map_entry;
     temp_map_entry.writable = 1;
-    temp_map_entry.write_through = 1;
-    temp_map_entry.cache_disable = 1;
+    temp_map_entry.write_through = 0;
+    temp_map_entry.cache_disable = 0;
     temp_map_entry.user_accessible = 0;
     temp_map_entry.page_table_addr = ((uint32_t)page_table) >> 12;
     temp_map_entry.present = 1;
@@ -234,91 +384,109 @@ static void create_temp_mapping_entry(struct page_dir * const page_dir) {
 
 // Pre-allocate page tables for all PDEs used by kernel addresses.
 // @param page_dir: Pointer on the page directory to fill.
+// Large PDEs also get a page table, which is kept aside in KERNEL_PAGE_TABLES
+// until the large page is removed.
 static void preallocate_kernel_page_table(struct page_dir * const page_dir) {
     for (uint32_t i = KERNEL_MIN_PDE_IDX; i < KERNEL_MAX_PDE_IDX; ++i) {
-        if (page_dir->entry[i].present) {
+        union pde_t const curr = page_dir->entry[i];
+        if (curr.present && !curr.page_size) {
             // The page table is already allocated for this PDE, skip.
+            KERNEL_PAGE_TABLES[i] = (void*)(curr.page_table_addr << 12);
         } else {
-            void const * const page_table = alloc_frame();
+            // The page table must be zeroed. This is important especially in
+            // baremetal since the page_table might contain garbage leading to
+            // PANIC when mapping into it.
+            void * const page_table = alloc_page_table();
             if (page_table == NO_FRAME) {
                 PANIC("Cannot pre-allocate kernel page tables");
             }
+            KERNEL_PAGE_TABLES[i] = page_table;
 
-            // Zero out the page. This is important especially in baremetal
-            // since the page_table might contain garbage leading to PANIC when
-            // mapping into it.
-            memzero(to_virt(page_table), PAGE_SIZE);
-
-            union pde_t pde;
-            // Try to be as inclusive as possible for the PDE. The PTEs will
-            // enforced the actual attributes.
-            pde.writable = 1;
-            pde.write_through = 0;
-            pde.cache_disable = 0;
-            // Reset accessed bit.
-            pde.accessed = 0;
-            pde.user_accessible = false;
-            pde.page_table_addr = ((uint32_t)page_table) >> 12;
-            pde.present = 1;
-
-            // The same page table can be used for both mappings.
-            page_dir->entry[i] = pde;
+            if (!curr.present) {
+                page_dir->entry[i] = make_table_pde(page_table, false);
+            }
         }
     }
 }
 
-static bool map_page_in(struct addr_space * const addr_space,
-                        void const * const paddr,
-                        void const * const vaddr,
-                        uint32_t const flags);
+// The end (exclusive) of the physical range covered by the direct map. Set by
+// init_paging().
+static uint32_t DIRECT_MAP_END = 0;
+
+bool paging_in_direct_map(void const * const paddr, size_t const len) {
+    uint32_t const addr = (uint32_t)paddr;
+    return addr < DIRECT_MAP_END && len <= DIRECT_MAP_END - addr;
+}
 
-// Create a temporary mapping using the temp page table.
+// Map a physical frame in a kmap slot of the current cpu.
+// @param slot: The slot to use.
 // @param phy_addr: The physical address to map.
 // @return: The virtual address mapping to `phy_addr`. This function is
 // guaranteed to succeed.
-// No lock on the address space is required.
-static void *create_temp_mapping(void const * const phy_addr) {
-    uint32_t const cpu = cpu_apic_id();
+// No lock on the address space is required: the page table of the temporary
+// mapping is shared by all address spaces and is never freed, and the entry of
+// the slot is private to this cpu.
+static void *kmap_slot(enum kmap_slot const slot, void const * const phy_addr) {
+    uint32_t const idx = cpu_apic_id() * KMAP_NUM_SLOTS + slot;
+    ASSERT(idx < PTES_PER_PAGE);
 
-    // Manually disable the old mapping (if existing).
     union pte_t * const entry = (union pte_t*)((RECURSIVE_PDE_IDX << 22) |
-        (TEMP_MAP_PDE_IDX << 12)) + cpu;
-    ASSERT(!(((uint32_t)entry) & 0x3));
-    entry->present = 0;
-
-    void * const vaddr = (void*)((TEMP_MAP_PDE_IDX << 22) | (cpu << 12));
-    uint32_t const flags = VM_WRITE | VM_WRITE_THROUGH | VM_NON_GLOBAL |
-        VM_CACHE_DISABLE;
-
-    // We do not need the lock on the current address space here, because:
-    //  - The page table used for the mapping already exists, hence the page dir
-    //  will not be modified.
-    //  - The entry in the page table is private to this cpu. No race condition
-    //  possible here.
-    bool const res = map_page_in(get_curr_addr_space(), phy_addr, vaddr, flags);
-    // The map_page_in() call above cannot fail, this is because we will map to
-    // the temp map page table and hence no page table allocation is necessary
-    // and no error can occur in OOM scenarios.
-    ASSERT(res);
-
-    // No need for TLB Shootdown either. This mapping should NEVER be used by
-    // other cpus.
-    cpu_invalidate_tlb();
+        (TEMP_MAP_PDE_IDX << 12)) + idx;
+    void * const vaddr = (void*)((TEMP_MAP_PDE_IDX << 22) | (idx << 12));
+    union pte_t const pte = make_pte(phy_addr, VM_WRITE | VM_NON_GLOBAL);
+
+    // Consecutive mappings of the same frame are common, e.g. when accessing
+    // the page directory of another address space multiple times. In this case
+    // the TLB entry, if any, is already correct.
+    if (!compare_ptes(*entry, pte)) {
+        *entry = pte;
+        // No need for TLB Shootdown. This mapping is NEVER used by other cpus.
+        cpu_invlpg(vaddr);
+    }
     return vaddr;
 }
 
+// Get a virtual address mapping to a physical frame. Frames covered by the
+// direct map are accessed through it, other frames are mapped in a kmap slot of
+// the current cpu.
+// @param slot: The slot to use if the frame is not in the direct map.
+// @param phy_addr: The physical address to map.
+// @return: The virtual address mapping to `phy_addr`, valid until `slot` is
+// re-used. This function is guaranteed to succeed.
+static void *kmap(enum kmap_slot const slot, void const * const phy_addr) {
+    if (paging_in_direct_map(phy_addr, PAGE_SIZE)) {
+        return to_virt(phy_addr);
+    }
+    return kmap_slot(slot, phy_addr);
+}
+
+void paging_zero_frame(void * const frame) {
+    if (!cpu_paging_enabled()) {
+        clear_page(to_virt(frame));
+        return;
+    }
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    clear_page(kmap(KMAP_FAULT, frame));
+    cpu_set_interrupt_flag(irqs);
+}
+
+void *paging_kmap(enum kmap_slot const slot, void const * const frame) {
+    ASSERT(!interrupts_enabled());
+    ASSERT(is_4kib_aligned(frame));
+    return kmap(slot, frame);
+}
+
 // Get a pointer on the page directory of an address space.
 // @param addr_space: The address space to get the page directory pointer from.
 // @return: The address of the page directory of `addr_space`. Note that this
 // pointer will _always_ be valid no matter if paging has been enabled or not.
 // This means this function can be used in early boot. This function is
 // guaranteed to succeed.
-// NOTE: One needs to be EXTREMELY careful when using get_page_dir() and
-// get_page_table() in the same function/scope. In the case those functions are
-// used to access a page dir and a page table of an address space that is NOT
-// the current address space, a temporary mapping will be used. Both functions
-// will map the page dir/table to the same virtual address in the temporary page
-// table, effectively overwritting each other.
+// NOTE: When `addr_space` is not the current address space, the page directory
+// is accessed through the KMAP_PAGE_DIR slot of the current cpu, hence the
+// returned pointer is only valid until the next call to this function for
+// another address space.
 static struct page_dir *get_page_dir(struct addr_space * const addr_space) {
     if (!cpu_paging_enabled()) {
         // Paging is not yet enabled, but we are in higher half using the Boot
@@ -336,7 +504,7 @@ static struct page_dir *get_page_dir(struct addr_space * const addr_space) {
         // different from this cpu's address space. In this case map the page
         // directory of the target address space to the current address space
         // and return the virtual address where it has been mapped to.
-        return create_temp_mapping(addr_space->page_dir_phy_addr);
+        return kmap(KMAP_PAGE_DIR, addr_space->page_dir_phy_addr);
     }
 }
 
@@ -348,14 +516,15 @@ static struct page_dir *get_page_dir(struct addr_space * const addr_space) {
 // that this pointer will _always_ be valid no matter if paging has been enabled
 // or not.  This means this function can be used in early boot. This function is
 // guaranteed to succeed.
-// NOTE: One needs to be EXTREMELY careful when using get_page_dir() and
-// get_page_table() in the same function/scope. In the case those functions are
-// used to access a page dir and a page table of an address space that is NOT
-// the current address space, a temporary mapping will be used. Both functions
-// will map the page dir/table to the same virtual address in the temporary page
-// table, effectively overwritting each other.
+// NOTE: When the page table does not belong to the current address space, it is
+// accessed through the KMAP_PAGE_TABLE slot of the current cpu, hence the
+// returned pointer is only valid until the next call to this function for
+// another address space. This does not affect the pointer returned by
+// get_page_dir().
 static struct page_table *get_page_table(struct page_dir * const page_dir,
                                          uint16_t const index) {
+    // Large PDEs do not point to a page table.
+    ASSERT(!page_dir->entry[index].page_size);
     if (!cpu_paging_enabled()) {
         // Paging is not yet enabled, we can use the to_virt() on the addres of
         // the page table to manipulate it directly.
@@ -372,7 +541,7 @@ static struct page_table *get_page_table(struct page_dir * const page_dir,
         // cannot use the recursive entry to get the virtual address of the page
         // table, map it in the current address space instead.
         void *frame = (void*)(page_dir->entry[index].page_table_addr << 12);
-        return create_temp_mapping(frame);
+        return kmap(KMAP_PAGE_TABLE, frame);
     }
 }
 
@@ -392,6 +561,7 @@ static void remove_identity_mapping(void) {
         ASSERT(page_dir->entry[i].present);
         // Zero the entire entry, cleaner.
         memzero(page_dir->entry + i, sizeof(*page_dir->entry));
+        get_curr_addr_space()->pde_num_mapped[i] = 0;
     }
 }
 
@@ -416,6 +586,67 @@ static inline bool is_temp_mapping(void const * const vaddr) {
     return pde_index(vaddr) == TEMP_MAP_PDE_IDX;
 }
 
+// Check if a PDE index is used by kernel addresses, that is if the PDE is
+// shared by all the address spaces.
+// @param pde_idx: The index to test.
+// @return: true if the index is in [KERNEL_MIN_PDE_IDX; KERNEL_MAX_PDE_IDX[.
+static inline bool is_kernel_pde(uint16_t const pde_idx) {
+    return KERNEL_MIN_PDE_IDX <= pde_idx && pde_idx < KERNEL_MAX_PDE_IDX;
+}
+
+// Get the counter of pages mapped under a PDE.
+// @param addr_space: The address space.
+// @param pde_idx: The index of the PDE.
+// @return: A pointer to the counter. Counters of kernel PDEs are shared by all
+// address spaces and are stored in the kernel address space.
+// Note: Counters are protected by the lock of the address space to which they
+// belong. The PDE of the temporary mapping is never accounted.
+static uint16_t *pde_num_mapped(struct addr_space * const addr_space,
+                                uint16_t const pde_idx) {
+    struct addr_space * const owner = is_kernel_pde(pde_idx) ?
+        get_kernel_addr_space() : addr_space;
+    return &owner->pde_num_mapped[pde_idx];
+}
+
+// A modification of a kernel PDE to be propagated to all the address spaces.
+struct pde_update {
+    uint16_t idx;
+    union pde_t pde;
+};
+
+// Apply a struct pde_update to the page directory of an address space. This is
+// the callback used with addr_space_for_each().
+// @param addr_space: The address space to modify.
+// @param arg: Pointer to the struct pde_update.
+static void apply_pde_update(struct addr_space * const addr_space,
+                             void * const arg) {
+    struct pde_update const * const update = arg;
+    get_page_dir(addr_space)->entry[update->idx] = update->pde;
+}
+
+// Set a PDE in an address space. Modifications of kernel PDEs are propagated to
+// the page directories of all the address spaces.
+// @param addr_space: The address space to modify. Must be the kernel address
+// space if `pde_idx` is a kernel PDE.
+// @param pde_idx: The index of the PDE to set.
+// @param pde: The new value of the PDE.
+// Note: This function assumes that the lock of the address space is held. The
+// caller is responsible for invalidating the TLBs.
+static void set_pde(struct addr_space * const addr_space,
+                    uint16_t const pde_idx,
+                    union pde_t const pde) {
+    get_page_dir(addr_space)->entry[pde_idx] = pde;
+    // Before paging is enabled only the kernel address space exists.
+    if (is_kernel_pde(pde_idx) && cpu_paging_enabled()) {
+        ASSERT(addr_space == get_kernel_addr_space());
+        struct pde_update update = {
+            .idx = pde_idx,
+            .pde = pde,
+        };
+        addr_space_for_each(apply_pde_update, &update);
+    }
+}
+
 // Map a physical frame to a virtual page.
 // @param addr_space: The address space in which the mapping should be
 // performed.
@@ -456,7 +687,20 @@ static bool map_page_in(struct addr_space * const addr_space,
     }
 
     uint32_t const pde_idx = pde_index(vaddr);
-    bool page_table_allocated = false;
+    uint32_t const pte_idx = pte_index(vaddr);
+    union pte_t const pte = make_pte(paddr, flags);
+
+    if (page_dir->entry[pde_idx].page_size) {
+        // The page is part of a large page, the mapping is only allowed if it
+        // is identical to the one already in place.
+        union pde_t const pde = page_dir->entry[pde_idx];
+        if (!compare_ptes(pte, large_pde_pte(pde, pte_idx))) {
+            PANIC("Overwriting previous large page when mapping address %p",
+                vaddr);
+        }
+        return true;
+    }
+
     if (!page_dir->entry[pde_idx].present) {
         // The table for this index is not present, we need to allocate it and
         // set it up.
@@ -465,50 +709,13 @@ static bool map_page_in(struct addr_space * const addr_space,
             SET_ERROR("Cannot allocate new page table", ENONE);
             return false;
         }
-        page_table_allocated = true;
-        union pde_t pde;
-        // Try to be as inclusive as possible for the PDE. The PTEs will
-        // enforced the actual attributes.
-        pde.writable = 1;
-        pde.write_through = 0;
-        pde.cache_disable = 0;
-        // Reset accessed bit.
-        pde.accessed = 0;
-
-        pde.user_accessible = (bool)(flags & VM_USER);
-
-        pde.page_table_addr = ((uint32_t)new_table) >> 12;
-        pde.present = 1;
-
         // The same page table can be used for both mappings.
-        page_dir->entry[pde_idx] = pde;
+        page_dir->entry[pde_idx] = make_table_pde(new_table,
+            (bool)(flags & VM_USER));
     }
 
+    // A freshly allocated page table is already zeroed by alloc_page_table().
     struct page_table * const page_table = get_page_table(page_dir, pde_idx);
-    if (page_table_allocated) {
-        // If the page table has been freshly allocated zero it, this is to
-        // avoid garbage.
-        memzero(page_table, sizeof(*page_table));
-    }
-
-    union pte_t pte;
-    // Need to be extremely careful with the bitwise op here. The value stored
-    // in the attributes of the PTE need to be 0 or 1, anything higher might not
-    // map to what it seems (eg. pte.write_through = 2 will write 0 instead).
-    // This is because of the bitfields with size 1 bit.
-    pte.writable = (bool)(flags & VM_WRITE);
-    pte.write_through = (bool)(flags & VM_WRITE_THROUGH);
-    pte.cache_disable = (bool)(flags & VM_CACHE_DISABLE);
-    pte.global = (bool)!(flags & VM_NON_GLOBAL);
-    pte.user_accessible = (bool)(flags & VM_USER);
-    // Reset accessed and dirty bits.
-    pte.accessed = 0;
-    pte.dirty = 0;
-    pte.zero = 0;
-    pte.present = 1;
-    pte.frame_addr = ((uint32_t)paddr) >> 12;
-
-    uint32_t const pte_idx = pte_index(vaddr);
 
     if (page_table->entry[pte_idx].present) {
         // If there was already an entry at this index compare with the new
@@ -517,12 +724,142 @@ static bool map_page_in(struct addr_space * const addr_space,
         if (!compare_ptes(pte, page_table->entry[pte_idx])) {
             PANIC("Overwriting previous PTE when mapping address %p", vaddr);
         }
+    } else if (!is_temp_mapping(vaddr)) {
+        // Temporary mappings are per-cpu and modified without holding the
+        // lock, those are not accounted.
+        ++*pde_num_mapped(addr_space, pde_idx);
     }
 
     page_table->entry[pte_idx] = pte;
     return true;
 }
 
+// Check if a page table is empty, that is all of its entry have the present bit
+// set to 0.
+// @param table: The page table to test.
+// @return: true if the page table is empty, false otherwise.
+static bool page_table_is_empty(struct page_table const * const table) {
+    for (uint16_t i = 0; i < PTES_PER_PAGE; ++i) {
+        if (table->entry[i].present) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check if a large page can be mapped at a virtual address, that is if nothing
+// is mapped in the 4MiB region starting at this address, or if the region is
+// already mapped with a large page.
+// @param addr_space: The address space to test.
+// @param vaddr: The virtual address. Must be 4MiB aligned.
+// @return: true if map_large_page_in() can be used for this address.
+static bool can_map_large_page(struct addr_space * const addr_space,
+                               void const * const vaddr) {
+    ASSERT(is_large_page_aligned(vaddr));
+    uint16_t const pde_idx = pde_index(vaddr);
+    if (is_temp_mapping(vaddr) || pde_idx == RECURSIVE_PDE_IDX) {
+        return false;
+    }
+
+    struct page_dir * const page_dir = get_page_dir(addr_space);
+    union pde_t const pde = page_dir->entry[pde_idx];
+    if (!pde.present || pde.page_size) {
+        return true;
+    }
+    // The page table of a kernel PDE is never freed, hence it can be replaced
+    // as long as it is empty. Page tables of user PDEs are freed as soon as
+    // they become empty.
+    return is_kernel_pde(pde_idx) && KERNEL_PAGE_TABLES[pde_idx] &&
+        page_table_is_empty(get_page_table(page_dir, pde_idx));
+}
+
+// Map a large page. The caller must have checked that can_map_large_page()
+// returns true for this address.
+// @param addr_space: The address space in which the mapping should be
+// performed.
+// @param paddr: The physical address to map. Must be 4MiB aligned.
+// @param vaddr: The virtual address to map. Must be 4MiB aligned.
+// @param flags: Flags indicating the attributes of the mapping. See macros VM_*
+// in paging.h.
+static void map_large_page_in(struct addr_space * const addr_space,
+                              void const * const paddr,
+                              void const * const vaddr,
+                              uint32_t const flags) {
+    ASSERT(addr_space == get_kernel_addr_space() || is_user_addr(vaddr));
+    uint16_t const pde_idx = pde_index(vaddr);
+    union pde_t const pde = make_large_pde(paddr, flags);
+    union pde_t const curr = get_page_dir(addr_space)->entry[pde_idx];
+    if (curr.present && curr.page_size) {
+        // Same as map_page_in(), re-mapping is only allowed if the new mapping
+        // is identical.
+        if (!compare_ptes(large_pde_pte(pde, 0), large_pde_pte(curr, 0))) {
+            PANIC("Overwriting previous large page when mapping address %p",
+                vaddr);
+        }
+        return;
+    }
+    set_pde(addr_space, pde_idx, pde);
+    *pde_num_mapped(addr_space, pde_idx) = PTES_PER_PAGE;
+}
+
+// Map a contiguous range of pages, using large pages whenever possible.
+// @param addr_space: The address space in which the mapping should be
+// performed.
+// @param paddr: The physical address of the range. Must be 4KiB aligned.
+// @param vaddr: The virtual address of the range. Must be 4KiB aligned.
+// @param npages: The number of 4KiB pages to map.
+// @param flags: Flags indicating the attributes of the mapping. See macros VM_*
+// in paging.h.
+// @param num_mapped: Output parameter, set to the number of pages that have
+// been mapped by this function.
+// @return: true if the mapping was successful, false otherwise in which case the
+// first `*num_mapped` pages are mapped.
+static bool map_range_in(struct addr_space * const addr_space,
+                         void const * const paddr,
+                         void const * const vaddr,
+                         uint32_t const npages,
+                         uint32_t const flags,
+                         uint32_t * const num_mapped) {
+    *num_mapped = 0;
+    while (*num_mapped < npages) {
+        void const * const pchunk = paddr + *num_mapped * PAGE_SIZE;
+        void const * const vchunk = vaddr + *num_mapped * PAGE_SIZE;
+        bool const large = npages - *num_mapped >= PTES_PER_PAGE &&
+            is_large_page_aligned(pchunk) &&
+            is_large_page_aligned(vchunk) &&
+            can_map_large_page(addr_space, vchunk);
+        if (large) {
+            map_large_page_in(addr_space, pchunk, vchunk, flags);
+            *num_mapped += PTES_PER_PAGE;
+        } else if (map_page_in(addr_space, pchunk, vchunk, flags)) {
+            ++*num_mapped;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compute the flags to use when mapping a page of the kernel image during paging
+// initialization.
+// @param ptr: The higher-half address of the page.
+// @return: The VM_* flags to use for this page.
+static uint32_t kernel_mapping_flags(void const * const ptr) {
+    if (in_low_mem(ptr)) {
+        // Addresses mapped to low memory should be write through with cache
+        // disabled as we expect memory devices mapped there (incl. VGA
+        // buffer).
+        return VM_WRITE | VM_WRITE_THROUGH | VM_CACHE_DISABLE;
+    } else if (in_text_section(ptr) || in_rodata_section(ptr)) {
+        // Addresses mapped to the .text and .rodata section should be marked
+        // as readonly.
+        return 0;
+    } else {
+        // Any other addresses are read/write.
+        return VM_WRITE;
+    }
+}
+
 // As part as the paging initialization routine, create two mappings:
 // _ One identity mapping of the entire kernel.
 // _ One higher half mapping where the kernel is relocated at KERNEL_PHY_OFFSET
@@ -537,33 +874,101 @@ static void create_identity_and_higher_half_mappings(struct page_dir * pd) {
 
     struct addr_space * const addr_space = get_curr_addr_space();
 
-    for(void const * ptr = start; ptr < end; ptr += PAGE_SIZE) {
-        uint32_t flags = 0;
-        if (in_low_mem(ptr)) {
-            // Addresses mapped to low memory should be write through with
-            // cache disabled as we expect memory devices mapped there (incl.
-            // VGA buffer).
-            flags = VM_WRITE | VM_WRITE_THROUGH | VM_CACHE_DISABLE;
-        } else if (in_text_section(ptr) || in_rodata_section(ptr)) {
-            // Addresses mapped to the .text and .rodata section should be
-            // marked as readonly.
-            flags = 0;
-        } else {
-            // Any other addresses are read/write.
-            flags = VM_WRITE;
+    // The mapping is done in runs of pages with the same flags so that large
+    // pages can be used for any run spanning an entire 4MiB region.
+    void const * run_start = start;
+    while (run_start < end) {
+        uint32_t const flags = kernel_mapping_flags(run_start);
+        void const * run_end = run_start + PAGE_SIZE;
+        while (run_end < end && kernel_mapping_flags(run_end) == flags) {
+            run_end += PAGE_SIZE;
         }
 
-        void const * const paddr = to_phys(ptr);
-        void const * const vaddr = ptr;
+        void const * const paddr = to_phys(run_start);
+        void const * const vaddr = run_start;
+        uint32_t const npages = (run_end - run_start) / PAGE_SIZE;
+        uint32_t num_mapped;
         // Map the higher-half address to the physical address.
-        if (!map_page_in(addr_space, paddr, vaddr, flags)) {
+        if (!map_range_in(addr_space, paddr, vaddr, npages, flags,
+                          &num_mapped)) {
             PANIC("Cannot create higher half mapping\n");
         }
         // Identity map the low addresses.
-        if (!map_page_in(addr_space, paddr, paddr, flags)) {
+        if (!map_range_in(addr_space, paddr, paddr, npages, flags,
+                          &num_mapped)) {
             PANIC("Cannot create identity mapping\n");
         }
+        run_start = run_end;
+    }
+}
+
+// Check if a physical page is part of an available memory region.
+// @param paddr: The physical address of the page.
+// @return: true if the entire page is usable RAM, false otherwise.
+static bool is_usable_ram(void const * const paddr) {
+    struct multiboot_mmap_entry const * const first = get_mmap_entry_ptr();
+    uint32_t const count = multiboot_mmap_entries_count();
+
+    struct multiboot_mmap_entry const * ptr;
+    for (ptr = first; ptr < first + count; ++ptr) {
+        struct multiboot_mmap_entry entry;
+        phy_read(ptr, &entry, sizeof(entry));
+        if (mmap_entry_is_available(&entry) && mmap_entry_within_4GiB(&entry)
+            && entry.base_addr <= (uint32_t)paddr
+            && paddr + PAGE_SIZE - 1 <= get_max_addr_for_entry(&entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Get the attributes of the direct mapping of a physical page.
+// @param paddr: The physical address of the page.
+// @return: The flags to use when mapping `paddr` in the direct map.
+static uint32_t direct_map_flags(void const * const paddr) {
+    if (is_usable_ram(paddr)) {
+        return VM_WRITE;
+    } else {
+        // Reserved ranges might contain memory mapped devices.
+        return VM_WRITE | VM_WRITE_THROUGH | VM_CACHE_DISABLE;
+    }
+}
+
+// As part as the paging initialization routine, map the physical memory
+// following the kernel image to higher half, up to DIRECT_MAP_MAX_MIB. This
+// must be called after create_identity_and_higher_half_mappings() and before
+// preallocate_kernel_page_table().
+static void create_direct_map(void) {
+    uint32_t const start = (uint32_t)to_phys(KERNEL_END_ADDR + 1);
+    uint32_t const kernel_end = round_up_u32(start, PAGE_SIZE);
+    uint32_t const ram_end = round_down_u32((uint32_t)get_max_addr() + 1,
+        PAGE_SIZE);
+    uint32_t const max_end = DIRECT_MAP_MAX_MIB << 20;
+    uint32_t const end = max_u32(kernel_end, min_u32(ram_end, max_end));
+
+    struct addr_space * const addr_space = get_curr_addr_space();
+
+    // As for the kernel image, the mapping is done in runs of pages with the
+    // same flags so that large pages can be used.
+    uint32_t run_start = kernel_end;
+    while (run_start < end) {
+        uint32_t const flags = direct_map_flags((void*)run_start);
+        uint32_t run_end = run_start + PAGE_SIZE;
+        while (run_end < end && direct_map_flags((void*)run_end) == flags) {
+            run_end += PAGE_SIZE;
+        }
+
+        void const * const paddr = (void*)run_start;
+        uint32_t const npages = (run_end - run_start) / PAGE_SIZE;
+        uint32_t num_mapped;
+        if (!map_range_in(addr_space, paddr, to_virt(paddr), npages,
+                          flags, &num_mapped)) {
+            PANIC("Cannot create direct map\n");
+        }
+        run_start = run_end;
     }
+    DIRECT_MAP_END = end;
+    LOG("Direct map covers physical range [0x0; %p[\n", (void*)end);
 }
 
 // Initialize and enable paging. After calling this function the processor uses
@@ -600,7 +1005,7 @@ void init_paging(void) {
     LOG("Kernel's page directory allocated at phy address %p\n", page_dir_phy);
 
     struct page_dir * const page_dir = to_virt(page_dir_phy);
-    memzero(page_dir, PAGE_SIZE);
+    clear_page(page_dir);
 
     // Initialize the kernel's struct addr_space with the frame we just
     // allocated for the page directory. This _must_ be done before calling any
@@ -616,6 +1021,10 @@ void init_paging(void) {
     LOG("Creating ID and higher half mappings.\n");
     create_identity_and_higher_half_mappings(page_dir);
 
+    // Map the rest of the physical memory to higher half.
+    LOG("Creating direct map.\n");
+    create_direct_map();
+
     // Set the last entry in the page directory to point to itself. This is to
     // implement recursive page tables which makes it easier to modify page
     // directories and page tables once paging is enabled.
@@ -656,28 +1065,71 @@ void init_paging(void) {
     cpu_invalidate_tlb();
 }
 
-// Check if a page table is empty, that is all of its entry have the present bit
-// set to 0.
-// @param table: The page table to test.
-// @return: true if the page table is empty, false otherwise.
-static bool page_table_is_empty(struct page_table const * const table) {
-    for (uint16_t i = 0; i < PTES_PER_PAGE; ++i) {
-        if (table->entry[i].present) {
-            return false;
-        }
+// Add a frame to the list of frames to be freed when a batch is committed.
+// @param batch: The batch.
+// @param frame: The frame to free.
+// Note: The caller must make sure that the batch is not full, see
+// batch_is_full().
+static void batch_defer_free_frame(struct paging_batch * const batch,
+                                   void * const frame) {
+    ASSERT(batch->num_frames < PAGING_BATCH_MAX_FRAMES);
+    batch->frames[batch->num_frames++] = frame;
+}
+
+// Add a large page to the list of 4MiB physical ranges to be freed when a batch
+// is committed.
+// @param batch: The batch.
+// @param frame: The address of the first frame of the range.
+// Note: The caller must make sure that the batch is not full, see
+// batch_is_full().
+static void batch_defer_free_large_frame(struct paging_batch * const batch,
+                                         void * const frame) {
+    ASSERT(batch->num_large_frames < PAGING_BATCH_MAX_LARGE_FRAMES);
+    batch->large_frames[batch->num_large_frames++] = frame;
+}
+
+// Check if a batch might not have enough room to hold the frames freed by the
+// unmapping of a single page, that is the frame mapped to the page and the
+// frame used by its page table, or by the unmapping of a single large page.
+// @param batch: The batch.
+// @return: true if the batch must be committed before unmapping another page.
+static bool batch_is_full(struct paging_batch const * const batch) {
+    return batch->num_frames + 2 > PAGING_BATCH_MAX_FRAMES ||
+        batch->num_large_frames == PAGING_BATCH_MAX_LARGE_FRAMES;
+}
+
+// Add a virtual memory range to the range that must be invalidated when a batch
+// is committed.
+// @param batch: The batch.
+// @param vaddr: The start address of the range.
+// @param len: The length of the range in bytes.
+static void batch_add_range(struct paging_batch * const batch,
+                            void const * const vaddr,
+                            size_t const len) {
+    void const * const start = get_page_addr(vaddr);
+    void const * const end = get_page_addr(vaddr + len - 1) + PAGE_SIZE;
+    if (!batch->modified) {
+        batch->start = start;
+        batch->end = end;
+        batch->modified = true;
+    } else {
+        batch->start = start < batch->start ? start : batch->start;
+        batch->end = end > batch->end ? end : batch->end;
     }
-    return true;
 }
 
 // Unmap a virtual page.
-// @param addr_space: The address space in which the unmapping should be
-// performed.
+// @param batch: The batch this unmapping is part of. The frames freed by this
+// function are only given back to the frame allocator when the batch is
+// committed.
 // @param vaddr: The address of the virtual page. Must be 4Kib aligned.
 // @param free_phy_frame: If set to true, the physical frame pointed by vaddr
 // will be freed.
-static void unmap_page_in(struct addr_space * const addr_space,
+// Note: The batch must not be full, see batch_is_full().
+static void unmap_page_in(struct paging_batch * const batch,
                           void const * const vaddr,
                           bool const free_phy_frame) {
+    struct addr_space * const addr_space = batch->addr_space;
     ASSERT(is_4kib_aligned(vaddr));
     // Since the address space of processes are sharing the kernel address, if
     // one modify kernel mappings with any address space then the lock will not
@@ -706,28 +1158,118 @@ static void unmap_page_in(struct addr_space * const addr_space,
     if (free_phy_frame) {
         uint32_t const foffset = page_table->entry[pte_idx].frame_addr;
         void * const faddr = (void*)((uint32_t)foffset << 12);
-        free_frame(faddr);
+        batch_defer_free_frame(batch, faddr);
     }
 
     memzero(&page_table->entry[pte_idx], sizeof(*page_table->entry));
+    uint16_t * const num_mapped = pde_num_mapped(addr_space, pde_idx);
+    ASSERT(*num_mapped);
+    --*num_mapped;
 
     // Check if the current page table became empty when removing the entry
     // above. If this is the case then the frame used by this table should be
+    // freed. Kernel page tables are shared by all address spaces and are never
     // freed.
-    if (page_table_is_empty(page_table)) {
+    if (!is_kernel_pde(pde_idx) && page_table_is_empty(page_table)) {
         // This was the last page in the page table. Free the frame used by the
         // page table and mark the corresponding PDE as not present.
 
-        // We need to recall get_page_dir() here. This is because if we are
-        // operating in another address space than the current, get_page_dir()
-        // had used a temp mapping to access the page dir, and that temp mapping
-        // has been overwritten by get_page_table().
-        page_dir = get_page_dir(addr_space);
         page_dir->entry[pde_idx].present = 0;
-        void const * const frame_addr =
+        // Other cpus might still be walking this page table until the batch
+        // is committed, hence its frame cannot be re-used before that.
+        void * const frame_addr =
             (void*)(page_dir->entry[pde_idx].page_table_addr << 12);
-        free_frame(frame_addr);
+        batch_defer_free_frame(batch, frame_addr);
+        memstat_add(MEMSTAT_PAGE_TABLES, -PAGE_SIZE);
+    }
+}
+
+// Check if a virtual address is mapped by a large page.
+// @param addr_space: The address space to test.
+// @param vaddr: The virtual address.
+// @return: true if the PDE of `vaddr` maps a large page, false otherwise.
+static bool is_large_page(struct addr_space * const addr_space,
+                          void const * const vaddr) {
+    union pde_t const pde = get_page_dir(addr_space)->entry[pde_index(vaddr)];
+    return pde.present && pde.page_size;
+}
+
+// Unmap an entire large page.
+// @param batch: The batch this unmapping is part of.
+// @param vaddr: The address of the large page. Must be 4MiB aligned.
+// @param free_phy_frame: If set to true, the 4MiB physical range mapped by the
+// large page will be freed.
+// Note: The batch must not be full, see batch_is_full().
+static void unmap_large_page_in(struct paging_batch * const batch,
+                                void const * const vaddr,
+                                bool const free_phy_frame) {
+    struct addr_space * const addr_space = batch->addr_space;
+    ASSERT(is_large_page_aligned(vaddr));
+    ASSERT(addr_space == get_kernel_addr_space() || (is_user_addr(vaddr)));
+
+    uint16_t const pde_idx = pde_index(vaddr);
+    union pde_t const pde = get_page_dir(addr_space)->entry[pde_idx];
+    ASSERT(pde.present && pde.page_size);
+
+    if (free_phy_frame) {
+        batch_defer_free_large_frame(batch,
+            (void*)(pde.page_table_addr << 12));
+    }
+
+    union pde_t new_pde;
+    if (is_kernel_pde(pde_idx)) {
+        // Put back the page table of the PDE. It is empty since it had to be
+        // when the large page was mapped.
+        new_pde = make_table_pde(KERNEL_PAGE_TABLES[pde_idx], false);
+    } else {
+        new_pde.val = 0;
+    }
+    set_pde(addr_space, pde_idx, new_pde);
+    *pde_num_mapped(addr_space, pde_idx) = 0;
+}
+
+// Replace a large page by a given page table, filled with the equivalent 4KiB
+// mappings.
+// @param addr_space: The address space to modify.
+// @param pde_idx: The index of the PDE mapping the large page.
+// @param table_phy: The physical address of the page table to use.
+static void split_large_page_with(struct addr_space * const addr_space,
+                                  uint16_t const pde_idx,
+                                  struct page_table * const table_phy) {
+    union pde_t const pde = get_page_dir(addr_space)->entry[pde_idx];
+    ASSERT(pde.present && pde.page_size);
+
+    // The table must be filled before being installed in the PDE, other cpus
+    // might be accessing the large page concurrently.
+    struct page_table * const table = cpu_paging_enabled() ?
+        kmap(KMAP_COPY, table_phy) : to_virt(table_phy);
+    for (uint16_t i = 0; i < PTES_PER_PAGE; ++i) {
+        table->entry[i] = large_pde_pte(pde, i);
+    }
+
+    set_pde(addr_space, pde_idx, make_table_pde(table_phy,
+        pde.user_accessible));
+}
+
+// Replace a large page by a page table containing the equivalent 4KiB mappings.
+// @param addr_space: The address space to modify.
+// @param vaddr: An address within the large page.
+// Note: Splitting a large page in a user PDE requires allocating a page table.
+// Unmapping cannot fail, hence this function panics if no frame is available.
+static void split_large_page_in(struct addr_space * const addr_space,
+                                void const * const vaddr) {
+    uint16_t const pde_idx = pde_index(vaddr);
+    struct page_table * table_phy;
+    if (is_kernel_pde(pde_idx)) {
+        table_phy = KERNEL_PAGE_TABLES[pde_idx];
+    } else {
+        table_phy = alloc_page_table();
+        if (table_phy == NO_FRAME) {
+            PANIC("Cannot allocate page table to split large page at %p",
+                vaddr);
+        }
     }
+    split_large_page_with(addr_space, pde_idx, table_phy);
 }
 
 // Compute the offset within a page of an address.
@@ -737,34 +1279,104 @@ static uint32_t page_offset(void const * const addr) {
     return (uint32_t)addr & 0xFFF;
 }
 
-// Execute a TLB-Shootdown if required, that is if other cpus on the system are
-// online.
-static void maybe_to_tlb_shootdown(void) {
+void paging_flush_tlb_range(void const * const vaddr, uint32_t const num_pages) {
+    if (!num_pages || num_pages > TLB_FLUSH_MAX_INVLPG) {
+        cpu_invalidate_tlb();
+        return;
+    }
+
+    void const * const start = get_page_addr(vaddr);
+    for (uint32_t i = 0; i < num_pages; ++i) {
+        cpu_invlpg(start + i * PAGE_SIZE);
+    }
+
+    // Page tables might have been allocated or freed while modifying the range,
+    // invalidate their entries in the recursive mapping as well.
+    uint32_t const first_pde = pde_index(start);
+    uint32_t const last_pde = pde_index(start + (num_pages - 1) * PAGE_SIZE);
+    for (uint32_t pde = first_pde; pde <= last_pde; ++pde) {
+        cpu_invlpg((void*)((RECURSIVE_PDE_IDX << 22) | (pde << 12)));
+    }
+}
+
+// Invalidate the TLB entries of a modified virtual memory range on all cpus that
+// might have them cached. The current cpu flushes its TLB if needed and a TLB
+// shootdown is sent to the remote cpus, if any are online.
+// @param addr_space: The address space that has been modified.
+// @param vaddr: The start address of the modified range.
+// @param len: The length of the modified range in bytes. If 0, the entire TLB
+// is flushed.
+static void maybe_to_tlb_shootdown(struct addr_space * const addr_space,
+                                   void const * const vaddr,
+                                   size_t const len) {
+    // A num_pages of 0 requests a full flush.
+    uint32_t const num_pages = len ?
+        ceil_x_over_y_u32(len + page_offset(vaddr), PAGE_SIZE) : 0;
+
+    // Kernel mappings are shared by all address spaces, any cpu might have
+    // them cached in its TLB.
+    bool const shared = addr_space == get_kernel_addr_space() ||
+        vaddr >= (void*)KERNEL_PHY_OFFSET;
+
+    if (shared || addr_space == get_curr_addr_space()) {
+        paging_flush_tlb_range(vaddr, num_pages);
+    }
     if (aps_are_online()) {
-        exec_tlb_shootdown();
+        exec_tlb_shootdown(shared ? NULL : addr_space, vaddr, num_pages);
+    }
+}
+
+void paging_batch_begin(struct paging_batch * const batch,
+                        struct addr_space * const addr_space) {
+    batch->addr_space = addr_space;
+    batch->modified = false;
+    batch->start = NULL;
+    batch->end = NULL;
+    batch->num_frames = 0;
+    batch->num_large_frames = 0;
+}
+
+void paging_batch_commit(struct paging_batch * const batch) {
+    if (batch->modified) {
+        maybe_to_tlb_shootdown(batch->addr_space, batch->start,
+            batch->end - batch->start);
+    }
+
+    // All cpus are done using the old translations, the frames can safely be
+    // re-used.
+    free_frames(batch->num_frames, batch->frames);
+    for (uint32_t i = 0; i < batch->num_large_frames; ++i) {
+        free_contiguous_frames(batch->large_frames[i], MAX_FRAME_ORDER);
     }
+    paging_batch_begin(batch, batch->addr_space);
 }
 
 // Map a virtual memory region to a physical one.
-// @param addr_space: The address space in which the mapping should be added.
+// @param batch: The batch this mapping is part of. Its address space is the one
+// in which the mapping should be added.
 // @param paddr: The physical address to map the virtual address to.
 // @param vaddr: The virtual address.
 // @param len: The length in byte of the memory region. Note that mapping should
 // ideally be multiple of PAGE_SIZE (since that is the granularity), but this
 // field does not have to be.
 // @param flags: The attributes of the mapping. See VM_* macros in paging.h.
+// @param num_mapped: Output parameter, set to the number of pages that have
+// been mapped by this function.
 // Note: The addresses do not have to be 4KiB aligned, the mapping function will
 // take care of that. However they need to have the same page offset (lower 12
 // bits).
 // @return: true if the mapping was succesful, false otherwise. If this
-// function returns false then the paging structure/addr space is guaranteed to
-// be untouched.
+// function returns false then the first `*num_mapped` pages are mapped and must
+// be unmapped by the caller, after releasing the lock, using
+// do_paging_batch_unmap(). This is because unmapping them might require
+// committing the batch.
 // Note: This function assumes that the virtual address space is locked.
-static bool do_paging_map_in(struct addr_space * const addr_space,
+static bool do_paging_map_in(struct paging_batch * const batch,
                              void const * const paddr,
                              void const * const vaddr,
                              size_t const len,
-                             uint32_t const flags) {
+                             uint32_t const flags,
+                             uint32_t * const num_mapped) {
     // This function accepts addresses that are not page aligned. However they
     // at least need to share the same page offset, otherwise there is probably
     // an issue in the caller.
@@ -778,77 +1390,134 @@ static bool do_paging_map_in(struct addr_space * const addr_space,
 
     // Map the pages.
     uint32_t const num_frames = ceil_x_over_y_u32(fixed_len, PAGE_SIZE);
-    for (size_t i = 0; i < num_frames; ++i) {
-        void const * const pchunk = start_phy + i * PAGE_SIZE;
-        void const * const vchunk = start_virt + i * PAGE_SIZE;
-        if (!map_page_in(addr_space, pchunk, vchunk, flags)) {
-            // The mapping failed because we ran out of memory to allocate a new
-            // page table. Undo all the mapped frames above and return failure.
-            SET_ERROR("Failed to map one frame in request", ENONE);
-            for (size_t j = 0; j < i; ++j) {
-                unmap_page_in(addr_space, start_virt + j * PAGE_SIZE, false);
-            }
-            return false;
+    if (!map_range_in(batch->addr_space, start_phy, start_virt, num_frames,
+                      flags, num_mapped)) {
+        // The mapping failed because we ran out of memory to allocate a new
+        // page table.
+        if (*num_mapped) {
+            batch_add_range(batch, start_virt, *num_mapped * PAGE_SIZE);
         }
+        return false;
     }
+    batch_add_range(batch, start_virt, num_frames * PAGE_SIZE);
     return true;
 }
 
-bool paging_map_in(struct addr_space * const addr_space,
-                   void const * const paddr,
-                   void const * const vaddr,
-                   size_t const len,
-                   uint32_t const flags) {
-    spinlock_lock(&addr_space->lock);
-    bool const res = do_paging_map_in(addr_space, paddr, vaddr, len, flags);
-    spinlock_unlock(&addr_space->lock);
-
-    if (res) {
-        cpu_invalidate_tlb();
-        maybe_to_tlb_shootdown();
-    }
-    return res;
-}
-
 // Unmap a virtual memory region.
-// @param addr_space: The address space in which the mapping should be removed.
+// @param batch: The batch this unmapping is part of. Its address space is the
+// one in which the mapping should be removed.
 // @param vaddr: The virtual address to unmap.
 // @param len: The length of the memory area.
 // @param free_phy_frame: If true, the physical frame mapped to the memory
-// region will be freed.
-static void do_paging_unmap_in(struct addr_space * const addr_space,
-                               void const * const vaddr,
-                               size_t const len,
-                               bool const free_phy_frame) {
+// region will be freed once the batch is committed.
+// Note: This function assumes that the address space is _not_ locked. The batch
+// might need to be committed in the middle of the unmapping if it does not have
+// enough room to hold the frames to be freed, and committing cannot be done
+// within the critical section.
+static void do_paging_batch_unmap(struct paging_batch * const batch,
+                                  void const * const vaddr,
+                                  size_t const len,
+                                  bool const free_phy_frame) {
+    struct addr_space * const addr_space = batch->addr_space;
     void const * const start_virt = get_page_addr(vaddr);
     size_t const fixed_len = len + (uint32_t)(vaddr - start_virt);
-
     uint32_t const num_frames = ceil_x_over_y_u32(fixed_len, PAGE_SIZE);
-    for (size_t i = 0; i < num_frames; ++i) {
-        unmap_page_in(addr_space, start_virt + i * PAGE_SIZE, free_phy_frame);
+    TRACEPOINT(paging_unmap, "as=%p vaddr=%p len=%u free=%u", addr_space,
+               vaddr, len, free_phy_frame);
+
+    uint32_t i = 0;
+    while (i < num_frames) {
+        uint32_t const chunk_start = i;
+        lock_addr_space(addr_space);
+        while (i < num_frames && !batch_is_full(batch)) {
+            void const * const page = start_virt + i * PAGE_SIZE;
+            if (is_large_page(addr_space, page)) {
+                if (is_large_page_aligned(page) &&
+                    num_frames - i >= PTES_PER_PAGE) {
+                    unmap_large_page_in(batch, page, free_phy_frame);
+                    i += PTES_PER_PAGE;
+                    continue;
+                }
+                // Only part of the large page is unmapped.
+                split_large_page_in(addr_space, page);
+            }
+            unmap_page_in(batch, page, free_phy_frame);
+            ++i;
+        }
+        unlock_addr_space(addr_space);
+
+        if (i > chunk_start) {
+            batch_add_range(batch, start_virt + chunk_start * PAGE_SIZE,
+                (i - chunk_start) * PAGE_SIZE);
+        }
+        if (i < num_frames) {
+            // Out of room to hold the frames to be freed.
+            paging_batch_commit(batch);
+        }
     }
 }
 
+bool paging_batch_map(struct paging_batch * const batch,
+                      void const * const paddr,
+                      void const * const vaddr,
+                      size_t const len,
+                      uint32_t const flags) {
+    TRACEPOINT(paging_map, "as=%p vaddr=%p paddr=%p len=%u flags=%x",
+               batch->addr_space, vaddr, paddr, len, flags);
+    uint32_t num_mapped;
+    lock_addr_space(batch->addr_space);
+    bool const res = do_paging_map_in(batch, paddr, vaddr, len, flags,
+        &num_mapped);
+    unlock_addr_space(batch->addr_space);
+
+    if (!res) {
+        SET_ERROR("Failed to map one frame in request", ENONE);
+        // Undo all the mapped frames.
+        do_paging_batch_unmap(batch, vaddr, num_mapped * PAGE_SIZE, false);
+    }
+    return res;
+}
+
+void paging_batch_unmap(struct paging_batch * const batch,
+                        void const * const vaddr,
+                        size_t const len) {
+    do_paging_batch_unmap(batch, vaddr, len, false);
+}
+
+void paging_batch_unmap_and_free_frames(struct paging_batch * const batch,
+                                        void const * const vaddr,
+                                        size_t const len) {
+    do_paging_batch_unmap(batch, vaddr, len, true);
+}
+
+bool paging_map_in(struct addr_space * const addr_space,
+                   void const * const paddr,
+                   void const * const vaddr,
+                   size_t const len,
+                   uint32_t const flags) {
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+    bool const res = paging_batch_map(&batch, paddr, vaddr, len, flags);
+    paging_batch_commit(&batch);
+    return res;
+}
+
 void paging_unmap_in(struct addr_space * const addr_space,
                      void const * const vaddr,
                      size_t const len) {
-    spinlock_lock(&addr_space->lock);
-    do_paging_unmap_in(addr_space, vaddr, len, false);
-    spinlock_unlock(&addr_space->lock);
-
-    cpu_invalidate_tlb();
-    maybe_to_tlb_shootdown();
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+    paging_batch_unmap(&batch, vaddr, len);
+    paging_batch_commit(&batch);
 }
 
 void paging_unmap_and_free_frames_in(struct addr_space * const addr_space,
                                      void const * const vaddr,
                                      size_t const len) {
-    lock_addr_space(addr_space);
-    do_paging_unmap_in(addr_space, vaddr, len, true);
-    unlock_addr_space(addr_space);
-
-    cpu_invalidate_tlb();
-    maybe_to_tlb_shootdown();
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+    paging_batch_unmap_and_free_frames(&batch, vaddr, len);
+    paging_batch_commit(&batch);
 }
 
 // Check if a virtual page is currently mapped to a frame in physical memory.
@@ -864,6 +1533,8 @@ static bool page_is_mapped(struct addr_space * const addr_space,
     uint32_t const pte_idx = pte_index(vaddr);
     if (!page_dir->entry[pde_idx].present) {
         return false;
+    } else if (page_dir->entry[pde_idx].page_size) {
+        return true;
     }
     struct page_table * const table = get_page_table(page_dir, pde_idx);
     bool const mapped = table->entry[pte_idx].present;
@@ -906,13 +1577,17 @@ static uint32_t compute_hole_size(struct addr_space * const addr_space,
     // hole.
     for (uint16_t i = start_pde_idx; i < PDES_PER_PAGE - 2; ++i) {
         union pde_t const * const pde = &page_dir->entry[i];
-        if (!pde->present) {
+        uint16_t const num_mapped = *pde_num_mapped(addr_space, i);
+        if (!pde->present || !num_mapped) {
             if (i == start_pde_idx) {
                 count += PTES_PER_PAGE - pte_index(vaddr);
             } else {
                 count += PTES_PER_PAGE;
             }
             continue;
+        } else if (pde->page_size || num_mapped == PTES_PER_PAGE) {
+            // Fully mapped, the hole ends here.
+            return count;
         }
 
         struct page_table * const page_table = get_page_table(page_dir,i);
@@ -937,18 +1612,71 @@ static uint32_t compute_hole_size(struct addr_space * const addr_space,
 // @param start_addr: The start address to search from.
 // @parma npages: The minimum number of contiguous non mapped pages to look for.
 // @return: The start virtual address of the memory region.
+// Note: The search relies on the per-PDE counters of mapped pages to skip empty
+// and full PDEs without reading their page table. Only the page tables of
+// partially mapped PDEs are scanned, each PTE is inspected at most once.
+// Note: The pages of the lazy segments of the address space are considered
+// mapped.
 static void *do_paging_find_contiguous_non_mapped_pages_in(
     struct addr_space * const addr_space,
     void * const start_addr,
     size_t const npages) {
 
-    void * ptr = find_next_non_mapped_page(addr_space, start_addr);
-    while (ptr != NO_REGION) {
-        uint32_t const hole = compute_hole_size(addr_space, ptr);
-        if (hole >= npages) {
-            return ptr;
+    // We can only search up to the address which is the first address of the
+    // temp mapping page table.
+    uint32_t const max_page = TEMP_MAP_PDE_IDX * PTES_PER_PAGE;
+    uint32_t page = (uint32_t)start_addr >> 12;
+    // The current hole is [hole_start; hole_start + hole_size[, in pages.
+    uint32_t hole_start = page;
+    uint32_t hole_size = 0;
+
+    bool found = false;
+    while (!found && (page < max_page || hole_size >= npages)) {
+        if (hole_size >= npages) {
+            // Pages of lazy segments are reserved, the hole cannot contain any.
+            void * const start = (void*)(hole_start << 12);
+            struct vm_segment const * const segment = addr_space_find_segment(
+                addr_space, start, start + npages * PAGE_SIZE);
+            if (segment) {
+                page = (uint32_t)segment->end >> 12;
+                hole_start = page;
+                hole_size = 0;
+            } else {
+                found = true;
+            }
+            continue;
+        }
+
+        uint16_t const pde_idx = page / PTES_PER_PAGE;
+        uint16_t const pte_idx = page % PTES_PER_PAGE;
+        uint16_t const num_mapped = *pde_num_mapped(addr_space, pde_idx);
+        if (!num_mapped) {
+            // The rest of the PDE is free.
+            hole_size += PTES_PER_PAGE - pte_idx;
+            page += PTES_PER_PAGE - pte_idx;
+        } else if (num_mapped == PTES_PER_PAGE) {
+            // The entire PDE is mapped, the hole can only start after it.
+            page += PTES_PER_PAGE - pte_idx;
+            hole_start = page;
+            hole_size = 0;
+        } else {
+            struct page_dir * const page_dir = get_page_dir(addr_space);
+            struct page_table const * const table =
+                get_page_table(page_dir, pde_idx);
+            for (uint16_t i = pte_idx; i < PTES_PER_PAGE && hole_size < npages;
+                 ++i, ++page) {
+                if (table->entry[i].present) {
+                    hole_start = page + 1;
+                    hole_size = 0;
+                } else {
+                    hole_size ++;
+                }
+            }
         }
-        ptr = find_next_non_mapped_page(addr_space, ptr + PAGE_SIZE);
+    }
+
+    if (found) {
+        return (void*)(hole_start << 12);
     }
 
     // Could not find a hole big enough.
@@ -969,11 +1697,12 @@ void *paging_find_contiguous_non_mapped_pages_in(
     return res;
 }
 
-void *paging_map_frames_above_in(struct addr_space * const addr_space,
-                                 void * const start_addr,
-                                 void ** frames,
-                                 size_t const npages,
-                                 uint32_t const flags) {
+void *paging_batch_map_frames_above(struct paging_batch * const batch,
+                                    void * const start_addr,
+                                    void ** frames,
+                                    size_t const npages,
+                                    uint32_t const flags) {
+    struct addr_space * const addr_space = batch->addr_space;
     lock_addr_space(addr_space);
     void * const start = do_paging_find_contiguous_non_mapped_pages_in(
         addr_space, start_addr, npages);
@@ -985,37 +1714,127 @@ void *paging_map_frames_above_in(struct addr_space * const addr_space,
 
     for (size_t i = 0; i < npages; ++i) {
         void const * const frame = frames[i];
-        bool const res = do_paging_map_in(addr_space,
+        uint32_t num_mapped;
+        bool const res = do_paging_map_in(batch,
                                           frame,
                                           start + i * PAGE_SIZE,
                                           PAGE_SIZE,
-                                          flags);
+                                          flags,
+                                          &num_mapped);
         if (!res) {
+            unlock_addr_space(addr_space);
             // This is not exactly what happens but it is better for the caller
             // to deal with a single error return value than 2.
             SET_ERROR("Could not map frames in virtual mem space hole", ENONE);
+            // Undo the frames mapped so far.
+            do_paging_batch_unmap(batch, start, (i + num_mapped) * PAGE_SIZE,
+                false);
             return NO_REGION;
         }
     }
     unlock_addr_space(addr_space);
+    return start;
+}
 
+void *paging_map_frames_above_in(struct addr_space * const addr_space,
+                                 void * const start_addr,
+                                 void ** frames,
+                                 size_t const npages,
+                                 uint32_t const flags) {
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+    void * const start = paging_batch_map_frames_above(&batch, start_addr,
+        frames, npages, flags);
     // TLB invalidation must be done outside the critical section.
-    cpu_invalidate_tlb();
-    maybe_to_tlb_shootdown();
+    paging_batch_commit(&batch);
+    return start;
+}
+
+// Find a hole in which a physical range can be mapped using large pages, that
+// is a hole starting at an address with the same offset within a large page as
+// the physical range.
+// @param addr_space: The address space in which the search should be carried
+// out.
+// @param start_addr: The start address to search from.
+// @param paddr: The physical address of the range.
+// @param npages: The size of the range in number of pages.
+// @return: The start virtual address of the hole, NO_REGION if no such hole
+// has been found.
+// Note: This function assumes the virtual address space is locked.
+static void *find_large_page_hole(struct addr_space * const addr_space,
+                                  void * const start_addr,
+                                  void const * const paddr,
+                                  uint32_t const npages) {
+    uint32_t const offset = (uint32_t)paddr & (LARGE_PAGE_SIZE - 1);
+    void * const max_ptr = (void*)(TEMP_MAP_PDE_IDX << 22);
+    void * ptr = (void*)(((uint32_t)start_addr & ~(LARGE_PAGE_SIZE - 1)) |
+        offset);
+    if (ptr < start_addr) {
+        ptr += LARGE_PAGE_SIZE;
+    }
+
+    for (; ptr < max_ptr; ptr += LARGE_PAGE_SIZE) {
+        if (!page_is_mapped(addr_space, ptr) &&
+            compute_hole_size(addr_space, ptr) >= npages) {
+            return ptr;
+        }
+    }
+    return NO_REGION;
+}
+
+void *paging_map_range_above_in(struct addr_space * const addr_space,
+                                void * const start_addr,
+                                void const * const paddr,
+                                size_t const len,
+                                uint32_t const flags) {
+    ASSERT(is_4kib_aligned(paddr));
+    uint32_t const npages = ceil_x_over_y_u32(len, PAGE_SIZE);
+
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
 
+    lock_addr_space(addr_space);
+    void * start = NO_REGION;
+    if (npages >= PTES_PER_PAGE) {
+        // Only worth it if at least one large page can be used.
+        start = find_large_page_hole(addr_space, start_addr, paddr, npages);
+    }
+    if (start == NO_REGION) {
+        start = do_paging_find_contiguous_non_mapped_pages_in(addr_space,
+            start_addr, npages);
+    }
+    if (start == NO_REGION) {
+        // Cannot find a region big enough to map the range to.
+        unlock_addr_space(addr_space);
+        return NO_REGION;
+    }
+
+    uint32_t num_mapped;
+    bool const res = do_paging_map_in(&batch, paddr, start, len, flags,
+        &num_mapped);
+    unlock_addr_space(addr_space);
+
+    if (!res) {
+        SET_ERROR("Could not map range in virtual mem space hole", ENONE);
+        // Undo the pages mapped so far.
+        do_paging_batch_unmap(&batch, start, num_mapped * PAGE_SIZE, false);
+        start = NO_REGION;
+    }
+    // TLB invalidation must be done outside the critical section.
+    paging_batch_commit(&batch);
     return start;
 }
 
 void paging_setup_new_page_dir(void * const page_dir_phy_addr) {
     // Copy each entry in the new page directory.
     struct page_dir const * const curr_pd = get_page_dir(get_curr_addr_space());
-    struct page_dir * const dest_pd = create_temp_mapping(page_dir_phy_addr);
+    struct page_dir * const dest_pd = kmap(KMAP_COPY, page_dir_phy_addr);
 
     // Getting a pointer on the page dir of the current address space should not
     // use a temp mapping but the recursive entry instead.
     ASSERT(curr_pd != dest_pd);
 
-    memzero(dest_pd, PAGE_SIZE);
+    clear_page(dest_pd);
 
     uint16_t const start_idx = pde_index(KERNEL_PHY_OFFSET);
     for (uint16_t i = start_idx; i < PDES_PER_PAGE - 1; ++i) {
@@ -1045,14 +1864,15 @@ void paging_free_addr_space(struct addr_space * const addr_space) {
     // Don't touch at kernel page tables.
     uint16_t const max_index = pde_index(KERNEL_PHY_OFFSET);
     for (uint16_t i = 0; i < max_index; ++i) {
-        // We need to recall get_page_dir() here. This is because if we are
-        // operating in another address space than the current, get_page_dir()
-        // had used a temp mapping to access the page dir, and that temp mapping
-        // has been overwritten by get_page_table().
         struct page_dir * const page_dir = get_page_dir(addr_space);
         union pde_t pde = page_dir->entry[i];
         if (!pde.present) {
             continue;
+        } else if (pde.page_size) {
+            // Large pages do not use a page table.
+            free_contiguous_frames((void*)(pde.page_table_addr << 12),
+                MAX_FRAME_ORDER);
+            continue;
         }
 
         struct page_table * const page_table = get_page_table(page_dir, i);
@@ -1070,12 +1890,532 @@ void paging_free_addr_space(struct addr_space * const addr_space) {
         // Free the physical frame used to hold the page table.
         void * const frame = (void*)(pde.page_table_addr << 12);
         free_frame(frame);
+        memstat_add(MEMSTAT_PAGE_TABLES, -PAGE_SIZE);
     }
 
-    // Free the physical frame used for the page dir.
+    // Free the physical frame used for the page dir, see
+    // create_new_addr_space().
     free_frame(addr_space->page_dir_phy_addr);
+    memstat_add(MEMSTAT_PAGE_TABLES, -PAGE_SIZE);
+
+    // No cpu is using this address space anymore, hence this shootdown has no
+    // target. It is kept in case this assumption is broken in the future.
+    maybe_to_tlb_shootdown(addr_space, NULL, 0);
+}
+
+// Copy a user page table of an address space into a page table of another
+// address space, sharing the frames. Writable pages are made read-only and
+// copy-on-write in the source table, the copied entries are identical.
+// @param src: The address space to copy from.
+// @param pde_idx: The index of the PDE of the page table to copy.
+// @param dst_table_phy: The physical address of the page table to copy into.
+// Must be zeroed.
+// @param num_copied: Output parameter, set to the number of pages copied.
+// @return: true on success, false if a reference could not be taken on a frame,
+// in which case only the first `*num_copied` present pages have been copied.
+static bool clone_page_table(struct addr_space * const src,
+                             uint16_t const pde_idx,
+                             struct page_table * const dst_table_phy,
+                             uint16_t * const num_copied) {
+    // The source and destination tables use different kmap slots, the entries
+    // can be copied directly.
+    struct page_table * const src_table =
+        get_page_table(get_page_dir(src), pde_idx);
+    struct page_table * const dst_table = kmap(KMAP_COPY, dst_table_phy);
+    *num_copied = 0;
+    for (uint16_t i = 0; i < PTES_PER_PAGE; ++i) {
+        union pte_t pte = src_table->entry[i];
+        if (!pte.present) {
+            continue;
+        } else if (!frame_get((void*)(pte.frame_addr << 12))) {
+            return false;
+        }
+        if (pte.writable) {
+            pte.writable = 0;
+            pte.cow = 1;
+            src_table->entry[i] = pte;
+        }
+        dst_table->entry[i] = pte;
+        ++*num_copied;
+    }
+    return true;
+}
+
+bool paging_clone_user_mappings(struct addr_space * const src,
+                                struct addr_space * const dst) {
+    // The user part of the kernel address space maps frames it does not own
+    // (e.g. the identity mapping), those cannot be shared.
+    ASSERT(src != get_kernel_addr_space());
+    ASSERT(cpu_paging_enabled());
+
+    bool res = true;
+    lock_addr_space(src);
+    for (uint16_t i = 0; i < KERNEL_MIN_PDE_IDX && res; ++i) {
+        union pde_t const pde = get_page_dir(src)->entry[i];
+        if (!pde.present) {
+            continue;
+        }
+
+        if (pde.page_size) {
+            // Pages are copied 4KiB at a time upon write, split large pages.
+            struct page_table * const table = alloc_page_table();
+            if (table == NO_FRAME) {
+                SET_ERROR("Cannot allocate page table to split large page",
+                    ENOMEM);
+                res = false;
+                break;
+            }
+            split_large_page_with(src, i, table);
+        }
+
+        struct page_table * const dst_table = alloc_page_table();
+        if (dst_table == NO_FRAME) {
+            SET_ERROR("Cannot allocate page table for cloned addr space",
+                ENOMEM);
+            res = false;
+            break;
+        }
+
+        uint16_t num_copied;
+        if (!clone_page_table(src, i, dst_table, &num_copied)) {
+            SET_ERROR("Cannot share frame with cloned addr space", ENONE);
+            res = false;
+        }
+
+        // Even in case of failure the table is installed, so that the
+        // references taken so far are dropped when `dst` is deleted.
+        get_page_dir(dst)->entry[i] = make_table_pde(dst_table,
+            pde.user_accessible);
+        dst->pde_num_mapped[i] = num_copied;
+    }
+    unlock_addr_space(src);
+
+    // Some writable pages of the source address space are now read-only.
+    maybe_to_tlb_shootdown(src, NULL, 0);
+    return res;
+}
+
+// Fill the page of a lazy segment.
+// @param segment: The segment.
+// @param page: The page to fill. Must be mapped and writable in the current
+// address space.
+static void fill_segment_page(struct vm_segment const * const segment,
+                              void * const page) {
+    void * const data_end = segment->data_start + segment->data_len;
+    void * const page_end = page + PAGE_SIZE;
+    void * const start = page < segment->data_start ? segment->data_start : page;
+    void * const end = page_end < data_end ? page_end : data_end;
+
+    // The first byte of the page that is not read from the file.
+    void * zero_start = page;
+    if (start < end) {
+        memzero(page, start - page);
+        off_t const offset = segment->offset + (start - segment->data_start);
+        size_t const len = end - start;
+        // Copy straight from the file's memory when possible (e.g. initrd),
+        // skipping the filesystem and disk layers.
+        void const * const src = vfs_mmap_readonly(segment->file, offset, len);
+        if (src) {
+            memcpy(start, src, len);
+            zero_start = end;
+        } else {
+            zero_start = start + vfs_read(segment->file, offset, start, len);
+        }
+    }
+    memzero(zero_start, page_end - zero_start);
+}
+
+// Try to map the frame of the file's page cache backing a page of a read-only
+// lazy segment, so that all the processes mapping the same file page share the
+// same frame.
+// @param addr_space: The address space, must be locked.
+// @param segment: The segment containing the page.
+// @param page: The page to map.
+// @return: true if the page is now mapped, false if the page cannot be shared
+// and must be filled in a private frame instead.
+static bool map_shared_segment_page(struct addr_space * const addr_space,
+                                    struct vm_segment const * const segment,
+                                    void * const page) {
+    void * const data_end = segment->data_start + segment->data_len;
+    if (segment->flags & VM_WRITE || page < segment->data_start ||
+        page >= data_end) {
+        return false;
+    }
+    off_t const offset = segment->offset + (page - segment->data_start);
+    if (offset % PAGE_SIZE) {
+        return false;
+    }
+    uint32_t len;
+    void * const frame = vfs_get_page(segment->file, offset / PAGE_SIZE, &len);
+    if (frame == NO_FRAME) {
+        return false;
+    }
+    // The frame is zeroed after the end of the file. Hence it can only be used
+    // if the segment's data covers the whole page, or stops exactly where the
+    // file does.
+    uint32_t const needed = min_u32(data_end - page, PAGE_SIZE);
+    if (len != needed || !map_page_in(addr_space, frame, page, segment->flags)) {
+        free_frame(frame);
+        return false;
+    }
+    return true;
+}
 
-    maybe_to_tlb_shootdown();
+// Try to map the frame of the segment image of a read-only lazy segment for a
+// page that was already filled by another address space.
+// @param addr_space: The address space, must be locked.
+// @param segment: The segment containing the page.
+// @param page: The page to map.
+// @return: true if the page is now mapped, false if the page must be filled.
+static bool map_segment_image_page(struct addr_space * const addr_space,
+                                   struct vm_segment const * const segment,
+                                   void * const page) {
+    if (!segment->image) {
+        return false;
+    }
+    void * const frame = segment_image_get_frame(segment->image, page);
+    if (frame == NO_FRAME) {
+        return false;
+    }
+    if (!map_page_in(addr_space, frame, page, segment->flags)) {
+        free_frame(frame);
+        return false;
+    }
+    return true;
+}
+
+// Resolve a fault on a non-present page of a lazy segment in the current
+// address space, by allocating and filling a frame for the page.
+// @param page: The faulting page.
+// @return: true if the page is now mapped, false otherwise.
+static bool handle_segment_fault(void * const page) {
+    struct addr_space * const addr_space = get_curr_addr_space();
+    bool res = false;
+    lock_addr_space(addr_space);
+    struct vm_segment const * const segment =
+        addr_space_find_segment(addr_space, page, page + PAGE_SIZE);
+    if (!segment || !segment->flags) {
+        // Not a lazy page, or a guard page.
+    } else if (page_is_mapped(addr_space, page)) {
+        // Another cpu mapped the page already.
+        res = true;
+    } else if (map_shared_segment_page(addr_space, segment, page) ||
+               map_segment_image_page(addr_space, segment, page)) {
+        res = true;
+    } else {
+        // Pages without any data from the file only need to be zeroed.
+        bool const has_data = page < segment->data_start + segment->data_len &&
+            segment->data_start < page + PAGE_SIZE;
+        void * const frame = has_data ? alloc_frame() : alloc_zeroed_frame();
+        // The page is mapped writable to be filled. Until its permissions are
+        // fixed below, it is only accessible from this cpu since the address
+        // space is locked and the page was not mapped before.
+        if (frame != NO_FRAME &&
+            map_page_in(addr_space, frame, page, segment->flags | VM_WRITE)) {
+            if (has_data) {
+                fill_segment_page(segment, page);
+            }
+            if (!(segment->flags & VM_WRITE)) {
+                struct page_table * const table =
+                    get_page_table(get_page_dir(addr_space), pde_index(page));
+                table->entry[pte_index(page)].writable = 0;
+                cpu_invlpg(page);
+            }
+            if (segment->image && has_data) {
+                segment_image_set_frame(segment->image, page, frame);
+            }
+            res = true;
+        } else if (frame != NO_FRAME) {
+            free_frame(frame);
+        }
+    }
+    unlock_addr_space(addr_space);
+    return res;
+}
+
+// Check if a user page of the current address space can be accessed.
+// @param addr_space: The current address space, must be locked.
+// @param page: The address of the page.
+// @param write: If true, check for write access.
+// @return: true if the page is mapped with the required access, or if an access
+// would be resolved by the page fault handler, false otherwise.
+static bool user_page_accessible(struct addr_space * const addr_space,
+                                 void const * const page,
+                                 bool const write) {
+    struct page_dir * const page_dir = get_page_dir(addr_space);
+    union pde_t const pde = page_dir->entry[pde_index(page)];
+    if (pde.present && pde.page_size) {
+        return pde.user_accessible && (!write || pde.writable);
+    } else if (pde.present) {
+        struct page_table * const table =
+            get_page_table(page_dir, pde_index(page));
+        union pte_t const pte = table->entry[pte_index(page)];
+        if (pte.present) {
+            // A write to a copy-on-write page is resolved by the fault handler.
+            return pde.user_accessible && pte.user_accessible &&
+                (!write || pte.writable || pte.cow);
+        }
+    }
+    // Not mapped yet, this is only fine if the page is part of a lazy segment.
+    struct vm_segment const * const segment =
+        addr_space_find_segment(addr_space, page, page + PAGE_SIZE);
+    return segment && segment->flags && (!write || segment->flags & VM_WRITE);
+}
+
+bool paging_user_range_accessible(void const * const addr,
+                                  size_t const len,
+                                  bool const write) {
+    void const * const end = addr + len;
+    if (!len) {
+        return true;
+    } else if (end < addr || end > (void*)KERNEL_PHY_OFFSET) {
+        return false;
+    }
+
+    struct addr_space * const addr_space = get_curr_addr_space();
+    bool res = true;
+    lock_addr_space(addr_space);
+    for (void const * page = get_page_addr(addr); res && page < end;
+         page += PAGE_SIZE) {
+        res = user_page_accessible(addr_space, page, write);
+    }
+    unlock_addr_space(addr_space);
+    return res;
+}
+
+bool paging_handle_page_fault(void const * const fault_addr,
+                              uint32_t const error_code) {
+    if (!is_user_addr(fault_addr) || !cpu_paging_enabled()) {
+        return false;
+    }
+
+    void * const page = get_page_addr(fault_addr);
+    bool const present = error_code & 0x1;
+    bool const write = error_code & 0x2;
+    if (!present) {
+        return handle_segment_fault(page);
+    } else if (!write) {
+        // Only a write to a present page can be a copy-on-write fault.
+        return false;
+    }
+
+    struct addr_space * const addr_space = get_curr_addr_space();
+    uint16_t const pde_idx = pde_index(page);
+    uint16_t const pte_idx = pte_index(page);
+
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+
+    bool res = false;
+    lock_addr_space(addr_space);
+    // The faulting address space is the current one, hence its page directory
+    // and tables are accessed through the recursive entry. The copy uses the
+    // KMAP_FAULT slot since the fault might have interrupted a kernel path
+    // using another slot.
+    struct page_dir * const page_dir = get_page_dir(addr_space);
+    union pde_t const pde = page_dir->entry[pde_idx];
+    if (pde.present && !pde.page_size) {
+        struct page_table * const table = get_page_table(page_dir, pde_idx);
+        union pte_t pte = table->entry[pte_idx];
+        if (pte.present && pte.writable) {
+            // Another cpu resolved the fault already, the TLB entry of this cpu
+            // was stale.
+            cpu_invlpg(page);
+            res = true;
+        } else if (pte.present && pte.cow) {
+            void * const old_frame = (void*)(pte.frame_addr << 12);
+            if (frame_ref_count(old_frame) == 1) {
+                // All other address spaces dropped their reference, the frame
+                // can be written in place.
+                res = true;
+            } else {
+                void * const new_frame = alloc_frame();
+                if (new_frame != NO_FRAME) {
+                    copy_page(kmap(KMAP_FAULT, new_frame), page);
+                    pte.frame_addr = (uint32_t)new_frame >> 12;
+                    // Other cpus running this address space might still read
+                    // the old frame until the batch is committed.
+                    batch_defer_free_frame(&batch, old_frame);
+                    res = true;
+                }
+            }
+
+            if (res) {
+                pte.writable = 1;
+                pte.cow = 0;
+                table->entry[pte_idx] = pte;
+                batch_add_range(&batch, page, PAGE_SIZE);
+            }
+        }
+    }
+    unlock_addr_space(addr_space);
+
+    paging_batch_commit(&batch);
+    return res;
+}
+
+// Get the PTE mapping a user page of the current address space.
+// @param addr_space: The current address space, must be locked.
+// @param page: The address of the page.
+// @return: A pointer to the PTE, NULL if the page is part of a large page or if
+// its page table does not exist.
+static union pte_t *get_user_pte(struct addr_space * const addr_space,
+                                 void const * const page) {
+    struct page_dir * const page_dir = get_page_dir(addr_space);
+    union pde_t const pde = page_dir->entry[pde_index(page)];
+    if (!pde.present || pde.page_size || !pde.user_accessible) {
+        return NULL;
+    }
+    return get_page_table(page_dir, pde_index(page))->entry + pte_index(page);
+}
+
+// Check if pages can be exchanged with the current address space, see
+// paging_loan_user_page().
+// @param page: The address of the page.
+// @return: true if the page is a user page of a process' address space.
+static bool can_loan_page(void const * const page) {
+    ASSERT(is_4kib_aligned(page));
+    // The user part of the kernel address space maps frames it does not own
+    // (e.g. the identity mapping), those cannot be exchanged.
+    return cpu_paging_enabled() && is_user_addr(page) &&
+        get_curr_addr_space() != get_kernel_addr_space();
+}
+
+void *paging_loan_user_page(void const * const page) {
+    if (!can_loan_page(page)) {
+        return NO_FRAME;
+    }
+    struct addr_space * const addr_space = get_curr_addr_space();
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+
+    void * frame = NO_FRAME;
+    lock_addr_space(addr_space);
+    union pte_t * const pte = get_user_pte(addr_space, page);
+    if (pte && pte->present && pte->user_accessible &&
+        frame_get((void*)(pte->frame_addr << 12))) {
+        frame = (void*)(pte->frame_addr << 12);
+        if (pte->writable) {
+            // Same as clone_page_table(), the lender and the borrower now
+            // share the frame until one of them writes to it.
+            union pte_t new_pte = *pte;
+            new_pte.writable = 0;
+            new_pte.cow = 1;
+            *pte = new_pte;
+            batch_add_range(&batch, page, PAGE_SIZE);
+        }
+    }
+    unlock_addr_space(addr_space);
+
+    paging_batch_commit(&batch);
+    return frame;
+}
+
+bool paging_map_loaned_page(void * const page, void * const frame) {
+    if (!can_loan_page(page)) {
+        return false;
+    }
+    struct addr_space * const addr_space = get_curr_addr_space();
+    struct paging_batch batch;
+    paging_batch_begin(&batch, addr_space);
+
+    lock_addr_space(addr_space);
+    union pte_t * pte = get_user_pte(addr_space, page);
+    if (!pte || !pte->present) {
+        // The page must be mapped to be replaced, which is not the case for
+        // pages of lazy segments that were never accessed.
+        unlock_addr_space(addr_space);
+        if (!handle_segment_fault(page)) {
+            return false;
+        }
+        lock_addr_space(addr_space);
+        pte = get_user_pte(addr_space, page);
+    }
+
+    bool res = false;
+    if (pte && pte->present && pte->user_accessible &&
+        (pte->writable || pte->cow)) {
+        union pte_t new_pte = *pte;
+        // Other cpus running this address space might still access the old
+        // frame until the batch is committed.
+        batch_defer_free_frame(&batch, (void*)(pte->frame_addr << 12));
+        new_pte.frame_addr = (uint32_t)frame >> 12;
+        new_pte.writable = 0;
+        new_pte.cow = 1;
+        *pte = new_pte;
+        batch_add_range(&batch, page, PAGE_SIZE);
+        res = true;
+    }
+    unlock_addr_space(addr_space);
+
+    paging_batch_commit(&batch);
+    return res;
+}
+
+// Count the pages mapped in a range of user memory of an address space.
+// @param addr_space: The address space, must be locked.
+// @param start: The start of the range. Must be 4KiB aligned.
+// @param end: The end of the range, excluded. Must be 4KiB aligned.
+// @return: The number of pages of the range currently mapped.
+static uint32_t count_mapped_user_pages(struct addr_space * const addr_space,
+                                       void const * const start,
+                                       void const * const end) {
+    ASSERT(is_4kib_aligned(start) && is_4kib_aligned(end));
+    ASSERT(start <= end && (start == end || is_user_addr(end - 1)));
+    uint32_t num = 0;
+    void const * page = start;
+    while (page < end) {
+        uint16_t const pde_idx = pde_index(page);
+        void const * const next_pde =
+            (void*)(((uint32_t)page & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE);
+        void const * const stop = next_pde < end ? next_pde : end;
+        struct page_dir * const page_dir = get_page_dir(addr_space);
+        union pde_t const pde = page_dir->entry[pde_idx];
+        if (pde.present && pde.page_size) {
+            num += (stop - page) / PAGE_SIZE;
+        } else if (pde.present && addr_space->pde_num_mapped[pde_idx]) {
+            struct page_table * const table = get_page_table(page_dir, pde_idx);
+            for (void const * p = page; p < stop; p += PAGE_SIZE) {
+                num += table->entry[pte_index(p)].present;
+            }
+        }
+        page = stop;
+    }
+    return num;
+}
+
+void paging_get_user_mem_stats_in(struct addr_space * const addr_space,
+                                  struct paging_user_mem_stats * const stats) {
+    ASSERT(addr_space != get_kernel_addr_space());
+    // The page directory.
+    stats->table_frames = 1;
+    stats->mapped_pages = 0;
+    stats->segment_pages = 0;
+
+    lock_addr_space(addr_space);
+    for (uint16_t i = 0; i < KERNEL_MIN_PDE_IDX; ++i) {
+        union pde_t const pde = get_page_dir(addr_space)->entry[i];
+        if (pde.present && !pde.page_size) {
+            stats->table_frames++;
+        }
+        stats->mapped_pages += addr_space->pde_num_mapped[i];
+    }
+    struct vm_segment const * segment;
+    list_for_each_entry(segment, &addr_space->segments, segment_list) {
+        stats->segment_pages +=
+            count_mapped_user_pages(addr_space, segment->start, segment->end);
+    }
+    unlock_addr_space(addr_space);
+}
+
+uint32_t paging_num_mapped_user_pages_in(struct addr_space * const addr_space,
+                                         void const * const start,
+                                         void const * const end) {
+    ASSERT(addr_space != get_kernel_addr_space());
+    lock_addr_space(addr_space);
+    uint32_t const num = count_mapped_user_pages(addr_space, start, end);
+    unlock_addr_space(addr_space);
+    return num;
 }
 
 void paging_walk(void) {
@@ -1087,7 +2427,14 @@ void paging_walk(void) {
 
     struct page_dir * const page_dir = get_page_dir(get_curr_addr_space());
     for (uint32_t i = 0; i < 1024; ++i) {
-        if (page_dir->entry[i].present) {
+        if (page_dir->entry[i].present && page_dir->entry[i].page_size) {
+            if (!int_open) {
+                int_begin = i << 22;
+                int_end = int_begin;
+                int_open = true;
+            }
+            int_end += LARGE_PAGE_SIZE;
+        } else if (page_dir->entry[i].present) {
             struct page_table * const page_table = get_page_table(page_dir, i);
             for (uint32_t j = 0; j < 1024; ++j) {
                 if (page_table->entry[j].present) {
@@ -1114,4 +2461,28 @@ void paging_walk(void) {
     }
 }
 
+void *paging_virt_to_phys(void const * const vaddr) {
+    ASSERT(cpu_paging_enabled());
+    // The recursive mapping must refer to the same page directory throughout
+    // the walk.
+    preempt_disable();
+    struct page_dir * const page_dir = get_page_dir(get_curr_addr_space());
+    uint32_t const pde_idx = pde_index(vaddr);
+    uint32_t const pte_idx = pte_index(vaddr);
+    union pde_t const pde = page_dir->entry[pde_idx];
+    union pte_t pte;
+    pte.val = 0;
+    if (pde.present && pde.page_size) {
+        pte = large_pde_pte(pde, pte_idx);
+    } else if (pde.present) {
+        pte = get_page_table(page_dir, pde_idx)->entry[pte_idx];
+    }
+    preempt_enable();
+
+    if (!pte.present) {
+        return NO_FRAME;
+    }
+    return (void*)((pte.frame_addr << 12) | ((uint32_t)vaddr & 0xFFF));
+}
+
 #include <paging.test>
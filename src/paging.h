@@ -3,6 +3,8 @@
 #include <addr_space.h>
 
 #define PAGE_SIZE   0x1000
+// The size of a large page, that is a page mapped by a single PDE (PSE).
+#define LARGE_PAGE_SIZE (1 << 22)
 
 // Initialize and enable paging.
 void init_paging(void);
@@ -18,6 +20,14 @@ void init_paging(void);
 // Do not set the global bit for the mapping of this page.
 #define VM_NON_GLOBAL       (1 << 4)
 
+// Large pages
+// ===========
+//      Mapping functions automatically use 4MiB pages (PSE) for the parts of a
+// mapping for which both the virtual and physical addresses are 4MiB aligned
+// and that span at least LARGE_PAGE_SIZE bytes. Unmapping only a part of a
+// large page splits it back into 4KiB pages first. This is transparent to the
+// callers.
+
 // Map a virtual memory region to a physical one.
 // @param addr_space: The address space in which the mapping will be performed.
 // @param paddr: The physical address to map the virtual address to. Must be
@@ -145,6 +155,142 @@ void *paging_map_frames_above_in(struct addr_space * const addr_space,
                                (npages),                            \
                                (flags))
 
+// Map a contiguous physical memory region to virtual memory above a certain
+// address. If the region is big enough, the virtual address is chosen so that
+// the mapping can use large pages, that is it has the same offset as `paddr`
+// within a large page.
+// @param addr_space: The address space to create the mapping into.
+// @param start_addr: The min virtual address to map the region to.
+// @param paddr: The physical address of the region. Must be 4KiB aligned.
+// @param len: The length of the region in bytes.
+// @param flags: The flags to use for the mapping.
+// @return: The virtual address of the mapping, or NO_REGION in case of error in
+// which case nothing is mapped.
+void *paging_map_range_above_in(struct addr_space * const addr_space,
+                                void * const start_addr,
+                                void const * const paddr,
+                                size_t const len,
+                                uint32_t const flags);
+
+// Same as paging_map_range_above_in() in the current address space.
+// @param start_addr: The min virtual address to map the region to.
+// @param paddr: The physical address of the region. Must be 4KiB aligned.
+// @param len: The length of the region in bytes.
+// @param flags: The flags to use for the mapping.
+// @return: The virtual address of the mapping, or NO_REGION.
+#define paging_map_range_above(start_addr, paddr, len, flags)   \
+    paging_map_range_above_in(get_curr_addr_space(),            \
+                              (start_addr),                     \
+                              (paddr),                          \
+                              (len),                            \
+                              (flags))
+
+// Batched map/unmap operations
+// =============================
+//      Each map/unmap function above invalidates the modified range from the TLB
+// and executes a TLB shootdown before returning. When performing many
+// operations in a row, this cost can be amortized by grouping them in a batch:
+//
+//      struct paging_batch batch;
+//      paging_batch_begin(&batch, addr_space);
+//      paging_batch_map(&batch, ...);
+//      paging_batch_unmap_and_free_frames(&batch, ...);
+//      ...
+//      paging_batch_commit(&batch);
+//
+// The TLB of the current cpu and remote cpus is invalidated once, at commit
+// time, for the union of all the modified ranges. Frames freed by unmap
+// operations (including page tables becoming empty) are only given back to the
+// frame allocator after this invalidation, since other cpus might still access
+// them through stale TLB entries until then.
+// Because of this, the old translation of a page unmapped or re-mapped within a
+// batch might still be used by any cpu until the batch is committed. Pages that
+// were not mapped before can be accessed right away.
+
+// The max number of frames a batch can defer freeing. A batch is automatically
+// committed when this number is reached.
+#define PAGING_BATCH_MAX_FRAMES 64
+// The max number of large pages (4MiB physical ranges) a batch can defer
+// freeing.
+#define PAGING_BATCH_MAX_LARGE_FRAMES 4
+
+// The state of a batch of map/unmap operations.
+struct paging_batch {
+    // The address space in which the operations are performed.
+    struct addr_space * addr_space;
+    // Indicate if any mapping has been modified since the beginning of the
+    // batch, if true then [start; end[ is the range to invalidate.
+    bool modified;
+    void const * start;
+    void const * end;
+    // The frames to be freed once the batch is committed.
+    uint32_t num_frames;
+    void * frames[PAGING_BATCH_MAX_FRAMES];
+    // The large pages to be freed once the batch is committed, each entry is
+    // the address of the first frame of a 4MiB physical range.
+    uint32_t num_large_frames;
+    void * large_frames[PAGING_BATCH_MAX_LARGE_FRAMES];
+};
+
+// Start a new batch of map/unmap operations.
+// @param batch: The batch to initialize.
+// @param addr_space: The address space in which the operations of the batch are
+// performed.
+void paging_batch_begin(struct paging_batch * const batch,
+                        struct addr_space * const addr_space);
+
+// Commit a batch: invalidate the modified range from the TLB of all cpus that
+// might have it cached and free the frames released by the operations of the
+// batch. The batch is re-initialized and can be used for more operations
+// afterwards.
+// @param batch: The batch to commit.
+// Note: As for the non-batched operations, the lock of the address space must
+// not be held when calling this function.
+void paging_batch_commit(struct paging_batch * const batch);
+
+// Same as paging_map_in(), as part of a batch.
+// @param batch: The batch.
+// @param paddr: The physical address to map the virtual address to.
+// @param vaddr: The virtual address.
+// @param len: The length in byte of the memory region.
+// @param flags: The attributes of the mapping. See VM_* macros in paging.h.
+// @return: true if the mapping was successful, false otherwise.
+bool paging_batch_map(struct paging_batch * const batch,
+                      void const * const paddr,
+                      void const * const vaddr,
+                      size_t const len,
+                      uint32_t const flags);
+
+// Same as paging_unmap_in(), as part of a batch.
+// @param batch: The batch.
+// @param vaddr: The virtual address to unmap. Must be 4KiB aligned.
+// @param len: The length of the memory area.
+void paging_batch_unmap(struct paging_batch * const batch,
+                        void const * const vaddr,
+                        size_t const len);
+
+// Same as paging_unmap_and_free_frames_in(), as part of a batch. The frames are
+// freed when the batch is committed.
+// @param batch: The batch.
+// @param vaddr: The virtual address to unmap. Must be 4KiB aligned.
+// @param len: The length of the memory area.
+void paging_batch_unmap_and_free_frames(struct paging_batch * const batch,
+                                        void const * const vaddr,
+                                        size_t const len);
+
+// Same as paging_map_frames_above_in(), as part of a batch.
+// @param batch: The batch.
+// @param start_addr: The min virtual address to map the frames to.
+// @param frames: An array containing the physical frames to be mapped.
+// @param npages: The number of physical frames to mapped.
+// @param flags: The flags to use when mapping the physical frames.
+// @return: The start virtual address of the memory region or NO_REGION.
+void *paging_batch_map_frames_above(struct paging_batch * const batch,
+                                    void * const start_addr,
+                                    void ** frames,
+                                    size_t const npages,
+                                    uint32_t const flags);
+
 // Setup a new page directory. This function will initialized the page directory
 // with the entries used by the kernel as well as the recursive entry. Any
 // address below KERNEL_PHY_OFFSET is not mapped.
@@ -152,15 +298,170 @@ void *paging_map_frames_above_in(struct addr_space * const addr_space,
 // initialize.
 void paging_setup_new_page_dir(void * const page_dir_phy_addr);
 
+// Copy all the user mappings of an address space into another one. The user
+// frames themselves are not copied but shared: writable pages are made
+// read-only and copy-on-write in both address spaces, the first write to such a
+// page copies it (see paging_handle_page_fault()). Hence the cost of a clone is
+// proportional to the number of page tables, not to the amount of memory.
+// @param src: The address space to copy. Cannot be the kernel address space.
+// @param dst: The address space to copy into. Must not contain any user
+// mapping.
+// @return: true on success, false otherwise. In case of failure `dst` contains
+// only part of the mappings and must be deleted.
+bool paging_clone_user_mappings(struct addr_space * const src,
+                                struct addr_space * const dst);
+
+// Lend the frame mapped to a user page of the current address space, so that it
+// can be mapped into another address space with paging_map_loaned_page()
+// instead of copying its content. If the page is writable, it becomes read-only
+// and copy-on-write: later writes from the current address space go to a copy
+// of the page and never reach the borrower.
+// @param page: The address of the page. Must be 4KiB aligned.
+// @return: The physical address of the frame, with a reference taken on it for
+// the borrower, NO_FRAME if the page is not a mapped user page (in which case
+// it must be copied instead).
+void *paging_loan_user_page(void const * const page);
+
+// Map a frame lent by paging_loan_user_page() to a user page of the current
+// address space, replacing its current frame. The page is mapped read-only and
+// copy-on-write, a write to it copies the frame only if the lender or another
+// borrower still maps it.
+// @param page: The address of the page. Must be 4KiB aligned and writable by
+// the user, non-present pages of lazy segments are faulted in first.
+// @param frame: The lent frame. On success, the reference on the frame is
+// transferred to the mapping.
+// @return: true on success, false if the page is not a writable user page, in
+// which case the caller keeps its reference on the frame.
+bool paging_map_loaned_page(void * const page, void * const frame);
+
+// The memory used by the user part of an address space, see
+// paging_get_user_mem_stats_in().
+struct paging_user_mem_stats {
+    // The number of frames used by the page directory and the user page tables.
+    uint32_t table_frames;
+    // The number of user pages mapped, a large page counts as 1024 pages.
+    uint32_t mapped_pages;
+    // The number of pages mapped in the lazy segments of the address space,
+    // included in `mapped_pages`.
+    uint32_t segment_pages;
+};
+
+// Get the memory used by the user part of an address space. This walks the
+// page directory and the page tables covering the lazy segments.
+// @param addr_space: The address space. Cannot be the kernel address space.
+// @param stats: Output parameter receiving the statistics.
+void paging_get_user_mem_stats_in(struct addr_space * const addr_space,
+                                  struct paging_user_mem_stats * const stats);
+
+// Count the pages mapped in a range of user memory of an address space.
+// @param addr_space: The address space. Cannot be the kernel address space.
+// @param start: The start of the range. Must be 4KiB aligned.
+// @param end: The end of the range, excluded. Must be 4KiB aligned.
+// @return: The number of pages of the range currently mapped.
+uint32_t paging_num_mapped_user_pages_in(struct addr_space * const addr_space,
+                                         void const * const start,
+                                         void const * const end);
+
+// Try to resolve a page fault in the current address space. This handles writes
+// to copy-on-write pages and the first access to pages of lazy segments (see
+// addr_space_add_segment()).
+// @param fault_addr: The faulting address, that is the value of CR2.
+// @param error_code: The error code of the page fault.
+// @return: true if the fault has been resolved and the faulting access can be
+// retried, false otherwise.
+bool paging_handle_page_fault(void const * const fault_addr,
+                              uint32_t const error_code);
+
+// Check if a range of user memory of the current address space can be accessed
+// by the kernel on behalf of the process. Pages which are not mapped yet are
+// accessible if they belong to a lazy segment of the address space.
+// @param addr: The start of the range.
+// @param len: The length of the range in bytes.
+// @param write: If true, check for write access, otherwise check for read
+// access.
+// @return: true if the range is entirely in user space and accessible, false
+// otherwise.
+// Note: This is only a snapshot of the mappings of the address space. Accesses
+// to the range must still be prepared to fault, see uaccess.h.
+bool paging_user_range_accessible(void const * const addr,
+                                  size_t const len,
+                                  bool const write);
+
+// Check if a physical range is covered by the direct map, that is if to_virt()
+// can be used to access it.
+// @param paddr: The start of the physical range.
+// @param len: The length of the range in bytes.
+// @return: true if the entire range is in the direct map, false otherwise.
+bool paging_in_direct_map(void const * const paddr, size_t const len);
+
+// Get the physical address backing a virtual address of the current address
+// space, e.g. to program a DMA transfer to/from a kernel buffer.
+// @param vaddr: The virtual address. The page containing it must stay mapped as
+// long as the physical address is in use.
+// @return: The physical address, NO_FRAME if the page is not mapped.
+void *paging_virt_to_phys(void const * const vaddr);
+
+// Kmap slots.
+// ===========
+// Each cpu owns KMAP_NUM_SLOTS fixed virtual pages in the temporary mapping
+// page table. Mapping a frame in a slot only writes the PTE of the slot and
+// invalidates it from the TLB of the current cpu, no lock and no TLB shootdown
+// are required since no other cpu ever uses those pages. Different slots can be
+// used at the same time, e.g. to copy from one frame to another.
+// A mapping is only valid on the cpu that created it and until the slot is
+// re-used, hence the caller must not be preempted nor interrupted while using
+// it. The page fault handler can run while another slot is in use, hence it only
+// uses the KMAP_FAULT slot, which must only be used by code that cannot itself
+// trigger a page fault while the mapping is in use.
+// Frames covered by the direct map (see paging_in_direct_map()) are not mapped
+// in the slot, their direct map address is returned instead.
+enum kmap_slot {
+    // Used to access the page directory of another address space.
+    KMAP_PAGE_DIR,
+    // Used to access a page table of another address space.
+    KMAP_PAGE_TABLE,
+    // General purpose slot.
+    KMAP_COPY,
+    // Used by the page fault handler and paging_zero_frame().
+    KMAP_FAULT,
+    KMAP_NUM_SLOTS,
+};
+
+// Map a physical frame in one of the kmap slots of the current cpu.
+// @param slot: The slot to use.
+// @param frame: The physical address of the frame to map. Must be page aligned.
+// @return: The virtual address of the slot, valid until the slot is re-used.
+// This function is guaranteed to succeed.
+// Note: This function must be called with interrupts disabled.
+void *paging_kmap(enum kmap_slot const slot, void const * const frame);
+
+// Fill a physical frame with zeros.
+// @param frame: The physical address of the frame.
+// Note: This uses the KMAP_FAULT slot if the frame is not in the direct map.
+void paging_zero_frame(void * const frame);
+
 // Recursively delete an address space. All physical frames mapped to user space
 // will be freed, all user page tables and the page directory will be freed as
 // well.
 // @param addr_space: The address space to de-allocate.
-// Note: This function cannot know if a particular physical frame mapped to user
-// space (or a user page table) is used by another process (or even the kernel).
-// Therefore it is not compatible with page table/frame sharing.
+// Note: Frames shared with other address spaces (see
+// paging_clone_user_mappings()) are only given back to the frame allocator once
+// their last reference is dropped. Page tables cannot be shared.
 void paging_free_addr_space(struct addr_space * const addr_space);
 
+// Ranges of pages up to this size are invalidated from the TLB one page at a
+// time using INVLPG, bigger ranges trigger a full TLB flush instead.
+#define TLB_FLUSH_MAX_INVLPG    32
+
+// Invalidate the TLB entries of a virtual memory range on the current cpu.
+// @param vaddr: The start address of the range, does not need to be page
+// aligned.
+// @param num_pages: The number of pages in the range. If 0 or greater than
+// TLB_FLUSH_MAX_INVLPG, the entire TLB is flushed instead.
+// Note: This also invalidates the entries of the recursive mapping covering the
+// page tables of the range, as those might have been freed or allocated.
+void paging_flush_tlb_range(void const * const vaddr, uint32_t const num_pages);
+
 // Debug function printing the contiguous ranges of virtual addresses that are
 // mapped in the current address space.
 void paging_walk(void);
@@ -0,0 +1,279 @@
+#include <parallel.h>
+#include <atomic.h>
+#include <percpu.h>
+#include <acpi.h>
+#include <ipm.h>
+#include <workqueue.h>
+#include <sched.h>
+#include <debug.h>
+#include <mwait.h>
+
+// The number of tasks in a deque. A task is only split if its second half fits
+// in the deque, splitting halves the size of the tasks hence this only limits
+// the parallelism of ranges of more than 2^TASK_DEQUE_SIZE grains.
+#define TASK_DEQUE_SIZE 64
+#define TASK_DEQUE_MASK (TASK_DEQUE_SIZE - 1)
+
+// The state of a parallel_for(), on the stack of its caller.
+struct pfor_job {
+    parallel_func func;
+    void * arg;
+    uint32_t grain;
+    // The number of indices not executed yet. The job is done once this
+    // reaches 0.
+    atomic_t remaining;
+    // The number of helpers recruited for the job that did not exit yet. The
+    // caller cannot return before all of them exited.
+    atomic_t helpers;
+};
+
+// A sub-range of a job.
+struct task {
+    struct pfor_job * job;
+    uint32_t start;
+    uint32_t end;
+};
+
+// A Chase-Lev deque of tasks. The owner of the deque pushes and pops tasks at
+// the bottom, other cpus steal tasks from the top.
+struct task_deque {
+    // The index of the oldest task, only incremented, through a cmpxchg.
+    atomic_t top;
+    // The index following the newest task, only written by the owner.
+    atomic_t bottom;
+    // Set while a cpu is executing tasks on this cpu, in which case it owns the
+    // deque. Nested helpers, i.e. remote calls interrupting the owner, can only
+    // steal.
+    bool owned;
+    struct task tasks[TASK_DEQUE_SIZE];
+};
+
+DECLARE_PER_CPU(struct task_deque, task_deque);
+
+// Push a task at the bottom of a deque. Only called by the owner.
+// @param dq: The deque.
+// @param task: The task to push.
+// @return: true if the task was pushed, false if the deque is full.
+static bool deque_push(struct task_deque * const dq,
+                       struct task const * const task) {
+    int32_t const b = atomic_read(&dq->bottom);
+    int32_t const t = atomic_read(&dq->top);
+    if (b - t >= TASK_DEQUE_SIZE) {
+        return false;
+    }
+    dq->tasks[b & TASK_DEQUE_MASK] = *task;
+    // The task must be visible before the new bottom.
+    atomic_write_release(&dq->bottom, b + 1);
+    return true;
+}
+
+// Pop the newest task of a deque. Only called by the owner.
+// @param dq: The deque.
+// @param task: Output parameter receiving the task.
+// @return: true if a task was popped, false if the deque is empty.
+static bool deque_pop(struct task_deque * const dq, struct task * const task) {
+    int32_t const b = atomic_read(&dq->bottom) - 1;
+    atomic_write(&dq->bottom, b);
+    // Reserve the bottom task before reading top, thieves read top before
+    // bottom. This is the store-load ordering that requires a full fence.
+    cpu_mfence();
+    int32_t t = atomic_read(&dq->top);
+    if (t > b) {
+        // The deque was empty.
+        atomic_write(&dq->bottom, b + 1);
+        return false;
+    }
+    *task = dq->tasks[b & TASK_DEQUE_MASK];
+    if (t < b) {
+        // More than one task, no thief can reach this one.
+        return true;
+    }
+    // Last task, race with the thieves for it.
+    bool const won = atomic_cmpxchg(&dq->top, &t, t + 1);
+    atomic_write(&dq->bottom, b + 1);
+    return won;
+}
+
+// Steal the oldest task of a deque.
+// @param dq: The deque.
+// @param task: Output parameter receiving the task.
+// @return: true if a task was stolen, false if the deque is empty or another
+// cpu took the task first.
+static bool deque_steal(struct task_deque * const dq, struct task * const task) {
+    int32_t t = atomic_read_acquire(&dq->top);
+    int32_t const b = atomic_read_acquire(&dq->bottom);
+    if (t >= b) {
+        return false;
+    }
+    // The slot can only be overwritten once top moved past it, in which case
+    // the cmpxchg fails and the copy is discarded.
+    struct task const stolen = dq->tasks[t & TASK_DEQUE_MASK];
+    if (!atomic_cmpxchg(&dq->top, &t, t + 1)) {
+        return false;
+    }
+    *task = stolen;
+    return true;
+}
+
+// Execute a task, splitting it first if it is larger than the grain of its job.
+// @param dq: The deque owned by the current cpu, NULL if the current cpu does
+// not own its deque, in which case the task is not split.
+// @param task: The task to execute.
+static void run_task(struct task_deque * const dq, struct task task) {
+    struct pfor_job * const job = task.job;
+    while (dq && task.end - task.start > job->grain) {
+        uint32_t const mid = task.start + (task.end - task.start) / 2;
+        struct task const second = { .job = job, .start = mid, .end = task.end };
+        if (!deque_push(dq, &second)) {
+            break;
+        }
+        task.end = mid;
+    }
+    job->func(job->arg, task.start, task.end);
+    // The job might be done and its caller gone after this.
+    atomic_sub(&job->remaining, task.end - task.start);
+}
+
+// Try to steal a task from the deques of the other cpus.
+// @param self: The current cpu.
+// @param include_self: If true, also try the deque of the current cpu.
+// @param task: Output parameter receiving the task.
+// @return: true if a task was stolen.
+static bool steal_task(uint8_t const self,
+                       bool const include_self,
+                       struct task * const task) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t i = include_self ? 0 : 1; i < ncpus; ++i) {
+        uint8_t const victim = (self + i) % ncpus;
+        if (deque_steal(&cpu_var(task_deque, victim), task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Execute the tasks of a job until it is done, helping other jobs on the way
+// if their tasks are stolen.
+// @param job: The job.
+// @param first: The first task to execute, i.e. the whole range, when called
+// by the caller of the job. NULL when called by a helper, which starts by
+// stealing.
+static void work_on_job(struct pfor_job * const job,
+                        struct task const * const first) {
+    preempt_disable();
+    uint8_t const self = cpu_id();
+    // Interrupts are disabled so that a nested helper cannot claim the deque
+    // at the same time.
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    struct task_deque * dq = &this_cpu_var(task_deque);
+    if (dq->owned) {
+        dq = NULL;
+    } else {
+        dq->owned = true;
+    }
+    cpu_set_interrupt_flag(irqs);
+
+    if (first) {
+        run_task(dq, *first);
+    }
+    while (atomic_read(&job->remaining)) {
+        struct task task;
+        if ((dq && deque_pop(dq, &task)) || steal_task(self, !dq, &task)) {
+            run_task(dq, task);
+        } else if (!dq && !first) {
+            // A nested helper interrupted a cpu that might be executing a
+            // task, possibly of a job waiting for this very cpu. Waiting
+            // here could deadlock, leave the rest of the job to the others.
+            break;
+        } else {
+            cpu_pause();
+        }
+    }
+
+    if (dq) {
+        // The tasks of other jobs split by this cpu are not left behind.
+        struct task task;
+        while (deque_pop(dq, &task)) {
+            run_task(dq, task);
+        }
+        dq->owned = false;
+    }
+    preempt_enable();
+}
+
+// A helper recruited by a parallel_for().
+// @param arg: The job.
+static void help_job(void * const arg) {
+    struct pfor_job * const job = arg;
+    work_on_job(job, NULL);
+    // The job can be gone after this.
+    atomic_dec(&job->helpers);
+}
+
+void parallel_for(uint32_t const start,
+                  uint32_t const end,
+                  uint32_t const grain,
+                  parallel_func const func,
+                  void * const arg) {
+    if (start >= end) {
+        return;
+    }
+    uint32_t const len = end - start;
+    uint32_t const g = grain ? grain : 1;
+    uint8_t const ncpus = acpi_get_number_cpus();
+    if (len <= g || ncpus == 1) {
+        func(arg, start, end);
+        return;
+    }
+    // Cpus waiting for their job must accept the remote calls recruiting them
+    // as helpers of other jobs, otherwise two concurrent jobs could wait on
+    // each other.
+    ASSERT(interrupts_enabled());
+    // The number of remaining indices is an atomic_t.
+    ASSERT(len <= 0x7FFFFFFF);
+
+    struct pfor_job job = {
+        .func = func,
+        .arg = arg,
+        .grain = g,
+    };
+    atomic_init(&job.remaining, len);
+
+    // Recruit at most one helper per chunk.
+    uint32_t const nchunks = (len + g - 1) / g;
+    uint32_t const max_helpers = ncpus - 1;
+    uint8_t const nhelpers = nchunks - 1 < max_helpers ? nchunks - 1 :
+        max_helpers;
+    atomic_init(&job.helpers, nhelpers);
+    struct work helpers[ncpus];
+
+    preempt_disable();
+    uint8_t const self = cpu_id();
+    for (uint8_t i = 1; i <= nhelpers; ++i) {
+        uint8_t const cpu = (self + i) % ncpus;
+        work_init(helpers + cpu, help_job, &job);
+        if (workqueue_has_worker(cpu)) {
+            queue_work(cpu, helpers + cpu);
+        } else {
+            exec_remote_call(cpu, help_job, &job, false);
+        }
+    }
+
+    struct task const all = { .job = &job, .start = start, .end = end };
+    work_on_job(&job, &all);
+
+    // Helpers that did not start yet are not needed anymore. Those recruited
+    // through a remote call cannot be canceled, they exit as soon as they
+    // start.
+    for (uint8_t i = 1; i <= nhelpers; ++i) {
+        uint8_t const cpu = (self + i) % ncpus;
+        if (cancel_work(helpers + cpu)) {
+            atomic_dec(&job.helpers);
+        }
+    }
+    wait_on_address(&job.helpers, !atomic_read(&job.helpers));
+    preempt_enable();
+}
+
+#include <parallel.test>
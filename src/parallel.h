@@ -0,0 +1,44 @@
+#pragma once
+#include <types.h>
+
+// Fork-join parallelism for bulk kernel operations.
+//     parallel_for() splits a range of indices into chunks and executes them on
+// all the cpus. Each cpu has a Chase-Lev work-stealing deque of tasks, a task
+// being a sub-range of a parallel_for(): a cpu executing a task larger than the
+// grain splits it in two, pushes the second half on its deque and continues
+// with the first half. Cpus out of work steal the oldest, hence largest, task
+// of another cpu's deque. This balances the load without any central queue
+// while keeping the chunks executed by a cpu mostly contiguous.
+//
+// The cpus are recruited by the caller of parallel_for(): a cpu whose worker
+// is running (see workqueue.h) helps from its worker, in process context.
+// Otherwise, e.g. at boot or on cpus not running the scheduler, the cpu helps
+// from an asynchronous remote call, in interrupt context. Helpers run with
+// preemption disabled until the range is done, the function executed on the
+// chunks must therefore not block nor call parallel_for() itself.
+
+// The function executed on the chunks of a parallel_for().
+// @param arg: The argument given to parallel_for().
+// @param start: The first index of the chunk.
+// @param end: The index following the last index of the chunk.
+typedef void (*parallel_func)(void * const arg,
+                              uint32_t const start,
+                              uint32_t const end);
+
+// Execute a function on all the indices of a range, in parallel on all the
+// cpus. The calling cpu participates, this function returns once the whole
+// range has been executed. Interrupts must be enabled.
+// @param start: The first index of the range.
+// @param end: The index following the last index of the range.
+// @param grain: The size under which a chunk is not split further, chunks are
+// therefore usually between grain/2 and grain indices. 0 is treated as 1.
+// @param func: The function to execute on each chunk.
+// @param arg: The argument passed to `func`.
+void parallel_for(uint32_t const start,
+                  uint32_t const end,
+                  uint32_t const grain,
+                  parallel_func const func,
+                  void * const arg);
+
+// Execute the tests of parallel_for().
+void parallel_test(void);
@@ -0,0 +1,97 @@
+#include <pci.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <debug.h>
+
+// The I/O ports of configuration mechanism #1.
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// The address and data ports are a pair, protects them from concurrent
+// accesses.
+static DECLARE_SPINLOCK(PCI_CONFIG_LOCK);
+
+// Compute the value of the address port to access a double word of the
+// configuration space of a function.
+// @param addr: The function.
+// @param offset: The offset in the configuration space.
+// @return: The value to write to PCI_CONFIG_ADDRESS.
+static uint32_t config_address(struct pci_addr const addr,
+                               uint8_t const offset) {
+    ASSERT(addr.dev < 32 && addr.func < 8);
+    return (1U << 31) | ((uint32_t)addr.bus << 16) |
+        ((uint32_t)addr.dev << 11) | ((uint32_t)addr.func << 8) |
+        (offset & 0xFC);
+}
+
+uint32_t pci_read32(struct pci_addr const addr, uint8_t const offset) {
+    ASSERT(!(offset % 4));
+    spinlock_lock(&PCI_CONFIG_LOCK);
+    cpu_outl(PCI_CONFIG_ADDRESS, config_address(addr, offset));
+    uint32_t const value = cpu_inl(PCI_CONFIG_DATA);
+    spinlock_unlock(&PCI_CONFIG_LOCK);
+    return value;
+}
+
+uint16_t pci_read16(struct pci_addr const addr, uint8_t const offset) {
+    ASSERT(!(offset % 2));
+    return pci_read32(addr, offset & 0xFC) >> ((offset & 2) * 8);
+}
+
+void pci_write32(struct pci_addr const addr,
+                 uint8_t const offset,
+                 uint32_t const value) {
+    ASSERT(!(offset % 4));
+    spinlock_lock(&PCI_CONFIG_LOCK);
+    cpu_outl(PCI_CONFIG_ADDRESS, config_address(addr, offset));
+    cpu_outl(PCI_CONFIG_DATA, value);
+    spinlock_unlock(&PCI_CONFIG_LOCK);
+}
+
+void pci_write16(struct pci_addr const addr,
+                 uint8_t const offset,
+                 uint16_t const value) {
+    ASSERT(!(offset % 2));
+    uint8_t const shift = (offset & 2) * 8;
+    uint32_t const old = pci_read32(addr, offset & 0xFC);
+    uint32_t const new = (old & ~(0xFFFFU << shift)) | ((uint32_t)value << shift);
+    pci_write32(addr, offset & 0xFC, new);
+}
+
+bool pci_find_class(uint8_t const class,
+                    uint8_t const subclass,
+                    struct pci_addr * const addr) {
+    // A brute-force scan of all the buses, this is only done at boot.
+    for (uint16_t bus = 0; bus < 256; ++bus) {
+        for (uint8_t dev = 0; dev < 32; ++dev) {
+            for (uint8_t func = 0; func < 8; ++func) {
+                struct pci_addr const a = {
+                    .bus = bus,
+                    .dev = dev,
+                    .func = func,
+                };
+                if (pci_read16(a, PCI_VENDOR_ID) == 0xFFFF) {
+                    if (!func) {
+                        // No device.
+                        break;
+                    }
+                    continue;
+                }
+                uint32_t const class_rev = pci_read32(a, PCI_CLASS_REVISION);
+                if (class_rev >> 24 == class &&
+                    ((class_rev >> 16) & 0xFF) == subclass) {
+                    *addr = a;
+                    return true;
+                }
+                bool const multi_func =
+                    pci_read16(a, PCI_HEADER_TYPE) & 0x80;
+                if (!func && !multi_func) {
+                    break;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+#include <pci.test>
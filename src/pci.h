@@ -0,0 +1,68 @@
+#pragma once
+#include <types.h>
+
+// PCI configuration space access.
+//    The configuration space of PCI functions is accessed through the I/O ports
+// 0xCF8 (address) and 0xCFC (data), aka configuration mechanism #1. This is
+// only what drivers need to find their device and read its BARs, there is no
+// resource allocation: the BIOS already assigned the I/O and memory ranges.
+
+// The location of a PCI function.
+struct pci_addr {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+};
+
+// Offsets of the fields of the configuration space header.
+#define PCI_VENDOR_ID       0x00
+#define PCI_COMMAND         0x04
+#define PCI_CLASS_REVISION  0x08
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_INTERRUPT_LINE  0x3C
+
+// Bits of the command register.
+#define PCI_COMMAND_IO          (1 << 0)
+#define PCI_COMMAND_MEMORY      (1 << 1)
+#define PCI_COMMAND_BUS_MASTER  (1 << 2)
+
+// Read a double word from the configuration space of a function.
+// @param addr: The function.
+// @param offset: The offset of the double word, must be 4-byte aligned.
+// @return: The value read. 0xFFFFFFFF if the function does not exist.
+uint32_t pci_read32(struct pci_addr const addr, uint8_t const offset);
+
+// Read a word from the configuration space of a function.
+// @param addr: The function.
+// @param offset: The offset of the word, must be 2-byte aligned.
+// @return: The value read.
+uint16_t pci_read16(struct pci_addr const addr, uint8_t const offset);
+
+// Write a double word to the configuration space of a function.
+// @param addr: The function.
+// @param offset: The offset of the double word, must be 4-byte aligned.
+// @param value: The value to write.
+void pci_write32(struct pci_addr const addr,
+                 uint8_t const offset,
+                 uint32_t const value);
+
+// Write a word to the configuration space of a function.
+// @param addr: The function.
+// @param offset: The offset of the word, must be 2-byte aligned.
+// @param value: The value to write.
+void pci_write16(struct pci_addr const addr,
+                 uint8_t const offset,
+                 uint16_t const value);
+
+// Find the first function of a given class.
+// @param class: The base class code.
+// @param subclass: The sub-class code.
+// @param addr: Output parameter set to the location of the function.
+// @return: true if a function was found, false otherwise.
+bool pci_find_class(uint8_t const class,
+                    uint8_t const subclass,
+                    struct pci_addr * const addr);
+
+// Execute the tests of the PCI configuration space access.
+void pci_test(void);
@@ -37,11 +37,20 @@
 // @return: The void* read at %gs:offset.
 void *_read_void_ptr_at_offset(uint32_t const offset);
 
+// Make sure a per-cpu variable can be accessed with a single instruction by the
+// this_cpu_read/write/add macros.
+// @param var: The name of the variable.
+#define _CHECK_PERCPU_OP_SIZE(var)                                      \
+    _Static_assert(sizeof(_PERCPU_NAME(var)) == 1 ||                    \
+                   sizeof(_PERCPU_NAME(var)) == 2 ||                    \
+                   sizeof(_PERCPU_NAME(var)) == 4,                      \
+                   "Per-cpu operations only support 1, 2 and 4 bytes variables")
+
 // Compute the pointer to this cpu's variable.
 // @param var: The name of the variable to get a pointer to.
 #define _THIS_CPU_VAR_PTR(var) \
     ((typeof(_PERCPU_NAME(var))*) \
-     (_read_void_ptr_at_offset(_VAR_OFFSET(this_cpu_off))+_VAR_OFFSET(var)))
+     (this_cpu_read(this_cpu_off)+_VAR_OFFSET(var)))
 
 // Public interface:
 
@@ -56,6 +65,56 @@ void *_read_void_ptr_at_offset(uint32_t const offset);
 
 // Accessor macros:
 
+// Single instruction accessors:
+//     The following macros read and modify a variable of the current cpu with a
+// single GS-relative instruction, e.g. `mov %gs:offset, %eax`. An instruction
+// cannot be interrupted half-way, hence there is no way for the current process
+// to be migrated to another cpu in the middle of the access. Those macros are
+// therefore safe to use in a preemptible context, without any check, and are
+// meant for hot paths such as preempt_disable(), cpu_id() or get_curr_proc().
+// They only support variables of 1, 2 or 4 bytes.
+// Note that two consecutive accesses might still happen on different cpus if
+// preemption is enabled.
+
+// Read this cpu's variable `var`.
+// @param var: The name of the variable, as declared using DECLARE_PER_CPU.
+// @return: The value of the variable.
+// Note: The memory clobber orders the read against plain C stores to the same
+// variable done through this_cpu_var() or cpu_var().
+#define this_cpu_read(var) ({                                           \
+    _CHECK_PERCPU_OP_SIZE(var);                                         \
+    typeof(_PERCPU_NAME(var)) __val;                                    \
+    asm volatile("mov%z0 %%gs:(%1), %0"                                 \
+                 : "=q"(__val) : "r"(_VAR_OFFSET(var)) : "memory");     \
+    __val;                                                              \
+})
+
+// Write this cpu's variable `var`.
+// @param var: The name of the variable, as declared using DECLARE_PER_CPU.
+// @param val: The value to write.
+#define this_cpu_write(var, val) ({                                     \
+    _CHECK_PERCPU_OP_SIZE(var);                                         \
+    typeof(_PERCPU_NAME(var)) const __val = (val);                      \
+    asm volatile("mov%z0 %0, %%gs:(%1)"                                 \
+                 : : "q"(__val), "r"(_VAR_OFFSET(var)) : "memory");     \
+})
+
+// Add a value to this cpu's variable `var`. This is atomic with regard to
+// interrupts on the current cpu, but not with regard to other cpus.
+// @param var: The name of the variable, as declared using DECLARE_PER_CPU.
+// @param val: The value to add.
+#define this_cpu_add(var, val) ({                                       \
+    _CHECK_PERCPU_OP_SIZE(var);                                         \
+    typeof(_PERCPU_NAME(var)) const __val = (val);                      \
+    asm volatile("add%z0 %0, %%gs:(%1)"                                 \
+                 : : "q"(__val), "r"(_VAR_OFFSET(var)) : "memory", "cc");\
+})
+
+// Increment/decrement this cpu's variable `var`, see this_cpu_add().
+// @param var: The name of the variable, as declared using DECLARE_PER_CPU.
+#define this_cpu_inc(var)   this_cpu_add(var, 1)
+#define this_cpu_dec(var)   this_cpu_add(var, -1)
+
 // Check that all prerequisites are met before accessing a percpu variable using
 // the this_cpu_var macro. The preriquisites are:
 //  - Preemption is disabled.
@@ -77,10 +136,23 @@ bool check_percpu_prerequisites(char const * const var,
 // @param var: The name of the variable, as declared using DECLARE_PER_CPU.
 // Note: this macro can be used as a left and right value, to write and read
 // respectively.
+// Note: The prerequisites are only checked when building with PERCPU_DEBUG,
+// which is the case of debug builds. Otherwise the access is a single GS-relative
+// load of this_cpu_off followed by the access to the variable.
+#ifdef PERCPU_DEBUG
 #define this_cpu_var(var)                                               \
     (*(check_percpu_prerequisites(#var, __func__, __FILE__, __LINE__) ? \
        (_THIS_CPU_VAR_PTR(var)) :                                       \
        ((typeof(_PERCPU_NAME(var))*)NULL)))
+#else
+#define this_cpu_var(var) (*(_THIS_CPU_VAR_PTR(var)))
+#endif
+
+// Get the value of this cpu's variable `var`. This macro will NOT CHECK THE
+// PREREQUISITES. It is meant for paths known to run with interrupts disabled,
+// e.g. preemptible() or the interrupt dispatch.
+// @param var: The name of the variable, as declared using DECLARE_PER_CPU.
+#define this_cpu_var_unsafe(var) (*(_THIS_CPU_VAR_PTR(var)))
 
 // Access a remote cpu's variable.
 // @param var: The name of the variable, as declared using DECLARE_PER_CPU.
@@ -0,0 +1,349 @@
+#include <pipe.h>
+#include <spinlock.h>
+#include <mutex.h>
+#include <wait_queue.h>
+#include <list.h>
+#include <kmalloc.h>
+#include <paging.h>
+#include <frame_alloc.h>
+#include <kernel_map.h>
+#include <memory.h>
+#include <math.h>
+#include <debug.h>
+
+STATIC_ASSERT(PIPE_LOAN_THRESHOLD % PAGE_SIZE == 0, "");
+
+// The frames lent by a single large write.
+struct pipe_loan {
+    // Element of the `loans` list of the pipe.
+    struct list_node node;
+    // The number of frames of the loan.
+    uint32_t num_pages;
+    // The number of bytes of the loan already read.
+    uint32_t pos;
+    // The lent frames, in order. A frame mapped by the reader is replaced by
+    // NO_FRAME, the reference on the frame now belongs to the reader's mapping.
+    void * frames[];
+};
+
+struct pipe {
+    // Protects all the fields below except the content of `buf`, which is only
+    // accessed by the reader and the writer outside of the lock: the writer only
+    // writes after the last unread byte, the reader only reads unread bytes.
+    spinlock_t lock;
+    // false once the corresponding end has been closed.
+    bool read_open;
+    bool write_open;
+    // The offset in `buf` of the first unread byte.
+    uint32_t head;
+    // The number of unread bytes in `buf`, starting at `head` and wrapping
+    // around.
+    uint32_t len;
+    // The pending struct pipe_loan. Their data comes after the unread bytes of
+    // `buf`, hence nothing is written to `buf` while this list is not empty.
+    struct list_node loans;
+    // Serialize the readers, respectively the writers.
+    struct mutex read_lock;
+    struct mutex write_lock;
+    // The reader waits for data on `read_wq`, the writer waits for room on
+    // `write_wq`.
+    struct wait_queue read_wq;
+    struct wait_queue write_wq;
+    // The number of lent pages mapped into the reader without a copy.
+    uint32_t num_loaned_pages;
+    uint8_t buf[PIPE_BUF_SIZE];
+};
+
+struct pipe *create_pipe(void) {
+    struct pipe * const pipe = kmalloc(sizeof(*pipe));
+    if (!pipe) {
+        return NULL;
+    }
+    spinlock_init(&pipe->lock);
+    pipe->read_open = true;
+    pipe->write_open = true;
+    pipe->head = 0;
+    pipe->len = 0;
+    list_init(&pipe->loans);
+    mutex_init(&pipe->read_lock);
+    mutex_init(&pipe->write_lock);
+    wait_queue_init(&pipe->read_wq);
+    wait_queue_init(&pipe->write_wq);
+    pipe->num_loaned_pages = 0;
+    return pipe;
+}
+
+// Free a loan and drop the references on the frames it still holds.
+// @param loan: The loan to free. Must not be in a list.
+static void free_loan(struct pipe_loan * const loan) {
+    for (uint32_t i = 0; i < loan->num_pages; ++i) {
+        if (loan->frames[i] != NO_FRAME) {
+            free_frame(loan->frames[i]);
+        }
+    }
+    kfree(loan);
+}
+
+void pipe_close(struct pipe * const pipe, bool const write_end) {
+    spinlock_lock(&pipe->lock);
+    if (write_end) {
+        ASSERT(pipe->write_open);
+        pipe->write_open = false;
+    } else {
+        ASSERT(pipe->read_open);
+        pipe->read_open = false;
+    }
+    bool const unused = !pipe->read_open && !pipe->write_open;
+    if (!unused) {
+        // The other end might be waiting for this one. Waking it up under the
+        // lock prevents the other end from freeing the pipe in the meantime.
+        wake_up_all(&pipe->read_wq);
+        wake_up_all(&pipe->write_wq);
+    }
+    spinlock_unlock(&pipe->lock);
+
+    if (unused) {
+        while (!list_empty(&pipe->loans)) {
+            struct pipe_loan * const loan =
+                list_entry(pipe->loans.next, struct pipe_loan, node);
+            list_del(&loan->node);
+            free_loan(loan);
+        }
+        kfree(pipe);
+    }
+}
+
+// Check if a read would not block.
+// @param pipe: The pipe.
+// @return: true if there is data to read or if the write end is closed.
+static bool can_read(struct pipe * const pipe) {
+    spinlock_lock(&pipe->lock);
+    bool const res = pipe->len || !list_empty(&pipe->loans) ||
+        !pipe->write_open;
+    spinlock_unlock(&pipe->lock);
+    return res;
+}
+
+// Read the unread bytes of the ring buffer of a pipe, up to the end of the
+// buffer.
+// @param pipe: The pipe. The caller must be the reader.
+// @param dst: The buffer to read into.
+// @param len: The size of `dst`.
+// @return: The number of bytes read.
+static size_t read_buf(struct pipe * const pipe,
+                       uint8_t * const dst,
+                       size_t const len) {
+    spinlock_lock(&pipe->lock);
+    uint32_t const head = pipe->head;
+    uint32_t const avail = pipe->len;
+    spinlock_unlock(&pipe->lock);
+
+    size_t const n = min_u32(min_u32(len, avail), PIPE_BUF_SIZE - head);
+    memcpy(dst, pipe->buf + head, n);
+
+    spinlock_lock(&pipe->lock);
+    pipe->head = (head + n) % PIPE_BUF_SIZE;
+    pipe->len -= n;
+    spinlock_unlock(&pipe->lock);
+    return n;
+}
+
+// Read from the oldest loan of a pipe, up to the end of the current page of the
+// loan. Full pages read into page aligned buffers are mapped instead of being
+// copied, when possible.
+// @param pipe: The pipe. The caller must be the reader.
+// @param dst: The buffer to read into.
+// @param len: The size of `dst`.
+// @return: The number of bytes read, 0 if there is no pending loan.
+static size_t read_loan(struct pipe * const pipe,
+                        uint8_t * const dst,
+                        size_t const len) {
+    spinlock_lock(&pipe->lock);
+    struct pipe_loan * const loan = list_empty(&pipe->loans) ? NULL :
+        list_entry(pipe->loans.next, struct pipe_loan, node);
+    spinlock_unlock(&pipe->lock);
+    if (!loan) {
+        return 0;
+    }
+
+    // Once in the list, the loan is only accessed by the reader.
+    uint32_t const idx = loan->pos / PAGE_SIZE;
+    uint32_t const offset = loan->pos % PAGE_SIZE;
+    void * const frame = loan->frames[idx];
+    size_t n;
+    if (!offset && len >= PAGE_SIZE && is_4kib_aligned(dst) &&
+        paging_map_loaned_page(dst, frame)) {
+        loan->frames[idx] = NO_FRAME;
+        pipe->num_loaned_pages++;
+        n = PAGE_SIZE;
+    } else {
+        n = min_u32(len, PAGE_SIZE - offset);
+        phy_read(frame + offset, dst, n);
+    }
+
+    loan->pos += n;
+    if (loan->pos == loan->num_pages * PAGE_SIZE) {
+        spinlock_lock(&pipe->lock);
+        list_del(&loan->node);
+        spinlock_unlock(&pipe->lock);
+        free_loan(loan);
+    }
+    return n;
+}
+
+size_t pipe_read(struct pipe * const pipe,
+                 uint8_t * const buf,
+                 size_t const len) {
+    if (!len) {
+        return 0;
+    }
+    mutex_lock(&pipe->read_lock);
+    wait_event(&pipe->read_wq, can_read(pipe));
+
+    // The bytes of the ring buffer were written before the pending loans, if
+    // any.
+    size_t read = 0;
+    while (read < len) {
+        size_t n = read_buf(pipe, buf + read, len - read);
+        if (!n) {
+            n = read_loan(pipe, buf + read, len - read);
+        }
+        if (!n) {
+            break;
+        }
+        read += n;
+    }
+    mutex_unlock(&pipe->read_lock);
+
+    if (read) {
+        wake_up(&pipe->write_wq);
+    }
+    return read;
+}
+
+// Check if the writer can copy data into the ring buffer of a pipe without
+// blocking.
+// @param pipe: The pipe.
+// @return: true if there is room in the ring buffer and no pending loan, or if
+// the read end is closed.
+static bool can_write_buf(struct pipe * const pipe) {
+    spinlock_lock(&pipe->lock);
+    bool const res = (pipe->len < PIPE_BUF_SIZE && list_empty(&pipe->loans)) ||
+        !pipe->read_open;
+    spinlock_unlock(&pipe->lock);
+    return res;
+}
+
+// Check if the writer can add a loan to a pipe without blocking. Only one loan
+// is pending at a time, so that a writer cannot pin an unbounded amount of
+// memory.
+// @param pipe: The pipe.
+// @return: true if there is no pending loan, or if the read end is closed.
+static bool can_write_loan(struct pipe * const pipe) {
+    spinlock_lock(&pipe->lock);
+    bool const res = list_empty(&pipe->loans) || !pipe->read_open;
+    spinlock_unlock(&pipe->lock);
+    return res;
+}
+
+// Copy data into the ring buffer of a pipe, up to the end of the buffer.
+// @param pipe: The pipe. The caller must be the writer.
+// @param src: The data to write.
+// @param len: The size of the data.
+// @return: The number of bytes written, 0 if the read end is closed.
+static size_t write_buf(struct pipe * const pipe,
+                        uint8_t const * const src,
+                        size_t const len) {
+    spinlock_lock(&pipe->lock);
+    bool const open = pipe->read_open;
+    uint32_t const tail = (pipe->head + pipe->len) % PIPE_BUF_SIZE;
+    uint32_t const room = PIPE_BUF_SIZE - pipe->len;
+    spinlock_unlock(&pipe->lock);
+    if (!open) {
+        return 0;
+    }
+
+    size_t const n = min_u32(min_u32(len, room), PIPE_BUF_SIZE - tail);
+    memcpy(pipe->buf + tail, src, n);
+
+    spinlock_lock(&pipe->lock);
+    pipe->len += n;
+    spinlock_unlock(&pipe->lock);
+    return n;
+}
+
+// Lend the frames of page aligned data to a pipe.
+// @param pipe: The pipe. The caller must be the writer, there must not be any
+// pending loan.
+// @param src: The data to lend. Must be page aligned.
+// @param len: The size of the data, only full pages are lent.
+// @return: The number of bytes lent, 0 if the read end is closed or if the
+// first page could not be lent, in which case the data must be copied instead.
+static size_t write_loan(struct pipe * const pipe,
+                         uint8_t const * const src,
+                         size_t const len) {
+    uint32_t const max_pages = min_u32(len / PAGE_SIZE, PIPE_MAX_LOAN_PAGES);
+    struct pipe_loan * const loan =
+        kmalloc(sizeof(*loan) + max_pages * sizeof(*loan->frames));
+    if (!loan) {
+        return 0;
+    }
+    uint32_t num_pages = 0;
+    while (num_pages < max_pages) {
+        void * const frame = paging_loan_user_page(src + num_pages * PAGE_SIZE);
+        if (frame == NO_FRAME) {
+            break;
+        }
+        loan->frames[num_pages++] = frame;
+    }
+    loan->num_pages = num_pages;
+    loan->pos = 0;
+
+    spinlock_lock(&pipe->lock);
+    bool const open = pipe->read_open;
+    if (open && num_pages) {
+        list_add_tail(&pipe->loans, &loan->node);
+    }
+    spinlock_unlock(&pipe->lock);
+
+    if (!open || !num_pages) {
+        free_loan(loan);
+        return 0;
+    }
+    return num_pages * PAGE_SIZE;
+}
+
+size_t pipe_write(struct pipe * const pipe,
+                  uint8_t const * const buf,
+                  size_t const len) {
+    mutex_lock(&pipe->write_lock);
+    // Stop trying to lend pages after the first failure, e.g. for kernel
+    // buffers.
+    bool try_loan = is_user_addr(buf);
+    size_t written = 0;
+    while (written < len) {
+        uint8_t const * const src = buf + written;
+        size_t const remaining = len - written;
+        size_t n = 0;
+        if (try_loan && is_4kib_aligned(src) &&
+            remaining >= PIPE_LOAN_THRESHOLD) {
+            wait_event(&pipe->write_wq, can_write_loan(pipe));
+            n = write_loan(pipe, src, remaining);
+            try_loan = n;
+        }
+        if (!n) {
+            wait_event(&pipe->write_wq, can_write_buf(pipe));
+            n = write_buf(pipe, src, remaining);
+        }
+        if (!n) {
+            // The read end is closed.
+            break;
+        }
+        written += n;
+        wake_up(&pipe->read_wq);
+    }
+    mutex_unlock(&pipe->write_lock);
+    return written;
+}
+
+#include <pipe.test>
@@ -0,0 +1,70 @@
+#pragma once
+#include <types.h>
+
+// Pipes
+// =====
+//    A pipe is a unidirectional channel between processes: the bytes written to
+// its write end are read, in the same order, from its read end. Both ends are
+// installed in the file tables of processes (see proc_install_pipe()) and are
+// accessed with the read() and write() syscalls.
+//    Small writes are copied into a ring buffer of PIPE_BUF_SIZE bytes owned by
+// the pipe, and copied again to the reader. Writes of at least
+// PIPE_LOAN_THRESHOLD bytes from a page aligned user buffer are not copied
+// instead: the frames backing the buffer are lent to the pipe (see
+// paging_loan_user_page()) and mapped into the address space of the reader if
+// its buffer is page aligned as well (see paging_map_loaned_page()). The pages
+// are shared copy-on-write, hence neither side observes writes made by the
+// other after the transfer, and a large transfer costs a couple of page table
+// updates per page instead of two copies.
+//    There is at most one reader and one writer at a time in a pipe, others
+// wait for their turn. A read blocks until some data is available and returns
+// what is available, a write blocks until all its data is in the pipe.
+
+// The size of the ring buffer of a pipe in bytes.
+#define PIPE_BUF_SIZE           4096
+
+// The minimum size of a write for its pages to be lent instead of copied.
+#define PIPE_LOAN_THRESHOLD     (4 * 4096)
+
+// The maximum number of pages lent by a single loan. Larger writes are split
+// into multiple loans.
+#define PIPE_MAX_LOAN_PAGES     64
+
+struct pipe;
+
+// Create a pipe.
+// @return: The pipe with one reference on each end, NULL if the allocation
+// failed.
+struct pipe *create_pipe(void);
+
+// Drop the reference on one end of a pipe. Once the write end is closed, reads
+// return 0 after all data has been read. Once the read end is closed, writes
+// return early. The pipe is freed once both ends are closed.
+// @param pipe: The pipe.
+// @param write_end: If true, close the write end, otherwise close the read end.
+void pipe_close(struct pipe * const pipe, bool const write_end);
+
+// Read from a pipe. This blocks until data is available or the write end is
+// closed.
+// @param pipe: The pipe.
+// @param buf: The buffer to read into. Must have been validated with
+// user_range_ok() if it is a user buffer.
+// @param len: The size of the buffer.
+// @return: The number of bytes read, 0 if the write end is closed and all data
+// has been read.
+size_t pipe_read(struct pipe * const pipe, uint8_t * const buf,
+                 size_t const len);
+
+// Write to a pipe. This blocks until all the data is in the pipe or the read
+// end is closed.
+// @param pipe: The pipe.
+// @param buf: The data to write. Must have been validated with user_range_ok()
+// if it is a user buffer.
+// @param len: The size of the data in bytes.
+// @return: The number of bytes written, less than `len` only if the read end
+// was closed.
+size_t pipe_write(struct pipe * const pipe, uint8_t const * const buf,
+                  size_t const len);
+
+// Execute the tests of the pipes.
+void pipe_test(void);
@@ -8,10 +8,44 @@
 #include <segmentation.h>
 #include <sched.h>
 #include <vfs.h>
+#include <pipe.h>
+#include <memstat.h>
 #include <error.h>
-
-// The number of stack frames to be allocated by default for a new process.
-#define DEFAULT_NUM_STACK_FRAMES    4
+#include <kmem_cache.h>
+#include <fpu.h>
+#include <tracelog.h>
+#include <clock.h>
+
+DEFINE_TRACEPOINT(proc_create);
+DEFINE_TRACEPOINT(proc_switch);
+DEFINE_TRACEPOINT(proc_delete);
+
+// The number of frames allocated for the kernel stack of a process.
+#define KERNEL_STACK_NUM_FRAMES     4
+
+// The user stack of a process is located right under the kernel, preceded by a
+// guard page.
+#define USER_STACK_END              ((void*)KERNEL_PHY_OFFSET)
+
+// Object cache used to allocate the struct proc.
+static DECLARE_KMEM_CACHE(PROC_CACHE, struct proc, CACHE_LINE_SIZE, NULL);
+
+// The maximum number of dead processes kept in PROC_POOL.
+#define PROC_POOL_MAX               32
+
+// Dead processes kept for reuse by create_proc_in_ring(). Mapping a kernel
+// stack and, even more so, unmapping it (which shoots down the TLB of all cpus)
+// dominate the cost of short-lived processes, hence a deleted process keeps its
+// struct proc and its kernel stack in this pool, up to PROC_POOL_MAX
+// processes. The pool is a stack so that the most recently used kernel stack,
+// likely to still be in the cache, is reused first.
+static struct {
+    struct proc * procs[PROC_POOL_MAX];
+    uint32_t len;
+} PROC_POOL;
+
+// Protects PROC_POOL.
+static DECLARE_SPINLOCK(PROC_POOL_LOCK);
 
 // Get a pointer to the bottom of a stack given a pointer to its top.
 // @param stack_top: pointer to the top of the stack that is the address of the
@@ -25,74 +59,84 @@ static void *get_stack_bottom(void const * const stack_top,
     return ptr + num_pages * PAGE_SIZE - 4;
 }
 
-// De-allocate a stack.
+// De-allocate a kernel stack.
 // @param stack: The struct stack describing the stack to be de-allocated.
 static void dealloc_stack(struct stack const * const stack) {
     void * const top = stack->top;
     ASSERT(stack->bottom > stack->top);
     // De-allocating a stack must be done from the kernel address space.
-    ASSERT(get_curr_addr_space() == get_kernel_addr_space());
+    struct addr_space * const prev_addr_space = enter_kernel_addr_space();
     paging_unmap_and_free_frames(top, stack->num_pages * PAGE_SIZE);
+    exit_kernel_addr_space(prev_addr_space);
+    memstat_add(MEMSTAT_KERNEL_STACKS,
+                -(int32_t)(stack->num_pages * PAGE_SIZE));
 }
 
-// Allocate a stack for a process in its own address space.
+// Allocate the kernel stack of a process. The page fault handler runs on the
+// kernel stack, hence its frames must be allocated upfront.
 // @param proc: The process to allocate the stack to.
-// @param kernel_stack: If true, the kernel stack of the process will be
-// allocated, otherwise it is the user stack.
 // @return: true if the stack was successfully created, false otherwise.
-static bool allocate_stack(struct proc * const proc, bool const kernel_stack) {
-    // Kernel processes do not have a user stack, only a kernel stack.
-    ASSERT(!proc->is_kernel_proc || kernel_stack);
-
+static bool allocate_kernel_stack(struct proc * const proc) {
     // Allocate physical frames that will be used for the process' stack.
-    uint32_t const n_stack_frames = DEFAULT_NUM_STACK_FRAMES;
+    uint32_t const n_stack_frames = KERNEL_STACK_NUM_FRAMES;
     void * frames[n_stack_frames];
-    for (uint32_t i = 0; i < n_stack_frames; ++i) {
-        frames[i] = alloc_frame();
-        if (frames[i] == NO_FRAME) {
-            for (uint32_t j = 0; j < i; ++j) {
-                free_frame(frames[j]);
-            }
-            SET_ERROR("Could not allocate frame for process stack", ENONE);
-            return false;
-        }
+    if (!alloc_frames(n_stack_frames, frames)) {
+        SET_ERROR("Could not allocate frame for process stack", ENONE);
+        return false;
     }
 
-    // Map the stack into the process' address space.
-    uint32_t map_flags = VM_WRITE | VM_NON_GLOBAL;
-    if (!kernel_stack) {
-        map_flags |= VM_USER;
-    }
-    // When mapping stacks for kernel processes, we avoid mapping under the 1MiB
-    // addresses. This is because those addresses are used by SMP and/or BIOS
-    // and sometimes need to be identically mapped.
-    void * const low = (void*)(kernel_stack ? KERNEL_PHY_OFFSET : 0x0);
-
-    // When mapping kernel stacks in kernel address space, we need to operate on
-    // the kernel address space.
-    struct addr_space * const as =
-        kernel_stack ? get_kernel_addr_space() : proc->addr_space;
-    void * const stack_top =
-        paging_map_frames_above_in(as, low, frames, n_stack_frames, map_flags);
+    // Map the stack into the kernel address space. We avoid mapping under the
+    // 1MiB addresses. This is because those addresses are used by SMP and/or
+    // BIOS and sometimes need to be identically mapped.
+    uint32_t const map_flags = VM_WRITE | VM_NON_GLOBAL;
+    void * const low = (void*)KERNEL_PHY_OFFSET;
+    void * const stack_top = paging_map_frames_above_in(get_kernel_addr_space(),
+        low, frames, n_stack_frames, map_flags);
     if (stack_top == NO_REGION) {
         SET_ERROR("Could not map process' stack to its addr space", ENONE);
-        for (uint32_t i = 0; i < n_stack_frames; ++i) {
-            free_frame(frames[i]);
-        }
+        free_frames(n_stack_frames, frames);
         return false;
     }
 
     void * const stack_bottom = get_stack_bottom(stack_top, n_stack_frames);
-    if (kernel_stack) {
-        proc->kernel_stack.top = stack_top;
-        proc->kernel_stack.bottom = stack_bottom;
-        proc->kernel_stack.num_pages = n_stack_frames;
-        proc->kernel_stack_ptr = stack_bottom;
-    } else {
-        proc->user_stack.top = stack_top;
-        proc->user_stack.bottom = stack_bottom;
-        proc->user_stack.num_pages = n_stack_frames;
+    proc->kernel_stack.top = stack_top;
+    proc->kernel_stack.bottom = stack_bottom;
+    proc->kernel_stack.num_pages = n_stack_frames;
+    proc->kernel_stack_ptr = stack_bottom;
+    memstat_add(MEMSTAT_KERNEL_STACKS, n_stack_frames * PAGE_SIZE);
+    return true;
+}
+
+// Reserve the user stack of a process in its address space. No frame is
+// allocated, the pages of the stack are faulted in upon their first access. The
+// page right under the stack is a guard page, catching stack overflows.
+// @param proc: The process to reserve the stack for.
+// @param num_pages: The size of the stack in number of pages.
+// @return: true if the stack was successfully reserved, false otherwise.
+static bool reserve_user_stack(struct proc * const proc,
+                               uint32_t const num_pages) {
+    // Kernel processes do not have a user stack, only a kernel stack.
+    ASSERT(!proc->is_kernel_proc);
+    size_t const size = num_pages * PAGE_SIZE;
+    ASSERT(num_pages && size < (size_t)USER_STACK_END - PAGE_SIZE);
+
+    void * const stack_top = USER_STACK_END - size;
+    uint32_t const map_flags = VM_WRITE | VM_NON_GLOBAL | VM_USER;
+    if (!addr_space_add_segment(proc->addr_space, stack_top, size, NULL, 0, 0,
+        map_flags)) {
+        SET_ERROR("Could not reserve process' stack in its addr space", ENONE);
+        return false;
+    }
+    if (!addr_space_add_segment(proc->addr_space, stack_top - PAGE_SIZE,
+        PAGE_SIZE, NULL, 0, 0, 0)) {
+        // The stack segment is released along with the address space.
+        SET_ERROR("Could not reserve guard page of process' stack", ENONE);
+        return false;
     }
+
+    proc->user_stack.top = stack_top;
+    proc->user_stack.bottom = get_stack_bottom(stack_top, num_pages);
+    proc->user_stack.num_pages = num_pages;
     return true;
 }
 
@@ -163,16 +207,80 @@ static void init_registers(struct proc * const proc) {
     regs->ss = ds.value;
 }
 
+// Allocate a struct proc and its kernel stack, reusing a dead process from
+// PROC_POOL if possible.
+// @return: The struct proc, zeroed except for its kernel stack. NULL if the
+// allocation failed.
+static struct proc *alloc_proc(void) {
+    spinlock_lock(&PROC_POOL_LOCK);
+    struct proc * proc = PROC_POOL.len ? PROC_POOL.procs[--PROC_POOL.len] : NULL;
+    spinlock_unlock(&PROC_POOL_LOCK);
+
+    if (proc) {
+        // Leave the process in the same state as a newly allocated one.
+        struct stack const kernel_stack = proc->kernel_stack;
+        memzero(proc, sizeof(*proc));
+        proc->kernel_stack = kernel_stack;
+        proc->kernel_stack_ptr = kernel_stack.bottom;
+        return proc;
+    }
+
+    proc = kmem_cache_alloc(&PROC_CACHE);
+    if (!proc) {
+        SET_ERROR("Could not allocate struct proc", ENONE);
+        return NULL;
+    }
+    if (!allocate_kernel_stack(proc)) {
+        SET_ERROR("Could not allocate kernel stack for process", ENONE);
+        kmem_cache_free(&PROC_CACHE, proc);
+        return NULL;
+    }
+    return proc;
+}
+
+// Free a struct proc allocated by alloc_proc() and its kernel stack, or put
+// them in PROC_POOL.
+// @param proc: The process. Its kernel stack must not be in use anymore.
+static void free_proc(struct proc * const proc) {
+    spinlock_lock(&PROC_POOL_LOCK);
+    bool const pooled = PROC_POOL.len < PROC_POOL_MAX;
+    if (pooled) {
+        PROC_POOL.procs[PROC_POOL.len++] = proc;
+    }
+    spinlock_unlock(&PROC_POOL_LOCK);
+
+    if (!pooled) {
+        dealloc_stack(&proc->kernel_stack);
+        kmem_cache_free(&PROC_CACHE, proc);
+    }
+}
+
+void proc_pool_shrink(void) {
+    while (true) {
+        spinlock_lock(&PROC_POOL_LOCK);
+        struct proc * const proc =
+            PROC_POOL.len ? PROC_POOL.procs[--PROC_POOL.len] : NULL;
+        spinlock_unlock(&PROC_POOL_LOCK);
+        if (!proc) {
+            break;
+        }
+        dealloc_stack(&proc->kernel_stack);
+        kmem_cache_free(&PROC_CACHE, proc);
+    }
+}
+
 // Create a new process. This function will set default values for the process'
 // registers and allocate a stack.
 // @param ring: The privilege level of the process.
+// @param user_stack_pages: The size of the user stack in number of pages.
+// Ignored for kernel processes.
 // @return: On success return a pointer on the initialized struct proc,
 // otherwise NULL is returned.
-static struct proc *create_proc_in_ring(uint8_t const ring) {
+static struct proc *create_proc_in_ring(uint8_t const ring,
+                                        uint32_t const user_stack_pages) {
     ASSERT(ring == 0 || ring == 3);
-    struct proc * const proc = kmalloc(sizeof(*proc));
+    struct proc * const proc = alloc_proc();
     if (!proc) {
-        SET_ERROR("Could not allocate struct proc", ENONE);
         return NULL;
     }
     proc->is_kernel_proc = (!ring);
@@ -184,29 +292,17 @@ static struct proc *create_proc_in_ring(uint8_t const ring) {
 
     if (!proc->addr_space) {
         SET_ERROR("Cannot create address space for new process", ENONE);
-        kfree(proc);
+        free_proc(proc);
         return NULL;
     }
 
     // User processes will have a user stack besides the kernel stack. Kernel
     // processes only have a kernel stack.
-    if (!proc->is_kernel_proc && !allocate_stack(proc, false)) {
+    if (!proc->is_kernel_proc &&
+        !reserve_user_stack(proc, user_stack_pages)) {
         SET_ERROR("Could not allocate user stack for process", ENONE);
         delete_addr_space(proc->addr_space);
-        kfree(proc);
-        return NULL;
-    }
-
-    // Allocate kernel stack for the process.
-    if (!allocate_stack(proc, true)) {
-        SET_ERROR("Could not allocate kernel stack for process", ENONE);
-        // De-allocate the user stack.
-        paging_unmap_and_free_frames(proc->user_stack.top,
-                                     proc->user_stack.num_pages * PAGE_SIZE);
-        if (ring) {
-            delete_addr_space(proc->addr_space);
-        }
-        kfree(proc);
+        free_proc(proc);
         return NULL;
     }
 
@@ -214,6 +310,7 @@ static struct proc *create_proc_in_ring(uint8_t const ring) {
     // allocating the stack(s) since ESP and EBP will be pointing onto the
     // kernel/user stack.
     init_registers(proc);
+    fpu_init_proc(proc);
 
     list_init(&proc->rq);
 
@@ -222,8 +319,10 @@ static struct proc *create_proc_in_ring(uint8_t const ring) {
     proc->state_flags = PROC_WAITING_EIP;
 
     proc->pid = get_new_pid();
+    TRACEPOINT(proc_create, "pid=%u kernel=%u", proc->pid,
+               proc->is_kernel_proc);
 
-    // All other fields are 0 since the kmalloc memzeroed the struct proc for
+    // All other fields are 0 since alloc_proc() memzeroed the struct proc for
     // us.
 
     return proc;
@@ -246,9 +345,13 @@ static void catch_kstack_underflow(void) {
 extern void initial_ret_from_spawn(struct proc * const self);
 
 struct proc *create_proc(void) {
+    return create_proc_with_stack(DEFAULT_USER_STACK_PAGES);
+}
+
+struct proc *create_proc_with_stack(uint32_t const user_stack_pages) {
     // After this call one only needs to copy the code into the process'
     // address space and point EIP to the right place.
-    struct proc * const proc = create_proc_in_ring(3);
+    struct proc * const proc = create_proc_in_ring(3, user_stack_pages);
     if (!proc) {
         return NULL;
     }
@@ -272,7 +375,7 @@ struct proc *create_proc(void) {
 }
 
 struct proc *create_kproc(void (*func)(void*), void * const arg) {
-    struct proc * const kproc = create_proc_in_ring(0);
+    struct proc * const kproc = create_proc_in_ring(0, 0);
     if (!kproc) {
         return NULL;
     }
@@ -338,7 +441,9 @@ void switch_to_proc(struct proc * const proc) {
     // variable. This won't be done by do_context_switch()!
     proc->cpu = cpu_id();
     set_curr_proc(proc);
-    switch_to_addr_space(proc->addr_space);
+    // Kernel processes only use kernel mappings, they borrow the address space
+    // currently in use instead of loading the kernel address space.
+    switch_to_proc_addr_space(proc->addr_space, proc->is_kernel_proc);
 
     // Change the kernel stack of the TSS of this cpu. This is only required for
     // user processes since kernel processes will never have to switch privilege
@@ -347,37 +452,136 @@ void switch_to_proc(struct proc * const proc) {
         change_tss_esp0(proc->kernel_stack.bottom);
     }
 
+    // The FPU state is switched lazily, see fpu.h.
+    fpu_switch(curr, proc);
+
+    // Account the runtime of the previous process, the idle process included,
+    // and start the clock of the next.
+    if (curr) {
+        proc_account_runtime(curr);
+    }
+    proc->run_start_ns = clock_now_ns();
+
+    // The first context switch on a cpu has no previous process, use pid 0.
+    TRACEPOINT(proc_switch, "prev=%u next=%u", curr ? curr->pid : 0, proc->pid);
+
     // Perform the actual context switch. This will re-enable preemption and
     // interrupts (if necessary).
     do_context_switch(curr, proc, irqs);
 }
 
+void proc_account_runtime(struct proc * const proc) {
+    uint64_t const now = clock_now_ns();
+    if (now > proc->run_start_ns) {
+        proc->runtime_ns += now - proc->run_start_ns;
+    }
+    proc->run_start_ns = now;
+}
+
+void proc_set_nice(struct proc * const proc, int32_t const nice) {
+    if (nice < PROC_NICE_MIN) {
+        proc->nice = PROC_NICE_MIN;
+    } else if (nice > PROC_NICE_MAX) {
+        proc->nice = PROC_NICE_MAX;
+    } else {
+        proc->nice = nice;
+    }
+}
+
+// The bitmap of the file table is a single word.
+STATIC_ASSERT(MAX_FDS <= 32, "MAX_FDS does not fit the file table bitmap");
+
+void proc_get_mem_stats(struct proc * const proc,
+                        struct proc_mem_stats * const stats) {
+    memzero(stats, sizeof(*stats));
+    stats->kernel_stack_frames = proc->kernel_stack.num_pages;
+    if (proc->is_kernel_proc) {
+        return;
+    }
+    struct paging_user_mem_stats user;
+    paging_get_user_mem_stats_in(proc->addr_space, &user);
+    stats->page_table_frames = user.table_frames;
+    // The user stack is one of the lazy segments.
+    void const * const stack = proc->user_stack.top;
+    stats->user_stack_pages = paging_num_mapped_user_pages_in(proc->addr_space,
+        stack, stack + proc->user_stack.num_pages * PAGE_SIZE);
+    stats->segment_pages = user.segment_pages - stats->user_stack_pages;
+    stats->other_pages = user.mapped_pages - user.segment_pages;
+}
+
+fd_t proc_install_fd(struct proc * const proc, struct file * const file) {
+    struct file_table * const table = &proc->file_table;
+    uint32_t const free = ~table->used;
+    fd_t const fd = free ? __builtin_ctz(free) : MAX_FDS;
+    if (fd >= MAX_FDS) {
+        return MAX_FDS;
+    }
+    table->entries[fd].file = file;
+    table->entries[fd].pipe = NULL;
+    table->entries[fd].file_pointer = 0x0;
+    read_ahead_init(&table->entries[fd].read_ahead);
+    table->used |= 1U << fd;
+    return fd;
+}
+
+fd_t proc_install_pipe(struct proc * const proc,
+                       struct pipe * const pipe,
+                       bool const write_end) {
+    fd_t const fd = proc_install_fd(proc, NULL);
+    if (fd < MAX_FDS) {
+        proc->file_table.entries[fd].pipe = pipe;
+        proc->file_table.entries[fd].pipe_write_end = write_end;
+    }
+    return fd;
+}
+
+struct file_table_entry *proc_get_fd(struct proc * const proc, fd_t const fd) {
+    struct file_table * const table = &proc->file_table;
+    if (fd >= MAX_FDS || !(table->used & (1U << fd))) {
+        return NULL;
+    }
+    return table->entries + fd;
+}
+
+bool proc_close_fd(struct proc * const proc, fd_t const fd) {
+    struct file_table_entry * const entry = proc_get_fd(proc, fd);
+    if (!entry) {
+        return false;
+    }
+    proc->file_table.used &= ~(1U << fd);
+    if (entry->pipe) {
+        pipe_close(entry->pipe, entry->pipe_write_end);
+    } else {
+        vfs_close(entry->file);
+    }
+    // Reset the entry to avoid use after free.
+    entry->file = NULL;
+    entry->pipe = NULL;
+    return true;
+}
+
 // Close all the files opened by a process.
 // @param proc: The process for which all opened files should be closed.
 static void close_all_opened_files(struct proc * const proc) {
-    for (fd_t fd = 0; fd < MAX_FDS; ++fd) {
-        struct file_table_entry * const entry = proc->file_table[fd];
-        if (!entry) {
-            continue;
-        }
-        vfs_close(entry->file);
-        kfree(entry);
-        // Reset the entry to avoid use after free.
-        proc->file_table[fd] = NULL;
+    while (proc->file_table.used) {
+        proc_close_fd(proc, __builtin_ctz(proc->file_table.used));
     }
 }
 
 void delete_proc(struct proc * const proc) {
+    TRACEPOINT(proc_delete, "pid=%u", proc->pid);
+
     // Close any file that remained opened until now.
     close_all_opened_files(proc);
 
-    dealloc_stack(&proc->kernel_stack);
     if (!proc->is_kernel_proc) {
         // Delete the address space for user processes, this will also
         // de-allocate the user stack.
         delete_addr_space(proc->addr_space);
     }
-    kfree(proc);
+    // The kernel stack is kept for the next process if there is room in the
+    // pool.
+    free_proc(proc);
 }
 
 #include <proc.test>
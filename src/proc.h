@@ -1,9 +1,13 @@
 #pragma once
 #include <addr_space.h>
 #include <list.h>
+#include <avl.h>
 #include <percpu.h>
 #include <fs.h>
 #include <syscalls.h>
+#include <fpu.h>
+#include <atomic.h>
+#include <memstat.h>
 
 // Process related functions and types.
 
@@ -37,18 +41,42 @@ struct register_save_area {
     reg_t es;
 } __attribute__((packed));
 
+// Forward declaration, see pipe.h.
+struct pipe;
+
 // This struct contains the state of an opened file of a process.
 struct file_table_entry {
-    // The file in question, as returned by vfs_open().
+    // The file in question, as returned by vfs_open(). NULL for pipes.
     struct file * file;
+    // If not NULL, the entry is an end of this pipe instead of a file and the
+    // fields below are unused.
+    struct pipe * pipe;
+    // If `pipe` is not NULL, true if the entry is the write end of the pipe,
+    // false if it is the read end.
+    bool pipe_write_end;
     // Pointer within the file, that is the offset at which the next call to
     // read() write() will read from/write to.
     off_t file_pointer;
+    // The sequential access detection of read(), see page_cache.h.
+    struct read_ahead read_ahead;
 };
 
 // The maximum number of opened file per process.
 #define MAX_FDS 32
 
+// The file table of a process. It maps a file descriptor to the state of the
+// corresponding opened file. The entries are stored inline, together with a
+// bitmap of the file descriptors in use, so that opening and closing a file does
+// not allocate memory and finding the lowest free descriptor is a single bit
+// scan. Each entry holds its own reference on the file, duplicating a
+// descriptor only takes an additional reference with vfs_file_get().
+struct file_table {
+    // Bit i is set if the file descriptor i is in use.
+    uint32_t used;
+    // The entries of the file descriptors, only valid if in use.
+    struct file_table_entry entries[MAX_FDS];
+};
+
 // Describe a process' stack.
 struct stack {
     // The top of the stack, that is the lowest address pointing to a byte in
@@ -57,10 +85,15 @@ struct stack {
     // The bottom of the stack, that is the highest address pointing to a byte
     // in the stack.
     void * bottom;
-    // The size of the stack in number of pages.
+    // The size of the stack in number of pages. For user stacks, this is the
+    // size of the reserved virtual memory range, its pages are only allocated
+    // upon their first access.
     uint32_t num_pages;
 };
 
+// The default size of the user stack of a process in number of pages.
+#define DEFAULT_USER_STACK_PAGES    256
+
 // A process running on the system.
 struct proc {
     // The private address space of this process.
@@ -78,6 +111,13 @@ struct proc {
     // stack, this is the only stack.
     struct stack kernel_stack;
 
+    // The FPU and SSE state of this process, see fpu.h. This state is only
+    // guaranteed to be up to date while the process is not running.
+    struct fpu_state fpu_state;
+    // The cpu on which fpu_state was last loaded in the FPU registers,
+    // FPU_NO_CPU if it never was.
+    uint16_t fpu_cpu;
+
     // The saved kernel stack pointer of this process. When doing a context
     // switch the ESP register will be switched to that value in order to resume
     // execution of this process.
@@ -89,13 +129,46 @@ struct proc {
     // The list_node used to enqueue processes in runqueues.
     struct list_node rq;
 
+    // Indicate if the process is currently enqueued in a runqueue. This is
+    // maintained by the scheduler implementation under its runqueue lock and
+    // avoids having to walk the runqueue to know if a process is in it.
+    bool on_rq;
+
     // The cpu the process is currently enqueued in.
     uint8_t cpu;
 
+    // The priority of the process, from PROC_NICE_MIN (highest priority) to
+    // PROC_NICE_MAX (lowest priority). Defaults to 0. Only schedulers with a
+    // notion of priority use this field, see proc_set_nice().
+    int8_t nice;
+
+    // The total time the process has been running, in nanoseconds, as of its
+    // last accounting, see proc_account_runtime().
+    uint64_t runtime_ns;
+    // The clock value when the runtime of the process was last accounted, see
+    // clock_now_ns(). Only meaningful while the process is running.
+    uint64_t run_start_ns;
+
+    // The following fields are used by the fair scheduler:
+    // The node used to enqueue the process in the scheduler's tree.
+    struct avl_node fair_node;
+    // The virtual runtime of the process, that is its execution time, in
+    // nanoseconds, weighted by its priority.
+    uint64_t vruntime;
+    // The clock value when the process started running on its cpu, or when its
+    // runtime has last been accounted for. 0 if the process is not running.
+    uint64_t exec_start;
+
     // The state of the process. A value of 0 indicate that this process is
     // runnable. See values below.
     uint32_t state_flags;
 
+    // The blocking state of the process, one of the PROC_BLOCK_* values below.
+    // This arbitrates between the cpu switching a blocking process out and the
+    // cpu waking it up, so that exactly one of them enqueues it back, see
+    // sched_prepare_block() and sched_wake_up_proc().
+    atomic_t block_state;
+
     // The exit code of the process. This field is only valid if the process is
     // dead.
     uint8_t exit_code;
@@ -105,7 +178,12 @@ struct proc {
 
     // The file table contains the state of all the files opened by this
     // process. It maps a file descriptor to its corresponding file.
-    struct file_table_entry *file_table[MAX_FDS];
+    struct file_table file_table;
+
+    // The address, in the process' address space, of the submission/completion
+    // rings of this process. NULL if the rings have not been set up, see
+    // io_ring.h.
+    struct io_ring * io_ring;
 
     // The following is used for debugging purposes exclusively. It makes
     // possible to call hooks before and after calling a particular syscall.
@@ -126,6 +204,18 @@ struct proc {
 #define PROC_RUNNABLE       0x0 // Process can be enqueued in sched and run.
 #define PROC_WAITING_EIP    0x1 // Process has uninitialized EIP.
 #define PROC_DEAD           0x2 // Process is dead.
+#define PROC_BLOCKED        0x4 // Process is waiting for an event.
+
+// Below are the values of the struct proc' block_state field.
+// The process is not blocked.
+#define PROC_BLOCK_NONE     0
+// The process is about to block but is still running on its cpu.
+#define PROC_BLOCK_BLOCKING 1
+// The process has been switched out and is waiting to be woken up.
+#define PROC_BLOCK_BLOCKED  2
+// The process has been woken up while still running on its cpu. It must not be
+// switched out, or if it is, it must be put back into the scheduler.
+#define PROC_BLOCK_WOKEN    3
 
 // Check if a process is runnable.
 // @param p: A pointer on a struct proc.
@@ -137,11 +227,30 @@ struct proc {
 // @return: true if the process is currently dead, false otherwise.
 #define proc_is_dead(p)     ((p)->state_flags & PROC_DEAD)
 
+// The range of the nice values of a process.
+#define PROC_NICE_MIN   -20
+#define PROC_NICE_MAX   19
+
+// Set the priority of a process.
+// @param proc: The process.
+// @param nice: The new nice value of the process, clamped to [PROC_NICE_MIN,
+// PROC_NICE_MAX]. Lower values mean higher priority.
+void proc_set_nice(struct proc * const proc, int32_t const nice);
+
 // Create a new struct proc. The process' address space and stack are allocated.
 // The register_save_area is zeroed, ESP points to the freshly allocated stack.
+// The user stack is DEFAULT_USER_STACK_PAGES pages.
 // @return: On success, a pointer on the allocated struct proc, NULL otherwise.
 struct proc *create_proc(void);
 
+// Create a new struct proc with a user stack of a given size, see
+// create_proc(). Only the virtual memory of the user stack is reserved, its
+// pages are allocated upon their first access and an access to the page right
+// under the stack is a fault.
+// @param user_stack_pages: The size of the user stack in number of pages.
+// @return: On success, a pointer on the allocated struct proc, NULL otherwise.
+struct proc *create_proc_with_stack(uint32_t const user_stack_pages);
+
 // Kernel processes
 // ================
 //     Kernel processes are special processes that execute in ring 0. This means
@@ -159,16 +268,62 @@ struct proc *create_proc(void);
 // is returned.
 struct proc *create_kproc(void (*func)(void*), void * const arg);
 
+// Account the time a process has been running since the last accounting. Must
+// be called on the cpu running the process.
+// @param proc: The process, currently running on this cpu.
+void proc_account_runtime(struct proc * const proc);
+
 // Perform a context switch to a new process. This function will return when the
 // execution of the current process resumes.
 // @param proc: The process to execute.
 void switch_to_proc(struct proc * const proc);
 
 // Delete a process and all the physical frames mapped to its user address
-// space.
+// space. The struct proc and the kernel stack of the process might be kept for
+// reuse by a subsequent process creation, see proc_pool_shrink().
 // @param proc: The process to delete.
 // Note: This function assumes that proc has been dynamically allocated.
 void delete_proc(struct proc * const proc);
 
+// Free the dead processes kept for reuse by the process creation functions,
+// along with their kernel stacks.
+void proc_pool_shrink(void);
+
+// Get the memory used by a process.
+// @param proc: The process.
+// @param stats: Output parameter receiving the statistics.
+void proc_get_mem_stats(struct proc * const proc,
+                        struct proc_mem_stats * const stats);
+
+// Install an opened file in the file table of a process, using the lowest
+// free file descriptor. The file table takes over the reference on the file.
+// @param proc: The process.
+// @param file: The opened file.
+// @return: The file descriptor, or MAX_FDS if the file table is full.
+fd_t proc_install_fd(struct proc * const proc, struct file * const file);
+
+// Install an end of a pipe in the file table of a process, using the lowest
+// free file descriptor. The file table takes over the reference on the end.
+// @param proc: The process.
+// @param pipe: The pipe.
+// @param write_end: true to install the write end, false for the read end.
+// @return: The file descriptor, or MAX_FDS if the file table is full.
+fd_t proc_install_pipe(struct proc * const proc,
+                       struct pipe * const pipe,
+                       bool const write_end);
+
+// Get the entry of a file descriptor in the file table of a process.
+// @param proc: The process.
+// @param fd: The file descriptor.
+// @return: The entry, NULL if `fd` is not in use.
+struct file_table_entry *proc_get_fd(struct proc * const proc, fd_t const fd);
+
+// Close a file descriptor of a process, dropping its reference on the file or on
+// the end of the pipe.
+// @param proc: The process.
+// @param fd: The file descriptor to close.
+// @return: true if the file descriptor was closed, false if it was not in use.
+bool proc_close_fd(struct proc * const proc, fd_t const fd);
+
 // Execute tests related to proceses managment.
 void proc_test(void);
@@ -0,0 +1,201 @@
+#include <profiler.h>
+#include <kmalloc.h>
+#include <memory.h>
+#include <acpi.h>
+#include <cpu.h>
+#include <sched.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <debug.h>
+
+// The number of samples in the buffer of each cpu. With the scheduler tick
+// firing every 4ms this is about 8 seconds of busy time.
+#define PROFILER_BUFFER_LEN 2048
+
+// A sample of the context interrupted by a scheduler tick.
+struct profiler_sample {
+    // The instruction pointer of the interrupted context.
+    uint32_t eip;
+    // The pid of the process running on the cpu, 0 if none.
+    pid_t pid;
+    // The cpu that took the sample.
+    uint8_t cpu;
+    // True if the interrupted context was running in ring 3.
+    bool user;
+};
+
+// The sample buffer of a cpu. Only written by its cpu, with interrupts
+// disabled, and read by profiler_dump().
+struct sample_buffer {
+    // The number of samples in the buffer.
+    uint32_t volatile len;
+    // The number of samples dropped because the buffer was full.
+    uint32_t volatile dropped;
+    struct profiler_sample samples[PROFILER_BUFFER_LEN];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The sample buffer of each cpu, indexed by cpu id. NULL until profiler_init()
+// has been called.
+static struct sample_buffer * SAMPLE_BUFFERS = NULL;
+static uint16_t NUM_SAMPLE_BUFFERS = 0;
+
+// If true, the scheduler ticks record samples.
+static bool volatile PROFILER_RUNNING = false;
+
+// Serializes profiler_dump() calls.
+DECLARE_SPINLOCK(PROFILER_DUMP_LOCK);
+
+void profiler_init(void) {
+    uint16_t const ncpus = acpi_get_number_cpus();
+    struct sample_buffer * const bufs = kmalloc(ncpus * sizeof(*bufs));
+    if (!bufs) {
+        // Not fatal, the profiler simply cannot be started.
+        WARN("Cannot allocate profiler sample buffers for %u cpus\n", ncpus);
+        return;
+    }
+    for (uint16_t i = 0; i < ncpus; ++i) {
+        bufs[i].len = 0;
+        bufs[i].dropped = 0;
+    }
+    NUM_SAMPLE_BUFFERS = ncpus;
+    SAMPLE_BUFFERS = bufs;
+}
+
+void profiler_start(void) {
+    if (!SAMPLE_BUFFERS) {
+        LOG("Profiler not initialized, not starting\n");
+        return;
+    }
+    PROFILER_RUNNING = true;
+}
+
+void profiler_stop(void) {
+    PROFILER_RUNNING = false;
+}
+
+void profiler_sample(struct interrupt_frame const * const frame) {
+    if (__builtin_expect(!PROFILER_RUNNING, true)) {
+        return;
+    }
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    uint8_t const cpu = cpu_id();
+    if (cpu < NUM_SAMPLE_BUFFERS) {
+        struct sample_buffer * const buf = SAMPLE_BUFFERS + cpu;
+        uint32_t const len = buf->len;
+        if (len == PROFILER_BUFFER_LEN) {
+            buf->dropped++;
+        } else {
+            struct proc const * const curr = get_curr_proc();
+            struct profiler_sample * const sample = buf->samples + len;
+            sample->eip = frame->eip;
+            sample->pid = curr ? curr->pid : 0;
+            sample->cpu = cpu;
+            sample->user = (frame->cs & 3) == 3;
+            // Publish the sample only once fully written.
+            cpu_mfence();
+            buf->len = len + 1;
+        }
+    }
+    cpu_set_interrupt_flag(irqs);
+}
+
+// Compare two samples by instruction pointer.
+// @param a: The first sample.
+// @param b: The second sample.
+// @return: true if a sorts strictly before b.
+static bool eip_less(struct profiler_sample const * const a,
+                     struct profiler_sample const * const b) {
+    return a->eip < b->eip || (a->eip == b->eip && a->user < b->user);
+}
+
+// Compare two samples by pid.
+// @param a: The first sample.
+// @param b: The second sample.
+// @return: true if a sorts strictly before b.
+static bool pid_less(struct profiler_sample const * const a,
+                     struct profiler_sample const * const b) {
+    return a->pid < b->pid;
+}
+
+// Sort an array of samples. This is a shell sort, dumping a profile is not a
+// hot path and the number of samples is small.
+// @param samples: The samples to sort.
+// @param n: The number of samples.
+// @param less: The order to sort the samples in.
+static void sort_samples(struct profiler_sample * const samples,
+                         uint32_t const n,
+                         bool (*less)(struct profiler_sample const *,
+                                      struct profiler_sample const *)) {
+    for (uint32_t gap = n / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < n; ++i) {
+            struct profiler_sample const tmp = samples[i];
+            uint32_t j = i;
+            for (; j >= gap && less(&tmp, samples + j - gap); j -= gap) {
+                samples[j] = samples[j - gap];
+            }
+            samples[j] = tmp;
+        }
+    }
+}
+
+// Output the histograms of a set of sample buffers and empty them.
+// @param bufs: The sample buffers.
+// @param num_bufs: The number of buffers.
+static void dump_buffers(struct sample_buffer * const bufs,
+                         uint16_t const num_bufs) {
+    uint32_t total = 0;
+    uint32_t dropped = 0;
+    for (uint16_t i = 0; i < num_bufs; ++i) {
+        total += bufs[i].len;
+        dropped += bufs[i].dropped;
+    }
+    LOG("Profile: %u samples, %u dropped\n", total, dropped);
+    if (!total) {
+        return;
+    }
+
+    struct profiler_sample * const samples =
+        kmalloc(total * sizeof(*samples));
+    if (!samples) {
+        WARN("Cannot allocate %u samples for the profile\n", total);
+        return;
+    }
+    uint32_t n = 0;
+    for (uint16_t i = 0; i < num_bufs; ++i) {
+        uint32_t const len = bufs[i].len;
+        if (len) {
+            LOG("  cpu%u: %u samples, %u dropped\n", i, len, bufs[i].dropped);
+        }
+        memcpy(samples + n, bufs[i].samples, len * sizeof(*samples));
+        n += len;
+        bufs[i].len = 0;
+        bufs[i].dropped = 0;
+    }
+
+    sort_samples(samples, n, pid_less);
+    for (uint32_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && samples[j].pid == samples[i].pid; ++j);
+        LOG("  pid %u: %u samples\n", samples[i].pid, j - i);
+    }
+
+    // The format of those lines is parsed by `make profile_report`.
+    sort_samples(samples, n, eip_less);
+    for (uint32_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && !eip_less(samples + i, samples + j); ++j);
+        LOG("[prof] %x %u %c\n", samples[i].eip, j - i,
+            samples[i].user ? 'u' : 'k');
+    }
+    kfree(samples);
+}
+
+void profiler_dump(void) {
+    if (!SAMPLE_BUFFERS) {
+        return;
+    }
+    spinlock_lock(&PROFILER_DUMP_LOCK);
+    dump_buffers(SAMPLE_BUFFERS, NUM_SAMPLE_BUFFERS);
+    spinlock_unlock(&PROFILER_DUMP_LOCK);
+}
+
+#include <profiler.test>
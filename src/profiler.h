@@ -0,0 +1,41 @@
+#pragma once
+#include <types.h>
+#include <interrupt.h>
+
+// Sampling profiler.
+//    While the profiler is running, each scheduler tick (see sched_tick())
+// records a sample of the interrupted context: its instruction pointer, the cpu
+// and the pid of the current process. Samples are appended to the sample buffer
+// of the cpu without taking any lock, samples taken while the buffer is full
+// are dropped and counted. Since the tick is stopped on idle cpus, idle time is
+// mostly not sampled.
+//    profiler_dump() aggregates the samples into histograms. The kernel does
+// not have a symbol table, hence the histogram of instruction pointers is
+// output as raw addresses, one "[prof] <eip> <count> <k|u>" line per address,
+// which `make profile_report PROFILE_LOG=<file>` resolves against the symbols
+// of the kernel image, see the Makefile. Building the kernel with PROFILING=1
+// starts the profiler at boot and dumps the histograms once the tests
+// completed.
+
+// Allocate the per-cpu sample buffers. Must be called once the number of cpus
+// is known and dynamic allocation is available.
+void profiler_init(void);
+
+// Start recording samples on all cpus.
+void profiler_start(void);
+
+// Stop recording samples on all cpus.
+void profiler_stop(void);
+
+// Record a sample on the current cpu, if the profiler is running. Called from
+// the scheduler tick.
+// @param frame: The interrupt frame of the tick.
+void profiler_sample(struct interrupt_frame const * const frame);
+
+// Output the histograms of the samples per instruction pointer, per cpu and per
+// pid, then discard the samples. Should be called while the profiler is
+// stopped.
+void profiler_dump(void);
+
+// Run the profiler tests.
+void profiler_test(void);
@@ -0,0 +1,263 @@
+#include <rcu.h>
+#include <sched.h>
+#include <percpu.h>
+#include <acpi.h>
+#include <ipm.h>
+#include <timer.h>
+#include <clock.h>
+#include <cpumask.h>
+#include <spinlock.h>
+#include <kmalloc.h>
+#include <debug.h>
+
+// The number of quiescent states reported by each cpu so far.
+DECLARE_PER_CPU(uint32_t volatile, rcu_qs_count) = 0;
+
+// The state of the callbacks registered with call_rcu(). Only a single grace
+// period is tracked at a time, callbacks registered while it is in progress
+// wait for the next one.
+static struct rcu_state {
+    // Protects all of the fields below.
+    spinlock_t lock;
+    // The callbacks registered since the current grace period started.
+    struct list_node next;
+    // The callbacks waiting for the current grace period.
+    struct list_node waiting;
+    // true if a grace period is in progress.
+    bool gp_active;
+    // The rcu_qs_count of each cpu when the current grace period started.
+    uint32_t * gp_snap;
+    // The timer polling the grace period.
+    struct timer timer;
+    // true if the timer is pending or its callback is running.
+    bool timer_armed;
+} RCU;
+
+// Remote call used to kick a cpu which is late to report its quiescent state.
+// The IPM handler does the actual reporting if the interrupted context was
+// preemptible, see ipm_handler().
+// @param unused: Unused.
+static void rcu_kick(void * unused) {
+}
+
+// Take a snapshot of the quiescent state counters of all the cpus.
+// @param snap: The array receiving the counters, indexed by cpu.
+static void snapshot_qs(uint32_t * const snap) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        snap[cpu] = cpu_var(rcu_qs_count, cpu);
+    }
+}
+
+// Find the cpus that did not report a quiescent state since a snapshot.
+// @param snap: The snapshot taken by snapshot_qs().
+// @param lagging: Output parameter receiving the cpus that did not report a
+// quiescent state.
+// @return: true if all the cpus reported a quiescent state, i.e. the grace
+// period is over.
+static bool gp_done(uint32_t const * const snap, struct cpumask * lagging) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    cpumask_clear(lagging);
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        if (cpu_var(rcu_qs_count, cpu) == snap[cpu]) {
+            cpumask_set(lagging, cpu);
+        }
+    }
+    return !cpumask_weight(lagging);
+}
+
+// Kick the cpus that are late to report a quiescent state. The current cpu
+// is never kicked, it reports its own quiescent states.
+// @param lagging: The cpus to kick.
+static void kick_cpus(struct cpumask * const lagging) {
+    preempt_disable();
+    cpumask_unset(lagging, cpu_id());
+    if (cpumask_weight(lagging)) {
+        multicast_remote_call(lagging, rcu_kick, NULL, false);
+    }
+    preempt_enable();
+}
+
+// Report a quiescent state for the current cpu from a preemptible context.
+static void note_own_quiescent_state(void) {
+    preempt_disable();
+    rcu_note_quiescent_state();
+    preempt_enable();
+}
+
+// Move all the elements of a list at the tail of another.
+// @param dst: The destination list.
+// @param src: The source list, empty after this call.
+static void move_list(struct list_node * const dst,
+                      struct list_node * const src) {
+    while (!list_empty(src)) {
+        struct list_node * const node = list_first(src);
+        list_del(node);
+        list_add_tail(dst, node);
+    }
+}
+
+// Arm the polling timer on the current cpu. RCU.lock must be held.
+static void arm_timer(void) {
+    uint64_t const delay = RCU_POLL_PERIOD_MS * 1000000ULL;
+    timer_add(&RCU.timer, clock_now_ns() + delay);
+    RCU.timer_armed = true;
+}
+
+// Poll the current grace period, execute the callbacks waiting for it once it
+// is over and start the next one. Must be called with preemption disabled.
+static void process_callbacks(void) {
+    struct list_node done;
+    list_init(&done);
+    struct cpumask lagging;
+    cpumask_clear(&lagging);
+
+    spinlock_lock(&RCU.lock);
+    if (RCU.gp_active && gp_done(RCU.gp_snap, &lagging)) {
+        move_list(&done, &RCU.waiting);
+        RCU.gp_active = false;
+    }
+    if (!RCU.gp_active && !list_empty(&RCU.next)) {
+        // Start the next grace period, the cpus get a chance to report their
+        // quiescent states on their own before being kicked upon the next poll.
+        move_list(&RCU.waiting, &RCU.next);
+        snapshot_qs(RCU.gp_snap);
+        RCU.gp_active = true;
+    }
+    spinlock_unlock(&RCU.lock);
+
+    // Sending IPIs might enable interrupts, the lock must not be held.
+    kick_cpus(&lagging);
+
+    while (!list_empty(&done)) {
+        struct rcu_head * const head =
+            list_first_entry(&done, struct rcu_head, node);
+        list_del(&head->node);
+        // The callback might free or re-use the head.
+        head->func(head);
+    }
+}
+
+// Timer callback processing the callbacks and re-arming itself while some are
+// pending.
+// @param unused: Unused.
+static void rcu_poll(void * unused) {
+    process_callbacks();
+
+    spinlock_lock(&RCU.lock);
+    if (RCU.gp_active || !list_empty(&RCU.next)) {
+        arm_timer();
+    } else {
+        RCU.timer_armed = false;
+    }
+    spinlock_unlock(&RCU.lock);
+}
+
+void init_rcu(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    RCU.gp_snap = kmalloc(ncpus * sizeof(*RCU.gp_snap));
+    if (!RCU.gp_snap) {
+        PANIC("Cannot allocate RCU grace period snapshot\n");
+    }
+    spinlock_init(&RCU.lock);
+    list_init(&RCU.next);
+    list_init(&RCU.waiting);
+    RCU.gp_active = false;
+    RCU.timer_armed = false;
+    timer_init(&RCU.timer, rcu_poll, NULL);
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        cpu_var(rcu_qs_count, cpu) = 0;
+    }
+}
+
+void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+void rcu_note_quiescent_state(void) {
+    this_cpu_var(rcu_qs_count) ++;
+}
+
+void synchronize_rcu(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    uint32_t snap[ncpus];
+    snapshot_qs(snap);
+    // The caller is not in a read-side critical section.
+    note_own_quiescent_state();
+
+    uint64_t const period = RCU_POLL_PERIOD_MS * 1000000ULL;
+    uint64_t next_kick = 0;
+    struct cpumask lagging;
+    while (!gp_done(snap, &lagging)) {
+        uint64_t const now = clock_now_ns();
+        if (now >= next_kick) {
+            // Kick immediately, then again if some cpus were in a read-side
+            // critical section.
+            kick_cpus(&lagging);
+            next_kick = now + period;
+        }
+        note_own_quiescent_state();
+        if (sched_can_block()) {
+            sched_sleep(RCU_POLL_PERIOD_MS);
+        } else {
+            cpu_pause();
+        }
+    }
+}
+
+void call_rcu(struct rcu_head * const head, void (*func)(struct rcu_head *)) {
+    head->func = func;
+    spinlock_lock(&RCU.lock);
+    list_add_tail(&RCU.next, &head->node);
+    if (!RCU.timer_armed) {
+        arm_timer();
+    }
+    spinlock_unlock(&RCU.lock);
+}
+
+// The callback used by rcu_barrier().
+struct rcu_barrier {
+    struct rcu_head head;
+    bool volatile done;
+};
+
+// Signal the completion of an rcu_barrier().
+// @param head: The head of the struct rcu_barrier.
+static void rcu_barrier_func(struct rcu_head * const head) {
+    struct rcu_barrier * const barrier =
+        list_entry(head, struct rcu_barrier, head);
+    barrier->done = true;
+}
+
+void rcu_barrier(void) {
+    // Callbacks are executed in the order they were registered.
+    struct rcu_barrier barrier = { .done = false };
+    call_rcu(&barrier.head, rcu_barrier_func);
+
+    uint64_t const period = RCU_POLL_PERIOD_MS * 1000000ULL;
+    uint64_t next_poll = 0;
+    while (!barrier.done) {
+        // The caller is not in a read-side critical section.
+        note_own_quiescent_state();
+        uint64_t const now = clock_now_ns();
+        if (now >= next_poll) {
+            // The timer might be armed on this cpu while its interrupts are
+            // disabled, process the callbacks from here as well.
+            preempt_disable();
+            process_callbacks();
+            preempt_enable();
+            next_poll = now + period;
+        }
+        if (sched_can_block()) {
+            sched_sleep(RCU_POLL_PERIOD_MS);
+        } else {
+            cpu_pause();
+        }
+    }
+}
+
+#include <rcu.test>
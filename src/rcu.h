@@ -0,0 +1,86 @@
+#pragma once
+#include <types.h>
+#include <list.h>
+#include <atomic.h>
+
+// Read-Copy-Update (RCU)
+// ======================
+//     RCU lets readers of read-mostly data structures run without taking any
+// lock nor writing any shared memory. Readers delimit their accesses with
+// rcu_read_lock() and rcu_read_unlock(), which only disable preemption. Writers
+// serialize among themselves (e.g. with a spinlock), publish new objects with
+// rcu_assign_pointer() and, after unlinking an object, wait for a grace period
+// before freeing it, either synchronously with synchronize_rcu() or
+// asynchronously with call_rcu().
+//     A grace period ends once every cpu has been through a quiescent state,
+// that is a point where it cannot be in a read-side critical section. Since
+// readers disable preemption, any point where a cpu is preemptible is a
+// quiescent state. Each cpu counts its quiescent states in a per-cpu counter,
+// incremented upon schedule() and upon interrupts (timer and IPM) that
+// interrupted a preemptible context. A grace period starts by snapshotting the
+// counters and ends once all of them changed. Cpus that do not report a
+// quiescent state on their own, e.g. idle cpus with their tick stopped, are
+// kicked with an IPI whose handler reports it.
+//     Callbacks registered with call_rcu() are processed by a timer polling the
+// current grace period every RCU_POLL_PERIOD_MS ms. They run in the timer
+// interrupt, with interrupts enabled but preemption disabled, and therefore
+// must not block.
+
+// The period at which the callbacks' grace period is polled.
+#define RCU_POLL_PERIOD_MS  1
+
+// A callback to be executed after a grace period, embedded in the object it
+// frees.
+struct rcu_head {
+    // Node in the list of callbacks.
+    struct list_node node;
+    // The function called after the grace period.
+    void (*func)(struct rcu_head *);
+};
+
+// Read a pointer to an RCU-protected object. The object can then be accessed
+// until the end of the read-side critical section.
+// @param p: The pointer to read.
+#define rcu_dereference(p)  (*(typeof(p) volatile *)&(p))
+
+// Publish a pointer to an RCU-protected object. All the writes initializing
+// the object are visible to readers getting the pointer.
+// @param p: The pointer to write.
+// @param v: The new value of the pointer.
+#define rcu_assign_pointer(p, v)                    \
+    do {                                            \
+        atomic_compiler_barrier();                  \
+        *(typeof(p) volatile *)&(p) = (v);          \
+    } while (0)
+
+// Initialize the RCU state. Must be called once the timers and IPMs are
+// initialized.
+void init_rcu(void);
+
+// Enter an RCU read-side critical section. Sections can be nested.
+void rcu_read_lock(void);
+
+// Exit an RCU read-side critical section.
+void rcu_read_unlock(void);
+
+// Report a quiescent state for the current cpu. Must be called with preemption
+// disabled, from a point where the cpu was preemptible.
+void rcu_note_quiescent_state(void);
+
+// Wait for a grace period: all the read-side critical sections in progress
+// when this function is called are over when it returns. Must not be called
+// from a read-side critical section. Blocks if possible, busy-waits otherwise.
+void synchronize_rcu(void);
+
+// Execute a callback after a grace period, without waiting for it.
+// @param head: The rcu_head embedded in the object, not to be used until the
+// callback runs.
+// @param func: The callback, called with `head` as argument.
+void call_rcu(struct rcu_head * const head, void (*func)(struct rcu_head *));
+
+// Wait for all the callbacks registered with call_rcu() before this call to
+// have been executed. Must not be called from a read-side critical section.
+void rcu_barrier(void);
+
+// Execute RCU tests.
+void rcu_test(void);
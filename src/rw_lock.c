@@ -1,51 +1,83 @@
 #include <rw_lock.h>
 #include <memory.h>
 #include <debug.h>
+#include <cpu.h>
 
 void rwlock_init(rwlock_t * const lock) {
     rwlock_t const default_lock = INIT_RW_LOCK();
     memcpy(lock, &default_lock, sizeof(*lock));
 }
 
-void rwlock_read_lock(rwlock_t * const lock) {
-    spinlock_lock(&lock->readers_lock);
-    lock->num_readers ++;
-
-    if (lock->num_readers == 1) {
-        // This is the first reader, acquire the write lock to block writers.
-        //
-        // FIXME: We need to enable interrupts here as we are acquiring a second
-        // lock and having interrupts disabled here could cause a deadlock if a
-        // cpu with the writer lock tries to do a TLB shootdown.
-        // Enabling interrupts here could be dangerous but for now we don't have
-        // a choice.
-        cpu_set_interrupt_flag(true);
-        spinlock_lock(&lock->writer_lock);
+// Wait for the RWLOCK_WRITER bit of a lock to be cleared. The interrupt flag of
+// the caller of rwlock_read_lock() is restored while waiting, see rw_lock.h.
+// Interrupts are disabled again upon return.
+// @param lock: The lock to wait on.
+// @param irq: The interrupt flag of the caller of rwlock_read_lock().
+static void wait_for_writer(rwlock_t * const lock, bool const irq) {
+    cpu_set_interrupt_flag(irq);
+    while (atomic_read(&lock->state) & RWLOCK_WRITER) {
+        cpu_pause();
     }
-    spinlock_unlock(&lock->readers_lock);
+    cpu_set_interrupt_flag(false);
 }
 
-void rwlock_read_unlock(rwlock_t * const lock) {
-    spinlock_lock(&lock->readers_lock);
-    lock->num_readers --;
-
-    if (!lock->num_readers) {
-        // This is the last reader, releas the write lock to unblock writers.
-        // FIXME: Since the first and last readers might be different cpus, we
-        // need to fixup the owner field in the spinlock. This is disgusting.
-        lock->writer_lock.owner = cpu_id();
-        spinlock_unlock(&lock->writer_lock);
+void rwlock_read_lock(rwlock_t * const lock) {
+    bool const irq = interrupts_enabled();
+    // Interrupts are disabled while the reader count is incremented, so that
+    // an interrupt handler cannot see the transient increment of a reader
+    // backing off on the same cpu.
+    cpu_set_interrupt_flag(false);
+
+    while (true) {
+        int32_t const old = atomic_fetch_and_add(&lock->state, 1);
+        if (!(old & RWLOCK_WRITER)) {
+            // No writer, the read lock is acquired.
+            break;
+        }
+        // A writer is holding the lock or waiting for it, back off and wait
+        // until it is done before trying again.
+        atomic_dec(&lock->state);
+        wait_for_writer(lock, irq);
     }
-    spinlock_unlock(&lock->readers_lock);
+
+    cpu_set_interrupt_flag(irq);
 }
 
+void rwlock_read_unlock(rwlock_t * const lock) {
+    ASSERT(atomic_read(&lock->state) & ~RWLOCK_WRITER);
+    atomic_dec(&lock->state);
+}
 
 void rwlock_write_lock(rwlock_t * const lock) {
-    spinlock_lock(&lock->writer_lock);
+    // Interrupts are only disabled once the lock is acquired, see rw_lock.h.
+    bool const irq = interrupts_enabled();
+
+    // Set the RWLOCK_WRITER bit, this prevents new readers from acquiring the
+    // lock. Only one writer can set the bit at a time.
+    while (true) {
+        int32_t const old = atomic_read(&lock->state) & ~RWLOCK_WRITER;
+        int32_t const new = old | RWLOCK_WRITER;
+        if (atomic_compare_and_exchange(&lock->state, old, new) == old) {
+            break;
+        }
+        cpu_pause();
+    }
+
+    // Wait for the current readers to release the lock. Readers that are
+    // backing off might increment the count transiently, this is fine.
+    while (atomic_read(&lock->state) != RWLOCK_WRITER) {
+        cpu_pause();
+    }
+
+    cpu_set_interrupt_flag(false);
+    lock->interrupts_enabled = irq;
 }
 
 void rwlock_write_unlock(rwlock_t * const lock) {
-    spinlock_unlock(&lock->writer_lock);
+    ASSERT(atomic_read(&lock->state) & RWLOCK_WRITER);
+    bool const irq = lock->interrupts_enabled;
+    atomic_sub(&lock->state, RWLOCK_WRITER);
+    cpu_set_interrupt_flag(irq);
 }
 
 #include <rw_lock.test>
@@ -1,29 +1,63 @@
 #pragma once
-#include <spinlock.h>
+#include <atomic.h>
 
+// A reader-writer lock preferring writers: once a writer is waiting for the
+// lock, new readers wait for it to be done. The whole state of the lock is a
+// single atomic_t:
+//  - Bits 0 to 29 contain the number of readers currently holding the lock (or
+//  trying to acquire it).
+//  - Bit 30 (RWLOCK_WRITER) is set when a writer either holds the lock or is
+//  waiting for the current readers to release it.
+// Acquiring a read lock is therefore a single atomic increment as long as no
+// writer is around, readers do not serialize on each other. A writer first sets
+// the RWLOCK_WRITER bit, from this point on new readers back off, and then
+// waits for the existing readers to drain. This means that writers cannot be
+// starved by a continuous flow of readers.
+//
+// Waiters keep the interrupt flag of the caller while spinning: the holders of
+// the lock run with interrupts enabled (readers) or might enable them (e.g. a
+// TLB shootdown) and could be waiting for this cpu to acknowledge an IPI. Once
+// acquired, readers run with the interrupt flag of the caller while writers
+// keep interrupts disabled until the write lock is released. As a consequence,
+// rwlocks must not be acquired from interrupt handlers.
 typedef struct {
-    spinlock_t readers_lock; 
-    // Protected by readers_lock.
-    uint32_t num_readers;
-    spinlock_t writer_lock;
+    atomic_t state;
+    // The value of the interrupt flag of the writer before it acquired the
+    // lock. Only valid while the write lock is held.
+    bool interrupts_enabled;
 } rwlock_t;
 
+// Bit in the state of a rwlock_t indicating that a writer holds the lock or is
+// waiting for it.
+#define RWLOCK_WRITER   (1 << 30)
+
 #define INIT_RW_LOCK()                      \
     {                                       \
-        .readers_lock = INIT_SPINLOCK(),    \
-        .num_readers = 0,                   \
-        .writer_lock = INIT_SPINLOCK(),     \
+        .state = { .value = 0 },            \
+        .interrupts_enabled = false,        \
     }
 
 #define DECLARE_RW_LOCK(name) \
     rwlock_t name = INIT_RW_LOCK()
 
+// Initialize a rwlock_t.
+// @param lock: The lock to initialize.
 void rwlock_init(rwlock_t * const lock);
 
+// Acquire a read lock.
+// @param lock: The lock to acquire.
 void rwlock_read_lock(rwlock_t * const lock);
+
+// Release a read lock.
+// @param lock: The lock to release.
 void rwlock_read_unlock(rwlock_t * const lock);
 
+// Acquire the write lock.
+// @param lock: The lock to acquire.
 void rwlock_write_lock(rwlock_t * const lock);
+
+// Release the write lock.
+// @param lock: The lock to release.
 void rwlock_write_unlock(rwlock_t * const lock);
 
 void rwlock_test(void);
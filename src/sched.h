@@ -44,6 +44,21 @@ struct sched {
     void (*put_prev_proc)(struct proc * proc);
 };
 
+// The scheduler implementations available:
+//  - ts_sched: The Trivial Scheduler, a single runqueue shared by all cpus.
+//  - ws_sched: The Work Stealing scheduler, one runqueue per cpu with idle
+//  cpus stealing processes from the busiest runqueue.
+//  - fair_sched: A weighted fair scheduler, processes are scheduled by lowest
+//  virtual runtime, weighted by their nice value.
+extern struct sched ts_sched;
+extern struct sched ws_sched;
+extern struct sched fair_sched;
+
+// Select the scheduler implementation to be used. This must be called before
+// sched_init().
+// @param sched: The scheduler to use.
+void sched_select(struct sched * const sched);
+
 // Initialize the scheduler. This must be called once.
 void sched_init(void);
 
@@ -77,11 +92,63 @@ void schedule(void);
 // Signal to the scheduler that the current process should be rescheduled ASAP.
 void sched_resched(void);
 
+// Get the time a cpu spent running its idle process.
+// @param cpu: The cpu.
+// @return: The idle time of the cpu in nanoseconds, 0 if the scheduler has not
+// been initialized.
+uint64_t sched_cpu_idle_ns(uint8_t const cpu);
+
 // Check whether or not a cpu is idle.
 // @param cpu: The cpu to check.
 // @return: true if the cpu is idle, false otherwise.
 bool cpu_is_idle(uint8_t const cpu);
 
+// Blocking
+// ========
+//      A process waiting for an event can give its cpu to other processes by
+// blocking. A blocking process is marked PROC_BLOCKED, hence not runnable: the
+// next call to schedule() switches it out and the scheduler does not enqueue it
+// back. It is put back into the scheduler by sched_wake_up_proc(). The usual
+// pattern, implemented by wait queues (see wait_queue.h), is:
+//      sched_prepare_block();
+//      if (!condition) schedule();
+//      sched_finish_block();
+// with the waker making the condition true _before_ calling
+// sched_wake_up_proc(). Wake-ups are never lost: a process woken up between
+// sched_prepare_block() and schedule() either is not switched out or is put
+// back into the scheduler right after being switched out.
+
+// Check if the current context can block. This is the case if the scheduler is
+// running on this cpu and the current process is preemptible and not the idle
+// process. Other contexts (interrupt handlers, code running with preemption
+// disabled or before the scheduler started, ...) must busy-wait instead.
+// @return: true if the current process can block, false otherwise.
+bool sched_can_block(void);
+
+// Mark the current process as blocking. It will be switched out by the next
+// call to schedule(), until it is woken up. The caller must be able to block.
+void sched_prepare_block(void);
+
+// Mark the current process as not blocking anymore. This must be called after
+// sched_prepare_block(), whether or not the process was switched out.
+void sched_finish_block(void);
+
+// Wake up a process that blocked (or is about to block) after calling
+// sched_prepare_block(). The process is put back into the scheduler if it has
+// been switched out.
+// @param proc: The process to wake up.
+// @return: true if the process was blocked or blocking, false if it was not
+// blocking, in which case this function has no effect.
+bool sched_wake_up_proc(struct proc * const proc);
+
+// Put the current process to sleep for a given duration. If the current
+// process can block, its cpu is given to other processes in the meantime and
+// the process is woken up by a timer on its cpu (see timer.h), the sleep can
+// therefore be up to a jiffy (~1ms) longer than requested.
+// Otherwise this function busy-waits.
+// @param ms: The duration of the sleep in milliseconds.
+void sched_sleep(uint32_t const ms);
+
 // Disable preemption of the current process running on the current cpu. This
 // function can be called multiple times (even in nested interrupt) but
 // preemption will only be enabled back if preempt_enable() is called the exact
@@ -119,3 +186,9 @@ void set_curr_proc(struct proc * const proc);
 
 // Execute scheduling tests.
 void sched_test(void);
+
+// Execute tests of the WS scheduler.
+void ws_test(void);
+
+// Execute tests of the fair scheduler.
+void fair_test(void);
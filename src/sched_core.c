@@ -5,6 +5,16 @@
 #include <acpi.h>
 #include <lapic.h>
 #include <list.h>
+#include <ipm.h>
+#include <frame_alloc.h>
+#include <tracelog.h>
+#include <clock.h>
+#include <profiler.h>
+#include <timer.h>
+#include <mwait.h>
+#include <rcu.h>
+
+DEFINE_TRACEPOINT(sched_pick);
 
 // The core logic of scheduling. This file defines the functions declared in
 // sched.h.
@@ -32,21 +42,106 @@ DECLARE_PER_CPU(uint64_t, context_switches) = 0;
 // preempt_disable(), preempt_enable() and preemptible().
 DECLARE_PER_CPU(uint32_t, preempt_count) = 0;
 
-// The interrupt vector to use for scheduler ticks.
-#define SCHED_TICK_VECTOR   34
-
 // The period between two scheduler ticks in ms.
 #define SCHED_TICK_PERIOD   4
 
+// The scheduler tick is a timer of the timer wheel of each cpu, re-added by its
+// callback every SCHED_TICK_PERIOD ms.
+// Tickless idle: When a cpu has nothing to run and goes idle, it cancels its
+// scheduler tick instead of waking up every SCHED_TICK_PERIOD ms for nothing.
+// The LAPIC timer is then only armed for the other timers of the cpu, if any.
+// The tick is re-armed as soon as the cpu runs a process again.
+// Wake-ups: Cpus making a process available to the scheduler (enqueue or
+// put_prev) send a reschedule IPI (see send_resched_ipm()) to an idle cpu, if
+// any, so that the process does not wait for the next tick of that cpu, which
+// might never come if its tick is stopped.
+// The cpu going idle sets its nohz_idle flag _before_ calling pick_next_proc,
+// and cpus making a process available check the flags _after_ calling the
+// scheduler's callback. Since both callbacks synchronize on the runqueue(s),
+// either the idle cpu sees the process or the other cpu sees the flag.
+// Polling idle: When MWAIT is supported, an idle cpu with its nohz_idle flag
+// set waits in MWAIT on the cache line of that flag, with its idle_polling flag
+// set. Clearing the nohz_idle flag is then enough to wake the cpu up and the
+// IPI is skipped. The idle cpu sets idle_polling _before_ reading nohz_idle a
+// last time and the waking cpu reads idle_polling _after_ clearing nohz_idle,
+// hence either the idle cpu does not wait or the waking cpu sees it polling.
+
+// Indicate if the scheduler tick of a cpu is currently stopped. Only accessed
+// by the cpu itself.
+DECLARE_PER_CPU(bool, tick_stopped) = false;
+
+// The timer of the scheduler tick of each cpu.
+DECLARE_PER_CPU(struct timer, sched_tick_timer);
+
+static void sched_tick(void * unused);
+
+// Indicate that a cpu is idle, or about to be, with its tick stopped and needs
+// an IPI to notice new work. Set by the cpu itself and cleared by the cpu
+// sending the wake-up IPI.
+DECLARE_PER_CPU(bool volatile, nohz_idle) = false;
+
+// Indicate that a cpu is waiting in MWAIT for its nohz_idle flag to be cleared,
+// see "Polling idle" above. Only set with interrupts disabled, between the last
+// check of nohz_idle and the end of the MWAIT.
+DECLARE_PER_CPU(bool volatile, idle_polling) = false;
+
+// A process sleeping in sched_sleep(). The struct lives on the stack of the
+// process.
+struct sleeper {
+    // The process.
+    struct proc * proc;
+    // Set by the timer callback waking up the process.
+    bool volatile expired;
+    // The timer waking up the process.
+    struct timer timer;
+};
+
 // Each cpu has an idle kernel process which only goal is to put the current cpu
 // in idle. This process is run any time there is no other process to run on a
 // cpu.
 DECLARE_PER_CPU(struct proc *, idle_proc);
 
-// The actual idle_proc.
+// Put the current cpu in a low power state until the next interrupt, or until
+// its nohz_idle flag is cleared if MWAIT is supported. Interrupts are masked
+// during MWAIT, they break it nonetheless and are delivered once idle_polling
+// has been cleared, so that an interrupt cannot schedule away from idle while
+// the cpu is still advertised as polling.
+// @return: true if the nohz_idle flag has been cleared, i.e. the cpu has been
+// woken up without an IPI and must call schedule() itself.
+static bool idle_wait(void) {
+    if (!mwait_irq_break_supported()) {
+        cpu_set_interrupt_flag_and_halt();
+        return false;
+    }
+    cpu_set_interrupt_flag(false);
+    bool volatile * const nohz = &this_cpu_var(nohz_idle);
+    if (!*nohz) {
+        // The tick is running, there is no flag to wait on.
+        cpu_set_interrupt_flag_and_halt();
+        return false;
+    }
+    this_cpu_var(idle_polling) = true;
+    cpu_mfence();
+    cpu_monitor(nohz);
+    if (*nohz) {
+        // Bit 0 of ECX: masked interrupts break MWAIT.
+        cpu_mwait(0, 1);
+    }
+    this_cpu_var(idle_polling) = false;
+    bool const woken = !*nohz;
+    cpu_set_interrupt_flag(true);
+    return woken;
+}
+
+// The actual idle_proc. Idle time is used to drain the log rings and pre-zero
+// frames for alloc_zeroed_frame(), the cpu is put in a low power state once
+// there is nothing left to do.
 static void do_idle(void * unused) {
     while (true) {
-        cpu_set_interrupt_flag_and_halt();
+        tty_drain();
+        if (!frame_alloc_refill_zeroed_pool() && idle_wait()) {
+            schedule();
+        }
     }
 }
 
@@ -70,6 +165,10 @@ void sched_init(void) {
         cpu_var(sched_running, cpu) = false;
         cpu_var(context_switches, cpu) = 0;
         cpu_var(preempt_count, cpu) = 0;
+        cpu_var(tick_stopped, cpu) = false;
+        cpu_var(nohz_idle, cpu) = false;
+        cpu_var(idle_polling, cpu) = false;
+        timer_init(&cpu_var(sched_tick_timer, cpu), sched_tick, NULL);
     }
 
     // Initialize the actual scheduler.
@@ -77,24 +176,102 @@ void sched_init(void) {
         SCHEDULER->sched_init();
 }
 
+void sched_select(struct sched * const sched) {
+    SCHEDULER = sched;
+}
+
 bool sched_running_on_cpu(void) {
     return this_cpu_var(sched_running);
 }
 
-// Handle a tick of the scheduler timer.
-// @param frame: Unused, but mandatory to be used as an interrupt callback.
-static void sched_tick(struct interrupt_frame const * const frame) {
+// Arm the scheduler tick of the current cpu to fire in SCHED_TICK_PERIOD ms.
+static void enable_sched_tick(void) {
+    uint64_t const deadline = clock_now_ns() + SCHED_TICK_PERIOD * 1000000ULL;
+    timer_add(&this_cpu_var(sched_tick_timer), deadline);
+}
+
+// Handle a tick of the scheduler timer. Runs in the timer interrupt with
+// preemption disabled, the resched requested by the scheduler, if any, happens
+// when the interrupt re-enables preemption.
+// @param unused: Unused.
+static void sched_tick(void * unused) {
     ASSERT(SCHEDULER);
-    preempt_disable();
+    // The interrupted context is sampled by the profiler.
+    profiler_sample(timer_interrupt_frame());
+    if (!this_cpu_var(sched_running)) {
+        // The scheduler has been stopped on this cpu, do not re-arm the tick.
+        return;
+    }
+    enable_sched_tick();
     SCHEDULER->tick();
-    preempt_enable();
 }
 
-// Arm the LAPIC timer to send a tick in SCHED_TICK_PERIOD ms.
-static void enable_sched_tick(void) {
-    // Start the scheduler timer to fire every SCHED_TICK_PERIOD ms.
-    // This will enable interrupts.
-    lapic_start_timer(SCHED_TICK_PERIOD, true, SCHED_TICK_VECTOR, sched_tick);
+// Stop the scheduler tick of the current cpu, if it is not already stopped.
+// Called when the current cpu goes idle. Other timers, e.g. the ones of the
+// processes sleeping on this cpu, keep running.
+static void stop_sched_tick(void) {
+    if (!this_cpu_var(tick_stopped)) {
+        timer_cancel(&this_cpu_var(sched_tick_timer));
+        this_cpu_var(tick_stopped) = true;
+    }
+}
+
+// Re-arm the scheduler tick of the current cpu if it was stopped.
+static void restart_sched_tick(void) {
+    if (this_cpu_var(tick_stopped)) {
+        enable_sched_tick();
+        this_cpu_var(tick_stopped) = false;
+    }
+}
+
+// Check if a cpu is idle and should be sent a reschedule IPI when a process
+// becomes available.
+// @param cpu: The cpu to check.
+// @return: true if the cpu is idle, either with its tick stopped or not.
+static bool cpu_needs_wake_up(uint8_t const cpu) {
+    return cpu_var(nohz_idle, cpu) || cpu_is_idle(cpu);
+}
+
+// Find an idle cpu to wake up after a process has been made available to the
+// scheduler.
+// @param proc: The process that was made available.
+// @return: The cpu to wake up, -1 if there is none. The cpu the process is
+// enqueued on is preferred. Otherwise an idle cpu with a stopped tick is
+// returned so that it can pick or steal the process, as it will not notice the
+// process on its own.
+static int16_t wake_up_target(struct proc const * const proc) {
+    uint8_t const self = cpu_id();
+    if (proc->cpu != self && cpu_needs_wake_up(proc->cpu)) {
+        return proc->cpu;
+    }
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        if (cpu != self && cpu_var(nohz_idle, cpu)) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+// Wake up an idle cpu, if any, so that it can run a process that was just made
+// available to the scheduler.
+// @param proc: The process that was made available.
+static void wake_up_idle_cpu(struct proc const * const proc) {
+    // Make sure the process is visible in the runqueue before reading the
+    // nohz_idle flags.
+    cpu_mfence();
+    int16_t const target = wake_up_target(proc);
+    if (target >= 0) {
+        // Clear the flag to avoid considering the target again until it goes
+        // idle again.
+        cpu_var(nohz_idle, target) = false;
+        // A polling target wakes up from the write above, see comment at the
+        // top of this file.
+        cpu_mfence();
+        if (!cpu_var(idle_polling, target)) {
+            send_resched_ipm(target);
+        }
+    }
 }
 
 void sched_start(void) {
@@ -120,6 +297,7 @@ void sched_enqueue_proc(struct proc * const proc) {
 
     preempt_disable();
     SCHEDULER->enqueue_proc(proc);
+    wake_up_idle_cpu(proc);
     preempt_enable();
 }
 
@@ -137,6 +315,7 @@ void sched_update_curr(void) {
     cpu_set_interrupt_flag(false);
 
     struct proc * const curr = get_curr_proc();
+    proc_account_runtime(curr);
     if (!proc_is_runnable(curr)) {
         // The current proc is not runnable anymore, we should set the
         // resched_flag so that the next call to schedule() will choose another
@@ -173,8 +352,20 @@ static bool curr_cpu_need_resched(void) {
 void sched_put_prev_proc(struct proc * const prev) {
     preempt_disable();
     struct proc * const idle = this_cpu_var(idle_proc);
+    if (prev && atomic_read(&prev->block_state) != PROC_BLOCK_NONE) {
+        // The process blocked. It is now switched out, hence it can be
+        // enqueued by the cpu waking it up, unless it has been woken up while
+        // switching out, in which case it must be enqueued here.
+        int32_t const old = atomic_compare_and_exchange(&prev->block_state,
+            PROC_BLOCK_BLOCKING, PROC_BLOCK_BLOCKED);
+        if (old == PROC_BLOCK_WOKEN) {
+            atomic_write(&prev->block_state, PROC_BLOCK_NONE);
+            prev->state_flags &= ~PROC_BLOCKED;
+        }
+    }
     if (SCHEDULER && prev && prev != idle && proc_is_runnable(prev)) {
         SCHEDULER->put_prev_proc(prev);
+        wake_up_idle_cpu(prev);
     }
     preempt_enable();
 }
@@ -192,14 +383,39 @@ void schedule(void) {
     // We are changing the state (e.g. curr proc) of the current cpu, preemption
     // must be disabled.
     preempt_disable();
+    // The cpu was preemptible, hence not in an RCU read-side critical section.
+    rcu_note_quiescent_state();
     if (curr_cpu_need_resched()) {
         struct proc * const curr = get_curr_proc();
         struct proc * const idle = this_cpu_var(idle_proc);
 
+        // The tick is only managed once the scheduler has been started on
+        // this cpu.
+        bool const nohz = this_cpu_var(sched_running);
+        if (nohz) {
+            // Announce that this cpu might go idle _before_ looking at the
+            // runqueue, see comment at the top of this file.
+            this_cpu_var(nohz_idle) = true;
+            cpu_mfence();
+        }
+
         // Pick a new process to run. Default to idle_proc.
         struct proc * next = SCHEDULER->pick_next_proc();
         next = (next == NO_PROC) ? idle : next;
         ASSERT(proc_is_runnable(next));
+        TRACEPOINT(sched_pick, "curr=%u next=%u idle=%u", curr ? curr->pid : 0,
+                   next->pid, next == idle);
+
+        if (nohz && next == idle) {
+            // The flag might have been cleared by a cpu sending a reschedule
+            // IPI to this cpu after pick_next_proc. Setting it again is harmless
+            // since the IPI is pending anyway.
+            this_cpu_var(nohz_idle) = true;
+            stop_sched_tick();
+        } else if (nohz) {
+            this_cpu_var(nohz_idle) = false;
+            restart_sched_tick();
+        }
 
         this_cpu_var(resched_flag) = false;
 
@@ -227,6 +443,120 @@ void sched_resched(void) {
     preempt_enable();
 }
 
+uint64_t sched_cpu_idle_ns(uint8_t const cpu) {
+    struct proc const * const idle = cpu_var(idle_proc, cpu);
+    if (!idle) {
+        return 0;
+    }
+    uint64_t idle_ns = idle->runtime_ns;
+    if (cpu_var(curr_proc, cpu) == idle) {
+        // The runtime of idle is only accounted when it is switched out. Add
+        // the time since, which is racy for a remote cpu but close enough.
+        uint64_t const now = clock_now_ns();
+        uint64_t const start = idle->run_start_ns;
+        idle_ns += now > start ? now - start : 0;
+    }
+    return idle_ns;
+}
+
+bool sched_can_block(void) {
+    if (!SCHEDULER || !preemptible()) {
+        return false;
+    }
+    // Preemption is enabled, disable it while reading the percpu variables.
+    preempt_disable();
+    struct proc * const curr = get_curr_proc();
+    bool const res = this_cpu_var(sched_running) && curr &&
+        curr != this_cpu_var(idle_proc);
+    preempt_enable_no_resched();
+    return res;
+}
+
+void sched_prepare_block(void) {
+    // Interrupts are disabled so that the process cannot be switched out
+    // between the two updates.
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    struct proc * const curr = get_curr_proc();
+    ASSERT(curr && curr != this_cpu_var(idle_proc));
+    curr->state_flags |= PROC_BLOCKED;
+    atomic_write(&curr->block_state, PROC_BLOCK_BLOCKING);
+    cpu_set_interrupt_flag(irqs);
+}
+
+void sched_finish_block(void) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    struct proc * const curr = get_curr_proc();
+    // If the process was switched out, sched_wake_up_proc() already made it
+    // runnable. Otherwise it is still BLOCKING or WOKEN and nobody else will
+    // touch its state since it is running.
+    atomic_exchange(&curr->block_state, PROC_BLOCK_NONE);
+    curr->state_flags &= ~PROC_BLOCKED;
+    cpu_set_interrupt_flag(irqs);
+}
+
+bool sched_wake_up_proc(struct proc * const proc) {
+    // The process is still running on its cpu, sched_finish_block() or
+    // sched_put_prev_proc() will take care of it.
+    if (atomic_compare_and_exchange(&proc->block_state, PROC_BLOCK_BLOCKING,
+        PROC_BLOCK_WOKEN) == PROC_BLOCK_BLOCKING) {
+        return true;
+    }
+    // The process has been switched out, this cpu is now responsible for
+    // putting it back into the scheduler.
+    if (atomic_compare_and_exchange(&proc->block_state, PROC_BLOCK_BLOCKED,
+        PROC_BLOCK_NONE) == PROC_BLOCK_BLOCKED) {
+        proc->state_flags &= ~PROC_BLOCKED;
+        sched_enqueue_proc(proc);
+        return true;
+    }
+    return false;
+}
+
+// The callback of the timer of a process sleeping in sched_sleep().
+// @param arg: The struct sleeper of the process.
+static void wake_up_sleeper(void * const arg) {
+    struct sleeper * const sleeper = arg;
+    // The sleeper is on the stack of the process, it must not be accessed
+    // once expired is set.
+    struct proc * const proc = sleeper->proc;
+    sleeper->expired = true;
+    sched_wake_up_proc(proc);
+}
+
+void sched_sleep(uint32_t const ms) {
+    uint64_t const deadline = clock_now_ns() + ms * 1000000ULL;
+    if (!sched_can_block()) {
+        while (clock_now_ns() < deadline) {
+            cpu_pause();
+        }
+        return;
+    }
+
+    struct sleeper sleeper = {
+        .proc = get_curr_proc(),
+        .expired = false,
+    };
+    timer_init(&sleeper.timer, wake_up_sleeper, &sleeper);
+
+    // Interrupts are disabled until the process is marked as blocking so that
+    // the timer cannot fire before that.
+    cpu_set_interrupt_flag(false);
+    sched_prepare_block();
+    timer_add(&sleeper.timer, deadline);
+    cpu_set_interrupt_flag(true);
+
+    // The process will only be scheduled again once it has been woken up by
+    // wake_up_sleeper(). The loop handles the case where the process got
+    // preempted before reaching this point and has been woken up already, in
+    // which case schedule() returns immediately.
+    while (!sleeper.expired) {
+        schedule();
+    }
+    sched_finish_block();
+}
+
 bool cpu_is_idle(uint8_t const cpu) {
     struct proc * const curr = cpu_var(curr_proc, cpu);
     struct proc * const idle = cpu_var(idle_proc, cpu);
@@ -237,15 +567,9 @@ bool cpu_is_idle(uint8_t const cpu) {
 }
 
 void preempt_disable(void) {
-    // Accessing percpu variable in a preemptible context is not safe, therefore
-    // make sure to disable preemption but temporarily disabling interrupts.
-    bool const int_flag = interrupts_enabled();
-    cpu_set_interrupt_flag(false);
-
-    this_cpu_var(preempt_count)++;
-
-    // Reset interrupt flag as it was before this function.
-    cpu_set_interrupt_flag(int_flag);
+    // The increment is a single instruction, it cannot be interrupted and
+    // therefore does not need to run with interrupts disabled.
+    this_cpu_inc(preempt_count);
 
     // Make sure nothing crosses a call to preempt_disable().
     cpu_mfence();
@@ -286,12 +610,6 @@ void preempt_enable_no_resched(void) {
     do_preempt_enable(false);
 }
 
-// Get the value of this cpu's variable `var`. This macro will NOT CHECK THE
-// PRERIQUISITES. This macro is meant to be used by the preemptible() function
-// ONLY.
-// @param var: The name of the variable, as declared using DECLARE_PER_CPU.
-#define this_cpu_var_unsafe(var) (*(_THIS_CPU_VAR_PTR(var)))
-
 bool preemptible(void) {
     // Accessing percpu variable in a preemptible context is not safe, therefore
     // make sure to disable preemption but temporarily disabling interrupts.
@@ -320,19 +638,12 @@ void preempt_reset(void) {
     this_cpu_var_unsafe(preempt_count) = 0;
 }
 
-#undef this_cpu_var_unsafe
-
 struct proc *get_curr_proc(void) {
-    preempt_disable();
-    struct proc * const curr = this_cpu_var(curr_proc);
-    preempt_enable();
-    return curr;
+    return this_cpu_read(curr_proc);
 }
 
 void set_curr_proc(struct proc * const proc) {
-    preempt_disable();
-    this_cpu_var(curr_proc) = proc;
-    preempt_enable();
+    this_cpu_write(curr_proc, proc);
 }
 
 #include <sched.test>
@@ -119,6 +119,10 @@ struct tss {
     uint16_t io_map_base_addr;
 } __attribute__((packed));
 STATIC_ASSERT(sizeof(struct tss) == 104, "");
+// The SYSENTER entry point accesses the TSS with hardcoded offsets, see
+// sysenter_entry in syscalls_asm.S.
+STATIC_ASSERT(offsetof(struct tss, esp0) == 0x4, "");
+STATIC_ASSERT(offsetof(struct tss, gs) == 0x5C, "");
 
 // Each CPU has its own TSS since each cpu has its own kernel stack.
 DECLARE_PER_CPU(struct tss, tss);
@@ -260,10 +264,10 @@ static union segment_descriptor_t BOOT_GDT[] __attribute__((aligned(8))) = {
 // is enabled and the dynamic memory allocator is initialized.
 // The final GDT will have the following layout, assuming N cpus:
 //   0   |   NULL entry                  |
-//   1   |   Kernel Data Segment         |
-//   2   |   Kernel Code Segment         |
-//   3   |   User Data Segment           |
-//   4   |   User Code Segment           |
+//   1   |   Kernel Code Segment         |
+//   2   |   Kernel Data Segment         |
+//   3   |   User Code Segment           |
+//   4   |   User Data Segment           |
 //   5   |   Double fault Task           |
 //   6   |   CPU 0's percpu segment      |
 //   7   |   CPU 1's percpu segment      |
@@ -274,16 +278,19 @@ static union segment_descriptor_t BOOT_GDT[] __attribute__((aligned(8))) = {
 //       |           ...                 |
 // 6+2N-1|   CPU N's TSS segment         |
 //
+// Note: The order of the kernel and user segments is mandated by
+// SYSENTER/SYSEXIT which derive all selectors from the kernel code selector
+// stored in the IA32_SYSENTER_CS MSR (see syscalls.h).
 // Note: We are only using one Double Fault interrupt task. The rationale is
 // that a double fault requires a reset anyway to all cpus can share the task.
 static union segment_descriptor_t *GDT = NULL;
 static size_t GDT_SIZE = 0;
 
 // The following macros are defining the index of each segment in the final GDT.
-#define GDT_KDATA_IDX               1
-#define GDT_KCODE_IDX               2
-#define GDT_UDATA_IDX               3
-#define GDT_UCODE_IDX               4
+#define GDT_KCODE_IDX               1
+#define GDT_KDATA_IDX               2
+#define GDT_UCODE_IDX               3
+#define GDT_UDATA_IDX               4
 #define GDT_DOUBLE_FAULT_TASK_IDX   5
 // The index of the percpu segment in the GDT for a particular cpu.
 // @param cpu: The ACPI index of the cpu (starting at 0).
@@ -508,8 +515,8 @@ void init_final_gdt() {
         PANIC("Percpu areas were not allocated prior to the final GDT\n");
     }
 
-    // 1 NULL entry, one kernel data segment, one kernel code segment, one user
-    // data segment, one user code segment, one segment for the Double Fault
+    // 1 NULL entry, one kernel code segment, one kernel data segment, one user
+    // code segment, one user data segment, one segment for the Double Fault
     // TSS, one segment per cpu for per-cpu data and one segment per cpu for
     // TSS.
     uint8_t const ncpus = acpi_get_number_cpus();
@@ -522,10 +529,10 @@ void init_final_gdt() {
     }
 
     // Create flat user and kernel data/code segments.
-    GDT[GDT_KDATA_IDX] = GDT_ENTRY(0x0, PAGES, 0xFFFFF, DATA, 0);
     GDT[GDT_KCODE_IDX] = GDT_ENTRY(0x0, PAGES, 0xFFFFF, CODE, 0);
-    GDT[GDT_UDATA_IDX] = GDT_ENTRY(0x0, PAGES, 0xFFFFF, DATA, 3);
+    GDT[GDT_KDATA_IDX] = GDT_ENTRY(0x0, PAGES, 0xFFFFF, DATA, 0);
     GDT[GDT_UCODE_IDX] = GDT_ENTRY(0x0, PAGES, 0xFFFFF, CODE, 3);
+    GDT[GDT_UDATA_IDX] = GDT_ENTRY(0x0, PAGES, 0xFFFFF, DATA, 3);
 
     uint32_t const df_tss = (uint32_t)&DOUBLE_FAULT_TASK;
     GDT[GDT_DOUBLE_FAULT_TASK_IDX] = GDT_TSS_ENTRY(df_tss);
@@ -558,6 +565,10 @@ void setup_tss(void) {
     memzero(tss, sizeof(*tss));
     tss->esp0 = this_cpu_var(kernel_stack);
     tss->ss0 = cpu_read_ss();
+    // Hardware task switching is never used to switch to this TSS, hence the
+    // GS field is free to use. It contains the percpu segment of this cpu so
+    // that the SYSENTER entry point can load it without knowing the cpu id.
+    tss->gs = SEG_SEL(GDT_PERCPU_IDX(cpu), 0);
 
     // Insert the TSS into the GDT.
     uint32_t const tss_index = GDT_TSS_IDX(cpu);
@@ -626,6 +637,10 @@ void reset_double_fault_task_busy_bit(void) {
     desc->type = 0b1001;
 }
 
+void *get_tss_addr(void) {
+    return &this_cpu_var(tss);
+}
+
 void *get_tss_esp0(uint8_t const cpu) {
     struct tss const * const tss = &cpu_var(tss, cpu);
     return tss->esp0;
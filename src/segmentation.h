@@ -55,6 +55,10 @@ void set_segment_registers_for_kernel(void);
 // @param new_esp0: The new esp0 to use.
 void change_tss_esp0(void const * const new_esp0);
 
+// Get the linear address of the TSS of the current cpu.
+// @return: The address of the TSS.
+void *get_tss_addr(void);
+
 // Get the current ESP0 in the TSS of a cpu.
 // @param cpu: The cpu to get the ESP0 for.
 // @return: The value of ESP0 in the cpu's TSS.
@@ -0,0 +1,41 @@
+#include <seqlock.h>
+#include <memory.h>
+#include <debug.h>
+#include <cpu.h>
+
+// Note on ordering: x86 does not reorder loads with other loads nor stores with
+// other stores, and seqlock_read_begin()/seqlock_read_retry() being function
+// calls, the compiler cannot move the accesses to the protected data across
+// them either. On the write side, the atomic increments are full barriers.
+
+void seqlock_init(seqlock_t * const lock) {
+    seqlock_t const default_lock = INIT_SEQLOCK();
+    memcpy(lock, &default_lock, sizeof(*lock));
+}
+
+void seqlock_write_lock(seqlock_t * const lock) {
+    spinlock_lock(&lock->lock);
+    atomic_inc(&lock->seq);
+    ASSERT(atomic_read(&lock->seq) & 1);
+}
+
+void seqlock_write_unlock(seqlock_t * const lock) {
+    ASSERT(atomic_read(&lock->seq) & 1);
+    atomic_inc(&lock->seq);
+    spinlock_unlock(&lock->lock);
+}
+
+uint32_t seqlock_read_begin(seqlock_t * const lock) {
+    uint32_t seq;
+    while ((seq = atomic_read(&lock->seq)) & 1) {
+        // A write is in progress, wait for it to complete.
+        cpu_pause();
+    }
+    return seq;
+}
+
+bool seqlock_read_retry(seqlock_t * const lock, uint32_t const seq) {
+    return (uint32_t)atomic_read(&lock->seq) != seq;
+}
+
+#include <seqlock.test>
@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic.h>
+#include <spinlock.h>
+
+// Sequence lock for read-mostly data.
+// Writers are serialized using a spinlock and increment a sequence number
+// before and after modifying the protected data, hence the sequence number is
+// odd while a write is in progress. Readers never write to the lock: they read
+// the sequence number before and after reading the protected data and retry if
+// a write was in progress or happened in between. A typical reader looks like:
+//
+//  uint32_t seq;
+//  do {
+//      seq = seqlock_read_begin(&lock);
+//      // Copy the protected data.
+//  } while (seqlock_read_retry(&lock, seq));
+//
+// Since readers can observe the protected data in an inconsistent state, they
+// must only copy it and not act on it (e.g. follow pointers that might be
+// freed by a writer) until seqlock_read_retry() returned false.
+typedef struct {
+    // The sequence number, odd iff a writer is modifying the protected data.
+    atomic_t seq;
+    // Lock serializing writers.
+    spinlock_t lock;
+} seqlock_t;
+
+#define INIT_SEQLOCK()                  \
+    {                                   \
+        .seq = { .value = 0 },          \
+        .lock = INIT_SPINLOCK(),        \
+    }
+
+#define DECLARE_SEQLOCK(name) \
+    seqlock_t name = INIT_SEQLOCK()
+
+// Initialize a seqlock.
+// @param lock: The seqlock to initialize.
+void seqlock_init(seqlock_t * const lock);
+
+// Start a write critical section. As with spinlocks, interrupts are disabled
+// until the corresponding seqlock_write_unlock().
+// @param lock: The seqlock to acquire.
+void seqlock_write_lock(seqlock_t * const lock);
+
+// End a write critical section.
+// @param lock: The seqlock to release.
+void seqlock_write_unlock(seqlock_t * const lock);
+
+// Start a read critical section. Waits for any in-progress write to complete.
+// @param lock: The seqlock protecting the data to read.
+// @return: The sequence number to pass to seqlock_read_retry().
+uint32_t seqlock_read_begin(seqlock_t * const lock);
+
+// End a read critical section.
+// @param lock: The seqlock protecting the data that was read.
+// @param seq: The value returned by the corresponding seqlock_read_begin().
+// @return: true if a writer modified the data during the read critical
+// section, in which case the data read must be discarded and the read critical
+// section restarted. false if the data read is consistent.
+bool seqlock_read_retry(seqlock_t * const lock, uint32_t const seq);
+
+// Run seqlock tests.
+void seqlock_test(void);
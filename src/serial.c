@@ -1,6 +1,9 @@
 #include <serial.h>
 #include <cpu.h>
 #include <debug.h>
+#include <spinlock.h>
+#include <interrupt.h>
+#include <ioapic.h>
 
 // We assume that the COM port is located at this port addresses. There should
 // be a test/assumption check for this.
@@ -157,24 +160,182 @@ static void enable_serial_interrupt(void) {
     write_register(INT_ENABLE, 1);
 }
 
-// Implementation of the write interface of the SERIAL_STREAM I/O stream.
-// @param buf: The buffer to write to the serial port.
-// @param len: Length of the buffer.
-// @return: The number of bytes successfully sent.
-static size_t serial_write(uint8_t const * const buf, size_t const len) {
-    size_t sent = 0;
-    for (size_t i = 0; i < len && get_status().trans_buf_empty; ++i, ++sent) {
-        // Write as much as we can in the data register.
-        write_register(DATA, buf[i]);
+// Buffered output
+// ===============
+//    Writing to the serial port does not wait for the UART to transmit the
+// bytes. Instead, bytes are enqueued in the TX ring of the port and the UART
+// is fed from the ring whenever its transmit FIFO is empty:
+//   - Before serial_enable_tx_interrupt() is called, or if the ring is full,
+//   the writer itself feeds the UART, waiting for the FIFO to empty only when
+//   the ring is full.
+//   - Afterwards, the writer only feeds the UART if it is idle, the rest of the
+//   ring is drained by the THRE (Transmitter Holding Register Empty) interrupt.
+// serial_flush() synchronously drains the ring, this is used when the kernel
+// panics and interrupts cannot be relied on anymore.
+
+// The size of the TX ring of a port in bytes. Must be a power of two.
+#define TX_RING_SIZE    4096
+STATIC_ASSERT(!(TX_RING_SIZE & (TX_RING_SIZE - 1)),
+              "TX_RING_SIZE must be a power of two");
+
+// The interrupt vector used for the UART interrupts.
+#define SERIAL_VECTOR   36
+
+// The ISA IRQ of COM1.
+#define COM1_IRQ    4
+
+// Bits of the INT_ENABLE register.
+#define IER_DATA_AVAILABLE  (1 << 0)
+#define IER_THR_EMPTY       (1 << 1)
+
+// The TX ring of a serial port.
+struct tx_ring {
+    // Protects all the fields of the ring and the access to the transmit
+    // registers of the port.
+    spinlock_t lock;
+    // The bytes waiting to be sent. Bytes are enqueued at `tail` and sent from
+    // `head`. The indices are free-running, the ring is empty iff head == tail.
+    uint8_t data[TX_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    // The number of bytes that can be written to the DATA register at once
+    // when the trans_buf_empty bit is set. 1 unless the UART has a FIFO.
+    uint8_t fifo_size;
+    // If true, the ring is drained by the THRE interrupt.
+    bool irq_mode;
+    // If true, the THRE interrupt is currently enabled in the INT_ENABLE
+    // register, eg. the ring is non-empty and waiting on the UART.
+    bool thre_enabled;
+};
+
+// The TX ring of COM.
+static struct tx_ring TX_RING = {
+    .lock = INIT_SPINLOCK(),
+    .head = 0,
+    .tail = 0,
+    .fifo_size = 1,
+    .irq_mode = false,
+    .thre_enabled = false,
+};
+
+// Get the number of bytes in a TX ring.
+// @param ring: The ring.
+// @return: The number of bytes waiting to be sent.
+static uint32_t ring_len(struct tx_ring const * const ring) {
+    return ring->tail - ring->head;
+}
+
+// Feed the UART from a TX ring if its transmit FIFO is empty. The ring's lock
+// must be held.
+// @param ring: The ring to send bytes from.
+// @return: true if some bytes were sent, false if the UART was busy or the ring
+// empty.
+static bool ring_send(struct tx_ring * const ring) {
+    ASSERT(spinlock_is_held(&ring->lock));
+    if (!ring_len(ring) || !get_status().trans_buf_empty) {
+        return false;
+    }
+    // The FIFO is empty, it can take `fifo_size` bytes without checking the
+    // status again.
+    for (uint8_t i = 0; i < ring->fifo_size && ring_len(ring); ++i) {
+        write_register(DATA, ring->data[ring->head++ % TX_RING_SIZE]);
+    }
+    return true;
+}
+
+// Enable or disable the THRE interrupt of the port according to the state of a
+// TX ring. The ring's lock must be held.
+// @param ring: The ring.
+static void ring_update_thre(struct tx_ring * const ring) {
+    ASSERT(spinlock_is_held(&ring->lock));
+    bool const enable = ring->irq_mode && ring_len(ring);
+    if (enable != ring->thre_enabled) {
+        ring->thre_enabled = enable;
+        write_register(INT_ENABLE, enable ? IER_THR_EMPTY : 0);
+    }
+}
+
+// Enqueue a byte in a TX ring, feeding the UART synchronously if the ring is
+// full. The ring's lock must be held.
+// @param ring: The ring.
+// @param byte: The byte to enqueue.
+static void ring_enqueue(struct tx_ring * const ring, uint8_t const byte) {
+    ASSERT(spinlock_is_held(&ring->lock));
+    while (ring_len(ring) == TX_RING_SIZE) {
+        // The writer holds the lock with interrupts disabled, the THRE
+        // interrupt might never be delivered. Make room by polling.
+        ring_send(ring);
+    }
+    ring->data[ring->tail++ % TX_RING_SIZE] = byte;
+}
+
+// Write bytes to a serial port through its TX ring.
+// @param ring: The TX ring of the port.
+// @param buf: The buffer to write.
+// @param len: The length of the buffer.
+// @return: The number of bytes written, always `len`.
+static size_t ring_write(struct tx_ring * const ring,
+                         uint8_t const * const buf,
+                         size_t const len) {
+    spinlock_lock(&ring->lock);
+    for (size_t i = 0; i < len; ++i) {
+        ring_enqueue(ring, buf[i]);
         if (buf[i] == '\n') {
             // To get new line on the other side of the serial port we need to
-            // output a carriage return as well. One tricky part in doing this
-            // is that we might send more data than requested. For now we hide
-            // this from the callee by return at most `len`.
-            write_register(DATA, '\r');
+            // output a carriage return as well. This is hidden from the caller
+            // by returning at most `len`.
+            ring_enqueue(ring, '\r');
         }
     }
-    return sent;
+    // If the UART is idle, nothing will trigger the THRE interrupt, kick it.
+    // Without the interrupt, send as much as possible without waiting.
+    while (ring_send(ring)) {}
+    ring_update_thre(ring);
+    spinlock_unlock(&ring->lock);
+    return len;
+}
+
+// Synchronously send all the bytes of a TX ring.
+// @param ring: The ring to drain.
+static void ring_flush(struct tx_ring * const ring) {
+    spinlock_lock(&ring->lock);
+    while (ring_len(ring)) {
+        ring_send(ring);
+    }
+    ring_update_thre(ring);
+    spinlock_unlock(&ring->lock);
+}
+
+// Handle a THRE interrupt for a port.
+// @param ring: The TX ring of the port.
+static void ring_handle_interrupt(struct tx_ring * const ring) {
+    spinlock_lock(&ring->lock);
+    if (ring->thre_enabled) {
+        // Reading INT_ID acknowledges the THRE interrupt.
+        read_register(INT_ID);
+        ring_send(ring);
+        ring_update_thre(ring);
+    }
+    spinlock_unlock(&ring->lock);
+}
+
+// Interrupt handler for the UART interrupts.
+// @param frame: Unused.
+static void serial_interrupt_handler(struct interrupt_frame const * const frame) {
+    ring_handle_interrupt(&TX_RING);
+}
+
+// Implementation of the write interface of the SERIAL_STREAM I/O stream.
+// @param buf: The buffer to write to the serial port.
+// @param len: Length of the buffer.
+// @return: The number of bytes successfully written. The bytes might not have
+// been sent by the time this function returns.
+static size_t serial_write(uint8_t const * const buf, size_t const len) {
+    return ring_write(&TX_RING, buf, len);
+}
+
+void serial_flush(void) {
+    ring_flush(&TX_RING);
 }
 
 // Read from the serial controller.
@@ -193,6 +354,7 @@ static size_t serial_read(uint8_t * const buf, size_t const len) {
 struct io_stream SERIAL_STREAM = {
     .read = serial_read,
     .write = serial_write,
+    .flush = serial_flush,
 };
 
 // Initialize the serial stream.
@@ -202,6 +364,33 @@ void serial_init(void) {
     set_stop_bits(1);
     set_parity(NONE);
     enable_serial_interrupt();
+
+    // Enable and clear the FIFOs. The top bits of INT_ID indicate whether the
+    // UART actually has FIFOs (eg. 16550A) or not.
+    write_register(INT_ID, 0x7);
+    if ((read_register(INT_ID) & 0xC0) == 0xC0) {
+        TX_RING.fifo_size = 16;
+    }
+}
+
+void serial_enable_tx_interrupt(void) {
+    // Only the THRE interrupt is handled, nothing consumes received data.
+    spinlock_lock(&TX_RING.lock);
+    write_register(INT_ENABLE, 0);
+    TX_RING.thre_enabled = false;
+    spinlock_unlock(&TX_RING.lock);
+
+    interrupt_register_global_callback(SERIAL_VECTOR, serial_interrupt_handler);
+    // OUT2 gates the interrupt line of the UART on PCs. Also assert DTR and
+    // RTS.
+    write_register(MODEM_CTRL, 0xB);
+    redirect_isa_interrupt(COM1_IRQ, SERIAL_VECTOR);
+
+    spinlock_lock(&TX_RING.lock);
+    TX_RING.irq_mode = true;
+    while (ring_send(&TX_RING)) {}
+    ring_update_thre(&TX_RING);
+    spinlock_unlock(&TX_RING.lock);
 }
 
 #include <serial.test>
@@ -10,5 +10,14 @@ extern struct io_stream SERIAL_STREAM;
 // world.
 void serial_init(void);
 
+// Switch the serial port to interrupt-driven output: from now on the TX ring is
+// drained by the UART's THRE interrupt instead of by the writers. Must be
+// called after the IOAPIC is initialized.
+void serial_enable_tx_interrupt(void);
+
+// Synchronously send all the bytes enqueued in the TX ring. Does not rely on
+// interrupts.
+void serial_flush(void);
+
 // Execute all tests related to the serial controller logic.
 void serial_test(void);
@@ -8,9 +8,13 @@
 #include <acpi.h>
 #include <math.h>
 #include <kernel_map.h>
-#include <spinlock.h>
 #include <kmalloc.h>
 #include <addr_space.h>
+#include <fpu.h>
+#include <syscalls.h>
+#include <atomic.h>
+#include <clock.h>
+#include <timer.h>
 
 // Application Processor (AP) Start Up Algorithm
 // =============================================
@@ -72,6 +76,14 @@
 //     The segment containing the data frame is written at the end of the
 // physical frame contain the AP wake up code.
 //
+// Parallel Boot
+// -------------
+//     All the per-AP state is prepared by the BSP before sending the INIT-SIPI
+// sequence: every AP has its own kernel stack, allocated up front, and its own
+// slot in the kernel_stacks array of the data frame. The APs therefore boot and
+// initialize concurrently. Each AP increments an atomic counter once it is fully
+// initialized, the BSP spins on this counter until all APs are online.
+//
 // Stack Locking
 // -------------
 //     At the bottom of every stack is a lock that an AP _must_ acquire and hold
@@ -121,36 +133,64 @@ extern uint8_t stack_top;
 extern uint8_t stack_bottom;
 #define KERNEL_STACK_SIZE   ((size_t)(&stack_top - &stack_bottom))
 
-// Allocate a kernel stack for an AP. The kernel will be allocated in kernel
-// address space.
-// @return: The virtual addres of the stack allocated.
-static void *allocate_ap_kernel_stack(void) {
+// The number of pages used by an AP kernel stack, including its canary page.
+#define AP_KERNEL_STACK_PAGES   (ceil_x_over_y_u32(KERNEL_STACK_SIZE, PAGE_SIZE) + 1)
+
+// Allocate the kernel stacks of all the APs that do not have one yet. The
+// stacks are allocated up front, before the wake up, so that the APs can
+// initialize concurrently without touching any shared allocator. All the stacks
+// are carved out of a single region of the kernel address space and mapped in a
+// single batch. The address of the top of each stack is written to the
+// kernel_stack percpu variable of its AP.
+static void allocate_ap_kernel_stacks(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    uint32_t missing = 0;
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        // The kernel stack might be already allocated, this happens when
+        // running tests for instance where APs get reset for every test.
+        missing += (cpu != cpu_id() && !cpu_var(kernel_stack, cpu)) ? 1 : 0;
+    }
+    if (!missing) {
+        return;
+    }
+
     // Find a big enough hole in the virtual address space to fit the kernel
-    // stack.
-    // +1 for the stack canary.
-    size_t const size = ceil_x_over_y_u32(KERNEL_STACK_SIZE, PAGE_SIZE) + 1;
+    // stacks. Each stack is preceded by its canary page.
+    size_t const stack_pages = AP_KERNEL_STACK_PAGES;
     void * const vaddr = paging_find_contiguous_non_mapped_pages(
-        KERNEL_PHY_OFFSET, size);
+        KERNEL_PHY_OFFSET, missing * stack_pages);
     if (vaddr == NO_REGION) {
-        PANIC("Kernel Stack for AP doesnt fit in vaddr space\n");
+        PANIC("Kernel Stacks for APs dont fit in vaddr space\n");
     }
-    LOG("Kernel stack @ %p\n", vaddr);
 
-    // Allocate physical frames for the stack and map them to the higher half
+    // Allocate physical frames for the stacks and map them to the higher half
     // kernel.
-    for (uint32_t i = 0; i < size; ++i) {
+    struct paging_batch batch;
+    paging_batch_begin(&batch, get_curr_addr_space());
+    for (uint32_t i = 0; i < missing * stack_pages; ++i) {
         void * const frame = alloc_frame();
         if (frame == NO_FRAME) {
             PANIC("Not enough mem to allocate kernel stack\n");
         }
-        // The canary page (index 0) is read only.
-        uint32_t const flags = !i ? 0x0 : VM_WRITE;
-        if (!paging_map(frame, vaddr + i * PAGE_SIZE, PAGE_SIZE, flags)) {
+        // The canary page (index 0 of each stack) is read only.
+        uint32_t const flags = !(i % stack_pages) ? 0x0 : VM_WRITE;
+        if (!paging_batch_map(&batch, frame, vaddr + i * PAGE_SIZE, PAGE_SIZE,
+                              flags)) {
             PANIC("Cannot map kernel stack to virt mem\n");
         }
     }
-    // Skip the canary when returning the bottom of the stack.
-    return vaddr + PAGE_SIZE;
+    paging_batch_commit(&batch);
+
+    void * stack = vaddr;
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        if (cpu != cpu_id() && !cpu_var(kernel_stack, cpu)) {
+            // Skip the canary, the top of the stack is at the end of its last
+            // page.
+            cpu_var(kernel_stack, cpu) = stack + PAGE_SIZE + KERNEL_STACK_SIZE;
+            LOG("Kernel stack for cpu %u @ %p\n", cpu, stack + PAGE_SIZE);
+            stack += stack_pages * PAGE_SIZE;
+        }
+    }
 }
 
 // Create a data frame containing all data structures required by the APs to
@@ -193,27 +233,15 @@ static void * create_data_frame(void (*target)(void)) {
 
     uint16_t const ncpus = acpi_get_number_cpus();
 
-    // Allocate one kernel stack per APs that they will use after waking up and
-    // save the address of each stack in the data frame so that the APs can find
-    // their stack.
+    // Each AP gets its own slot in the data frame containing the kernel stack
+    // it will use after waking up, so that all APs can boot at the same time.
+    allocate_ap_kernel_stacks();
     for (uint16_t cpu = 0; cpu < ncpus; ++cpu) {
-        if (cpu == cpu_id()) {
-            // For the current cpu, write a 0 since it won't be woken up.
-            data_frame->kernel_stacks[cpu] = 0x0;
-        } else {
-            // The kernel stack might be already allocated, this happens when
-            // running tests for instance where APs get reset for every test. If
-            // that is the case, we don't need to re-allocate.
-            if (cpu_var(kernel_stack, cpu)) {
-                data_frame->kernel_stacks[cpu] = cpu_var(kernel_stack, cpu);
-            } else {
-                void * const stack = allocate_ap_kernel_stack();
-                cpu_var(kernel_stack, cpu) = stack + KERNEL_STACK_SIZE;
-                data_frame->kernel_stacks[cpu] = stack + KERNEL_STACK_SIZE;
-            }
-        }
+        // For the current cpu, write a 0 since it won't be woken up.
+        data_frame->kernel_stacks[cpu] =
+            cpu == cpu_id() ? 0x0 : cpu_var(kernel_stack, cpu);
     }
-    
+
     return phy_frame;
 }
 
@@ -288,10 +316,13 @@ static void * create_trampoline(void (*target)(void)) {
     // Since this is a code frame we should ideally make it read only after
     // copying the code on it. The current paging interface forces us to unmap
     // and remap the page.
-    paging_unmap(code_frame, PAGE_SIZE);
-    if (!paging_map(code_frame, code_frame, PAGE_SIZE, 0)) {
+    struct paging_batch batch;
+    paging_batch_begin(&batch, get_curr_addr_space());
+    paging_batch_unmap(&batch, code_frame, PAGE_SIZE);
+    if (!paging_batch_map(&batch, code_frame, code_frame, PAGE_SIZE, 0)) {
         PANIC("Cannot map AP code frame to virt memory\n");
     }
+    paging_batch_commit(&batch);
 
     return code_frame;
 }
@@ -308,48 +339,58 @@ static void cleanup_ap_wakeup_routine_allocs(void * const code_frame) {
     struct ap_boot_data_frame * const data_frame =
         get_data_frame_addr_from_frame(code_frame);
 
-    // Unmap the frame containing the AP wake up code.
-    paging_unmap(code_frame, PAGE_SIZE);
+    // Unmap the frame containing the AP wake up code and the data frame in a
+    // single batch.
+    struct paging_batch batch;
+    paging_batch_begin(&batch, get_curr_addr_space());
+    paging_batch_unmap(&batch, code_frame, PAGE_SIZE);
 
     // Don't free the code_frame here. It will be re-used later if we ever call
     // init_aps() again. See comment in create_trampoline().
 
-    // De-allocate the data frame.
-    paging_unmap(data_frame, PAGE_SIZE);
+    // De-allocate the data frame. This must be done after committing the
+    // batch.
+    paging_batch_unmap(&batch, data_frame, PAGE_SIZE);
+    paging_batch_commit(&batch);
     free_frame(data_frame);
 
     // De-allocate the code frame.
     free_frame(code_frame);
 }
 
-// Upon waking, APs are changing the state of the kernel through stack
-// allocations, logging, ... All of this needs to be protected against race
-// conditions.
-// As this is initialization stage we can use a big global lock without much
-// performance penalties.
-// The AP_BOOT_LOCK should be held when modifying the kernel state in anyway.
-// It is only meant to prevent race condition while APs are waking up, as the
-// BSP is waiting in the meantime.
-DECLARE_SPINLOCK(AP_BOOT_LOCK);
-
 // The number of Application Processor that are fully woken up and initialized.
-// This function serves as a signal to the BSP that all APs are online. It must
-// be incremented _once_ per AP, while holding the AP_BOOT_LOCK.
-static uint8_t APS_ONLINE = 0;
-
-// Initialize the AP state, that is IDT, GDT, cache, and LAPIC. This function
-// also increments the APS_ONLINE global variable before returning.
+// This counter serves as a signal to the BSP that all APs are online. It is
+// incremented _once_ per AP, at the very end of ap_initialize_state(). APs do
+// not share any other state during their initialization hence do not need any
+// lock and initialize in parallel.
+static atomic_t APS_ONLINE;
+
+// The number of Application Processors that started executing kernel code
+// after receiving a SIPI. This is incremented at the very beginning of
+// ap_initialize_state() and used by the fast boot path to know when the SIPIs
+// have been received by all the APs.
+static atomic_t APS_STARTED;
+
+// The maximum time the BSP waits for the APs to come online before giving up.
+#define AP_BOOT_TIMEOUT_MS  5000
+
+// Initialize the AP state, that is IDT, GDT, SYSENTER, cache, LAPIC and FPU.
+// This function also increments the APS_ONLINE counter before returning.
 void ap_initialize_state(void) {
+    // Check in with the BSP, see fast_wake_up_aps().
+    atomic_inc(&APS_STARTED);
+
     // This AP has a private stack in higher half that is of a decent size.
     // Before being fully operational, a few operations need to be done one this
-    // cpu. The next functions do not require the AP_BOOT_LOCK has they are
-    // setting cpu-private states.
+    // cpu. The next functions are setting cpu-private states and can run
+    // concurrently on all the APs.
     
     // Use the final GDT.
     ap_init_segmentation();
     // We can now use percpu variables.
 
     setup_tss();
+    init_sysenter();
     
     // Start by enabling the cache.
     cpu_enable_cache();
@@ -357,15 +398,16 @@ void ap_initialize_state(void) {
     // Initialize interrupts on this AP as well as the LAPIC.
     ap_interrupt_init();
     ap_init_lapic();
+    // Any timer left in the wheel of this cpu by a previous boot of the AP is
+    // dropped.
+    ap_init_timers();
+    ap_init_fpu();
 
     // This AP is now fully initialized, announce the the BSP that it is online.
     uint8_t const apic_id = cpu_apic_id();
     LOG("CPU %u online with stack %p\n", apic_id, cpu_read_esp());
 
-    // APS_ONLINE is protected using the AP_BOOT_LOCK.
-    spinlock_lock(&AP_BOOT_LOCK);
-    APS_ONLINE ++;
-    spinlock_unlock(&AP_BOOT_LOCK);
+    atomic_inc(&APS_ONLINE);
 }
 
 void ap_finalize_start_up(void) {
@@ -377,24 +419,11 @@ void ap_finalize_start_up(void) {
     }
 }
 
-// Actual implementation of the init_aps function. This variant allows one to
-// explicitely specify the target function to be called by the APs once online.
-// This is useful for testing.
-// @param target: The function that should be called by the APs after wake up.
-static void do_init_aps(void (*target)(void)) {
-    // In case we reset the APs, consider them offline until the wake up
-    // sequence is completed.
-    APS_ARE_ONLINE = false;
-
-    // Create the trampoline.
-    void * const ap_entry_point = create_trampoline(target);
-
-    // FIXME: The boot code will make a call to cpu_enable_paging_bits to enable
-    // paging. Therefore this function must be ID mapped into virtual memory.
-    extern void cpu_enable_paging_bits(void);
-    void const * const func_addr = to_phys(cpu_enable_paging_bits);
-    ASSERT(paging_map(func_addr, func_addr, PAGE_SIZE, 0));
-
+// Wake up the APs using the INIT-SIPI-SIPI sequence with the delays
+// recommended by the Intel manual. Those delays are meant for older hardware,
+// this is the conservative wake up sequence.
+// @param code_frame: The physical address of the trampoline.
+static void wake_up_aps(void const * const code_frame) {
     // The Intel manual provide the following algorithm to boot APs (manual
     // volume 3, chapter 8.4.4.1):
     //  1. Send a broadcast INIT IPI to all APs.
@@ -411,26 +440,124 @@ static void do_init_aps(void (*target)(void)) {
     lapic_send_broadcast_init();
     lapic_sleep(10);
 
-    lapic_send_broadcast_sipi(ap_entry_point);
+    // This sequence can be used after a failed fast wake up, in which case some
+    // APs might have already started and checked in before being reset by the
+    // INIT. All APs are now waiting for a SIPI, reset the counters.
+    atomic_init(&APS_STARTED, 0);
+    atomic_init(&APS_ONLINE, 0);
+
+    lapic_send_broadcast_sipi(code_frame);
     // FIXME: The lapic sleep only has a millisecond granularity. Therefore wait
     // 1ms instead of 200 micro-second. That should be fine.
     lapic_sleep(1);
 
-    lapic_send_broadcast_sipi(ap_entry_point);
-    lapic_sleep(200);
+    lapic_send_broadcast_sipi(code_frame);
+}
+
+#ifdef FAST_AP_BOOT
+// The delay between the INIT IPI and the first SIPI in the fast wake up
+// sequence. Modern cpus, and virtual cpus, do not need the 10ms delay.
+#define FAST_BOOT_INIT_DELAY_US     10
+// How long to wait for the APs to check in after the first SIPI before sending
+// the second one.
+#define FAST_BOOT_SIPI_TIMEOUT_US   200
+// How long to wait for the APs to check in after the second SIPI before falling
+// back to the conservative wake up sequence.
+#define FAST_BOOT_CHECK_IN_TIMEOUT_US   10000
+
+// Poll the APS_STARTED counter until all APs checked in.
+// @param naps: The number of APs.
+// @param timeout_us: The maximum time to wait in microseconds.
+// @return: true if all APs checked in before the timeout, false otherwise.
+static bool wait_for_aps_check_in(uint8_t const naps,
+                                  uint32_t const timeout_us) {
+    uint64_t const end = clock_now_ns() + (uint64_t)timeout_us * 1000;
+    while (atomic_read(&APS_STARTED) != naps) {
+        if (clock_now_ns() > end) {
+            return false;
+        }
+        cpu_pause();
+    }
+    return true;
+}
+
+// Wake up the APs using the INIT-SIPI-SIPI sequence, replacing the fixed delays
+// with polling of the APs' check-in counter. The second SIPI is only sent if
+// some APs did not check in after the first one.
+// @param code_frame: The physical address of the trampoline.
+// @param naps: The number of APs.
+// @return: true if all APs checked in, false otherwise in which case the
+// conservative sequence should be used.
+static bool fast_wake_up_aps(void const * const code_frame, uint8_t const naps) {
+    lapic_send_broadcast_init();
+    clock_delay_us(FAST_BOOT_INIT_DELAY_US);
+
+    lapic_send_broadcast_sipi(code_frame);
+    if (wait_for_aps_check_in(naps, FAST_BOOT_SIPI_TIMEOUT_US)) {
+        return true;
+    }
+
+    // APs that already started ignore the second SIPI.
+    lapic_send_broadcast_sipi(code_frame);
+    return wait_for_aps_check_in(naps, FAST_BOOT_CHECK_IN_TIMEOUT_US);
+}
+#endif
+
+// Actual implementation of the init_aps function. This variant allows one to
+// explicitely specify the target function to be called by the APs once online.
+// This is useful for testing.
+// @param target: The function that should be called by the APs after wake up.
+static void do_init_aps(void (*target)(void)) {
+    // In case we reset the APs, consider them offline until the wake up
+    // sequence is completed.
+    APS_ARE_ONLINE = false;
+    atomic_init(&APS_STARTED, 0);
+    atomic_init(&APS_ONLINE, 0);
+
+    // Create the trampoline.
+    void * const ap_entry_point = create_trampoline(target);
+
+    // FIXME: The boot code will make a call to cpu_enable_paging_bits to enable
+    // paging. Therefore this function must be ID mapped into virtual memory.
+    extern void cpu_enable_paging_bits(void);
+    void const * const func_addr = to_phys(cpu_enable_paging_bits);
+    ASSERT(paging_map(func_addr, func_addr, PAGE_SIZE, 0));
 
-    // Now wait for all the Application Processors to get online.
     uint8_t const naps = acpi_get_number_cpus() - 1;
-    while (APS_ONLINE != naps) {
-        lapic_sleep(10);
+    uint64_t const start = clock_now_ns();
+
+#ifdef FAST_AP_BOOT
+    // The fast wake up relies on the TSC for its timeouts.
+    bool const fast = clock_tsc_freq() && fast_wake_up_aps(ap_entry_point,
+                                                           naps);
+    if (!fast) {
+        WARN("Fast AP wake up failed after %U us, %d out of %u APs started\n",
+             (clock_now_ns() - start) / 1000, atomic_read(&APS_STARTED), naps);
+        wake_up_aps(ap_entry_point);
+    }
+#else
+    bool const fast = false;
+    wake_up_aps(ap_entry_point);
+#endif
+
+    // Now wait for all the Application Processors to get online. The APs boot
+    // concurrently, spin on the counter instead of sleeping for a fixed amount
+    // of time.
+    uint64_t const timeout = (uint64_t)AP_BOOT_TIMEOUT_MS * 1000000ULL;
+    uint64_t const wait_start = clock_now_ns();
+    while (atomic_read(&APS_ONLINE) != naps) {
+        // clock_now_ns() returns 0 if the TSC has not been calibrated, in which
+        // case there is no timeout.
+        if (clock_now_ns() - wait_start > timeout) {
+            PANIC("Only %d out of %u APs came online\n",
+                  atomic_read(&APS_ONLINE), naps);
+        }
+        cpu_pause();
     }
 
     APS_ARE_ONLINE = true;
-    LOG("All APs online!\n");
-
-    // Reset the APS_ONLINE global variable, in case we ever reset the APs and
-    // re-init them again (i.e. in tests).
-    APS_ONLINE = 0;
+    LOG("All APs online in %U us (%s wake up)\n",
+        (clock_now_ns() - start) / 1000, fast ? "fast" : "conservative");
 
     // All APs are woken up and all have allocated their private stack. We can
     // now clean up the code frame containing the wake up routine, the data
@@ -2,11 +2,51 @@
 #include <percpu.h>
 #include <cpu.h>
 
+#ifdef LOCK_PROFILING
+// Contention statistics of a spinlock, only present when the kernel is compiled
+// with LOCK_PROFILING. All durations are in TSC cycles.
+struct spinlock_stats {
+    // The name of the lock, as given to DECLARE_SPINLOCK. NULL for locks
+    // initialized otherwise.
+    char const * name;
+    // The number of times the lock has been acquired.
+    uint32_t acquisitions;
+    // The number of acquisitions that had to wait for another cpu to release
+    // the lock.
+    uint32_t contended;
+    // Total number of cycles spent waiting for the lock.
+    uint64_t spin_cycles;
+    // The longest time the lock has been held for.
+    uint64_t max_hold_cycles;
+    // The TSC value when the lock was last acquired.
+    uint64_t hold_start;
+};
+#endif
+
 // Spinlock state.
+// Spinlocks are ticket locks: A cpu acquiring the lock atomically takes the
+// next ticket (tail) and waits until the ticket being served (head) is its
+// own. Releasing the lock increments the head, handing the lock to the next
+// waiter. This makes the lock fair (waiters acquire the lock in FIFO order) and
+// waiters only read the lock while spinning instead of hammering its cache line
+// with atomic read-modify-write operations.
+// A waiter cannot give up its ticket, hence an interrupt handler trying to
+// acquire the same lock on the same cpu would deadlock waiting behind it. Only
+// cpus calling spinlock_lock() with interrupts disabled therefore take a ticket
+// and wait for it to be served. Cpus calling spinlock_lock() with interrupts
+// enabled keep them enabled while waiting and only take a ticket, with a
+// CMPXCHG, when the lock is free. This is required as the holder of a lock
+// might execute a TLB shootdown, which waits for all the remote cpus to
+// acknowledge it. As a consequence, the FIFO order only holds among the cpus
+// waiting with interrupts disabled.
 typedef struct {
-    // The underlying lock. If the lock is free, this field is 0, otherwise it
-    // is 1.
-    uint8_t lock;
+    // The ticket currently being served, that is the ticket of the cpu holding
+    // the lock. Only written by the holder of the lock.
+    uint16_t head;
+    // The next ticket to hand out. The lock is free iff head == tail.
+    // Note: head and tail must be the first 32 bits of the struct, in this
+    // order, as the assembly code accesses them as a single dword.
+    uint16_t tail;
     // The state of the interrupt flag of the cpu holding this lock _before_
     // acquiring the lock. This allows us to disable interrupts in critical
     // sections and restore them after releasing the lock (if they were enabled
@@ -15,23 +55,52 @@ typedef struct {
     // The owner of the spinlock. That is the ID of the cpu currently holding
     // the lock. If the lock is not held this field is 0xFF.
     uint8_t owner;
+#ifdef LOCK_PROFILING
+    // Contention statistics of this lock. Only updated by the holder of the
+    // lock.
+    struct spinlock_stats stats;
+#endif
 } spinlock_t;
 
-#define INIT_SPINLOCK() \
-    {                   \
-        .lock = 0,      \
-        .owner = 0xFF,  \
+#ifdef LOCK_PROFILING
+#define _INIT_SPINLOCK_STATS(lock_name) \
+        .stats = { .name = (lock_name) },
+#else
+#define _INIT_SPINLOCK_STATS(lock_name)
+#endif
+
+#define _INIT_SPINLOCK(lock_name)       \
+    {                                   \
+        .head = 0,                      \
+        .tail = 0,                      \
+        .owner = 0xFF,                  \
+        _INIT_SPINLOCK_STATS(lock_name) \
     }
 
+#define INIT_SPINLOCK() _INIT_SPINLOCK(NULL)
+
+#ifdef LOCK_PROFILING
+// When lock profiling is enabled, a pointer to each spinlock declared with
+// DECLARE_SPINLOCK is put into the .spinlocks section so that
+// spinlock_dump_profile() can enumerate them.
+#define DECLARE_SPINLOCK(name)                                              \
+    spinlock_t name = _INIT_SPINLOCK(#name);                                \
+    static spinlock_t * const __spinlock_ptr_ ## name                       \
+        __attribute__((section(".spinlocks"), used)) = &name;
+#else
 #define DECLARE_SPINLOCK(name)  \
     spinlock_t name = INIT_SPINLOCK();
+#endif
 
 // Initialize a spinlock to its default state (unlocked).
 // @param lock: The spinlock_t to initialize.
 void spinlock_init(spinlock_t * const lock);
 
 // Acquire the lock on a spinlock. Returns only when the lock has been acquired
-// by the current cpu.
+// by the current cpu. If interrupts are enabled when calling this function,
+// they stay enabled while waiting for the lock. Once the lock is acquired,
+// interrupts are disabled until spinlock_unlock() restores the interrupt flag
+// to its state before this call.
 // @param lock: The spinlock to acquire.
 void spinlock_lock(spinlock_t * const lock);
 
@@ -42,5 +111,12 @@ void spinlock_unlock(spinlock_t * const lock);
 // Check if a given spinlock is held by the current cpu.
 bool spinlock_is_held(spinlock_t const * const lock);
 
+// Log, over serial, the statistics of the `n` spinlocks declared with
+// DECLARE_SPINLOCK that spent the most cycles waiting for their lock. This
+// function only logs a notice if the kernel has not been compiled with
+// LOCK_PROFILING.
+// @param n: The max number of locks to log.
+void spinlock_dump_profile(uint32_t const n);
+
 // Run spinlock tests.
 void spinlock_test(void);
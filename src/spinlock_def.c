@@ -5,35 +5,89 @@
 
 // This file contains the definitions of spinlock_lock and spinlock_unlock.
 
-// Do the actual lock operation on the spinlock. Definition in the assembly
-// file.
+// Do the actual lock operation on the spinlock: take a ticket and wait for it
+// to be served. Definition in the assembly file.
+// @param lock: The spinlock to acquire.
+// @return: true if the lock was held by another cpu when the ticket was taken,
+// false otherwise.
+// Note: This function must be called with interrupts disabled.
+bool _spinlock_lock(spinlock_t * const lock);
+
+// Acquire the spinlock without waiting on a ticket: a ticket is only taken,
+// with a CMPXCHG, when the lock is free. Interrupts are enabled while waiting
+// for the lock to be free and disabled when trying to take it. Definition in
+// the assembly file.
 // @param lock: The spinlock to acquire.
-// @param irq_enabled: If true, the cpu will enable interrupt while waiting for
-// the lock to be available.
-void _spinlock_lock(spinlock_t * const lock, bool const irq_enabled);
+// @return: true if at least one attempt failed before the lock was acquired,
+// false otherwise.
+// Note: This function returns with interrupts disabled.
+bool _spinlock_lock_irq(spinlock_t * const lock);
 
 // Do the actual unlock operation on the spinlock. Definition in the assembly
 // file.
 // @param lock: The spinlock to release.
 void _spinlock_unlock(spinlock_t * const lock);
 
+#ifdef LOCK_PROFILING
+// The pointers to all the spinlocks declared with DECLARE_SPINLOCK. Those are
+// defined in the linker script.
+extern spinlock_t * const SECTION_SPINLOCKS_START;
+extern spinlock_t * const SECTION_SPINLOCKS_END;
+
+// Check if a lock has been declared with DECLARE_SPINLOCK.
+// @param lock: The lock to test.
+// @return: true if a pointer to `lock` is in the .spinlocks section.
+static bool is_declared_lock(spinlock_t const * const lock) {
+    for (spinlock_t * const * ptr = &SECTION_SPINLOCKS_START;
+         ptr < &SECTION_SPINLOCKS_END; ++ptr) {
+        if (*ptr == lock) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
 void spinlock_init(spinlock_t * const lock) {
     spinlock_t const default_lock = INIT_SPINLOCK();
+#ifdef LOCK_PROFILING
+    // Keep the name of declared locks. Other locks might contain garbage.
+    char const * const name = is_declared_lock(lock) ? lock->stats.name : NULL;
+#endif
     memcpy(lock, &default_lock, sizeof(default_lock));
+#ifdef LOCK_PROFILING
+    lock->stats.name = name;
+#endif
 }
 
 void spinlock_lock(spinlock_t * const lock) {
     bool const irq = interrupts_enabled();
 
-    // If interrupts are enabled while calling the spinlock_lock() then enable
-    // interrupt while waiting for the lock.
-    _spinlock_lock(lock, irq);
+#ifdef LOCK_PROFILING
+    uint64_t const start = read_tsc();
+#endif
+    // If interrupts are enabled while calling spinlock_lock() then they stay
+    // enabled while waiting for the lock, see comment in spinlock.h.
+    bool const contended = irq ? _spinlock_lock_irq(lock) :
+        _spinlock_lock(lock);
 
     // Interrupts are expected to be disabled when acquiring the lock.
     ASSERT(!interrupts_enabled());
 
     // We can now mutate the fields of the lock.
     lock->interrupts_enabled = irq;
+#ifdef LOCK_PROFILING
+    uint64_t const now = read_tsc();
+    lock->stats.acquisitions ++;
+    if (contended) {
+        lock->stats.contended ++;
+        lock->stats.spin_cycles += now - start;
+    }
+    lock->stats.hold_start = now;
+#else
+    // Only used for profiling.
+    (void)contended;
+#endif
 
     // The owner field is reset upon unlocking.
     ASSERT(lock->owner == 0xFF);
@@ -47,13 +101,62 @@ void spinlock_unlock(spinlock_t * const lock) {
     ASSERT(lock->owner == cpu_id());
     lock->owner = 0xFF;
 
+#ifdef LOCK_PROFILING
+    uint64_t const hold = read_tsc() - lock->stats.hold_start;
+    if (hold > lock->stats.max_hold_cycles) {
+        lock->stats.max_hold_cycles = hold;
+    }
+#endif
+
     _spinlock_unlock(lock);
     // Restore the IF to its previous value before the spinlock_lock.
     cpu_set_interrupt_flag(interrupts);
 }
 
 bool spinlock_is_held(spinlock_t const * const lock) {
-    return lock->lock == 1 && lock->owner == cpu_id();
+    return lock->head != lock->tail && lock->owner == cpu_id();
+}
+
+void spinlock_dump_profile(uint32_t const n) {
+#ifdef LOCK_PROFILING
+    // Statistics are read without acquiring the locks, the output might
+    // therefore be slightly inconsistent for locks in use. This also means
+    // that this function can be called while holding any lock.
+    uint32_t const num_locks = &SECTION_SPINLOCKS_END - &SECTION_SPINLOCKS_START;
+    spinlock_t * const * const locks = &SECTION_SPINLOCKS_START;
+
+    LOG("Spinlock profile (top %u of %u locks, cycles):\n", n, num_locks);
+    // Selection of the top-n locks by spin cycles. The number of declared
+    // locks is small and this is not a hot path, no need to be smart here.
+    spinlock_t const * prev = NULL;
+    for (uint32_t rank = 0; rank < n && rank < num_locks; ++rank) {
+        spinlock_t const * best = NULL;
+        for (uint32_t i = 0; i < num_locks; ++i) {
+            spinlock_t const * const l = locks[i];
+            // Only consider the locks ranked strictly after the previous one.
+            // Ties are broken by the position in the section.
+            bool const after_prev = !prev ||
+                l->stats.spin_cycles < prev->stats.spin_cycles ||
+                (l->stats.spin_cycles == prev->stats.spin_cycles && l > prev);
+            bool const better = !best ||
+                l->stats.spin_cycles > best->stats.spin_cycles ||
+                (l->stats.spin_cycles == best->stats.spin_cycles && l < best);
+            if (after_prev && better) {
+                best = l;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        LOG("  %s: acq = %u, contended = %u, spin = %U, max hold = %U\n",
+            best->stats.name, best->stats.acquisitions, best->stats.contended,
+            best->stats.spin_cycles, best->stats.max_hold_cycles);
+        prev = best;
+    }
+#else
+    LOG("Spinlock profiling not enabled, build with LOCK_PROFILING\n");
+    (void)n;
+#endif
 }
 
 #include <spinlock_def.test>
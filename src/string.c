@@ -1,28 +1,84 @@
 #include <string.h>
+#include <memory.h>
+
+// Word-at-a-time string operations
+// ================================
+//    strlen() and streq() read strings one double word at a time once the
+// pointer is aligned. An aligned double word never straddles a page boundary,
+// hence reading past the NUL terminator within the same double word cannot
+// fault, even if the string ends right before an unmapped page.
+// A double word contains a zero byte iff HAS_ZERO_BYTE() is non-zero: a byte
+// wraps around when subtracting 1 only if it is zero (or if a lower byte
+// borrowed, which requires a lower zero byte), and `~w` filters out bytes that
+// already had their most significant bit set.
+
+// Check if a double word contains a zero byte.
+#define HAS_ZERO_BYTE(w)    (((w) - 0x01010101) & ~(w) & 0x80808080)
 
 size_t strlen(const char * const str) {
-    size_t i;
-    for (i = 0; str[i]; ++i) {}
-    return i;
+    char const * curr = str;
+    // Go byte per byte until the pointer is aligned.
+    while ((uint32_t)curr & 3) {
+        if (!*curr) {
+            return curr - str;
+        }
+        curr++;
+    }
+
+    uint32_t const * word = (uint32_t const*)curr;
+    while (!HAS_ZERO_BYTE(*word)) {
+        word++;
+    }
+
+    // The terminator is within this double word.
+    curr = (char const*)word;
+    while (*curr) {
+        curr++;
+    }
+    return curr - str;
 }
 
 bool streq(const char * const str1, const char * const str2) {
-    size_t const len1 = strlen(str1);
-    size_t const len2 = strlen(str2);
-    if (len1 != len2) {
-        return false;
-    } else {
-        return strneq(str1, str2, len1);
+    char const * s1 = str1;
+    char const * s2 = str2;
+
+    // Strings that can be aligned at the same time are compared per double
+    // word, stopping at the first double word that differs or contains the
+    // terminator. Otherwise, or for the remaining bytes, compare byte per
+    // byte.
+    if (!(((uint32_t)s1 ^ (uint32_t)s2) & 3)) {
+        while ((uint32_t)s1 & 3) {
+            if (*s1 != *s2) {
+                return false;
+            } else if (!*s1) {
+                return true;
+            }
+            s1++;
+            s2++;
+        }
+
+        uint32_t const * w1 = (uint32_t const*)s1;
+        uint32_t const * w2 = (uint32_t const*)s2;
+        while (*w1 == *w2 && !HAS_ZERO_BYTE(*w1)) {
+            w1++;
+            w2++;
+        }
+        s1 = (char const*)w1;
+        s2 = (char const*)w2;
     }
-}
 
-bool strneq(const char * const str1, const char * const str2, size_t const n) {
-    for (size_t i = 0; i < n; ++i) {
-        if (str1[i] != str2[i]) {
-            return false;
+    while (*s1 == *s2) {
+        if (!*s1) {
+            return true;
         }
+        s1++;
+        s2++;
     }
-    return true;
+    return false;
+}
+
+bool strneq(const char * const str1, const char * const str2, size_t const n) {
+    return memeq(str1, str2, n);
 }
 
 size_t str_find_chr(char const * const str, char const ch, size_t const begin) {
@@ -53,4 +109,13 @@ void strncpy(char const * const src, char * const dst, size_t const len) {
     }
 }
 
+uint32_t str_hash(char const * const str) {
+    uint32_t hash = 2166136261;
+    for (char const * c = str; *c; ++c) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
 #include <string.test>
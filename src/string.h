@@ -35,6 +35,12 @@ size_t str_find_chr(char const * const str, char const ch, size_t const begin);
 
 void strncpy(char const * const src, char * const dst, size_t const len);
 
+// Compute the hash of a string (FNV-1a). This is meant for hash tables keyed on
+// strings, e.g. paths.
+// @param str: The NUL terminated string to hash.
+// @return: The hash of `str`.
+uint32_t str_hash(char const * const str);
+
 // STR_NPOS is used as a special return value of str_find_chr. It
 // indicates that a character is not present in the string.
 #define STR_NPOS    ((size_t) -1)
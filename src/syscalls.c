@@ -4,9 +4,24 @@
 #include <sched.h>
 #include <interrupt.h>
 #include <vfs.h>
+#include <pipe.h>
+#include <memstat.h>
 #include <kmalloc.h>
 #include <memory.h>
 #include <string.h>
+#include <segmentation.h>
+#include <kernel_map.h>
+#include <cpu.h>
+#include <io_ring.h>
+#include <uaccess.h>
+#include <paging.h>
+#include <frame_alloc.h>
+#include <math.h>
+#include <tracelog.h>
+#include <clock.h>
+
+DEFINE_TRACEPOINT(syscall_enter);
+DEFINE_TRACEPOINT(syscall_exit);
 
 // The mapping syscall number -> function.
 static void *SYSCALL_MAP[] = {
@@ -18,6 +33,16 @@ static void *SYSCALL_MAP[] = {
     [NR_SYSCALL_GETPID]   =   (void*)do_get_pid,
     [NR_SYSCALL_WRITE]    =   (void*)do_write,
     [NR_SYSCALL_KLOG]     =   (void*)do_klog,
+    [NR_SYSCALL_READV]    =   (void*)do_readv,
+    [NR_SYSCALL_WRITEV]   =   (void*)do_writev,
+    [NR_SYSCALL_BATCH]    =   (void*)do_syscall_batch,
+    [NR_SYSCALL_IO_RING_SETUP]  =   (void*)do_io_ring_setup,
+    [NR_SYSCALL_IO_RING_ENTER]  =   (void*)do_io_ring_enter,
+    [NR_SYSCALL_MMAP]     =   (void*)do_mmap,
+    [NR_SYSCALL_CLOCK_GETTIME]  =   (void*)do_clock_gettime,
+    [NR_SYSCALL_CLOSE]    =   (void*)do_close,
+    [NR_SYSCALL_PIPE]     =   (void*)do_pipe,
+    [NR_SYSCALL_MEM_STATS]  =   (void*)do_mem_stats,
 };
 
 // The number of entries in the SYSCALL_MAP.
@@ -38,6 +63,30 @@ static bool in_syscall_map_bounds(uint32_t syscall_nr) {
 reg_t do_syscall_dispatch(void const * const func,
                           struct syscall_args const * const args);
 
+// Account the time spent in a syscall as system time of the current cpu.
+// @param cpu: The cpu on which the syscall started.
+// @param start: The clock value when the syscall started.
+// @param before: The time accounting of the cpu when the syscall started.
+static void account_system_time(uint8_t const cpu,
+                                uint64_t const start,
+                                struct cpu_time const * const before) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    if (cpu_id() == cpu) {
+        // The syscall did not migrate. As with irq time (see
+        // generic_interrupt_handler()), nested syscalls (see
+        // do_syscall_batch()) already accounted their own time, hence set the
+        // total instead of adding to it. Interrupts serviced during the
+        // syscall are not system time.
+        struct cpu_time * const time = &this_cpu_var(cpu_time);
+        uint64_t const elapsed = clock_now_ns() - start;
+        uint64_t const irq = time->irq_ns - before->irq_ns;
+        time->system_ns = before->system_ns + (elapsed > irq ? elapsed - irq :
+                                                               0);
+    }
+    cpu_set_interrupt_flag(irqs);
+}
+
 // Dispatch a syscall given the values of the registers.
 // @param args: The arguments to the syscall, including the syscall number (in
 // EAX).
@@ -66,7 +115,15 @@ static reg_t syscall_dispatch(struct syscall_args const * const args) {
         curr->_pre_syscall_hook(curr, args);
     }
 
+    uint8_t const cpu = cpu_id();
+    struct cpu_time const before = cpu_var(cpu_time, cpu);
+    uint64_t const start = clock_now_ns();
+
+    TRACEPOINT(syscall_enter, "pid=%u nr=%u", curr->pid, syscall_nr);
     reg_t const res = do_syscall_dispatch(func, args);
+    TRACEPOINT(syscall_exit, "pid=%u nr=%u ret=%x", curr->pid, syscall_nr, res);
+
+    account_system_time(cpu, start, &before);
 
     if (debug && curr->_post_syscall_hook) {
         curr->_post_syscall_hook(curr, args, res);
@@ -96,6 +153,68 @@ static void syscall_int_handler(struct interrupt_frame const * const frame) {
     regs->eax = res;
 }
 
+// The user stack frame expected by the SYSENTER entry point, see syscalls.h.
+struct sysenter_user_frame {
+    reg_t ebp;
+    reg_t edx;
+    reg_t ecx;
+    reg_t ret_addr;
+} __attribute__((packed));
+
+// Handle a syscall entered through SYSENTER. This is called by sysenter_entry
+// with interrupts enabled.
+// @param args: The registers saved by sysenter_entry. Upon entry, the EBP field
+// contains the pointer on the user stack frame (see syscalls.h), and the ECX
+// and EDX fields are garbage. Upon return, args contains the values the
+// registers should have when going back to user space: EAX = result, ECX =
+// user stack pointer, EDX = return address, EBP = user's EBP.
+void syscall_sysenter_handler(struct syscall_args * const args) {
+    struct sysenter_user_frame const * const uframe = (void*)args->ebp;
+    void const * const uframe_end = uframe + 1;
+
+    struct sysenter_user_frame frame;
+    if (!copy_from_user(&frame, uframe, sizeof(frame))) {
+        PANIC("Invalid user stack frame for SYSENTER: %p\n", uframe);
+    }
+    args->ebp = frame.ebp;
+    args->ecx = frame.ecx;
+    args->edx = frame.edx;
+
+    args->eax = syscall_dispatch(args);
+    args->ecx = (reg_t)uframe_end;
+    args->edx = frame.ret_addr;
+}
+
+// The MSRs used to configure the SYSENTER entry point.
+#define IA32_SYSENTER_CS    0x174
+#define IA32_SYSENTER_ESP   0x175
+#define IA32_SYSENTER_EIP   0x176
+
+// Check if the current cpu supports SYSENTER/SYSEXIT.
+// @return: true if the instructions are supported, false otherwise.
+static bool cpu_has_sysenter(void) {
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    return edx & (1 << 11);
+}
+
+void init_sysenter(void) {
+    if (!cpu_has_sysenter()) {
+        LOG("[%u] SYSENTER not supported, only int 0x80 is available\n",
+            cpu_id());
+        return;
+    }
+    // The entry point in syscalls_asm.S.
+    extern void sysenter_entry(void);
+
+    // SYSENTER loads ESP with the address of this cpu's TSS, the entry point
+    // reads the kernel stack of the current process from its ESP0 field. This
+    // way the MSR does not need to be updated upon every context switch.
+    write_msr(IA32_SYSENTER_CS, kernel_code_selector().value);
+    write_msr(IA32_SYSENTER_ESP, (uint32_t)get_tss_addr());
+    write_msr(IA32_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
 void syscall_init(void) {
     interrupt_register_global_callback(SYSCALL_VECTOR, syscall_int_handler);
 }
@@ -117,9 +236,20 @@ void do_exit(uint8_t const exit_code) {
     curr->state_flags |= PROC_DEAD;
 }
 
+// The maximum length of a path copied on the stack by do_open(). Longer paths
+// are copied into a dynamically allocated buffer.
+#define OPEN_INLINE_PATH_LEN    255
+
 fd_t do_open(pathname_t const u_path) {
-    pathname_t const path = memdup(u_path, strlen(u_path) + 1);
-    TODO_PROPAGATE_ERROR(!path);
+    // Most paths are short, copy them on the stack to avoid allocating.
+    char inline_path[OPEN_INLINE_PATH_LEN + 1];
+    char * path = inline_path;
+    if (!strcpy_from_user(inline_path, u_path, OPEN_INLINE_PATH_LEN)) {
+        path = strdup_from_user(u_path, SYSCALL_MAX_STR_LEN);
+        if (!path) {
+            return SYSCALL_EFAULT;
+        }
+    }
     struct proc * const curr = get_curr_proc();
 
     // Open the file.
@@ -127,49 +257,103 @@ fd_t do_open(pathname_t const u_path) {
     ASSERT(file);
 
     // vfs_open() is supposed to make a copy of path if it is going to use it.
-    kfree((char*)path);
-
-    // Allocate a new entry for the file table.
-    struct file_table_entry * const op_file = kmalloc(sizeof(*op_file));
-    // FIXME: This syscall should retun an error code here.
-    TODO_PROPAGATE_ERROR(!op_file);
-    op_file->file = file;
-    op_file->file_pointer = 0x0;
-
-    // Find the next available id in the process's file table.
-    fd_t fd = 0;
-    for (fd = 0; fd < MAX_FDS && curr->file_table[fd]; ++fd);
+    if (path != inline_path) {
+        kfree(path);
+    }
+
+    // Insert the file in the process's file table.
+    fd_t const fd = proc_install_fd(curr, file);
     if (fd == MAX_FDS) {
         PANIC("No FDs left for process %u.\n", curr->pid);
     }
-
-    // Insert the entry in the file table.
-    curr->file_table[fd] = op_file;
     return fd;
 }
 
-size_t do_read(fd_t const fd, uint8_t * const buf, size_t const len) {
+// Get the entry of the current process' file table for a file descriptor.
+// @param fd: The file descriptor.
+// @return: The struct file_table_entry associated with `fd`.
+static struct file_table_entry *get_file_table_entry(fd_t const fd) {
     struct proc * const curr = get_curr_proc();
-
-    // Get the file from the file table.
-    struct file_table_entry * const op_file = curr->file_table[fd];
+    struct file_table_entry * const op_file = proc_get_fd(curr, fd);
     if (!op_file) {
         PANIC("Invalid fd %u for process %u\n", fd, curr->pid);
     }
+    return op_file;
+}
+
+void do_close(fd_t const fd) {
+    struct proc * const curr = get_curr_proc();
+    if (!proc_close_fd(curr, fd)) {
+        PANIC("Invalid fd %u for process %u\n", fd, curr->pid);
+    }
+}
 
-    size_t const ret = vfs_read(op_file->file, op_file->file_pointer, buf, len);
+reg_t do_pipe(fd_t * const u_fds) {
+    struct proc * const curr = get_curr_proc();
+    struct pipe * const pipe = create_pipe();
+    if (!pipe) {
+        PANIC("Cannot allocate pipe for process %u.\n", curr->pid);
+    }
+    fd_t const fds[2] = {
+        proc_install_pipe(curr, pipe, false),
+        proc_install_pipe(curr, pipe, true),
+    };
+    if (fds[0] == MAX_FDS || fds[1] == MAX_FDS) {
+        PANIC("No FDs left for process %u.\n", curr->pid);
+    }
+    if (!copy_to_user(u_fds, fds, sizeof(fds))) {
+        proc_close_fd(curr, fds[0]);
+        proc_close_fd(curr, fds[1]);
+        return SYSCALL_EFAULT;
+    }
+    return 0;
+}
+
+// Read from an end of a pipe.
+// @param entry: The file table entry of the end.
+// @param buf: The buffer to read into, already validated.
+// @param len: The size of the buffer.
+// @return: The number of bytes read.
+static size_t read_pipe_end(struct file_table_entry const * const entry,
+                            uint8_t * const buf,
+                            size_t const len) {
+    return entry->pipe_write_end ? 0 : pipe_read(entry->pipe, buf, len);
+}
+
+// Write to an end of a pipe.
+// @param entry: The file table entry of the end.
+// @param buf: The data to write, already validated.
+// @param len: The size of the data.
+// @return: The number of bytes written.
+static size_t write_pipe_end(struct file_table_entry const * const entry,
+                             uint8_t const * const buf,
+                             size_t const len) {
+    return entry->pipe_write_end ? pipe_write(entry->pipe, buf, len) : 0;
+}
+
+size_t do_read(fd_t const fd, uint8_t * const buf, size_t const len) {
+    struct file_table_entry * const op_file = get_file_table_entry(fd);
+    // The file system reads straight into the user buffer.
+    if (!user_range_ok(buf, len, true)) {
+        return SYSCALL_EFAULT;
+    } else if (op_file->pipe) {
+        return read_pipe_end(op_file, buf, len);
+    }
+
+    size_t const ret = vfs_read_ahead(op_file->file, &op_file->read_ahead,
+        op_file->file_pointer, buf, len);
 
     op_file->file_pointer += ret;
     return ret;
 }
 
 size_t do_write(fd_t const fd, uint8_t const * const buf, size_t const len) {
-    struct proc * const curr = get_curr_proc();
-
-    // Get the file from the file table.
-    struct file_table_entry * const op_file = curr->file_table[fd];
-    if (!op_file) {
-        PANIC("Invalid fd %u for process %u\n", fd, curr->pid);
+    struct file_table_entry * const op_file = get_file_table_entry(fd);
+    // The file system writes straight from the user buffer.
+    if (!user_range_ok(buf, len, false)) {
+        return SYSCALL_EFAULT;
+    } else if (op_file->pipe) {
+        return write_pipe_end(op_file, buf, len);
     }
 
     size_t const ret = vfs_write(op_file->file,
@@ -179,7 +363,141 @@ size_t do_write(fd_t const fd, uint8_t const * const buf, size_t const len) {
 
     op_file->file_pointer += ret;
     return ret;
+}
+
+void *do_mmap(fd_t const fd, uint32_t const offset, size_t const len) {
+    ASSERT(!get_curr_proc()->is_kernel_proc);
+    struct file_table_entry * const op_file = get_file_table_entry(fd);
+    if (!len || offset % PAGE_SIZE || op_file->pipe) {
+        return NULL;
+    }
+    uint32_t const first_page = offset / PAGE_SIZE;
+    uint32_t const npages = ceil_x_over_y_u32(len, PAGE_SIZE);
 
+    void ** const frames = kmalloc(npages * sizeof(*frames));
+    if (!frames) {
+        return NULL;
+    }
+    // Each frame comes with a reference for the mapping, dropped when the
+    // mapping is removed along with the address space.
+    uint32_t num_frames = 0;
+    while (num_frames < npages) {
+        uint32_t page_len;
+        void * const frame =
+            vfs_get_page(op_file->file, first_page + num_frames, &page_len);
+        if (frame == NO_FRAME) {
+            // Past the end of the file.
+            break;
+        }
+        frames[num_frames++] = frame;
+    }
+
+    void * res = NULL;
+    if (num_frames == npages) {
+        uint32_t const flags = VM_USER | VM_NON_GLOBAL;
+        res = paging_map_frames_above((void*)PAGE_SIZE, frames, npages, flags);
+        res = (res == NO_REGION) ? NULL : res;
+    }
+    if (!res) {
+        free_frames(num_frames, frames);
+    }
+    kfree(frames);
+    return res;
+}
+
+size_t do_readv(fd_t const fd,
+                struct iovec const * const iov,
+                size_t const iovcnt) {
+    struct file_table_entry * const op_file = get_file_table_entry(fd);
+
+    size_t total = 0;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        struct iovec vec;
+        if (!copy_from_user(&vec, iov + i, sizeof(vec)) ||
+            !user_range_ok(vec.base, vec.len, true)) {
+            // Report the bytes already read, if any.
+            return total ? total : SYSCALL_EFAULT;
+        }
+        size_t ret;
+        if (op_file->pipe) {
+            ret = read_pipe_end(op_file, vec.base, vec.len);
+        } else {
+            ret = vfs_read_ahead(op_file->file, &op_file->read_ahead,
+                                 op_file->file_pointer, vec.base, vec.len);
+            op_file->file_pointer += ret;
+        }
+        total += ret;
+        if (ret < vec.len) {
+            break;
+        }
+    }
+    return total;
+}
+
+size_t do_writev(fd_t const fd,
+                 struct iovec const * const iov,
+                 size_t const iovcnt) {
+    struct file_table_entry * const op_file = get_file_table_entry(fd);
+
+    size_t total = 0;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        struct iovec vec;
+        if (!copy_from_user(&vec, iov + i, sizeof(vec)) ||
+            !user_range_ok(vec.base, vec.len, false)) {
+            // Report the bytes already written, if any.
+            return total ? total : SYSCALL_EFAULT;
+        }
+        size_t ret;
+        if (op_file->pipe) {
+            ret = write_pipe_end(op_file, vec.base, vec.len);
+        } else {
+            ret = vfs_write(op_file->file, op_file->file_pointer, vec.base,
+                            vec.len);
+            op_file->file_pointer += ret;
+        }
+        total += ret;
+        if (ret < vec.len) {
+            break;
+        }
+    }
+    return total;
+}
+
+size_t do_syscall_batch(struct syscall_args const * const reqs,
+                        reg_t * const results,
+                        size_t const n) {
+    struct proc * const curr = get_curr_proc();
+    size_t i;
+    for (i = 0; i < n && !proc_is_dead(curr); ++i) {
+        struct syscall_args req;
+        if (!copy_from_user(&req, reqs + i, sizeof(req))) {
+            break;
+        }
+        if (req.eax == NR_SYSCALL_BATCH) {
+            PANIC("Nested syscall batch in process %u\n", curr->pid);
+        }
+        reg_t const res = syscall_dispatch(&req);
+        if (!copy_to_user(results + i, &res, sizeof(res))) {
+            break;
+        }
+    }
+    return i;
+}
+
+reg_t do_clock_gettime(uint64_t * const u_ns) {
+    uint64_t const now = clock_now_ns();
+    return copy_to_user(u_ns, &now, sizeof(now)) ? 0 : SYSCALL_EFAULT;
+}
+
+reg_t do_mem_stats(struct memstat * const u_kernel,
+                   struct proc_mem_stats * const u_proc) {
+    struct memstat kernel;
+    struct proc_mem_stats proc;
+    memstat_get(&kernel);
+    proc_get_mem_stats(get_curr_proc(), &proc);
+    bool const ok = copy_to_user(u_kernel, &kernel, sizeof(kernel)) &&
+        copy_to_user(u_proc, &proc, sizeof(proc));
+    return ok ? 0 : SYSCALL_EFAULT;
 }
 
 pid_t do_get_pid(void) {
@@ -192,7 +510,12 @@ void do_klog(char const * const message) {
     uint64_t const tsc = read_tsc();
     pid_t const pid = curr->pid;
     uint8_t const cpu = cpu_id();
-    LOG("[%X | cpu %u | pid %u] %s", tsc, cpu, pid, message);
+    char * const msg = strdup_from_user(message, SYSCALL_MAX_STR_LEN);
+    if (!msg) {
+        return;
+    }
+    LOG("[%X | cpu %u | pid %u] %s", tsc, cpu, pid, msg);
+    kfree(msg);
 }
 
 #include <syscalls.test>
@@ -1,5 +1,6 @@
 #pragma once
 #include <types.h>
+#include <memstat.h>
 
 // Syscalls.
 // This files contains the syscall implementation.
@@ -12,6 +13,29 @@
 //
 //  Once the syscall is performed, EAX contains the result of the syscall other
 //  registers are untouched.
+//
+// Syscalls can also be performed with the SYSENTER instruction which avoids the
+// cost of the generic interrupt path. SYSENTER does not save the return address
+// nor the user stack pointer and SYSEXIT takes them from ECX and EDX, hence
+// those two registers cannot be used to pass arguments. Instead, the caller
+// pushes ECX, EDX and EBP (in this order) after the return address and points
+// EBP to the top of the stack before executing SYSENTER:
+//      |     ...     |
+//      |  Ret addr   |  <- EBP + 0xC
+//      |     ECX     |  <- EBP + 0x8
+//      |     EDX     |  <- EBP + 0x4
+// EBP->|     EBP     |
+// In practice this is done by a stub called with a regular `call`:
+//      push    ecx
+//      push    edx
+//      push    ebp
+//      mov     ebp, esp
+//      sysenter
+// The syscall returns to the return address, with the stack above popped. EAX
+// contains the result of the syscall, ECX and EDX are clobbered, the other
+// registers are untouched.
+// Note: SYSEXIT always returns to ring 3, hence only user processes can use
+// SYSENTER.
 
 // The vector number used by syscalls.
 #define SYSCALL_VECTOR  0x80
@@ -24,6 +48,24 @@
 #define NR_SYSCALL_GETPID   0x4
 #define NR_SYSCALL_WRITE    0x5
 #define NR_SYSCALL_KLOG     0x6
+#define NR_SYSCALL_READV    0x7
+#define NR_SYSCALL_WRITEV   0x8
+#define NR_SYSCALL_BATCH    0x9
+#define NR_SYSCALL_IO_RING_SETUP    0xA
+#define NR_SYSCALL_IO_RING_ENTER    0xB
+#define NR_SYSCALL_MMAP     0xC
+#define NR_SYSCALL_CLOCK_GETTIME    0xD
+#define NR_SYSCALL_CLOSE    0xE
+#define NR_SYSCALL_PIPE     0xF
+#define NR_SYSCALL_MEM_STATS    0x10
+
+// Value returned by syscalls when a pointer passed as argument does not point to
+// accessible user memory, see uaccess.h.
+#define SYSCALL_EFAULT      ((reg_t)-1)
+
+// The maximum length of the strings passed to syscalls (e.g. paths), NUL
+// excluded.
+#define SYSCALL_MAX_STR_LEN 4095
 
 // This struct represents the arguments passed to a syscall in order. This is
 // the same order as in Linux for 32-bit kernels. However, the similarity ends
@@ -41,32 +83,125 @@ struct syscall_args {
     reg_t ebp;
 };
 
+// Describe a buffer used by the vectored syscalls readv() and writev().
+struct iovec {
+    // The start address of the buffer.
+    void * base;
+    // The size of the buffer in bytes.
+    size_t len;
+};
+
 // Initialize the syscall mechanism.
 void syscall_init(void);
 
+// Configure the SYSENTER entry point on the current cpu. This must be called on
+// every cpu, after setup_tss().
+void init_sysenter(void);
+
 // Exit the current process. This function will obviously not return.
 // @param exit_code: The value of the exit code.
 void do_exit(uint8_t const exit_code);
 
 // Open a file.
 // @param u_path: The absolute path of the file to be opened.
-// @return: A file descriptor of the opened file.
+// @return: A file descriptor of the opened file, SYSCALL_EFAULT if u_path is
+// invalid.
 fd_t do_open(pathname_t const u_path);
 
+// Close a file descriptor. The descriptor can be reused by a subsequent open().
+// @param fd: The file descriptor to close.
+void do_close(fd_t const fd);
+
+// Create a pipe, see pipe.h, and install both its ends in the file table of the
+// calling process. Reading from the write end returns 0, writing to the read
+// end writes nothing. Until processes can be forked, the ends can only be given
+// to other processes by the kernel, see proc_install_pipe().
+// @param u_fds: The user buffer receiving the file descriptors of the read end
+// and of the write end, in that order.
+// @return: 0 on success, SYSCALL_EFAULT if u_fds is invalid.
+reg_t do_pipe(fd_t * const u_fds);
+
 // Read from a file descriptor.
 // @param fd: The file descriptor to read from.
 // @param buf: The buffer to read into.
 // @param len: The size of the read/buffer.
-// @return: The number of bytes read into buf.
+// @return: The number of bytes read into buf, SYSCALL_EFAULT if buf is
+// invalid.
 size_t do_read(fd_t const fd, uint8_t * const buf, size_t const len);
 
 // Write to a file descriptor.
 // @param fd: The file descriptor to write into.
 // @param buf: The data to write.
 // @param len: The size of the data to be written, in bytes.
-// @return: The number of bytes written.
+// @return: The number of bytes written, SYSCALL_EFAULT if buf is invalid.
 size_t do_write(fd_t const fd, uint8_t const * const buf, size_t const len);
 
+// Map the content of a file into the address space of the calling process. The
+// mapping is read-only and uses the frames of the page cache of the file,
+// hence all the processes mapping the same file share the same physical
+// memory, and subsequent writes to the file are visible through the mapping.
+// The mapping lives until the address space of the process is destroyed.
+// @param fd: The file descriptor of the file to map.
+// @param offset: The offset of the first byte to map in the file. Must be
+// page aligned.
+// @param len: The number of bytes to map. Bytes of the last page after the end
+// of the file read as 0.
+// @return: The address of the mapping, NULL if `offset` is not page aligned,
+// `len` is 0, the range goes past the last page of the file, `fd` is a pipe or
+// if the mapping could not be created.
+void *do_mmap(fd_t const fd, uint32_t const offset, size_t const len);
+
+// Read from a file descriptor into multiple buffers. The buffers are filled in
+// order, as if by successive read()s, stopping after the first short read.
+// @param fd: The file descriptor to read from.
+// @param iov: The array of buffers to read into.
+// @param iovcnt: The number of elements in `iov`.
+// @return: The total number of bytes read. If an invalid buffer is
+// encountered, the number of bytes read so far or SYSCALL_EFAULT if there are
+// none.
+size_t do_readv(fd_t const fd,
+                struct iovec const * const iov,
+                size_t const iovcnt);
+
+// Write multiple buffers to a file descriptor. The buffers are written in
+// order, as if by successive write()s, stopping after the first short write.
+// @param fd: The file descriptor to write into.
+// @param iov: The array of buffers to write.
+// @param iovcnt: The number of elements in `iov`.
+// @return: The total number of bytes written. If an invalid buffer is
+// encountered, the number of bytes written so far or SYSCALL_EFAULT if there
+// are none.
+size_t do_writev(fd_t const fd,
+                 struct iovec const * const iov,
+                 size_t const iovcnt);
+
+// Execute multiple syscalls in a single kernel entry. The syscalls are executed
+// in order, each is described by a struct syscall_args as if its registers were
+// passed to int 0x80. NR_SYSCALL_BATCH cannot be nested. The execution stops
+// early if one of the syscalls kills the process or if `reqs` or `results`
+// point to invalid memory.
+// @param reqs: The array of syscalls to execute.
+// @param results: The array receiving the result of each executed syscall, must
+// contain at least `n` elements.
+// @param n: The number of syscalls in `reqs`.
+// @return: The number of syscalls executed.
+size_t do_syscall_batch(struct syscall_args const * const reqs,
+                        reg_t * const results,
+                        size_t const n);
+
+// Read the monotonic clock, see clock_now_ns().
+// @param u_ns: The user buffer receiving the current time in nanoseconds.
+// @return: 0 on success, SYSCALL_EFAULT if u_ns is invalid.
+reg_t do_clock_gettime(uint64_t * const u_ns);
+
+// Get the memory usage of the kernel and of the calling process, see memstat.h.
+// @param u_kernel: The user buffer receiving the memory usage of the kernel.
+// @param u_proc: The user buffer receiving the memory usage of the calling
+// process.
+// @return: 0 on success, SYSCALL_EFAULT if a buffer is invalid.
+reg_t do_mem_stats(struct memstat * const u_kernel,
+                   struct proc_mem_stats * const u_proc);
+
 // Return the PID of the current process.
 pid_t do_get_pid(void);
 
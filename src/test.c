@@ -2,8 +2,17 @@
 #include <debug.h>
 #include <frame_alloc.h>
 #include <kmalloc.h>
+#include <proc.h>
+#include <kmem_cache.h>
 #include <lapic.h>
 #include <acpi.h>
+#include <ipm.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <smp.h>
+#include <percpu.h>
+#include <sched.h>
+#include <proc_test_helpers.h>
 
 // Some test statistics:
 // The number of tests run so far.
@@ -15,6 +24,31 @@ static uint32_t SUCCESS_COUNT = 0;
 static uint32_t TOT_PHY_FRAME_LEAK = 0;
 // The size in bytes of dynamically allocated memory leaks in the tests.
 static uint32_t TOT_DYN_MEM_LEAK = 0;
+// Protects the statistics above, tests might run concurrently, see
+// test_run_parallel().
+DECLARE_SPINLOCK(TEST_STATS_LOCK);
+
+// True while test_run_parallel() is running suites. Per-test leak detection is
+// disabled during that time.
+static bool volatile PARALLEL_RUN = false;
+
+// Give back the memory held by the allocators' caches (the pool of dead
+// processes, kmalloc's per-cpu caches and retained empty groups, and the
+// retained empty slabs of the object caches). This memory would otherwise be
+// reported as leaked.
+static void release_cached_memory(void) {
+    proc_pool_shrink();
+    kmalloc_drain_caches();
+    kmem_cache_shrink_all();
+    kmalloc_shrink();
+}
+
+// Compute the number of bytes currently dynamically allocated, either through
+// kmalloc or object caches.
+// @return: The number of bytes allocated.
+static size_t dyn_mem_allocated(void) {
+    return kmalloc_total_allocated() + kmem_cache_total_allocated();
+}
 
 // Detect memory leaks (physical or dynamic) and prints a warning if any is
 // found. This function makes sure not to output false positives due to timing
@@ -24,42 +58,58 @@ static uint32_t TOT_DYN_MEM_LEAK = 0;
 // before running the test.
 // @param kmalloc_before: The number of bytes dynamically allocated before
 // running the test.
-static void detect_memory_leaks(char const * const name,
+// @return: true if a leak was detected, false otherwise.
+static bool detect_memory_leaks(char const * const name,
                                 uint32_t const frames_before,
                                 uint32_t const kmalloc_before) {
     uint32_t const max_tries = 10;
     uint32_t num_tries = 0;
+    release_cached_memory();
     while (num_tries < max_tries &&
         (frames_allocated() > frames_before ||
-        kmalloc_total_allocated() > kmalloc_before)) {
+        dyn_mem_allocated() > kmalloc_before)) {
         num_tries ++;
         lapic_sleep(100);
+        release_cached_memory();
     }
 
     uint32_t const allocated_frames_after = frames_allocated();
-    size_t const kmalloc_tot_after = kmalloc_total_allocated();
+    size_t const kmalloc_tot_after = dyn_mem_allocated();
     if (frames_before < allocated_frames_after) {
         uint32_t const num = allocated_frames_after - frames_before;
         WARN("  Physical frame leak of %u frames detected for %s\n", num, name);
+        spinlock_lock(&TEST_STATS_LOCK);
         TOT_PHY_FRAME_LEAK += num;
+        spinlock_unlock(&TEST_STATS_LOCK);
     }
     if (kmalloc_before < kmalloc_tot_after) {
         uint32_t const num = kmalloc_tot_after - kmalloc_before;
         WARN("  Dynamic memory leak of %u bytes detected for %s\n", num, name);
+        spinlock_lock(&TEST_STATS_LOCK);
         TOT_DYN_MEM_LEAK += num;
+        spinlock_unlock(&TEST_STATS_LOCK);
         kmalloc_list_allocations();
     }
+    return frames_before < allocated_frames_after ||
+        kmalloc_before < kmalloc_tot_after;
 }
 
 void __run_single_test(test_function const func, char const * const name) {
-    TESTS_COUNT ++;
-
-    uint32_t const allocated_frames_before = frames_allocated();
-    size_t const kmalloc_tot_before = kmalloc_total_allocated();
+    bool const check_leaks = !PARALLEL_RUN;
+    uint32_t allocated_frames_before = 0;
+    size_t kmalloc_tot_before = 0;
+    if (check_leaks) {
+        release_cached_memory();
+        allocated_frames_before = frames_allocated();
+        kmalloc_tot_before = dyn_mem_allocated();
+    }
 
     bool const res = func();
 
+    spinlock_lock(&TEST_STATS_LOCK);
+    TESTS_COUNT ++;
     SUCCESS_COUNT += res ? 1 : 0;
+    spinlock_unlock(&TEST_STATS_LOCK);
 #ifdef SERIAL
     // Serial output allows us to send color codes.
     char const * const str = res?"\033[32m OK \033[39m":"\033[31mFAIL\033[39m";
@@ -67,7 +117,130 @@ void __run_single_test(test_function const func, char const * const name) {
     char const * const str = res ? " OK " : "FAIL";
 #endif
     LOG("[%s] %s\n", str, name);
-    detect_memory_leaks(name, allocated_frames_before, kmalloc_tot_before);
+    if (check_leaks) {
+        detect_memory_leaks(name, allocated_frames_before, kmalloc_tot_before);
+    }
+}
+
+// The memory allocated by a suite run by test_run_parallel(), computed from the
+// balances of the cpu running it, see frame_alloc_cpu_balance().
+struct suite_balance {
+    // The number of frames allocated and not freed by the suite.
+    int32_t frames;
+    // The number of bytes allocated and not freed by the suite, through
+    // kmalloc() or object caches.
+    int32_t bytes;
+};
+
+// The state of the current test_run_parallel() call.
+static struct parallel_suite const * PARALLEL_SUITES = NULL;
+static uint32_t NUM_PARALLEL_SUITES = 0;
+// The balance of each suite, indexed as PARALLEL_SUITES.
+static struct suite_balance * PARALLEL_BALANCES = NULL;
+// The index of the next suite to run.
+static atomic_t NEXT_PARALLEL_SUITE;
+// The number of cpus that are done running suites.
+static atomic_t PARALLEL_CPUS_DONE;
+
+// Get the number of bytes allocated minus the number of bytes freed on the
+// current cpu so far, through kmalloc() or object caches.
+// @return: The balance of the current cpu.
+static int32_t dyn_mem_cpu_balance(void) {
+    return kmalloc_cpu_balance() + kmem_cache_cpu_balance();
+}
+
+// Run suites of the current test_run_parallel() call until there is none left,
+// recording the balance of each suite.
+static void run_parallel_suites(void) {
+    while (true) {
+        uint32_t const i = atomic_fetch_and_add(&NEXT_PARALLEL_SUITE, 1);
+        if (i >= NUM_PARALLEL_SUITES) {
+            break;
+        }
+        // The runner is never migrated, hence the suite runs entirely on this
+        // cpu.
+        int32_t const frames_before = frame_alloc_cpu_balance();
+        int32_t const bytes_before = dyn_mem_cpu_balance();
+        PARALLEL_SUITES[i].func();
+        PARALLEL_BALANCES[i].frames = frame_alloc_cpu_balance() - frames_before;
+        PARALLEL_BALANCES[i].bytes = dyn_mem_cpu_balance() - bytes_before;
+    }
+    atomic_inc(&PARALLEL_CPUS_DONE);
+}
+
+// The code of the kernel processes running suites on the APs.
+// @param unused: Unused.
+static void parallel_suites_proc(void * const unused) {
+    run_parallel_suites();
+    // Wait to be reset by test_run_parallel().
+    lock_up();
+}
+
+void test_run_parallel(struct parallel_suite const * const suites,
+                       uint32_t const n) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    uint8_t const this_cpu = cpu_id();
+    struct proc ** const procs = kmalloc(ncpus * sizeof(*procs));
+    PARALLEL_BALANCES = kmalloc(n * sizeof(*PARALLEL_BALANCES));
+    ASSERT(procs && PARALLEL_BALANCES);
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        procs[cpu] = NULL;
+        if (cpu != this_cpu) {
+            procs[cpu] = create_kproc(parallel_suites_proc, NULL);
+            ASSERT(procs[cpu]);
+        }
+    }
+
+    release_cached_memory();
+    uint32_t const frames_before = frames_allocated();
+    size_t const kmalloc_before = dyn_mem_allocated();
+
+    PARALLEL_SUITES = suites;
+    NUM_PARALLEL_SUITES = n;
+    atomic_init(&NEXT_PARALLEL_SUITE, 0);
+    atomic_init(&PARALLEL_CPUS_DONE, 0);
+    PARALLEL_RUN = true;
+    cpu_mfence();
+
+    // On the APs, the suites run in kernel processes, with interrupts enabled.
+    // There is no scheduler: each runner keeps its cpu until the cpu is reset.
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        if (procs[cpu]) {
+            exec_remote_call(cpu, exec_proc, procs[cpu], false);
+        }
+    }
+    run_parallel_suites();
+    while (atomic_read(&PARALLEL_CPUS_DONE) != ncpus) {
+        cpu_pause();
+    }
+
+    // The APs are locked up in the runners, reset them.
+    if (ncpus > 1) {
+        init_aps();
+    }
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        if (procs[cpu]) {
+            cpu_var(curr_proc, cpu) = NULL;
+            delete_proc(procs[cpu]);
+        }
+    }
+    PARALLEL_RUN = false;
+
+    // Memory freed on another cpu than the one that allocated it makes the
+    // balance of a suite positive without any leak, the balances are therefore
+    // only used to attribute a leak detected for the whole set.
+    if (detect_memory_leaks("parallel suites", frames_before, kmalloc_before)) {
+        for (uint32_t i = 0; i < n; ++i) {
+            struct suite_balance const * const balance = PARALLEL_BALANCES + i;
+            if (balance->frames > 0 || balance->bytes > 0) {
+                WARN("  %s did not free %d frames and %d bytes\n",
+                     suites[i].name, balance->frames, balance->bytes);
+            }
+        }
+    }
+    kfree(PARALLEL_BALANCES);
+    PARALLEL_BALANCES = NULL;
+    kfree(procs);
 }
 
 void print_test_summary(void) {
@@ -18,6 +18,38 @@ void __run_single_test(test_function const func, char const * const name);
 #define TEST_FWK_RUN(func) \
     __run_single_test(func, #func)
 
+// A test suite is a function running the tests of a subsystem with
+// TEST_FWK_RUN, e.g. str_test().
+typedef void (*test_suite)(void);
+
+// A test suite run by test_run_parallel().
+struct parallel_suite {
+    // The suite.
+    test_suite func;
+    // The name of the suite, used to report its leaks.
+    char const * name;
+};
+
+// Short-hand to declare a struct parallel_suite, naming it after the function.
+#define PARALLEL_SUITE(func) \
+    { func, #func }
+
+// Run a set of independent test suites concurrently on all cpus. Each suite is
+// run entirely by one cpu: the suites are pulled from a shared index by the
+// current cpu and by a kernel process started on each AP. The APs are reset
+// with init_aps() once all suites completed. Suites must not use other cpus
+// (remote calls, init_aps(), ...), must not block as there is no scheduler, and
+// must not use global state other suites depend on (e.g. OOM simulations).
+// The memory counters used by the leak detection are global, hence the leak
+// detection of each test is disabled while suites run concurrently. Leaks are
+// instead detected once for the whole set, after all suites completed, and
+// attributed to the suites using the balance of the cpu that ran each of them,
+// see frame_alloc_cpu_balance().
+// @param suites: The suites to run.
+// @param n: The number of suites.
+void test_run_parallel(struct parallel_suite const * const suites,
+                       uint32_t const n);
+
 // Print a summary of all the tests executed so far.
 void print_test_summary(void);
 
@@ -0,0 +1,402 @@
+#include <timer.h>
+#include <lapic.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <sched.h>
+#include <rcu.h>
+#include <debug.h>
+
+// The layout of the wheel, see timer.h.
+#define LVL_CLK_SHIFT   3
+#define LVL_SIZE        TIMER_WHEEL_LEVEL_SIZE
+#define LVL_MASK        (LVL_SIZE - 1)
+#define LVL_SHIFT(n)    ((n) * LVL_CLK_SHIFT)
+#define LVL_GRAN(n)     (1ULL << LVL_SHIFT(n))
+#define LVL_OFFS(n)     ((n) * LVL_SIZE)
+// The smallest delay going into level n > 0.
+#define LVL_START(n)    ((LVL_SIZE - 1ULL) << (((n) - 1) * LVL_CLK_SHIFT))
+// Delays at or above this value do not fit in the wheel.
+#define WHEEL_CUTOFF    LVL_START(TIMER_WHEEL_LEVELS)
+// The longest delay actually put in the wheel.
+#define WHEEL_MAX       (WHEEL_CUTOFF - LVL_GRAN(TIMER_WHEEL_LEVELS - 1))
+#define WHEEL_SIZE      (TIMER_WHEEL_LEVELS * LVL_SIZE)
+
+// Value of next_expiry and programmed when there is none.
+#define NO_EXPIRY   (~0ULL)
+
+// The timer wheel of a cpu.
+struct timer_base {
+    // Protects the wheel. Only the owner cpu adds timers, but any cpu can
+    // cancel one.
+    spinlock_t lock;
+    // The next jiffy to process. All the buckets for the jiffies before clk
+    // have been processed.
+    uint64_t clk;
+    // A lower bound on the expiry of the earliest bucket of the wheel,
+    // NO_EXPIRY if the wheel is empty. Canceling a timer does not update it,
+    // leading to a spurious but harmless interrupt at worst.
+    uint64_t next_expiry;
+    // The jiffy the LAPIC timer is armed for, NO_EXPIRY if it is stopped.
+    uint64_t programmed;
+    // Set while the timer interrupt is running the expired timers. The LAPIC
+    // timer is re-armed at the end of the interrupt instead of by timer_add().
+    bool running;
+    // The frame of the timer interrupt while it runs the callbacks.
+    struct interrupt_frame const * irq_frame;
+    // Bit i is set iff the bucket i is not empty.
+    uint32_t pending_map[WHEEL_SIZE / 32];
+    // The buckets of all the levels.
+    struct list_node buckets[WHEEL_SIZE];
+};
+
+DECLARE_PER_CPU(struct timer_base, timer_base);
+
+// Get the current jiffy.
+static uint64_t now_jiffies(void) {
+    return clock_now_ns() >> TIMER_JIFFY_SHIFT;
+}
+
+// Convert a clock value to a jiffy, rounding up so that timers never expire
+// early.
+// @param ns: The clock value in ns.
+// @return: The first jiffy starting at or after `ns`.
+static uint64_t ns_to_jiffies(uint64_t const ns) {
+    uint64_t const mask = (1ULL << TIMER_JIFFY_SHIFT) - 1;
+    return (ns + mask) >> TIMER_JIFFY_SHIFT;
+}
+
+// Compute the index of the bucket of a deadline in a level.
+// @param deadline: The deadline of the timer.
+// @param lvl: The level.
+// @param bucket_expiry: Output parameter receiving the jiffy at which the
+// bucket expires.
+// @return: The index of the bucket in the wheel.
+static uint16_t calc_index(uint64_t const deadline,
+                           uint32_t const lvl,
+                           uint64_t * const bucket_expiry) {
+    // Round up to the granularity of the level, the timer must not expire
+    // early.
+    uint64_t const pos = (deadline + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+    *bucket_expiry = pos << LVL_SHIFT(lvl);
+    return LVL_OFFS(lvl) + (pos & LVL_MASK);
+}
+
+// Compute the bucket for a deadline.
+// @param base: The wheel.
+// @param deadline: The deadline of the timer.
+// @param bucket_expiry: Output parameter receiving the jiffy at which the
+// bucket expires.
+// @return: The index of the bucket in the wheel.
+static uint16_t calc_wheel_index(struct timer_base const * const base,
+                                 uint64_t deadline,
+                                 uint64_t * const bucket_expiry) {
+    uint64_t const clk = base->clk;
+    if (deadline < clk) {
+        // Expired already, put it in the next bucket to be processed.
+        deadline = clk;
+    }
+    uint64_t const delta = deadline - clk;
+    if (delta >= WHEEL_CUTOFF) {
+        // Out of the range of the wheel, the timer will be re-inserted upon
+        // expiration of this bucket.
+        return calc_index(clk + WHEEL_MAX, TIMER_WHEEL_LEVELS - 1,
+            bucket_expiry);
+    }
+    uint32_t lvl = 0;
+    while (lvl < TIMER_WHEEL_LEVELS - 1 && delta >= LVL_START(lvl + 1)) {
+        lvl ++;
+    }
+    return calc_index(deadline, lvl, bucket_expiry);
+}
+
+// Put a timer in its bucket. The lock of the base must be held.
+// @param base: The wheel.
+// @param timer: The timer to enqueue, with its deadline set.
+static void enqueue_timer(struct timer_base * const base,
+                          struct timer * const timer) {
+    uint64_t bucket_expiry;
+    uint16_t const idx = calc_wheel_index(base, timer->deadline,
+        &bucket_expiry);
+    timer->idx = idx;
+    list_add_tail(base->buckets + idx, &timer->node);
+    base->pending_map[idx / 32] |= 1U << (idx % 32);
+    if (bucket_expiry < base->next_expiry) {
+        base->next_expiry = bucket_expiry;
+    }
+}
+
+// Remove a pending timer from its bucket. The lock of the base must be held.
+// @param base: The wheel containing the timer.
+// @param timer: The timer to remove.
+static void detach_timer(struct timer_base * const base,
+                         struct timer * const timer) {
+    uint16_t const idx = timer->idx;
+    list_del(&timer->node);
+    if (list_empty(base->buckets + idx)) {
+        base->pending_map[idx / 32] &= ~(1U << (idx % 32));
+    }
+    timer->pending = false;
+}
+
+// Compute the expiry of the earliest non-empty bucket of the wheel. This scans
+// the pending bitmap of each level starting from the current position of clk
+// in that level.
+// @param base: The wheel.
+// @return: The jiffy at which the earliest bucket expires, NO_EXPIRY if the
+// wheel is empty.
+static uint64_t next_bucket_expiry(struct timer_base const * const base) {
+    uint64_t next = NO_EXPIRY;
+    for (uint32_t lvl = 0; lvl < TIMER_WHEEL_LEVELS; ++lvl) {
+        uint32_t const * const map = base->pending_map + LVL_OFFS(lvl) / 32;
+        if (!map[0] && !map[1]) {
+            continue;
+        }
+        // Buckets of this level expire at multiples of the granularity, the
+        // first one to process is at or after clk.
+        uint64_t const start =
+            (base->clk + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+        for (uint32_t off = 0; off < LVL_SIZE; ++off) {
+            uint32_t const i = (start + off) & LVL_MASK;
+            if (map[i / 32] & (1U << (i % 32))) {
+                uint64_t const expiry = (start + off) << LVL_SHIFT(lvl);
+                next = expiry < next ? expiry : next;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+// Arm the LAPIC timer for the next expiry of the wheel of the current cpu, or
+// stop it if the wheel is empty. Interrupts must be disabled.
+// @param base: The wheel of the current cpu.
+static void program_lapic(struct timer_base * const base) {
+    uint64_t const next = base->next_expiry;
+    if (next == base->programmed) {
+        return;
+    } else if (next == NO_EXPIRY) {
+        lapic_stop_timer();
+    } else {
+        uint64_t const deadline_ns = next << TIMER_JIFFY_SHIFT;
+        uint64_t const now_ns = clock_now_ns();
+        lapic_arm_timer(deadline_ns > now_ns ? deadline_ns - now_ns : 0,
+            TIMER_VECTOR);
+    }
+    base->programmed = next;
+}
+
+// Move the clk of the base forward to the current jiffy, without skipping any
+// non-empty bucket. Adding a timer to an idle wheel whose clk lags behind
+// would otherwise put it in a coarser level than necessary.
+// @param base: The wheel.
+static void forward_clk(struct timer_base * const base) {
+    uint64_t const now = now_jiffies();
+    uint64_t const target = now < base->next_expiry ? now : base->next_expiry;
+    if (target > base->clk) {
+        base->clk = target;
+    }
+}
+
+// Move the timers in the buckets expiring at the current clk to a list. The
+// lock of the base must be held.
+// @param base: The wheel.
+// @param expired: The list receiving the timers.
+static void collect_expired_timers(struct timer_base * const base,
+                                   struct list_node * const expired) {
+    uint64_t clk = base->clk;
+    for (uint32_t lvl = 0; lvl < TIMER_WHEEL_LEVELS; ++lvl) {
+        uint16_t const idx = LVL_OFFS(lvl) + (clk & LVL_MASK);
+        struct list_node * const bucket = base->buckets + idx;
+        while (!list_empty(bucket)) {
+            struct list_node * const node = list_first(bucket);
+            list_del(node);
+            list_add_tail(expired, node);
+        }
+        base->pending_map[idx / 32] &= ~(1U << (idx % 32));
+        // The buckets of the next level only expire on multiples of their
+        // granularity.
+        if (clk & ((1 << LVL_CLK_SHIFT) - 1)) {
+            break;
+        }
+        clk >>= LVL_CLK_SHIFT;
+    }
+}
+
+// Run the expired timers of the wheel of the current cpu and re-arm the LAPIC
+// timer for the next expiry. Must be called with interrupts disabled, those are
+// only enabled while running the callbacks.
+// @param base: The wheel of the current cpu.
+static void run_timers(struct timer_base * const base) {
+    spinlock_lock(&base->lock);
+    base->running = true;
+    uint64_t const now = now_jiffies();
+    while (base->clk <= now) {
+        // Skip the empty buckets.
+        if (base->next_expiry > base->clk) {
+            uint64_t const next = next_bucket_expiry(base);
+            base->next_expiry = next;
+            if (next > now) {
+                base->clk = now + 1;
+                break;
+            }
+            base->clk = next;
+        }
+
+        struct list_node expired;
+        list_init(&expired);
+        collect_expired_timers(base, &expired);
+        base->clk ++;
+
+        while (!list_empty(&expired)) {
+            struct timer * const timer =
+                list_first_entry(&expired, struct timer, node);
+            list_del(&timer->node);
+            if (timer->deadline >= base->clk) {
+                // The deadline was beyond the range of the wheel.
+                enqueue_timer(base, timer);
+                continue;
+            }
+            timer->pending = false;
+            // The timer might be freed or re-added by its callback, it must
+            // not be accessed after this point.
+            void (*func)(void*) = timer->func;
+            void * const arg = timer->arg;
+            spinlock_unlock(&base->lock);
+            cpu_set_interrupt_flag(true);
+            func(arg);
+            cpu_set_interrupt_flag(false);
+            spinlock_lock(&base->lock);
+        }
+        // Timers added by the callbacks can only go into buckets after clk.
+        base->next_expiry = base->clk;
+    }
+    base->next_expiry = next_bucket_expiry(base);
+    base->running = false;
+    program_lapic(base);
+    spinlock_unlock(&base->lock);
+}
+
+// The handler of the LAPIC timer interrupt.
+// @param frame: The interrupt frame.
+static void timer_interrupt(struct interrupt_frame const * const frame) {
+    // A preemptible interrupted context is a quiescent state for RCU.
+    bool const quiescent = preemptible();
+    // The callbacks must not be preempted while the wheel is being processed.
+    // Interrupts are disabled while the wheel is manipulated, so that a nested
+    // interrupt cannot add or cancel a timer on this cpu while the lock is
+    // held.
+    preempt_disable();
+    if (quiescent) {
+        rcu_note_quiescent_state();
+    }
+    cpu_set_interrupt_flag(false);
+    struct timer_base * const base = &this_cpu_var(timer_base);
+    struct interrupt_frame const * const old_frame = base->irq_frame;
+    base->irq_frame = frame;
+    // The LAPIC timer fired, it is not armed anymore.
+    base->programmed = NO_EXPIRY;
+
+    run_timers(base);
+
+    base->irq_frame = old_frame;
+    cpu_set_interrupt_flag(true);
+    // This might reschedule if a callback asked for it, e.g. the scheduler
+    // tick.
+    preempt_enable();
+}
+
+void timer_init(struct timer * const timer,
+                void (*func)(void*),
+                void * const arg) {
+    list_init(&timer->node);
+    timer->deadline = 0;
+    timer->func = func;
+    timer->arg = arg;
+    timer->idx = 0;
+    timer->cpu = 0;
+    timer->pending = false;
+}
+
+void timer_add(struct timer * const timer, uint64_t const deadline_ns) {
+    if (timer->pending) {
+        timer_cancel(timer);
+    }
+
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    struct timer_base * const base = &this_cpu_var(timer_base);
+    spinlock_lock(&base->lock);
+
+    if (!base->running) {
+        forward_clk(base);
+    }
+    timer->deadline = ns_to_jiffies(deadline_ns);
+    timer->cpu = cpu_id();
+    timer->pending = true;
+    enqueue_timer(base, timer);
+    if (!base->running) {
+        program_lapic(base);
+    }
+
+    spinlock_unlock(&base->lock);
+    cpu_set_interrupt_flag(irqs);
+}
+
+bool timer_cancel(struct timer * const timer) {
+    if (!timer->pending) {
+        return false;
+    }
+    struct timer_base * const base = &cpu_var(timer_base, timer->cpu);
+    spinlock_lock(&base->lock);
+    // The timer might have expired while waiting for the lock.
+    bool const pending = timer->pending;
+    if (pending) {
+        detach_timer(base, timer);
+    }
+    spinlock_unlock(&base->lock);
+    return pending;
+}
+
+bool timer_pending(struct timer const * const timer) {
+    return timer->pending;
+}
+
+struct interrupt_frame const *timer_interrupt_frame(void) {
+    return this_cpu_var(timer_base).irq_frame;
+}
+
+// Initialize the wheel of the current cpu.
+static void init_timer_base(void) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    struct timer_base * const base = &this_cpu_var(timer_base);
+    spinlock_init(&base->lock);
+    base->clk = now_jiffies();
+    base->next_expiry = NO_EXPIRY;
+    base->programmed = NO_EXPIRY;
+    base->running = false;
+    base->irq_frame = NULL;
+    for (uint32_t i = 0; i < WHEEL_SIZE / 32; ++i) {
+        base->pending_map[i] = 0;
+    }
+    for (uint32_t i = 0; i < WHEEL_SIZE; ++i) {
+        list_init(base->buckets + i);
+    }
+    lapic_stop_timer();
+    cpu_set_interrupt_flag(irqs);
+}
+
+void init_timers(void) {
+    init_timer_base();
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    interrupt_register_global_callback(TIMER_VECTOR, timer_interrupt);
+    cpu_set_interrupt_flag(irqs);
+}
+
+void ap_init_timers(void) {
+    init_timer_base();
+}
+
+#include <timer.test>
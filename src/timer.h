@@ -0,0 +1,98 @@
+#pragma once
+#include <types.h>
+#include <list.h>
+#include <interrupt.h>
+
+// Software timers.
+//     Each cpu has a timer wheel multiplexing any number of timers on its LAPIC
+// timer, which runs in one-shot mode and is armed for the earliest deadline of
+// the wheel, or stopped if the wheel is empty. Timers are used for the
+// scheduler tick, sleeps, timeouts, ...
+//
+// Time is measured in jiffies of 2^TIMER_JIFFY_SHIFT ns (~1.05 ms) read from
+// the TSC clocksource (see clock_now_ns()), hence timers have a resolution of a
+// jiffy and can expire up to a jiffy late, never early.
+//
+// The wheel is hierarchical: it has TIMER_WHEEL_LEVELS levels of
+// TIMER_WHEEL_LEVEL_SIZE buckets, the buckets of level N span 8^N jiffies.
+// A timer goes into the level covering its delay and stays there until it
+// expires, timers are never cascaded from a level to the next: adding and
+// canceling a timer are O(1), the price being that a timer in level N can
+// expire up to 8^N jiffies late, that is roughly 1/8th (12.5%) of its delay.
+// Delays longer than the range of the wheel (~36 minutes) are handled by
+// re-inserting the timer once the end of the range is reached.
+//
+// Timer callbacks run in the timer interrupt of the cpu the timer was added
+// on, with interrupts enabled but preemption disabled. A callback can re-add
+// its own timer, e.g. to implement periodic timers.
+
+// The interrupt vector used by the LAPIC timer.
+#define TIMER_VECTOR    34
+
+// A jiffy is 2^TIMER_JIFFY_SHIFT nanoseconds.
+#define TIMER_JIFFY_SHIFT   20
+
+#define TIMER_WHEEL_LEVELS      6
+#define TIMER_WHEEL_LEVEL_SIZE  64
+
+struct timer {
+    // The node in the bucket of the timer.
+    struct list_node node;
+    // The jiffy at which the timer expires.
+    uint64_t deadline;
+    // The function to call when the timer expires and its argument.
+    void (*func)(void*);
+    void * arg;
+    // The index of the bucket containing the timer.
+    uint16_t idx;
+    // The cpu on which the timer has been added.
+    uint8_t cpu;
+    // Whether or not the timer has been added and did not expire yet.
+    bool pending;
+};
+
+// Initialize a timer.
+// @param timer: The timer to initialize.
+// @param func: The function to call upon expiration of the timer.
+// @param arg: The argument to pass to `func`.
+void timer_init(struct timer * const timer,
+                void (*func)(void*),
+                void * const arg);
+
+// Add a timer to the wheel of the current cpu. If the timer is already
+// pending it is first canceled. A timer must not be added concurrently on
+// multiple cpus.
+// @param timer: The timer to add.
+// @param deadline_ns: The clock value, in nanoseconds (see clock_now_ns()), at
+// which the timer expires. If this is in the past, the timer expires on the
+// next jiffy.
+void timer_add(struct timer * const timer, uint64_t const deadline_ns);
+
+// Cancel a pending timer. This can be called from any cpu. Note that this does
+// not wait for the callback of the timer if it is running on another cpu.
+// @param timer: The timer to cancel.
+// @return: true if the timer was pending, false if it already expired or was
+// never added.
+bool timer_cancel(struct timer * const timer);
+
+// Check if a timer is pending.
+// @param timer: The timer.
+// @return: true if the timer has been added and did not expire yet.
+bool timer_pending(struct timer const * const timer);
+
+// Get the interrupt frame of the timer interrupt running the timer callbacks on
+// the current cpu. This allows callbacks, e.g. the scheduler tick, to sample
+// the interrupted context.
+// @return: The interrupt frame, NULL if not called from a timer callback.
+struct interrupt_frame const *timer_interrupt_frame(void);
+
+// Initialize the timers on the BSP. The timer must have been calibrated
+// already, see calibrate_timer().
+void init_timers(void);
+
+// Initialize the timers on the current AP. Any timer pending on this cpu
+// before this call is dropped.
+void ap_init_timers(void);
+
+// Execute the tests of the timers.
+void timer_test(void);
@@ -0,0 +1,195 @@
+#include <topology.h>
+#include <percpu.h>
+#include <acpi.h>
+#include <cpu.h>
+#include <debug.h>
+
+// The number of low bits of the APIC ID to shift out to get the id of a level
+// of the topology.
+struct topology_shifts {
+    uint8_t smt;
+    uint8_t llc;
+    uint8_t package;
+};
+
+// The level types reported in ECX[15:8] of CPUID leaf 0xB.
+#define CPUID_TOPO_TYPE_INVALID 0
+#define CPUID_TOPO_TYPE_SMT     1
+
+DECLARE_PER_CPU(struct cpu_topology, cpu_topology);
+
+// Compute the number of bits needed to represent `n` distinct ids.
+// @param n: The number of ids.
+// @return: ceil(log2(n)), 0 if n <= 1.
+static uint8_t ceil_log2(uint32_t const n) {
+    uint8_t shift = 0;
+    while (shift < 32 && (1ULL << shift) < n) {
+        shift ++;
+    }
+    return shift;
+}
+
+// Get the number of APIC IDs sharing the last level cache, from CPUID leaf 0x4.
+// @return: The number of APIC IDs, 0 if leaf 0x4 is not supported.
+static uint32_t llc_sharing(uint32_t const max_leaf) {
+    if (max_leaf < 0x4) {
+        return 0;
+    }
+    uint32_t sharing = 0;
+    uint32_t llc_level = 0;
+    for (uint32_t i = 0; ; ++i) {
+        uint32_t eax;
+        cpuid_ecx(0x4, i, &eax, NULL, NULL, NULL);
+        // EAX[4:0] is the cache type, 0 means there are no more caches.
+        if (!(eax & 0x1F)) {
+            break;
+        }
+        // EAX[7:5] is the cache level, EAX[25:14] the maximum number of APIC
+        // IDs sharing the cache minus one.
+        uint32_t const level = (eax >> 5) & 0x7;
+        if (level >= llc_level) {
+            llc_level = level;
+            sharing = ((eax >> 14) & 0xFFF) + 1;
+        }
+    }
+    return sharing;
+}
+
+// Read the width of the fields of the APIC ID from the CPUID leaves of the
+// current cpu.
+// @param shifts: Output parameter receiving the widths.
+static void read_topology_shifts(struct topology_shifts * const shifts) {
+    shifts->smt = 0;
+    shifts->package = 0;
+
+    uint32_t max_leaf;
+    cpuid(0x0, &max_leaf, NULL, NULL, NULL);
+    bool leaf_b = false;
+    if (max_leaf >= 0xB) {
+        for (uint32_t i = 0; ; ++i) {
+            uint32_t eax, ebx, ecx;
+            cpuid_ecx(0xB, i, &eax, &ebx, &ecx, NULL);
+            uint32_t const type = (ecx >> 8) & 0xFF;
+            // EBX[15:0], the number of cpus at this level, is 0 for invalid
+            // levels.
+            if (type == CPUID_TOPO_TYPE_INVALID || !(ebx & 0xFFFF)) {
+                break;
+            }
+            // EAX[4:0] is the shift to get the id of the next level. The last
+            // valid level gives the shift of the package id.
+            uint8_t const shift = eax & 0x1F;
+            if (type == CPUID_TOPO_TYPE_SMT) {
+                shifts->smt = shift;
+            }
+            shifts->package = shift;
+            leaf_b = true;
+        }
+    }
+
+    if (!leaf_b) {
+        uint32_t ebx, edx;
+        cpuid(1, NULL, &ebx, NULL, &edx);
+        // CPUID.01H:EDX[28] indicates that EBX[23:16] is the number of APIC IDs
+        // per package.
+        if (edx & (1 << 28)) {
+            uint32_t const logical = (ebx >> 16) & 0xFF;
+            uint32_t cores = 1;
+            if (max_leaf >= 0x4) {
+                // CPUID.04H:EAX[31:26] is the number of cores per package minus
+                // one.
+                uint32_t eax;
+                cpuid_ecx(0x4, 0, &eax, NULL, NULL, NULL);
+                cores = (eax >> 26) + 1;
+            }
+            shifts->package = ceil_log2(logical);
+            shifts->smt = ceil_log2(logical / cores);
+        }
+    }
+
+    // The LLC lies between the core and the package. Without leaf 0x4, the
+    // LLC is assumed to span the package.
+    uint32_t const sharing = llc_sharing(max_leaf);
+    shifts->llc = sharing ? ceil_log2(sharing) : shifts->package;
+    if (shifts->smt > shifts->package) {
+        shifts->smt = shifts->package;
+    }
+    if (shifts->llc > shifts->package) {
+        shifts->llc = shifts->package;
+    } else if (shifts->llc < shifts->smt) {
+        shifts->llc = shifts->smt;
+    }
+}
+
+// Compute the topology of all the cpus from the width of the fields of their
+// APIC IDs.
+// @param shifts: The widths of the fields.
+// @param topos: The topology of each cpu, indexed by cpu id.
+// @param ncpus: The number of cpus.
+static void compute_topology(struct topology_shifts const * const shifts,
+                             struct cpu_topology * const * const topos,
+                             uint16_t const ncpus) {
+    for (uint16_t cpu = 0; cpu < ncpus; ++cpu) {
+        struct cpu_topology * const topo = topos[cpu];
+        topo->core_id = cpu >> shifts->smt;
+        topo->llc_id = cpu >> shifts->llc;
+        topo->package_id = cpu >> shifts->package;
+        cpumask_clear(&topo->smt_siblings);
+        cpumask_clear(&topo->llc_cpus);
+        cpumask_clear(&topo->package_cpus);
+    }
+    for (uint16_t cpu = 0; cpu < ncpus; ++cpu) {
+        struct cpu_topology * const topo = topos[cpu];
+        for (uint16_t other = 0; other < ncpus; ++other) {
+            struct cpu_topology const * const o = topos[other];
+            if (o->core_id == topo->core_id) {
+                cpumask_set(&topo->smt_siblings, other);
+            }
+            if (o->llc_id == topo->llc_id) {
+                cpumask_set(&topo->llc_cpus, other);
+            }
+            if (o->package_id == topo->package_id) {
+                cpumask_set(&topo->package_cpus, other);
+            }
+        }
+    }
+}
+
+void init_topology(void) {
+    struct topology_shifts shifts;
+    read_topology_shifts(&shifts);
+
+    uint16_t const ncpus = acpi_get_number_cpus();
+    struct cpu_topology * topos[ncpus];
+    for (uint16_t cpu = 0; cpu < ncpus; ++cpu) {
+        topos[cpu] = &cpu_var(cpu_topology, cpu);
+    }
+    compute_topology(&shifts, topos, ncpus);
+
+    struct cpu_topology const * const last = topos[ncpus - 1];
+    LOG("Topology: APIC ID shifts smt = %u llc = %u package = %u, %u cores, "
+        "%u LLCs, %u packages\n", shifts.smt, shifts.llc, shifts.package,
+        last->core_id + 1, last->llc_id + 1, last->package_id + 1);
+}
+
+struct cpu_topology const *topology_cpu(uint8_t const cpu) {
+    ASSERT(cpu < acpi_get_number_cpus());
+    return &cpu_var(cpu_topology, cpu);
+}
+
+enum topology_level topology_distance(uint8_t const a, uint8_t const b) {
+    struct cpu_topology const * const ta = topology_cpu(a);
+    struct cpu_topology const * const tb = topology_cpu(b);
+    if (a == b) {
+        return TOPOLOGY_SELF;
+    } else if (ta->core_id == tb->core_id) {
+        return TOPOLOGY_SMT;
+    } else if (ta->llc_id == tb->llc_id) {
+        return TOPOLOGY_LLC;
+    } else if (ta->package_id == tb->package_id) {
+        return TOPOLOGY_PACKAGE;
+    } else {
+        return TOPOLOGY_SYSTEM;
+    }
+}
+
+#include <topology.test>
@@ -0,0 +1,62 @@
+#pragma once
+#include <types.h>
+#include <cpumask.h>
+
+// CPU topology.
+//     The APIC ID of a cpu is made of bit fields identifying, from the least
+// significant bits, its SMT thread within its core, its core within its package
+// and its package. CPUID leaf 0xB gives the width of each field, leaf 0x4 gives
+// the number of APIC IDs sharing each cache, from which the field identifying
+// the last level cache (LLC) is derived. Cpu ids are APIC IDs (see cpu_id()),
+// hence the topology of every cpu is computed from the CPUID leaves of the BSP,
+// all the cpus being assumed identical.
+//     Without leaf 0xB, the legacy leaves 0x1 and 0x4 are used instead. Without
+// any of them, each cpu is considered to be its own package.
+
+// How close two cpus are, from the closest to the farthest. Ordered so that
+// levels can be compared.
+enum topology_level {
+    // The same cpu.
+    TOPOLOGY_SELF = 0,
+    // SMT siblings, i.e. two hardware threads of the same core.
+    TOPOLOGY_SMT = 1,
+    // Two cpus sharing the last level cache.
+    TOPOLOGY_LLC = 2,
+    // Two cpus of the same package.
+    TOPOLOGY_PACKAGE = 3,
+    // Two cpus of different packages.
+    TOPOLOGY_SYSTEM = 4,
+};
+
+// The position of a cpu in the topology. Ids are unique across the system,
+// e.g. two cpus have the same core_id iff they are SMT siblings.
+struct cpu_topology {
+    // The core of the cpu.
+    uint8_t core_id;
+    // The group of cpus sharing the last level cache with this cpu.
+    uint8_t llc_id;
+    // The package of the cpu.
+    uint8_t package_id;
+    // The cpus at each level of the topology, including this cpu.
+    struct cpumask smt_siblings;
+    struct cpumask llc_cpus;
+    struct cpumask package_cpus;
+};
+
+// Discover the topology of all the cpus from the CPUID leaves of the current
+// cpu. Must be called on the BSP after the percpu areas of the APs have been
+// allocated.
+void init_topology(void);
+
+// Get the position of a cpu in the topology.
+// @param cpu: The cpu.
+// @return: The topology of `cpu`.
+struct cpu_topology const *topology_cpu(uint8_t const cpu);
+
+// Compute how close two cpus are.
+// @param a, b: The cpus.
+// @return: The closest level of the topology containing both cpus.
+enum topology_level topology_distance(uint8_t const a, uint8_t const b);
+
+// Execute topology tests.
+void topology_test(void);
@@ -0,0 +1,234 @@
+#include <tracelog.h>
+#include <tty.h>
+#include <string.h>
+#include <memory.h>
+#include <kmalloc.h>
+#include <acpi.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <debug.h>
+
+// The number of records in the trace ring of each cpu.
+#define TRACE_RING_LEN  256
+
+// A record in a trace ring. Records have a fixed size so that appending one
+// does not require computing its length, and occupy a single cache line.
+struct trace_record {
+    // The value of the TSC when the record was created.
+    uint64_t tsc;
+    // The index of the record's descriptor in the .tracelog section.
+    uint16_t desc_id;
+    // The cpu that created the record.
+    uint8_t cpu;
+    uint8_t num_args;
+    // The raw values of the arguments, zero-extended.
+    uint64_t args[TRACELOG_MAX_ARGS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+STATIC_ASSERT(sizeof(struct trace_record) == CACHE_LINE_SIZE,
+              "trace_record does not fit in a cache line");
+
+// The trace ring of a cpu. As for the tty's log rings, a trace ring is only
+// written by its cpu, with interrupts disabled, and only read by the cpu
+// dumping the trace.
+struct trace_ring {
+    // The index of the oldest record, only written by the dumping cpu. Indices
+    // are free-running, the ring is empty iff head == tail.
+    uint32_t volatile head;
+    // The index after the newest record, only written by the ring's cpu.
+    uint32_t volatile tail;
+    // The number of records dropped because the ring was full, only written by
+    // the ring's cpu.
+    uint32_t volatile dropped;
+    // The value of `dropped` at the last dump, only written by the dumping cpu.
+    uint32_t dropped_reported;
+    struct trace_record records[TRACE_RING_LEN];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The trace ring of each cpu, indexed by cpu id. NULL until tracelog_init()
+// has been called.
+static struct trace_ring * TRACE_RINGS = NULL;
+static uint16_t NUM_TRACE_RINGS = 0;
+
+// Serializes tracelog_dump() calls.
+DECLARE_SPINLOCK(TRACELOG_DUMP_LOCK);
+
+// The bounds of the .tracelog section, see linker.ld.
+extern struct tracelog_desc SECTION_TRACELOG_START;
+extern struct tracelog_desc SECTION_TRACELOG_END;
+
+// The bounds of the .tracepoints section, see linker.ld.
+extern struct tracepoint * const SECTION_TRACEPOINTS_START;
+extern struct tracepoint * const SECTION_TRACEPOINTS_END;
+
+// Compile a descriptor: parse its format string once and cache the size of
+// each argument. PANIC if the number of substitutions does not match the number
+// of arguments of the call site. Concurrent compilations of the same descriptor
+// are harmless as they write the same values.
+// @param desc: The descriptor to compile.
+static void compile_desc(struct tracelog_desc * const desc) {
+    uint8_t num_args = 0;
+    for (char const * c = desc->fmt; *c; ++c) {
+        if (*c != '%' || !*(c + 1)) {
+            continue;
+        }
+        uint8_t const size = tty_fmt_arg_size(*(++c));
+        if (!size) {
+            continue;
+        } else if (num_args == desc->num_args) {
+            // Checked first so that arg_sizes is never overflowed.
+            num_args++;
+            break;
+        }
+        desc->arg_sizes[num_args++] = size;
+    }
+    if (num_args != desc->num_args) {
+        PANIC("TRACELOG at %s:%u takes %u arguments, format expects %s%u\n",
+              desc->file, desc->line, desc->num_args,
+              num_args > desc->num_args ? "at least " : "", num_args);
+    }
+    // The sizes must be visible before the descriptor is marked compiled.
+    cpu_mfence();
+    desc->compiled = true;
+}
+
+void tracelog_record(struct tracelog_desc * const desc, ...) {
+    if (!desc->compiled) {
+        compile_desc(desc);
+    }
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    uint8_t const cpu = cpu_id();
+    if (cpu >= NUM_TRACE_RINGS) {
+        // No ring yet, either tracelog_init() was not called or this is an AP
+        // that did not get its final id yet.
+        cpu_set_interrupt_flag(irqs);
+        return;
+    }
+    struct trace_ring * const ring = TRACE_RINGS + cpu;
+    uint32_t const tail = ring->tail;
+    if (tail - ring->head == TRACE_RING_LEN) {
+        ring->dropped++;
+        cpu_set_interrupt_flag(irqs);
+        return;
+    }
+
+    struct trace_record * const rec = ring->records + (tail % TRACE_RING_LEN);
+    rec->tsc = read_tsc();
+    rec->desc_id = desc - &SECTION_TRACELOG_START;
+    rec->cpu = cpu;
+    rec->num_args = desc->num_args;
+    va_list list;
+    va_start(list, desc);
+    for (uint8_t i = 0; i < desc->num_args; ++i) {
+        // Values smaller than an int are promoted to an int in the variadic
+        // argument list. Hence 32-bit values are read as uint32_t.
+        rec->args[i] = desc->arg_sizes[i] == 8 ? va_arg(list, uint64_t) :
+            va_arg(list, uint32_t);
+    }
+    va_end(list);
+    // Publish the record only once fully written.
+    cpu_mfence();
+    ring->tail = tail + 1;
+    cpu_set_interrupt_flag(irqs);
+}
+
+void tracelog_init(void) {
+    uint16_t const ncpus = acpi_get_number_cpus();
+    struct trace_ring * const rings = kmalloc(ncpus * sizeof(*rings));
+    if (!rings) {
+        // Not fatal, TRACELOG() records are simply dropped.
+        WARN("Cannot allocate trace rings for %u cpus\n", ncpus);
+        return;
+    }
+    for (uint16_t i = 0; i < ncpus; ++i) {
+        rings[i].head = 0;
+        rings[i].tail = 0;
+        rings[i].dropped = 0;
+        rings[i].dropped_reported = 0;
+    }
+    NUM_TRACE_RINGS = ncpus;
+    TRACE_RINGS = rings;
+}
+
+bool tracepoint_enable(char const * const name, bool const enabled) {
+    for (struct tracepoint * const * ptr = &SECTION_TRACEPOINTS_START;
+         ptr < &SECTION_TRACEPOINTS_END; ++ptr) {
+        if (streq((*ptr)->name, name)) {
+            (*ptr)->enabled = enabled;
+            return true;
+        }
+    }
+    return false;
+}
+
+void tracepoint_enable_all(bool const enabled) {
+    for (struct tracepoint * const * ptr = &SECTION_TRACEPOINTS_START;
+         ptr < &SECTION_TRACEPOINTS_END; ++ptr) {
+        (*ptr)->enabled = enabled;
+    }
+}
+
+// Find the ring containing the oldest record among all trace rings.
+// @param rings: The rings.
+// @param num_rings: The number of rings.
+// @return: The ring containing the oldest record, NULL if all rings are empty.
+static struct trace_ring *find_oldest(struct trace_ring * const rings,
+                                      uint16_t const num_rings) {
+    struct trace_ring * oldest = NULL;
+    uint64_t oldest_tsc = 0;
+    for (uint16_t i = 0; i < num_rings; ++i) {
+        struct trace_ring * const ring = rings + i;
+        if (ring->head == ring->tail) {
+            continue;
+        }
+        uint64_t const tsc = ring->records[ring->head % TRACE_RING_LEN].tsc;
+        if (!oldest || tsc < oldest_tsc) {
+            oldest = ring;
+            oldest_tsc = tsc;
+        }
+    }
+    return oldest;
+}
+
+// Format and output the records of a set of trace rings, oldest first, and
+// remove them from their rings.
+// @param rings: The rings.
+// @param num_rings: The number of rings.
+static void dump_rings(struct trace_ring * const rings,
+                       uint16_t const num_rings) {
+    uint32_t const num_descs = &SECTION_TRACELOG_END - &SECTION_TRACELOG_START;
+    struct trace_ring * ring;
+    while ((ring = find_oldest(rings, num_rings))) {
+        struct trace_record const * const rec =
+            ring->records + (ring->head % TRACE_RING_LEN);
+        if (rec->desc_id < num_descs) {
+            struct tracelog_desc const * const desc =
+                &SECTION_TRACELOG_START + rec->desc_id;
+            LOG("[%U cpu%u] ", rec->tsc, rec->cpu);
+            tty_printf_values(desc->fmt, rec->args, rec->num_args);
+        }
+        // The record must be fully read before its cpu can reuse the slot.
+        cpu_mfence();
+        ring->head++;
+    }
+
+    for (uint16_t i = 0; i < num_rings; ++i) {
+        uint32_t const dropped = rings[i].dropped;
+        if (dropped != rings[i].dropped_reported) {
+            LOG("[tracelog] cpu%u dropped %u records\n", i,
+                dropped - rings[i].dropped_reported);
+            rings[i].dropped_reported = dropped;
+        }
+    }
+}
+
+void tracelog_dump(void) {
+    if (!TRACE_RINGS) {
+        return;
+    }
+    spinlock_lock(&TRACELOG_DUMP_LOCK);
+    dump_rings(TRACE_RINGS, NUM_TRACE_RINGS);
+    spinlock_unlock(&TRACELOG_DUMP_LOCK);
+}
+
+#include <tracelog.test>
@@ -0,0 +1,142 @@
+#pragma once
+#include <types.h>
+
+// Binary trace logging.
+//    tty_printf() parses its format string and converts every value to text
+// each time it is called, which is too expensive for high-frequency tracing.
+// TRACELOG() instead records the raw values of its arguments and defers all the
+// formatting to the moment the trace is dumped with tracelog_dump():
+//  - Each TRACELOG() call site defines a static format descriptor in the
+//  .tracelog section. The format string must be a literal. The number of
+//  arguments is counted at compile time and checked against the format string
+//  the first time the call site is executed, at which point the descriptor is
+//  "compiled": the size of each argument is cached in the descriptor so that
+//  the format string is never parsed again.
+//  - A call appends a fixed-size record, containing the TSC, the id of the
+//  descriptor (its index in the .tracelog section) and the raw arguments, to
+//  the trace ring of the current cpu. No lock is taken.
+//  - tracelog_dump() formats the records of all cpus, oldest first, with
+//  tty_printf_values().
+// Since formatting happens later, %s arguments must point to strings that
+// outlive the record, typically literals. Records created before
+// tracelog_init() are dropped, as well as records created while the ring of the
+// cpu is full, which are counted.
+
+// The max number of arguments of a TRACELOG() call.
+#define TRACELOG_MAX_ARGS   6
+
+// The format descriptor of a TRACELOG() call site. Descriptors are laid out
+// contiguously in the .tracelog section, hence the alignment which prevents the
+// compiler from padding between them.
+struct tracelog_desc {
+    // The format string, same syntax as tty_printf().
+    char const * fmt;
+    // The location of the call site.
+    char const * file;
+    uint16_t line;
+    // The number of arguments passed to the TRACELOG() call.
+    uint8_t num_args;
+    // True once the descriptor has been compiled, that is `arg_sizes` has been
+    // filled from the format string.
+    bool volatile compiled;
+    // The size in bytes of each argument, see tty_fmt_arg_size().
+    uint8_t arg_sizes[TRACELOG_MAX_ARGS];
+} __attribute__((aligned(32)));
+
+// Count the number of arguments of a variadic macro, up to TRACELOG_MAX_ARGS +
+// 1.
+#define _TRACELOG_NARGS(...)                                                \
+    _TRACELOG_NARGS_IMPL(0, ##__VA_ARGS__, 7, 6, 5, 4, 3, 2, 1, 0)
+#define _TRACELOG_NARGS_IMPL(_0, _1, _2, _3, _4, _5, _6, _7, N, ...) N
+
+// Record an event in the trace of the current cpu.
+// @param format: The format string, must be a string literal.
+// @param __VA_ARGS__: The values to use in the formatted string, at most
+// TRACELOG_MAX_ARGS.
+#define TRACELOG(format, ...)                                               \
+    do {                                                                    \
+        _Static_assert(_TRACELOG_NARGS(__VA_ARGS__) <= TRACELOG_MAX_ARGS,   \
+                       "Too many arguments to TRACELOG");                   \
+        static struct tracelog_desc __tracelog_desc                         \
+            __attribute__((section(".tracelog"), used)) = {                 \
+            .fmt = "" format "",                                            \
+            .file = __FILE__,                                               \
+            .line = __LINE__,                                               \
+            .num_args = _TRACELOG_NARGS(__VA_ARGS__),                       \
+            .compiled = false,                                              \
+        };                                                                  \
+        tracelog_record(&__tracelog_desc, ##__VA_ARGS__);                   \
+    } while (0)
+
+// Static tracepoints.
+//    A tracepoint is a named TRACELOG() call site that is disabled by default.
+// When disabled, it costs a load and a not-taken branch. Tracepoints are
+// defined with DEFINE_TRACEPOINT() in the file using them, a pointer to each of
+// them is put in the .tracepoints section so that they can be enabled by name
+// with tracepoint_enable(). Building the kernel with TRACING=1 enables all of
+// them at boot and dumps the trace at the end of kernel_main().
+//    The format of a tracepoint's record is "<name> <key>=<value> ...", hence
+// its dump line, see tracelog_dump(), reads:
+//      [<tsc> cpu<cpu>] <name> <key>=<value> ...
+// which an offline tool can turn into a per-cpu timeline.
+
+// A static tracepoint.
+struct tracepoint {
+    // The name of the tracepoint, as given to DEFINE_TRACEPOINT().
+    char const * name;
+    // If true, the tracepoint records an event each time it is hit.
+    bool volatile enabled;
+};
+
+// Define a tracepoint. Must be used at file scope.
+// @param tp: The name of the tracepoint.
+#define DEFINE_TRACEPOINT(tp)                                               \
+    static struct tracepoint __tracepoint_ ## tp = {                        \
+        .name = #tp,                                                        \
+        .enabled = false,                                                   \
+    };                                                                      \
+    static struct tracepoint * const __tracepoint_ptr_ ## tp                \
+        __attribute__((section(".tracepoints"), used)) =                    \
+        &__tracepoint_ ## tp;
+
+// Record an event for a tracepoint, if it is enabled.
+// @param tp: The name of the tracepoint, as given to DEFINE_TRACEPOINT().
+// @param format: The format of the event's fields, "<key>=<value> ...". Must be
+// a string literal.
+// @param __VA_ARGS__: The values of the fields.
+#define TRACEPOINT(tp, format, ...)                                         \
+    do {                                                                    \
+        if (__builtin_expect(__tracepoint_ ## tp.enabled, false)) {         \
+            TRACELOG(#tp " " format "\n", ##__VA_ARGS__);                   \
+        }                                                                   \
+    } while (0)
+
+// Enable or disable a tracepoint.
+// @param name: The name of the tracepoint.
+// @param enabled: Whether the tracepoint should record events.
+// @return: true if the tracepoint exists, false otherwise.
+bool tracepoint_enable(char const * const name, bool const enabled);
+
+// Enable or disable all the tracepoints.
+// @param enabled: Whether the tracepoints should record events.
+void tracepoint_enable_all(bool const enabled);
+
+// Append a record to the trace ring of the current cpu. Not meant to be called
+// directly, use TRACELOG() instead.
+// @param desc: The descriptor of the call site.
+// @param __VA_ARGS__: The values of the arguments.
+void tracelog_record(struct tracelog_desc * const desc, ...);
+
+// Allocate the per-cpu trace rings. Until this function is called, TRACELOG()
+// records are dropped. Must be called once the number of cpus is known and
+// dynamic allocation is available.
+void tracelog_init(void);
+
+// Format and output the records of all cpus, oldest first, removing them from
+// the trace rings. Each record is output as "[<tsc> cpu<cpu>] " followed by its
+// formatted string. The number of records each cpu dropped since the last dump
+// is reported as well.
+void tracelog_dump(void);
+
+// Run the tracelog tests.
+void tracelog_test(void);
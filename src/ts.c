@@ -6,10 +6,10 @@
 // cpus.
 
 // The runqueue.
-static struct list_node RUNQUEUE;
+static struct counted_list RUNQUEUE;
 
 // A lock protecting the runqueue against concurrent access.
-static spinlock_t RUNQUEUE_LOCK;
+static DECLARE_SPINLOCK(RUNQUEUE_LOCK);
 
 // Lock the RUNQUEUE_LOCK.
 static void lock_runqueue(void) {
@@ -23,48 +23,46 @@ static void unlock_runqueue(void) {
 
 // Get a pointer on the runqueue and lock it.
 // @return: A pointer on RUNQUEUE.
-static struct list_node *get_runqueue_and_lock(void) {
+static struct counted_list *get_runqueue_and_lock(void) {
     lock_runqueue();
     return &RUNQUEUE; 
 }
 
 // Initialize the runqueue and lock.
 static void ts_sched_init(void) {
-    list_init(&RUNQUEUE);
+    counted_list_init(&RUNQUEUE);
     spinlock_init(&RUNQUEUE_LOCK);
 }
 
 // Enqueue a process.
 // @param proc: The process to enqueue.
 static void ts_enqueue_proc(struct proc * const proc) {
-    struct list_node * const runqueue = get_runqueue_and_lock();
+    struct counted_list * const runqueue = get_runqueue_and_lock();
 
-    list_add_tail(runqueue, &proc->rq);
+    ASSERT(!proc->on_rq);
+    counted_list_add_tail(runqueue, &proc->rq);
+    proc->on_rq = true;
 
     unlock_runqueue();
 }
 
-// Check if a process is currently enqueued in the runqueue.
-// @param proc: The process we are looking for in `rq`.
-// @return: true if proc is enqueued false otherwise.
-static bool in_runqueue(struct proc const * const proc) {
-    struct list_node * const rq = &RUNQUEUE;
-    struct proc * it;
-    list_for_each_entry(it, rq, rq) {
-        if (it == proc) {
-            return true;
-        }
-    }
-    return false;
+// Remove a process from the runqueue.
+// @param proc: The process to remove. Must be in the runqueue.
+// Note: This function assumes the RUNQUEUE_LOCK is held.
+static void remove_from_runqueue(struct proc * const proc) {
+    ASSERT(spinlock_is_held(&RUNQUEUE_LOCK));
+    ASSERT(proc->on_rq);
+    counted_list_del(&RUNQUEUE, &proc->rq);
+    proc->on_rq = false;
 }
 
 // Dequeue a process.
 // @param proc: The process to dequeue.
 static void ts_dequeue_proc(struct proc * const proc) {
-    struct list_node * const runqueue = get_runqueue_and_lock();
+    struct counted_list * const runqueue = get_runqueue_and_lock();
 
-    ASSERT(in_runqueue(proc) && runqueue);
-    list_del(&proc->rq);
+    ASSERT(runqueue);
+    remove_from_runqueue(proc);
 
     unlock_runqueue();
 }
@@ -84,20 +82,20 @@ static void ts_tick(void) {
 // @return: The next process to run.
 static struct proc *ts_pick_next_proc(void) {
     struct proc * next;
-    struct list_node * const runqueue = get_runqueue_and_lock();
+    struct counted_list * const runqueue = get_runqueue_and_lock();
 
-    if (!list_size(runqueue)) {
+    if (counted_list_empty(runqueue)) {
         next = NO_PROC;
     } else {
-        next = list_first_entry(runqueue, struct proc, rq);
-        list_del(&next->rq);
+        next = list_first_entry(&runqueue->head, struct proc, rq);
+        remove_from_runqueue(next);
     }
 
     unlock_runqueue();
     return next;
 }
 
-struct sched const ts_sched = {
+struct sched ts_sched = {
     .sched_init          = ts_sched_init,
     .enqueue_proc        = ts_enqueue_proc,
     .dequeue_proc        = ts_dequeue_proc,
@@ -2,7 +2,14 @@
 #include <string.h>
 #include <memory.h>
 #include <spinlock.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <acpi.h>
+#include <cpu.h>
+#include <math.h>
+#include <debug.h>
 
+// Serializes the writes to the output stream.
 DECLARE_SPINLOCK(TTY_LOCK);
 
 
@@ -10,13 +17,243 @@ DECLARE_SPINLOCK(TTY_LOCK);
 static struct i_stream const * INPUT_STREAM;
 static struct o_stream const * OUTPUT_STREAM;
 
-static void putc(char const chr) {
-    OUTPUT_STREAM->write((uint8_t*)&chr, 1);
+// If true, the output stream is flushed after each tty_printf(), see
+// tty_enter_sync_mode().
+static bool SYNC_MODE = false;
+
+// Log records
+// ===========
+//    tty_printf() does not format directly into the output stream. Instead the
+// output is formatted into a tty_buf on the stack, without holding any lock,
+// and the resulting bytes are appended as a log record to the log ring of
+// the current cpu. Each record carries the TSC value at which it was created
+// and the id of the cpu that created it.
+//    Log rings are single-producer/single-consumer: a ring is only written by
+// its cpu, with interrupts disabled, and only read by the drainer. There is a
+// single drainer at any time, the first cpu to set DRAINING. It streams
+// the records of all rings to the output stream, oldest first. A cpu that
+// finishes a tty_printf() tries to become the drainer and gives up if another
+// cpu already is, which will pick up the new record. The idle loop drains as
+// well, see tty_drain().
+//    Before tty_init_log_rings() and in sync mode, tty_printf() writes to the
+// output stream directly under TTY_LOCK.
+
+// The maximum length of a log record. Longer outputs are split in multiple
+// records.
+#define TTY_MAX_RECORD_LEN  256
+
+// The size of the log ring of each cpu in bytes.
+#define LOG_RING_SIZE   4096
+
+// A buffer to format into.
+struct tty_buf {
+    // The formatted bytes not yet emitted.
+    char data[TTY_MAX_RECORD_LEN];
+    uint16_t len;
+    // If true, the bytes are written to the output stream when emitted instead
+    // of being appended to a log ring. TTY_LOCK must be held.
+    bool direct;
+};
+
+// The header of a record in a log ring. The record's data immediately follows
+// its header.
+struct log_record_hdr {
+    // The value of the TSC when the record was created.
+    uint64_t tsc;
+    // The length of the record's data.
+    uint16_t len;
+    // The cpu that created the record.
+    uint8_t cpu;
+} __attribute__((packed));
+
+// The log ring of a cpu.
+struct log_ring {
+    // The offset of the oldest record, only written by the drainer. Offsets are
+    // free-running, the ring is empty iff head == tail.
+    uint32_t volatile head;
+    // The offset after the newest record, only written by the ring's cpu.
+    uint32_t volatile tail;
+    uint8_t data[LOG_RING_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The log ring of each cpu, indexed by cpu id. NULL until tty_init_log_rings()
+// has been called.
+static struct log_ring * LOG_RINGS = NULL;
+static uint16_t NUM_LOG_RINGS = 0;
+
+// Non-zero while a cpu is draining the log rings.
+static atomic_t DRAINING = {.value = 0};
+
+// Copy bytes into a log ring, wrapping around if necessary.
+// @param ring: The ring.
+// @param off: The free-running offset to copy at.
+// @param src: The bytes to copy.
+// @param len: The number of bytes to copy.
+static void ring_copy_in(struct log_ring * const ring,
+                         uint32_t const off,
+                         void const * const src,
+                         uint32_t const len) {
+    uint32_t const start = off % LOG_RING_SIZE;
+    uint32_t const first = min_u32(len, LOG_RING_SIZE - start);
+    memcpy(ring->data + start, src, first);
+    memcpy(ring->data, (uint8_t const*)src + first, len - first);
+}
+
+// Copy bytes out of a log ring, wrapping around if necessary.
+// @param ring: The ring.
+// @param off: The free-running offset to copy from.
+// @param dst: The destination buffer.
+// @param len: The number of bytes to copy.
+static void ring_copy_out(struct log_ring const * const ring,
+                          uint32_t const off,
+                          void * const dst,
+                          uint32_t const len) {
+    uint32_t const start = off % LOG_RING_SIZE;
+    uint32_t const first = min_u32(len, LOG_RING_SIZE - start);
+    memcpy(dst, ring->data + start, first);
+    memcpy((uint8_t*)dst + first, ring->data, len - first);
+}
+
+// Check if any log ring contains records.
+// @return: true if some records are waiting to be drained.
+static bool records_pending(void) {
+    for (uint16_t i = 0; i < NUM_LOG_RINGS; ++i) {
+        if (LOG_RINGS[i].head != LOG_RINGS[i].tail) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write the oldest record of all log rings to the output stream and remove it
+// from its ring. Must be called by the drainer with TTY_LOCK held.
+// @return: true if a record was written, false if all rings are empty.
+static bool write_oldest_record(void) {
+    ASSERT(spinlock_is_held(&TTY_LOCK));
+    struct log_ring * oldest = NULL;
+    struct log_record_hdr oldest_hdr;
+    for (uint16_t i = 0; i < NUM_LOG_RINGS; ++i) {
+        struct log_ring * const ring = LOG_RINGS + i;
+        if (ring->head == ring->tail) {
+            continue;
+        }
+        struct log_record_hdr hdr;
+        ring_copy_out(ring, ring->head, &hdr, sizeof(hdr));
+        if (!oldest || hdr.tsc < oldest_hdr.tsc) {
+            oldest = ring;
+            oldest_hdr = hdr;
+        }
+    }
+    if (!oldest) {
+        return false;
+    }
+
+    uint8_t data[TTY_MAX_RECORD_LEN];
+    ring_copy_out(oldest, oldest->head + sizeof(oldest_hdr), data,
+                  oldest_hdr.len);
+    OUTPUT_STREAM->write(data, oldest_hdr.len);
+    // The record must be fully read before its cpu can reuse the space.
+    cpu_mfence();
+    oldest->head += sizeof(oldest_hdr) + oldest_hdr.len;
+    return true;
+}
+
+// Write the records of all the log rings to the output stream, if no other cpu
+// is already doing so.
+// @param wait: If true and another cpu is draining, wait for it to finish and
+// drain the records appended meanwhile. Otherwise return immediately, leaving
+// the records to the other cpu.
+static void drain_records(bool const wait) {
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    while (true) {
+        if (atomic_exchange(&DRAINING, 1)) {
+            if (!wait) {
+                break;
+            }
+            cpu_pause();
+            continue;
+        }
+        spinlock_lock(&TTY_LOCK);
+        while (write_oldest_record()) {}
+        spinlock_unlock(&TTY_LOCK);
+        atomic_write(&DRAINING, 0);
+        // A record might have been appended by a cpu that saw DRAINING set
+        // right before it was cleared. Drain it as well.
+        if (!records_pending()) {
+            break;
+        }
+    }
+    cpu_set_interrupt_flag(irqs);
+}
+
+// Append a record to a log ring, draining the rings if it is full. Must be
+// called by the ring's cpu with interrupts disabled.
+// @param ring: The ring.
+// @param hdr: The header of the record.
+// @param data: The data of the record, of length hdr->len.
+static void ring_append(struct log_ring * const ring,
+                        struct log_record_hdr const * const hdr,
+                        char const * const data) {
+    uint32_t const size = sizeof(*hdr) + hdr->len;
+    while (LOG_RING_SIZE - (ring->tail - ring->head) < size) {
+        drain_records(true);
+    }
+    ring_copy_in(ring, ring->tail, hdr, sizeof(*hdr));
+    ring_copy_in(ring, ring->tail + sizeof(*hdr), data, hdr->len);
+    // Publish the record only once fully written.
+    cpu_mfence();
+    ring->tail += size;
+}
+
+// Emit the content of a tty_buf, either to the output stream or as a new
+// record in the current cpu's log ring.
+// @param buf: The buffer to emit. Empty after this call.
+static void emit(struct tty_buf * const buf) {
+    if (!buf->len) {
+        return;
+    } else if (buf->direct) {
+        ASSERT(spinlock_is_held(&TTY_LOCK));
+        OUTPUT_STREAM->write((uint8_t*)buf->data, buf->len);
+        buf->len = 0;
+        return;
+    }
+
+    bool const irqs = interrupts_enabled();
+    cpu_set_interrupt_flag(false);
+    uint8_t const cpu = cpu_id();
+    if (cpu < NUM_LOG_RINGS) {
+        struct log_record_hdr const hdr = {
+            .tsc = read_tsc(),
+            .len = buf->len,
+            .cpu = cpu,
+        };
+        ring_append(LOG_RINGS + cpu, &hdr, buf->data);
+    } else {
+        // This cpu does not have a ring yet, eg. an AP that did not get its
+        // final id yet.
+        spinlock_lock(&TTY_LOCK);
+        OUTPUT_STREAM->write((uint8_t*)buf->data, buf->len);
+        spinlock_unlock(&TTY_LOCK);
+    }
+    cpu_set_interrupt_flag(irqs);
+    buf->len = 0;
+}
+
+// Append a character to a tty_buf, emitting the buffer first if it is full.
+// @param buf: The buffer.
+// @param chr: The character to append.
+static void putc(struct tty_buf * const buf, char const chr) {
+    if (buf->len == TTY_MAX_RECORD_LEN) {
+        emit(buf);
+    }
+    buf->data[buf->len++] = chr;
 }
 
 // Output an unsigned integer into the output stream in base 10 format.
+// @param buf: The buffer to format into.
 // @param n: The unsigned integer to output.
-static void output_uint(uint64_t const n) {
+static void output_uint(struct tty_buf * const buf, uint64_t const n) {
     // `digits` is an array that will contain the char representation of all
     // digits of `n` in reverse order. For instance if n == 123 then digits will
     // be ['3', '2', '1', '\0', ..., '\0'].
@@ -26,7 +263,7 @@ static void output_uint(uint64_t const n) {
     // Loop over n, determine each base-10 digits and store them in `digits`.
     uint64_t curr = n;
     if (n == 0) {
-        putc('0');
+        putc(buf, '0');
         return;
     }
     while (curr) {
@@ -37,104 +274,134 @@ static void output_uint(uint64_t const n) {
     }
     // Print each digit, reversing the order ...
     for (int8_t i = digit_idx-1; i >= 0; --i) {
-        putc(digits[i]);
+        putc(buf, digits[i]);
     }
 }
 
 // Output a signed integer into the output stream in base 10 format.
+// @param buf: The buffer to format into.
 // @param n: The signed integer to output.
-static void output_sint(int64_t const n) {
+static void output_sint(struct tty_buf * const buf, int64_t const n) {
     if (n < 0) {
-        putc('-');
-        output_uint((uint64_t)(-n));
+        putc(buf, '-');
+        output_uint(buf, (uint64_t)(-n));
     } else {
-        output_uint((uint64_t)(n));
+        output_uint(buf, (uint64_t)(n));
     }
 }
 
 // Output an unsigned integer into the output stream in hexadecimal
 // format.
+// @param buf: The buffer to format into.
 // @param n: The unsigned integer to output.
 // @param is64bits: Indicates whether or not the printed hexadecimal word should
 // be 64 bits or not.
-static void output_uint_hex(uint64_t const n, bool const is64bits) {
-    putc('0');
-    putc('x');
+static void output_uint_hex(struct tty_buf * const buf,
+                            uint64_t const n,
+                            bool const is64bits) {
+    putc(buf, '0');
+    putc(buf, 'x');
     for(int8_t i = is64bits ? 60 : 28; i >= 0; i -= 4) {
         uint64_t const mask = ((uint64_t)0xF) << i;
         uint8_t const half_byte = (n & mask) >> (i);
         if (half_byte < 0xA) {
-            putc('0' + half_byte);
+            putc(buf, '0' + half_byte);
         } else {
-            putc('A' + (half_byte-0xA));
+            putc(buf, 'A' + (half_byte-0xA));
         }
     }
 
 }
 
+// The source of the values substituted in a format string. Values come either
+// from a va_list or from an array of raw values, see tty_printf_values().
+struct fmt_args {
+    // If non-NULL, the values are read from this list.
+    va_list * list;
+    // Otherwise, the values are read from this array, in order. Each value
+    // holds the zero-extended bits of the argument.
+    uint64_t const * values;
+    // The number of values remaining in `values`.
+    uint8_t num_values;
+};
+
+// Read the next value to substitute from a fmt_args.
+// @param args: The source of the values.
+// @param size: The size of the value in bytes, as given by
+// tty_fmt_arg_size().
+// @return: The zero-extended bits of the value.
+static uint64_t next_arg(struct fmt_args * const args, uint8_t const size) {
+    if (args->list) {
+        // Values smaller than an int are promoted to an int in the variadic
+        // argument list. Hence 32-bit values are read as uint32_t.
+        return size == 8 ? va_arg(*args->list, uint64_t) :
+            va_arg(*args->list, uint32_t);
+    } else if (!args->num_values) {
+        // Not enough values, substitute 0 rather than reading garbage.
+        return 0;
+    } else {
+        args->num_values--;
+        return *(args->values++);
+    }
+}
+
 // Handle a substitution in the formatted string.
+// @param buf: The buffer to format into.
 // @param fmt: Pointer on the pointer pointing on the current char in the
 // caller. This pointer gets updated to point to the first char after the
 // substitution pattern in the format string.
-// @param list: The value list containing the values to be plugged in the
-// string.
-static void handle_substitution(char const **fmt, va_list *list) {
+// @param args: The values to be plugged in the string.
+static void handle_substitution(struct tty_buf * const buf,
+                                char const **fmt,
+                                struct fmt_args * const args) {
     char const *curr = *fmt;
     // Read the next char to figure out the type we need to write.
     char const type = *(curr++);
-    // We have the type, simply read the value from the va_list.
+    uint8_t const size = tty_fmt_arg_size(type);
+    // We have the type, simply read the value from the arguments.
+    uint64_t const val = size ? next_arg(args, size) : 0;
     switch (type) {
         case 'd': {
-            int64_t const val = va_arg((*list), int32_t);
-            output_sint(val);
+            output_sint(buf, (int32_t)val);
             break;
         }
         case 'D': {
-            int64_t const val = va_arg((*list), int64_t);
-            output_sint(val);
+            output_sint(buf, (int64_t)val);
             break;
         }
         case 'u': {
-            uint64_t const val = va_arg((*list), uint32_t);
-            output_uint(val);
-            break;
+            // FALL-THROUGH
         }
         case 'U': {
-            uint64_t const val = va_arg((*list), uint64_t);
-            output_uint(val);
+            output_uint(buf, val);
             break;
         }
         case 'p': {
             // FALL-THROUGH
         }
         case 'x': {
-            uint64_t const val = va_arg((*list), uint32_t);
-            output_uint_hex(val, false);
+            output_uint_hex(buf, val, false);
             break;
         }
         case 'X': {
-            uint64_t const val = va_arg((*list), uint64_t);
-            output_uint_hex(val, true);
+            output_uint_hex(buf, val, true);
             break;
         }
         case 's': {
-            char const * const str = va_arg((*list), char const * const);
-            for(size_t i = 0; i < strlen(str); ++i) {
-                putc(str[i]);
+            char const * const str = (char const *)(uint32_t)val;
+            for (char const * c = str; *c; ++c) {
+                putc(buf, *c);
             }
             break;
         }
         case 'c': {
-            // Values smaller than an int are promoted to an int in the variadic
-            // argument list. Hence for char we use int.
-            char const val = va_arg((*list), int);
-            putc(val);
+            putc(buf, (char)val);
             break;
         }
         default: {
             // For any other param, print the % and the char and move along.
-            putc('%');
-            putc(type);
+            putc(buf, '%');
+            putc(buf, type);
             break;
         }
     }
@@ -143,14 +410,17 @@ static void handle_substitution(char const **fmt, va_list *list) {
 }
 
 // Do the actual printf in the output stream.
+// @param buf: The buffer to format into.
 // @param fmt: The formatted string.
-// @param list: The list of values to be inserted in the string.
-static void do_printf(const char * const fmt, va_list list) {
+// @param args: The values to be inserted in the string.
+static void do_printf(struct tty_buf * const buf,
+                      const char * const fmt,
+                      struct fmt_args * const args) {
     char const *curr = fmt;
     while (curr) {
         // Skip all the character that does not mark a substitution.
         while (*curr && (*curr != '%')) {
-            putc(*(curr++));
+            putc(buf, *(curr++));
         }
 
         if (!*curr) {
@@ -164,12 +434,12 @@ static void do_printf(const char * const fmt, va_list list) {
         if (!*curr) {
             // We reach the end of the string, however the last character was a
             // % and therefore was not a substitution. Print it now and return.
-            putc('%');
+            putc(buf, '%');
             return;
         }
 
         // Handle the substitution.
-        handle_substitution(&curr, &list);
+        handle_substitution(buf, &curr, args);
     }
 }
 
@@ -182,17 +452,101 @@ void tty_init(struct i_stream const * const input_stream,
     OUTPUT_STREAM = output_stream;
 }
 
+// Format a string and output it, either directly to the output stream or
+// through the current cpu's log ring.
+// @param fmt: The format string.
+// @param args: The values to use in the formatted string.
+static void format_and_output(char const * const fmt,
+                              struct fmt_args * const args) {
+    if (!LOG_RINGS || SYNC_MODE) {
+        // Pending records must go out first.
+        tty_flush();
+        spinlock_lock(&TTY_LOCK);
+        struct tty_buf buf = {.len = 0, .direct = true};
+        do_printf(&buf, fmt, args);
+        emit(&buf);
+        if (SYNC_MODE && OUTPUT_STREAM->flush) {
+            OUTPUT_STREAM->flush();
+        }
+        spinlock_unlock(&TTY_LOCK);
+    } else {
+        struct tty_buf buf = {.len = 0, .direct = false};
+        do_printf(&buf, fmt, args);
+        emit(&buf);
+        drain_records(false);
+    }
+}
+
 // Print a formatted string to the output stream.
 // @param fmt: The format string.
 // @param __VA_ARGS: The values to use in the formatted string.
 void tty_printf(const char * const fmt, ...) {
-    spinlock_lock(&TTY_LOCK);
-    // We use the generic_printf function with the tty_putc function as backend.
     va_list list;
     va_start(list, fmt);
-    do_printf(fmt, list);
+    struct fmt_args args = {.list = &list, .values = NULL, .num_values = 0};
+    format_and_output(fmt, &args);
     va_end(list);
-    spinlock_unlock(&TTY_LOCK);
+}
+
+void tty_printf_values(char const * const fmt,
+                       uint64_t const * const values,
+                       uint8_t const num_values) {
+    struct fmt_args args = {
+        .list = NULL,
+        .values = values,
+        .num_values = num_values,
+    };
+    format_and_output(fmt, &args);
+}
+
+uint8_t tty_fmt_arg_size(char const type) {
+    switch (type) {
+        case 'd':
+        case 'u':
+        case 'p':
+        case 'x':
+        case 's':
+        case 'c':
+            return 4;
+        case 'D':
+        case 'U':
+        case 'X':
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+void tty_enter_sync_mode(void) {
+    SYNC_MODE = true;
+}
+
+void tty_init_log_rings(void) {
+    uint16_t const ncpus = acpi_get_number_cpus();
+    struct log_ring * const rings = kmalloc(ncpus * sizeof(*rings));
+    if (!rings) {
+        // Not fatal, keep writing directly to the output stream.
+        WARN("Cannot allocate log rings for %u cpus\n", ncpus);
+        return;
+    }
+    for (uint16_t i = 0; i < ncpus; ++i) {
+        rings[i].head = 0;
+        rings[i].tail = 0;
+    }
+    NUM_LOG_RINGS = ncpus;
+    LOG_RINGS = rings;
+}
+
+void tty_drain(void) {
+    if (LOG_RINGS) {
+        drain_records(false);
+    }
+}
+
+void tty_flush(void) {
+    if (LOG_RINGS) {
+        drain_records(true);
+    }
 }
 
 #include <tty.test>
@@ -16,5 +16,42 @@ void tty_init(struct i_stream const * const input_stream,
 // @param __VA_ARGS: The values to use in the formatted string.
 void tty_printf(const char * const fmt, ...);
 
+// Print a formatted string to the output stream, taking the values to
+// substitute from an array instead of a variadic argument list. This is used to
+// format binary trace records after the fact, see tracelog.h.
+// @param fmt: The format string.
+// @param values: The values to use in the formatted string, in order. Each
+// value holds the zero-extended bits of the argument, eg. a %d value holds the
+// 32 bits of the int32_t.
+// @param num_values: The number of values in `values`. Substitutions past the
+// last value print 0.
+void tty_printf_values(char const * const fmt,
+                       uint64_t const * const values,
+                       uint8_t const num_values);
+
+// Get the size of the argument consumed by a substitution in a format string.
+// @param type: The character following the '%' in the format string.
+// @return: 4 for 32-bit values (%d, %u, %x, %p, %s, %c), 8 for 64-bit values
+// (%D, %U, %X), 0 if the substitution does not consume an argument.
+uint8_t tty_fmt_arg_size(char const type);
+
+// Make all subsequent tty_printf() calls synchronous: each call returns only
+// once its output has been flushed out of the output stream. This is used when
+// panicking since the interrupts draining buffered output might never come.
+void tty_enter_sync_mode(void);
+
+// Allocate the per-cpu log rings. Until this function is called, tty_printf()
+// writes directly to the output stream. Must be called once the number of cpus
+// is known and dynamic allocation is available.
+void tty_init_log_rings(void);
+
+// Write the pending log records of all cpus to the output stream, unless
+// another cpu is already doing so. Does not wait.
+void tty_drain(void);
+
+// Write the pending log records of all cpus to the output stream, waiting for
+// any other cpu draining them.
+void tty_flush(void);
+
 // Testing of the tty.
 void tty_test(void);
@@ -0,0 +1,117 @@
+#include <uaccess.h>
+#include <sched.h>
+#include <paging.h>
+#include <kmalloc.h>
+#include <debug.h>
+#include <error.h>
+
+// The routines in uaccess_asm.S.
+uint32_t uaccess_memcpy(void * const dst,
+                        void const * const src,
+                        size_t const len);
+uint32_t uaccess_strnlen(char const * const str, size_t const max_len);
+extern uint8_t uaccess_fault_start;
+extern uint8_t uaccess_fault_end;
+extern uint8_t uaccess_fault_fixup;
+
+// Value returned by the routines in uaccess_asm.S when a fault occured.
+#define UACCESS_FAULT   ((uint32_t)-1)
+
+// Check if the current process is a kernel process, whose pointers are trusted.
+// @return: true if there is a current process and this is a kernel process.
+static bool curr_is_kernel_proc(void) {
+    struct proc const * const curr = get_curr_proc();
+    return !curr || curr->is_kernel_proc;
+}
+
+bool user_range_ok(void const * const uaddr,
+                   size_t const len,
+                   bool const write) {
+    return curr_is_kernel_proc() ||
+        paging_user_range_accessible(uaddr, len, write);
+}
+
+bool copy_from_user(void * const dst,
+                    void const * const usrc,
+                    size_t const len) {
+    if (!user_range_ok(usrc, len, false)) {
+        return false;
+    }
+    return uaccess_memcpy(dst, usrc, len) != UACCESS_FAULT;
+}
+
+bool copy_to_user(void * const udst,
+                  void const * const src,
+                  size_t const len) {
+    if (!user_range_ok(udst, len, true)) {
+        return false;
+    }
+    return uaccess_memcpy(udst, src, len) != UACCESS_FAULT;
+}
+
+// Get the length of a string of the current process.
+// @param ustr: The user string.
+// @param max_len: The maximum length of the string, NUL excluded.
+// @return: The length of the string, UACCESS_FAULT if the string is invalid or
+// longer than max_len.
+static uint32_t user_strlen(char const * const ustr, size_t const max_len) {
+    // The length is not known yet, validate the first byte only. The pages
+    // after it are validated by copy_from_user() once the length is known, a
+    // fault before that point is caught by uaccess_strnlen().
+    if (!user_range_ok(ustr, 1, false)) {
+        return UACCESS_FAULT;
+    }
+    uint32_t const len = uaccess_strnlen(ustr, max_len);
+    return len <= max_len ? len : UACCESS_FAULT;
+}
+
+bool strcpy_from_user(char * const dst,
+                      char const * const ustr,
+                      size_t const max_len) {
+    uint32_t const len = user_strlen(ustr, max_len);
+    // The string could be modified concurrently, do not rely on the NUL byte
+    // being copied.
+    if (len == UACCESS_FAULT || !copy_from_user(dst, ustr, len)) {
+        return false;
+    }
+    dst[len] = '\0';
+    return true;
+}
+
+char *strdup_from_user(char const * const ustr, size_t const max_len) {
+    uint32_t const len = user_strlen(ustr, max_len);
+    if (len == UACCESS_FAULT) {
+        return NULL;
+    }
+
+    char * const str = kmalloc(len + 1);
+    if (!str) {
+        SET_ERROR("Cannot allocate string copied from user", ENONE);
+        return NULL;
+    }
+    // The string could be modified concurrently, do not rely on the NUL byte
+    // being copied.
+    if (!copy_from_user(str, ustr, len)) {
+        kfree(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+bool uaccess_handle_fault(struct interrupt_frame const * const frame) {
+    uint8_t const * const eip = (uint8_t const*)frame->eip;
+    if (eip < &uaccess_fault_start || &uaccess_fault_end <= eip) {
+        return false;
+    }
+    // The register save area and the interrupt frame are separate copies of
+    // the EIP pushed by the cpu, the IRET uses the one pushed by the cpu. It is
+    // located right after the register save area, the vector and the error
+    // code, see interrupt_entry in interrupt_handler.S.
+    reg_t * const iret_eip = (reg_t*)(frame->registers + 1) + 2;
+    ASSERT(*iret_eip == frame->eip);
+    *iret_eip = (reg_t)&uaccess_fault_fixup;
+    return true;
+}
+
+#include <uaccess.test>
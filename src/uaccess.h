@@ -0,0 +1,78 @@
+#pragma once
+#include <types.h>
+#include <interrupt.h>
+
+// User memory access.
+// Syscalls receive pointers from user processes. Before accessing the memory
+// they point to, the kernel must make sure that:
+//  - The memory is user memory and not kernel memory. Otherwise a process could
+//  read or overwrite kernel data through a syscall.
+//  - The memory is accessible, either mapped or part of a lazy segment of the
+//  address space.
+// Large buffers (e.g. for read() and write()) are validated once with
+// user_range_ok() and then accessed directly, this way the file system copies
+// straight into or from the user pages. Small objects (paths, arrays of
+// arguments) are copied with the functions below which, on top of the
+// validation, survive page faults that cannot be resolved: a faulting access
+// makes the copy fail instead of panicking the kernel.
+// Note: Kernel processes are trusted, their pointers are kernel addresses and
+// are never validated.
+
+// Check if a range of memory can be accessed by the kernel on behalf of the
+// current process.
+// @param uaddr: The start of the range.
+// @param len: The length of the range in bytes.
+// @param write: If true, check for write access, otherwise read access.
+// @return: true if the range can be accessed, false otherwise.
+bool user_range_ok(void const * const uaddr,
+                   size_t const len,
+                   bool const write);
+
+// Copy memory from the current process.
+// @param dst: The kernel destination buffer.
+// @param usrc: The user source buffer.
+// @param len: The number of bytes to copy.
+// @return: true on success, false if the user buffer is invalid. In case of
+// failure, the content of `dst` is undefined.
+bool copy_from_user(void * const dst,
+                    void const * const usrc,
+                    size_t const len);
+
+// Copy memory to the current process.
+// @param udst: The user destination buffer.
+// @param src: The kernel source buffer.
+// @param len: The number of bytes to copy.
+// @return: true on success, false if the user buffer is invalid. In case of
+// failure, the content of `udst` is undefined.
+bool copy_to_user(void * const udst,
+                  void const * const src,
+                  size_t const len);
+
+// Copy a NUL-terminated string from the current process into a kernel buffer.
+// @param dst: The destination buffer, of at least max_len + 1 bytes.
+// @param ustr: The user string.
+// @param max_len: The maximum length of the string, NUL excluded.
+// @return: true on success, false if the string is invalid or longer than
+// max_len. In case of failure, the content of `dst` is undefined.
+bool strcpy_from_user(char * const dst,
+                      char const * const ustr,
+                      size_t const max_len);
+
+// Copy a NUL-terminated string from the current process into a newly allocated
+// kernel buffer.
+// @param ustr: The user string.
+// @param max_len: The maximum length of the string, NUL excluded.
+// @return: The copy of the string, to be kfree()'ed by the caller. NULL if the
+// string is invalid, longer than max_len, or if the allocation failed.
+char *strdup_from_user(char const * const ustr, size_t const max_len);
+
+// Try to resolve a page fault caused by a user memory access. This is called by
+// the interrupt handler for page faults not resolved by the paging code.
+// @param frame: The interrupt frame of the page fault.
+// @return: true if the fault was raised by one of the copy functions above, in
+// which case the copy will fail upon returning from the interrupt, false
+// otherwise.
+bool uaccess_handle_fault(struct interrupt_frame const * const frame);
+
+// Execute user memory access tests.
+void uaccess_test(void);
@@ -5,6 +5,7 @@
 #include <memory.h>
 #include <fs.h>
 #include <disk.h>
+#include <spinlock.h>
 
 // Implementation of the USTAR filesystem. This filesystem is no more than a
 // read only TAR archive. It is used for the init ram-disk.
@@ -116,6 +117,243 @@ static bool read_header(struct disk * const disk,
     return disk_read(disk, offset, dest, sizeof(*hdr)) == USTAR_SEC_SIZE;
 }
 
+// The maximum length of the full name of a file: the prefix, a '/' and the
+// filename.
+#define USTAR_MAX_PATH_LEN  (155 + 1 + 100)
+
+// Get the length of a header field that is NUL terminated unless it uses the
+// entire field.
+// @param field: The field.
+// @param size: The size of the field in bytes.
+// @return: The length of the string in the field.
+static size_t field_len(char const * const field, size_t const size) {
+    size_t len = 0;
+    while (len < size && field[len]) {
+        len++;
+    }
+    return len;
+}
+
+// Get the full name of the file described by a header, that is the prefix (if
+// any) followed by a '/' and the filename.
+// @param hdr: The header.
+// @param buf: The buffer receiving the full name, NUL terminated.
+static void header_full_name(struct ustar_header const * const hdr,
+                             char buf[USTAR_MAX_PATH_LEN + 1]) {
+    size_t prefix_len = field_len(hdr->filename_prefix,
+                                  sizeof(hdr->filename_prefix));
+    size_t const filename_len = field_len(hdr->filename,
+                                          sizeof(hdr->filename));
+    if (prefix_len) {
+        // Most of the time, there is no prefix.
+        memcpy(buf, hdr->filename_prefix, prefix_len);
+        // Add the '/'.
+        buf[prefix_len] = '/';
+        prefix_len ++;
+    }
+    memcpy(buf + prefix_len, hdr->filename, filename_len);
+    buf[prefix_len + filename_len] = '\0';
+}
+
+// Get the offset of the header following the one at `offset`.
+// @param hdr: The header at `offset`.
+// @param offset: The offset of `hdr` on disk.
+// @return: The offset of the next header.
+static uint32_t next_header_offset(struct ustar_header const * const hdr,
+                                   uint32_t const offset) {
+    uint32_t next = offset + sizeof(*hdr);
+    // If this was a file, skip any sector containing data as well.
+    if (is_file(hdr)) {
+        uint64_t const size = octal_string_to_u64(hdr->filesize);
+        next += ceil_x_over_y_u32(size, USTAR_SEC_SIZE) * USTAR_SEC_SIZE;
+    }
+    return next;
+}
+
+// USTAR index
+// ===========
+//    Since the archive has no directory structure, finding a file requires
+// reading every header preceding it. To avoid this, the archive is scanned
+// once when the disk is mounted and an in-memory hash table path -> header
+// offset is built and attached to the disk's fs_private. Opens on a mounted
+// disk are then a hash table lookup. Disks that are accessed without being
+// mounted (e.g. in tests) fall back to the linear scan.
+
+// An entry of the index, describing a file or directory in the archive.
+struct ustar_index_entry {
+    // Node in the bucket's list.
+    struct list_node bucket_ll;
+    // The hash of `path`.
+    uint32_t hash;
+    // The offset of the header of the file on disk.
+    uint32_t header_offset;
+    // The size of the file in bytes.
+    uint64_t size;
+    // The full name of the file, NUL terminated.
+    char path[];
+};
+
+// The index of a USTAR disk.
+struct ustar_index {
+    // The number of times the disk has been mounted. The index is freed when
+    // the last mount is removed.
+    uint32_t mount_count;
+    // Protects the buckets. Lookups take a read lock, insertions and deletions
+    // a write lock.
+    rwlock_t lock;
+    // The number of buckets, always a power of two.
+    uint32_t num_buckets;
+    // The buckets, each a list of struct ustar_index_entry.
+    struct list_node * buckets;
+};
+
+// Get the bucket of an index for a given hash.
+// @param index: The index.
+// @param hash: The hash of the path.
+// @return: The list of the bucket.
+static struct list_node *index_bucket(struct ustar_index * const index,
+                                      uint32_t const hash) {
+    return index->buckets + (hash & (index->num_buckets - 1));
+}
+
+// Look up a path in an index. The caller must hold the index's lock.
+// @param index: The index.
+// @param path: The path to look up.
+// @return: The entry for `path` or NULL if the path is not in the index.
+static struct ustar_index_entry *index_lookup(struct ustar_index * const index,
+                                              char const * const path) {
+    uint32_t const hash = str_hash(path);
+    struct ustar_index_entry * it;
+    list_for_each_entry(it, index_bucket(index, hash), bucket_ll) {
+        if (it->hash == hash && streq(it->path, path)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+// Allocate an entry of the index.
+// @param path: The path of the file.
+// @param header_offset: The offset of the header of the file on disk.
+// @param size: The size of the file.
+// @return: The new entry, NULL if the allocation failed.
+static struct ustar_index_entry *index_entry_create(char const * const path,
+                                                    uint32_t const header_offset,
+                                                    uint64_t const size) {
+    size_t const len = strlen(path);
+    struct ustar_index_entry * const entry = kmalloc(sizeof(*entry) + len + 1);
+    if (!entry) {
+        return NULL;
+    }
+    list_init(&entry->bucket_ll);
+    entry->hash = str_hash(path);
+    entry->header_offset = header_offset;
+    entry->size = size;
+    memcpy(entry->path, path, len + 1);
+    return entry;
+}
+
+// Insert an entry in an index. The caller must hold the write lock of the
+// index.
+// @param index: The index.
+// @param entry: The entry to insert.
+static void index_insert(struct ustar_index * const index,
+                         struct ustar_index_entry * const entry) {
+    list_add_tail(index_bucket(index, entry->hash), &entry->bucket_ll);
+}
+
+// Remove an entry from an index and free it. The caller must hold the write
+// lock of the index.
+// @param entry: The entry to remove.
+static void index_remove(struct ustar_index_entry * const entry) {
+    list_del(&entry->bucket_ll);
+    kfree(entry);
+}
+
+// Free an index and all its entries.
+// @param index: The index to free.
+static void index_destroy(struct ustar_index * const index) {
+    for (uint32_t i = 0; i < index->num_buckets; ++i) {
+        struct list_node * const bucket = index->buckets + i;
+        while (!list_empty(bucket)) {
+            index_remove(list_first_entry(bucket, struct ustar_index_entry,
+                                          bucket_ll));
+        }
+    }
+    kfree(index->buckets);
+    kfree(index);
+}
+
+// Scan the archive on a disk and build its index.
+// @param disk: The disk.
+// @return: The index, NULL if memory could not be allocated.
+static struct ustar_index *index_build(struct disk * const disk) {
+    struct ustar_index * const index = kmalloc(sizeof(*index));
+    struct ustar_header * const hdr = kmalloc(sizeof(*hdr));
+    char * const fullname = kmalloc(USTAR_MAX_PATH_LEN + 1);
+    if (!index || !hdr || !fullname) {
+        kfree(index);
+        kfree(hdr);
+        kfree(fullname);
+        return NULL;
+    }
+
+    // Collect all entries first, the number of buckets depends on the number
+    // of files.
+    struct list_node entries;
+    list_init(&entries);
+    uint32_t num_entries = 0;
+    bool oom = false;
+
+    uint32_t offset = 0x0;
+    while (read_header(disk, offset, hdr) && hdr->filename[0]) {
+        header_full_name(hdr, fullname);
+        uint64_t const size = is_file(hdr) ?
+            octal_string_to_u64(hdr->filesize) : 0;
+        struct ustar_index_entry * const entry =
+            index_entry_create(fullname, offset, size);
+        if (!entry) {
+            oom = true;
+            break;
+        }
+        list_add_tail(&entries, &entry->bucket_ll);
+        num_entries++;
+        offset = next_header_offset(hdr, offset);
+    }
+    kfree(hdr);
+    kfree(fullname);
+
+    // Aim for a load factor of at most 1.
+    uint32_t num_buckets = 1;
+    while (num_buckets < num_entries) {
+        num_buckets *= 2;
+    }
+    index->buckets = oom ? NULL : kmalloc(num_buckets * sizeof(*index->buckets));
+    index->num_buckets = index->buckets ? num_buckets : 0;
+    for (uint32_t i = 0; i < index->num_buckets; ++i) {
+        list_init(index->buckets + i);
+    }
+
+    while (!list_empty(&entries)) {
+        struct ustar_index_entry * const entry =
+            list_first_entry(&entries, struct ustar_index_entry, bucket_ll);
+        list_del(&entry->bucket_ll);
+        if (index->buckets) {
+            index_insert(index, entry);
+        } else {
+            kfree(entry);
+        }
+    }
+
+    if (!index->buckets) {
+        kfree(index);
+        return NULL;
+    }
+    index->mount_count = 0;
+    rwlock_init(&index->lock);
+    return index;
+}
+
 // Find a file given its path in a USTAR filesystem.
 // @param disk: The disk to look into.
 // @param filepath: The path of the file we are looking for.
@@ -126,8 +364,22 @@ static bool read_header(struct disk * const disk,
 static bool find_file(struct disk * const disk,
                       char const * const filepath,
                       uint32_t *file_offset) {
+    struct ustar_index * const index = disk->fs_private;
+    if (index) {
+        rwlock_read_lock(&index->lock);
+        struct ustar_index_entry const * const entry =
+            index_lookup(index, filepath);
+        if (entry) {
+            *file_offset = entry->header_offset;
+        }
+        rwlock_read_unlock(&index->lock);
+        return !!entry;
+    }
+
+    // The disk is not mounted, scan the archive.
     struct ustar_header * const hdr = kmalloc(sizeof(*hdr));
-    if (!hdr) {
+    char * const fullname = kmalloc(USTAR_MAX_PATH_LEN + 1);
+    if (!hdr || !fullname) {
         // This is probably not desirable here but this case should not happen
         // often anyway. This could be solved by using the stack instead.
         PANIC("Cannot allocate memory to find file\n");
@@ -137,50 +389,20 @@ static bool find_file(struct disk * const disk,
     bool found = false;
 
     while (read_header(disk, offset, hdr)) {
-        char * const prefix = hdr->filename_prefix;
-        size_t prefix_len = strlen(prefix);
-        char * const filename = hdr->filename;
-        size_t const filename_len = strlen(filename);
-        size_t const full_filename_len = prefix_len + strlen(filename);
-
-        // +1 for the potential "/" between the prefix and the file
-        // +1 for the '\0'.
-        char * const fullname = kmalloc(full_filename_len + 2);
-        if (!fullname) {
-            // This is probably not desirable here but this case should not happen
-            // often anyway. This could be solved by using the stack instead.
-            PANIC("Cannot allocate memory to find file\n");
-        }
-
-        if (prefix_len) {
-            // Most of the time, there is no prefix.
-            memcpy(fullname, prefix, prefix_len);
-            // Add the '/'.
-            fullname[prefix_len] = '/';
-            prefix_len ++;
-        }
-        memcpy(fullname + prefix_len, filename, filename_len);
-
+        header_full_name(hdr, fullname);
         found = streq(fullname, filepath);
-        kfree(fullname);
         if (found) {
             // File is found.
             break;
         } else {
-            // Skip header.
-            offset += sizeof(*hdr);
-
-            // If this was a file, skip any sector containing data as well.
-            if (is_file(hdr)) {
-                uint64_t const size = octal_string_to_u64(hdr->filesize);
-                offset += ceil_x_over_y_u32(size, 512) * 512;
-            }
+            offset = next_header_offset(hdr, offset);
         }
     }
     if (found) {
         *file_offset = offset;
     }
     kfree(hdr);
+    kfree(fullname);
     return found;
 }
 
@@ -265,10 +487,29 @@ static size_t ustar_write(struct file * file,
     return ustar_do_file_update(file, offset, (uint8_t *)buf, len, false);
 }
 
+// Get a pointer to the content of a file stored on a USTAR filesystem, if the
+// disk it is stored on is directly accessible in memory (e.g. the initrd).
+// @param file: The file.
+// @param offset: The offset of the first byte to access within the file.
+// @param len: The number of bytes to access.
+// @return: The address of the data or NULL.
+static void const *ustar_map_readonly(struct file * const file,
+                                      off_t const offset,
+                                      size_t const len) {
+    struct ustar_file_private_data const * const data = file->fs_private;
+    uint64_t const file_len = octal_string_to_u64(data->header.filesize);
+    if (!len || offset >= file_len || len > file_len - offset) {
+        return NULL;
+    }
+    off_t const data_off = data->header_offset + sizeof(data->header);
+    return disk_get_ptr(file->disk, data_off + offset, len);
+}
+
 // The file operations on a USTAR filesystem.
 static struct file_ops ustar_file_ops = {
     .read = ustar_read,
     .write = ustar_write,
+    .map_readonly = ustar_map_readonly,
 };
 
 // Detect if a given disk uses a USTAR filesystem.
@@ -301,23 +542,71 @@ static enum fs_op_res ustar_create_file(struct disk * const disk,
 // Delete a file from a USTAR filesystem.
 // @param disk: The disk to delete the file from.
 // @param path: The path of the file to be deleted.
+// Note: The archive itself is left untouched, only the index of a mounted disk
+// is updated, hence the file is not visible anymore until the disk is mounted
+// again.
 static void ustar_delete_file(struct disk * const disk,
                               char const * const path) {
+    struct ustar_index * const index = disk->fs_private;
+    if (!index) {
+        return;
+    }
+    rwlock_write_lock(&index->lock);
+    struct ustar_index_entry * const entry = index_lookup(index, path);
+    if (entry) {
+        index_remove(entry);
+    }
+    rwlock_write_unlock(&index->lock);
 }
 
-// Open a file on a USTAR filesystem.
-// @param disk: The disk to open the file from.
-// @param file: The struct file to initialize.
-// @param path: The full path of the file to be opened.
-// @return: A struct file for the opened file.
-static enum fs_op_res ustar_open_file(struct disk * const disk,
-                                      struct file * const file,
-                                      char const * const path) {
-    uint32_t file_offset = 0;
-    if (!find_file(disk, path, &file_offset)) {
-        return FS_NOT_FOUND;
+// Serializes ustar_mount() and ustar_unmount(), which may be called
+// concurrently on the same disk.
+static DECLARE_SPINLOCK(USTAR_MOUNT_LOCK);
+
+// Build the index of a USTAR disk when it is mounted.
+// @param disk: The disk being mounted.
+// @return: true on success, false if the index could not be allocated.
+static bool ustar_mount(struct disk * const disk) {
+    spinlock_lock(&USTAR_MOUNT_LOCK);
+    struct ustar_index * index = disk->fs_private;
+    if (!index) {
+        index = index_build(disk);
+        if (!index) {
+            spinlock_unlock(&USTAR_MOUNT_LOCK);
+            return false;
+        }
+        disk->fs_private = index;
+    }
+    index->mount_count++;
+    spinlock_unlock(&USTAR_MOUNT_LOCK);
+    return true;
+}
+
+// Free the index of a USTAR disk once it is not mounted anymore.
+// @param disk: The disk being unmounted.
+static void ustar_unmount(struct disk * const disk) {
+    spinlock_lock(&USTAR_MOUNT_LOCK);
+    struct ustar_index * const index = disk->fs_private;
+    ASSERT(index && index->mount_count);
+    bool const last = !--index->mount_count;
+    if (last) {
+        disk->fs_private = NULL;
+    }
+    spinlock_unlock(&USTAR_MOUNT_LOCK);
+
+    if (last) {
+        index_destroy(index);
     }
+}
 
+// Initialize the FS specific fields of a file on a USTAR filesystem.
+// @param disk: The disk the file is stored on.
+// @param file: The struct file to initialize.
+// @param file_offset: The offset of the USTAR header of the file on disk.
+// @return: FS_SUCCESS if the header was read, FS_NOT_FOUND otherwise.
+static enum fs_op_res ustar_init_opened_file(struct disk * const disk,
+                                             struct file * const file,
+                                             uint32_t const file_offset) {
     // Should have been done by caller.
     ASSERT(file->fs_relative_path);
     ASSERT(file->disk);
@@ -333,13 +622,53 @@ static enum fs_op_res ustar_open_file(struct disk * const disk,
         PANIC("Cannot allocate memory to open file\n");
     }
     data->header_offset = file_offset;
-    bool const success = read_header(disk, file_offset, &data->header);
-    ASSERT(success);
+    if (!read_header(disk, file_offset, &data->header)) {
+        kfree(data);
+        return FS_NOT_FOUND;
+    }
     file->fs_private = data;
+    file->fs_handle = file_offset;
 
     return FS_SUCCESS;
 }
 
+// Open a file on a USTAR filesystem.
+// @param disk: The disk to open the file from.
+// @param file: The struct file to initialize.
+// @param path: The full path of the file to be opened.
+// @return: A struct file for the opened file.
+static enum fs_op_res ustar_open_file(struct disk * const disk,
+                                      struct file * const file,
+                                      char const * const path) {
+    uint32_t file_offset = 0;
+    if (!find_file(disk, path, &file_offset)) {
+        return FS_NOT_FOUND;
+    }
+    enum fs_op_res const res = ustar_init_opened_file(disk, file, file_offset);
+    ASSERT(res == FS_SUCCESS);
+    return res;
+}
+
+// Open a file on a USTAR filesystem from the offset of its header, as found by
+// a previous ustar_open_file(). This avoids scanning the archive.
+// @param disk: The disk to open the file from.
+// @param file: The struct file to initialize.
+// @param path: The full path of the file to be opened.
+// @param handle: The offset of the header of the file on disk.
+// @return: A struct file for the opened file.
+static enum fs_op_res ustar_open_file_by_handle(struct disk * const disk,
+                                                struct file * const file,
+                                                char const * const path,
+                                                uint64_t const handle) {
+    ASSERT(handle <= (uint32_t)-1);
+    enum fs_op_res const res = ustar_init_opened_file(disk, file, handle);
+    if (res != FS_SUCCESS) {
+        // The header is not there anymore, fall back to a full lookup.
+        return ustar_open_file(disk, file, path);
+    }
+    return res;
+}
+
 // Close an opened file on a USTAR filesystem.
 // @param file: The file to be closed.
 static void ustar_close_file(struct file * const file) {
@@ -350,8 +679,11 @@ static void ustar_close_file(struct file * const file) {
 // The filesystem operations for a USTAR filesystem.
 struct fs_ops const ustar_fs_ops = {
     .detect_fs = ustar_detect_fs,
+    .mount = ustar_mount,
+    .unmount = ustar_unmount,
     .create_file = ustar_create_file,
     .open_file = ustar_open_file,
+    .open_file_by_handle = ustar_open_file_by_handle,
     .close_file = ustar_close_file,
     .delete_file = ustar_delete_file,
 };
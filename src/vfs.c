@@ -3,48 +3,115 @@
 #include <debug.h>
 #include <list.h>
 #include <spinlock.h>
+#include <rcu.h>
 #include <kmalloc.h>
+#include <kmem_cache.h>
 #include <string.h>
 #include <memory.h>
 #include <error.h>
 
 extern struct fs const ustar_fs;
+extern struct fs const extentfs_fs;
 
 // This array contains a pointer to the struct fs of each supported filesystem.
 // Upon mounting a new disk, VFS will lookup filesystem from this array to
 // detect which one is used on the disk.
 static struct fs const * const SUPPORTED_FS[] = {
     &ustar_fs,
+    &extentfs_fs,
 };
 
 // Describe a mount in VFS.
 struct mount {
-    // The path on which a disk is mounted.
+    // The path on which a disk is mounted. NULL if this entry of the mount
+    // table is unused.
     pathname_t mount_point;
+    // The length and hash of mount_point, so that comparisons against it can
+    // skip the string comparison when they differ.
+    size_t mount_point_len;
+    uint32_t mount_point_hash;
     // The disk mounted.
     struct disk * disk;
     // The filesystem used by the disk.
     struct fs const * fs;
-    // Linked list of struct mounts.
-    struct list_node mount_point_list;
 };
 
-// A linked list containing all mounts in VFS.
-static struct list_node MOUNTS;
-// A lock to protect the MOUNTS linked-list.
+// The maximum number of disks that can be mounted at the same time.
+#define MAX_MOUNTS  16
+
+// The mount table. Mounting and unmounting is rare while looking up the mount
+// of a file happens on every open, hence readers scan the table without any
+// lock, in an RCU read-side critical section. A struct mount is never modified
+// once published in the table: unmounting clears its slot and frees it after a
+// grace period. NULL slots are unused.
+static struct mount * MOUNTS[MAX_MOUNTS];
+// Serializes the writers of MOUNTS.
 static DECLARE_SPINLOCK(MOUNTS_LOCK);
+// The generation of the mount table, incremented each time it is modified.
+static atomic_t MOUNTS_GEN;
+
+// The number of entries of the path cache in each bucket of the opened file
+// table.
+#define PATH_CACHE_WAYS 2
+// The maximum length of a path, excluding the NUL char, that can be stored in
+// the path cache. Longer paths are never cached.
+#define PATH_CACHE_MAX_PATH_LEN 63
+
+// An entry of the path cache. The path cache remembers for recently opened
+// paths which mount they belong to and the filesystem's handle for the file so
+// that re-opening them after they were closed skips both the mount table scan
+// and the filesystem lookup.
+struct path_cache_entry {
+    // true if this entry is in use.
+    bool valid;
+    // The hash of `path`.
+    uint32_t hash;
+    // The generation of the mount table when the entry was filled. The entry
+    // is stale as soon as the mount table is modified.
+    uint32_t mounts_gen;
+    // A copy of the mount containing the path.
+    struct mount mount;
+    // The fs_handle of the file after the filesystem opened it.
+    uint64_t fs_handle;
+    // The absolute path of the file.
+    char path[PATH_CACHE_MAX_PATH_LEN + 1];
+};
 
-// A linked list of all the opened struct files * on the system. This linked
-// list is used to share struct file * between processes wishing to open the
-// same file. AKA Opened Files Linked List (OFLL).
-// TODO: Later on, this should be implemented as a hash map filename => file*.
-static struct list_node OPENED_FILES;
-// Lock for the OPENED_FILES list.
-static DECLARE_SPINLOCK(OPENED_FILES_LOCK);
+// A bucket of the opened file table.
+struct opened_files_bucket {
+    // Lock protecting both the list and the path cache of this bucket.
+    spinlock_t lock;
+    // The list of opened files whose path hashes to this bucket. Lookups
+    // traverse it under RCU, see list_for_each_entry_rcu(). This is not a
+    // counted_list: those have no RCU variants and the length of a bucket is
+    // never needed.
+    struct list_node files;
+    // Path cache entries for paths hashing to this bucket.
+    struct path_cache_entry path_cache[PATH_CACHE_WAYS];
+    // The index of the path cache entry to evict on the next insertion.
+    uint8_t path_cache_victim;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The number of buckets in the opened file table. Must be a power of two.
+#define OPENED_FILES_BUCKETS    64
+
+// The table of all the opened struct files * on the system, hashed by absolute
+// path. This table is used to share struct file * between processes wishing to
+// open the same file. Each bucket has its own lock so that opening/closing
+// unrelated files does not contend.
+static struct opened_files_bucket OPENED_FILES[OPENED_FILES_BUCKETS];
+
+// Object cache used to allocate the struct file.
+static DECLARE_KMEM_CACHE(FILE_CACHE, struct file, CACHE_LINE_SIZE, NULL);
 
 void init_vfs(void) {
-    list_init(&MOUNTS);
-    list_init(&OPENED_FILES);
+    memzero(MOUNTS, sizeof(MOUNTS));
+    atomic_init(&MOUNTS_GEN, 0);
+    memzero(OPENED_FILES, sizeof(OPENED_FILES));
+    for (uint32_t i = 0; i < OPENED_FILES_BUCKETS; ++i) {
+        spinlock_init(&OPENED_FILES[i].lock);
+        list_init(&OPENED_FILES[i].files);
+    }
 }
 
 // Detect the filesystem used on a disk.
@@ -72,160 +139,326 @@ static bool mount_target_is_valid(pathname_t const pathname) {
     return len && (pathname[0] == '/') && (pathname[len - 1] == '/');
 }
 
+// Call the mount() operation of a filesystem, if it has one.
+// @param fs: The filesystem.
+// @param disk: The disk being mounted.
+// @return: true on success, false otherwise.
+static bool fs_mount(struct fs const * const fs, struct disk * const disk) {
+    return !fs->ops->mount || fs->ops->mount(disk);
+}
+
+// Call the unmount() operation of a filesystem, if it has one.
+// @param fs: The filesystem.
+// @param disk: The disk being unmounted.
+static void fs_unmount(struct fs const * const fs, struct disk * const disk) {
+    if (fs->ops->unmount) {
+        fs->ops->unmount(disk);
+    }
+}
+
 bool vfs_mount(struct disk * const disk, pathname_t const target) {
     ASSERT(mount_target_is_valid(target));
-    struct mount * const mount = kmalloc(sizeof(*mount));
-    if (!mount) {
-        SET_ERROR("Cannot allocate memory to registers new mount", ENONE);
+
+    struct fs const * const fs = get_fs_for_disk(disk);
+    if (!fs) {
+        SET_ERROR("No filesystem implementation found", ENOFSIMPL);
         return false;
     }
 
-    mount->mount_point = target;
-    mount->disk = disk;
-    mount->fs = get_fs_for_disk(disk);
-    if (!mount->fs) {
-        SET_ERROR("No filesystem implementation found", ENOFSIMPL);
-        kfree(mount);
+    // The filesystem might allocate and read from disk, do it before taking
+    // the lock.
+    if (!fs_mount(fs, disk)) {
+        SET_ERROR("Filesystem failed to mount disk", ENONE);
+        return false;
+    }
+
+    struct mount * const new = kmalloc(sizeof(*new));
+    if (!new) {
+        fs_unmount(fs, disk);
+        SET_ERROR("Cannot allocate struct mount", ENONE);
         return false;
     }
-    list_init(&mount->mount_point_list);
+    new->mount_point = target;
+    new->mount_point_len = strlen(target);
+    new->mount_point_hash = str_hash(target);
+    new->disk = disk;
+    new->fs = fs;
 
     spinlock_lock(&MOUNTS_LOCK);
 
-    // Check that the desired target is not already used by another mount.
-    struct mount const * it = NULL;
-    list_for_each_entry(it, &MOUNTS, mount_point_list) {
-        if (streq(it->mount_point, target)) {
+    // Check that the desired target is not already used by another mount and
+    // find a free entry in the mount table.
+    struct mount ** free_entry = NULL;
+    for (uint32_t i = 0; i < MAX_MOUNTS; ++i) {
+        struct mount const * const mount = MOUNTS[i];
+        if (!mount) {
+            free_entry = free_entry ? free_entry : MOUNTS + i;
+        } else if (mount->mount_point_len == new->mount_point_len &&
+                   mount->mount_point_hash == new->mount_point_hash &&
+                   streq(mount->mount_point, target)) {
             spinlock_unlock(&MOUNTS_LOCK);
+            kfree(new);
+            fs_unmount(fs, disk);
             SET_ERROR("Mount point already mounted", EMOUNTED);
-            kfree(mount);
             return false;
         }
     }
 
-    list_add_tail(&MOUNTS, &mount->mount_point_list);
+    if (!free_entry) {
+        spinlock_unlock(&MOUNTS_LOCK);
+        kfree(new);
+        fs_unmount(fs, disk);
+        SET_ERROR("Mount table is full", ENONE);
+        return false;
+    }
+
+    rcu_assign_pointer(*free_entry, new);
+    atomic_inc(&MOUNTS_GEN);
     spinlock_unlock(&MOUNTS_LOCK);
     return true;
 }
 
 bool vfs_unmount(pathname_t const pathname) {
+    size_t const len = strlen(pathname);
+    uint32_t const hash = str_hash(pathname);
+
     spinlock_lock(&MOUNTS_LOCK);
 
-    struct mount * mount = NULL;
-    list_for_each_entry(mount, &MOUNTS, mount_point_list) {
-        if (streq(mount->mount_point, pathname)) {
-            break;
+    for (uint32_t i = 0; i < MAX_MOUNTS; ++i) {
+        struct mount * const mount = MOUNTS[i];
+        if (mount && mount->mount_point_len == len &&
+            mount->mount_point_hash == hash &&
+            streq(mount->mount_point, pathname)) {
+            rcu_assign_pointer(MOUNTS[i], NULL);
+            atomic_inc(&MOUNTS_GEN);
+            spinlock_unlock(&MOUNTS_LOCK);
+            // Readers might still be looking at the mount.
+            synchronize_rcu();
+            fs_unmount(mount->fs, mount->disk);
+            kfree(mount);
+            return true;
         }
     }
 
-    if (!list_size(&MOUNTS) || !mount) {
-        // This path was never mounted.
-        // Note: The list_size() check is necessary due to the fact that mount
-        // has an undefined value if the list if empty.
-        spinlock_unlock(&MOUNTS_LOCK);
-        SET_ERROR("Tried to unmount non mount point", ENOTMOUNTPOINT);
-        return false;
-    }
-
-    list_del(&mount->mount_point_list);
+    // This path was never mounted.
     spinlock_unlock(&MOUNTS_LOCK);
-
-    kfree(mount);
-    return true;
+    SET_ERROR("Tried to unmount non mount point", ENOTMOUNTPOINT);
+    return false;
 }
 
 // Check if a pathname is under a given mount.
 // @param mount: The mount.
 // @param filename: The pathname to test.
+// @param filename_len: The length of `filename`.
 // @return: If `filename` is under `mount` then the length of the common prefix
 // is returned. Otherwise 0.
 static size_t is_under_mount(struct mount const * const mount, 
-                             pathname_t const filename) {
-    size_t const mount_len = strlen(mount->mount_point);
-    size_t const filename_len = strlen(filename);
-
+                             pathname_t const filename,
+                             size_t const filename_len) {
+    size_t const mount_len = mount->mount_point_len;
     if (filename_len < mount_len) {
         // Filename is too short to be under mount.
         return 0;
     }
-
-    for (size_t i = 0; i < mount_len; ++i) {
-        if (mount->mount_point[i] != filename[i]) {
-            return 0;
-        }
-    }
-    return mount_len;
+    return strneq(mount->mount_point, filename, mount_len) ? mount_len : 0;
 }
 
-// Find which mount in the MOUNTS linked-list contains a given pathname.
+// Find which mount in the mount table contains a given pathname.
 // @param filename: The pathname for which the function should find the
 // associated mount.
-// @return: The mount containing the pathname, NULL if no such mount exists.
-static struct mount const *find_mount_for_file(pathname_t const filename) {
-    spinlock_lock(&MOUNTS_LOCK);
-
-    struct mount const * best_mount = NULL;
-    struct mount const * mount = NULL;
+// @param result: Output parameter, if a mount is found, it is copied into
+// this struct.
+// @return: true if a mount containing the pathname was found, false otherwise.
+static bool find_mount_for_file(pathname_t const filename,
+                                struct mount * const result) {
+    size_t const filename_len = strlen(filename);
+    bool found = false;
     size_t longest_common_prefix = 0;
 
-    list_for_each_entry(mount, &MOUNTS, mount_point_list) {
-        size_t const common = is_under_mount(mount, filename);
+    rcu_read_lock();
+    for (uint32_t i = 0; i < MAX_MOUNTS; ++i) {
+        struct mount const * const mount = rcu_dereference(MOUNTS[i]);
+        if (!mount) {
+            continue;
+        }
+        size_t const common = is_under_mount(mount, filename, filename_len);
         if (common > longest_common_prefix) {
             longest_common_prefix = common;
-            best_mount = mount;
+            *result = *mount;
+            found = true;
         }
     }
-
-    spinlock_unlock(&MOUNTS_LOCK);
-    return best_mount;
+    rcu_read_unlock();
+    return found;
 }
 
-// Opening/Closing files and the Opened Files Linked List (OFLL)
-// =============================================================
+// Opening/Closing files and the opened file table
+// ================================================
 //    When opening a file through vfs_open(), we first need to check if this
-// file is already opened by looking it up in the OFLL. The reason is that we
-// need to maintain the invariant that there is only ONE struct file* per
-// pathname, even if this file is opened in multiple processes concurrently.
-// When closing a file, care must be taken not to remove it from the OFLL if
+// file is already opened by looking it up in the opened file table. The reason
+// is that we need to maintain the invariant that there is only ONE struct file*
+// per pathname, even if this file is opened in multiple processes concurrently.
+// When closing a file, care must be taken not to remove it from the table if
 // another live process is still using it, this is implemented using a ref count
 // in the struct file (see open_ref_count field).
 //
 // There are two tricky scenarios:
 //   - A file is opened for the first time: We need to allocate its struct file*
-//   and insert it in the OFLL.
+//   and insert it in the table.
 //   - A file is being closed and no other process is using it: We need to
-//   remove it from the OFLL and free its associated struct file*.
-// Note that in both scenarios, we need to hold the OFLL's lock while
-// opening/closing the file. This is because another process might try to open
-// the same file concurrently and, if the opening operation is not in the OFLL's
-// lock critical section, we might end up with two struct file*.
+//   remove it from the table and free its associated struct file*.
+// Note that in both scenarios, we need to hold the lock of the file's bucket
+// while opening/closing the file. This is because another process might try to
+// open the same file concurrently and, if the opening operation is not in the
+// bucket's lock critical section, we might end up with two struct file*.
+// Since a path always hashes to the same bucket, files in different buckets
+// can be opened and closed in parallel.
+// Looking up an already opened file does not need the lock however: the bucket
+// is traversed in an RCU read-side critical section and a reference is taken
+// only if the file's ref count is not already 0, i.e. the file is not being
+// closed. Closed files are freed after a grace period.
+
+// Get the bucket of the opened file table for a path.
+// @param hash: The hash of the path, as computed by str_hash().
+// @return: The bucket.
+static struct opened_files_bucket *get_bucket(uint32_t const hash) {
+    return OPENED_FILES + (hash & (OPENED_FILES_BUCKETS - 1));
+}
+
+// Look up a path in the path cache.
+// @param bucket: The bucket of the path. Its lock must be held.
+// @param filename: The path to look up.
+// @param hash: The hash of `filename`.
+// @return: The entry for `filename` if it is present and not stale, NULL
+// otherwise.
+static struct path_cache_entry *path_cache_lookup(
+    struct opened_files_bucket * const bucket,
+    pathname_t const filename,
+    uint32_t const hash) {
+    ASSERT(spinlock_is_held(&bucket->lock));
+
+    uint32_t const gen = atomic_read(&MOUNTS_GEN);
+    for (uint32_t i = 0; i < PATH_CACHE_WAYS; ++i) {
+        struct path_cache_entry * const entry = bucket->path_cache + i;
+        if (!entry->valid || entry->hash != hash) {
+            continue;
+        } else if (entry->mounts_gen != gen) {
+            // The mount table changed since this entry was filled.
+            entry->valid = false;
+        } else if (streq(entry->path, filename)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Insert a path in the path cache, evicting an older entry if necessary.
+// @param bucket: The bucket of the path. Its lock must be held.
+// @param filename: The path to insert.
+// @param len: The length of `filename`.
+// @param hash: The hash of `filename`.
+// @param mount: The mount containing `filename`.
+// @param mounts_gen: The generation of the mount table read before looking up
+// `mount`.
+// @param fs_handle: The fs_handle of the file.
+static void path_cache_insert(struct opened_files_bucket * const bucket,
+                              pathname_t const filename,
+                              size_t const len,
+                              uint32_t const hash,
+                              struct mount const * const mount,
+                              uint32_t const mounts_gen,
+                              uint64_t const fs_handle) {
+    ASSERT(spinlock_is_held(&bucket->lock));
+
+    if (len > PATH_CACHE_MAX_PATH_LEN) {
+        return;
+    }
+
+    // Prefer a free entry over evicting a valid one.
+    struct path_cache_entry * entry = NULL;
+    for (uint32_t i = 0; i < PATH_CACHE_WAYS; ++i) {
+        if (!bucket->path_cache[i].valid) {
+            entry = bucket->path_cache + i;
+            break;
+        }
+    }
+    if (!entry) {
+        entry = bucket->path_cache + bucket->path_cache_victim;
+        bucket->path_cache_victim =
+            (bucket->path_cache_victim + 1) % PATH_CACHE_WAYS;
+    }
+
+    entry->valid = true;
+    entry->hash = hash;
+    entry->mounts_gen = mounts_gen;
+    entry->mount = *mount;
+    entry->fs_handle = fs_handle;
+    memcpy(entry->path, filename, len + 1);
+}
+
+// Remove a path from the path cache, if present.
+// @param bucket: The bucket of the path. Its lock must be held.
+// @param filename: The path to remove.
+// @param hash: The hash of `filename`.
+static void path_cache_invalidate(struct opened_files_bucket * const bucket,
+                                  pathname_t const filename,
+                                  uint32_t const hash) {
+    ASSERT(spinlock_is_held(&bucket->lock));
+
+    for (uint32_t i = 0; i < PATH_CACHE_WAYS; ++i) {
+        struct path_cache_entry * const entry = bucket->path_cache + i;
+        if (entry->valid && entry->hash == hash &&
+            streq(entry->path, filename)) {
+            entry->valid = false;
+        }
+    }
+}
 
 // Open a file.
 // @param filename: The absolute path of the file to be opened.
+// @param len: The length of `filename`.
+// @param hash: The hash of `filename`.
+// @param create: If true, the file is created on its filesystem if it does not
+// exist.
 // @return: The associated struct file*.
-static struct file *open_file(pathname_t const filename) {
+static struct file *open_file(pathname_t const filename,
+                              size_t const len,
+                              uint32_t const hash,
+                              bool const create) {
     // Per the explaination above.
-    ASSERT(spinlock_is_held(&OPENED_FILES_LOCK));
-
-    struct mount const * const mount = find_mount_for_file(filename);
-    if (!mount) {
-        SET_ERROR("Cannot find mount point for file", ENOTFOUND);
-        return NULL;
+    struct opened_files_bucket * const bucket = get_bucket(hash);
+    ASSERT(spinlock_is_held(&bucket->lock));
+
+    struct path_cache_entry const * const cached =
+        path_cache_lookup(bucket, filename, hash);
+
+    struct mount mount;
+    // Read the generation before looking up the mount so that a concurrent
+    // mount/unmount makes the new path cache entry stale instead of wrong.
+    uint32_t mounts_gen = 0;
+    if (cached) {
+        mount = cached->mount;
+    } else {
+        mounts_gen = atomic_read(&MOUNTS_GEN);
+        if (!find_mount_for_file(filename, &mount)) {
+            SET_ERROR("Cannot find mount point for file", ENOTFOUND);
+            return NULL;
+        }
     }
-    struct disk * const disk = mount->disk;
+    struct disk * const disk = mount.disk;
 
     // The filename passed as argument is short lived. Make a copy.
-    pathname_t const filename_cpy = memdup(filename, strlen(filename) + 1);
+    pathname_t const filename_cpy = memdup(filename, len + 1);
     if (!filename_cpy) {
         SET_ERROR("Cannot allocate memory for file name", ENONE);
         return NULL;
     }
     // Use the same string to represent the absolute and relative paths.
-    pathname_t const rel_path = filename_cpy + strlen(mount->mount_point);
+    pathname_t const rel_path = filename_cpy + mount.mount_point_len;
 
     // Allocate the file and initialize all the fields except for the FS
     // specific ones.
-    struct file * const file = kmalloc(sizeof(*file));
+    struct file * const file = kmem_cache_alloc(&FILE_CACHE);
     if (!file) {
         SET_ERROR("Cannot allocate struct file", ENONE);
         kfree((void*)filename_cpy);
@@ -233,40 +466,67 @@ static struct file *open_file(pathname_t const filename) {
     }
 
     file->abs_path = filename_cpy;
+    file->abs_path_len = len;
     file->fs_relative_path = rel_path;
     file->disk = disk;
+    file->fs = mount.fs;
+    file->fs_handle = 0;
+    file->path_hash = hash;
     list_init(&file->opened_files_ll);
     atomic_init(&file->open_ref_count, 1);
     rwlock_init(&file->lock);
+    page_cache_init(&file->page_cache);
 
     // Initialize FS specific fields.
+    struct fs_ops const * const ops = mount.fs->ops;
+    enum fs_op_res res;
     rwlock_write_lock(&file->lock);
-    enum fs_op_res const res = mount->fs->ops->open_file(disk, file, rel_path);
+    if (cached && ops->open_file_by_handle) {
+        res = ops->open_file_by_handle(disk, file, rel_path, cached->fs_handle);
+    } else {
+        res = ops->open_file(disk, file, rel_path);
+    }
+    if (res == FS_NOT_FOUND && create) {
+        res = ops->create_file(disk, file, rel_path);
+    }
     rwlock_write_unlock(&file->lock);
     if (res == FS_SUCCESS) {
+        if (!cached) {
+            path_cache_insert(bucket, filename, len, hash, &mount, mounts_gen,
+                              file->fs_handle);
+        }
         return file;
     } else {
         // abs_path and fs_relative_path are using the same string. Only one
         // free necessary for both.
         kfree((char*)file->abs_path);
-        kfree(file);
+        kmem_cache_free(&FILE_CACHE, file);
         SET_ERROR("Cannot find file on filesystem", ENOTFOUND);
         return NULL;
     }
 }
 
-// Lookup a file into the OFLL.
+// Lookup a file into the opened file table.
 // @param filename: The absolute path of the file to lookup.
-// @return: If the file is present in the list, this function returns the struct
-// file* associated with it. Else return NULL.
-static struct file *lookup_file(pathname_t const filename) {
-    // Per the explaination above.
-    ASSERT(spinlock_is_held(&OPENED_FILES_LOCK));
+// @param len: The length of `filename`.
+// @param hash: The hash of `filename`.
+// @return: If the file is present in the table, this function returns the
+// struct file* associated with it. Else return NULL.
+// Note: The caller must either hold the lock of the file's bucket or be in an
+// RCU read-side critical section. In the latter case the file might be closing
+// concurrently.
+static struct file *lookup_file(pathname_t const filename,
+                                size_t const len,
+                                uint32_t const hash) {
+    struct opened_files_bucket * const bucket = get_bucket(hash);
 
     bool found = false;
     struct file * it;
-    list_for_each_entry(it, &OPENED_FILES, opened_files_ll) {
-        if (streq(it->abs_path, filename)) {
+    list_for_each_entry_rcu(it, &bucket->files, opened_files_ll) {
+        // Both the hash and the length must match before comparing the
+        // strings, and only `len` bytes need comparing then.
+        if (it->path_hash == hash && it->abs_path_len == len &&
+            strneq(it->abs_path, filename, len)) {
             // This file has already been opened.
             found = true;
             break;
@@ -275,70 +535,105 @@ static struct file *lookup_file(pathname_t const filename) {
     return found ? it : NULL;
 }
 
-// Look up a file in the OFLL or open the file and insert it into the list.
+// Look up a file in the opened file table or open the file and insert it into
+// the table.
 // @param filename: The absolute path of the file to look up/open.
+// @param create: If true, the file is created if it does not exist.
 // @return: The struct file* associated with `filename`.
-static struct file *lookup_file_or_open(pathname_t const filename) {
-    spinlock_lock(&OPENED_FILES_LOCK);
+static struct file *lookup_file_or_open(pathname_t const filename,
+                                        bool const create) {
+    uint32_t const hash = str_hash(filename);
+    size_t const len = strlen(filename);
+    struct opened_files_bucket * const bucket = get_bucket(hash);
+
+    // Fast path: the file is already opened and not being closed.
+    rcu_read_lock();
+    struct file *file = lookup_file(filename, len, hash);
+    if (file && atomic_inc_not_zero(&file->open_ref_count)) {
+        rcu_read_unlock();
+        return file;
+    }
+    rcu_read_unlock();
 
-    struct file *file = lookup_file(filename);
+    spinlock_lock(&bucket->lock);
+
+    file = lookup_file(filename, len, hash);
     if (file) {
         // File was already opened, we can return now.
         atomic_inc(&file->open_ref_count);
-        spinlock_unlock(&OPENED_FILES_LOCK);
+        spinlock_unlock(&bucket->lock);
         return file;
     }
 
-    // Open file and insert it into the OFLL.
-    file = open_file(filename);
+    // Open file and insert it into the table.
+    file = open_file(filename, len, hash, create);
     if (!file) {
         // Could not open the file.
-        spinlock_unlock(&OPENED_FILES_LOCK);
+        spinlock_unlock(&bucket->lock);
         return NULL;
     }
 
-    list_add(&OPENED_FILES, &file->opened_files_ll);
+    list_add_rcu(&bucket->files, &file->opened_files_ll);
 
-    spinlock_unlock(&OPENED_FILES_LOCK);
+    spinlock_unlock(&bucket->lock);
     return file;
 }
 
 struct file *vfs_open(pathname_t const filename) {
-    return lookup_file_or_open(filename);
+    return lookup_file_or_open(filename, false);
+}
+
+struct file *vfs_create(pathname_t const filename) {
+    return lookup_file_or_open(filename, true);
 }
 
-// Close a file. This function must be called on a file that is NOT in the OFLL.
+// Free a closed file after a grace period.
+// @param head: The rcu_head of the file.
+static void free_file_rcu(struct rcu_head * const head) {
+    struct file * const file = list_entry(head, struct file, rcu);
+    // abs_path and fs_relative_path are using the same string. Only one free
+    // necessary for both.
+    kfree((char*)file->abs_path);
+    kmem_cache_free(&FILE_CACHE, file);
+}
+
+// Close a file. This function must be called on a file that is NOT in the
+// opened file table.
 // @param file: The file to be closed.
 static void close_file(struct file * const file) {
     // Per the explaination above.
-    ASSERT(spinlock_is_held(&OPENED_FILES_LOCK));
-
-    // The file should be removed from the OFLL before being freed.
-    ASSERT(!lookup_file(file->abs_path));
+    ASSERT(spinlock_is_held(&get_bucket(file->path_hash)->lock));
 
-    struct mount const * const mount = find_mount_for_file(file->abs_path);
-    ASSERT(mount);
+    // The file should be removed from the table before being freed.
+    ASSERT(!lookup_file(file->abs_path, file->abs_path_len, file->path_hash));
 
     rwlock_write_lock(&file->lock);
-    mount->fs->ops->close_file(file);
+    file->fs->ops->close_file(file);
     rwlock_write_unlock(&file->lock);
 
-    // abs_path and fs_relative_path are using the same string. Only one free
-    // necessary for both.
-    kfree((char*)file->abs_path);
+    page_cache_destroy(&file->page_cache);
+
+    // Lock-free lookups might still be comparing the path of the file.
+    call_rcu(&file->rcu, free_file_rcu);
+}
 
-    kfree(file);
+void vfs_file_get(struct file * const file) {
+    // The caller already holds a reference, the file cannot be closed
+    // concurrently.
+    ASSERT(atomic_read(&file->open_ref_count) > 0);
+    atomic_inc(&file->open_ref_count);
 }
 
 void vfs_close(struct file * const file) {
-    spinlock_lock(&OPENED_FILES_LOCK);
+    struct opened_files_bucket * const bucket = get_bucket(file->path_hash);
+    spinlock_lock(&bucket->lock);
     if (atomic_dec_and_test(&file->open_ref_count)) {
         // This was the last instance of this file. We can now actually close
-        // the file and remove it from the OFLL.
-        list_del(&file->opened_files_ll);
+        // the file and remove it from the table.
+        list_del_rcu(&file->opened_files_ll);
         close_file(file);
     }
-    spinlock_unlock(&OPENED_FILES_LOCK);
+    spinlock_unlock(&bucket->lock);
 }
 
 size_t vfs_read(struct file * const file,
@@ -346,7 +641,19 @@ size_t vfs_read(struct file * const file,
                 uint8_t * const buf,
                 size_t const len) {
     rwlock_read_lock(&file->lock);
-    size_t const res = file->ops->read(file, offset, buf, len);
+    size_t const res = page_cache_read(file, offset, buf, len);
+    rwlock_read_unlock(&file->lock);
+    return res;
+}
+
+size_t vfs_read_ahead(struct file * const file,
+                      struct read_ahead * const ra,
+                      off_t const offset,
+                      uint8_t * const buf,
+                      size_t const len) {
+    rwlock_read_lock(&file->lock);
+    page_cache_read_ahead(file, ra, offset, len);
+    size_t const res = page_cache_read(file, offset, buf, len);
     rwlock_read_unlock(&file->lock);
     return res;
 }
@@ -357,19 +664,46 @@ size_t vfs_write(struct file * const file,
                  size_t const len) {
     rwlock_write_lock(&file->lock);
     size_t const res = file->ops->write(file, offset, buf, len);
+    page_cache_write(file, offset, buf, res);
     rwlock_write_unlock(&file->lock);
     return res;
 }
 
-void vfs_delete(pathname_t const filename) {
-    struct mount const * const mount = find_mount_for_file(filename);
+void *vfs_get_page(struct file * const file,
+                   uint32_t const page_idx,
+                   uint32_t * const len) {
+    rwlock_read_lock(&file->lock);
+    void * const frame = page_cache_get(file, page_idx, len);
+    rwlock_read_unlock(&file->lock);
+    return frame;
+}
+
+void const *vfs_mmap_readonly(struct file * const file,
+                              off_t const offset,
+                              size_t const len) {
+    if (!file->ops->map_readonly) {
+        return NULL;
+    }
+    // The FS private data is only modified while opening and closing, which
+    // cannot happen concurrently since the caller holds a reference.
+    return file->ops->map_readonly(file, offset, len);
+}
 
-    if (!mount) {
+void vfs_delete(pathname_t const filename) {
+    // The file's handle might not be valid anymore after the deletion.
+    uint32_t const hash = str_hash(filename);
+    struct opened_files_bucket * const bucket = get_bucket(hash);
+    spinlock_lock(&bucket->lock);
+    path_cache_invalidate(bucket, filename, hash);
+    spinlock_unlock(&bucket->lock);
+
+    struct mount mount;
+    if (!find_mount_for_file(filename, &mount)) {
         PANIC("Cannot find mount point for file %s\n", filename);
     }
 
-    pathname_t const rel_name = filename + strlen(mount->mount_point);
-    return mount->fs->ops->delete_file(mount->disk, rel_name);
+    pathname_t const rel_name = filename + mount.mount_point_len;
+    return mount.fs->ops->delete_file(mount.disk, rel_name);
 }
 
 #include <vfs.test>
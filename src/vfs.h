@@ -1,5 +1,6 @@
 #pragma once
 #include <disk.h>
+#include <page_cache.h>
 #include <types.h>
 
 // This file contains VFS (Virtual File System) related functions. Note that
@@ -31,6 +32,18 @@ bool vfs_unmount(pathname_t const pathname);
 // file is found, NULL is returned instead.
 struct file *vfs_open(pathname_t const filename);
 
+// Open a file from VFS, creating it if it does not exist. This requires the
+// filesystem of the file to support the create_file() operation.
+// @param filename: The absolute path of the file to be opened or created.
+// @return: The struct file * associated with the file, NULL if it could not be
+// created.
+struct file *vfs_create(pathname_t const filename);
+
+// Take an additional reference on an opened file. The reference must be dropped
+// using vfs_close().
+// @param file: The file.
+void vfs_file_get(struct file * const file);
+
 // Close an opened file.
 // @param file: The file to be closed.
 void vfs_close(struct file * const file);
@@ -46,6 +59,20 @@ size_t vfs_read(struct file * const file,
                 uint8_t * const buf,
                 size_t const len);
 
+// Read from a file through a file descriptor, prefetching the data following
+// the read if the reads of the descriptor are sequential, see page_cache.h.
+// @param file: The file to read from.
+// @param ra: The read-ahead state of the file descriptor.
+// @param offset: The offset at which the read should be performed in the file.
+// @param buf: The buffer to read into.
+// @param len: The length in bytes of the read/buffer.
+// @return: The number of bytes successfully read into buf.
+size_t vfs_read_ahead(struct file * const file,
+                      struct read_ahead * const ra,
+                      off_t const offset,
+                      uint8_t * const buf,
+                      size_t const len);
+
 // Write to a file.
 // @param file: The file to write into.
 // @param offset: The offset at which the write should be performed in the file.
@@ -57,6 +84,37 @@ size_t vfs_write(struct file * const file,
                  uint8_t const * const buf,
                  size_t const len);
 
+// Get the frame of the page cache holding a page of a file, reading the page
+// from the filesystem if it is not cached yet. The frame is shared by all the
+// openers of the file and writes to the file are reflected in it.
+// @param file: The file.
+// @param page_idx: The index of the page within the file, i.e. its offset
+// divided by PAGE_SIZE.
+// @param len: Output parameter set to the number of bytes of the page that are
+// part of the file. The rest of the frame is zeroed.
+// @return: The physical address of the frame, with a reference taken on behalf
+// of the caller which must be dropped with free_frame(). NO_FRAME if the page
+// is past the end of the file or cannot be cached.
+void *vfs_get_page(struct file * const file,
+                   uint32_t const page_idx,
+                   uint32_t * const len);
+
+// Get a pointer to the content of a file in memory, avoiding any copy. This is
+// only possible for files whose data already resides in memory, e.g. files on
+// the initrd, callers must fall back to vfs_read() when NULL is returned.
+// @param file: The file. The caller must hold a reference on the file as long
+// as it uses the returned pointer.
+// @param offset: The offset of the first byte to access within the file.
+// @param len: The number of bytes to access.
+// @return: The address of the byte at `offset` in the file, the following
+// len - 1 bytes are accessible too. NULL if the file does not support direct
+// access or the range is out of the bounds of the file.
+// Note: The memory is never modified through this pointer but concurrent
+// vfs_write() on the file are visible through it.
+void const *vfs_mmap_readonly(struct file * const file,
+                              off_t const offset,
+                              size_t const len);
+
 // Delete a file.
 // @param filename: The absolute path of the file to be deleted.
 void vfs_delete(pathname_t const filename);
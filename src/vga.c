@@ -1,6 +1,7 @@
 #include <vga.h>
 #include <memory.h>
 #include <kernel_map.h>
+#include <debug.h>
 
 #define VGA_DEFAULT_MATRIX_ADDR 0xB8000
 
@@ -13,6 +14,10 @@ static uint16_t * MATRIX_ADDR = (uint16_t*)VGA_DEFAULT_MATRIX_ADDR;
 static uint8_t VGA_WIDTH = 80;
 static uint8_t VGA_HEIGHT = 25;
 
+// The maximum width and height of the VGA text matrix.
+#define VGA_MAX_WIDTH   80
+#define VGA_MAX_HEIGHT  25
+
 // The VGA text mode color codes. These can be used both for foreground and
 // background colors.
 enum color_t {
@@ -67,7 +72,63 @@ static char_t create_char(unsigned char const chr, color_desc_t const color) {
     return chr | (color << 8);
 }
 
-// Put a VGA character in the VGA matrix at given coordinates.
+// Shadow buffer
+// =============
+//    The VGA matrix is uncached MMIO, hence writing to it is slow. All writes
+// go to a shadow copy of the matrix in normal memory instead, and the rows that
+// changed are copied to the VGA matrix in bulk by flush_dirty_rows() at the
+// end of each write to the stream.
+// The rows of the shadow buffer form a ring: scrolling up only moves the index
+// of the top row and clears the new bottom row, without moving the other rows.
+// Every row of the VGA matrix needs to be rewritten after a scroll though.
+
+// The shadow buffer. Row y of the screen is the row (TOP_ROW + y) % VGA_HEIGHT
+// of this buffer, each row being VGA_WIDTH cells.
+static char_t SHADOW[VGA_MAX_WIDTH * VGA_MAX_HEIGHT];
+// The row of SHADOW containing the top row of the screen.
+static uint8_t TOP_ROW = 0;
+// Bit y is set if row y of the screen changed since the last flush.
+static uint32_t DIRTY_ROWS = 0;
+STATIC_ASSERT(VGA_MAX_HEIGHT <= 32, "DIRTY_ROWS too small for VGA_MAX_HEIGHT");
+
+// Get a row of the screen in the shadow buffer.
+// @param y: The row of the screen.
+// @return: The address of the first cell of the row in the shadow buffer.
+static char_t *shadow_row(uint8_t const y) {
+    return SHADOW + ((TOP_ROW + y) % VGA_HEIGHT) * VGA_WIDTH;
+}
+
+// Get a cell of the screen in the shadow buffer.
+// @param idx: The linear index of the cell on the screen.
+// @return: The address of the cell in the shadow buffer.
+static char_t *shadow_cell(uint16_t const idx) {
+    return shadow_row(idx / VGA_WIDTH) + idx % VGA_WIDTH;
+}
+
+// Copy the dirty rows of the shadow buffer to the VGA matrix. Consecutive
+// dirty rows that are also consecutive in the shadow buffer are copied at
+// once.
+static void flush_dirty_rows(void) {
+    uint8_t y = 0;
+    while (y < VGA_HEIGHT) {
+        if (!(DIRTY_ROWS & (1U << y))) {
+            y++;
+            continue;
+        }
+        uint8_t end = y + 1;
+        while (end < VGA_HEIGHT && (DIRTY_ROWS & (1U << end)) &&
+               shadow_row(end) == shadow_row(end - 1) + VGA_WIDTH) {
+            end++;
+        }
+        size_t const size = (end - y) * VGA_WIDTH * sizeof(char_t);
+        memcpy(MATRIX_ADDR + y * VGA_WIDTH, shadow_row(y), size);
+        y = end;
+    }
+    DIRTY_ROWS = 0;
+}
+
+// Put a VGA character in the VGA matrix at given coordinates. The character
+// reaches the VGA matrix on the next flush_dirty_rows().
 // @param c: The VGA character to output.
 // @param x: The x coordinate in the matrix to output the character to.
 // @param y: The y coordinate in the matrix to output the character to.
@@ -77,13 +138,8 @@ static void put_char_at(char_t const c, uint8_t const x, uint8_t const y) {
         // Bogus coordinates. Do nothing.
         return;
     }
-    // The VGA matrix is a single array in the memory, thus we have to compute
-    // the linear index corresponding to the position (x, y).
-    uint16_t const linear_idx = x + y * VGA_WIDTH;
-    // We assume that the VGA buffer stays at the same address after setting up
-    // paging. This can be done using idempotent mapping for this memory area.
-    uint16_t* const vga_buf = MATRIX_ADDR;
-    vga_buf[linear_idx] = c;
+    shadow_row(y)[x] = c;
+    DIRTY_ROWS |= 1U << y;
 }
 
 // Clear the VGA matrix with a black color.
@@ -91,7 +147,10 @@ static void clear_matrix(void) {
     // Memseting the matrix to 0 works as it describes a black foreground on a
     // black background with a \0 char.
     size_t const matrix_size = VGA_WIDTH * VGA_HEIGHT * 2;
+    memzero((uint8_t*)SHADOW, matrix_size);
     memzero((uint8_t*)MATRIX_ADDR, matrix_size);
+    TOP_ROW = 0;
+    DIRTY_ROWS = 0;
 }
 
 // We use a linear indexing of the VGA matrix. In memory the matrix is
@@ -104,23 +163,18 @@ static uint16_t cursor = 0;
 
 // Scroll up the content of the VGA matrix.
 static void scroll_up(void) {
-    // Memcpy from the second row to the first row. In total we copy the
-    // entirety of the matrix minus one row.
-    uint16_t * const dst = MATRIX_ADDR;
-    uint16_t const * const src = MATRIX_ADDR + VGA_WIDTH;
-    size_t const cpy_size = VGA_WIDTH * (VGA_HEIGHT - 1) * 2;
-    memcpy(dst, src, cpy_size);
-
-    // Clear the last line to avoid leaving garbage behind.
-    uint16_t * const last_row = MATRIX_ADDR + VGA_WIDTH * (VGA_HEIGHT - 1);
-    size_t const row_size = VGA_WIDTH * 2;
-    memzero((uint8_t*)last_row, row_size);
+    // The old top row becomes the new bottom row, clear it to avoid leaving
+    // garbage behind.
+    TOP_ROW = (TOP_ROW + 1) % VGA_HEIGHT;
+    memzero((uint8_t*)shadow_row(VGA_HEIGHT - 1), VGA_WIDTH * 2);
+    // All the rows moved on the screen.
+    DIRTY_ROWS = (1U << VGA_HEIGHT) - 1;
 }
 
 // Handle a new line character coming to the VGA input stream.
 static void handle_newline(void) {
     // A newline is simply setting the cursor to the next multiple of VGA_WIDTH.
-    if (cursor > 0 && cursor % VGA_WIDTH == 0 && MATRIX_ADDR[cursor-1]) {
+    if (cursor > 0 && cursor % VGA_WIDTH == 0 && *shadow_cell(cursor - 1)) {
         // The cursor is on the beginning of a new line which hapenned because
         // of a line wrap. In this case we can silently drop the newline
         // character as the string printed fits exactly in one row.
@@ -164,7 +218,8 @@ static void handle_char(char const chr) {
         }
         color_desc_t const clr = create_color_desc(LIGHT_GREY, BLACK);
         char_t const vga_char = create_char(chr, clr);
-        MATRIX_ADDR[cursor] = vga_char;
+        *shadow_cell(cursor) = vga_char;
+        DIRTY_ROWS |= 1U << (cursor / VGA_WIDTH);
         // Move the cursor to the right.
         cursor ++;
     }
@@ -180,6 +235,7 @@ static size_t stream_write(uint8_t const * const buf, size_t const length) {
     for (size_t i = 0; i < length; i++) {
         handle_char(buf[i]);
     }
+    flush_dirty_rows();
     return length;
 }
 
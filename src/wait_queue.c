@@ -0,0 +1,79 @@
+#include <wait_queue.h>
+#include <memory.h>
+#include <debug.h>
+
+void wait_queue_init(struct wait_queue * const wq) {
+    spinlock_init(&wq->lock);
+    list_init(&wq->waiters);
+}
+
+void wait_queue_prepare(struct wait_queue * const wq,
+                        struct wait_queue_entry * const entry,
+                        bool const first) {
+    if (first) {
+        entry->proc = get_curr_proc();
+        list_init(&entry->node);
+    }
+
+    // The process must be marked as blocking while holding the lock, so that
+    // a waker removing it from the queue sees it as blocking.
+    spinlock_lock(&wq->lock);
+    if (list_empty(&entry->node)) {
+        // Either the first call or the process has been woken up and removed
+        // from the queue but the condition did not hold.
+        list_add_tail(&wq->waiters, &entry->node);
+    }
+    sched_prepare_block();
+    spinlock_unlock(&wq->lock);
+}
+
+void wait_queue_finish(struct wait_queue * const wq,
+                       struct wait_queue_entry * const entry) {
+    spinlock_lock(&wq->lock);
+    if (!list_empty(&entry->node)) {
+        list_del(&entry->node);
+    }
+    spinlock_unlock(&wq->lock);
+    sched_finish_block();
+}
+
+// Remove the first waiter of a wait queue and wake it up. The lock of the queue
+// must be held.
+// @param wq: The wait queue.
+// @return: true if a process was woken up, false if the queue was empty.
+static bool wake_up_first(struct wait_queue * const wq) {
+    ASSERT(spinlock_is_held(&wq->lock));
+    if (list_empty(&wq->waiters)) {
+        return false;
+    }
+    struct wait_queue_entry * const entry =
+        list_first_entry(&wq->waiters, struct wait_queue_entry, node);
+    // The entry is on the stack of the process, read it before waking it up.
+    struct proc * const proc = entry->proc;
+    list_del(&entry->node);
+    sched_wake_up_proc(proc);
+    return true;
+}
+
+bool wake_up(struct wait_queue * const wq) {
+    spinlock_lock(&wq->lock);
+    bool const res = wake_up_first(wq);
+    spinlock_unlock(&wq->lock);
+    return res;
+}
+
+uint32_t wake_up_all(struct wait_queue * const wq) {
+    uint32_t n = 0;
+    spinlock_lock(&wq->lock);
+    while (wake_up_first(wq)) {
+        n ++;
+    }
+    spinlock_unlock(&wq->lock);
+    return n;
+}
+
+bool wait_queue_has_waiters(struct wait_queue * const wq) {
+    return !list_empty(&wq->waiters);
+}
+
+#include <wait_queue.test>
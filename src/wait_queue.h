@@ -0,0 +1,110 @@
+#pragma once
+#include <spinlock.h>
+#include <list.h>
+#include <sched.h>
+
+// Wait queues.
+//     A wait queue is a list of processes waiting for an event. Instead of
+// spinning until a condition becomes true, a process adds itself to the queue
+// and blocks, giving its cpu to other processes. The code making the condition
+// true then wakes up the processes on the queue:
+//
+//  Waiter:                             Waker:
+//      wait_event(&wq, cond);              cond = true;
+//                                          wake_up(&wq);
+//
+// A waiter always re-checks the condition after being woken up, hence spurious
+// wake-ups are harmless. In contexts that cannot block (see sched_can_block()),
+// wait_event() busy-waits on the condition instead. Waking up a queue is
+// allowed from any context, including interrupt handlers.
+struct wait_queue {
+    // Protects the list of waiters.
+    spinlock_t lock;
+    // The struct wait_queue_entry of the waiting processes, in the order they
+    // started to wait.
+    struct list_node waiters;
+};
+
+// A waiting process. This lives on the stack of the waiting process.
+struct wait_queue_entry {
+    // The waiting process.
+    struct proc * proc;
+    // The node in the waiters list of the queue. The entry is not in the queue
+    // iff this node is a singleton.
+    struct list_node node;
+};
+
+#define INIT_WAIT_QUEUE(name)                                       \
+    {                                                               \
+        .lock = INIT_SPINLOCK(),                                    \
+        .waiters = { .next = &(name).waiters, .prev = &(name).waiters }, \
+    }
+
+#define DECLARE_WAIT_QUEUE(name) \
+    struct wait_queue name = INIT_WAIT_QUEUE(name)
+
+// Initialize a wait queue.
+// @param wq: The wait queue to initialize.
+void wait_queue_init(struct wait_queue * const wq);
+
+// Add the current process to a wait queue, if it is not already in it, and mark
+// it as blocking. This must be followed by a call to wait_queue_finish().
+// @param wq: The wait queue.
+// @param entry: The entry of the current process. Initialized by this function
+// on the first call.
+// @param first: true on the first call for this entry, false otherwise.
+void wait_queue_prepare(struct wait_queue * const wq,
+                        struct wait_queue_entry * const entry,
+                        bool const first);
+
+// Remove the current process from a wait queue, if it is still in it, and mark
+// it as not blocking.
+// @param wq: The wait queue.
+// @param entry: The entry of the current process.
+void wait_queue_finish(struct wait_queue * const wq,
+                       struct wait_queue_entry * const entry);
+
+// Wait until a condition becomes true. The condition is evaluated each time the
+// process is woken up, it must therefore be free of side effects unless those
+// are intended to happen once the condition is true (e.g. a trylock).
+// @param wq: The wait queue on which the process waits.
+// @param cond: The condition.
+#define wait_event(wq, cond)                                        \
+    do {                                                            \
+        if (!sched_can_block()) {                                   \
+            while (!(cond)) {                                       \
+                cpu_pause();                                        \
+            }                                                       \
+            break;                                                  \
+        }                                                           \
+        struct wait_queue_entry __wq_entry;                         \
+        bool __wq_first = true;                                     \
+        while (true) {                                              \
+            wait_queue_prepare((wq), &__wq_entry, __wq_first);      \
+            __wq_first = false;                                     \
+            if (cond) {                                             \
+                break;                                              \
+            }                                                       \
+            schedule();                                             \
+        }                                                           \
+        wait_queue_finish((wq), &__wq_entry);                       \
+    } while (0)
+
+// Wake up the first process waiting on a wait queue.
+// @param wq: The wait queue.
+// @return: true if a process was woken up, false if the queue was empty.
+bool wake_up(struct wait_queue * const wq);
+
+// Wake up all the processes waiting on a wait queue.
+// @param wq: The wait queue.
+// @return: The number of processes woken up.
+uint32_t wake_up_all(struct wait_queue * const wq);
+
+// Check if any process is waiting on a wait queue. This is racy by nature, a
+// process might start waiting right after this function returned false.
+// @param wq: The wait queue.
+// @return: true if at least one process is in the queue.
+bool wait_queue_has_waiters(struct wait_queue * const wq);
+
+// Execute the tests of wait queues.
+void wait_queue_test(void);
@@ -0,0 +1,193 @@
+#include <workqueue.h>
+#include <spinlock.h>
+#include <percpu.h>
+#include <acpi.h>
+#include <sched.h>
+#include <debug.h>
+
+// The pool of work items of a cpu.
+struct worker_pool {
+    // Protects the queue.
+    spinlock_t lock;
+    // The pending work items, in the order they were queued.
+    struct list_node works;
+    // The worker waits on this queue while there is no work.
+    struct wait_queue wq;
+    // The processes waiting in flush_workqueue() for this pool.
+    struct wait_queue flushers;
+    // The worker of the pool, NULL if not started.
+    struct proc * worker;
+    // The number of items executed by the pool so far.
+    uint64_t executed;
+};
+
+DECLARE_PER_CPU(struct worker_pool, worker_pool);
+
+void work_init(struct work * const work,
+               void (*func)(void*),
+               void * const arg) {
+    list_init(&work->node);
+    work->func = func;
+    work->arg = arg;
+    atomic_init(&work->pending, 0);
+    work->cpu = 0;
+}
+
+bool queue_work(uint8_t const cpu, struct work * const work) {
+    ASSERT(cpu < acpi_get_number_cpus());
+    // Claiming the pending flag first guarantees that the item is queued in
+    // at most one pool.
+    if (atomic_compare_and_exchange(&work->pending, 0, 1)) {
+        return false;
+    }
+    struct worker_pool * const pool = &cpu_var(worker_pool, cpu);
+    spinlock_lock(&pool->lock);
+    work->cpu = cpu;
+    list_add_tail(&pool->works, &work->node);
+    spinlock_unlock(&pool->lock);
+    wake_up(&pool->wq);
+    return true;
+}
+
+bool cancel_work(struct work * const work) {
+    if (!atomic_read(&work->pending)) {
+        return false;
+    }
+    struct worker_pool * const pool = &cpu_var(worker_pool, work->cpu);
+    spinlock_lock(&pool->lock);
+    // The item might have been dequeued by the worker in the meantime, or
+    // claimed but not yet added to the queue by queue_work().
+    bool const queued = atomic_read(&work->pending) &&
+        !list_empty(&work->node);
+    if (queued) {
+        list_del(&work->node);
+        atomic_write(&work->pending, 0);
+    }
+    spinlock_unlock(&pool->lock);
+    return queued;
+}
+
+bool work_pending(struct work const * const work) {
+    return atomic_read((atomic_t*)&work->pending);
+}
+
+// Execute all the work items of a pool, including those queued while doing so.
+// @param pool: The pool.
+// @return: The number of items executed.
+static uint32_t run_works(struct worker_pool * const pool) {
+    uint32_t n = 0;
+    while (true) {
+        spinlock_lock(&pool->lock);
+        if (list_empty(&pool->works)) {
+            spinlock_unlock(&pool->lock);
+            break;
+        }
+        struct work * const work =
+            list_first_entry(&pool->works, struct work, node);
+        list_del(&work->node);
+        // Read the item before it can be re-queued or freed.
+        void (*func)(void*) = work->func;
+        void * const arg = work->arg;
+        atomic_write(&work->pending, 0);
+        pool->executed ++;
+        spinlock_unlock(&pool->lock);
+
+        func(arg);
+        n ++;
+    }
+    return n;
+}
+
+// The code of the worker of a pool.
+// @param arg: The pool.
+static void worker_code(void * const arg) {
+    struct worker_pool * const pool = arg;
+    while (true) {
+        wait_event(&pool->wq, !list_empty(&pool->works));
+        run_works(pool);
+    }
+}
+
+// A barrier queued by flush_workqueue(). This lives on the stack of the
+// flushing process.
+struct flush_barrier {
+    struct work work;
+    // Set once the barrier has been executed.
+    bool volatile done;
+    // The flushers queue of the pool.
+    struct wait_queue * flushers;
+};
+
+// Execute a flush barrier.
+// @param arg: The barrier.
+static void flush_barrier_func(void * const arg) {
+    struct flush_barrier * const barrier = arg;
+    // The flusher might return as soon as done is set, the barrier must not be
+    // accessed after that.
+    struct wait_queue * const flushers = barrier->flushers;
+    barrier->done = true;
+    wake_up_all(flushers);
+}
+
+void flush_workqueue(uint8_t const cpu) {
+    struct worker_pool * const pool = &cpu_var(worker_pool, cpu);
+    struct flush_barrier barrier;
+    work_init(&barrier.work, flush_barrier_func, &barrier);
+    barrier.done = false;
+    barrier.flushers = &pool->flushers;
+    queue_work(cpu, &barrier.work);
+    // Other flushers of the pool might wake up this process before its barrier
+    // is done, wait_event() handles such spurious wake-ups.
+    wait_event(&pool->flushers, barrier.done);
+}
+
+bool workqueue_has_worker(uint8_t const cpu) {
+    return cpu_var(worker_pool, cpu).worker != NULL;
+}
+
+void init_workqueues(void) {
+    for (uint8_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+        struct worker_pool * const pool = &cpu_var(worker_pool, cpu);
+        spinlock_init(&pool->lock);
+        list_init(&pool->works);
+        wait_queue_init(&pool->wq);
+        wait_queue_init(&pool->flushers);
+        pool->worker = NULL;
+        pool->executed = 0;
+    }
+}
+
+bool workqueue_start_workers(void) {
+    for (uint8_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+        struct worker_pool * const pool = &cpu_var(worker_pool, cpu);
+        ASSERT(!pool->worker);
+        struct proc * const worker = create_kproc(worker_code, pool);
+        if (!worker) {
+            WARN("Cannot create worker for cpu %u\n", cpu);
+            workqueue_stop_workers();
+            return false;
+        }
+        // The schedulers with per-cpu runqueues enqueue a process on the cpu
+        // it last ran on.
+        worker->cpu = cpu;
+        pool->worker = worker;
+    }
+    for (uint8_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+        sched_enqueue_proc(cpu_var(worker_pool, cpu).worker);
+    }
+    return true;
+}
+
+void workqueue_stop_workers(void) {
+    for (uint8_t cpu = 0; cpu < acpi_get_number_cpus(); ++cpu) {
+        struct worker_pool * const pool = &cpu_var(worker_pool, cpu);
+        if (pool->worker) {
+            delete_proc(pool->worker);
+            pool->worker = NULL;
+        }
+        // The entry of the worker, if it was waiting, was on its stack.
+        wait_queue_init(&pool->wq);
+    }
+}
+
+#include <workqueue.test>
@@ -0,0 +1,90 @@
+#pragma once
+#include <list.h>
+#include <atomic.h>
+#include <wait_queue.h>
+
+// Workqueues.
+//     Interrupt handlers, remote calls and other contexts that cannot block
+// must be fast. Work that is too heavy for such contexts, or that is better
+// batched, can be deferred to a worker: each cpu has a pool with a queue of
+// work items and a kernel process, the worker, running the items of the queue
+// in process context, with interrupts and preemption enabled:
+//
+//      static void do_heavy_work(void * arg) { ... }
+//      static struct work w;
+//      work_init(&w, do_heavy_work, arg);
+//      ...
+//      queue_work(cpu, &w);
+//
+// A work item is embedded in the caller's data so that queuing work never
+// allocates. An item is queued at most once: queuing a pending item has no
+// effect, so that multiple requests for the same work are batched in a single
+// execution. An item can be re-queued, e.g. by its own function, as soon as it
+// started to execute.
+// The items of a pool are executed in the order they were queued, one at a
+// time. The worker of a pool is enqueued on the pool's cpu but, as any
+// process, might be migrated by the scheduler.
+struct work {
+    // The node in the queue of the pool.
+    struct list_node node;
+    // The function to execute and its argument.
+    void (*func)(void*);
+    void * arg;
+    // Non-zero while the item is queued and did not start to execute.
+    atomic_t pending;
+    // The cpu of the pool the item was last queued on.
+    uint8_t cpu;
+};
+
+// Initialize a work item.
+// @param work: The item to initialize.
+// @param func: The function to execute.
+// @param arg: The argument to pass to `func`.
+void work_init(struct work * const work,
+               void (*func)(void*),
+               void * const arg);
+
+// Queue a work item in the pool of a cpu. This can be called from any context,
+// including interrupt handlers.
+// @param cpu: The cpu of the pool.
+// @param work: The item to queue.
+// @return: true if the item was queued, false if it was already pending.
+bool queue_work(uint8_t const cpu, struct work * const work);
+
+// Remove a pending work item from its pool. This does not wait for the item if
+// it is being executed.
+// @param work: The item to remove.
+// @return: true if the item was pending, false otherwise.
+bool cancel_work(struct work * const work);
+
+// Check if a work item is pending.
+// @param work: The item.
+// @return: true if the item has been queued and did not start to execute yet.
+bool work_pending(struct work const * const work);
+
+// Wait until all the work items queued in the pool of a cpu before this call
+// have been executed. This blocks if possible, otherwise busy-waits, and never
+// returns if the workers are not running.
+// @param cpu: The cpu of the pool.
+void flush_workqueue(uint8_t const cpu);
+
+// Check if the worker of a cpu has been started.
+// @param cpu: The cpu.
+// @return: true if work queued on `cpu` will be executed by its worker.
+bool workqueue_has_worker(uint8_t const cpu);
+
+// Initialize the pools of all the cpus. The workers are not created yet.
+void init_workqueues(void);
+
+// Create the worker of each cpu and enqueue it in the scheduler. This must be
+// called after sched_init(). Work queued before this call is kept and executed
+// once the workers run.
+// @return: true on success, false if a worker could not be created.
+bool workqueue_start_workers(void);
+
+// Delete the workers. This must only be called once the scheduler is stopped
+// on all cpus. Pending work items stay in their pools.
+void workqueue_stop_workers(void);
+
+// Execute the tests of the workqueues.
+void workqueue_test(void);
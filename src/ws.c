@@ -0,0 +1,212 @@
+#include <sched.h>
+#include <debug.h>
+#include <acpi.h>
+#include <topology.h>
+
+// The "Work Stealing" scheduler (WS).
+// The WS scheduler keeps one runqueue per cpu, each protected by its own lock,
+// so that cpus do not contend on a global lock on every tick and context
+// switch:
+//  - A process is enqueued on the runqueue of the cpu it last ran on, to keep
+//  its cache state warm, unless the current cpu has a shorter runqueue in
+//  which case it is enqueued on the current cpu (affine wake-up).
+//  - A process put back after running on a cpu is enqueued on this cpu's
+//  runqueue.
+//  - A cpu with an empty runqueue steals a process from the closest non-empty
+//  runqueue in the topology (SMT siblings first, then cpus sharing the last
+//  level cache, then the package, then the rest of the system), the busiest
+//  one if several are at the same distance. This keeps stolen processes near
+//  their cache state. The process is taken from the tail of the victim's
+//  runqueue, as this is the one the victim would run last.
+// Within a runqueue, processes are scheduled in a round-robin fashion.
+
+// The runqueue of a cpu.
+struct ws_runqueue {
+    // Lock protecting the runqueue. When a cpu needs to lock another cpu's
+    // runqueue, it must not hold its own.
+    spinlock_t lock;
+    // The processes enqueued in this runqueue, linked through their rq field.
+    // Its length can be read without holding the lock to get an estimate of
+    // the load of the runqueue.
+    struct counted_list queue;
+};
+
+DECLARE_PER_CPU(struct ws_runqueue, ws_runqueue);
+
+// Get the runqueue of a cpu.
+// @param cpu: The cpu.
+// @return: A pointer to the runqueue of `cpu`.
+static struct ws_runqueue *get_runqueue(uint8_t const cpu) {
+    return &cpu_var(ws_runqueue, cpu);
+}
+
+// Get the number of processes in the runqueue of a cpu. The lock of the runqueue
+// does not need to be held, in which case the result is only an estimate.
+// @param cpu: The cpu.
+// @return: The length of the runqueue of `cpu`.
+static uint32_t runqueue_len(uint8_t const cpu) {
+    return counted_list_size(&get_runqueue(cpu)->queue);
+}
+
+// Initialize the runqueues of all cpus.
+static void ws_sched_init(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+        struct ws_runqueue * const rq = get_runqueue(cpu);
+        spinlock_init(&rq->lock);
+        counted_list_init(&rq->queue);
+    }
+}
+
+// Add a process at the tail of a runqueue.
+// @param cpu: The cpu owning the runqueue.
+// @param proc: The process to enqueue.
+static void runqueue_add(uint8_t const cpu, struct proc * const proc) {
+    struct ws_runqueue * const rq = get_runqueue(cpu);
+    spinlock_lock(&rq->lock);
+    // proc->cpu indicates which runqueue the proc is in, this is used by
+    // ws_dequeue_proc().
+    ASSERT(!proc->on_rq);
+    proc->cpu = cpu;
+    counted_list_add_tail(&rq->queue, &proc->rq);
+    proc->on_rq = true;
+    spinlock_unlock(&rq->lock);
+}
+
+// Remove a process from a runqueue.
+// @param rq: The runqueue.
+// @param proc: The process to remove. Must be in `rq`.
+// Note: This function assumes the lock of the runqueue is held.
+static void runqueue_remove(struct ws_runqueue * const rq,
+                            struct proc * const proc) {
+    ASSERT(spinlock_is_held(&rq->lock));
+    ASSERT(proc->on_rq);
+    counted_list_del(&rq->queue, &proc->rq);
+    proc->on_rq = false;
+}
+
+// Enqueue a process.
+// @param proc: The process to enqueue.
+static void ws_enqueue_proc(struct proc * const proc) {
+    uint8_t const this_cpu = cpu_id();
+    uint8_t target = proc->cpu;
+    if (target >= acpi_get_number_cpus() ||
+        runqueue_len(target) > runqueue_len(this_cpu)) {
+        target = this_cpu;
+    }
+    runqueue_add(target, proc);
+}
+
+// Dequeue a process.
+// @param proc: The process to dequeue.
+static void ws_dequeue_proc(struct proc * const proc) {
+    // The process might be stolen by another cpu between the time we read
+    // proc->cpu and the time we acquire the lock. Retry until the lock of the
+    // runqueue containing the process is held.
+    while (true) {
+        uint8_t const cpu = proc->cpu;
+        struct ws_runqueue * const rq = get_runqueue(cpu);
+        spinlock_lock(&rq->lock);
+        if (proc->cpu == cpu) {
+            runqueue_remove(rq, proc);
+            spinlock_unlock(&rq->lock);
+            return;
+        }
+        spinlock_unlock(&rq->lock);
+    }
+}
+
+// Update the current process.
+static void ws_update_curr(void) {
+}
+
+// React to a scheduler tick.
+static void ws_tick(void) {
+    // As with the TS scheduler, perform one context switch per tick.
+    sched_resched();
+}
+
+// Take a process out of a runqueue.
+// @param cpu: The cpu owning the runqueue.
+// @param from_tail: If true, take the last process of the runqueue, otherwise
+// the first one.
+// @return: The process taken out of the runqueue, NO_PROC if it was empty.
+static struct proc *runqueue_pop(uint8_t const cpu, bool const from_tail) {
+    struct ws_runqueue * const rq = get_runqueue(cpu);
+    struct proc * proc = NO_PROC;
+
+    spinlock_lock(&rq->lock);
+    if (!counted_list_empty(&rq->queue)) {
+        proc = from_tail ? list_last_entry(&rq->queue.head, struct proc, rq) :
+            list_first_entry(&rq->queue.head, struct proc, rq);
+        runqueue_remove(rq, proc);
+    }
+    spinlock_unlock(&rq->lock);
+    return proc;
+}
+
+// Steal a process from the closest non-empty runqueue in the topology, the
+// busiest among the closest.
+// @return: The stolen process, NO_PROC if all runqueues are empty.
+static struct proc *steal_proc(void) {
+    uint8_t const ncpus = acpi_get_number_cpus();
+    uint8_t const this_cpu = cpu_id();
+
+    // The lengths are read without locking, hence the victim's runqueue might
+    // be empty by the time we lock it. In this case try again with the new
+    // victim.
+    while (true) {
+        uint8_t busiest = this_cpu;
+        uint32_t busiest_len = 0;
+        enum topology_level busiest_dist = TOPOLOGY_SYSTEM;
+        for (uint8_t cpu = 0; cpu < ncpus; ++cpu) {
+            uint32_t const len = runqueue_len(cpu);
+            if (cpu == this_cpu || !len) {
+                continue;
+            }
+            enum topology_level const dist = topology_distance(this_cpu, cpu);
+            if (!busiest_len || dist < busiest_dist ||
+                (dist == busiest_dist && len > busiest_len)) {
+                busiest = cpu;
+                busiest_len = len;
+                busiest_dist = dist;
+            }
+        }
+
+        if (!busiest_len) {
+            return NO_PROC;
+        }
+
+        struct proc * const proc = runqueue_pop(busiest, true);
+        if (proc != NO_PROC) {
+            return proc;
+        }
+    }
+}
+
+// Select the next process to be run on a cpu.
+// If no process is available, this function will return NO_PROC.
+// @return: The next process to run.
+static struct proc *ws_pick_next_proc(void) {
+    struct proc * const next = runqueue_pop(cpu_id(), false);
+    return (next != NO_PROC) ? next : steal_proc();
+}
+
+// Put back the process that was running on the current cpu.
+// @param proc: The process.
+static void ws_put_prev_proc(struct proc * const proc) {
+    // The process just ran on this cpu, keep it there.
+    runqueue_add(cpu_id(), proc);
+}
+
+struct sched ws_sched = {
+    .sched_init          = ws_sched_init,
+    .enqueue_proc        = ws_enqueue_proc,
+    .dequeue_proc        = ws_dequeue_proc,
+    .update_curr         = ws_update_curr,
+    .tick                = ws_tick,
+    .pick_next_proc      = ws_pick_next_proc,
+    .put_prev_proc       = ws_put_prev_proc,
+};
+
+#include <ws.test>